@@ -0,0 +1,865 @@
+﻿#include "stdafx.h"
+#include "Animation.h"
+#include "AnimationGraph.h"
+#include "FrameAllocator.h"
+#include "Log.h"
+#include "Profiler.h"
+#include <emmintrin.h>
+//=============================================================================
+namespace
+{
+	inline __m128 load(const glm::vec4& value) { return _mm_load_ps(&value.x); }
+	inline void store(glm::vec4& value, __m128 data) { _mm_store_ps(&value.x, data); }
+	inline __m128 lerp(__m128 a, __m128 b, __m128 weight) { return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), weight)); }
+
+	inline __m128 select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+	// Нормализованный lerp четверок кватернионов, вес у каждой дорожки свой.
+	// q и -q - одно вращение; вращения из разных полусфер смешиваются через -b, иначе lerp идет по длинной дуге
+	inline void nlerp(const __m128 a[4], const __m128 b[4], __m128 weight, __m128 output[4])
+	{
+		const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_add_ps(_mm_mul_ps(a[2], b[2]), _mm_mul_ps(a[3], b[3])));
+		const __m128 sign = _mm_and_ps(dot, _mm_set1_ps(-0.0f));
+
+		__m128 result[4];
+		for (int i = 0; i < 4; i++)
+			result[i] = lerp(a[i], _mm_xor_ps(b[i], sign), weight);
+		const __m128 lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(result[0], result[0]), _mm_mul_ps(result[1], result[1])),
+			_mm_add_ps(_mm_mul_ps(result[2], result[2]), _mm_mul_ps(result[3], result[3])));
+		const __m128 inverseLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(lengthSq));
+		for (int i = 0; i < 4; i++)
+			output[i] = _mm_mul_ps(result[i], inverseLength);
+	}
+
+	inline void storeSoa(SoaTransform& output, const __m128 rotation[4], const __m128 translation[3], const __m128 scale[3])
+	{
+		store(output.rotationX, rotation[0]);
+		store(output.rotationY, rotation[1]);
+		store(output.rotationZ, rotation[2]);
+		store(output.rotationW, rotation[3]);
+		store(output.translationX, translation[0]);
+		store(output.translationY, translation[1]);
+		store(output.translationZ, translation[2]);
+		store(output.scaleX, scale[0]);
+		store(output.scaleY, scale[1]);
+		store(output.scaleZ, scale[2]);
+	}
+
+	// Смешивание четверки суставов; общий шаг выборки кадров клипа и смешивания поз
+	inline void blendSoa(const SoaTransform& a, const SoaTransform& b, __m128 weight, SoaTransform& output)
+	{
+		const __m128 ar[4] = { load(a.rotationX), load(a.rotationY), load(a.rotationZ), load(a.rotationW) };
+		const __m128 br[4] = { load(b.rotationX), load(b.rotationY), load(b.rotationZ), load(b.rotationW) };
+		__m128 rotation[4];
+		nlerp(ar, br, weight, rotation);
+
+		const __m128 translation[3] =
+		{
+			lerp(load(a.translationX), load(b.translationX), weight),
+			lerp(load(a.translationY), load(b.translationY), weight),
+			lerp(load(a.translationZ), load(b.translationZ), weight),
+		};
+		const __m128 scale[3] =
+		{
+			lerp(load(a.scaleX), load(b.scaleX), weight),
+			lerp(load(a.scaleY), load(b.scaleY), weight),
+			lerp(load(a.scaleZ), load(b.scaleZ), weight),
+		};
+
+		// запись после всех чтений: output может совпадать с a или b
+		storeSoa(output, rotation, translation, scale);
+	}
+
+	constexpr float SmallestThreeRange = 0.70710678f; // без наибольшей по модулю компоненты остальные не больше 1/sqrt(2)
+	constexpr float SmallestThreeMax = 32767.0f;       // 15 бит на компоненту вращения
+	constexpr float RangeMax = 65535.0f;               // 16 бит на компоненту переноса и масштаба
+
+	// Вращение в 48 бит: три компоненты по 15 бит, индекс отброшенной наибольшей - в старших битах первых двух слов.
+	// Знак кватерниона выбирается так, чтобы отброшенная была положительной: она восстанавливается из единичной длины
+	void encodeRotation(glm::quat rotation, uint16_t* output)
+	{
+		rotation = glm::normalize(rotation);
+		const float components[4] = { rotation.x, rotation.y, rotation.z, rotation.w };
+		int largest = 0;
+		for (int i = 1; i < 4; i++)
+		{
+			if (std::abs(components[i]) > std::abs(components[largest])) largest = i;
+		}
+
+		const float sign = components[largest] < 0.0f ? -1.0f : 1.0f;
+		for (int i = 0, slot = 0; i < 4; i++)
+		{
+			if (i == largest) continue;
+			const float normalized = (components[i] * sign + SmallestThreeRange) / (2.0f * SmallestThreeRange);
+			output[slot++] = (uint16_t)std::clamp(std::lround(normalized * SmallestThreeMax), 0l, (long)SmallestThreeMax);
+		}
+		output[0] |= uint16_t((largest & 1) << 15);
+		output[1] |= uint16_t((largest >> 1) << 15);
+	}
+
+	// Скалярный двойник decodeRotations для оценки ошибки при сжатии
+	glm::quat decodeRotation(const uint16_t* values)
+	{
+		const int largest = (values[0] >> 15) | ((values[1] >> 15) << 1);
+		float small[3];
+		for (int i = 0; i < 3; i++)
+			small[i] = float(values[i] & 0x7FFF) * (2.0f * SmallestThreeRange / SmallestThreeMax) - SmallestThreeRange;
+		const float restored = std::sqrt(std::max(0.0f, 1.0f - small[0] * small[0] - small[1] * small[1] - small[2] * small[2]));
+
+		float components[4];
+		for (int i = 0, slot = 0; i < 4; i++)
+			components[i] = i == largest ? restored : small[slot++];
+		return glm::quat(components[3], components[0], components[1], components[2]);
+	}
+
+	// Ключи четырех дорожек в три вектора компонент. Ключ читается одной 64-битной загрузкой с лишним словом,
+	// за последним ключом клипа для этого есть слово запаса
+	inline void gatherKeys(const uint16_t* const keys[4], __m128i output[3])
+	{
+		const __m128i k01 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)keys[0]), _mm_loadl_epi64((const __m128i*)keys[1]));
+		const __m128i k23 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)keys[2]), _mm_loadl_epi64((const __m128i*)keys[3]));
+		const __m128i ab = _mm_unpacklo_epi32(k01, k23);
+		const __m128i c = _mm_unpackhi_epi32(k01, k23);
+		const __m128i zero = _mm_setzero_si128();
+		output[0] = _mm_unpacklo_epi16(ab, zero);
+		output[1] = _mm_unpackhi_epi16(ab, zero);
+		output[2] = _mm_unpacklo_epi16(c, zero);
+	}
+
+	// Четыре ключа вращения в SoA: компоненты из 15 бит во float, отброшенная - из единичной длины,
+	// по местам они расставляются масками индекса, без ветвлений по дорожкам
+	inline void decodeRotations(const uint16_t* const keys[4], __m128 output[4])
+	{
+		__m128i values[3];
+		gatherKeys(keys, values);
+		const __m128i index = _mm_or_si128(_mm_srli_epi32(values[0], 15), _mm_slli_epi32(_mm_srli_epi32(values[1], 15), 1));
+
+		const __m128i mask = _mm_set1_epi32(0x7FFF);
+		const __m128 scale = _mm_set1_ps(2.0f * SmallestThreeRange / SmallestThreeMax);
+		const __m128 offset = _mm_set1_ps(SmallestThreeRange);
+		const __m128 s0 = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(values[0], mask)), scale), offset);
+		const __m128 s1 = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(values[1], mask)), scale), offset);
+		const __m128 s2 = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(values[2]), scale), offset);
+		const __m128 lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s0, s0), _mm_mul_ps(s1, s1)), _mm_mul_ps(s2, s2));
+		const __m128 restored = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), lengthSq), _mm_setzero_ps()));
+
+		const __m128 is0 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_setzero_si128()));
+		const __m128 is1 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(1)));
+		const __m128 is2 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(2)));
+		const __m128 is3 = _mm_castsi128_ps(_mm_cmpeq_epi32(index, _mm_set1_epi32(3)));
+		output[0] = select(is0, restored, s0);
+		output[1] = select(is0, s0, select(is1, restored, s1));
+		output[2] = select(is2, restored, select(is3, s2, s1));
+		output[3] = select(is3, restored, s2);
+	}
+
+	// Четыре ключа переноса или масштаба: 16 бит в диапазоне своей дорожки
+	inline void decodeVectors(const uint16_t* const keys[4], const glm::vec4* min, const glm::vec4* step, __m128 output[3])
+	{
+		__m128i values[3];
+		gatherKeys(keys, values);
+		for (int i = 0; i < 3; i++)
+			output[i] = _mm_add_ps(load(min[i]), _mm_mul_ps(_mm_cvtepi32_ps(values[i]), load(step[i])));
+	}
+
+	constexpr uint32_t KeyMaskBits = 17; // кадры сегмента 0..SegmentFrames включительно
+	static_assert(AnimationClip::SegmentFrames + 1 == KeyMaskBits);
+
+	// Номер бита - экспонента его значения во float (значения меньше 2^24 переводятся точно)
+	inline __m128i bitIndex(__m128i bit)
+	{
+		return _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(bit)), 23), _mm_set1_epi32(127));
+	}
+
+	// Ключи четырех дорожек вокруг кадра local сегмента без поиска и ветвлений. Заголовок дорожки - маска кадров
+	// сегмента с ключами и номер ее первого ключа: номер ключа - число битов маски до кадра включительно,
+	// кадры соседних ключей - старший бит до кадра и младший после. После последнего ключа to = from и вес 0
+	inline __m128 findKeys(const uint16_t* headers, const uint16_t* keys, float local, const uint16_t* from[4], const uint16_t* to[4])
+	{
+		const __m128i header = _mm_loadu_si128((const __m128i*)headers);
+		const __m128i mask = _mm_and_si128(header, _mm_set1_epi32((1 << KeyMaskBits) - 1));
+		const __m128i upToFrame = _mm_set1_epi32((2 << (uint32_t)local) - 1);
+		const __m128i before = _mm_and_si128(mask, upToFrame); // бит кадра 0 есть всегда
+		const __m128i after = _mm_andnot_si128(upToFrame, mask);
+		const __m128i hasNext = _mm_cmpgt_epi32(after, _mm_setzero_si128());
+
+		__m128i count = _mm_sub_epi32(before, _mm_and_si128(_mm_srli_epi32(before, 1), _mm_set1_epi32(0x55555555)));
+		count = _mm_add_epi32(_mm_and_si128(count, _mm_set1_epi32(0x33333333)), _mm_and_si128(_mm_srli_epi32(count, 2), _mm_set1_epi32(0x33333333)));
+		count = _mm_and_si128(_mm_add_epi32(count, _mm_srli_epi32(count, 4)), _mm_set1_epi32(0x0F0F0F0F));
+		count = _mm_add_epi32(count, _mm_srli_epi32(count, 8));
+		count = _mm_and_si128(_mm_add_epi32(count, _mm_srli_epi32(count, 16)), _mm_set1_epi32(0x3F));
+
+		alignas(16) uint32_t fromKeys[4];
+		alignas(16) uint32_t toKeys[4];
+		const __m128i key = _mm_add_epi32(_mm_srli_epi32(header, KeyMaskBits), _mm_sub_epi32(count, _mm_set1_epi32(1)));
+		_mm_store_si128((__m128i*)fromKeys, key);
+		_mm_store_si128((__m128i*)toKeys, _mm_sub_epi32(key, hasNext));
+		for (int lane = 0; lane < 4; lane++)
+		{
+			from[lane] = keys + fromKeys[lane] * 3;
+			to[lane] = keys + toKeys[lane] * 3;
+		}
+
+		const __m128 fromFrame = _mm_cvtepi32_ps(bitIndex(before));
+		const __m128 toFrame = _mm_cvtepi32_ps(bitIndex(_mm_and_si128(after, _mm_sub_epi32(_mm_setzero_si128(), after))));
+		const __m128 weight = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(local), fromFrame), _mm_sub_ps(toFrame, fromFrame));
+		return _mm_and_ps(weight, _mm_castsi128_ps(hasNext));
+	}
+
+	// Ключи дорожки на кадрах [first, last]: крайние обязательны, между ними жадно - от ключа как можно дальше,
+	// пока fits(from, to, frame) держит пропущенные кадры в допуске. Постоянная в допуске дорожка - один ключ
+	template<typename Fits>
+	void reduceKeys(uint32_t first, uint32_t last, Fits&& fits, std::vector<uint32_t>& kept)
+	{
+		kept.assign(1, first);
+		bool constant = true;
+		for (uint32_t frame = first + 1; frame <= last && constant; frame++)
+			constant = fits(first, first, frame);
+		if (constant) return;
+
+		for (uint32_t from = first; from < last; )
+		{
+			uint32_t to = from + 1;
+			while (to < last)
+			{
+				bool all = true;
+				for (uint32_t frame = from + 1; frame <= to && all; frame++)
+					all = fits(from, to + 1, frame);
+				if (!all) break;
+				to++;
+			}
+			kept.push_back(to);
+			from = to;
+		}
+	}
+
+	glm::quat nlerpScalar(const glm::quat& a, glm::quat b, float weight)
+	{
+		if (glm::dot(a, b) < 0.0f) b = -b;
+		return glm::normalize(a + (b - a) * weight);
+	}
+
+	float rotationError(const glm::quat& a, const glm::quat& b)
+	{
+		return 2.0f * std::acos(std::min(1.0f, std::abs(glm::dot(a, b))));
+	}
+
+	// a * b по столбцам; output может совпадать с b, но не с a
+	inline void multiplyMatrices(const glm::mat4& a, const glm::mat4& b, __m128 output[4])
+	{
+		const __m128 a0 = _mm_loadu_ps(&a[0].x);
+		const __m128 a1 = _mm_loadu_ps(&a[1].x);
+		const __m128 a2 = _mm_loadu_ps(&a[2].x);
+		const __m128 a3 = _mm_loadu_ps(&a[3].x);
+		for (int column = 0; column < 4; column++)
+		{
+			const __m128 c = _mm_loadu_ps(&b[column].x);
+			const __m128 x = _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 0));
+			const __m128 y = _mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1));
+			const __m128 z = _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 2, 2));
+			const __m128 w = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3));
+			output[column] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, x), _mm_mul_ps(a1, y)), _mm_add_ps(_mm_mul_ps(a2, z), _mm_mul_ps(a3, w)));
+		}
+	}
+}
+//=============================================================================
+SoaTransform SoaTransform::Identity()
+{
+	SoaTransform transform;
+	transform.rotationX = transform.rotationY = transform.rotationZ = glm::vec4(0.0f);
+	transform.rotationW = glm::vec4(1.0f);
+	transform.translationX = transform.translationY = transform.translationZ = glm::vec4(0.0f);
+	transform.scaleX = transform.scaleY = transform.scaleZ = glm::vec4(1.0f);
+	return transform;
+}
+//=============================================================================
+void SoaTransform::SetJoint(uint32_t lane, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale)
+{
+	rotationX[lane] = rotation.x;
+	rotationY[lane] = rotation.y;
+	rotationZ[lane] = rotation.z;
+	rotationW[lane] = rotation.w;
+	translationX[lane] = translation.x;
+	translationY[lane] = translation.y;
+	translationZ[lane] = translation.z;
+	scaleX[lane] = scale.x;
+	scaleY[lane] = scale.y;
+	scaleZ[lane] = scale.z;
+}
+//=============================================================================
+void SoaTransform::GetJoint(uint32_t lane, glm::vec3& translation, glm::quat& rotation, glm::vec3& scale) const
+{
+	rotation = glm::quat(rotationW[lane], rotationX[lane], rotationY[lane], rotationZ[lane]);
+	translation = glm::vec3(translationX[lane], translationY[lane], translationZ[lane]);
+	scale = glm::vec3(scaleX[lane], scaleY[lane], scaleZ[lane]);
+}
+//=============================================================================
+uint32_t Skeleton::AddJoint(const std::string& name, int32_t parent, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale,
+	const glm::mat4& inverseBindMatrix)
+{
+	const uint32_t joint = GetJointCount();
+	assert(joint < MaxJoints);
+	assert(parent < (int32_t)joint);
+
+	m_names.push_back(name);
+	m_parents.push_back((int16_t)parent);
+	m_heights.push_back(0);
+	// предки поднимаются, пока новая цепочка длиннее их прежних
+	uint8_t height = 1;
+	for (int32_t ancestor = parent; ancestor >= 0 && m_heights[ancestor] < height; ancestor = m_parents[ancestor], height++)
+		m_heights[ancestor] = height;
+	m_inverseBindMatrices.push_back(inverseBindMatrix);
+	if (joint % 4 == 0) m_bindPose.push_back(SoaTransform::Identity());
+	m_bindPose.back().SetJoint(joint % 4, translation, rotation, scale);
+	return joint;
+}
+//=============================================================================
+int32_t Skeleton::FindJoint(const std::string& name) const
+{
+	for (size_t i = 0; i < m_names.size(); i++)
+	{
+		if (m_names[i] == name) return (int32_t)i;
+	}
+	return -1;
+}
+//=============================================================================
+AnimationClip::AnimationClip(std::string name, uint32_t soaCount, uint32_t frameCount, float frameRate)
+	: m_name(std::move(name))
+	, m_soaCount(soaCount)
+	, m_frameCount(std::max(frameCount, 1u))
+	, m_frameRate(frameRate)
+{
+	m_frames.resize(size_t(m_frameCount) * m_soaCount, SoaTransform::Identity());
+}
+//=============================================================================
+size_t AnimationClip::GetMemorySize() const
+{
+	return m_frames.size() * sizeof(SoaTransform) + m_ranges.size() * sizeof(SoaRange) + m_keys.size() * sizeof(uint16_t)
+		+ m_segmentOffsets.size() * sizeof(uint32_t);
+}
+//=============================================================================
+std::shared_ptr<AnimationClip> AnimationClip::Compress(const AnimationClip& clip, const ClipCompressionSettings& settings, ClipCompressionStatistics* statistics)
+{
+	PROFILE_FUNCTION();
+	assert(!clip.IsCompressed());
+
+	const uint32_t soaCount = clip.m_soaCount;
+	const uint32_t frameCount = clip.m_frameCount;
+	const uint32_t segmentCount = std::max(1u, (frameCount - 1 + SegmentFrames - 1) / SegmentFrames);
+
+	auto compressed = std::make_shared<AnimationClip>(clip.m_name, soaCount, 1, clip.m_frameRate);
+	compressed->m_frameCount = frameCount;
+	compressed->m_frames = {};
+	compressed->m_ranges.resize(size_t(soaCount) * 2);
+
+	std::vector<std::vector<uint16_t>> segmentHeaders(segmentCount);
+	std::vector<std::vector<uint16_t>> segmentKeys(segmentCount);
+	std::vector<uint32_t> kept;
+
+	// квантованные ключи дорожки на каждом кадре и их декодированные значения - по ним считается ошибка
+	std::vector<std::array<uint16_t, 3>> quantized(frameCount);
+	std::vector<glm::quat> rawRotations(frameCount), decodedRotations(frameCount);
+	std::vector<glm::vec3> rawVectors(frameCount), decodedVectors(frameCount);
+
+	// прореживает дорожку по сегментам; крайние кадры сегмента - ключи в обоих соседних сегментах
+	auto addTrack = [&](auto&& fits)
+	{
+		for (uint32_t segment = 0; segment < segmentCount; segment++)
+		{
+			const uint32_t first = segment * SegmentFrames;
+			const uint32_t last = std::min(first + SegmentFrames, frameCount - 1);
+			reduceKeys(first, last, fits, kept);
+
+			auto& keys = segmentKeys[segment];
+			uint32_t header = uint32_t(keys.size() / 3) << KeyMaskBits;
+			for (uint32_t frame : kept)
+			{
+				header |= 1u << (frame - first);
+				keys.insert(keys.end(), quantized[frame].begin(), quantized[frame].end());
+			}
+			segmentHeaders[segment].insert(segmentHeaders[segment].end(), { uint16_t(header & 0xFFFF), uint16_t(header >> 16) });
+		}
+	};
+	auto weightOf = [](uint32_t from, uint32_t to, uint32_t frame) { return to > from ? float(frame - from) / float(to - from) : 0.0f; };
+
+	for (uint32_t soa = 0; soa < soaCount; soa++)
+	{
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			for (uint32_t frame = 0; frame < frameCount; frame++)
+			{
+				const SoaTransform& transform = clip.GetFrame(frame)[soa];
+				rawRotations[frame] = glm::normalize(glm::quat(transform.rotationW[lane], transform.rotationX[lane], transform.rotationY[lane], transform.rotationZ[lane]));
+				encodeRotation(rawRotations[frame], quantized[frame].data());
+				decodedRotations[frame] = decodeRotation(quantized[frame].data());
+			}
+			addTrack([&](uint32_t from, uint32_t to, uint32_t frame)
+			{
+				const glm::quat value = nlerpScalar(decodedRotations[from], decodedRotations[to], weightOf(from, to, frame));
+				return rotationError(value, rawRotations[frame]) <= settings.rotationTolerance;
+			});
+		}
+
+		for (uint32_t kind = 0; kind < 2; kind++)
+		{
+			const bool translation = kind == 0;
+			const float tolerance = translation ? settings.translationTolerance : settings.scaleTolerance;
+			SoaRange& range = compressed->m_ranges[size_t(soa) * 2 + kind];
+			for (uint32_t lane = 0; lane < 4; lane++)
+			{
+				glm::vec3 min(std::numeric_limits<float>::max());
+				glm::vec3 max(-std::numeric_limits<float>::max());
+				for (uint32_t frame = 0; frame < frameCount; frame++)
+				{
+					const SoaTransform& transform = clip.GetFrame(frame)[soa];
+					rawVectors[frame] = translation
+						? glm::vec3(transform.translationX[lane], transform.translationY[lane], transform.translationZ[lane])
+						: glm::vec3(transform.scaleX[lane], transform.scaleY[lane], transform.scaleZ[lane]);
+					min = glm::min(min, rawVectors[frame]);
+					max = glm::max(max, rawVectors[frame]);
+				}
+
+				const glm::vec3 step = (max - min) / RangeMax;
+				for (int i = 0; i < 3; i++)
+				{
+					range.min[i][lane] = min[i];
+					range.step[i][lane] = step[i];
+				}
+				for (uint32_t frame = 0; frame < frameCount; frame++)
+				{
+					for (int i = 0; i < 3; i++)
+					{
+						const float normalized = step[i] > 0.0f ? (rawVectors[frame][i] - min[i]) / step[i] : 0.0f;
+						quantized[frame][i] = (uint16_t)std::clamp(std::lround(normalized), 0l, (long)RangeMax);
+					}
+					decodedVectors[frame] = min + glm::vec3(quantized[frame][0], quantized[frame][1], quantized[frame][2]) * step;
+				}
+				addTrack([&](uint32_t from, uint32_t to, uint32_t frame)
+				{
+					const glm::vec3 value = glm::mix(decodedVectors[from], decodedVectors[to], weightOf(from, to, frame));
+					return glm::length(value - rawVectors[frame]) <= tolerance;
+				});
+			}
+		}
+	}
+
+	// сегменты подряд: заголовки дорожек, затем их ключи
+	uint32_t keyCount = 0;
+	for (uint32_t segment = 0; segment < segmentCount; segment++)
+	{
+		const auto& headers = segmentHeaders[segment];
+		const auto& keys = segmentKeys[segment];
+		assert(keys.size() / 3 < (1u << (32 - KeyMaskBits)));
+		keyCount += uint32_t(keys.size() / 3);
+
+		compressed->m_segmentOffsets.push_back((uint32_t)compressed->m_keys.size());
+		compressed->m_keys.insert(compressed->m_keys.end(), headers.begin(), headers.end());
+		compressed->m_keys.insert(compressed->m_keys.end(), keys.begin(), keys.end());
+	}
+	compressed->m_keys.push_back(0); // запас для 64-битной загрузки последнего ключа
+
+	if (statistics)
+	{
+		*statistics = {};
+		statistics->rawBytes = clip.GetMemorySize();
+		statistics->compressedBytes = compressed->GetMemorySize();
+		statistics->rawKeys = soaCount * TracksPerSoa * frameCount;
+		statistics->keys = keyCount;
+
+		// ошибка - как ее увидит аниматор: выборка сжатого клипа ровно на кадрах исходного
+		std::vector<SoaTransform> pose(soaCount);
+		for (uint32_t frame = 0; frame < frameCount; frame++)
+		{
+			compressed->sampleCompressed((float)frame, pose.data());
+			for (uint32_t soa = 0; soa < soaCount; soa++)
+			{
+				for (uint32_t lane = 0; lane < 4; lane++)
+				{
+					glm::vec3 rawTranslation, translation, rawScale, scale;
+					glm::quat rawRotation, rotation;
+					clip.GetFrame(frame)[soa].GetJoint(lane, rawTranslation, rawRotation, rawScale);
+					pose[soa].GetJoint(lane, translation, rotation, scale);
+					statistics->maxRotationError = std::max(statistics->maxRotationError, rotationError(rotation, glm::normalize(rawRotation)));
+					statistics->maxTranslationError = std::max(statistics->maxTranslationError, glm::length(translation - rawTranslation));
+					statistics->maxScaleError = std::max(statistics->maxScaleError, glm::length(scale - rawScale));
+				}
+			}
+		}
+	}
+	return compressed;
+}
+//=============================================================================
+void AnimationClip::Sample(float time, bool loop, SoaTransform* output) const
+{
+	const float duration = GetDuration();
+	float framePosition = 0.0f;
+	if (m_frameCount >= 2 && duration > 0.0f)
+	{
+		if (loop)
+		{
+			time = std::fmod(time, duration);
+			if (time < 0.0f) time += duration;
+		}
+		else
+		{
+			time = std::clamp(time, 0.0f, duration);
+		}
+		framePosition = time * m_frameRate;
+	}
+
+	if (IsCompressed())
+	{
+		sampleCompressed(framePosition, output);
+		return;
+	}
+	if (m_frameCount < 2)
+	{
+		std::copy_n(GetFrame(0), m_soaCount, output);
+		return;
+	}
+
+	const uint32_t frame = std::min((uint32_t)framePosition, m_frameCount - 2);
+	animation::BlendPoses(GetFrame(frame), GetFrame(frame + 1), framePosition - (float)frame, m_soaCount, output);
+}
+//=============================================================================
+void AnimationClip::sampleCompressed(float framePosition, SoaTransform* output) const
+{
+	const uint32_t segment = std::min((uint32_t)framePosition / SegmentFrames, (uint32_t)m_segmentOffsets.size() - 1);
+	const float local = framePosition - float(segment * SegmentFrames);
+	const uint16_t* headers = m_keys.data() + m_segmentOffsets[segment];
+	const uint16_t* keys = headers + m_soaCount * TracksPerSoa * 2;
+
+	const uint16_t* from[4];
+	const uint16_t* to[4];
+	for (uint32_t soa = 0; soa < m_soaCount; soa++)
+	{
+		const uint16_t* trackHeaders = headers + soa * TracksPerSoa * 2;
+		const SoaRange& translationRange = m_ranges[size_t(soa) * 2];
+		const SoaRange& scaleRange = m_ranges[size_t(soa) * 2 + 1];
+		__m128 a[4], b[4], rotation[4], translation[3], scale[3];
+
+		__m128 weight = findKeys(trackHeaders, keys, local, from, to);
+		decodeRotations(from, a);
+		decodeRotations(to, b);
+		nlerp(a, b, weight, rotation);
+
+		weight = findKeys(trackHeaders + 8, keys, local, from, to);
+		decodeVectors(from, translationRange.min, translationRange.step, a);
+		decodeVectors(to, translationRange.min, translationRange.step, b);
+		for (int i = 0; i < 3; i++)
+			translation[i] = lerp(a[i], b[i], weight);
+
+		weight = findKeys(trackHeaders + 16, keys, local, from, to);
+		decodeVectors(from, scaleRange.min, scaleRange.step, a);
+		decodeVectors(to, scaleRange.min, scaleRange.step, b);
+		for (int i = 0; i < 3; i++)
+			scale[i] = lerp(a[i], b[i], weight);
+
+		storeSoa(output[soa], rotation, translation, scale);
+	}
+}
+//=============================================================================
+void animation::BlendPoses(const SoaTransform* a, const SoaTransform* b, float weight, uint32_t soaCount, SoaTransform* output)
+{
+	const __m128 weight4 = _mm_set1_ps(weight);
+	for (uint32_t i = 0; i < soaCount; i++)
+		blendSoa(a[i], b[i], weight4, output[i]);
+}
+//=============================================================================
+void animation::BlendPosesMasked(const SoaTransform* a, const SoaTransform* b, const glm::vec4* mask, float weight, uint32_t soaCount, SoaTransform* output)
+{
+	const __m128 weight4 = _mm_set1_ps(weight);
+	for (uint32_t i = 0; i < soaCount; i++)
+		blendSoa(a[i], b[i], _mm_mul_ps(load(mask[i]), weight4), output[i]);
+}
+//=============================================================================
+void animation::LocalToModel(const Skeleton& skeleton, const SoaTransform* local, glm::mat4* model, uint32_t leafDepth)
+{
+	const uint32_t jointCount = skeleton.GetJointCount();
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	// локальные матрицы четверками суставов: кватернион в поворот, масштаб по столбцам, затем транспонирование в AoS
+	for (uint32_t soa = 0; soa < skeleton.GetSoaCount(); soa++)
+	{
+		const SoaTransform& transform = local[soa];
+		const __m128 x = load(transform.rotationX), y = load(transform.rotationY), z = load(transform.rotationZ), w = load(transform.rotationW);
+		const __m128 x2 = _mm_add_ps(x, x), y2 = _mm_add_ps(y, y), z2 = _mm_add_ps(z, z);
+		const __m128 xx = _mm_mul_ps(x, x2), yy = _mm_mul_ps(y, y2), zz = _mm_mul_ps(z, z2);
+		const __m128 xy = _mm_mul_ps(x, y2), xz = _mm_mul_ps(x, z2), yz = _mm_mul_ps(y, z2);
+		const __m128 wx = _mm_mul_ps(w, x2), wy = _mm_mul_ps(w, y2), wz = _mm_mul_ps(w, z2);
+		const __m128 sx = load(transform.scaleX), sy = load(transform.scaleY), sz = load(transform.scaleZ);
+
+		__m128 columns[4][4] =
+		{
+			{ _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx), _mm_mul_ps(_mm_add_ps(xy, wz), sx), _mm_mul_ps(_mm_sub_ps(xz, wy), sx), zero },
+			{ _mm_mul_ps(_mm_sub_ps(xy, wz), sy), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy), _mm_mul_ps(_mm_add_ps(yz, wx), sy), zero },
+			{ _mm_mul_ps(_mm_add_ps(xz, wy), sz), _mm_mul_ps(_mm_sub_ps(yz, wx), sz), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz), zero },
+			{ load(transform.translationX), load(transform.translationY), load(transform.translationZ), one },
+		};
+		for (auto& column : columns)
+			_MM_TRANSPOSE4_PS(column[0], column[1], column[2], column[3]);
+
+		const uint32_t lanes = std::min(4u, jointCount - soa * 4);
+		for (uint32_t lane = 0; lane < lanes; lane++)
+		{
+			glm::mat4& matrix = model[soa * 4 + lane];
+			for (int column = 0; column < 4; column++)
+				_mm_storeu_ps(&matrix[column].x, columns[column][lane]);
+		}
+	}
+
+	// родитель идет раньше потомка и к его очереди уже в системе модели
+	const int16_t* parents = skeleton.GetParents();
+	const uint8_t* heights = skeleton.GetJointHeights();
+	for (uint32_t joint = 0; joint < jointCount; joint++)
+	{
+		if (parents[joint] < 0 || heights[joint] < leafDepth) continue;
+		__m128 result[4];
+		multiplyMatrices(model[parents[joint]], model[joint], result);
+		for (int column = 0; column < 4; column++)
+			_mm_storeu_ps(&model[joint][column].x, result[column]);
+	}
+}
+//=============================================================================
+void animation::BuildSkinPalette(const Skeleton& skeleton, const glm::mat4* model, SkinMatrix* palette, uint32_t leafDepth)
+{
+	const glm::mat4* inverseBindMatrices = skeleton.GetInverseBindMatrices();
+	const int16_t* parents = skeleton.GetParents();
+	const uint8_t* heights = skeleton.GetJointHeights();
+	for (uint32_t joint = 0; joint < skeleton.GetJointCount(); joint++)
+	{
+		// высота родителя больше, поэтому его матрица уже посчитана или тоже скопирована
+		if (heights[joint] < leafDepth && parents[joint] >= 0)
+		{
+			palette[joint] = palette[parents[joint]];
+			continue;
+		}
+		__m128 matrix[4];
+		multiplyMatrices(model[joint], inverseBindMatrices[joint], matrix);
+		// после транспонирования столбцы - строки, нижняя строка аффинной матрицы не нужна
+		_MM_TRANSPOSE4_PS(matrix[0], matrix[1], matrix[2], matrix[3]);
+		_mm_storeu_ps(&palette[joint].rows[0].x, matrix[0]);
+		_mm_storeu_ps(&palette[joint].rows[1].x, matrix[1]);
+		_mm_storeu_ps(&palette[joint].rows[2].x, matrix[2]);
+	}
+}
+//=============================================================================
+void animation::BlendPalettes(const SkinMatrix* a, const SkinMatrix* b, float weight, uint32_t count, SkinMatrix* output)
+{
+	const __m128 weight4 = _mm_set1_ps(weight);
+	for (uint32_t joint = 0; joint < count; joint++)
+	{
+		for (int row = 0; row < 3; row++)
+		{
+			const __m128 from = _mm_loadu_ps(&a[joint].rows[row].x);
+			const __m128 to = _mm_loadu_ps(&b[joint].rows[row].x);
+			_mm_storeu_ps(&output[joint].rows[row].x, _mm_add_ps(from, _mm_mul_ps(_mm_sub_ps(to, from), weight4)));
+		}
+	}
+}
+//=============================================================================
+void animation::RunCompressionBenchmark(const AnimationClip& clip, const ClipCompressionSettings& settings)
+{
+	using Clock = std::chrono::steady_clock;
+	auto nanosecondsPer = [](Clock::time_point start, uint64_t count)
+	{
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (double)count;
+	};
+
+	constexpr uint32_t Samples = 20000;
+	constexpr uint32_t ClipCopies = 256; // рабочий набор сотни клипов: несжатые не помещаются в кэш
+	const uint32_t joints = clip.GetSoaCount() * 4;
+
+	ClipCompressionStatistics statistics;
+	const auto compressStart = Clock::now();
+	const std::shared_ptr<const AnimationClip> compressed = AnimationClip::Compress(clip, settings, &statistics);
+	LOG_INFO(Benchmark, "Animation compression benchmark, clip '{}': {} joints, {} frames", clip.GetName(), joints, clip.GetFrameCount());
+	LOG_INFO(Benchmark, "  compression:        {:.2f} ms", nanosecondsPer(compressStart, 1) / 1e6);
+	LOG_INFO(Benchmark, "  size:               {:.1f} KB -> {:.1f} KB ({:.1f}x), keys {} of {}", statistics.rawBytes / 1024.0,
+		statistics.compressedBytes / 1024.0, (double)statistics.rawBytes / (double)statistics.compressedBytes, statistics.keys, statistics.rawKeys);
+	LOG_INFO(Benchmark, "  max error:          {:.4f} deg, translation {:.5f}, scale {:.5f}", glm::degrees(statistics.maxRotationError),
+		statistics.maxTranslationError, statistics.maxScaleError);
+
+	std::vector<float> times(Samples);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> distribution(0.0f, clip.GetDuration());
+	for (float& time : times) time = distribution(random);
+
+	std::vector<SoaTransform> pose(clip.GetSoaCount());
+	float checksum = 0.0f;
+	auto sample = [&](const std::vector<const AnimationClip*>& clips, bool sequential)
+	{
+		const auto start = Clock::now();
+		for (uint32_t i = 0; i < Samples; i++)
+		{
+			const float time = sequential ? (float)i / 60.0f : times[i];
+			clips[i % clips.size()]->Sample(time, true, pose.data());
+			checksum += pose[0].rotationW.x;
+		}
+		return nanosecondsPer(start, Samples) / joints;
+	};
+
+	std::vector<AnimationClip> rawCopies(ClipCopies, clip);
+	std::vector<AnimationClip> compressedCopies(ClipCopies, *compressed);
+	std::vector<const AnimationClip*> rawOne{ &clip }, compressedOne{ compressed.get() }, rawMany, compressedMany;
+	for (uint32_t i = 0; i < ClipCopies; i++)
+	{
+		rawMany.push_back(&rawCopies[i]);
+		compressedMany.push_back(&compressedCopies[i]);
+	}
+
+	// один клип в кэше: цена декодирования против чтения двух кадров
+	LOG_INFO(Benchmark, "  playback, 1 clip:   raw {:.2f} ns/joint, compressed {:.2f} ns/joint", sample(rawOne, true), sample(compressedOne, true));
+	LOG_INFO(Benchmark, "  random, 1 clip:     raw {:.2f} ns/joint, compressed {:.2f} ns/joint", sample(rawOne, false), sample(compressedOne, false));
+	// клипы по очереди: каждая выборка читает память, вытесненную предыдущими
+	LOG_INFO(Benchmark, "  random, {} clips: raw {:.2f} ns/joint, compressed {:.2f} ns/joint", ClipCopies, sample(rawMany, false), sample(compressedMany, false));
+	LOG_VERBOSE(Benchmark, "  checksum {}", checksum);
+}
+//=============================================================================
+Animator::Animator(std::shared_ptr<const Skeleton> skeleton)
+	: m_skeleton(std::move(skeleton))
+{
+	assert(m_skeleton);
+	// соседние аниматоры вычисляют позы реже кадра в разные кадры
+	static std::atomic<uint32_t> nextPhase{ 0 };
+	m_lodPhase = nextPhase++;
+}
+//=============================================================================
+Animator::~Animator() = default;
+//=============================================================================
+void Animator::SetGraph(std::shared_ptr<const AnimationGraph> graph)
+{
+	assert(!graph || graph->GetSkeleton().GetSoaCount() == m_skeleton->GetSoaCount());
+	m_graph = graph ? std::make_unique<AnimationGraphInstance>(std::move(graph)) : nullptr;
+}
+//=============================================================================
+void Animator::Play(std::shared_ptr<const AnimationClip> clip, float fadeDuration, bool loop)
+{
+	assert(!clip || clip->GetSoaCount() == m_skeleton->GetSoaCount());
+
+	if (fadeDuration > 0.0f && m_current.clip)
+	{
+		m_fading = m_current;
+		m_fadeDuration = fadeDuration;
+		m_fadeTime = m_previousFadeTime = 0.0f;
+	}
+	else
+	{
+		m_fading.clip.reset();
+	}
+	m_current = { std::move(clip), 0.0f, 0.0f, loop };
+}
+//=============================================================================
+void Animator::Advance(float deltaTime)
+{
+	const float step = deltaTime * m_speed;
+	if (m_graph)
+	{
+		m_graph->Advance(step);
+		return;
+	}
+	advanceTrack(m_current, step);
+
+	if (!m_fading.clip) return;
+	// затухший клип снимается, когда и предыдущий тик целиком в новом клипе
+	if (m_previousFadeTime >= m_fadeDuration)
+	{
+		m_fading.clip.reset();
+		return;
+	}
+	advanceTrack(m_fading, step);
+	m_previousFadeTime = m_fadeTime;
+	m_fadeTime = std::min(m_fadeTime + deltaTime, m_fadeDuration);
+}
+//=============================================================================
+void Animator::Evaluate(float alpha, SkinMatrix* palette) const
+{
+	evaluate(alpha, AnimationLod{}, palette);
+}
+//=============================================================================
+bool Animator::Evaluate(float alpha, const AnimationLod& lod, uint64_t frameIndex, SkinMatrix* palette)
+{
+	const bool continued = m_lodValid && frameIndex == m_lodLastFrame + 1;
+	m_lodLastFrame = frameIndex;
+	if (lod.interval <= 1)
+	{
+		m_lodValid = false;
+		evaluate(alpha, lod, palette);
+		return true;
+	}
+
+	const uint32_t jointCount = m_skeleton->GetJointCount();
+	if (m_lodPalettes.empty()) m_lodPalettes.resize(size_t(jointCount) * 2);
+	SkinMatrix* earlier = m_lodPalettes.data();
+	SkinMatrix* later = earlier + jointCount;
+
+	bool evaluated = true;
+	if (!continued)
+	{
+		// персонаж только что стал видимым или перешел с полной частоты: обе палитры - текущая поза,
+		// а отсчет интервала сдвинут на фазу аниматора, чтобы вычисления не собирались в один кадр
+		evaluate(alpha, lod, later);
+		std::copy_n(later, jointCount, earlier);
+		m_lodKeyFrame = frameIndex - std::min<uint64_t>(frameIndex, m_lodPhase % lod.interval);
+		m_lodValid = true;
+	}
+	else if (frameIndex - m_lodKeyFrame >= lod.interval)
+	{
+		std::copy_n(later, jointCount, earlier);
+		evaluate(alpha, lod, later);
+		m_lodKeyFrame = frameIndex;
+	}
+	else
+		evaluated = false;
+
+	const float weight = std::min(float(frameIndex - m_lodKeyFrame) / float(lod.interval), 1.0f);
+	animation::BlendPalettes(earlier, later, weight, jointCount, palette);
+	return evaluated;
+}
+//=============================================================================
+void Animator::evaluate(float alpha, const AnimationLod& lod, SkinMatrix* palette) const
+{
+	const Skeleton& skeleton = *m_skeleton;
+	const uint32_t soaCount = skeleton.GetSoaCount();
+
+	ArenaVector<SoaTransform> pose(framemem::GetThreadAllocator<SoaTransform>());
+	pose.resize(soaCount);
+	if (m_graph)
+		m_graph->Evaluate(alpha, pose.data(), lod.blending);
+	else if (m_current.clip)
+		m_current.clip->Sample(glm::mix(m_current.previousTime, m_current.time, alpha), m_current.loop, pose.data());
+	else
+		std::copy_n(skeleton.GetBindPose(), soaCount, pose.data());
+
+	if (m_fading.clip && !m_graph && lod.blending)
+	{
+		ArenaVector<SoaTransform> fadingPose(framemem::GetThreadAllocator<SoaTransform>());
+		fadingPose.resize(soaCount);
+		m_fading.clip->Sample(glm::mix(m_fading.previousTime, m_fading.time, alpha), m_fading.loop, fadingPose.data());
+		const float weight = glm::clamp(glm::mix(m_previousFadeTime, m_fadeTime, alpha) / m_fadeDuration, 0.0f, 1.0f);
+		animation::BlendPoses(fadingPose.data(), pose.data(), weight, soaCount, pose.data());
+	}
+
+	ArenaVector<glm::mat4> model(framemem::GetThreadAllocator<glm::mat4>());
+	model.resize(skeleton.GetJointCount());
+	animation::LocalToModel(skeleton, pose.data(), model.data(), lod.leafDepth);
+	animation::BuildSkinPalette(skeleton, model.data(), palette, lod.leafDepth);
+}
+//=============================================================================
+void Animator::advanceTrack(Track& track, float deltaTime)
+{
+	if (!track.clip) return;
+
+	track.previousTime = track.time;
+	track.time += deltaTime;
+	const float duration = track.clip->GetDuration();
+	if (track.loop && duration > 0.0f && track.time >= duration)
+	{
+		// оба момента сдвигаются вместе, иначе интерполяция между тиками пробежала бы клип назад
+		const float wrap = std::floor(track.time / duration) * duration;
+		track.time -= wrap;
+		track.previousTime -= wrap;
+	}
+}
+//=============================================================================
\ No newline at end of file
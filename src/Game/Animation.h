@@ -0,0 +1,227 @@
+﻿#pragma once
+
+// Трансформы четырех суставов в SoA: каждая компонента - vec4 по суставам, поэтому выборка клипа
+// и смешивание поз идут SSE-инструкциями без перестановок. Хвост последней четверки - единичные трансформы
+struct alignas(16) SoaTransform final
+{
+	glm::vec4 rotationX, rotationY, rotationZ, rotationW;
+	glm::vec4 translationX, translationY, translationZ;
+	glm::vec4 scaleX, scaleY, scaleZ;
+
+	static SoaTransform Identity();
+
+	void SetJoint(uint32_t lane, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale);
+	void GetJoint(uint32_t lane, glm::vec3& translation, glm::quat& rotation, glm::vec3& scale) const;
+};
+
+// Матрица палитры скиннинга: три строки аффинной матрицы, в шейдере - три vec4 на сустав
+struct SkinMatrix final
+{
+	glm::vec4 rows[3];
+};
+
+class Skeleton final
+{
+public:
+	static constexpr uint32_t MaxJoints = 256; // индекс сустава в вершине - uint8
+
+	// Родитель добавляется раньше потомков (parent < индекса сустава), у корня parent = -1.
+	// Локальная поза привязки задает позу без клипа, inverseBindMatrix переводит вершины меша в систему сустава
+	uint32_t AddJoint(const std::string& name, int32_t parent, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale,
+		const glm::mat4& inverseBindMatrix);
+
+	uint32_t GetJointCount() const { return (uint32_t)m_parents.size(); }
+	uint32_t GetSoaCount() const { return (GetJointCount() + 3) / 4; }
+	// -1, если сустава нет
+	int32_t FindJoint(const std::string& name) const;
+
+	const std::string& GetJointName(uint32_t joint) const { return m_names[joint]; }
+	const int16_t* GetParents() const { return m_parents.data(); }
+	const glm::mat4* GetInverseBindMatrices() const { return m_inverseBindMatrices.data(); }
+	const SoaTransform* GetBindPose() const { return m_bindPose.data(); }
+	// Высота сустава: самая длинная цепочка звеньев от него до листа, у листа (кончики пальцев, лицо) - 0
+	const uint8_t* GetJointHeights() const { return m_heights.data(); }
+
+private:
+	std::vector<std::string> m_names;
+	std::vector<int16_t>     m_parents;
+	std::vector<uint8_t>     m_heights;
+	std::vector<glm::mat4>   m_inverseBindMatrices;
+	std::vector<SoaTransform> m_bindPose;
+};
+
+// Допуски прореживания ключей при сжатии клипа
+struct ClipCompressionSettings final
+{
+	float rotationTolerance{ 0.0005f };    // радианы
+	float translationTolerance{ 0.0005f }; // единицы модели
+	float scaleTolerance{ 0.0005f };
+};
+
+struct ClipCompressionStatistics final
+{
+	size_t   rawBytes{ 0 };
+	size_t   compressedBytes{ 0 };
+	uint32_t rawKeys{ 0 };             // ключей на дорожку по кадру, включая хвост последней четверки
+	uint32_t keys{ 0 };
+	float    maxRotationError{ 0.0f }; // радианы, по выборке сжатого клипа на кадрах исходного
+	float    maxTranslationError{ 0.0f };
+	float    maxScaleError{ 0.0f };
+};
+
+// Клип, пересчитанный на равномерную сетку кадров: выборка - два соседних кадра и смешивание без поиска ключей.
+// Сжатый клип (Compress) хранит вместо кадров прореженные квантованные ключи по сегментам в SegmentFrames кадров
+class AnimationClip final
+{
+public:
+	static constexpr float DefaultFrameRate = 30.0f;
+	static constexpr uint32_t SegmentFrames = 16;
+
+	AnimationClip(std::string name, uint32_t soaCount, uint32_t frameCount, float frameRate = DefaultFrameRate);
+
+	// Сжатая копия клипа. Дорожка - компонента трансформа (вращение, перенос, масштаб) одного сустава.
+	// Ключи дорожки прореживаются, пока линейная интерполяция между оставшимися укладывается в допуск;
+	// вращения хранятся тремя наименьшими компонентами в 48 битах, переносы и масштабы - по 16 бит в диапазоне дорожки.
+	// Сегмент - таблица начал дорожек и ключи подряд, выборка в момент t читает только свой сегмент
+	static std::shared_ptr<AnimationClip> Compress(const AnimationClip& clip, const ClipCompressionSettings& settings,
+		ClipCompressionStatistics* statistics = nullptr);
+	bool IsCompressed() const { return !m_segmentOffsets.empty(); }
+
+	const std::string& GetName() const { return m_name; }
+	float GetDuration() const { return float(m_frameCount - 1) / m_frameRate; }
+	float GetFrameRate() const { return m_frameRate; }
+	uint32_t GetFrameCount() const { return m_frameCount; }
+	uint32_t GetSoaCount() const { return m_soaCount; }
+	size_t GetMemorySize() const;
+
+	// Только у несжатого клипа
+	SoaTransform* GetFrame(uint32_t frame) { return m_frames.data() + size_t(frame) * m_soaCount; }
+	const SoaTransform* GetFrame(uint32_t frame) const { return m_frames.data() + size_t(frame) * m_soaCount; }
+
+	// Локальная поза в момент time, output - GetSoaCount() четверок. loop - время берется по модулю длительности
+	void Sample(float time, bool loop, SoaTransform* output) const;
+
+private:
+	static constexpr uint32_t TracksPerSoa = 12; // вращения, переносы, масштабы четверки суставов
+
+	// Декодирование ключа переноса или масштаба четверки: min + значение * step
+	struct alignas(16) SoaRange final
+	{
+		glm::vec4 min[3];
+		glm::vec4 step[3];
+	};
+
+	void sampleCompressed(float framePosition, SoaTransform* output) const;
+
+	std::string               m_name;
+	uint32_t                  m_soaCount;
+	uint32_t                  m_frameCount;
+	float                     m_frameRate;
+	std::vector<SoaTransform> m_frames; // кадр за кадром, в кадре - четверки суставов
+
+	// Сжатый клип: у каждой четверки диапазоны переносов и масштабов; сегмент в m_keys - заголовки дорожек
+	// (по два uint16: маска кадров сегмента с ключами и номер первого ключа), затем ключи по три квантованных uint16
+	std::vector<SoaRange> m_ranges;
+	std::vector<uint16_t> m_keys;
+	std::vector<uint32_t> m_segmentOffsets;
+};
+
+namespace animation
+{
+	// output = a + (b - a) * weight: переносы и масштабы линейно, вращения - нормализованный lerp по короткой дуге.
+	// output может совпадать с a или b
+	void BlendPoses(const SoaTransform* a, const SoaTransform* b, float weight, uint32_t soaCount, SoaTransform* output);
+	// То же с весом у каждого сустава: mask[i] - веса четверки i, умножаются на weight
+	void BlendPosesMasked(const SoaTransform* a, const SoaTransform* b, const glm::vec4* mask, float weight, uint32_t soaCount, SoaTransform* output);
+	// Локальные трансформы в матрицы суставов в системе модели: один проход по индексам родителей.
+	// Суставы ниже leafDepth (см. Skeleton::GetJointHeights) пропускаются, их матрицы не нужны BuildSkinPalette
+	void LocalToModel(const Skeleton& skeleton, const SoaTransform* local, glm::mat4* model, uint32_t leafDepth = 0);
+	// Матрица сустава, умноженная на обратную матрицу привязки. Сустав ниже leafDepth берет матрицу родителя:
+	// в позе привязки относительно него он двигается вместе с родителем
+	void BuildSkinPalette(const Skeleton& skeleton, const glm::mat4* model, SkinMatrix* palette, uint32_t leafDepth = 0);
+	// output = a + (b - a) * weight поэлементно. Для линейного скиннинга это то же, что смешать вершины
+	void BlendPalettes(const SkinMatrix* a, const SkinMatrix* b, float weight, uint32_t count, SkinMatrix* output);
+
+	// Сжатие клипа и выборка несжатого и сжатого: одного клипа в кэше и сотни копий мимо кэша, результат в лог
+	void RunCompressionBenchmark(const AnimationClip& clip, const ClipCompressionSettings& settings);
+}
+
+class AnimationGraph;
+class AnimationGraphInstance;
+
+// Упрощения вычисления позы дальнего персонажа
+struct AnimationLod final
+{
+	uint32_t interval{ 1 };    // кадров между вычислениями позы, между ними смешиваются две последние палитры
+	uint32_t leafDepth{ 0 };   // суставы с высотой меньше не считаются: 1 - листья скелета, 2 - и их родители
+	bool     blending{ true }; // false - из смесей и переходов только ветвь с наибольшим весом, без слоев
+};
+
+// Уровни детализации анимации по размеру персонажа на экране
+struct AnimationLodSettings final
+{
+	static constexpr uint32_t LevelCount = 4;
+
+	// Уровень i, пока описанная сфера персонажа занимает больше screenSizes[i] высоты экрана, иначе следующий
+	std::array<float, LevelCount - 1>    screenSizes{ 0.25f, 0.1f, 0.04f };
+	std::array<AnimationLod, LevelCount> levels{ { { 1, 0, true }, { 2, 0, true }, { 4, 1, false }, { 8, 2, false } } };
+};
+
+// Проигрывание клипов на узле: текущий клип и затухающий предыдущий, либо граф анимации вместо них.
+// Время идет тиками фиксированного шага, поза считается между двумя последними тиками, как трансформы узлов
+class Animator final
+{
+public:
+	explicit Animator(std::shared_ptr<const Skeleton> skeleton);
+	~Animator();
+
+	// fadeDuration > 0 - предыдущий клип плавно уступает новому
+	void Play(std::shared_ptr<const AnimationClip> clip, float fadeDuration = 0.0f, bool loop = true);
+	void SetTime(float time) { m_current.time = m_current.previousTime = time; }
+	void SetSpeed(float speed) { m_speed = speed; }
+	// Поза считается графом, Play() больше не действует; nullptr - снова клипы. Параметры графа - через GetGraph()
+	void SetGraph(std::shared_ptr<const AnimationGraph> graph);
+	AnimationGraphInstance* GetGraph() const { return m_graph.get(); }
+	float GetSpeed() const { return m_speed; }
+
+	// Тик фиксированного шага
+	void Advance(float deltaTime);
+	// Палитра скиннинга из GetSkeleton().GetJointCount() матриц. alpha - как у Transform::Interpolate.
+	// Временные позы берутся из арены кадра потока, можно звать из задач
+	void Evaluate(float alpha, SkinMatrix* palette) const;
+	// То же с упрощениями lod. При lod.interval > 1 поза считается раз в интервал со сдвигом фазы от других
+	// аниматоров, палитра между вычислениями смешивается из двух последних с запаздыванием на интервал.
+	// Зовется раз в кадр frameIndex, пропуск кадра сбрасывает кэш. true, если поза считалась в этом кадре
+	bool Evaluate(float alpha, const AnimationLod& lod, uint64_t frameIndex, SkinMatrix* palette);
+
+	const Skeleton& GetSkeleton() const { return *m_skeleton; }
+	const AnimationClip* GetClip() const { return m_current.clip.get(); }
+
+private:
+	struct Track final
+	{
+		std::shared_ptr<const AnimationClip> clip;
+		float time{ 0.0f };
+		float previousTime{ 0.0f };
+		bool  loop{ true };
+	};
+
+	static void advanceTrack(Track& track, float deltaTime);
+	void evaluate(float alpha, const AnimationLod& lod, SkinMatrix* palette) const;
+
+	std::shared_ptr<const Skeleton> m_skeleton;
+	Track m_current;
+	Track m_fading;                  // клип до Play(), затухает за m_fadeDuration
+	float m_fadeDuration{ 0.0f };
+	float m_fadeTime{ 0.0f };
+	float m_previousFadeTime{ 0.0f };
+	float m_speed{ 1.0f };
+	std::unique_ptr<AnimationGraphInstance> m_graph;
+
+	// Кэш вычислений реже кадра: раньше вычисленная палитра, затем позже вычисленная
+	std::vector<SkinMatrix> m_lodPalettes;
+	uint64_t                m_lodKeyFrame{ 0 };  // кадр вычисления поздней палитры
+	uint64_t                m_lodLastFrame{ 0 };
+	uint32_t                m_lodPhase{ 0 };
+	bool                    m_lodValid{ false };
+};
\ No newline at end of file
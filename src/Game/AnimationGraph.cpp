@@ -0,0 +1,587 @@
+﻿#include "stdafx.h"
+#include "AnimationGraph.h"
+#include "FrameAllocator.h"
+#include "Graphics.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t MaxGraphNodes = 4096;  // узел, на который ссылаются дважды, копируется в каждое место
+	constexpr float MinNodeDuration = 0.001f;
+
+	struct TransitionDesc final
+	{
+		std::string from;
+		std::string to;
+		std::string parameter;
+		std::string comparison;
+		float       threshold{ 0.0f };
+		float       duration{ 0.0f };
+	};
+
+	// Узел описания до компиляции, потомки - индексы в описании
+	struct NodeDesc final
+	{
+		AnimationGraph::NodeType    type;
+		std::string                 name;
+		std::string                 clip;
+		float                       value{ 1.0f };
+		bool                        loop{ true };
+		std::string                 parameters[2];
+		std::vector<uint32_t>       children;
+		std::vector<glm::vec2>      points;
+		std::string                 joint;
+		std::vector<std::string>    states;
+		std::vector<TransitionDesc> transitions;
+	};
+}
+//=============================================================================
+std::shared_ptr<AnimationGraph> AnimationGraph::LoadFromFile(const std::string& path, const Model& model)
+{
+	PROFILE_FUNCTION();
+
+	if (!model.GetSkeleton())
+	{
+		LOG_ERROR(Scene, "Animation graph needs a model with a skeleton: {}", path);
+		return nullptr;
+	}
+	std::ifstream file(path);
+	if (!file)
+	{
+		LOG_ERROR(Scene, "Failed to open animation graph: {}", path);
+		return nullptr;
+	}
+
+	auto graph = std::make_shared<AnimationGraph>();
+	graph->m_skeleton = model.GetSkeleton();
+	const Skeleton& skeleton = *graph->m_skeleton;
+
+	std::vector<NodeDesc> descs;
+	std::string output;
+	auto findDesc = [&](const std::string& name) -> int32_t
+	{
+		for (size_t i = 0; i < descs.size(); i++)
+		{
+			if (descs[i].name == name) return (int32_t)i;
+		}
+		return -1;
+	};
+	auto findMachine = [&](const std::string& name) -> NodeDesc*
+	{
+		const int32_t desc = findDesc(name);
+		return desc >= 0 && descs[desc].type == NodeType::StateMachine ? &descs[desc] : nullptr;
+	};
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream stream(line);
+		std::string command;
+		if (!(stream >> command) || command[0] == '#') continue;
+
+		bool valid = true;
+		if (command == "parameter")
+		{
+			std::string name;
+			float value = 0.0f;
+			valid = stream >> name >> value && graph->FindParameter(name) < 0;
+			if (valid)
+			{
+				graph->m_parameterNames.push_back(name);
+				graph->m_parameterDefaults.push_back(value);
+			}
+		}
+		else if (command == "clip" || command == "blend1d" || command == "blend2d" || command == "layer" || command == "state_machine")
+		{
+			NodeDesc desc;
+			valid = static_cast<bool>(stream >> desc.name) && findDesc(desc.name) < 0;
+			if (command == "clip")
+			{
+				desc.type = NodeType::Clip;
+				valid = valid && stream >> desc.clip;
+				float rate;
+				std::string once;
+				if (valid && stream >> rate)
+				{
+					desc.value = rate;
+					if (stream >> once) desc.loop = once != "once";
+				}
+			}
+			else if (command == "blend1d" || command == "blend2d")
+			{
+				const bool is2D = command == "blend2d";
+				desc.type = is2D ? NodeType::BlendSpace2D : NodeType::BlendSpace1D;
+				valid = valid && stream >> desc.parameters[0] && (!is2D || stream >> desc.parameters[1]);
+				std::string child;
+				glm::vec2 point{ 0.0f };
+				while (valid && stream >> child)
+				{
+					const int32_t childDesc = findDesc(child);
+					valid = childDesc >= 0 && stream >> point.x && (!is2D || stream >> point.y);
+					desc.children.push_back((uint32_t)childDesc);
+					desc.points.push_back(point);
+				}
+				valid = valid && !desc.children.empty();
+			}
+			else if (command == "layer")
+			{
+				desc.type = NodeType::Layer;
+				std::string base, layer, weight;
+				valid = valid && stream >> base >> layer >> desc.joint >> weight && findDesc(base) >= 0 && findDesc(layer) >= 0;
+				if (valid)
+				{
+					desc.children = { (uint32_t)findDesc(base), (uint32_t)findDesc(layer) };
+					// вес - число или имя параметра
+					char* end = nullptr;
+					desc.value = std::strtof(weight.c_str(), &end);
+					if (*end != '\0') desc.parameters[0] = weight;
+				}
+			}
+			else
+			{
+				desc.type = NodeType::StateMachine;
+			}
+			if (valid) descs.push_back(std::move(desc));
+		}
+		else if (command == "state")
+		{
+			std::string machineName, state, node;
+			valid = stream >> machineName >> state >> node && findDesc(node) >= 0;
+			NodeDesc* machine = valid ? findMachine(machineName) : nullptr;
+			valid = machine && std::find(machine->states.begin(), machine->states.end(), state) == machine->states.end();
+			if (valid)
+			{
+				machine->states.push_back(state);
+				machine->children.push_back((uint32_t)findDesc(node));
+			}
+		}
+		else if (command == "transition")
+		{
+			std::string machineName;
+			TransitionDesc transition;
+			valid = stream >> machineName >> transition.from >> transition.to >> transition.parameter >> transition.comparison
+				>> transition.threshold >> transition.duration && (transition.comparison == "<" || transition.comparison == ">");
+			NodeDesc* machine = valid ? findMachine(machineName) : nullptr;
+			valid = machine != nullptr;
+			if (valid) machine->transitions.push_back(transition);
+		}
+		else if (command == "output")
+		{
+			valid = stream >> output && findDesc(output) >= 0;
+		}
+		else
+		{
+			valid = false;
+		}
+
+		if (!valid)
+		{
+			LOG_ERROR(Scene, "Invalid animation graph line in {}: {}", path, line);
+			return nullptr;
+		}
+	}
+	if (output.empty())
+	{
+		LOG_ERROR(Scene, "Animation graph has no output: {}", path);
+		return nullptr;
+	}
+
+	// компиляция обходом от выхода: потомки выписываются раньше родителя, ссылки только на объявленные выше узлы
+	// исключают циклы. Для каждого узла считается глубина стека временных поз его поддерева
+	std::vector<uint32_t> poseNeeds;
+	bool compiled = true;
+	auto fail = [&](const NodeDesc& desc, const char* reason) -> uint32_t
+	{
+		if (compiled) LOG_ERROR(Scene, "Animation graph node '{}' in {}: {}", desc.name, path, reason);
+		compiled = false;
+		return 0;
+	};
+	auto emit = [&](auto& self, uint32_t descIndex) -> uint32_t
+	{
+		const NodeDesc& desc = descs[descIndex];
+		if (graph->m_nodes.size() >= MaxGraphNodes) return fail(desc, "too many nodes");
+
+		Node node;
+		node.type = desc.type;
+		node.loop = desc.loop;
+		node.value = desc.value;
+		node.first = (uint32_t)graph->m_nodes.size();
+		for (int i = 0; i < 2; i++)
+		{
+			if (desc.parameters[i].empty()) continue;
+			const int32_t parameter = graph->FindParameter(desc.parameters[i]);
+			if (parameter < 0) return fail(desc, "unknown parameter");
+			node.parameters[i] = (uint16_t)parameter;
+		}
+
+		std::vector<uint32_t> children;
+		uint32_t needs = 1;
+		for (size_t i = 0; i < desc.children.size(); i++)
+		{
+			const uint32_t child = self(self, desc.children[i]);
+			if (!compiled) return 0;
+			children.push_back(child);
+			// первый потомок смеси и слоя пишет прямо в позу узла, остальные - на уровень глубже;
+			// у автомата любое состояние может оказаться затухающим
+			const bool deeper = i > 0 || desc.type == NodeType::StateMachine;
+			needs = std::max(needs, poseNeeds[child] + (deeper ? 1 : 0));
+		}
+
+		switch (desc.type)
+		{
+		case NodeType::Clip:
+		{
+			const auto clip = model.FindClip(desc.clip);
+			if (!clip || clip->GetSoaCount() != skeleton.GetSoaCount()) return fail(desc, "unknown clip");
+			if (desc.value <= 0.0f) return fail(desc, "rate must be positive");
+			node.data = (uint32_t)graph->m_clips.size();
+			graph->m_clips.push_back(clip);
+			break;
+		}
+		case NodeType::BlendSpace1D:
+		case NodeType::BlendSpace2D:
+			if (children.size() > MaxBlendChildren) return fail(desc, "too many children");
+			for (size_t i = 0; i < children.size(); i++)
+			{
+				const NodeType childType = graph->m_nodes[children[i]].type;
+				if (childType == NodeType::Layer || childType == NodeType::StateMachine) return fail(desc, "only clips and blend spaces can be blended");
+				if (desc.type == NodeType::BlendSpace1D && i > 0 && desc.points[i].x <= desc.points[i - 1].x) return fail(desc, "values must ascend");
+			}
+			break;
+		case NodeType::Layer:
+		{
+			const int32_t joint = skeleton.FindJoint(desc.joint);
+			if (joint < 0) return fail(desc, "unknown joint");
+			// маска - сустав и все его потомки; родители идут раньше потомков
+			std::vector<uint8_t> inMask(skeleton.GetJointCount(), 0);
+			std::vector<glm::vec4> mask(skeleton.GetSoaCount(), glm::vec4(0.0f));
+			for (uint32_t j = (uint32_t)joint; j < skeleton.GetJointCount(); j++)
+			{
+				const int16_t parent = skeleton.GetParents()[j];
+				inMask[j] = j == (uint32_t)joint || (parent >= 0 && inMask[parent]);
+				if (inMask[j]) mask[j / 4][j % 4] = 1.0f;
+			}
+			node.data = (uint32_t)graph->m_masks.size();
+			graph->m_masks.push_back(std::move(mask));
+			break;
+		}
+		case NodeType::StateMachine:
+		{
+			if (children.empty()) return fail(desc, "no states");
+			Machine machine{ (uint32_t)graph->m_transitions.size(), 0 };
+			auto findState = [&](const std::string& name) -> int32_t
+			{
+				const auto it = std::find(desc.states.begin(), desc.states.end(), name);
+				return it == desc.states.end() ? -1 : (int32_t)(it - desc.states.begin());
+			};
+			for (const TransitionDesc& transitionDesc : desc.transitions)
+			{
+				const int32_t from = transitionDesc.from == "*" ? -1 : findState(transitionDesc.from);
+				const int32_t to = findState(transitionDesc.to);
+				const int32_t parameter = graph->FindParameter(transitionDesc.parameter);
+				if ((from < 0 && transitionDesc.from != "*") || to < 0) return fail(desc, "unknown transition state");
+				if (parameter < 0) return fail(desc, "unknown transition parameter");
+				graph->m_transitions.push_back({ from, (uint32_t)to, (uint16_t)parameter,
+					transitionDesc.comparison == "<" ? Comparison::Less : Comparison::Greater, transitionDesc.threshold, transitionDesc.duration });
+				machine.transitionCount++;
+			}
+			node.data = (uint32_t)graph->m_machines.size();
+			graph->m_machines.push_back(machine);
+			break;
+		}
+		}
+
+		node.firstChild = (uint32_t)graph->m_children.size();
+		node.childCount = (uint32_t)children.size();
+		for (size_t i = 0; i < children.size(); i++)
+		{
+			graph->m_children.push_back(children[i]);
+			graph->m_childPoints.push_back(i < desc.points.size() ? desc.points[i] : glm::vec2(0.0f));
+		}
+		graph->m_nodes.push_back(node);
+		poseNeeds.push_back(needs);
+		return (uint32_t)graph->m_nodes.size() - 1;
+	};
+	const uint32_t root = emit(emit, (uint32_t)findDesc(output));
+	if (!compiled) return nullptr;
+
+	graph->m_poseCount = poseNeeds[root];
+	LOG_INFO(Scene, "Animation graph loaded: {} ({} nodes, {} parameters, {} poses per evaluation)", path, graph->m_nodes.size(),
+		graph->m_parameterNames.size(), graph->m_poseCount);
+	return graph;
+}
+//=============================================================================
+int32_t AnimationGraph::FindParameter(const std::string& name) const
+{
+	for (size_t i = 0; i < m_parameterNames.size(); i++)
+	{
+		if (m_parameterNames[i] == name) return (int32_t)i;
+	}
+	return -1;
+}
+//=============================================================================
+AnimationGraphInstance::AnimationGraphInstance(std::shared_ptr<const AnimationGraph> graph)
+	: m_graph(std::move(graph))
+	, m_parameters(m_graph->m_parameterDefaults)
+	, m_phases(m_graph->m_nodes.size())
+	, m_machines(m_graph->m_machines.size())
+{
+}
+//=============================================================================
+bool AnimationGraphInstance::SetParameter(const std::string& name, float value)
+{
+	const int32_t parameter = m_graph->FindParameter(name);
+	if (parameter < 0) return false;
+	m_parameters[parameter] = value;
+	return true;
+}
+//=============================================================================
+void AnimationGraphInstance::Advance(float deltaTime)
+{
+	advanceNode(m_graph->GetNodeCount() - 1, deltaTime);
+}
+//=============================================================================
+void AnimationGraphInstance::Evaluate(float alpha, SoaTransform* output, bool blending) const
+{
+	const uint32_t soaCount = m_graph->GetSkeleton().GetSoaCount();
+	ArenaVector<SoaTransform> poses(framemem::GetThreadAllocator<SoaTransform>());
+	poses.resize(size_t(m_graph->m_poseCount - 1) * soaCount);
+
+	const uint32_t root = m_graph->GetNodeCount() - 1;
+	evaluateNode({ alpha, blending, soaCount, poses.data() }, root, getPhase(root, alpha), 0, output);
+}
+//=============================================================================
+void AnimationGraphInstance::advanceNode(uint32_t node, float deltaTime)
+{
+	using NodeType = AnimationGraph::NodeType;
+	const AnimationGraph::Node& desc = m_graph->m_nodes[node];
+	const uint32_t* children = m_graph->m_children.data() + desc.firstChild;
+
+	switch (desc.type)
+	{
+	case NodeType::Layer:
+		advanceNode(children[0], deltaTime);
+		advanceNode(children[1], deltaTime);
+		break;
+	case NodeType::StateMachine:
+	{
+		MachineState& machine = m_machines[desc.data];
+		if (machine.fading)
+		{
+			// затухшее состояние снимается, когда и предыдущий тик целиком в новом
+			if (machine.previousFadeTime >= machine.fadeDuration)
+			{
+				machine.fading = false;
+			}
+			else
+			{
+				machine.previousFadeTime = machine.fadeTime;
+				machine.fadeTime = std::min(machine.fadeTime + deltaTime, machine.fadeDuration);
+			}
+		}
+
+		const AnimationGraph::Machine& transitions = m_graph->m_machines[desc.data];
+		for (uint32_t i = 0; i < transitions.transitionCount; i++)
+		{
+			const AnimationGraph::Transition& transition = m_graph->m_transitions[transitions.firstTransition + i];
+			if ((transition.from >= 0 && (uint32_t)transition.from != machine.current) || transition.to == machine.current) continue;
+			const float value = m_parameters[transition.parameter];
+			const bool passed = transition.comparison == AnimationGraph::Comparison::Less ? value < transition.threshold : value > transition.threshold;
+			if (!passed) continue;
+
+			machine.previous = machine.current;
+			machine.current = transition.to;
+			machine.fading = transition.duration > 0.0f;
+			machine.fadeTime = machine.previousFadeTime = 0.0f;
+			machine.fadeDuration = transition.duration;
+			// новое состояние начинается с начала
+			resetSubtree(children[machine.current]);
+			break;
+		}
+
+		advanceNode(children[machine.current], deltaTime);
+		if (machine.fading) advanceNode(children[machine.previous], deltaTime);
+		break;
+	}
+	default:
+	{
+		Phase& phase = m_phases[node];
+		phase.previousPhase = phase.phase;
+		phase.phase += deltaTime / getDuration(node);
+		if (desc.type != NodeType::Clip || desc.loop)
+		{
+			// оба момента сдвигаются вместе, как в Animator
+			const float wrap = std::floor(phase.phase);
+			phase.phase -= wrap;
+			phase.previousPhase -= wrap;
+		}
+		else
+		{
+			phase.phase = std::min(phase.phase, 1.0f);
+		}
+		break;
+	}
+	}
+}
+//=============================================================================
+void AnimationGraphInstance::resetSubtree(uint32_t node)
+{
+	for (uint32_t i = m_graph->m_nodes[node].first; i <= node; i++)
+	{
+		m_phases[i] = {};
+		if (m_graph->m_nodes[i].type == AnimationGraph::NodeType::StateMachine)
+			m_machines[m_graph->m_nodes[i].data] = {};
+	}
+}
+//=============================================================================
+float AnimationGraphInstance::getDuration(uint32_t node) const
+{
+	const AnimationGraph::Node& desc = m_graph->m_nodes[node];
+	if (desc.type == AnimationGraph::NodeType::Clip)
+		return std::max(m_graph->m_clips[desc.data]->GetDuration() / desc.value, MinNodeDuration);
+
+	// длительность смеси - средняя по весам, потомки проходят свои клипы за одну фазу смеси
+	float weights[AnimationGraph::MaxBlendChildren];
+	const uint32_t count = getBlendWeights(node, weights);
+	float duration = 0.0f;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (weights[i] > 0.0f) duration += weights[i] * getDuration(m_graph->m_children[desc.firstChild + i]);
+	}
+	return std::max(duration, MinNodeDuration);
+}
+//=============================================================================
+uint32_t AnimationGraphInstance::getBlendWeights(uint32_t node, float* weights) const
+{
+	const AnimationGraph::Node& desc = m_graph->m_nodes[node];
+	const glm::vec2* points = m_graph->m_childPoints.data() + desc.firstChild;
+	const uint32_t count = desc.childCount;
+	std::fill_n(weights, count, 0.0f);
+
+	if (desc.type == AnimationGraph::NodeType::BlendSpace1D)
+	{
+		const float x = m_parameters[desc.parameters[0]];
+		if (x <= points[0].x)
+		{
+			weights[0] = 1.0f;
+			return count;
+		}
+		for (uint32_t i = 0; i + 1 < count; i++)
+		{
+			if (x >= points[i + 1].x) continue;
+			const float t = (x - points[i].x) / (points[i + 1].x - points[i].x);
+			weights[i] = 1.0f - t;
+			weights[i + 1] = t;
+			return count;
+		}
+		weights[count - 1] = 1.0f;
+		return count;
+	}
+
+	// градиентные полосы: вес точки падает до нуля на пути к каждой соседней, берется наименьший
+	const glm::vec2 p(m_parameters[desc.parameters[0]], m_parameters[desc.parameters[1]]);
+	float total = 0.0f;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		float weight = 1.0f;
+		for (uint32_t j = 0; j < count; j++)
+		{
+			const glm::vec2 edge = points[j] - points[i];
+			const float lengthSq = glm::dot(edge, edge);
+			if (i == j || lengthSq <= 0.0f) continue;
+			weight = std::min(weight, 1.0f - glm::dot(p - points[i], edge) / lengthSq);
+		}
+		weights[i] = std::max(weight, 0.0f);
+		total += weights[i];
+	}
+	if (total > 0.0f)
+	{
+		for (uint32_t i = 0; i < count; i++)
+			weights[i] /= total;
+	}
+	else
+	{
+		weights[0] = 1.0f;
+	}
+	return count;
+}
+//=============================================================================
+float AnimationGraphInstance::getPhase(uint32_t node, float alpha) const
+{
+	const AnimationGraph::Node& desc = m_graph->m_nodes[node];
+	const float phase = glm::mix(m_phases[node].previousPhase, m_phases[node].phase, alpha);
+	if (desc.type == AnimationGraph::NodeType::Clip && !desc.loop) return glm::clamp(phase, 0.0f, 1.0f);
+	return phase - std::floor(phase);
+}
+//=============================================================================
+void AnimationGraphInstance::evaluateNode(const EvaluationContext& context, uint32_t node, float phase, uint32_t depth, SoaTransform* output) const
+{
+	using NodeType = AnimationGraph::NodeType;
+	const AnimationGraph::Node& desc = m_graph->m_nodes[node];
+	const uint32_t* children = m_graph->m_children.data() + desc.firstChild;
+	// поза следующего уровня стека
+	SoaTransform* scratch = context.poses + size_t(depth) * context.soaCount;
+
+	switch (desc.type)
+	{
+	case NodeType::Clip:
+	{
+		const AnimationClip& clip = *m_graph->m_clips[desc.data];
+		clip.Sample(phase * clip.GetDuration(), desc.loop, output);
+		break;
+	}
+	case NodeType::BlendSpace1D:
+	case NodeType::BlendSpace2D:
+	{
+		// взвешенная сумма накапливается попарным смешиванием: вес очередного потомка - его доля в уже набранной сумме
+		float weights[AnimationGraph::MaxBlendChildren];
+		const uint32_t count = getBlendWeights(node, weights);
+		if (!context.blending)
+		{
+			const uint32_t dominant = uint32_t(std::max_element(weights, weights + count) - weights);
+			evaluateNode(context, children[dominant], phase, depth, output);
+			break;
+		}
+		float accumulated = 0.0f;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (weights[i] <= 0.0f) continue;
+			if (accumulated == 0.0f)
+			{
+				evaluateNode(context, children[i], phase, depth, output);
+			}
+			else
+			{
+				evaluateNode(context, children[i], phase, depth + 1, scratch);
+				animation::BlendPoses(output, scratch, weights[i] / (accumulated + weights[i]), context.soaCount, output);
+			}
+			accumulated += weights[i];
+		}
+		break;
+	}
+	case NodeType::Layer:
+	{
+		evaluateNode(context, children[0], getPhase(children[0], context.alpha), depth, output);
+		const float weight = desc.parameters[0] != AnimationGraph::NoParameter ? glm::clamp(m_parameters[desc.parameters[0]], 0.0f, 1.0f) : desc.value;
+		if (weight <= 0.0f || !context.blending) break;
+		evaluateNode(context, children[1], getPhase(children[1], context.alpha), depth + 1, scratch);
+		animation::BlendPosesMasked(output, scratch, m_graph->m_masks[desc.data].data(), weight, context.soaCount, output);
+		break;
+	}
+	case NodeType::StateMachine:
+	{
+		const MachineState& machine = m_machines[desc.data];
+		const uint32_t current = children[machine.current];
+		evaluateNode(context, current, getPhase(current, context.alpha), depth, output);
+		if (!machine.fading || !context.blending) break;
+
+		const uint32_t previous = children[machine.previous];
+		evaluateNode(context, previous, getPhase(previous, context.alpha), depth + 1, scratch);
+		const float weight = glm::clamp(glm::mix(machine.previousFadeTime, machine.fadeTime, context.alpha) / machine.fadeDuration, 0.0f, 1.0f);
+		animation::BlendPoses(scratch, output, weight, context.soaCount, output);
+		break;
+	}
+	}
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include "Animation.h"
+
+class Model;
+
+// Скомпилированный граф анимации персонажа: узлы в плоском массиве, потомки всегда раньше родителя,
+// поддерево узла - непрерывный диапазон [first, узел]. Граф неизменяем и общий для всех персонажей модели,
+// состояние персонажа - AnimationGraphInstance
+class AnimationGraph final
+{
+public:
+	enum class NodeType : uint8_t
+	{
+		Clip,
+		BlendSpace1D, // потомки на отрезке значений параметра, смешиваются два соседних
+		BlendSpace2D, // потомки в точках плоскости двух параметров, веса - интерполяция градиентными полосами
+		Layer,        // поверх базы накладывается слой по маске суставов: потомок сустава маски и он сам
+		StateMachine  // состояния - потомки, переходы по условиям на параметры с плавной сменой
+	};
+
+	static constexpr uint32_t MaxBlendChildren = 16;
+
+	// Текстовое описание, строка - объявление параметра или узла; узел ссылается только на объявленные выше:
+	// "parameter <name> <default>",
+	// "clip <name> <clip> [<rate> [once]]" - клип модели, once - без повтора,
+	// "blend1d <name> <parameter> <node> <value> [<node> <value> ...]" - значения по возрастанию,
+	// "blend2d <name> <parameterX> <parameterY> <node> <x> <y> [<node> <x> <y> ...]",
+	// "layer <name> <base> <layer> <joint> <weight|parameter>",
+	// "state_machine <name>", "state <machine> <state> <node>" - первое состояние начальное,
+	// "transition <machine> <from|*> <to> <parameter> <<|>> <threshold> <duration>" - проверяются по порядку,
+	// "output <node>". Потомки смесей синхронизированы по фазе смеси, поэтому в смесях только клипы и смеси.
+	// Клипы и суставы ищутся в модели, nullptr при ошибке
+	static std::shared_ptr<AnimationGraph> LoadFromFile(const std::string& path, const Model& model);
+
+	const Skeleton& GetSkeleton() const { return *m_skeleton; }
+	uint32_t GetNodeCount() const { return (uint32_t)m_nodes.size(); }
+	// Поз на вычисление: глубина стека временных поз при обходе
+	uint32_t GetPoseCount() const { return m_poseCount; }
+
+	uint32_t GetParameterCount() const { return (uint32_t)m_parameterNames.size(); }
+	const std::string& GetParameterName(uint32_t parameter) const { return m_parameterNames[parameter]; }
+	// -1, если параметра нет
+	int32_t FindParameter(const std::string& name) const;
+
+private:
+	friend class AnimationGraphInstance;
+
+	static constexpr uint16_t NoParameter = 0xFFFF;
+
+	enum class Comparison : uint8_t
+	{
+		Less,
+		Greater
+	};
+
+	struct Node final
+	{
+		NodeType type;
+		bool     loop{ true };
+		uint16_t parameters[2]{ NoParameter, NoParameter };
+		uint32_t first{ 0 };      // начало поддерева
+		uint32_t firstChild{ 0 }; // в m_children
+		uint32_t childCount{ 0 };
+		uint32_t data{ 0 };       // клип, маска или автомат
+		float    value{ 1.0f };   // скорость клипа или постоянный вес слоя
+	};
+
+	struct Transition final
+	{
+		int32_t    from;          // состояние автомата, -1 - из любого
+		uint32_t   to;
+		uint16_t   parameter;
+		Comparison comparison;
+		float      threshold;
+		float      duration;
+	};
+
+	struct Machine final
+	{
+		uint32_t firstTransition;
+		uint32_t transitionCount;
+	};
+
+	std::shared_ptr<const Skeleton>                   m_skeleton;
+	std::vector<Node>                                 m_nodes;
+	std::vector<uint32_t>                             m_children;
+	std::vector<glm::vec2>                            m_childPoints; // параллельно m_children: положения потомков смесей
+	std::vector<std::shared_ptr<const AnimationClip>> m_clips;
+	std::vector<std::vector<glm::vec4>>               m_masks;       // веса суставов слоев четверками
+	std::vector<Machine>                              m_machines;
+	std::vector<Transition>                           m_transitions;
+	std::vector<std::string>                          m_parameterNames;
+	std::vector<float>                                m_parameterDefaults;
+	uint32_t                                          m_poseCount{ 1 };
+};
+
+// Состояние графа у персонажа: параметры, фазы узлов и состояния автоматов. Память выделяется один раз
+// при создании, вычисление берет временные позы из арены кадра потока, поэтому персонажи считаются задачами параллельно
+class AnimationGraphInstance final
+{
+public:
+	explicit AnimationGraphInstance(std::shared_ptr<const AnimationGraph> graph);
+
+	const AnimationGraph& GetGraph() const { return *m_graph; }
+
+	void SetParameter(uint32_t parameter, float value) { m_parameters[parameter] = value; }
+	float GetParameter(uint32_t parameter) const { return m_parameters[parameter]; }
+	// false, если параметра нет
+	bool SetParameter(const std::string& name, float value);
+
+	// Тик фиксированного шага: переходы автоматов и фазы узлов
+	void Advance(float deltaTime);
+	// Локальная поза между двумя последними тиками, output - GetSkeleton().GetSoaCount() четверок.
+	// Без blending смеси и автоматы берут одну ветвь с наибольшим весом, слои не накладываются
+	void Evaluate(float alpha, SoaTransform* output, bool blending = true) const;
+
+	// Текущее состояние автомата по порядку объявления
+	uint32_t GetCurrentState(uint32_t machine) const { return m_machines[machine].current; }
+
+private:
+	struct Phase final
+	{
+		float phase{ 0.0f };         // доля длительности узла
+		float previousPhase{ 0.0f };
+	};
+
+	struct MachineState final
+	{
+		uint32_t current{ 0 };
+		uint32_t previous{ 0 };
+		bool     fading{ false };
+		float    fadeTime{ 0.0f };
+		float    previousFadeTime{ 0.0f };
+		float    fadeDuration{ 0.0f };
+	};
+
+	struct EvaluationContext final
+	{
+		float         alpha;
+		bool          blending;
+		uint32_t      soaCount;
+		SoaTransform* poses; // глубина стека d > 0 пишет в poses + (d - 1) * soaCount
+	};
+
+	// Узлы со своей фазой: выход графа, база и слой слоя, состояния автомата. Потомки смесей идут по фазе смеси
+	void advanceNode(uint32_t node, float deltaTime);
+	void resetSubtree(uint32_t node);
+	float getDuration(uint32_t node) const;
+	uint32_t getBlendWeights(uint32_t node, float* weights) const;
+	float getPhase(uint32_t node, float alpha) const;
+	void evaluateNode(const EvaluationContext& context, uint32_t node, float phase, uint32_t depth, SoaTransform* output) const;
+
+	std::shared_ptr<const AnimationGraph> m_graph;
+	std::vector<float>                    m_parameters;
+	std::vector<Phase>                    m_phases;   // по узлам графа
+	std::vector<MachineState>             m_machines;
+};
\ No newline at end of file
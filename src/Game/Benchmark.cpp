@@ -0,0 +1,420 @@
+﻿#include "stdafx.h"
+#include "Benchmark.h"
+#include "Log.h"
+#include "Scene.h"
+#include "GpuProfiler.h"
+#include "RenderThread.h"
+//=============================================================================
+namespace
+{
+	// дочитываем запросы GPU и ждем, пока поток рендера нарисует измеренные кадры
+	constexpr uint32_t DrainFrames = gpuprofiler::FramesInFlight + renderthread::MaxQueuedFrames + 2;
+
+	struct Percentiles final
+	{
+		double p50{ 0.0 };
+		double p95{ 0.0 };
+		double p99{ 0.0 };
+		double mean{ 0.0 };
+		double min{ 0.0 };
+		double max{ 0.0 };
+	};
+
+	Percentiles computePercentiles(std::vector<double> values)
+	{
+		Percentiles result;
+		if (values.empty()) return result;
+
+		std::sort(values.begin(), values.end());
+		// nearest-rank
+		auto rank = [&values](double p)
+		{
+			const size_t index = (size_t)std::ceil(p * values.size());
+			return values[std::clamp<size_t>(index, 1, values.size()) - 1];
+		};
+		result.p50 = rank(0.50);
+		result.p95 = rank(0.95);
+		result.p99 = rank(0.99);
+		result.min = values.front();
+		result.max = values.back();
+		double sum = 0.0;
+		for (double value : values) sum += value;
+		result.mean = sum / values.size();
+		return result;
+	}
+
+	void writePercentiles(FILE* file, const char* name, const Percentiles& p, size_t samples)
+	{
+		fprintf(file, "  \"%s\": { \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"mean\": %.4f, \"min\": %.4f, \"max\": %.4f, \"samples\": %zu },\n",
+			name, p.p50, p.p95, p.p99, p.mean, p.min, p.max, samples);
+	}
+
+	std::string escapeJson(const std::string& str)
+	{
+		std::string result;
+		for (char c : str)
+		{
+			if (c == '"' || c == '\\') result += '\\';
+			result += c;
+		}
+		return result;
+	}
+
+	// Разбор JSON результата в плоский список "object.key" -> значение. Хватает для формата, который пишет WriteResult()
+	class FlatJsonReader final
+	{
+	public:
+		bool Parse(const std::string& text)
+		{
+			m_text = text;
+			m_pos = 0;
+			return parseValue("") && (skipSpaces(), m_pos == m_text.size());
+		}
+
+		std::unordered_map<std::string, double> numbers;
+		std::unordered_map<std::string, std::string> strings;
+
+	private:
+		void skipSpaces()
+		{
+			while (m_pos < m_text.size() && std::isspace((unsigned char)m_text[m_pos])) m_pos++;
+		}
+
+		bool parseString(std::string& out)
+		{
+			if (m_text[m_pos] != '"') return false;
+			m_pos++;
+			out.clear();
+			while (m_pos < m_text.size() && m_text[m_pos] != '"')
+			{
+				if (m_text[m_pos] == '\\' && m_pos + 1 < m_text.size()) m_pos++;
+				out += m_text[m_pos++];
+			}
+			if (m_pos >= m_text.size()) return false;
+			m_pos++;
+			return true;
+		}
+
+		bool parseValue(const std::string& key)
+		{
+			skipSpaces();
+			if (m_pos >= m_text.size()) return false;
+
+			const char c = m_text[m_pos];
+			if (c == '{')
+			{
+				m_pos++;
+				skipSpaces();
+				if (m_pos < m_text.size() && m_text[m_pos] == '}') { m_pos++; return true; }
+				while (true)
+				{
+					skipSpaces();
+					std::string name;
+					if (!parseString(name)) return false;
+					skipSpaces();
+					if (m_pos >= m_text.size() || m_text[m_pos++] != ':') return false;
+					if (!parseValue(key.empty() ? name : key + "." + name)) return false;
+					skipSpaces();
+					if (m_pos >= m_text.size()) return false;
+					if (m_text[m_pos] == ',') { m_pos++; continue; }
+					if (m_text[m_pos] == '}') { m_pos++; return true; }
+					return false;
+				}
+			}
+			if (c == '"')
+			{
+				std::string value;
+				if (!parseString(value)) return false;
+				strings[key] = value;
+				return true;
+			}
+
+			char* end = nullptr;
+			const double value = std::strtod(m_text.c_str() + m_pos, &end);
+			if (end == m_text.c_str() + m_pos) return false;
+			m_pos = size_t(end - m_text.c_str());
+			numbers[key] = value;
+			return true;
+		}
+
+		std::string m_text;
+		size_t      m_pos{ 0 };
+	};
+
+	bool readResult(const std::string& path, FlatJsonReader& reader)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			LOG_ERROR(Benchmark, "Failed to open benchmark result: {}", path);
+			return false;
+		}
+		std::stringstream stream;
+		stream << file.rdbuf();
+		if (!reader.Parse(stream.str()))
+		{
+			LOG_ERROR(Benchmark, "Failed to parse benchmark result: {}", path);
+			return false;
+		}
+		return true;
+	}
+}
+//=============================================================================
+bool CameraSpline::Load(const std::string& path)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		LOG_ERROR(Benchmark, "Failed to open camera path: {}", path);
+		return false;
+	}
+
+	m_keys.clear();
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream stream(line);
+		std::string command;
+		if (!(stream >> command) || command[0] == '#') continue;
+		if (command != "key")
+		{
+			LOG_WARNING(Benchmark, "Unknown camera path command: {}", command);
+			continue;
+		}
+
+		Key key;
+		if (!(stream >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch))
+		{
+			LOG_ERROR(Benchmark, "Invalid camera key: {}", line);
+			return false;
+		}
+		if (!m_keys.empty() && key.time <= m_keys.back().time)
+		{
+			LOG_ERROR(Benchmark, "Camera keys must be sorted by time: {}", line);
+			return false;
+		}
+		m_keys.push_back(key);
+	}
+
+	if (m_keys.size() < 2)
+	{
+		LOG_ERROR(Benchmark, "Camera path needs at least two keys: {}", path);
+		return false;
+	}
+	return true;
+}
+//=============================================================================
+void CameraSpline::Evaluate(float time, glm::vec3& position, float& yaw, float& pitch) const
+{
+	time = std::clamp(time, m_keys.front().time, m_keys.back().time);
+
+	size_t i = 0;
+	while (i + 2 < m_keys.size() && m_keys[i + 1].time < time) i++;
+
+	const Key& k1 = m_keys[i];
+	const Key& k2 = m_keys[i + 1];
+	const Key& k0 = m_keys[i > 0 ? i - 1 : i];
+	const Key& k3 = m_keys[std::min(i + 2, m_keys.size() - 1)];
+	const float t = (time - k1.time) / (k2.time - k1.time);
+
+	position = glm::catmullRom(k0.position, k1.position, k2.position, k3.position, t);
+	const glm::vec2 angles = glm::catmullRom(
+		glm::vec2(k0.yaw, k0.pitch), glm::vec2(k1.yaw, k1.pitch),
+		glm::vec2(k2.yaw, k2.pitch), glm::vec2(k3.yaw, k3.pitch), t);
+	yaw = angles.x;
+	pitch = angles.y;
+}
+//=============================================================================
+bool Benchmark::Init(const BenchmarkSettings& settings)
+{
+	m_settings = settings;
+	m_settings.measuredFrames = std::max(m_settings.measuredFrames, 1u);
+	if (!m_spline.Load(m_settings.cameraPath))
+		return false;
+
+	m_cpuFrameTimes.reserve(m_settings.measuredFrames);
+	m_gpuFrameTimes.reserve(m_settings.measuredFrames);
+
+	// без GPU профилировщика нет времени кадра на GPU
+	gpuprofiler::SetEnabled(true);
+
+	// позже контекст GL принадлежит потоку рендера
+	m_renderer = (const char*)glGetString(GL_RENDERER);
+	m_glVersion = (const char*)glGetString(GL_VERSION);
+
+	m_phase = m_settings.warmupFrames > 0 ? Phase::Warmup : Phase::Measure;
+	m_frame = 0;
+	m_active = true;
+	LOG_INFO(Benchmark, "Benchmark: {}, {} warm-up + {} measured frames", m_settings.scenePath,
+		m_settings.warmupFrames, m_settings.measuredFrames);
+	return true;
+}
+//=============================================================================
+bool Benchmark::IsFinished() const
+{
+	return m_active && m_phase == Phase::Drain && m_frame >= DrainFrames;
+}
+//=============================================================================
+double Benchmark::GetFixedDeltaTime() const
+{
+	const uint32_t frames = m_phase == Phase::Warmup ? m_settings.warmupFrames : m_settings.measuredFrames;
+	return frames > 1 ? m_spline.GetDuration() / double(frames - 1) : 0.0;
+}
+//=============================================================================
+float Benchmark::getSplineTime(uint32_t frame, uint32_t frameCount) const
+{
+	return frameCount > 1 ? m_spline.GetDuration() * float(frame) / float(frameCount - 1) : 0.0f;
+}
+//=============================================================================
+void Benchmark::BeginFrame(Camera& camera, uint64_t frameIndex)
+{
+	if (!m_active) return;
+
+	float splineTime = m_spline.GetDuration();
+	if (m_phase == Phase::Warmup)
+		splineTime = getSplineTime(m_frame, m_settings.warmupFrames);
+	else if (m_phase == Phase::Measure)
+		splineTime = getSplineTime(m_frame, m_settings.measuredFrames);
+
+	glm::vec3 position;
+	float yaw, pitch;
+	m_spline.Evaluate(splineTime, position, yaw, pitch);
+	camera.SetPosition(position);
+	camera.SetOrientation(yaw, pitch);
+
+	if (m_phase == Phase::Measure)
+	{
+		if (m_frame == 0) m_firstMeasuredFrame = frameIndex;
+		m_lastMeasuredFrame = frameIndex;
+	}
+	m_frameStart = std::chrono::steady_clock::now();
+}
+//=============================================================================
+void Benchmark::EndFrame()
+{
+	if (!m_active) return;
+
+	if (m_phase == Phase::Measure)
+	{
+		m_cpuFrameTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_frameStart).count());
+	}
+
+	m_frame++;
+	if (m_phase == Phase::Warmup && m_frame >= m_settings.warmupFrames)
+	{
+		m_phase = Phase::Measure;
+		m_frame = 0;
+	}
+	else if (m_phase == Phase::Measure && m_frame >= m_settings.measuredFrames)
+	{
+		m_phase = Phase::Drain;
+		m_frame = 0;
+	}
+}
+//=============================================================================
+void Benchmark::OnFrameRendered(const renderthread::FrameResult& result)
+{
+	if (!m_active || m_firstMeasuredFrame == ~0ull) return;
+
+	const bool measuredFramesKnown = m_phase == Phase::Drain;
+	if (result.frameIndex >= m_firstMeasuredFrame && (!measuredFramesKnown || result.frameIndex <= m_lastMeasuredFrame))
+	{
+		m_drawCalls += result.statistics.drawCalls;
+		m_triangles += result.statistics.triangles;
+		m_textureBinds += result.statistics.textureBinds;
+		m_stateCallsIssued += result.statistics.issuedCalls;
+		m_stateCallsFiltered += result.statistics.filteredCalls;
+		m_statisticsFrames++;
+
+		if (result.frameIndex == m_firstMeasuredFrame) m_firstGpuFrame = result.gpuFrameNumber;
+		if (measuredFramesKnown && result.frameIndex == m_lastMeasuredFrame) m_lastGpuFrame = result.gpuFrameNumber;
+	}
+
+	// запросы GPU читаются на несколько кадров позже, к этому моменту границы уже известны
+	if (result.resolvedGpuFrame != ~0ull && m_firstGpuFrame != ~0ull
+		&& result.resolvedGpuFrame >= m_firstGpuFrame && result.resolvedGpuFrame <= m_lastGpuFrame)
+		m_gpuFrameTimes.push_back(result.resolvedGpuTime);
+}
+//=============================================================================
+bool Benchmark::WriteResult() const
+{
+	FILE* file = fopen(m_settings.outputPath.c_str(), "w");
+	if (!file)
+	{
+		LOG_ERROR(Benchmark, "Failed to write benchmark result: {}", m_settings.outputPath);
+		return false;
+	}
+
+	const double frames = std::max(m_statisticsFrames, 1u);
+	const Percentiles cpu = computePercentiles(m_cpuFrameTimes);
+	const Percentiles gpu = computePercentiles(m_gpuFrameTimes);
+
+	fprintf(file, "{\n");
+	fprintf(file, "  \"scene\": \"%s\",\n", escapeJson(m_settings.scenePath).c_str());
+	fprintf(file, "  \"camera\": \"%s\",\n", escapeJson(m_settings.cameraPath).c_str());
+	fprintf(file, "  \"renderer\": \"%s\",\n", escapeJson(m_renderer).c_str());
+	fprintf(file, "  \"glVersion\": \"%s\",\n", escapeJson(m_glVersion).c_str());
+	fprintf(file, "  \"warmupFrames\": %u,\n", m_settings.warmupFrames);
+	fprintf(file, "  \"measuredFrames\": %u,\n", m_settings.measuredFrames);
+	writePercentiles(file, "cpuFrameTimeMs", cpu, m_cpuFrameTimes.size());
+	writePercentiles(file, "gpuFrameTimeMs", gpu, m_gpuFrameTimes.size());
+	fprintf(file, "  \"drawCalls\": %.2f,\n", double(m_drawCalls) / frames);
+	fprintf(file, "  \"triangles\": %.2f,\n", double(m_triangles) / frames);
+	fprintf(file, "  \"textureBinds\": %.2f,\n", double(m_textureBinds) / frames);
+	fprintf(file, "  \"stateCallsIssued\": %.2f,\n", double(m_stateCallsIssued) / frames);
+	fprintf(file, "  \"stateCallsFiltered\": %.2f\n", double(m_stateCallsFiltered) / frames);
+	fprintf(file, "}\n");
+	fclose(file);
+
+	LOG_INFO(Benchmark, "Benchmark: CPU p50/p95/p99 {:.3f}/{:.3f}/{:.3f} ms, GPU p50/p95/p99 {:.3f}/{:.3f}/{:.3f} ms",
+		cpu.p50, cpu.p95, cpu.p99, gpu.p50, gpu.p95, gpu.p99);
+	LOG_INFO(Benchmark, "Benchmark result saved: {}", m_settings.outputPath);
+	return true;
+}
+//=============================================================================
+int CompareBenchmarkResults(const std::string& baselinePath, const std::string& currentPath, double thresholdPercent)
+{
+	FlatJsonReader baseline, current;
+	if (!readResult(baselinePath, baseline) || !readResult(currentPath, current))
+		return 2;
+
+	if (baseline.strings["renderer"] != current.strings["renderer"])
+		LOG_WARNING(Benchmark, "Benchmark results come from different renderers: '{}' and '{}'", baseline.strings["renderer"], current.strings["renderer"]);
+	if (baseline.strings["scene"] != current.strings["scene"] || baseline.strings["camera"] != current.strings["camera"])
+		LOG_WARNING(Benchmark, "Benchmark results come from different scenes or camera paths");
+
+	// у всех метрик меньше - лучше
+	const char* metrics[] =
+	{
+		"cpuFrameTimeMs.p50", "cpuFrameTimeMs.p95", "cpuFrameTimeMs.p99",
+		"gpuFrameTimeMs.p50", "gpuFrameTimeMs.p95", "gpuFrameTimeMs.p99",
+		"drawCalls", "triangles", "textureBinds",
+	};
+
+	int regressions = 0;
+	LOG_INFO(Benchmark, "metric                    baseline      current     change");
+	for (const char* metric : metrics)
+	{
+		const auto base = baseline.numbers.find(metric);
+		const auto cur = current.numbers.find(metric);
+		if (base == baseline.numbers.end() || cur == current.numbers.end())
+		{
+			LOG_WARNING(Benchmark, "Metric is missing: {}", metric);
+			continue;
+		}
+
+		const double change = base->second > 0.0 ? (cur->second - base->second) / base->second * 100.0 : 0.0;
+		const bool isRegression = change > thresholdPercent;
+		LOG_INFO(Benchmark, "{:<22} {:12.3f} {:12.3f} {:+9.2f}%{}", metric, base->second, cur->second, change, isRegression ? "  REGRESSION" : "");
+		if (isRegression) regressions++;
+	}
+
+	if (regressions > 0)
+	{
+		LOG_ERROR(Benchmark, "{} metric(s) regressed by more than {}%", regressions, thresholdPercent);
+		return 1;
+	}
+	LOG_INFO(Benchmark, "No regressions");
+	return 0;
+}
+//=============================================================================
\ No newline at end of file
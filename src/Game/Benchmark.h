@@ -0,0 +1,92 @@
+﻿#pragma once
+
+class Camera;
+namespace renderthread { struct FrameResult; }
+
+// Воспроизводимый замер кадра: сцена из файла описания, камера по записанному сплайну,
+// N кадров прогрева и M замеряемых кадров с фиксированным шагом времени. Результат - JSON.
+// Без окна - вместе с --headless (HeadlessContext.h), в том числе на ферме под Linux с Mesa llvmpipe.
+struct BenchmarkSettings final
+{
+	std::string scenePath;
+	std::string cameraPath;
+	std::string outputPath{ "benchmark.json" };
+	uint32_t    warmupFrames{ 60 };
+	uint32_t    measuredFrames{ 600 };
+};
+
+// Сплайн Catmull-Rom по ключам "key <time> <x> <y> <z> <yaw> <pitch>"
+class CameraSpline final
+{
+public:
+	bool Load(const std::string& path);
+
+	void Evaluate(float time, glm::vec3& position, float& yaw, float& pitch) const;
+	float GetDuration() const { return m_keys.empty() ? 0.0f : m_keys.back().time; }
+
+private:
+	struct Key final
+	{
+		float     time;
+		glm::vec3 position;
+		float     yaw;
+		float     pitch;
+	};
+	std::vector<Key> m_keys;
+};
+
+class Benchmark final
+{
+public:
+	bool Init(const BenchmarkSettings& settings);
+
+	bool IsActive() const { return m_active; }
+	bool IsFinished() const;
+	double GetFixedDeltaTime() const;
+
+	// Вызывается потоком игры до сборки пакета кадра frameIndex
+	void BeginFrame(Camera& camera, uint64_t frameIndex);
+	// Вызывается после отправки пакета кадра
+	void EndFrame();
+	// Итоги кадров от потока рендера: статистика rhi и время GPU измеряемых кадров
+	void OnFrameRendered(const renderthread::FrameResult& result);
+
+	bool WriteResult() const;
+
+private:
+	enum class Phase : uint8_t
+	{
+		Warmup,
+		Measure,
+		Drain // дочитываем результаты GPU запросов измеренных кадров
+	};
+
+	float getSplineTime(uint32_t frame, uint32_t frameCount) const;
+
+	BenchmarkSettings m_settings;
+	CameraSpline      m_spline;
+	bool              m_active{ false };
+	Phase             m_phase{ Phase::Warmup };
+	uint32_t          m_frame{ 0 };
+	std::string       m_renderer;
+	std::string       m_glVersion;
+
+	std::chrono::steady_clock::time_point m_frameStart;
+	// измеряемые кадры: номера пакетов и соответствующие им номера кадров gpuprofiler
+	uint64_t            m_firstMeasuredFrame{ ~0ull };
+	uint64_t            m_lastMeasuredFrame{ ~0ull };
+	uint64_t            m_firstGpuFrame{ ~0ull };
+	uint64_t            m_lastGpuFrame{ ~0ull };
+
+	std::vector<double> m_cpuFrameTimes;
+	std::vector<double> m_gpuFrameTimes;
+	uint64_t            m_drawCalls{ 0 };
+	uint64_t            m_triangles{ 0 };
+	uint64_t            m_textureBinds{ 0 };
+	uint64_t            m_stateCallsIssued{ 0 };
+	uint64_t            m_stateCallsFiltered{ 0 };
+	uint32_t            m_statisticsFrames{ 0 };
+};
+
+// Сравнивает два результата. Возвращает код выхода процесса: 0 - регрессий нет, 1 - есть, 2 - ошибка чтения
+int CompareBenchmarkResults(const std::string& baselinePath, const std::string& currentPath, double thresholdPercent);
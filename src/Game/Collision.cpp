@@ -0,0 +1,927 @@
+﻿#include "stdafx.h"
+#include "Collision.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+#include "Log.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t BinCount = 16;
+	constexpr uint32_t MaxSahDepth = 32; // глубже - деление пополам: дерево не выходит за MaxDepth при любых данных
+	constexpr float    TraversalCost = 1.0f; // относительно проверки одного треугольника
+	constexpr float    Epsilon = 1e-6f;
+
+	float surfaceArea(const glm::vec3& min, const glm::vec3& max)
+	{
+		const glm::vec3 size = glm::max(max - min, glm::vec3(0.0f));
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
+	float lengthSquared(const glm::vec3& v)
+	{
+		return glm::dot(v, v);
+	}
+
+	// Луч против треугольника с двух сторон (Моллер - Трумбор): t по лучу
+	bool intersectTriangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& t)
+	{
+		const glm::vec3 edge1 = b - a;
+		const glm::vec3 edge2 = c - a;
+		const glm::vec3 p = glm::cross(direction, edge2);
+		const float determinant = glm::dot(edge1, p);
+		if (std::abs(determinant) < 1e-12f) return false;
+		const float inverse = 1.0f / determinant;
+		const glm::vec3 s = origin - a;
+		const float u = glm::dot(s, p) * inverse;
+		if (u < 0.0f || u > 1.0f) return false;
+		const glm::vec3 q = glm::cross(s, edge1);
+		const float v = glm::dot(direction, q) * inverse;
+		if (v < 0.0f || u + v > 1.0f) return false;
+		t = glm::dot(edge2, q) * inverse;
+		return true;
+	}
+
+	// Ближайшая к p точка треугольника (Эриксон, "Real-Time Collision Detection", 5.1.5)
+	glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+	{
+		const glm::vec3 ab = b - a;
+		const glm::vec3 ac = c - a;
+		const glm::vec3 ap = p - a;
+		const float d1 = glm::dot(ab, ap);
+		const float d2 = glm::dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+		const glm::vec3 bp = p - b;
+		const float d3 = glm::dot(ab, bp);
+		const float d4 = glm::dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3) return b;
+
+		const float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+		const glm::vec3 cp = p - c;
+		const float d5 = glm::dot(ab, cp);
+		const float d6 = glm::dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6) return c;
+
+		const float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+		const float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		const float denominator = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denominator) + ac * (vc * denominator);
+	}
+
+	// Ближайшие точки двух отрезков (там же, 5.1.9)
+	void closestPointsSegments(const glm::vec3& p1, const glm::vec3& q1, const glm::vec3& p2, const glm::vec3& q2, glm::vec3& c1, glm::vec3& c2)
+	{
+		const glm::vec3 d1 = q1 - p1;
+		const glm::vec3 d2 = q2 - p2;
+		const glm::vec3 r = p1 - p2;
+		const float a = glm::dot(d1, d1);
+		const float e = glm::dot(d2, d2);
+		const float f = glm::dot(d2, r);
+		float s = 0.0f;
+		float t = 0.0f;
+		if (a <= Epsilon && e <= Epsilon)
+		{
+			c1 = p1;
+			c2 = p2;
+			return;
+		}
+		if (a <= Epsilon)
+			t = std::clamp(f / e, 0.0f, 1.0f);
+		else
+		{
+			const float c = glm::dot(d1, r);
+			if (e <= Epsilon)
+				s = std::clamp(-c / a, 0.0f, 1.0f);
+			else
+			{
+				const float b = glm::dot(d1, d2);
+				const float denominator = a * e - b * b;
+				s = denominator != 0.0f ? std::clamp((b * f - c * e) / denominator, 0.0f, 1.0f) : 0.0f;
+				t = (b * s + f) / e;
+				if (t < 0.0f)
+				{
+					t = 0.0f;
+					s = std::clamp(-c / a, 0.0f, 1.0f);
+				}
+				else if (t > 1.0f)
+				{
+					t = 1.0f;
+					s = std::clamp((b - c) / a, 0.0f, 1.0f);
+				}
+			}
+		}
+		c1 = p1 + d1 * s;
+		c2 = p2 + d2 * t;
+	}
+
+	// Ближайшие точки отрезка и треугольника, квадрат расстояния. Пересекающий отрезок дает 0
+	float closestPointsSegmentTriangle(const glm::vec3& p, const glm::vec3& q, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c,
+		glm::vec3& onSegment, glm::vec3& onTriangle)
+	{
+		float t = 0.0f;
+		if (intersectTriangle(p, q - p, a, b, c, t) && t >= 0.0f && t <= 1.0f)
+		{
+			onSegment = onTriangle = p + (q - p) * t;
+			return 0.0f;
+		}
+
+		// иначе ближайшая пара - конец отрезка и треугольник или отрезок и ребро
+		onSegment = p;
+		onTriangle = closestPointOnTriangle(p, a, b, c);
+		float best = lengthSquared(onSegment - onTriangle);
+		auto consider = [&](const glm::vec3& segmentPoint, const glm::vec3& trianglePoint)
+		{
+			const float distance = lengthSquared(segmentPoint - trianglePoint);
+			if (distance < best)
+			{
+				best = distance;
+				onSegment = segmentPoint;
+				onTriangle = trianglePoint;
+			}
+		};
+		consider(q, closestPointOnTriangle(q, a, b, c));
+		const std::array<glm::vec3, 3> vertices{ a, b, c };
+		for (uint32_t i = 0; i < 3; i++)
+		{
+			glm::vec3 segmentPoint, edgePoint;
+			closestPointsSegments(p, q, vertices[i], vertices[(i + 1) % 3], segmentPoint, edgePoint);
+			consider(segmentPoint, edgePoint);
+		}
+		return best;
+	}
+
+	// Сфера радиуса radius, центр center + t * delta. Касание в t = 0 засчитывается, только если сфера
+	// уже задевает элемент и движется к нему
+	struct SphereSweep final
+	{
+		glm::vec3 center;
+		glm::vec3 delta;
+		float     radius;
+		float     t;       // лучшее касание, на входе - предел
+		glm::vec3 normal;
+		bool      hit{ false };
+
+		void report(float time, const glm::vec3& contactNormal)
+		{
+			t = time;
+			normal = contactNormal;
+			hit = true;
+		}
+
+		// Грань - выпуклый многоугольник (треугольник или параллелограмм)
+		template<size_t Count>
+		void face(const std::array<glm::vec3, Count>& vertices)
+		{
+			const glm::vec3 winding = glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]);
+			const float area = glm::length(winding);
+			if (area < Epsilon) return;
+			glm::vec3 planeNormal = winding / area;
+			float distance = glm::dot(center - vertices[0], planeNormal);
+			if (distance < 0.0f)
+			{
+				planeNormal = -planeNormal;
+				distance = -distance;
+			}
+			const float approach = glm::dot(delta, planeNormal);
+			if (approach >= 0.0f) return;
+
+			float time = 0.0f;
+			if (distance > radius)
+			{
+				time = (distance - radius) / -approach;
+				if (time > t) return;
+			}
+			const glm::vec3 contact = center + delta * time - planeNormal * std::min(distance, radius);
+			for (size_t i = 0; i < Count; i++)
+			{
+				if (glm::dot(glm::cross(vertices[(i + 1) % Count] - vertices[i], contact - vertices[i]), winding) < 0.0f) return;
+			}
+			report(time, planeNormal);
+		}
+
+		void edge(const glm::vec3& from, const glm::vec3& to)
+		{
+			const glm::vec3 direction = to - from;
+			const float lengthSq = lengthSquared(direction);
+			if (lengthSq < Epsilon) return;
+			const glm::vec3 offset = center - from;
+			// расстояние до прямой ребра: квадратное уравнение в проекции на плоскость, перпендикулярную ребру
+			const glm::vec3 offsetPerp = offset - direction * (glm::dot(offset, direction) / lengthSq);
+			const glm::vec3 deltaPerp = delta - direction * (glm::dot(delta, direction) / lengthSq);
+			const float a = lengthSquared(deltaPerp);
+			const float b = 2.0f * glm::dot(offsetPerp, deltaPerp);
+			const float c = lengthSquared(offsetPerp) - radius * radius;
+
+			float time = 0.0f;
+			if (c > 0.0f)
+			{
+				if (a < Epsilon) return;
+				const float discriminant = b * b - 4.0f * a * c;
+				if (discriminant < 0.0f) return;
+				time = (-b - std::sqrt(discriminant)) / (2.0f * a);
+				if (time < 0.0f || time > t) return;
+			}
+			else if (b >= 0.0f)
+				return;
+
+			const float s = glm::dot(offset + delta * time, direction) / lengthSq;
+			if (s < 0.0f || s > 1.0f) return;
+			const glm::vec3 away = center + delta * time - (from + direction * s);
+			const float awayLength = glm::length(away);
+			if (awayLength < Epsilon) return;
+			report(time, away / awayLength);
+		}
+
+		void vertex(const glm::vec3& point)
+		{
+			const glm::vec3 offset = center - point;
+			const float a = lengthSquared(delta);
+			const float b = 2.0f * glm::dot(offset, delta);
+			const float c = lengthSquared(offset) - radius * radius;
+
+			float time = 0.0f;
+			if (c > 0.0f)
+			{
+				if (a < Epsilon) return;
+				const float discriminant = b * b - 4.0f * a * c;
+				if (discriminant < 0.0f) return;
+				time = (-b - std::sqrt(discriminant)) / (2.0f * a);
+				if (time < 0.0f || time > t) return;
+			}
+			else if (b >= 0.0f)
+				return;
+
+			const glm::vec3 away = center + delta * time - point;
+			const float awayLength = glm::length(away);
+			if (awayLength < Epsilon) return;
+			report(time, away / awayLength);
+		}
+	};
+
+	// Капсула [bottom, bottom + axis] касается треугольника, когда нижняя сфера касается призмы - треугольника,
+	// вытянутого на -axis (сумма Минковского). Первое касание - по граням, ребрам и вершинам призмы
+	void sweepCapsuleTriangle(SphereSweep& sweep, const glm::vec3& axis, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+	{
+		sweep.face(std::array<glm::vec3, 3>{ a, b, c });
+		sweep.edge(a, b);
+		sweep.edge(b, c);
+		sweep.edge(c, a);
+		sweep.vertex(a);
+		sweep.vertex(b);
+		sweep.vertex(c);
+		if (lengthSquared(axis) < Epsilon) return;
+
+		const glm::vec3 a2 = a - axis;
+		const glm::vec3 b2 = b - axis;
+		const glm::vec3 c2 = c - axis;
+		sweep.face(std::array<glm::vec3, 3>{ a2, b2, c2 });
+		sweep.face(std::array<glm::vec3, 4>{ a, b, b2, a2 });
+		sweep.face(std::array<glm::vec3, 4>{ b, c, c2, b2 });
+		sweep.face(std::array<glm::vec3, 4>{ c, a, a2, c2 });
+		sweep.edge(a2, b2);
+		sweep.edge(b2, c2);
+		sweep.edge(c2, a2);
+		sweep.edge(a, a2);
+		sweep.edge(b, b2);
+		sweep.edge(c, c2);
+		sweep.vertex(a2);
+		sweep.vertex(b2);
+		sweep.vertex(c2);
+	}
+}
+//=============================================================================
+void CollisionMesh::AddModel(const Model& model, const glm::mat4& worldMatrix)
+{
+	for (size_t i = 0; i < model.GetNumMesh(); i++)
+	{
+		const Mesh& mesh = model.GetMesh(i);
+		if (const MeshGeometry* geometry = mesh.GetGeometry())
+			AddTriangles(geometry->positions.data(), geometry->indices.data(), geometry->indices.size(), worldMatrix * mesh.GetLocalTransform());
+	}
+}
+//=============================================================================
+void CollisionMesh::AddTriangles(const glm::vec3* positions, const uint32_t* indices, size_t indexCount, const glm::mat4& worldMatrix)
+{
+	m_triangles.reserve(m_triangles.size() + indexCount / 3);
+	for (size_t i = 0; i + 2 < indexCount; i += 3)
+	{
+		const Triangle triangle{
+			glm::vec3(worldMatrix * glm::vec4(positions[indices[i]], 1.0f)),
+			glm::vec3(worldMatrix * glm::vec4(positions[indices[i + 1]], 1.0f)),
+			glm::vec3(worldMatrix * glm::vec4(positions[indices[i + 2]], 1.0f))
+		};
+		// вырожденные треугольники ни с чем не сталкиваются, но занимали бы листья
+		if (lengthSquared(glm::cross(triangle.b - triangle.a, triangle.c - triangle.a)) > 1e-12f)
+			m_triangles.push_back(triangle);
+	}
+}
+//=============================================================================
+void CollisionMesh::Build()
+{
+	PROFILE_FUNCTION();
+	using Clock = std::chrono::steady_clock;
+	const Clock::time_point start = Clock::now();
+
+	m_nodes.clear();
+	m_statistics = {};
+	if (m_triangles.size() >= (1u << LeafCountShift)) [[unlikely]]
+	{
+		LOG_ERROR(Scene, "Collision mesh has {} triangles, limit is {}", m_triangles.size(), 1u << LeafCountShift);
+		m_triangles.resize((1u << LeafCountShift) - 1);
+	}
+	if (m_triangles.empty()) return;
+
+	std::vector<BuildItem> items(m_triangles.size());
+	glm::vec3 boundsMin(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+	for (uint32_t i = 0; i < (uint32_t)m_triangles.size(); i++)
+	{
+		const Triangle& triangle = m_triangles[i];
+		BuildItem& item = items[i];
+		item.min = glm::min(triangle.a, glm::min(triangle.b, triangle.c));
+		item.max = glm::max(triangle.a, glm::max(triangle.b, triangle.c));
+		item.center = (item.min + item.max) * 0.5f;
+		item.triangle = i;
+		boundsMin = glm::min(boundsMin, item.min);
+		boundsMax = glm::max(boundsMax, item.max);
+	}
+	const glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(Epsilon));
+	m_origin = boundsMin;
+	m_scale = 65535.0f / extent;
+	m_invScale = extent / 65535.0f;
+
+	m_nodes.reserve(m_triangles.size());
+	buildNode(items, 0, (uint32_t)items.size(), 1);
+
+	// треугольники листа подряд, в порядке дерева
+	std::vector<Triangle> sorted(m_triangles.size());
+	for (size_t i = 0; i < items.size(); i++)
+		sorted[i] = m_triangles[items[i].triangle];
+	m_triangles = std::move(sorted);
+	m_nodes.shrink_to_fit();
+
+	m_statistics.triangleCount = (uint32_t)m_triangles.size();
+	m_statistics.nodeCount = (uint32_t)m_nodes.size();
+	m_statistics.buildMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+//=============================================================================
+void CollisionMesh::Clear()
+{
+	m_triangles.clear();
+	m_nodes.clear();
+	m_statistics = {};
+}
+//=============================================================================
+bool CollisionMesh::Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, CollisionHit& hit) const
+{
+	bool found = false;
+	traverseSegment(origin, direction, glm::vec3(0.0f), maxDistance, [&](uint32_t first, uint32_t count, float& limit)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const Triangle& triangle = m_triangles[i];
+			float t = 0.0f;
+			if (!intersectTriangle(origin, direction, triangle.a, triangle.b, triangle.c, t) || t < 0.0f || t > limit) continue;
+			limit = t;
+			hit.distance = t;
+			hit.triangle = i;
+			found = true;
+		}
+	});
+	if (!found) return false;
+
+	const Triangle& triangle = m_triangles[hit.triangle];
+	glm::vec3 normal = glm::normalize(glm::cross(triangle.b - triangle.a, triangle.c - triangle.a));
+	if (glm::dot(normal, direction) > 0.0f) normal = -normal;
+	hit.point = origin + direction * hit.distance;
+	hit.normal = normal;
+	return true;
+}
+//=============================================================================
+bool CollisionMesh::SweepCapsule(const Capsule& capsule, const glm::vec3& displacement, CollisionHit& hit) const
+{
+	const glm::vec3 axis = capsule.top - capsule.bottom;
+	SphereSweep sweep{ capsule.bottom, displacement, capsule.radius, 1.0f, glm::vec3(0.0f) };
+	const glm::vec3 center = (capsule.bottom + capsule.top) * 0.5f;
+	const glm::vec3 extent = glm::abs(axis) * 0.5f + glm::vec3(capsule.radius);
+	traverseSegment(center, displacement, extent, 1.0f, [&](uint32_t first, uint32_t count, float& limit)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const Triangle& triangle = m_triangles[i];
+			const bool hadHit = sweep.hit;
+			const float previous = sweep.t;
+			sweepCapsuleTriangle(sweep, axis, triangle.a, triangle.b, triangle.c);
+			if (sweep.hit && (!hadHit || sweep.t < previous)) hit.triangle = i;
+		}
+		limit = sweep.t;
+	});
+	if (!sweep.hit) return false;
+
+	const Triangle& triangle = m_triangles[hit.triangle];
+	glm::vec3 onSegment;
+	closestPointsSegmentTriangle(capsule.bottom + displacement * sweep.t, capsule.top + displacement * sweep.t,
+		triangle.a, triangle.b, triangle.c, onSegment, hit.point);
+	hit.distance = sweep.t;
+	hit.normal = sweep.normal;
+	return true;
+}
+//=============================================================================
+bool CollisionMesh::FindPenetration(const Capsule& capsule, glm::vec3& correction) const
+{
+	const glm::vec3 center = (capsule.bottom + capsule.top) * 0.5f;
+	const glm::vec3 extent = glm::abs(capsule.top - capsule.bottom) * 0.5f + glm::vec3(capsule.radius);
+	float deepest = 0.0f;
+	traverseSegment(center, glm::vec3(0.0f), extent, 0.0f, [&](uint32_t first, uint32_t count, float&)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const Triangle& triangle = m_triangles[i];
+			glm::vec3 onSegment, onTriangle;
+			const float distanceSq = closestPointsSegmentTriangle(capsule.bottom, capsule.top, triangle.a, triangle.b, triangle.c, onSegment, onTriangle);
+			if (distanceSq >= capsule.radius * capsule.radius) continue;
+
+			glm::vec3 direction;
+			float depth;
+			if (distanceSq > Epsilon * Epsilon)
+			{
+				const float distance = std::sqrt(distanceSq);
+				direction = (onSegment - onTriangle) / distance;
+				depth = capsule.radius - distance;
+			}
+			else
+			{
+				// ось капсулы проходит сквозь треугольник: наружу по нормали, на сторону центра капсулы
+				direction = glm::normalize(glm::cross(triangle.b - triangle.a, triangle.c - triangle.a));
+				if (glm::dot(center - triangle.a, direction) < 0.0f) direction = -direction;
+				depth = capsule.radius - std::min(glm::dot(capsule.bottom - triangle.a, direction), glm::dot(capsule.top - triangle.a, direction));
+			}
+			if (depth > deepest)
+			{
+				deepest = depth;
+				correction = direction * depth;
+			}
+		}
+	});
+	return deepest > 0.0f;
+}
+//=============================================================================
+uint32_t CollisionMesh::buildNode(std::vector<BuildItem>& items, uint32_t begin, uint32_t end, uint32_t depth)
+{
+	const uint32_t index = (uint32_t)m_nodes.size();
+	m_nodes.emplace_back();
+	m_statistics.maxDepth = std::max(m_statistics.maxDepth, depth);
+
+	glm::vec3 boundsMin = items[begin].min;
+	glm::vec3 boundsMax = items[begin].max;
+	glm::vec3 centerMin = items[begin].center;
+	glm::vec3 centerMax = items[begin].center;
+	for (uint32_t i = begin + 1; i < end; i++)
+	{
+		boundsMin = glm::min(boundsMin, items[i].min);
+		boundsMax = glm::max(boundsMax, items[i].max);
+		centerMin = glm::min(centerMin, items[i].center);
+		centerMax = glm::max(centerMax, items[i].center);
+	}
+	setBounds(m_nodes[index], boundsMin, boundsMax);
+
+	const uint32_t count = end - begin;
+	auto makeLeaf = [&]
+	{
+		m_nodes[index].data = LeafFlag | (count - 1) << LeafCountShift | begin;
+		m_statistics.leafCount++;
+		return index;
+	};
+	if (count <= 2) return makeLeaf();
+
+	// SAH по корзинам центров: стоимость деления - площади половин, умноженные на число треугольников в них
+	uint32_t bestAxis = 0;
+	uint32_t bestSplit = 0;
+	float bestCost = std::numeric_limits<float>::max();
+	if (depth < MaxSahDepth)
+	{
+		for (uint32_t axis = 0; axis < 3; axis++)
+		{
+			const float axisExtent = centerMax[axis] - centerMin[axis];
+			if (axisExtent < Epsilon) continue;
+			const float binScale = BinCount / axisExtent;
+
+			struct Bin final
+			{
+				glm::vec3 min{ std::numeric_limits<float>::max() };
+				glm::vec3 max{ -std::numeric_limits<float>::max() };
+				uint32_t  count{ 0 };
+			};
+			std::array<Bin, BinCount> bins;
+			for (uint32_t i = begin; i < end; i++)
+			{
+				const uint32_t bin = std::min((uint32_t)((items[i].center[axis] - centerMin[axis]) * binScale), BinCount - 1);
+				bins[bin].min = glm::min(bins[bin].min, items[i].min);
+				bins[bin].max = glm::max(bins[bin].max, items[i].max);
+				bins[bin].count++;
+			}
+
+			// площади и числа слева от каждой границы, затем проход справа
+			std::array<float, BinCount - 1> leftCost;
+			Bin accumulated;
+			for (uint32_t i = 0; i < BinCount - 1; i++)
+			{
+				accumulated.min = glm::min(accumulated.min, bins[i].min);
+				accumulated.max = glm::max(accumulated.max, bins[i].max);
+				accumulated.count += bins[i].count;
+				leftCost[i] = accumulated.count > 0 ? surfaceArea(accumulated.min, accumulated.max) * (float)accumulated.count : 0.0f;
+			}
+			accumulated = {};
+			for (uint32_t i = BinCount - 1; i > 0; i--)
+			{
+				accumulated.min = glm::min(accumulated.min, bins[i].min);
+				accumulated.max = glm::max(accumulated.max, bins[i].max);
+				accumulated.count += bins[i].count;
+				if (accumulated.count == 0 || accumulated.count == count) continue;
+				const float cost = leftCost[i - 1] + surfaceArea(accumulated.min, accumulated.max) * (float)accumulated.count;
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+	}
+
+	uint32_t middle;
+	if (bestCost < std::numeric_limits<float>::max())
+	{
+		// лист дешевле деления - оставляем, если влезает в узел
+		const float area = surfaceArea(boundsMin, boundsMax);
+		if (count <= MaxLeafTriangles && bestCost >= (count - TraversalCost) * area) return makeLeaf();
+
+		const float binScale = BinCount / (centerMax[bestAxis] - centerMin[bestAxis]);
+		const auto split = std::partition(items.begin() + begin, items.begin() + end, [&](const BuildItem& item)
+		{
+			return std::min((uint32_t)((item.center[bestAxis] - centerMin[bestAxis]) * binScale), BinCount - 1) < bestSplit;
+		});
+		middle = (uint32_t)(split - items.begin());
+	}
+	else
+	{
+		// совпадающие центры или слишком глубоко: пополам по самой длинной оси центров
+		if (count <= MaxLeafTriangles && depth < MaxSahDepth) return makeLeaf();
+		const glm::vec3 centerExtent = centerMax - centerMin;
+		const uint32_t axis = centerExtent.x > centerExtent.y ? (centerExtent.x > centerExtent.z ? 0 : 2) : (centerExtent.y > centerExtent.z ? 1 : 2);
+		middle = begin + count / 2;
+		std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+			[axis](const BuildItem& a, const BuildItem& b) { return a.center[axis] < b.center[axis]; });
+	}
+	if (middle == begin || middle == end) middle = begin + count / 2;
+
+	buildNode(items, begin, middle, depth + 1);
+	const uint32_t right = buildNode(items, middle, end, depth + 1);
+	m_nodes[index].data = right;
+	return index;
+}
+//=============================================================================
+void CollisionMesh::setBounds(Node& node, const glm::vec3& min, const glm::vec3& max) const
+{
+	// округление наружу и еще на шаг, чтобы ошибки float не сузили узел
+	const glm::vec3 low = glm::floor((min - m_origin) * m_scale) - 1.0f;
+	const glm::vec3 high = glm::ceil((max - m_origin) * m_scale) + 1.0f;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		node.min[axis] = (uint16_t)std::clamp(low[axis], 0.0f, 65535.0f);
+		node.max[axis] = (uint16_t)std::clamp(high[axis], 0.0f, 65535.0f);
+	}
+}
+//=============================================================================
+void CollisionMesh::getBounds(const Node& node, glm::vec3& min, glm::vec3& max) const
+{
+	min = m_origin + glm::vec3(node.min[0], node.min[1], node.min[2]) * m_invScale;
+	max = m_origin + glm::vec3(node.max[0], node.max[1], node.max[2]) * m_invScale;
+}
+//=============================================================================
+template<typename F>
+void CollisionMesh::traverseSegment(const glm::vec3& origin, const glm::vec3& delta, const glm::vec3& extent, float limit, F&& function) const
+{
+	if (m_nodes.empty()) return;
+
+	glm::vec3 inverseDelta;
+	for (int axis = 0; axis < 3; axis++)
+		inverseDelta[axis] = std::abs(delta[axis]) > 1e-12f ? 1.0f / delta[axis] : 0.0f;
+
+	// вход отрезка в расширенные границы узла, false - не пересекает до limit
+	auto enter = [&](const Node& node, float& time)
+	{
+		glm::vec3 min, max;
+		getBounds(node, min, max);
+		min -= extent;
+		max += extent;
+		float t0 = 0.0f;
+		float t1 = limit;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (inverseDelta[axis] == 0.0f)
+			{
+				if (origin[axis] < min[axis] || origin[axis] > max[axis]) return false;
+				continue;
+			}
+			float near = (min[axis] - origin[axis]) * inverseDelta[axis];
+			float far = (max[axis] - origin[axis]) * inverseDelta[axis];
+			if (near > far) std::swap(near, far);
+			t0 = std::max(t0, near);
+			t1 = std::min(t1, far);
+			if (t0 > t1) return false;
+		}
+		time = t0;
+		return true;
+	};
+
+	struct Entry final
+	{
+		uint32_t node;
+		float    time;
+	};
+	std::array<Entry, MaxDepth + 1> stack;
+	uint32_t stackSize = 0;
+	float rootTime = 0.0f;
+	if (!enter(m_nodes[0], rootTime)) return;
+	stack[stackSize++] = { 0, rootTime };
+
+	while (stackSize > 0)
+	{
+		const Entry entry = stack[--stackSize];
+		if (entry.time > limit) continue;
+
+		const Node& node = m_nodes[entry.node];
+		if (node.data & LeafFlag)
+		{
+			function(node.data & ((1u << LeafCountShift) - 1), ((node.data & ~LeafFlag) >> LeafCountShift) + 1, limit);
+			continue;
+		}
+
+		// ближний потомок кладется последним и обходится первым
+		const uint32_t left = entry.node + 1;
+		const uint32_t right = node.data;
+		float leftTime = 0.0f;
+		float rightTime = 0.0f;
+		const bool hitLeft = enter(m_nodes[left], leftTime);
+		const bool hitRight = enter(m_nodes[right], rightTime);
+		if (hitLeft && hitRight)
+		{
+			const bool leftFirst = leftTime <= rightTime;
+			stack[stackSize++] = leftFirst ? Entry{ right, rightTime } : Entry{ left, leftTime };
+			stack[stackSize++] = leftFirst ? Entry{ left, leftTime } : Entry{ right, rightTime };
+		}
+		else if (hitLeft)
+			stack[stackSize++] = { left, leftTime };
+		else if (hitRight)
+			stack[stackSize++] = { right, rightTime };
+	}
+}
+//=============================================================================
+CharacterController::CharacterController(const CollisionMesh& mesh, const Settings& settings)
+	: m_mesh(mesh)
+	, m_settings(settings)
+	, m_minGroundNormalY(std::cos(glm::radians(settings.maxSlope)))
+{
+	m_settings.height = std::max(m_settings.height, m_settings.radius * 2.0f);
+}
+//=============================================================================
+glm::vec3 CharacterController::Move(const glm::vec3& displacement)
+{
+	PROFILE_FUNCTION();
+
+	const glm::vec3 up(0.0f, 1.0f, 0.0f);
+	const glm::vec3 start = m_position;
+	glm::vec3 position = m_position;
+	depenetrate(position);
+
+	// по горизонтали - скольжение вдоль стен; уперлись, стоя на земле - пробуем подняться на ступень
+	const glm::vec3 horizontal(displacement.x, 0.0f, displacement.z);
+	if (lengthSquared(horizontal) > Epsilon * Epsilon)
+	{
+		glm::vec3 moved = slide(position, horizontal, true);
+		const glm::vec3 progress = moved - position;
+		if (m_grounded && m_settings.stepHeight > 0.0f && lengthSquared(progress - horizontal) > lengthSquared(horizontal) * 0.01f)
+		{
+			const glm::vec3 raised = slide(position, up * m_settings.stepHeight, false);
+			glm::vec3 stepped = slide(raised, horizontal, true);
+			glm::vec3 stepNormal;
+			const glm::vec3 steppedProgress = stepped - position;
+			if (sweepDown(stepped, raised.y - position.y, stepNormal)
+				&& steppedProgress.x * steppedProgress.x + steppedProgress.z * steppedProgress.z > progress.x * progress.x + progress.z * progress.z + Epsilon)
+				moved = stepped;
+		}
+		position = moved;
+	}
+
+	// по вертикали: вниз - до пологой поверхности, по крутой соскальзываем
+	if (std::abs(displacement.y) > Epsilon)
+		position = slide(position, up * displacement.y, false);
+
+	// земля под ногами; стоявший на земле и не поднимающийся персонаж прижимается к ней - спуск по ступеням
+	const bool wasGrounded = m_grounded;
+	const bool snap = wasGrounded && displacement.y <= 0.0f;
+	glm::vec3 probed = position;
+	glm::vec3 groundNormal;
+	m_grounded = sweepDown(probed, m_settings.groundProbe + (snap ? m_settings.stepHeight : 0.0f), groundNormal);
+	m_groundNormal = m_grounded ? groundNormal : up;
+	if (m_grounded && snap) position = probed;
+
+	m_position = position;
+	return m_position - start;
+}
+//=============================================================================
+Capsule CharacterController::getCapsule(const glm::vec3& position) const
+{
+	return {
+		position + glm::vec3(0.0f, m_settings.radius, 0.0f),
+		position + glm::vec3(0.0f, m_settings.height - m_settings.radius, 0.0f),
+		m_settings.radius
+	};
+}
+//=============================================================================
+void CharacterController::depenetrate(glm::vec3& position) const
+{
+	for (uint32_t i = 0; i < m_settings.maxIterations; i++)
+	{
+		glm::vec3 correction;
+		if (!m_mesh.FindPenetration(getCapsule(position), correction)) break;
+		position += correction + glm::normalize(correction) * m_settings.skinWidth;
+	}
+}
+//=============================================================================
+glm::vec3 CharacterController::slide(const glm::vec3& start, const glm::vec3& displacement, bool horizontal) const
+{
+	glm::vec3 position = start;
+	glm::vec3 remaining = displacement;
+	glm::vec3 previousNormal(0.0f);
+	for (uint32_t i = 0; i < m_settings.maxIterations; i++)
+	{
+		const float length = glm::length(remaining);
+		if (length < 1e-5f) break;
+
+		CollisionHit hit;
+		if (!m_mesh.SweepCapsule(getCapsule(position), remaining, hit))
+		{
+			position += remaining;
+			break;
+		}
+		// до касания с зазором skinWidth
+		const glm::vec3 direction = remaining / length;
+		const float travel = std::max(hit.distance * length - m_settings.skinWidth, 0.0f);
+		position += direction * travel;
+		remaining -= direction * travel;
+
+		glm::vec3 normal = hit.normal;
+		if (!horizontal && remaining.y < 0.0f && isWalkable(normal)) break; // встали на землю
+		if (horizontal && !isWalkable(normal))
+		{
+			// стена: скольжение только вдоль нее, без подъема
+			normal.y = 0.0f;
+			if (lengthSquared(normal) < Epsilon) break;
+			normal = glm::normalize(normal);
+		}
+		remaining -= normal * glm::dot(remaining, normal);
+
+		// угол из двух плоскостей: только вдоль линии их пересечения
+		if (i > 0 && glm::dot(remaining, previousNormal) < 0.0f)
+		{
+			const glm::vec3 crease = glm::cross(previousNormal, normal);
+			if (lengthSquared(crease) < Epsilon) break;
+			const glm::vec3 creaseDirection = glm::normalize(crease);
+			remaining = creaseDirection * glm::dot(remaining, creaseDirection);
+		}
+		previousNormal = normal;
+	}
+	return position;
+}
+//=============================================================================
+bool CharacterController::sweepDown(glm::vec3& position, float distance, glm::vec3& normal) const
+{
+	if (distance <= 0.0f) return false;
+
+	const glm::vec3 down(0.0f, -distance, 0.0f);
+	CollisionHit hit;
+	if (!m_mesh.SweepCapsule(getCapsule(position), down, hit))
+	{
+		position += down;
+		return false;
+	}
+	position.y -= std::max(hit.distance * distance - m_settings.skinWidth, 0.0f);
+	normal = hit.normal;
+	if (!isWalkable(normal))
+	{
+		// касание ребра ступени дает наклонную нормаль; поверхность - под точкой касания, чуть дальше от оси капсулы
+		const glm::vec3 outward(hit.point.x - position.x, 0.0f, hit.point.z - position.z);
+		CollisionHit surface;
+		if (lengthSquared(outward) > Epsilon * Epsilon
+			&& m_mesh.Raycast(hit.point + glm::normalize(outward) * m_settings.skinWidth + glm::vec3(0.0f, m_settings.skinWidth, 0.0f),
+				glm::vec3(0.0f, -1.0f, 0.0f), m_settings.skinWidth * 2.0f, surface)
+			&& isWalkable(surface.normal))
+			normal = surface.normal;
+	}
+	return isWalkable(normal);
+}
+//=============================================================================
+bool collision::RunBenchmark(const Model& model)
+{
+	using Clock = std::chrono::steady_clock;
+	auto seconds = [](Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	};
+
+	CollisionMesh mesh;
+	mesh.AddModel(model, glm::mat4(1.0f));
+	mesh.Build();
+	if (mesh.IsEmpty())
+	{
+		LOG_ERROR(Benchmark, "Model has no static triangles for collision");
+		return false;
+	}
+
+	// первое построение уже было: дальше повторы с теми же треугольниками
+	constexpr uint32_t BuildIterations = 5;
+	double buildTotal = 0.0;
+	double buildMin = mesh.GetStatistics().buildMilliseconds;
+	for (uint32_t i = 0; i < BuildIterations; i++)
+	{
+		mesh.Build();
+		buildTotal += mesh.GetStatistics().buildMilliseconds;
+		buildMin = std::min(buildMin, mesh.GetStatistics().buildMilliseconds);
+	}
+	const CollisionMesh::Statistics& statistics = mesh.GetStatistics();
+	LOG_INFO(Benchmark, "Collision benchmark, threads: {}", jobs::GetThreadCount());
+	LOG_INFO(Benchmark, "  triangles: {}, nodes: {} ({} leaves, depth {}), {:.1f} KB nodes + {:.1f} KB triangles",
+		statistics.triangleCount, statistics.nodeCount, statistics.leafCount, statistics.maxDepth,
+		statistics.nodeCount * 16.0 / 1024.0, statistics.triangleCount * 36.0 / 1024.0);
+	LOG_INFO(Benchmark, "  build:              {:.2f} ms avg, {:.2f} ms min", buildTotal / BuildIterations, buildMin);
+
+	// запросы из случайных точек в границах модели, одинаковые для одного потока и задач
+	constexpr uint32_t QueryCount = 1 << 16;
+	const glm::vec3 boundsMin = model.GetBoundsMin();
+	const glm::vec3 boundsSize = model.GetBoundsMax() - model.GetBoundsMin();
+	const float maxDistance = glm::length(boundsSize);
+	std::mt19937 random(42);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::normal_distribution<float> normal(0.0f, 1.0f);
+	std::vector<glm::vec3> origins(QueryCount);
+	std::vector<glm::vec3> directions(QueryCount);
+	for (uint32_t i = 0; i < QueryCount; i++)
+	{
+		origins[i] = boundsMin + boundsSize * glm::vec3(unit(random), unit(random), unit(random));
+		glm::vec3 direction(normal(random), normal(random), normal(random));
+		directions[i] = lengthSquared(direction) > Epsilon ? glm::normalize(direction) : glm::vec3(0.0f, -1.0f, 0.0f);
+	}
+
+	auto measure = [&](const char* name, auto&& query)
+	{
+		std::atomic<uint32_t> hits{ 0 };
+		Clock::time_point start = Clock::now();
+		uint32_t serialHits = 0;
+		for (uint32_t i = 0; i < QueryCount; i++) serialHits += query(i) ? 1 : 0;
+		const double serial = QueryCount / seconds(start);
+
+		start = Clock::now();
+		jobs::ParallelFor(QueryCount, 256, [&](uint32_t begin, uint32_t end)
+		{
+			uint32_t count = 0;
+			for (uint32_t i = begin; i < end; i++) count += query(i) ? 1 : 0;
+			hits.fetch_add(count, std::memory_order_relaxed);
+		});
+		const double parallel = QueryCount / seconds(start);
+		LOG_INFO(Benchmark, "  {:<19} {:.2f} M/s, parallel {:.2f} M/s, hits {:.1f}%", name, serial / 1e6, parallel / 1e6,
+			100.0 * serialHits / QueryCount);
+	};
+
+	measure("raycast:", [&](uint32_t i)
+	{
+		CollisionHit hit;
+		return mesh.Raycast(origins[i], directions[i], maxDistance, hit);
+	});
+
+	const CharacterController::Settings controllerSettings;
+	measure("capsule sweep 1m:", [&](uint32_t i)
+	{
+		const Capsule capsule{ origins[i], origins[i] + glm::vec3(0.0f, controllerSettings.height - controllerSettings.radius * 2.0f, 0.0f), controllerSettings.radius };
+		CollisionHit hit;
+		return mesh.SweepCapsule(capsule, directions[i], hit);
+	});
+
+	// шаг персонажа за кадр 60 Гц: ходьба 5 м/с и падение
+	measure("controller move:", [&](uint32_t i)
+	{
+		CharacterController controller(mesh, controllerSettings);
+		controller.SetPosition(origins[i]);
+		controller.Move(glm::vec3(directions[i].x, 0.0f, directions[i].z) * (5.0f / 60.0f) + glm::vec3(0.0f, -0.1f, 0.0f));
+		return controller.IsGrounded();
+	});
+	return true;
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,152 @@
+﻿#pragma once
+
+#include "Graphics.h"
+
+// Капсула: центры нижней и верхней полусфер и радиус
+struct Capsule final
+{
+	glm::vec3 bottom{ 0.0f };
+	glm::vec3 top{ 0.0f };
+	float     radius{ 0.0f };
+};
+
+struct CollisionHit final
+{
+	float     distance{ 0.0f };   // Raycast - расстояние по лучу, SweepCapsule - доля перемещения
+	glm::vec3 point{ 0.0f };      // точка треугольника
+	glm::vec3 normal{ 0.0f };     // от геометрии к запросу
+	uint32_t  triangle{ 0 };
+};
+
+// Статическая геометрия уровня: треугольники моделей в мировых координатах и BVH по SAH над ними.
+// Узел дерева - 16 байт: границы квантованы в uint16 относительно границ всей геометрии (с округлением наружу,
+// поэтому узел только шире точного), потомки и листья - индексом. Левый потомок лежит сразу за родителем.
+// Запросы const и выполняются из любого числа потоков
+class CollisionMesh final
+{
+public:
+	struct Statistics final
+	{
+		uint32_t triangleCount{ 0 };
+		uint32_t nodeCount{ 0 };
+		uint32_t leafCount{ 0 };
+		uint32_t maxDepth{ 0 };
+		double   buildMilliseconds{ 0.0 };
+	};
+
+	// Меши модели без скиннинга с их локальными трансформами; дерево перестраивается в Build()
+	void AddModel(const Model& model, const glm::mat4& worldMatrix);
+	void AddTriangles(const glm::vec3* positions, const uint32_t* indices, size_t indexCount, const glm::mat4& worldMatrix);
+	void Build();
+	void Clear();
+	bool IsEmpty() const { return m_nodes.empty(); }
+
+	// direction - единичный
+	bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, CollisionHit& hit) const;
+	// Первое касание капсулы, движущейся на displacement; уже пересекающие капсулу треугольники дают касание в 0,
+	// если движение направлено в них
+	bool SweepCapsule(const Capsule& capsule, const glm::vec3& displacement, CollisionHit& hit) const;
+	// Самое глубокое пересечение капсулы с треугольником: сдвиг капсулы, убирающий его. false - пересечений нет
+	bool FindPenetration(const Capsule& capsule, glm::vec3& correction) const;
+
+	const Statistics& GetStatistics() const { return m_statistics; }
+
+private:
+	static constexpr uint32_t LeafFlag = 1u << 31;
+	static constexpr uint32_t LeafCountShift = 27;
+	static constexpr uint32_t MaxLeafTriangles = 1u << (31 - LeafCountShift);
+	static constexpr uint32_t MaxDepth = 64;
+
+	struct Node final
+	{
+		std::array<uint16_t, 3> min;
+		std::array<uint16_t, 3> max;
+		uint32_t                data; // лист: LeafFlag | (число - 1) << LeafCountShift | первый треугольник, иначе правый потомок
+	};
+	static_assert(sizeof(Node) == 16);
+
+	struct Triangle final
+	{
+		glm::vec3 a, b, c;
+	};
+
+	struct BuildItem final
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		glm::vec3 center;
+		uint32_t  triangle;
+	};
+
+	uint32_t buildNode(std::vector<BuildItem>& items, uint32_t begin, uint32_t end, uint32_t depth);
+	void setBounds(Node& node, const glm::vec3& min, const glm::vec3& max) const;
+	void getBounds(const Node& node, glm::vec3& min, glm::vec3& max) const;
+	// Листья, чьи границы пересекает отрезок origin + t * delta, t in [0, limit], с расширением границ на extent.
+	// function(first, count, limit&) может уменьшить limit - дальние узлы отсекаются, ближние обходятся первыми
+	template<typename F>
+	void traverseSegment(const glm::vec3& origin, const glm::vec3& delta, const glm::vec3& extent, float limit, F&& function) const;
+
+	std::vector<Triangle>  m_triangles;
+	std::vector<Node>      m_nodes;
+	glm::vec3              m_origin{ 0.0f };   // квантование: q = (p - m_origin) * m_scale
+	glm::vec3              m_scale{ 0.0f };
+	glm::vec3              m_invScale{ 0.0f };
+	Statistics             m_statistics;
+};
+
+// Капсула персонажа над CollisionMesh: движение со скольжением вдоль поверхностей, подъем на ступени
+// высотой до stepHeight и определение земли. Позиция - низ капсулы (ноги)
+class CharacterController final
+{
+public:
+	struct Settings final
+	{
+		float    radius{ 0.35f };
+		float    height{ 1.8f };       // полная, с полусферами
+		float    stepHeight{ 0.4f };
+		float    maxSlope{ 50.0f };    // градусов; круче - стена, по ней не поднимаются и на ней не стоят
+		float    skinWidth{ 0.01f };   // зазор до поверхности, чтобы следующий шаг не начинался в касании
+		float    groundProbe{ 0.1f };  // глубина поиска земли под ногами
+		uint32_t maxIterations{ 4 };   // плоскостей скольжения за одно перемещение
+	};
+
+	// Геометрия должна пережить контроллер
+	CharacterController(const CollisionMesh& mesh, const Settings& settings);
+
+	void SetPosition(const glm::vec3& position) { m_position = position; }
+	const glm::vec3& GetPosition() const { return m_position; }
+	Capsule GetCapsule() const { return getCapsule(m_position); }
+	const Settings& GetSettings() const { return m_settings; }
+
+	// Перемещение с учетом столкновений, возвращает фактический сдвиг
+	glm::vec3 Move(const glm::vec3& displacement);
+
+	// Результат последнего Move
+	bool IsGrounded() const { return m_grounded; }
+	const glm::vec3& GetGroundNormal() const { return m_groundNormal; }
+
+private:
+	Capsule getCapsule(const glm::vec3& position) const;
+	bool isWalkable(const glm::vec3& normal) const { return normal.y >= m_minGroundNormalY; }
+	// Выталкивает капсулу из геометрии, в которой она оказалась (телепорт, неточность предыдущих шагов)
+	void depenetrate(glm::vec3& position) const;
+	// Скольжение: до касания, затем остаток перемещения вдоль плоскости касания. horizontal - стены
+	// не превращают движение в подъем
+	glm::vec3 slide(const glm::vec3& position, const glm::vec3& displacement, bool horizontal) const;
+	// Спуск вниз не больше distance; true - встали на пологую поверхность
+	bool sweepDown(glm::vec3& position, float distance, glm::vec3& normal) const;
+
+	const CollisionMesh& m_mesh;
+	Settings             m_settings;
+	float                m_minGroundNormalY;
+	glm::vec3            m_position{ 0.0f };
+	bool                 m_grounded{ false };
+	glm::vec3            m_groundNormal{ 0.0f, 1.0f, 0.0f };
+};
+
+namespace collision
+{
+	// Построение дерева по модели и запросы в секунду: лучи, движения капсулы и контроллера, в один поток
+	// и задачами. Результат в лог
+	bool RunBenchmark(const Model& model);
+}
\ No newline at end of file
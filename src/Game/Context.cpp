@@ -1,6 +1,11 @@
 ﻿#include "stdafx.h"
 #include "Context.h"
-#include "CoreApp.h"
+#include "Log.h"
+#include "Render.h"
+#include "HeadlessContext.h"
+#include "FramePacket.h"
+#include "FrameAllocator.h"
+#include <stb/stb_image_write.h>
 //=============================================================================
 Context* thisContext{ nullptr };
 //=============================================================================
@@ -50,7 +55,7 @@ void handleKeyEvents(GLFWwindow* window, int key, int scancode, int action, int
 	//}
 
 	//std::string keyName = glfwGetKeyName(key, 0);
-	//Print(keyName + " - " + actionName);
+	//LOG_VERBOSE(Core, "{} - {}", keyName, actionName);
 }
 //=============================================================================
 void handleMouseButtonEvents(GLFWwindow* window, int button, int action, int mods) noexcept
@@ -89,7 +94,7 @@ void handleMouseButtonEvents(GLFWwindow* window, int button, int action, int mod
 	//	break;
 	//}
 
-	//Print(mouseButtonName + " - " + actionName);
+	//LOG_VERBOSE(Core, "{} - {}", mouseButtonName, actionName);
 }
 //=============================================================================
 void handleMousePositionEvents(GLFWwindow* window, double xpos, double ypos) noexcept
@@ -107,13 +112,52 @@ void handleFramebufferResizeEvents([[maybe_unused]] GLFWwindow* window, int widt
 	SetWindowSize(width, height);
 }
 //=============================================================================
-bool Context::Init(int windowWidth, int windowHeight, std::string_view title)
+bool Context::Init(int windowWidth, int windowHeight, std::string_view title, bool headless)
 {
-	glfwSetErrorCallback([](int e, const char* str) { Fatal("GLTF Context error(" + std::to_string(e) + "): " + str); });
+	m_headless = headless;
+	m_startTime = std::chrono::steady_clock::now();
+
+	if (m_headless)
+	{
+		if (!headless::Init(windowWidth, windowHeight))
+			return false;
+
+		if (!gladLoadGL(headless::GetProcAddress))
+		{
+			LOG_FATAL(Render, "Failed to initialize OpenGL context!");
+			return false;
+		}
+
+		m_frameWidth = std::max(windowWidth, 1);
+		m_frameHeight = std::max(windowHeight, 1);
+		m_screenAspect = (float)m_frameWidth / (float)m_frameHeight;
+
+		// остальной код рисует в кадровый буфер по умолчанию и не знает, что окна нет
+		m_offscreenFrameBuffer = std::make_shared<FrameBuffer>(m_frameWidth, m_frameHeight);
+		rhi::SetDefaultFramebuffer(m_offscreenFrameBuffer->GetID());
+
+		IMGUI_CHECKVERSION();
+		ImGui::CreateContext();
+		ImGui::GetIO().DisplaySize = ImVec2((float)m_frameWidth, (float)m_frameHeight);
+		ImGui::GetIO().IniFilename = nullptr;
+		ImGui_ImplOpenGL3_Init("#version 330 core");
+		ImGui_ImplOpenGL3_NewFrame(); // ресурсы бэкенда создаются здесь, пока контекст на этом потоке
+		ImGui::StyleColorsDark();
+
+		glViewport(0, 0, m_frameWidth, m_frameHeight);
+
+		m_lastFrameTime = getTime();
+
+		thisContext = this;
+		LOG_INFO(Render, "Headless OpenGL context: {}, {}", (const char*)glGetString(GL_VERSION), (const char*)glGetString(GL_RENDERER));
+		return true;
+	}
+
+	glfwSetErrorCallback([](int e, const char* str) { LOG_FATAL(Core, "GLFW error({}): {}", e, str); });
 
 	if (!glfwInit())
 	{
-		Fatal("glfwInit() failed!");
+		LOG_FATAL(Core, "glfwInit() failed!");
 		return false;
 	}
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -128,7 +172,7 @@ bool Context::Init(int windowWidth, int windowHeight, std::string_view title)
 	m_window = glfwCreateWindow(windowWidth, windowHeight, title.data(), nullptr, nullptr);
 	if (!m_window)
 	{
-		Fatal("Failed to create GLFW window!");
+		LOG_FATAL(Core, "Failed to create GLFW window!");
 		return false;
 	}
 
@@ -147,7 +191,7 @@ bool Context::Init(int windowWidth, int windowHeight, std::string_view title)
 
 	if (!gladLoadGL(glfwGetProcAddress))
 	{
-		Fatal("Failed to initialize OpenGL context!");
+		LOG_FATAL(Render, "Failed to initialize OpenGL context!");
 		return false;
 	}
 
@@ -155,11 +199,12 @@ bool Context::Init(int windowWidth, int windowHeight, std::string_view title)
 	ImGui::CreateContext();
 	ImGui_ImplGlfw_InitForOpenGL(m_window, true);
 	ImGui_ImplOpenGL3_Init("#version 330 core");
+	ImGui_ImplOpenGL3_NewFrame(); // ресурсы бэкенда создаются здесь, пока контекст на этом потоке
 	ImGui::StyleColorsDark();
 
 	glViewport(0, 0, m_frameWidth, m_frameHeight);
 
-	m_lastFrameTime = glfwGetTime();
+	m_lastFrameTime = getTime();
 
 	thisContext = this;
 	return true;
@@ -167,6 +212,19 @@ bool Context::Init(int windowWidth, int windowHeight, std::string_view title)
 //=============================================================================
 void Context::Close()
 {
+	if (m_headless)
+	{
+		if (ImGui::GetCurrentContext())
+		{
+			ImGui_ImplOpenGL3_Shutdown();
+			ImGui::DestroyContext();
+		}
+		m_offscreenFrameBuffer.reset();
+		headless::Close();
+		thisContext = nullptr;
+		return;
+	}
+
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
@@ -177,6 +235,7 @@ void Context::Close()
 //=============================================================================
 bool Context::ShouldClose() const
 {
+	if (m_headless) return false; // без окна закрыть некому, выход только через app::Exit()
 	return glfwWindowShouldClose(m_window);
 }
 //=============================================================================
@@ -212,33 +271,87 @@ GLFWwindow* Context::GetWindow()
 //=============================================================================
 void Context::BeginFrame()
 {
-	const double currentTime = glfwGetTime();
+	const double currentTime = getTime();
 	m_deltaTime = currentTime - m_lastFrameTime;
 	m_lastFrameTime = currentTime;
 }
 //=============================================================================
 void Context::BeginImgui()
 {
-	ImGui_ImplOpenGL3_NewFrame();
-	ImGui_ImplGlfw_NewFrame();
+	// ImGui_ImplOpenGL3_NewFrame() вызывает поток рендера перед отрисовкой
+	if (m_headless)
+	{
+		ImGuiIO& io = ImGui::GetIO();
+		io.DisplaySize = ImVec2((float)m_frameWidth, (float)m_frameHeight);
+		io.DeltaTime = m_deltaTime > 0.0 ? (float)m_deltaTime : 1.0f / 60.0f;
+	}
+	else
+	{
+		ImGui_ImplGlfw_NewFrame();
+	}
 	ImGui::NewFrame();
 }
 //=============================================================================
-void Context::EndImgui()
+void Context::EndImgui(ImGuiDrawDataCopy& drawData)
 {
 	ImGui::Render();
-	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+	drawData.Capture(ImGui::GetDrawData());
 }
 //=============================================================================
 void Context::EndFrame()
 {
+	framemem::EndFrame();
 	m_isResize = false;
-	glfwSwapBuffers(m_window);
+	if (m_headless) return;
 	glfwPollEvents();
 }
 //=============================================================================
+void Context::Present()
+{
+	if (m_headless)
+	{
+		glFlush();
+		return;
+	}
+	glfwSwapBuffers(m_window);
+}
+//=============================================================================
+void Context::MakeCurrent(bool current)
+{
+	if (m_headless)
+		headless::MakeCurrent(current);
+	else
+		glfwMakeContextCurrent(current ? m_window : nullptr);
+}
+//=============================================================================
+bool Context::SaveScreenshot(const std::string& path) const
+{
+	std::vector<uint8_t> pixels(size_t(m_frameWidth) * m_frameHeight * 4);
+	rhi::BindFramebuffer(0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, m_frameWidth, m_frameHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+	stbi_flip_vertically_on_write(1);
+	if (!stbi_write_png(path.c_str(), m_frameWidth, m_frameHeight, 4, pixels.data(), m_frameWidth * 4))
+	{
+		LOG_ERROR(Render, "Failed to save screenshot: {}", path);
+		return false;
+	}
+	LOG_INFO(Render, "Screenshot saved: {}", path);
+	return true;
+}
+//=============================================================================
+double Context::getTime() const
+{
+	if (m_headless)
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+	return glfwGetTime();
+}
+//=============================================================================
 glm::uvec2 Context::GetCursorPosition() const
-{	
+{
+	if (!m_window) return glm::uvec2{ 0 };
+
 	double xpos, ypos;
 	glfwGetCursorPos(m_window, &xpos, &ypos);
 	return glm::uvec2{ static_cast<glm::uint>(xpos), static_cast<glm::uint>(ypos) };
@@ -246,6 +359,7 @@ glm::uvec2 Context::GetCursorPosition() const
 //=============================================================================
 void Context::SetCursorPosition(const glm::uvec2& position)
 {
+	if (!m_window) return;
 	glfwSetCursorPos(m_window, static_cast<double>(position.x), static_cast<double>(position.y));
 }
 //=============================================================================
@@ -1,18 +1,29 @@
 ﻿#pragma once
 
+class FrameBuffer;
+class ImGuiDrawDataCopy;
+
 class Context final
 {
 public:
-	bool Init(int windowWidth, int windowHeight, std::string_view title);
+	// headless - контекст через EGL без окна, кадр рисуется в offscreen FrameBuffer
+	bool Init(int windowWidth, int windowHeight, std::string_view title, bool headless = false);
 	void Close();
 
 	bool ShouldClose() const;
 
+	// Поток игры: время кадра и события окна
 	void BeginFrame();
 	void BeginImgui();
-	void EndImgui();
+	// Завершает кадр ImGui и копирует его данные для потока рендера
+	void EndImgui(ImGuiDrawDataCopy& drawData);
 	void EndFrame();
 
+	// Поток рендера: вывод кадра на экран
+	void Present();
+	// Делает контекст GL текущим для вызывающего потока или отвязывает его
+	void MakeCurrent(bool current);
+
 	bool IsResize() const;
 
 	int GetWidth() const;
@@ -20,6 +31,10 @@ public:
 	float GetAspect() const;
 	double GetDeltaTime() const;
 	GLFWwindow* GetWindow();
+	bool IsHeadless() const { return m_headless; }
+
+	// Сохраняет текущее содержимое кадра в PNG (для эталонных изображений)
+	bool SaveScreenshot(const std::string& path) const;
 
 	glm::uvec2 GetCursorPosition() const;
 	void SetCursorPosition(const glm::uvec2& position);
@@ -27,7 +42,12 @@ public:
 private:
 	friend void SetWindowSize(int width, int height);
 
+	double getTime() const;
+
 	GLFWwindow* m_window{ nullptr };
+	bool        m_headless{ false };
+	std::shared_ptr<FrameBuffer> m_offscreenFrameBuffer;
+	std::chrono::steady_clock::time_point m_startTime;
 	int         m_frameWidth{ 0 };
 	int         m_frameHeight{ 0 };
 	float       m_screenAspect{ 0.0 };
@@ -0,0 +1,231 @@
+﻿#include "stdafx.h"
+#include "Crowd.h"
+#include "FramePacket.h"
+#include "GpuProfiler.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t AgentBindingPoint = 6;
+	constexpr uint32_t MaxCellsPerGroup = 64 * 1024;
+}
+//=============================================================================
+void Crowd::Init(const CrowdSettings& settings)
+{
+	m_settings = settings;
+}
+//=============================================================================
+void Crowd::Close()
+{
+	Clear();
+}
+//=============================================================================
+void Crowd::Clear()
+{
+	m_groups.clear();
+	m_instances.clear();
+	m_agents.clear();
+	m_instanceBuffer.reset();
+	m_agentBuffer.reset();
+	m_time = m_previousTime = 0.0;
+	m_statistics = {};
+}
+//=============================================================================
+bool Crowd::AddGroup(const CrowdGroupSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	const auto& model = settings.model;
+	if (!model || !model->GetSkeleton() || model->GetNumClips() == 0)
+	{
+		LOG_ERROR(Scene, "Crowd group needs a model with a skeleton and clips");
+		return false;
+	}
+
+	const glm::vec2 areaSize = settings.areaMax - settings.areaMin;
+	const uint32_t cellsX = (uint32_t)std::ceil(areaSize.x / m_settings.cellSize);
+	const uint32_t cellsZ = (uint32_t)std::ceil(areaSize.y / m_settings.cellSize);
+	if (areaSize.x <= 0.0f || areaSize.y <= 0.0f || cellsX * cellsZ > MaxCellsPerGroup)
+	{
+		LOG_ERROR(Scene, "Invalid crowd area: {} x {} m", areaSize.x, areaSize.y);
+		return false;
+	}
+
+	if (!model->GetVertexAnimation())
+	{
+		auto animation = VertexAnimation::Bake(*model, m_settings.bakeSettings);
+		if (!animation) return false;
+		model->SetVertexAnimation(std::move(animation));
+	}
+
+	Group group;
+	group.settings = settings;
+	group.animation = model->GetVertexAnimation();
+	const int32_t clip = settings.clip.empty() ? -1 : group.animation->FindClip(settings.clip);
+	if (!settings.clip.empty() && clip < 0)
+	{
+		LOG_ERROR(Scene, "Crowd model has no clip '{}'", settings.clip);
+		return false;
+	}
+
+	// персонажи раскладываются по ячейкам сетки, чтобы отсекать ячейки целиком
+	struct Agent final
+	{
+		MeshInstanceData instance;
+		glm::vec4        animation;
+	};
+	const uint32_t cellCount = cellsX * cellsZ;
+	std::vector<std::vector<Agent>> cellAgents(cellCount);
+	std::mt19937 random(settings.seed);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	for (uint32_t i = 0; i < settings.count; i++)
+	{
+		const glm::vec2 point = glm::mix(settings.areaMin, settings.areaMax, glm::vec2(uniform(random), uniform(random)));
+		const float yaw = uniform(random) * glm::two_pi<float>();
+		const uint32_t agentClip = clip >= 0 ? (uint32_t)clip : std::min((uint32_t)(uniform(random) * group.animation->GetClipCount()), (uint32_t)group.animation->GetClipCount() - 1);
+		const VertexAnimation::Clip& bakedClip = group.animation->GetClip(agentClip);
+		const float duration = float(bakedClip.frameCount - 1) / bakedClip.frameRate;
+		const float rate = glm::mix(settings.minRate, settings.maxRate, uniform(random));
+
+		Agent agent;
+		agent.instance.worldMatrix = glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(point.x, settings.height, point.y)), yaw, glm::vec3(0.0f, 1.0f, 0.0f));
+		agent.instance.tint = glm::vec4(glm::vec3(glm::mix(0.85f, 1.0f, uniform(random))), 1.0f);
+		// одинаковые персонажи с одним клипом не двигаются в такт
+		agent.animation = glm::vec4((float)agentClip, uniform(random) * duration, rate, 0.0f);
+
+		const glm::uvec2 cell = glm::min(glm::uvec2((point - settings.areaMin) / m_settings.cellSize), glm::uvec2(cellsX - 1, cellsZ - 1));
+		cellAgents[cell.y * cellsX + cell.x].push_back(agent);
+	}
+
+	// сфера персонажа вписывается в куб вокруг основания: радиус с запасом на смещение центра модели
+	const glm::vec3 boundsCenter = (model->GetBoundsMin() + model->GetBoundsMax()) * 0.5f;
+	const float boundsReach = glm::length(boundsCenter) + glm::length(model->GetBoundsMax() - model->GetBoundsMin()) * 0.5f;
+	const size_t firstGroupAgent = m_agents.size();
+	for (const auto& agents : cellAgents)
+	{
+		if (agents.empty()) continue;
+
+		Cell cell;
+		cell.firstAgent = (uint32_t)m_agents.size();
+		cell.agentCount = (uint32_t)agents.size();
+		cell.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+		cell.boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (const Agent& agent : agents)
+		{
+			const glm::vec3 position = agent.instance.worldMatrix[3];
+			cell.boundsMin = glm::min(cell.boundsMin, position - boundsReach);
+			cell.boundsMax = glm::max(cell.boundsMax, position + boundsReach);
+			m_instances.push_back(agent.instance);
+			m_agents.push_back(agent.animation);
+		}
+		group.cells.push_back(cell);
+	}
+
+	m_statistics.totalAgents = (uint32_t)m_agents.size();
+	m_statistics.totalCells += (uint32_t)group.cells.size();
+	bool newAnimation = true;
+	for (const Group& other : m_groups)
+	{
+		if (other.animation == group.animation) newAnimation = false;
+	}
+	if (newAnimation) m_statistics.textureBytes += group.animation->GetMemorySize();
+	LOG_INFO(Scene, "Crowd group: {} agents in {} cells", m_agents.size() - firstGroupAgent, group.cells.size());
+	m_groups.push_back(std::move(group));
+
+	// данные персонажей не меняются: буферы пересоздаются только при добавлении группы
+	if (!m_agents.empty())
+	{
+		m_instanceBuffer = std::make_shared<VertexBuffer>((unsigned int)(m_instances.size() * sizeof(MeshInstanceData)), m_instances.data());
+		m_agentBuffer = std::make_shared<StorageBuffer>(AgentBindingPoint, (uint32_t)(m_agents.size() * sizeof(glm::vec4)), m_agents.data());
+	}
+	return true;
+}
+//=============================================================================
+void Crowd::Advance(float deltaTime)
+{
+	m_previousTime = m_time;
+	m_time += deltaTime;
+}
+//=============================================================================
+void Crowd::BuildFramePacket(float alpha, FramePacket& packet)
+{
+	PROFILE_FUNCTION();
+
+	m_statistics.visibleCells = 0;
+	m_statistics.drawnAgents = 0;
+	m_statistics.draws = 0;
+	if (m_groups.empty()) return;
+
+	packet.crowdTime = (float)glm::mix(m_previousTime, m_time, (double)alpha);
+
+	const Frustum frustum = Frustum::FromMatrix(packet.camera.projection * packet.camera.view);
+	const glm::vec3 cameraPosition = packet.camera.cameraPosition;
+	const size_t firstDraw = packet.crowdDraws.size();
+	for (uint32_t groupIndex = 0; groupIndex < m_groups.size(); groupIndex++)
+	{
+		const Group& group = m_groups[groupIndex];
+		for (const Cell& cell : group.cells)
+		{
+			const float distance = glm::distance(glm::clamp(cameraPosition, cell.boundsMin, cell.boundsMax), cameraPosition);
+			if (distance > group.settings.cullDistance) continue;
+			if (!frustum.IsAABBVisible((cell.boundsMin + cell.boundsMax) * 0.5f, (cell.boundsMax - cell.boundsMin) * 0.5f)) continue;
+
+			m_statistics.visibleCells++;
+			m_statistics.drawnAgents += cell.agentCount;
+			// ячейки группы лежат подряд: соседние видимые ячейки рисуются одним вызовом
+			if (packet.crowdDraws.size() > firstDraw)
+			{
+				CrowdDraw& last = packet.crowdDraws.back();
+				if (last.group == groupIndex && last.firstAgent + last.agentCount == cell.firstAgent)
+				{
+					last.agentCount += cell.agentCount;
+					continue;
+				}
+			}
+			packet.crowdDraws.push_back({ groupIndex, cell.firstAgent, cell.agentCount });
+		}
+	}
+	m_statistics.draws = (uint32_t)(packet.crowdDraws.size() - firstDraw);
+}
+//=============================================================================
+void Crowd::RenderPacket(const FramePacket& packet, ShaderProgram& drawProgram)
+{
+	if (packet.crowdDraws.empty()) return;
+
+	PROFILE_FUNCTION();
+	GPU_PROFILE_SCOPE("Crowd");
+
+	drawProgram.Bind();
+	drawProgram.SetUniform1f("Time", packet.crowdTime);
+	m_agentBuffer->Bind();
+	const VertexAnimation* boundAnimation = nullptr;
+	for (const CrowdDraw& draw : packet.crowdDraws)
+	{
+		const Group& group = m_groups[draw.group];
+		if (group.animation.get() != boundAnimation)
+		{
+			boundAnimation = group.animation.get();
+			boundAnimation->Bind(drawProgram);
+		}
+		drawProgram.SetUniform1i("FirstAgent", (int)draw.firstAgent);
+		const Model& model = *group.settings.model;
+		for (size_t i = 0; i < model.GetNumMesh(); i++)
+		{
+			drawProgram.SetUniform1i("VertexOffset", (int)boundAnimation->GetMeshVertexOffset(i));
+			model.GetMesh(i).Draw(m_instanceBuffer->GetID(), draw.firstAgent, draw.agentCount);
+		}
+	}
+}
+//=============================================================================
+void Crowd::DrawImGui()
+{
+	if (m_groups.empty()) return;
+
+	ImGui::Begin("Crowd");
+	ImGui::Text("Groups: %zu, agents: %u, cells: %u", m_groups.size(), m_statistics.totalAgents, m_statistics.totalCells);
+	ImGui::Text("Visible cells: %u, drawn agents: %u in %u draws", m_statistics.visibleCells, m_statistics.drawnAgents, m_statistics.draws);
+	ImGui::Text("Animation textures: %.1f MB", m_statistics.textureBytes / (1024.0 * 1024.0));
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,98 @@
+﻿#pragma once
+
+#include "Graphics.h"
+#include "VertexAnimation.h"
+
+struct FramePacket;
+
+// Группа персонажей толпы: одна модель со скелетом, расставленная случайно на прямоугольнике XZ
+struct CrowdGroupSettings final
+{
+	std::shared_ptr<Model> model;
+	std::string clip;                // пусто - случайный клип у каждого персонажа
+	glm::vec2   areaMin{ -20.0f };
+	glm::vec2   areaMax{ 20.0f };
+	float       height{ 0.0f };      // высота основания персонажей
+	uint32_t    count{ 100 };
+	float       minRate{ 0.8f };     // скорость проигрывания клипа персонажа - случайная в [minRate, maxRate]
+	float       maxRate{ 1.2f };
+	float       cullDistance{ 150.0f };
+	uint32_t    seed{ 1 };
+};
+
+// Видимые подряд идущие персонажи одной группы, один вызов на меш модели
+struct CrowdDraw final
+{
+	uint32_t group;
+	uint32_t firstAgent;
+	uint32_t agentCount;
+};
+
+struct CrowdSettings final
+{
+	float                   cellSize{ 16.0f };
+	VertexAnimationSettings bakeSettings;
+};
+
+// Фоновые персонажи без скелета во время игры: анимация запечена в текстуры (VertexAnimation),
+// клип, сдвиг времени и скорость персонажа лежат в буфере хранения и не меняются. Вершинный шейдер
+// сам выбирает кадры по общему времени толпы, поэтому на CPU остается только отсечение ячеек
+class Crowd final
+{
+public:
+	struct Statistics final
+	{
+		uint32_t totalAgents{ 0 };
+		uint32_t totalCells{ 0 };
+		uint32_t visibleCells{ 0 };
+		uint32_t drawnAgents{ 0 };
+		uint32_t draws{ 0 };
+		size_t   textureBytes{ 0 }; // текстуры анимации всех моделей групп
+	};
+
+	void Init(const CrowdSettings& settings = {});
+	void Close();
+	void Clear();
+
+	// Расстановка и запекание анимации модели, если ее еще нет. Вызывается на потоке с контекстом GL до запуска потока рендера
+	bool AddGroup(const CrowdGroupSettings& settings);
+
+	// Тик фиксированного шага: только время толпы
+	void Advance(float deltaTime);
+	// Поток игры, после Scene::BuildFramePacket: камера берется из пакета, alpha - как у Transform::Interpolate
+	void BuildFramePacket(float alpha, FramePacket& packet);
+	// Поток рендера: drawProgram - шейдер толпы с выборкой вершин из текстур анимации
+	void RenderPacket(const FramePacket& packet, ShaderProgram& drawProgram);
+
+	const Statistics& GetStatistics() const { return m_statistics; }
+
+	void DrawImGui();
+
+private:
+	struct Cell final
+	{
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		uint32_t  firstAgent; // в общем массиве персонажей всех групп
+		uint32_t  agentCount;
+	};
+
+	struct Group final
+	{
+		CrowdGroupSettings               settings;
+		std::shared_ptr<VertexAnimation> animation;
+		std::vector<Cell>                cells;
+	};
+
+	CrowdSettings                  m_settings;
+	std::vector<Group>             m_groups;
+	std::vector<MeshInstanceData>  m_instances; // все группы подряд, внутри группы - по ячейкам
+	std::vector<glm::vec4>         m_agents;    // параллельно m_instances: клип, сдвиг времени, скорость
+	double                         m_time{ 0.0 };
+	double                         m_previousTime{ 0.0 };
+	Statistics                     m_statistics;
+
+	// Поток рендера
+	std::shared_ptr<VertexBuffer>  m_instanceBuffer;
+	std::shared_ptr<StorageBuffer> m_agentBuffer;
+};
\ No newline at end of file
@@ -0,0 +1,360 @@
+﻿#include "stdafx.h"
+#include "Entity.h"
+#include "Log.h"
+//=============================================================================
+namespace
+{
+	constexpr std::align_val_t ChunkAlignment{ 64 };
+
+	std::mutex                                                   componentMutex;
+	std::array<ecs::ComponentInfo, ecs::MaxComponentTypes>       componentInfos;
+	uint32_t                                                     componentCount = 0;
+
+	size_t alignUp(size_t offset, size_t alignment)
+	{
+		return (offset + alignment - 1) & ~(alignment - 1);
+	}
+}
+//=============================================================================
+uint32_t ecs::detail::RegisterComponent(const ComponentInfo& info)
+{
+	std::lock_guard lock(componentMutex);
+	if (componentCount == MaxComponentTypes) [[unlikely]]
+	{
+		LOG_FATAL(Scene, "Too many component types, limit is {}", MaxComponentTypes);
+		std::abort();
+	}
+	assert(info.alignment <= (size_t)ChunkAlignment);
+	componentInfos[componentCount] = info;
+	return componentCount++;
+}
+//=============================================================================
+const ecs::ComponentInfo& ecs::detail::GetComponentInfo(uint32_t id)
+{
+	// запись единственная и до первого возврата номера, дальше только чтение
+	return componentInfos[id];
+}
+//=============================================================================
+ecs::World::World() = default;
+//=============================================================================
+ecs::World::~World()
+{
+	Clear();
+}
+//=============================================================================
+void ecs::World::Destroy(Entity entity)
+{
+	assert(m_iterating == 0);
+	if (!IsAlive(entity)) return;
+
+	Location& location = m_locations[entity.index];
+	Archetype& archetype = *location.archetype;
+	for (uint32_t id : archetype.m_components)
+	{
+		const ComponentInfo& info = detail::GetComponentInfo(id);
+		if (!info.trivial) info.destroy(componentAddress(location, id));
+	}
+	removeRow(archetype, location.chunk, location.row);
+
+	location.archetype = nullptr;
+	location.generation++;
+	m_freeSlots.push_back(entity.index);
+	m_entityCount--;
+}
+//=============================================================================
+void ecs::World::Clear()
+{
+	assert(m_iterating == 0);
+	for (auto& archetype : m_archetypes)
+	{
+		for (Chunk& chunk : archetype->m_chunks)
+		{
+			for (uint32_t id : archetype->m_components)
+			{
+				const ComponentInfo& info = detail::GetComponentInfo(id);
+				if (info.trivial) continue;
+				std::byte* column = static_cast<std::byte*>(archetype->GetColumn(chunk, id));
+				for (uint32_t row = 0; row < chunk.count; row++)
+					info.destroy(column + (size_t)row * info.size);
+			}
+			::operator delete(chunk.data, ChunkAlignment);
+		}
+		archetype->m_chunks.clear();
+		archetype->m_entityCount = 0;
+	}
+
+	// поколения сохраняются: старые ссылки не должны ожить в новых сущностях
+	m_freeSlots.clear();
+	for (uint32_t index = (uint32_t)m_locations.size(); index-- > 0;)
+	{
+		Location& location = m_locations[index];
+		if (location.archetype)
+		{
+			location.archetype = nullptr;
+			location.generation++;
+		}
+		m_freeSlots.push_back(index);
+	}
+	m_entityCount = 0;
+}
+//=============================================================================
+size_t ecs::World::GetChunkCount() const
+{
+	size_t count = 0;
+	for (const auto& archetype : m_archetypes)
+		count += archetype->m_chunks.size();
+	return count;
+}
+//=============================================================================
+ecs::Archetype* ecs::World::getArchetype(ComponentMask mask)
+{
+	if (auto it = m_archetypesByMask.find(mask); it != m_archetypesByMask.end())
+		return it->second;
+
+	auto archetype = std::make_unique<Archetype>();
+	archetype->m_mask = mask;
+	size_t rowSize = sizeof(Entity);
+	for (ComponentMask bits = mask; bits != 0; bits &= bits - 1)
+	{
+		const uint32_t id = (uint32_t)std::countr_zero(bits);
+		archetype->m_components.push_back(id);
+		rowSize += detail::GetComponentInfo(id).size;
+	}
+
+	// колонки одна за другой с выравниванием типа; если с отступами не влезло - на строку меньше
+	auto layout = [&archetype](uint32_t capacity)
+	{
+		size_t offset = sizeof(Entity) * capacity;
+		for (uint32_t id : archetype->m_components)
+		{
+			const ComponentInfo& info = detail::GetComponentInfo(id);
+			offset = alignUp(offset, info.alignment);
+			archetype->m_columnOffsets[id] = (uint32_t)offset;
+			offset += (size_t)info.size * capacity;
+		}
+		return offset;
+	};
+	uint32_t capacity = (uint32_t)std::max<size_t>(ChunkSize / rowSize, 1);
+	size_t chunkBytes = layout(capacity);
+	while (capacity > 1 && chunkBytes > ChunkSize)
+		chunkBytes = layout(--capacity);
+	archetype->m_capacity = capacity;
+	archetype->m_chunkBytes = std::max(chunkBytes, ChunkSize);
+
+	Archetype* result = archetype.get();
+	m_archetypes.push_back(std::move(archetype));
+	m_archetypesByMask.emplace(mask, result);
+	return result;
+}
+//=============================================================================
+const std::vector<ecs::Archetype*>& ecs::World::getQuery(ComponentMask mask)
+{
+	// архетипы только добавляются, поэтому запросу достаточно досмотреть новые
+	Query& query = m_queries[mask];
+	for (; query.checkedArchetypes < m_archetypes.size(); query.checkedArchetypes++)
+	{
+		Archetype* archetype = m_archetypes[query.checkedArchetypes].get();
+		if ((archetype->m_mask & mask) == mask) query.archetypes.push_back(archetype);
+	}
+	return query.archetypes;
+}
+//=============================================================================
+ecs::Entity ecs::World::createEntity(Archetype* archetype)
+{
+	assert(m_iterating == 0);
+	uint32_t index;
+	if (!m_freeSlots.empty())
+	{
+		index = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	else
+	{
+		index = (uint32_t)m_locations.size();
+		m_locations.emplace_back();
+	}
+	allocateRow(*archetype, index);
+	m_entityCount++;
+	return { index, m_locations[index].generation };
+}
+//=============================================================================
+void ecs::World::allocateRow(Archetype& archetype, uint32_t index)
+{
+	if (archetype.m_chunks.empty() || archetype.m_chunks.back().count == archetype.m_capacity)
+		archetype.m_chunks.push_back({ static_cast<std::byte*>(::operator new(archetype.m_chunkBytes, ChunkAlignment)), 0 });
+
+	Chunk& chunk = archetype.m_chunks.back();
+	Location& location = m_locations[index];
+	location.archetype = &archetype;
+	location.chunk = (uint32_t)archetype.m_chunks.size() - 1;
+	location.row = chunk.count++;
+	archetype.GetEntities(chunk)[location.row] = { index, location.generation };
+	archetype.m_entityCount++;
+}
+//=============================================================================
+void ecs::World::removeRow(Archetype& archetype, uint32_t chunkIndex, uint32_t row)
+{
+	Chunk& last = archetype.m_chunks.back();
+	const uint32_t lastChunk = (uint32_t)archetype.m_chunks.size() - 1;
+	const uint32_t lastRow = last.count - 1;
+	if (chunkIndex != lastChunk || row != lastRow)
+	{
+		// дыру закрывает последняя строка архетипа
+		Chunk& chunk = archetype.m_chunks[chunkIndex];
+		for (uint32_t id : archetype.m_components)
+		{
+			const ComponentInfo& info = detail::GetComponentInfo(id);
+			std::byte* destination = static_cast<std::byte*>(archetype.GetColumn(chunk, id)) + (size_t)row * info.size;
+			std::byte* source = static_cast<std::byte*>(archetype.GetColumn(last, id)) + (size_t)lastRow * info.size;
+			if (info.trivial)
+				std::memcpy(destination, source, info.size);
+			else
+				info.relocate(destination, source);
+		}
+		const Entity moved = archetype.GetEntities(last)[lastRow];
+		archetype.GetEntities(chunk)[row] = moved;
+		m_locations[moved.index].chunk = chunkIndex;
+		m_locations[moved.index].row = row;
+	}
+
+	if (--last.count == 0)
+	{
+		::operator delete(last.data, ChunkAlignment);
+		archetype.m_chunks.pop_back();
+	}
+	archetype.m_entityCount--;
+}
+//=============================================================================
+void ecs::World::moveEntity(Entity entity, uint32_t id, bool add)
+{
+	assert(m_iterating == 0);
+	const Location source = m_locations[entity.index];
+	Archetype& from = *source.archetype;
+	Archetype*& edge = add ? from.m_addEdges[id] : from.m_removeEdges[id];
+	if (!edge) edge = getArchetype(add ? from.m_mask | ComponentMask{ 1 } << id : from.m_mask & ~(ComponentMask{ 1 } << id));
+	Archetype& to = *edge;
+
+	allocateRow(to, entity.index);
+	const Location& destination = m_locations[entity.index];
+	for (uint32_t component : from.m_components)
+	{
+		const ComponentInfo& info = detail::GetComponentInfo(component);
+		void* sourceAddress = componentAddress(source, component);
+		if (!to.HasComponent(component))
+		{
+			if (!info.trivial) info.destroy(sourceAddress);
+		}
+		else if (info.trivial)
+			std::memcpy(componentAddress(destination, component), sourceAddress, info.size);
+		else
+			info.relocate(componentAddress(destination, component), sourceAddress);
+	}
+	removeRow(from, source.chunk, source.row);
+}
+//=============================================================================
+void ecs::RunBenchmark(uint32_t entityCount)
+{
+	using Clock = std::chrono::steady_clock;
+	auto milliseconds = [](Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	};
+
+	struct Position final { glm::vec3 value; };
+	struct Velocity final { glm::vec3 value; };
+	struct Health final { float value; };
+	struct Frozen final { uint8_t reason; };
+
+	// узел прежней сцены: все поля в одном объекте в куче, обход по вектору указателей
+	struct HeapNode final
+	{
+		glm::mat4   worldMatrix{ 1.0f };
+		glm::vec3   position{ 0.0f };
+		glm::vec3   velocity{ 0.0f };
+		float       health{ 100.0f };
+		bool        frozen{ false };
+		std::array<std::byte, 96> rest{}; // трансформ прошлого тика, модель, аниматор, потомки
+	};
+
+	constexpr uint32_t Iterations = 10;
+	constexpr float DeltaTime = 1.0f / 60.0f;
+	LOG_INFO(Scene, "ECS benchmark, entities: {}, threads: {}", entityCount, jobs::GetThreadCount());
+
+	World world;
+	std::vector<Entity> entities(entityCount);
+	// четыре архетипа: у половины есть здоровье, у каждой четвертой - заморозка
+	auto start = Clock::now();
+	for (uint32_t i = 0; i < entityCount; i++)
+	{
+		const glm::vec3 position{ (float)(i % 1000), 0.0f, (float)(i / 1000) };
+		const glm::vec3 velocity{ 1.0f, 0.5f * (float)(i % 7), -1.0f };
+		if (i % 4 == 0)
+			entities[i] = world.Create(Position{ position }, Velocity{ velocity }, Frozen{ 1 });
+		else if (i % 2 == 0)
+			entities[i] = world.Create(Position{ position }, Velocity{ velocity }, Health{ 100.0f });
+		else
+			entities[i] = world.Create(Position{ position }, Velocity{ velocity });
+	}
+	LOG_INFO(Scene, "  create:             {:.2f} ms, {} archetypes, {} chunks", milliseconds(start), world.GetArchetypeCount(), world.GetChunkCount());
+
+	auto integrate = [](Position& position, const Velocity& velocity) { position.value += velocity.value * DeltaTime; };
+	auto report = [entityCount](const char* name, double total)
+	{
+		const double perIteration = total / Iterations;
+		LOG_INFO(Scene, "  {:<19} {:.3f} ms, {:.2f} ns/entity", name, perIteration, perIteration * 1e6 / entityCount);
+	};
+
+	start = Clock::now();
+	for (uint32_t i = 0; i < Iterations; i++) world.ForEach<Position, Velocity>(integrate);
+	report("ForEach:", milliseconds(start));
+
+	start = Clock::now();
+	for (uint32_t i = 0; i < Iterations; i++) world.ParallelForEach<Position, Velocity>(integrate);
+	report("ParallelForEach:", milliseconds(start));
+
+	// запрос по части архетипов: куски без здоровья не читаются вовсе
+	start = Clock::now();
+	for (uint32_t i = 0; i < Iterations; i++)
+		world.ParallelForEach<Health, Velocity>([](Health& health, const Velocity& velocity) { health.value -= velocity.value.y * DeltaTime; });
+	report("subset query:", milliseconds(start));
+
+	// перенос между архетипами: снятие заморозки у четверти сущностей
+	start = Clock::now();
+	for (uint32_t i = 0; i < entityCount; i += 4) world.Remove<Frozen>(entities[i]);
+	LOG_INFO(Scene, "  remove component:   {:.2f} ms for {} entities", milliseconds(start), (entityCount + 3) / 4);
+
+	{
+		std::vector<std::unique_ptr<HeapNode>> storage(entityCount);
+		std::vector<HeapNode*> nodes(entityCount);
+		for (uint32_t i = 0; i < entityCount; i++)
+		{
+			storage[i] = std::make_unique<HeapNode>();
+			storage[i]->velocity = { 1.0f, 0.5f * (float)(i % 7), -1.0f };
+			nodes[i] = storage[i].get();
+		}
+		// узлы добавлялись в сцену не в порядке выделения памяти
+		std::shuffle(nodes.begin(), nodes.end(), std::mt19937(42));
+
+		start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++)
+		{
+			for (HeapNode* node : nodes) node->position += node->velocity * DeltaTime;
+		}
+		report("heap nodes:", milliseconds(start));
+
+		start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++)
+		{
+			jobs::ParallelFor(entityCount, 4096, [&nodes](uint32_t begin, uint32_t end)
+			{
+				for (uint32_t j = begin; j < end; j++) nodes[j]->position += nodes[j]->velocity * DeltaTime;
+			});
+		}
+		report("heap parallel:", milliseconds(start));
+	}
+
+	start = Clock::now();
+	for (const Entity entity : entities) world.Destroy(entity);
+	LOG_INFO(Scene, "  destroy:            {:.2f} ms", milliseconds(start));
+}
+//=============================================================================
\ No newline at end of file
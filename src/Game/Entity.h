@@ -0,0 +1,322 @@
+﻿#pragma once
+
+#include "JobSystem.h"
+
+// Сущности и компоненты по архетипам: сущности с одинаковым набором компонентов лежат в кусках своего
+// архетипа, каждый компонент - отдельная плотная колонка (SoA). Обход запроса идет по кускам подряд,
+// без указателей на объекты в куче. Добавление и удаление компонента переносит сущность в другой архетип.
+// Не потокобезопасно для изменений; обход ParallelForEach читает и пишет компоненты из задач, но создавать,
+// удалять сущности и менять их набор компонентов во время обхода нельзя
+namespace ecs
+{
+	constexpr uint32_t MaxComponentTypes = 64;
+	constexpr size_t   ChunkSize = 16 * 1024;
+
+	using ComponentMask = uint64_t;
+
+	// Ссылка на сущность: слот и поколение. Слот удаленной сущности переиспользуется с новым поколением,
+	// поэтому старая ссылка не попадет в чужую сущность
+	struct Entity final
+	{
+		uint32_t index{ ~0u };
+		uint32_t generation{ 0 };
+
+		bool IsNull() const { return index == ~0u; }
+		bool operator==(const Entity& other) const = default;
+		// Для хранения вне ECS, например в объекте сценария
+		uint64_t ToBits() const { return (uint64_t)generation << 32 | index; }
+		static Entity FromBits(uint64_t bits) { return { (uint32_t)bits, (uint32_t)(bits >> 32) }; }
+	};
+
+	// Операции над компонентом без знания типа: хранение в колонках и перенос между архетипами
+	struct ComponentInfo final
+	{
+		uint32_t size;
+		uint32_t alignment;
+		bool     trivial;                              // перенос копированием байт
+		void   (*relocate)(void* destination, void* source); // конструирует перемещением и разрушает источник
+		void   (*destroy)(void* object);
+	};
+
+	namespace detail
+	{
+		uint32_t RegisterComponent(const ComponentInfo& info);
+		const ComponentInfo& GetComponentInfo(uint32_t id);
+	}
+
+	// Номер типа компонента, общий для всех миров
+	template<typename T>
+	uint32_t GetComponentId()
+	{
+		// const в запросе - только обещание не писать в колонку
+		if constexpr (!std::is_same_v<T, std::remove_cv_t<T>>)
+			return GetComponentId<std::remove_cv_t<T>>();
+		else
+		{
+			static_assert(std::is_nothrow_move_constructible_v<T>);
+			static const uint32_t id = detail::RegisterComponent({
+				(uint32_t)sizeof(T),
+				(uint32_t)alignof(T),
+				std::is_trivially_copyable_v<T>,
+				[](void* destination, void* source)
+				{
+					new (destination) T(std::move(*static_cast<T*>(source)));
+					static_cast<T*>(source)->~T();
+				},
+				[](void* object) { static_cast<T*>(object)->~T(); }
+			});
+			return id;
+		}
+	}
+
+	template<typename... Components>
+	ComponentMask GetComponentMask()
+	{
+		return (ComponentMask{ 0 } | ... | (ComponentMask{ 1 } << GetComponentId<Components>()));
+	}
+
+	class Archetype;
+
+	// Кусок архетипа: ChunkSize байт, в начале сущности, затем колонки компонентов
+	struct Chunk final
+	{
+		std::byte* data;
+		uint32_t   count;
+	};
+
+	// Набор компонентов и его куски. Все куски, кроме последнего, заполнены: удаление переносит
+	// на место удаленной последнюю сущность архетипа
+	class Archetype final
+	{
+	public:
+		ComponentMask GetMask() const { return m_mask; }
+		uint32_t GetChunkCapacity() const { return m_capacity; }
+		size_t GetChunkCount() const { return m_chunks.size(); }
+		size_t GetEntityCount() const { return m_entityCount; }
+		const Chunk& GetChunk(size_t index) const { return m_chunks[index]; }
+
+		bool HasComponent(uint32_t id) const { return (m_mask >> id) & 1; }
+		Entity* GetEntities(const Chunk& chunk) const { return reinterpret_cast<Entity*>(chunk.data); }
+		// Колонка компонента в куске; компонент должен быть в архетипе
+		void* GetColumn(const Chunk& chunk, uint32_t id) const { return chunk.data + m_columnOffsets[id]; }
+
+	private:
+		friend class World;
+
+		ComponentMask                            m_mask{ 0 };
+		std::vector<uint32_t>                    m_components;      // номера типов по возрастанию
+		std::array<uint32_t, MaxComponentTypes>  m_columnOffsets{}; // по номеру типа
+		uint32_t                                 m_capacity{ 0 };
+		size_t                                   m_chunkBytes{ ChunkSize }; // больше ChunkSize, если строка в него не влезает
+		std::vector<Chunk>                       m_chunks;
+		size_t                                   m_entityCount{ 0 };
+		std::array<Archetype*, MaxComponentTypes> m_addEdges{};    // архетип с компонентом, по номеру типа
+		std::array<Archetype*, MaxComponentTypes> m_removeEdges{}; // архетип без компонента
+	};
+
+	// Кусок при обходе запроса: колонки компонентов как массивы из GetCount() элементов
+	class ChunkView final
+	{
+	public:
+		ChunkView(const Archetype& archetype, const Chunk& chunk) : m_archetype(&archetype), m_chunk(&chunk) {}
+
+		uint32_t GetCount() const { return m_chunk->count; }
+		const Entity* GetEntities() const { return m_archetype->GetEntities(*m_chunk); }
+		// Компонент, который есть в запросе
+		template<typename T>
+		T* Get() const
+		{
+			assert(m_archetype->HasComponent(GetComponentId<T>()));
+			return static_cast<T*>(m_archetype->GetColumn(*m_chunk, GetComponentId<T>()));
+		}
+		// Необязательный компонент: nullptr, если его нет у архетипа куска
+		template<typename T>
+		T* TryGet() const
+		{
+			const uint32_t id = GetComponentId<T>();
+			return m_archetype->HasComponent(id) ? static_cast<T*>(m_archetype->GetColumn(*m_chunk, id)) : nullptr;
+		}
+
+	private:
+		const Archetype* m_archetype;
+		const Chunk*     m_chunk;
+	};
+
+	class World final
+	{
+	public:
+		World();
+		~World();
+		World(const World&) = delete;
+		World& operator=(const World&) = delete;
+
+		template<typename... Components>
+		Entity Create(Components&&... components)
+		{
+			const Entity entity = createEntity(getArchetype(GetComponentMask<std::decay_t<Components>...>()));
+			const Location& location = m_locations[entity.index];
+			(new (componentAddress(location, GetComponentId<std::decay_t<Components>>())) std::decay_t<Components>(std::forward<Components>(components)), ...);
+			return entity;
+		}
+
+		// Разрушает компоненты; ссылки на сущность становятся недействительными
+		void Destroy(Entity entity);
+		bool IsAlive(Entity entity) const
+		{
+			return entity.index < m_locations.size() && m_locations[entity.index].archetype && m_locations[entity.index].generation == entity.generation;
+		}
+		// Все сущности; архетипы и кэш запросов остаются
+		void Clear();
+
+		// Компонент заменяется, если уже есть
+		template<typename T>
+		void Add(Entity entity, T&& component)
+		{
+			using Component = std::decay_t<T>;
+			assert(IsAlive(entity));
+			const uint32_t id = GetComponentId<Component>();
+			if (Component* existing = Get<Component>(entity))
+			{
+				*existing = std::forward<T>(component);
+				return;
+			}
+			moveEntity(entity, id, true);
+			new (componentAddress(m_locations[entity.index], id)) Component(std::forward<T>(component));
+		}
+
+		template<typename T>
+		void Remove(Entity entity)
+		{
+			assert(IsAlive(entity));
+			const uint32_t id = GetComponentId<T>();
+			if (m_locations[entity.index].archetype->HasComponent(id)) moveEntity(entity, id, false);
+		}
+
+		// nullptr - сущность удалена или компонента нет. Адрес действителен до изменения набора сущностей
+		template<typename T>
+		T* Get(Entity entity) const
+		{
+			if (!IsAlive(entity)) return nullptr;
+			const Location& location = m_locations[entity.index];
+			const uint32_t id = GetComponentId<T>();
+			return location.archetype->HasComponent(id) ? static_cast<T*>(componentAddress(location, id)) : nullptr;
+		}
+
+		template<typename T>
+		bool Has(Entity entity) const { return IsAlive(entity) && m_locations[entity.index].archetype->HasComponent(GetComponentId<T>()); }
+
+		size_t GetEntityCount() const { return m_entityCount; }
+		size_t GetArchetypeCount() const { return m_archetypes.size(); }
+		size_t GetChunkCount() const;
+
+		// Обход сущностей со всеми Components: function(Components&...). Остальные компоненты сущности
+		// не мешают; необязательные компоненты - через ForEachChunk и ChunkView::TryGet
+		template<typename... Components, typename F>
+		void ForEach(F&& function)
+		{
+			ForEachChunk<Components...>([&function](const ChunkView& chunk)
+			{
+				forEachInChunk<Components...>(chunk, function);
+			});
+		}
+
+		template<typename... Components, typename F>
+		void ForEachChunk(F&& function)
+		{
+			m_iterating++;
+			for (Archetype* archetype : getQuery(GetComponentMask<Components...>()))
+			{
+				for (const Chunk& chunk : archetype->m_chunks)
+					function(ChunkView(*archetype, chunk));
+			}
+			m_iterating--;
+		}
+
+		// Куски - задачам системы задач; function вызывается параллельно и не должна менять набор сущностей
+		template<typename... Components, typename F>
+		void ParallelForEach(F&& function)
+		{
+			ParallelForEachChunk<Components...>([&function](const ChunkView& chunk)
+			{
+				forEachInChunk<Components...>(chunk, function);
+			});
+		}
+
+		template<typename... Components, typename F>
+		void ParallelForEachChunk(F&& function)
+		{
+			const std::vector<Archetype*>& archetypes = getQuery(GetComponentMask<Components...>());
+			size_t chunkCount = 0;
+			for (const Archetype* archetype : archetypes) chunkCount += archetype->m_chunks.size();
+
+			// задачи делят сквозные номера кусков всех архетипов запроса; начало диапазона находится
+			// проходом по архетипам (их немного), так что список кусков не собирается и память не выделяется
+			m_iterating++;
+			jobs::ParallelFor((uint32_t)chunkCount, 1, [&](uint32_t begin, uint32_t end)
+			{
+				size_t archetypeIndex = 0;
+				size_t chunk = begin;
+				for (uint32_t i = begin; i < end; i++, chunk++)
+				{
+					while (chunk >= archetypes[archetypeIndex]->m_chunks.size())
+						chunk -= archetypes[archetypeIndex++]->m_chunks.size();
+					const Archetype& archetype = *archetypes[archetypeIndex];
+					function(ChunkView(archetype, archetype.m_chunks[chunk]));
+				}
+			});
+			m_iterating--;
+		}
+
+	private:
+		struct Location final
+		{
+			Archetype* archetype{ nullptr };
+			uint32_t   chunk{ 0 };
+			uint32_t   row{ 0 };
+			uint32_t   generation{ 0 };
+		};
+
+		// Архетипы с компонентами mask. Список запроса дополняется архетипами, созданными после прошлого обхода
+		struct Query final
+		{
+			std::vector<Archetype*> archetypes;
+			size_t                  checkedArchetypes{ 0 };
+		};
+
+		template<typename... Components, typename F>
+		static void forEachInChunk(const ChunkView& chunk, F& function)
+		{
+			const std::tuple<Components*...> columns{ chunk.Get<Components>()... };
+			for (uint32_t i = 0; i < chunk.GetCount(); i++)
+				function(std::get<Components*>(columns)[i]...);
+		}
+
+		Archetype* getArchetype(ComponentMask mask);
+		const std::vector<Archetype*>& getQuery(ComponentMask mask);
+		Entity createEntity(Archetype* archetype);
+		// Новая строка в конце архетипа, компоненты не сконструированы
+		void allocateRow(Archetype& archetype, uint32_t index);
+		// Переносит на место строки последнюю строку архетипа. Компоненты строки уже перенесены или разрушены
+		void removeRow(Archetype& archetype, uint32_t chunk, uint32_t row);
+		// Сущность в архетип с добавленным или удаленным компонентом id: общие компоненты переносятся,
+		// удаленный разрушается, добавленный конструирует вызывающий
+		void moveEntity(Entity entity, uint32_t id, bool add);
+		void* componentAddress(const Location& location, uint32_t id) const
+		{
+			const Archetype& archetype = *location.archetype;
+			return static_cast<std::byte*>(archetype.GetColumn(archetype.m_chunks[location.chunk], id)) + (size_t)location.row * detail::GetComponentInfo(id).size;
+		}
+
+		std::vector<Location>                              m_locations; // по номеру слота сущности
+		std::vector<uint32_t>                              m_freeSlots;
+		size_t                                             m_entityCount{ 0 };
+		std::vector<std::unique_ptr<Archetype>>            m_archetypes;
+		std::unordered_map<ComponentMask, Archetype*>      m_archetypesByMask;
+		std::unordered_map<ComponentMask, Query>           m_queries;
+		uint32_t                                           m_iterating{ 0 }; // вложенные обходы, изменения запрещены
+	};
+
+	// Замер на entityCount сущностях: создание, последовательный и параллельный обход, обход с фильтром,
+	// для сравнения - обход объектов, разбросанных по куче через указатели. Результат в лог
+	void RunBenchmark(uint32_t entityCount);
+}
\ No newline at end of file
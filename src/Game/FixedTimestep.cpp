@@ -0,0 +1,57 @@
+﻿#include "stdafx.h"
+#include "FixedTimestep.h"
+#include "Log.h"
+//=============================================================================
+void FixedTimestep::Init(const FixedTimestepSettings& settings)
+{
+	m_settings = settings;
+	if (m_settings.maxTicksPerFrame == 0) m_settings.maxTicksPerFrame = 1;
+	SetTickRate(settings.tickRate);
+	m_accumulator = 0.0;
+	m_ticksThisFrame = 0;
+	m_totalTicks = 0;
+	m_droppedTicks = 0;
+}
+//=============================================================================
+void FixedTimestep::SetTickRate(double tickRate)
+{
+	if (tickRate <= 0.0) [[unlikely]]
+	{
+		LOG_WARNING(Core, "Invalid tick rate {}, using 60", tickRate);
+		tickRate = 60.0;
+	}
+	// сохраняем фазу интерполяции при смене частоты
+	const double alpha = m_accumulator / m_fixedDeltaTime;
+	m_settings.tickRate = tickRate;
+	m_fixedDeltaTime = 1.0 / tickRate;
+	m_accumulator = alpha * m_fixedDeltaTime;
+}
+//=============================================================================
+uint32_t FixedTimestep::Advance(double frameTime)
+{
+	m_accumulator += std::clamp(frameTime, 0.0, m_settings.maxFrameTime);
+
+	const double ticks = std::floor(m_accumulator / m_fixedDeltaTime);
+	m_ticksThisFrame = (uint32_t)std::min(ticks, (double)m_settings.maxTicksPerFrame);
+	m_accumulator -= m_ticksThisFrame * m_fixedDeltaTime;
+
+	// не успеваем - отбрасываем хвост, иначе каждый следующий кадр будет еще длиннее
+	if (m_accumulator >= m_fixedDeltaTime)
+	{
+		m_droppedTicks += (uint64_t)(m_accumulator / m_fixedDeltaTime);
+		m_accumulator = std::fmod(m_accumulator, m_fixedDeltaTime);
+	}
+	m_totalTicks += m_ticksThisFrame;
+	return m_ticksThisFrame;
+}
+//=============================================================================
+void FixedTimestep::BeginTicks()
+{
+	m_ticksStart = std::chrono::steady_clock::now();
+}
+//=============================================================================
+void FixedTimestep::EndTicks()
+{
+	m_tickCpuTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_ticksStart).count();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,46 @@
+﻿#pragma once
+
+// Планировщик симуляции с фиксированным шагом. Время кадра копится в аккумуляторе и
+// расходуется целыми тиками; остаток дает коэффициент интерполяции для отрисовки.
+struct FixedTimestepSettings final
+{
+	double   tickRate{ 60.0 };      // тиков в секунду
+	uint32_t maxTicksPerFrame{ 8 }; // защита от "спирали смерти": лишнее время отбрасывается
+	double   maxFrameTime{ 0.25 };  // длинные кадры (отладчик, загрузка) не догоняются
+};
+
+class FixedTimestep final
+{
+public:
+	void Init(const FixedTimestepSettings& settings);
+	void SetTickRate(double tickRate);
+
+	// Добавляет время кадра и возвращает количество тиков FixedUpdate в этом кадре
+	uint32_t Advance(double frameTime);
+	// Замер времени CPU, потраченного на тики текущего кадра
+	void BeginTicks();
+	void EndTicks();
+
+	double GetFixedDeltaTime() const { return m_fixedDeltaTime; }
+	// Доля шага между предыдущим и текущим состоянием симуляции, [0, 1)
+	float GetAlpha() const { return (float)(m_accumulator / m_fixedDeltaTime); }
+
+	const FixedTimestepSettings& GetSettings() const { return m_settings; }
+	uint32_t GetTicksThisFrame() const { return m_ticksThisFrame; }
+	double GetSimTimeThisFrame() const { return m_ticksThisFrame * m_fixedDeltaTime; }
+	double GetTickCpuTimeThisFrame() const { return m_tickCpuTime; }
+	uint64_t GetTotalTicks() const { return m_totalTicks; }
+	double GetTotalSimTime() const { return m_totalTicks * m_fixedDeltaTime; }
+	uint64_t GetDroppedTicks() const { return m_droppedTicks; }
+
+private:
+	FixedTimestepSettings m_settings;
+	double                m_fixedDeltaTime{ 1.0 / 60.0 };
+	double                m_accumulator{ 0.0 };
+	uint32_t              m_ticksThisFrame{ 0 };
+	uint64_t              m_totalTicks{ 0 };
+	uint64_t              m_droppedTicks{ 0 };
+
+	std::chrono::steady_clock::time_point m_ticksStart;
+	double                m_tickCpuTime{ 0.0 };
+};
@@ -0,0 +1,673 @@
+﻿#include "stdafx.h"
+#include "Foliage.h"
+#include "FramePacket.h"
+#include "FrameAllocator.h"
+#include "GpuProfiler.h"
+#include "Impostor.h"
+#include "JobSystem.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t MaxLayerMeshes = 8;
+	constexpr uint32_t MaxCellsPerLayer = 65535; // гарантированный минимум GL_MAX_COMPUTE_WORK_GROUP_COUNT
+	constexpr uint32_t MinVisibleCapacity = 16384;
+
+	constexpr uint32_t InstanceBindingPoint = 0;
+	constexpr uint32_t CellBindingPoint = 1;
+	constexpr uint32_t VisibleBindingPoint = 2;
+	constexpr uint32_t CounterBindingPoint = 3;
+	constexpr uint32_t CullDataBindingPoint = 4;
+
+	// Раскладка std140 блока FoliageCullData
+	struct FoliageCullData final
+	{
+		glm::mat4  meshTransforms[MaxLayerMeshes];
+		glm::vec4  frustumPlanes[6];
+		glm::vec4  cameraPosition;
+		glm::vec4  boundingSphere;
+		glm::vec4  distances;
+		glm::uvec4 cellRange;
+		glm::uvec4 outputRange;
+		glm::vec4  impostorRange;
+	};
+
+	static_assert(sizeof(FoliageInstance) == 20, "FoliageInstance layout must match the cull shader");
+	static_assert(sizeof(FoliageCellDraw) == 12, "FoliageCellDraw layout must match the cull shader");
+	static_assert(sizeof(MeshInstanceData) == 80, "MeshInstanceData layout must match the cull shader");
+
+	const GLchar* cullShaderSource = R"glsl(
+#version 430 core
+
+layout(local_size_x = 64) in;
+
+struct FoliageInstance
+{
+	float x, y, z;
+	uint  rotationScale;
+	uint  tint;
+};
+
+struct CellDraw
+{
+	uint layer;
+	uint firstInstance;
+	uint instanceCount;
+};
+
+struct InstanceData // MeshInstanceData
+{
+	mat4 world;
+	vec4 tint;
+};
+
+layout(std430, binding = 0) readonly buffer InstanceStorage { FoliageInstance instances[]; };
+layout(std430, binding = 1) readonly buffer CellStorage { CellDraw cells[]; };
+layout(std430, binding = 2) writeonly buffer VisibleStorage { InstanceData visibleInstances[]; };
+layout(std430, binding = 3) buffer CounterStorage { uint counters[]; };
+
+layout(std140, binding = 4) uniform FoliageCullData
+{
+	mat4  meshTransforms[8];
+	vec4  frustumPlanes[6];
+	vec4  cameraPosition;
+	vec4  boundingSphere; // xyz - model space center, w - radius
+	vec4  distances;      // x - fade start, y - cull distance, z - min scale, w - max scale
+	uvec4 cellRange;      // x - first cell of the layer, y - layer counter, z - impostor counter
+	uvec4 outputRange;    // x - first output instance, y - stride between meshes, z - mesh count, w - first impostor instance
+	vec4  impostorRange;  // x - impostor switch distance, 0 - layer has no impostor
+};
+
+void main()
+{
+	// One work group per cell, cells of the layer follow each other
+	CellDraw cell = cells[cellRange.x + gl_WorkGroupID.x];
+	for (uint i = gl_LocalInvocationID.x; i < cell.instanceCount; i += gl_WorkGroupSize.x)
+	{
+		FoliageInstance instance = instances[cell.firstInstance + i];
+		vec3 position = vec3(instance.x, instance.y, instance.z);
+
+		// Unpack rotation around Y and uniform scale
+		float yaw = float(instance.rotationScale & 0xFFFFu) * (6.28318530718f / 65536.0f);
+		float scale = mix(distances.z, distances.w, float(instance.rotationScale >> 16) / 65535.0f);
+		float s = sin(yaw) * scale;
+		float c = cos(yaw) * scale;
+		mat4 world = mat4(
+			vec4(c, 0.0f, -s, 0.0f),
+			vec4(0.0f, scale, 0.0f, 0.0f),
+			vec4(s, 0.0f, c, 0.0f),
+			vec4(position, 1.0f));
+
+		// Distance fade
+		float cameraDistance = distance(position, cameraPosition.xyz);
+		float fade = 1.0f - clamp((cameraDistance - distances.x) / max(distances.y - distances.x, 0.001f), 0.0f, 1.0f);
+
+		// Bounding sphere against frustum
+		vec3 center = (world * vec4(boundingSphere.xyz, 1.0f)).xyz;
+		float radius = boundingSphere.w * scale;
+		bool visible = fade > 0.0f;
+		for (int p = 0; p < 6; p++)
+			visible = visible && dot(frustumPlanes[p].xyz, center) + frustumPlanes[p].w >= -radius;
+		if (!visible) continue;
+
+		// Far instances become one impostor quad instead of all meshes
+		vec4 tint = vec4(unpackUnorm4x8(instance.tint).rgb, fade);
+		if (impostorRange.x > 0.0f && cameraDistance > impostorRange.x)
+		{
+			visibleInstances[outputRange.w + atomicAdd(counters[cellRange.z], 1u)] = InstanceData(world, tint);
+			continue;
+		}
+
+		uint slot = atomicAdd(counters[cellRange.y], 1u);
+		for (uint m = 0u; m < outputRange.z; m++)
+			visibleInstances[outputRange.x + m * outputRange.y + slot] = InstanceData(world * meshTransforms[m], tint);
+	}
+}
+)glsl";
+
+	// Поворот вокруг Y, равномерный масштаб и перенос - так же, как в шейдере отсечения
+	glm::mat4 getInstanceMatrix(const FoliageInstance& instance, float minScale, float maxScale)
+	{
+		const float yaw = float(instance.rotationScale & 0xFFFF) * (glm::two_pi<float>() / 65536.0f);
+		const float scale = glm::mix(minScale, maxScale, float(instance.rotationScale >> 16) / 65535.0f);
+		const float s = std::sin(yaw) * scale;
+		const float c = std::cos(yaw) * scale;
+		return glm::mat4(
+			glm::vec4(c, 0.0f, -s, 0.0f),
+			glm::vec4(0.0f, scale, 0.0f, 0.0f),
+			glm::vec4(s, 0.0f, c, 0.0f),
+			glm::vec4(instance.position, 1.0f));
+	}
+
+	// 1 - ближе fadeStart, 0 - на cullDistance и дальше
+	float getDistanceFade(const glm::vec3& position, const glm::vec3& cameraPosition, const FoliageLayerSettings& settings)
+	{
+		const float range = std::max(settings.cullDistance - settings.fadeStart, 0.001f);
+		return 1.0f - glm::clamp((glm::distance(position, cameraPosition) - settings.fadeStart) / range, 0.0f, 1.0f);
+	}
+
+	// Буфер пересоздается с запасом, если size не помещается. retired - куда деть старый буфер, если его имя где-то запомнено
+	void reserveStorage(std::shared_ptr<StorageBuffer>& buffer, uint32_t bindingPoint, uint32_t size, uint32_t minSize,
+		std::vector<std::shared_ptr<StorageBuffer>>* retired = nullptr)
+	{
+		if (buffer && buffer->GetSize() >= size) return;
+		const uint32_t capacity = std::max({ size, buffer ? buffer->GetSize() * 2 : 0u, minSize });
+		if (buffer && retired) retired->push_back(std::move(buffer));
+		buffer = std::make_shared<StorageBuffer>(bindingPoint, capacity);
+	}
+}
+//=============================================================================
+void Foliage::Init(const FoliageSettings& settings)
+{
+	m_settings = settings;
+
+	if (!GLAD_GL_VERSION_4_3)
+	{
+		LOG_INFO(Scene, "Compute shaders are not available, foliage is culled on CPU");
+		return;
+	}
+
+	m_cullProgram = std::make_shared<ShaderProgram>(cullShaderSource);
+	if (!m_cullProgram->IsValid()) [[unlikely]]
+	{
+		LOG_WARNING(Scene, "Foliage cull shader failed, foliage is culled on CPU");
+		m_cullProgram.reset();
+		return;
+	}
+	m_cullUniformBuffer = std::make_shared<UniformBuffer>(CullDataBindingPoint, sizeof(FoliageCullData));
+}
+//=============================================================================
+void Foliage::Close()
+{
+	Clear();
+	m_cullProgram.reset();
+	m_cellBuffer.reset();
+	m_counterBuffer.reset();
+	m_commandBuffer.reset();
+	m_cullUniformBuffer.reset();
+	m_visibleBuffer.reset();
+	m_retiredVisibleBuffers.clear();
+}
+//=============================================================================
+void Foliage::Clear()
+{
+	m_layers.clear();
+	m_instances.clear();
+	m_instanceBuffer.reset();
+	m_statistics = {};
+}
+//=============================================================================
+bool Foliage::AddLayer(const FoliageLayerSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	const auto& model = settings.model;
+	if (!model || model->GetNumMesh() == 0 || model->GetNumMesh() > MaxLayerMeshes)
+	{
+		LOG_ERROR(Scene, "Foliage layer needs a model with 1..{} meshes", MaxLayerMeshes);
+		return false;
+	}
+
+	const glm::vec2 areaSize = settings.areaMax - settings.areaMin;
+	const uint32_t cellsX = (uint32_t)std::ceil(areaSize.x / m_settings.cellSize);
+	const uint32_t cellsZ = (uint32_t)std::ceil(areaSize.y / m_settings.cellSize);
+	if (areaSize.x <= 0.0f || areaSize.y <= 0.0f || cellsX * cellsZ > MaxCellsPerLayer)
+	{
+		LOG_ERROR(Scene, "Invalid foliage area: {} x {} m", areaSize.x, areaSize.y);
+		return false;
+	}
+
+	std::vector<uint8_t> densityMap;
+	int mapWidth = 0;
+	int mapHeight = 0;
+	if (!settings.densityMapPath.empty())
+	{
+		int channels;
+		stbi_set_flip_vertically_on_load(false);
+		stbi_uc* data = stbi_load(settings.densityMapPath.c_str(), &mapWidth, &mapHeight, &channels, 1);
+		if (!data)
+		{
+			LOG_ERROR(Scene, "Failed to load foliage density map: {}", settings.densityMapPath);
+			return false;
+		}
+		densityMap.assign(data, data + size_t(mapWidth) * mapHeight);
+		stbi_image_free(data);
+	}
+
+	// билинейная выборка карты, вне карты плотность 1
+	auto sampleDensity = [&](const glm::vec2& point)
+	{
+		if (densityMap.empty()) return 1.0f;
+		const glm::vec2 uv = (point - settings.areaMin) / areaSize * glm::vec2(mapWidth - 1, mapHeight - 1);
+		const glm::ivec2 p0 = glm::clamp(glm::ivec2(uv), glm::ivec2(0), glm::ivec2(mapWidth - 1, mapHeight - 1));
+		const glm::ivec2 p1 = glm::min(p0 + 1, glm::ivec2(mapWidth - 1, mapHeight - 1));
+		const glm::vec2 t = glm::clamp(uv - glm::vec2(p0), 0.0f, 1.0f);
+		auto texel = [&](int x, int y) { return densityMap[size_t(y) * mapWidth + x] / 255.0f; };
+		const float top = glm::mix(texel(p0.x, p0.y), texel(p1.x, p0.y), t.x);
+		const float bottom = glm::mix(texel(p0.x, p1.y), texel(p1.x, p1.y), t.x);
+		return glm::mix(top, bottom, t.y);
+	};
+
+	Layer layer;
+	layer.settings = settings;
+	layer.boundsCenter = (model->GetBoundsMin() + model->GetBoundsMax()) * 0.5f;
+	layer.boundsRadius = glm::length(model->GetBoundsMax() - model->GetBoundsMin()) * 0.5f;
+	for (size_t i = 0; i < model->GetNumMesh(); i++)
+	{
+		if (model->GetMesh(i).GetLocalTransform() != glm::mat4(1.0f))
+			layer.sharedInstances = false;
+	}
+
+	// ячейки рассыпаются независимо: у каждой свой генератор, результат не зависит от числа потоков
+	const uint32_t cellCount = cellsX * cellsZ;
+	std::vector<std::vector<FoliageInstance>> cellInstances(cellCount);
+	jobs::ParallelFor(cellCount, 4, [&](uint32_t begin, uint32_t end)
+	{
+		PROFILE_SCOPE("FoliageScatter");
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		for (uint32_t cellIndex = begin; cellIndex < end; cellIndex++)
+		{
+			std::mt19937 random(settings.seed * 0x9E3779B9u + cellIndex);
+			const glm::vec2 cellMin = settings.areaMin + glm::vec2(cellIndex % cellsX, cellIndex / cellsX) * m_settings.cellSize;
+			const glm::vec2 cellMax = glm::min(cellMin + m_settings.cellSize, settings.areaMax);
+			const float expected = settings.density * (cellMax.x - cellMin.x) * (cellMax.y - cellMin.y);
+			const uint32_t candidates = (uint32_t)expected + (uniform(random) < expected - std::floor(expected) ? 1 : 0);
+
+			auto& instances = cellInstances[cellIndex];
+			instances.reserve(candidates);
+			for (uint32_t i = 0; i < candidates; i++)
+			{
+				const glm::vec2 point = glm::mix(cellMin, cellMax, glm::vec2(uniform(random), uniform(random)));
+				const uint32_t yaw = (uint32_t)(uniform(random) * 65536.0f) & 0xFFFF;
+				const uint32_t scale = (uint32_t)(uniform(random) * 65535.0f + 0.5f);
+				const glm::vec3 tint = glm::mix(settings.tintMin, settings.tintMax, uniform(random));
+				if (uniform(random) >= sampleDensity(point)) continue;
+
+				instances.push_back({ glm::vec3(point.x, settings.height, point.y), yaw | (scale << 16), glm::packUnorm4x8(glm::vec4(tint, 1.0f)) });
+			}
+			// случайный порядок: любой префикс ячейки равномерно покрывает ее площадь
+			std::shuffle(instances.begin(), instances.end(), random);
+		}
+	});
+
+	// сфера экземпляра вписывается в куб вокруг основания: радиус с запасом на смещение центра модели
+	const size_t firstLayerInstance = m_instances.size();
+	const float boundsReach = glm::length(layer.boundsCenter) + layer.boundsRadius;
+	for (const auto& instances : cellInstances)
+	{
+		if (instances.empty()) continue;
+
+		Cell cell;
+		cell.firstInstance = (uint32_t)m_instances.size();
+		cell.instanceCount = (uint32_t)instances.size();
+		cell.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+		cell.boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (const FoliageInstance& instance : instances)
+		{
+			const float reach = boundsReach * glm::mix(settings.minScale, settings.maxScale, float(instance.rotationScale >> 16) / 65535.0f);
+			cell.boundsMin = glm::min(cell.boundsMin, instance.position - reach);
+			cell.boundsMax = glm::max(cell.boundsMax, instance.position + reach);
+		}
+		layer.cells.push_back(cell);
+		m_instances.insert(m_instances.end(), instances.begin(), instances.end());
+	}
+
+	m_statistics.totalInstances = (uint32_t)m_instances.size();
+	m_statistics.totalCells += (uint32_t)layer.cells.size();
+	LOG_INFO(Scene, "Foliage layer: {} instances in {} cells", m_instances.size() - firstLayerInstance, layer.cells.size());
+	m_layers.push_back(std::move(layer));
+
+	if (IsComputeAvailable() && !m_instances.empty())
+		m_instanceBuffer = std::make_shared<StorageBuffer>(InstanceBindingPoint, (uint32_t)(m_instances.size() * sizeof(FoliageInstance)), m_instances.data());
+	return true;
+}
+//=============================================================================
+void Foliage::BuildFramePacket(FramePacket& packet)
+{
+	PROFILE_FUNCTION();
+
+	m_statistics.visibleCells = 0;
+	m_statistics.submittedInstances = 0;
+	m_statistics.drawnInstances = 0;
+	m_statistics.impostorInstances = 0;
+	m_statistics.budgetScale = 1.0f;
+	if (m_layers.empty()) return;
+
+	const Frustum frustum = Frustum::FromMatrix(packet.camera.projection * packet.camera.view);
+	const glm::vec3 cameraPosition = packet.camera.cameraPosition;
+	packet.foliageCompute = m_settings.useCompute && IsComputeAvailable();
+
+	// отсечение ячеек и прореживание по дистанции: рисуется префикс ячейки
+	const size_t firstCell = packet.foliageCells.size();
+	packet.foliageCells.reserve(firstCell + m_statistics.totalCells);
+	uint64_t submitted = 0;
+	for (uint32_t layerIndex = 0; layerIndex < m_layers.size(); layerIndex++)
+	{
+		const FoliageLayerSettings& settings = m_layers[layerIndex].settings;
+		for (const Cell& cell : m_layers[layerIndex].cells)
+		{
+			const float distance = glm::distance(glm::clamp(cameraPosition, cell.boundsMin, cell.boundsMax), cameraPosition);
+			if (distance > settings.cullDistance) continue;
+			if (!frustum.IsAABBVisible((cell.boundsMin + cell.boundsMax) * 0.5f, (cell.boundsMax - cell.boundsMin) * 0.5f)) continue;
+
+			const float thinning = glm::clamp((distance - settings.thinningStart) / std::max(settings.cullDistance - settings.thinningStart, 0.001f), 0.0f, 1.0f);
+			const float scale = glm::mix(1.0f, settings.minDensityScale, thinning) * m_settings.densityScale;
+			const uint32_t count = std::min(cell.instanceCount, (uint32_t)std::ceil(cell.instanceCount * scale));
+			if (count == 0) continue;
+
+			packet.foliageCells.push_back({ layerIndex, cell.firstInstance, count });
+			submitted += count;
+		}
+	}
+
+	// бюджет кадра: все ячейки прореживаются одинаково, ближние остаются плотнее дальних
+	if (submitted > m_settings.instanceBudget)
+	{
+		m_statistics.budgetScale = (float)m_settings.instanceBudget / (float)submitted;
+		submitted = 0;
+		for (size_t i = firstCell; i < packet.foliageCells.size(); i++)
+		{
+			FoliageCellDraw& draw = packet.foliageCells[i];
+			draw.instanceCount = (uint32_t)(draw.instanceCount * m_statistics.budgetScale);
+			submitted += draw.instanceCount;
+		}
+	}
+
+	m_statistics.visibleCells = (uint32_t)(packet.foliageCells.size() - firstCell);
+	m_statistics.submittedInstances = (uint32_t)submitted;
+
+	if (!packet.foliageCompute)
+		cullInstancesOnCpu(packet, firstCell);
+}
+//=============================================================================
+void Foliage::cullInstancesOnCpu(FramePacket& packet, size_t firstCell)
+{
+	PROFILE_FUNCTION();
+
+	const uint32_t cellCount = (uint32_t)(packet.foliageCells.size() - firstCell);
+	if (cellCount == 0) return;
+
+	const Frustum frustum = Frustum::FromMatrix(packet.camera.projection * packet.camera.view);
+	const glm::vec3 cameraPosition = packet.camera.cameraPosition;
+	const FoliageCellDraw* draws = packet.foliageCells.data() + firstCell;
+
+	// первый проход: индексы видимых экземпляров, у ячейки свой участок размером с ее префикс.
+	// Меши заполняют участок с начала, импосторы - с конца
+	ArenaVector<uint32_t> candidateOffsets(framemem::GetThreadAllocator<uint32_t>());
+	candidateOffsets.resize(cellCount + 1);
+	for (uint32_t c = 0; c < cellCount; c++)
+		candidateOffsets[c + 1] = candidateOffsets[c] + draws[c].instanceCount;
+
+	ArenaVector<uint32_t> visibleIndices(framemem::GetThreadAllocator<uint32_t>());
+	visibleIndices.resize(candidateOffsets[cellCount]);
+	ArenaVector<uint32_t> visibleCounts(framemem::GetThreadAllocator<uint32_t>());
+	visibleCounts.resize(cellCount);
+	ArenaVector<uint32_t> impostorCounts(framemem::GetThreadAllocator<uint32_t>());
+	impostorCounts.resize(cellCount);
+	jobs::ParallelFor(cellCount, 4, [&](uint32_t begin, uint32_t end)
+	{
+		PROFILE_SCOPE("FoliageCull");
+		for (uint32_t c = begin; c < end; c++)
+		{
+			const FoliageCellDraw& draw = draws[c];
+			const Layer& layer = m_layers[draw.layer];
+			const FoliageLayerSettings& settings = layer.settings;
+			const Impostor* impostor = settings.model->GetImpostor();
+			const float switchDistance = impostor ? impostor->GetSwitchDistance() : std::numeric_limits<float>::max();
+			uint32_t* output = visibleIndices.data() + candidateOffsets[c];
+			uint32_t count = 0;
+			uint32_t impostorCount = 0;
+			for (uint32_t i = 0; i < draw.instanceCount; i++)
+			{
+				const uint32_t index = draw.firstInstance + i;
+				const FoliageInstance& instance = m_instances[index];
+				if (getDistanceFade(instance.position, cameraPosition, settings) <= 0.0f) continue;
+
+				const glm::mat4 world = getInstanceMatrix(instance, settings.minScale, settings.maxScale);
+				if (!frustum.IsSphereVisible(glm::vec3(world * glm::vec4(layer.boundsCenter, 1.0f)), layer.boundsRadius * world[1].y)) continue;
+				if (glm::distance(instance.position, cameraPosition) > switchDistance)
+					output[draw.instanceCount - ++impostorCount] = index;
+				else
+					output[count++] = index;
+			}
+			visibleCounts[c] = count;
+			impostorCounts[c] = impostorCount;
+		}
+	});
+
+	// раскладка выхода: слой за слоем, внутри слоя - меш за мешем, внутри меша - ячейка за ячейкой,
+	// за мешами слоя - его импосторы
+	ArenaVector<uint32_t> outputOffsets(framemem::GetThreadAllocator<uint32_t>());
+	outputOffsets.resize(cellCount);
+	ArenaVector<uint32_t> impostorOffsets(framemem::GetThreadAllocator<uint32_t>());
+	impostorOffsets.resize(cellCount);
+	ArenaVector<uint32_t> outputStrides(framemem::GetThreadAllocator<uint32_t>());
+	outputStrides.resize(cellCount);
+
+	const uint32_t base = (uint32_t)packet.instances.size();
+	uint32_t outputCount = 0;
+	for (uint32_t c = 0; c < cellCount;)
+	{
+		const uint32_t firstLayerCell = c;
+		const Layer& layer = m_layers[draws[c].layer];
+		uint32_t layerVisible = 0;
+		uint32_t layerImpostors = 0;
+		for (; c < cellCount && draws[c].layer == draws[firstLayerCell].layer; c++)
+		{
+			outputOffsets[c] = base + outputCount + layerVisible;
+			layerVisible += visibleCounts[c];
+		}
+		for (uint32_t i = firstLayerCell; i < c; i++)
+			outputStrides[i] = layer.sharedInstances ? 0 : layerVisible;
+
+		const auto& model = layer.settings.model;
+		if (layerVisible > 0)
+		{
+			for (uint32_t m = 0; m < model->GetNumMesh(); m++)
+				packet.batches.push_back({ &model->GetMesh(m), base + outputCount + (layer.sharedInstances ? 0 : m * layerVisible), layerVisible });
+			packet.drawItems += layerVisible * (uint32_t)model->GetNumMesh();
+			m_statistics.drawnInstances += layerVisible;
+			outputCount += layer.sharedInstances ? layerVisible : layerVisible * (uint32_t)model->GetNumMesh();
+		}
+
+		for (uint32_t i = firstLayerCell; i < c; i++)
+		{
+			impostorOffsets[i] = base + outputCount + layerImpostors;
+			layerImpostors += impostorCounts[i];
+		}
+		if (layerImpostors > 0)
+		{
+			packet.impostorBatches.push_back({ model->GetImpostor(), base + outputCount, layerImpostors });
+			packet.drawItems += layerImpostors;
+			m_statistics.drawnInstances += layerImpostors;
+			m_statistics.impostorInstances += layerImpostors;
+			outputCount += layerImpostors;
+		}
+	}
+	if (outputCount == 0) return;
+
+	// второй проход: матрицы видимых экземпляров сразу на свои места в пакете
+	packet.instances.resize(base + outputCount);
+	jobs::ParallelFor(cellCount, 4, [&](uint32_t begin, uint32_t end)
+	{
+		PROFILE_SCOPE("FoliageInstances");
+		for (uint32_t c = begin; c < end; c++)
+		{
+			const Layer& layer = m_layers[draws[c].layer];
+			const FoliageLayerSettings& settings = layer.settings;
+			const uint32_t* indices = visibleIndices.data() + candidateOffsets[c];
+			MeshInstanceData* output = packet.instances.data() + outputOffsets[c];
+			for (uint32_t k = 0; k < visibleCounts[c]; k++)
+			{
+				const FoliageInstance& instance = m_instances[indices[k]];
+				const glm::mat4 world = getInstanceMatrix(instance, settings.minScale, settings.maxScale);
+				const glm::vec4 tint(glm::vec3(glm::unpackUnorm4x8(instance.tint)), getDistanceFade(instance.position, cameraPosition, settings));
+				if (layer.sharedInstances)
+				{
+					output[k] = { world, tint };
+					continue;
+				}
+				for (uint32_t m = 0; m < settings.model->GetNumMesh(); m++)
+					output[m * outputStrides[c] + k] = { world * settings.model->GetMesh(m).GetLocalTransform(), tint };
+			}
+
+			// импосторы сложены с конца участка ячейки
+			MeshInstanceData* impostorOutput = packet.instances.data() + impostorOffsets[c];
+			for (uint32_t k = 0; k < impostorCounts[c]; k++)
+			{
+				const FoliageInstance& instance = m_instances[indices[draws[c].instanceCount - 1 - k]];
+				const glm::vec4 tint(glm::vec3(glm::unpackUnorm4x8(instance.tint)), getDistanceFade(instance.position, cameraPosition, settings));
+				impostorOutput[k] = { getInstanceMatrix(instance, settings.minScale, settings.maxScale), tint };
+			}
+		}
+	});
+}
+//=============================================================================
+void Foliage::RenderPacket(const FramePacket& packet, ShaderProgram& drawProgram)
+{
+	if (!packet.foliageCompute || packet.foliageCells.empty()) return;
+
+	PROFILE_FUNCTION();
+	GPU_PROFILE_SCOPE("Foliage");
+
+	// ячейки пакета идут по слоям: у слоя своя группа вызовов, счетчики мешей и импостора и участки выхода
+	struct LayerDispatch final
+	{
+		uint32_t        layer;
+		uint32_t        firstCell;
+		uint32_t        cellCount;
+		uint32_t        outputBase;
+		uint32_t        outputStride;
+		uint32_t        firstCommand;
+		const Impostor* impostor;     // команда импостора идет после команд мешей
+		uint32_t        impostorBase;
+	};
+	ArenaVector<LayerDispatch> dispatches(framemem::GetThreadAllocator<LayerDispatch>());
+	ArenaVector<DrawElementsIndirectCommand> commands(framemem::GetThreadAllocator<DrawElementsIndirectCommand>());
+	dispatches.reserve(m_layers.size());
+	commands.reserve(m_layers.size() * (MaxLayerMeshes + 1));
+
+	const auto& cells = packet.foliageCells;
+	uint32_t outputCount = 0;
+	for (uint32_t c = 0; c < cells.size();)
+	{
+		LayerDispatch dispatch{ cells[c].layer, c, 0, outputCount, 0, (uint32_t)commands.size(), nullptr, 0 };
+		uint32_t submitted = 0;
+		for (; c < cells.size() && cells[c].layer == dispatch.layer; c++)
+			submitted += cells[c].instanceCount;
+		dispatch.cellCount = c - dispatch.firstCell;
+
+		const Layer& layer = m_layers[dispatch.layer];
+		const auto& model = layer.settings.model;
+		dispatch.outputStride = layer.sharedInstances ? 0 : submitted;
+		for (uint32_t m = 0; m < model->GetNumMesh(); m++)
+			commands.push_back({ model->GetMesh(m).GetIndexCount(), 0, 0, 0, dispatch.outputBase + m * dispatch.outputStride });
+		outputCount += layer.sharedInstances ? submitted : submitted * (uint32_t)model->GetNumMesh();
+		dispatch.impostor = model->GetImpostor();
+		if (dispatch.impostor)
+		{
+			dispatch.impostorBase = outputCount;
+			commands.push_back({ Impostor::GetIndexCount(), 0, 0, 0, dispatch.impostorBase });
+			outputCount += submitted;
+		}
+		dispatches.push_back(dispatch);
+	}
+
+	// буфер видимых экземпляров запомнен в VAO мешей, поэтому старый не удаляется
+	reserveStorage(m_visibleBuffer, VisibleBindingPoint, outputCount * (uint32_t)sizeof(MeshInstanceData), MinVisibleCapacity * (uint32_t)sizeof(MeshInstanceData), &m_retiredVisibleBuffers);
+	reserveStorage(m_cellBuffer, CellBindingPoint, (uint32_t)(cells.size() * sizeof(FoliageCellDraw)), 1024 * sizeof(FoliageCellDraw));
+	reserveStorage(m_counterBuffer, CounterBindingPoint, (uint32_t)(dispatches.size() * 2 * sizeof(uint32_t)), 64 * sizeof(uint32_t));
+	reserveStorage(m_commandBuffer, 0, (uint32_t)(commands.size() * sizeof(DrawElementsIndirectCommand)), 64 * sizeof(DrawElementsIndirectCommand));
+
+	m_cellBuffer->SetData(cells.data(), (uint32_t)(cells.size() * sizeof(FoliageCellDraw)));
+	m_commandBuffer->SetData(commands.data(), (uint32_t)(commands.size() * sizeof(DrawElementsIndirectCommand)));
+	glClearNamedBufferData(m_counterBuffer->GetID(), GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+	{
+		GPU_PROFILE_SCOPE("FoliageCull");
+		m_cullProgram->Bind();
+		m_instanceBuffer->Bind();
+		m_cellBuffer->Bind();
+		m_visibleBuffer->Bind();
+		m_counterBuffer->Bind();
+		m_cullUniformBuffer->Bind();
+
+		const Frustum frustum = Frustum::FromMatrix(packet.camera.projection * packet.camera.view);
+		FoliageCullData cullData{};
+		for (size_t i = 0; i < frustum.planes.size(); i++)
+			cullData.frustumPlanes[i] = frustum.planes[i];
+		cullData.cameraPosition = glm::vec4(glm::vec3(packet.camera.cameraPosition), 1.0f);
+
+		for (uint32_t i = 0; i < dispatches.size(); i++)
+		{
+			const LayerDispatch& dispatch = dispatches[i];
+			const Layer& layer = m_layers[dispatch.layer];
+			const FoliageLayerSettings& settings = layer.settings;
+			const uint32_t meshCount = (uint32_t)settings.model->GetNumMesh();
+			for (uint32_t m = 0; m < meshCount; m++)
+				cullData.meshTransforms[m] = layer.sharedInstances ? glm::mat4(1.0f) : settings.model->GetMesh(m).GetLocalTransform();
+			cullData.boundingSphere = glm::vec4(layer.boundsCenter, layer.boundsRadius);
+			cullData.distances = glm::vec4(settings.fadeStart, settings.cullDistance, settings.minScale, settings.maxScale);
+			cullData.cellRange = glm::uvec4(dispatch.firstCell, i * 2, i * 2 + 1, 0);
+			cullData.outputRange = glm::uvec4(dispatch.outputBase, dispatch.outputStride, layer.sharedInstances ? 1 : meshCount, dispatch.impostorBase);
+			cullData.impostorRange = glm::vec4(dispatch.impostor ? dispatch.impostor->GetSwitchDistance() : 0.0f, 0.0f, 0.0f, 0.0f);
+			m_cullUniformBuffer->SetData(&cullData);
+			rhi::DispatchCompute(dispatch.cellCount);
+		}
+
+		// число видимых экземпляров слоя попадает в его команды без чтения на CPU
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+		for (uint32_t i = 0; i < dispatches.size(); i++)
+		{
+			const uint32_t meshCount = (uint32_t)m_layers[dispatches[i].layer].settings.model->GetNumMesh();
+			const uint32_t commandCount = meshCount + (dispatches[i].impostor ? 1 : 0);
+			for (uint32_t m = 0; m < commandCount; m++)
+			{
+				// команды мешей берут счетчик слоя, команда импостора - следующий
+				const GLintptr counterOffset = (i * 2 + (m < meshCount ? 0 : 1)) * sizeof(uint32_t);
+				const GLintptr commandOffset = (dispatches[i].firstCommand + m) * sizeof(DrawElementsIndirectCommand);
+				glCopyNamedBufferSubData(m_counterBuffer->GetID(), m_commandBuffer->GetID(), counterOffset,
+					commandOffset + offsetof(DrawElementsIndirectCommand, instanceCount), sizeof(uint32_t));
+			}
+		}
+	}
+
+	drawProgram.Bind();
+	rhi::BindDrawIndirectBuffer(m_commandBuffer->GetID());
+	for (const LayerDispatch& dispatch : dispatches)
+	{
+		const auto& model = m_layers[dispatch.layer].settings.model;
+		for (uint32_t m = 0; m < model->GetNumMesh(); m++)
+			model->GetMesh(m).DrawIndirect(m_visibleBuffer->GetID(), (dispatch.firstCommand + m) * sizeof(DrawElementsIndirectCommand));
+	}
+	// импосторы меняют программу, поэтому рисуются после всех мешей
+	for (const LayerDispatch& dispatch : dispatches)
+	{
+		if (dispatch.impostor)
+			dispatch.impostor->DrawIndirect(m_visibleBuffer->GetID(), (dispatch.firstCommand + m_layers[dispatch.layer].settings.model->GetNumMesh()) * sizeof(DrawElementsIndirectCommand));
+	}
+}
+//=============================================================================
+void Foliage::DrawImGui()
+{
+	if (m_layers.empty()) return;
+
+	ImGui::Begin("Foliage");
+	ImGui::Text("Layers: %zu, instances: %u, cells: %u", m_layers.size(), m_statistics.totalInstances, m_statistics.totalCells);
+	ImGui::Text("Visible cells: %u, submitted instances: %u", m_statistics.visibleCells, m_statistics.submittedInstances);
+	if (m_statistics.budgetScale < 1.0f)
+		ImGui::Text("Over budget, density scaled by %.2f", m_statistics.budgetScale);
+	if (!m_settings.useCompute || !IsComputeAvailable())
+		ImGui::Text("Drawn after CPU culling: %u, impostors: %u", m_statistics.drawnInstances, m_statistics.impostorInstances);
+
+	ImGui::BeginDisabled(!IsComputeAvailable());
+	ImGui::Checkbox("GPU culling", &m_settings.useCompute);
+	ImGui::EndDisabled();
+	ImGui::SliderFloat("Density", &m_settings.densityScale, 0.0f, 1.0f);
+	int budget = (int)m_settings.instanceBudget;
+	if (ImGui::InputInt("Budget", &budget, 10000, 100000))
+		m_settings.instanceBudget = (uint32_t)std::max(budget, 0);
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
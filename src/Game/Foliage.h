@@ -0,0 +1,126 @@
+﻿#pragma once
+
+#include "Graphics.h"
+
+struct FramePacket;
+
+// Слой растительности: одна модель, рассыпанная по карте плотности на прямоугольнике XZ
+struct FoliageLayerSettings final
+{
+	std::shared_ptr<Model> model;
+	std::string densityMapPath;          // канал R - плотность 0..1, строка 0 у areaMin.y. Пусто - равномерно
+	glm::vec2   areaMin{ -50.0f };
+	glm::vec2   areaMax{ 50.0f };
+	float       height{ 0.0f };          // высота основания экземпляров
+	float       density{ 0.5f };         // экземпляров на м² при плотности карты 1
+	float       minScale{ 0.8f };
+	float       maxScale{ 1.2f };
+	glm::vec3   tintMin{ 0.8f };         // цвет экземпляра - случайная точка между tintMin и tintMax
+	glm::vec3   tintMax{ 1.0f };
+	float       thinningStart{ 40.0f };  // дальше в ячейке рисуется только часть экземпляров
+	float       fadeStart{ 70.0f };      // дальше экземпляры растворяются
+	float       cullDistance{ 90.0f };   // дальше экземпляры не рисуются
+	float       minDensityScale{ 0.3f }; // доля экземпляров ячейки на cullDistance
+	uint32_t    seed{ 1 };
+};
+
+// Экземпляр в хранилище слоя - 20 байт вместо MeshInstanceData, матрица собирается при отсечении
+struct FoliageInstance final
+{
+	glm::vec3 position;
+	uint32_t  rotationScale; // младшие 16 бит - поворот вокруг Y, старшие - масштаб в [minScale, maxScale]
+	uint32_t  tint;          // RGBA8
+};
+
+// Видимая ячейка кадра: первые instanceCount ее экземпляров проходят поэкземплярное отсечение на GPU
+struct FoliageCellDraw final
+{
+	uint32_t layer;
+	uint32_t firstInstance;
+	uint32_t instanceCount;
+};
+
+struct FoliageSettings final
+{
+	float    cellSize{ 16.0f };
+	float    densityScale{ 1.0f };      // общий множитель плотности, настройка качества
+	uint32_t instanceBudget{ 250000 };  // экземпляров кадра до поэкземплярного отсечения, сверх - прореживание всех ячеек
+	bool     useCompute{ true };        // поэкземплярное отсечение вычислительным шейдером, иначе задачами на CPU
+};
+
+// Растительность из сотен тысяч экземпляров. Экземпляры рассыпаются по ячейкам сетки и упорядочены
+// внутри ячейки случайно, поэтому прореживание по дистанции и бюджету - это просто префикс ячейки.
+// Поток игры отсекает ячейки; экземпляры отсекает вычислительный шейдер с косвенной отрисовкой,
+// а без него - задачи на CPU, которые добавляют вызовы в общий список пакета кадра
+class Foliage final
+{
+public:
+	struct Statistics final
+	{
+		uint32_t totalInstances{ 0 };
+		uint32_t totalCells{ 0 };
+		uint32_t visibleCells{ 0 };
+		uint32_t submittedInstances{ 0 }; // после прореживания, до поэкземплярного отсечения
+		uint32_t drawnInstances{ 0 };     // только для отсечения на CPU
+		uint32_t impostorInstances{ 0 };  // из них импосторами, только для отсечения на CPU
+		float    budgetScale{ 1.0f };
+	};
+
+	// Нужен контекст GL: создаются шейдер отсечения и буферы
+	void Init(const FoliageSettings& settings = {});
+	void Close();
+	void Clear();
+
+	// Рассыпание экземпляров. Вызывается на потоке с контекстом GL до запуска потока рендера
+	bool AddLayer(const FoliageLayerSettings& settings);
+
+	// Поток игры, после Scene::BuildFramePacket: камера берется из пакета
+	void BuildFramePacket(FramePacket& packet);
+	// Поток рендера, после Scene::RenderPacket: отсечение на GPU и отрисовка программой drawProgram
+	void RenderPacket(const FramePacket& packet, ShaderProgram& drawProgram);
+
+	bool IsComputeAvailable() const { return m_cullProgram != nullptr; }
+	void SetComputeEnabled(bool enabled) { m_settings.useCompute = enabled; }
+	void SetDensityScale(float scale) { m_settings.densityScale = std::clamp(scale, 0.0f, 1.0f); }
+	void SetInstanceBudget(uint32_t budget) { m_settings.instanceBudget = budget; }
+	const Statistics& GetStatistics() const { return m_statistics; }
+
+	void DrawImGui();
+
+private:
+	struct Cell final
+	{
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		uint32_t  firstInstance; // в общем массиве экземпляров всех слоев
+		uint32_t  instanceCount;
+	};
+
+	struct Layer final
+	{
+		FoliageLayerSettings settings;
+		std::vector<Cell>    cells;
+		glm::vec3            boundsCenter{ 0.0f }; // сфера модели в ее системе координат
+		float                boundsRadius{ 0.0f };
+		// меши с единичной локальной трансформацией делят один набор экземпляров
+		bool                 sharedInstances{ true };
+	};
+
+	void cullInstancesOnCpu(FramePacket& packet, size_t firstCell);
+
+	FoliageSettings                m_settings;
+	std::vector<Layer>             m_layers;
+	std::vector<FoliageInstance>   m_instances; // все слои подряд, внутри слоя - по ячейкам
+	Statistics                     m_statistics;
+
+	// Поток рендера
+	std::shared_ptr<ShaderProgram> m_cullProgram;
+	std::shared_ptr<StorageBuffer> m_instanceBuffer;
+	std::shared_ptr<StorageBuffer> m_cellBuffer;
+	std::shared_ptr<StorageBuffer> m_counterBuffer;
+	std::shared_ptr<StorageBuffer> m_commandBuffer;
+	std::shared_ptr<UniformBuffer> m_cullUniformBuffer;
+	// выход отсечения - MeshInstanceData для VAO мешей; старые буферы не удаляются, см. Scene::RenderPacket
+	std::shared_ptr<StorageBuffer>              m_visibleBuffer;
+	std::vector<std::shared_ptr<StorageBuffer>> m_retiredVisibleBuffers;
+};
\ No newline at end of file
@@ -0,0 +1,295 @@
+﻿#include "stdafx.h"
+#include "FrameAllocator.h"
+#include "Log.h"
+//=============================================================================
+namespace
+{
+	constexpr size_t BlockAlignment = 64;
+
+	struct ThreadArena final
+	{
+		LinearArena arena{ "Thread", framemem::ThreadArenaSize };
+		std::atomic<bool> selfReset{ false }; // сбрасывается своим потоком, а не в EndFrame()
+	};
+
+	// Статический объект функции: арены в глобальных объектах других файлов (пакеты кадра)
+	// создают его первыми, значит он переживет их разрушение
+	struct Registry final
+	{
+		std::mutex                                mutex;
+		std::vector<LinearArena*>                 arenas;       // все арены, для отчета
+		std::vector<std::unique_ptr<ThreadArena>> threadArenas; // живут до конца программы: потоки держат на них указатели
+	};
+
+	Registry& getRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	thread_local ThreadArena* localArena{ nullptr };
+
+	std::atomic<uint64_t> heapAllocations{ 0 };
+	uint64_t              frameStartHeapAllocations{ 0 };
+	uint64_t              lastFrameHeapAllocations{ 0 };
+	uint64_t              maxSteadyFrameHeapAllocations{ 0 };
+	uint64_t              frameCount{ 0 };
+
+	std::byte* allocateBlock(size_t size)
+	{
+		return static_cast<std::byte*>(::operator new(size, std::align_val_t{ BlockAlignment }));
+	}
+
+	void freeBlock(std::byte* block)
+	{
+		::operator delete(block, std::align_val_t{ BlockAlignment });
+	}
+
+	ThreadArena& getThreadArena()
+	{
+		if (localArena) [[likely]] return *localArena;
+
+		auto threadArena = std::make_unique<ThreadArena>();
+		localArena = threadArena.get();
+		Registry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.threadArenas.push_back(std::move(threadArena));
+		return *localArena;
+	}
+
+	std::string formatSize(size_t size)
+	{
+		if (size >= 1024 * 1024) return std::format("{:.2f} MB", double(size) / (1024.0 * 1024.0));
+		return std::format("{:.1f} KB", double(size) / 1024.0);
+	}
+}
+//=============================================================================
+// Счетчик выделений из кучи для проверки кадра без выделений
+#if defined(_DEBUG)
+void* operator new(size_t size)
+{
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size ? size : 1)) return memory;
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+	const size_t align = (size_t)alignment;
+	size = (std::max<size_t>(size, 1) + align - 1) & ~(align - 1);
+#	if defined(_MSC_VER)
+	if (void* memory = _aligned_malloc(size, align)) return memory;
+#	else
+	if (void* memory = std::aligned_alloc(align, size)) return memory;
+#	endif
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+void operator delete[](void* memory) noexcept
+{
+	std::free(memory);
+}
+void operator delete(void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+void operator delete[](void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+#	if defined(_MSC_VER)
+	_aligned_free(memory);
+#	else
+	std::free(memory);
+#	endif
+}
+void operator delete[](void* memory, std::align_val_t alignment) noexcept
+{
+	operator delete(memory, alignment);
+}
+void operator delete(void* memory, size_t, std::align_val_t alignment) noexcept
+{
+	operator delete(memory, alignment);
+}
+void operator delete[](void* memory, size_t, std::align_val_t alignment) noexcept
+{
+	operator delete(memory, alignment);
+}
+#endif
+//=============================================================================
+LinearArena::LinearArena(const char* name, size_t initialSize)
+	: m_name(name)
+{
+	initialSize = std::max<size_t>(initialSize, BlockAlignment);
+	m_blocks.reserve(8);
+	m_blocks.emplace_back(allocateBlock(initialSize), initialSize);
+	setBlock(m_blocks.back().first, initialSize);
+	m_capacity.store(initialSize, std::memory_order_relaxed);
+
+	Registry& registry = getRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.arenas.push_back(this);
+}
+//=============================================================================
+LinearArena::~LinearArena()
+{
+	{
+		Registry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		std::erase(registry.arenas, this);
+	}
+	for (const auto& block : m_blocks)
+		freeBlock(block.first);
+}
+//=============================================================================
+void LinearArena::Reset()
+{
+	const size_t used = GetUsed();
+	const size_t highWaterMark = std::max(used, GetHighWaterMark());
+	m_lastUsed.store(used, std::memory_order_relaxed);
+	m_highWaterMark.store(highWaterMark, std::memory_order_relaxed);
+
+	if (m_blocks.size() > 1)
+	{
+		// блоков не хватило: заменяем их одним с запасом, чтобы следующие кадры уложились в него
+		for (const auto& block : m_blocks)
+			freeBlock(block.first);
+		m_blocks.clear();
+		const size_t size = (highWaterMark + highWaterMark / 4 + BlockAlignment - 1) & ~(BlockAlignment - 1);
+		m_blocks.emplace_back(allocateBlock(size), size);
+		m_capacity.store(size, std::memory_order_relaxed);
+	}
+	setBlock(m_blocks.back().first, m_blocks.back().second);
+	m_usedInFullBlocks = 0;
+}
+//=============================================================================
+void* LinearArena::allocateSlow(size_t size, size_t alignment)
+{
+	m_overflowCount.fetch_add(1, std::memory_order_relaxed);
+	m_usedInFullBlocks += m_cursor - m_blockStart;
+
+	const size_t blockSize = std::max(size + alignment, m_blocks.back().second * 2);
+	m_blocks.emplace_back(allocateBlock(blockSize), blockSize);
+	setBlock(m_blocks.back().first, blockSize);
+	m_capacity.fetch_add(blockSize, std::memory_order_relaxed);
+
+	const uintptr_t address = (m_cursor + alignment - 1) & ~uintptr_t(alignment - 1);
+	m_cursor = address + size;
+	return reinterpret_cast<void*>(address);
+}
+//=============================================================================
+void LinearArena::setBlock(std::byte* block, size_t size)
+{
+	m_blockStart = reinterpret_cast<uintptr_t>(block);
+	m_cursor = m_blockStart;
+	m_end = m_blockStart + size;
+}
+//=============================================================================
+LinearArena& framemem::GetThreadArena()
+{
+	return getThreadArena().arena;
+}
+//=============================================================================
+void framemem::ResetThreadArena()
+{
+	ThreadArena& threadArena = getThreadArena();
+	threadArena.selfReset.store(true, std::memory_order_relaxed);
+	threadArena.arena.Reset();
+}
+//=============================================================================
+void framemem::EndFrame()
+{
+	{
+		Registry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto& threadArena : registry.threadArenas)
+		{
+			if (!threadArena->selfReset.load(std::memory_order_relaxed))
+				threadArena->arena.Reset();
+		}
+	}
+
+	if constexpr (HeapTrackingEnabled)
+	{
+		const uint64_t allocations = heapAllocations.load(std::memory_order_relaxed);
+		lastFrameHeapAllocations = allocations - frameStartHeapAllocations;
+		frameStartHeapAllocations = allocations;
+
+		// после прогрева кадр не должен обращаться к куче, сообщаем о каждом новом максимуме
+		if (++frameCount > WarmupFrames && lastFrameHeapAllocations > maxSteadyFrameHeapAllocations)
+		{
+			maxSteadyFrameHeapAllocations = lastFrameHeapAllocations;
+			LOG_WARNING(Core, "Frame {} made {} heap allocations after warm-up", frameCount, lastFrameHeapAllocations);
+		}
+	}
+}
+//=============================================================================
+uint64_t framemem::GetHeapAllocationCount()
+{
+	return heapAllocations.load(std::memory_order_relaxed);
+}
+//=============================================================================
+uint64_t framemem::GetLastFrameHeapAllocations()
+{
+	return lastFrameHeapAllocations;
+}
+//=============================================================================
+void framemem::LogReport()
+{
+	Registry& registry = getRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for (const LinearArena* arena : registry.arenas)
+	{
+		LOG_INFO(Core, "Arena {}: high-water {}, capacity {}, overflows {}", arena->GetName(),
+			formatSize(arena->GetHighWaterMark()), formatSize(arena->GetCapacity()), arena->GetOverflowCount());
+	}
+}
+//=============================================================================
+void framemem::DrawImGui()
+{
+	ImGui::Begin("Frame memory");
+
+	if constexpr (HeapTrackingEnabled)
+		ImGui::Text("Heap allocations: last frame %llu, total %llu", (unsigned long long)lastFrameHeapAllocations, (unsigned long long)GetHeapAllocationCount());
+	else
+		ImGui::TextUnformatted("Heap allocation tracking is available in debug builds");
+
+	if (ImGui::BeginTable("Arenas", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+	{
+		ImGui::TableSetupColumn("Arena");
+		ImGui::TableSetupColumn("Last frame, KB");
+		ImGui::TableSetupColumn("High-water, KB");
+		ImGui::TableSetupColumn("Capacity, KB");
+		ImGui::TableSetupColumn("Overflows");
+		ImGui::TableHeadersRow();
+
+		Registry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (const LinearArena* arena : registry.arenas)
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn(); ImGui::TextUnformatted(arena->GetName());
+			ImGui::TableNextColumn(); ImGui::Text("%.1f", double(arena->GetLastUsed()) / 1024.0);
+			ImGui::TableNextColumn(); ImGui::Text("%.1f", double(arena->GetHighWaterMark()) / 1024.0);
+			ImGui::TableNextColumn(); ImGui::Text("%.1f", double(arena->GetCapacity()) / 1024.0);
+			ImGui::TableNextColumn(); ImGui::Text("%u", arena->GetOverflowCount());
+		}
+		ImGui::EndTable();
+	}
+
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,124 @@
+﻿#pragma once
+
+// Линейная арена: выделение - сдвиг указателя, освобождение - только сбросом всей арены.
+// Если блок закончился, арена берет дополнительный блок из кучи, а при сбросе заменяет все блоки
+// одним по пику использования, так что в установившемся режиме куча не нужна.
+// Арена не потокобезопасна: пишет в нее один поток
+class LinearArena final
+{
+public:
+	// name должен жить до конца программы (строковый литерал)
+	explicit LinearArena(const char* name, size_t initialSize = 64 * 1024);
+	~LinearArena();
+
+	LinearArena(const LinearArena&) = delete;
+	LinearArena& operator=(const LinearArena&) = delete;
+
+	void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+	{
+		const uintptr_t address = (m_cursor + alignment - 1) & ~uintptr_t(alignment - 1);
+		if (address + size <= m_end) [[likely]]
+		{
+			m_cursor = address + size;
+			return reinterpret_cast<void*>(address);
+		}
+		return allocateSlow(size, alignment);
+	}
+
+	template<typename T>
+	T* AllocateArray(size_t count) { return static_cast<T*>(Allocate(sizeof(T) * count, alignof(T))); }
+
+	// Вся выделенная из арены память становится недействительной
+	void Reset();
+
+	const char* GetName() const { return m_name; }
+	size_t GetUsed() const { return m_usedInFullBlocks + (m_cursor - m_blockStart); }
+
+	// Значения ниже обновляются в Reset() и читаются с любого потока
+	size_t GetLastUsed() const { return m_lastUsed.load(std::memory_order_relaxed); }
+	size_t GetHighWaterMark() const { return m_highWaterMark.load(std::memory_order_relaxed); }
+	size_t GetCapacity() const { return m_capacity.load(std::memory_order_relaxed); }
+	uint32_t GetOverflowCount() const { return m_overflowCount.load(std::memory_order_relaxed); }
+
+private:
+	void* allocateSlow(size_t size, size_t alignment);
+	void  setBlock(std::byte* block, size_t size);
+
+	const char* m_name;
+
+	uintptr_t m_blockStart{ 0 };
+	uintptr_t m_cursor{ 0 };
+	uintptr_t m_end{ 0 };
+	size_t    m_usedInFullBlocks{ 0 };
+
+	std::vector<std::pair<std::byte*, size_t>> m_blocks; // последний - текущий
+
+	std::atomic<size_t>   m_lastUsed{ 0 };
+	std::atomic<size_t>   m_highWaterMark{ 0 };
+	std::atomic<size_t>   m_capacity{ 0 };
+	std::atomic<uint32_t> m_overflowCount{ 0 }; // сколько раз не хватило блока
+};
+
+// Адаптер для контейнеров STL. deallocate ничего не делает: память возвращается сбросом арены,
+// поэтому контейнер не должен пережить сброс своей арены. Без final: контейнеры наследуются от аллокатора
+template<typename T>
+class ArenaAllocator
+{
+public:
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	ArenaAllocator(LinearArena& arena) noexcept : m_arena(&arena) {}
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) noexcept : m_arena(other.GetArena()) {}
+
+	T* allocate(size_t count) { return m_arena->AllocateArray<T>(count); }
+	void deallocate(T*, size_t) noexcept {}
+
+	LinearArena* GetArena() const noexcept { return m_arena; }
+
+	template<typename U>
+	bool operator==(const ArenaAllocator<U>& other) const noexcept { return m_arena == other.GetArena(); }
+
+private:
+	LinearArena* m_arena;
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Арены кадра. У каждого потока своя арена для временных данных кадра, арены потока игры и
+// потоков задач сбрасываются в Context::EndFrame(). Данные, которые читает поток рендера,
+// живут в арене пакета кадра (FramePacket::arena) - пакетов два, так что арена сбрасывается,
+// только когда поток рендера закончил с ней работать
+namespace framemem
+{
+	constexpr size_t   ThreadArenaSize = 256 * 1024;
+	constexpr uint32_t WarmupFrames = 120; // после них выделения из кучи в кадре считаются ошибкой
+
+#if defined(_DEBUG)
+	constexpr bool HeapTrackingEnabled = true;
+#else
+	constexpr bool HeapTrackingEnabled = false;
+#endif
+
+	LinearArena& GetThreadArena();
+
+	template<typename T>
+	ArenaAllocator<T> GetThreadAllocator() { return ArenaAllocator<T>(GetThreadArena()); }
+
+	// Поток сам сбрасывает свою арену (поток рендера - перед каждым пакетом), EndFrame() ее больше не трогает
+	void ResetThreadArena();
+
+	// Граница кадра игры. Задачи, которые пишут в арену своего потока, должны закончиться до нее
+	void EndFrame();
+
+	// Выделения через operator new с начала работы, считаются только в отладочной сборке
+	uint64_t GetHeapAllocationCount();
+	uint64_t GetLastFrameHeapAllocations();
+
+	// Пики использования всех арен в журнал
+	void LogReport();
+	void DrawImGui();
+}
@@ -0,0 +1,44 @@
+﻿#include "stdafx.h"
+#include "FramePacket.h"
+//=============================================================================
+ImGuiDrawDataCopy::~ImGuiDrawDataCopy()
+{
+	for (ImDrawList* list : m_lists)
+		IM_DELETE(list);
+}
+//=============================================================================
+void ImGuiDrawDataCopy::Capture(const ImDrawData* drawData)
+{
+	m_valid = false;
+	if (!drawData || !drawData->Valid) return;
+
+	while (m_lists.size() < (size_t)drawData->CmdListsCount)
+		m_lists.push_back(IM_NEW(ImDrawList)(drawData->CmdLists[0]->_Data));
+
+	m_drawData.Clear();
+	for (int i = 0; i < drawData->CmdListsCount; i++)
+	{
+		const ImDrawList* source = drawData->CmdLists[i];
+		ImDrawList* list = m_lists[i];
+		// resize + memcpy вместо operator=: ImVector::operator= освобождает память
+		list->CmdBuffer.resize(source->CmdBuffer.Size);
+		list->IdxBuffer.resize(source->IdxBuffer.Size);
+		list->VtxBuffer.resize(source->VtxBuffer.Size);
+		memcpy(list->CmdBuffer.Data, source->CmdBuffer.Data, source->CmdBuffer.size_in_bytes());
+		memcpy(list->IdxBuffer.Data, source->IdxBuffer.Data, source->IdxBuffer.size_in_bytes());
+		memcpy(list->VtxBuffer.Data, source->VtxBuffer.Data, source->VtxBuffer.size_in_bytes());
+		list->Flags = source->Flags;
+
+		// AddDrawList() проверяет служебные указатели записи, у копии их нет
+		m_drawData.CmdLists.push_back(list);
+		m_drawData.TotalVtxCount += list->VtxBuffer.Size;
+		m_drawData.TotalIdxCount += list->IdxBuffer.Size;
+	}
+	m_drawData.CmdListsCount = m_drawData.CmdLists.Size;
+	m_drawData.DisplayPos = drawData->DisplayPos;
+	m_drawData.DisplaySize = drawData->DisplaySize;
+	m_drawData.FramebufferScale = drawData->FramebufferScale;
+	m_drawData.Valid = true;
+	m_valid = true;
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,112 @@
+﻿#pragma once
+
+#include "Scene.h"
+#include "Foliage.h"
+#include "Crowd.h"
+#include "Terrain.h"
+#include "MorphTarget.h"
+#include "FrameAllocator.h"
+
+// Один вызов отрисовки: instanceCount экземпляров меша из FramePacket::instances начиная с firstInstance.
+// Потоку рендера не нужно обращаться к узлам сцены
+struct DrawBatch final
+{
+	const Mesh* mesh;
+	uint32_t    firstInstance;
+	uint32_t    instanceCount;
+};
+
+// Меш со скиннингом: экземпляр firstInstance + i берет палитру суставов с матрицы
+// skinInstances[firstSkinInstance + i] из FramePacket::skinPalettes
+struct SkinnedDrawBatch final
+{
+	const Mesh* mesh;
+	uint32_t    firstInstance;
+	uint32_t    instanceCount;
+	uint32_t    firstSkinInstance;
+};
+
+// То же для импосторов дальних экземпляров, экземпляры в том же FramePacket::instances
+struct ImpostorBatch final
+{
+	const Impostor* impostor;
+	uint32_t        firstInstance;
+	uint32_t        instanceCount;
+};
+
+// Меш узла с активными целями морфинга: рисуется отдельным вызовом из своей копии вершин
+struct MorphDraw final
+{
+	static constexpr uint32_t NoSkin = ~0u;
+
+	const Mesh* mesh;
+	uint32_t    instance;     // в FramePacket::instances
+	uint32_t    skinInstance; // в FramePacket::skinInstances, NoSkin - меш рисуется без скиннинга
+	uint32_t    firstWeight;  // активные цели в FramePacket::morphWeights
+	uint32_t    weightCount;
+	uint32_t    firstVertex;  // вершины экземпляра в буфере морфинга кадра
+};
+
+// Копия ImDrawData. Списки ImGui принадлежат контексту ImGui и перезаписываются следующим кадром,
+// поэтому поток рендера рисует свою копию. Буферы переиспользуются между кадрами
+class ImGuiDrawDataCopy final
+{
+public:
+	ImGuiDrawDataCopy() = default;
+	~ImGuiDrawDataCopy();
+	ImGuiDrawDataCopy(const ImGuiDrawDataCopy&) = delete;
+	ImGuiDrawDataCopy& operator=(const ImGuiDrawDataCopy&) = delete;
+
+	void Capture(const ImDrawData* drawData);
+	void Clear() { m_valid = false; }
+
+	// nullptr, если в кадре нет интерфейса
+	ImDrawData* Get() { return m_valid ? &m_drawData : nullptr; }
+
+private:
+	ImDrawData               m_drawData;
+	std::vector<ImDrawList*> m_lists;
+	bool                     m_valid{ false };
+};
+
+// Снимок кадра: поток игры заполняет его целиком, после отправки поток рендера только читает
+struct FramePacket final
+{
+	static constexpr size_t ArenaSize = 1024 * 1024;
+
+	// Память переменных данных кадра. Сбрасывается, когда пакет снова выдается потоку игры
+	LinearArena arena{ "Packet", ArenaSize };
+
+	uint64_t  frameIndex{ 0 };
+	int       width{ 0 };
+	int       height{ 0 };
+	bool      resized{ false };
+
+	CameraUniformData                       camera;
+	std::array<PointLightData, MaxNumLight> lights;
+	MaterialData                            material;
+	uint32_t                                brdf{ 0 }; // subroutine BRDF для освещаемых шейдеров
+	ArenaVector<DrawBatch>                  batches{ arena };
+	ArenaVector<MeshInstanceData>           instances{ arena };
+	ArenaVector<ImpostorBatch>              impostorBatches{ arena };
+	ArenaVector<SkinnedDrawBatch>           skinnedBatches{ arena };
+	ArenaVector<uint32_t>                   skinInstances{ arena };  // первая матрица палитры экземпляра
+	ArenaVector<SkinMatrix>                 skinPalettes{ arena };   // палитры видимых узлов с аниматором подряд
+	uint32_t                                drawItems{ 0 }; // мешей в кадре до объединения в вызовы
+	ArenaVector<MorphDraw>                  morphDraws{ arena };
+	ArenaVector<MorphWeight>                morphWeights{ arena };
+	ArenaVector<MeshVertex>                 morphVertices{ arena };  // посчитанные на CPU, пусто при morphCompute
+	uint32_t                                morphVertexCount{ 0 };
+	bool                                    morphCompute{ false };   // цели применяет вычислительный проход на потоке рендера
+	ArenaVector<FoliageCellDraw>            foliageCells{ arena };
+	bool                                    foliageCompute{ false }; // экземпляры ячеек отсекает GPU, иначе они уже в batches
+	ArenaVector<TerrainNodeInstance>        terrainNodes{ arena };
+	std::array<uint32_t, 5>                 terrainNodeGroups{};     // подряд идущие целые узлы, затем четверти 0..3
+	ArenaVector<TerrainPageCache::Upload>   terrainUploads{ arena }; // страницы, готовые к этому кадру
+	ArenaVector<CrowdDraw>                  crowdDraws{ arena };
+	float                                   crowdTime{ 0.0f };       // время толпы между двумя последними тиками
+
+	ImGuiDrawDataCopy ui;
+
+	std::string screenshotPath; // не пусто - сохранить кадр после отрисовки
+};
@@ -1,16 +1,65 @@
 ﻿#include "stdafx.h"
 #include "GameApp.h"
+#include "Log.h"
+#include "GpuProfiler.h"
+#include "Profiler.h"
+#include "RenderThread.h"
+#include "FrameAllocator.h"
+#include "AnimationGraph.h"
+#include "Foliage.h"
+#include "Crowd.h"
+#include "Impostor.h"
+#include "Terrain.h"
+#include "VertexAnimation.h"
+#include "MorphTarget.h"
+#include "ScriptBindings.h"
+#include "ScriptCache.h"
+#include "Collision.h"
 //=============================================================================
 // Shader sources
 #pragma region [ Shaders sources ]
 const GLchar* vertexShaderSource = R"glsl(
 #version 430 core
 
-layout(binding = 0) uniform TransformData
+layout(binding = 1) uniform CameraData
 {
-	mat4 model;
+	mat4 view;
+	mat4 projection;
+	vec3 cameraPosition;
 };
 
+layout(location = 0) in vec3 VertexPosition;
+layout(location = 1) in vec3 VertexNormal;
+layout(location = 2) in vec2 VertexTexCoords;
+layout(location = 3) in mat4 InstanceWorld; // MeshInstanceData
+layout(location = 7) in vec4 InstanceTint;
+
+layout(location = 0) smooth out vec3 PositionOut;
+layout(location = 1) smooth out vec3 NormalOut;
+layout(location = 2) smooth out vec2 TexCoordsOut;
+layout(location = 3) flat out vec4 TintOut;
+
+void main()
+{
+	// Transform vertex
+	vec4 position = InstanceWorld * vec4(VertexPosition, 1.0f);
+	gl_Position = projection * view * position;
+	PositionOut = position.xyz;
+
+	// Transform normal
+	vec4 normal = InstanceWorld * vec4(VertexNormal, 0.0f);
+	NormalOut = normal.xyz;
+
+	// Pass-through UV coordinates
+	TexCoordsOut = VertexTexCoords;
+	TintOut = InstanceTint;
+}
+)glsl";
+
+// Тот же вершинный шейдер со скиннингом: палитры суставов видимых узлов лежат в буферах хранения сцены
+const GLchar* skinnedVertexShaderSource = R"glsl(
+#version 430 core
+
 layout(binding = 1) uniform CameraData
 {
 	mat4 view;
@@ -18,27 +67,127 @@ layout(binding = 1) uniform CameraData
 	vec3 cameraPosition;
 };
 
+// Three rows of an affine matrix per joint, palettes of all animated nodes back to back
+layout(std430, binding = 4) readonly buffer SkinPaletteStorage { vec4 paletteRows[]; };
+// First palette matrix of each skinned instance
+layout(std430, binding = 5) readonly buffer SkinInstanceStorage { uint paletteOffsets[]; };
+
+uniform int PaletteBase;
+uniform int FirstSkinInstance;
+
 layout(location = 0) in vec3 VertexPosition;
 layout(location = 1) in vec3 VertexNormal;
 layout(location = 2) in vec2 VertexTexCoords;
+layout(location = 3) in mat4 InstanceWorld; // MeshInstanceData
+layout(location = 7) in vec4 InstanceTint;
+layout(location = 8) in uvec4 VertexJoints; // MeshSkinVertex
+layout(location = 9) in vec4 VertexWeights;
+
+layout(location = 0) smooth out vec3 PositionOut;
+layout(location = 1) smooth out vec3 NormalOut;
+layout(location = 2) smooth out vec2 TexCoordsOut;
+layout(location = 3) flat out vec4 TintOut;
+
+void main()
+{
+	// Blend the joint matrices row by row, weights sum to one
+	const uint palette = uint(PaletteBase) + paletteOffsets[FirstSkinInstance + gl_InstanceID];
+	vec4 row0 = vec4(0.0f);
+	vec4 row1 = vec4(0.0f);
+	vec4 row2 = vec4(0.0f);
+	for (int i = 0; i < 4; i++)
+	{
+		const uint row = (palette + VertexJoints[i]) * 3u;
+		row0 += paletteRows[row + 0u] * VertexWeights[i];
+		row1 += paletteRows[row + 1u] * VertexWeights[i];
+		row2 += paletteRows[row + 2u] * VertexWeights[i];
+	}
+	const vec4 skinnedPosition = vec4(VertexPosition, 1.0f);
+	const vec3 skinnedNormal = vec3(dot(row0.xyz, VertexNormal), dot(row1.xyz, VertexNormal), dot(row2.xyz, VertexNormal));
+
+	// Transform vertex
+	vec4 position = InstanceWorld * vec4(dot(row0, skinnedPosition), dot(row1, skinnedPosition), dot(row2, skinnedPosition), 1.0f);
+	gl_Position = projection * view * position;
+	PositionOut = position.xyz;
+
+	// Transform normal
+	vec4 normal = InstanceWorld * vec4(skinnedNormal, 0.0f);
+	NormalOut = normal.xyz;
+
+	// Pass-through UV coordinates
+	TexCoordsOut = VertexTexCoords;
+	TintOut = InstanceTint;
+}
+)glsl";
+
+// Вершинный шейдер толпы: позиции и нормали вершин берутся из текстур запеченной анимации, см. VertexAnimation
+const GLchar* crowdVertexShaderSource = R"glsl(
+#version 430 core
+
+layout(binding = 1) uniform CameraData
+{
+	mat4 view;
+	mat4 projection;
+	vec3 cameraPosition;
+};
+
+// Clip index, time offset and playback rate of each crowd agent
+layout(std430, binding = 6) readonly buffer CrowdAgentStorage { vec4 agents[]; };
+// First frame, frame count and frame rate of each baked clip
+layout(std430, binding = 7) readonly buffer VertexAnimationClipStorage { vec4 clips[]; };
+
+layout(binding = 3) uniform sampler2D PositionTexture; // normalized to the model bounds
+layout(binding = 4) uniform sampler2D NormalTexture;
+
+uniform float Time;
+uniform int   FirstAgent;
+uniform int   VertexOffset; // first vertex of the mesh in a texture frame
+uniform int   TextureWidth;
+uniform int   RowsPerFrame;
+uniform vec3  BoundsMin;
+uniform vec3  BoundsExtent;
+
+layout(location = 2) in vec2 VertexTexCoords;
+layout(location = 3) in mat4 InstanceWorld; // MeshInstanceData
+layout(location = 7) in vec4 InstanceTint;
 
 layout(location = 0) smooth out vec3 PositionOut;
 layout(location = 1) smooth out vec3 NormalOut;
 layout(location = 2) smooth out vec2 TexCoordsOut;
+layout(location = 3) flat out vec4 TintOut;
+
+ivec2 frameTexel(int frame)
+{
+	const int texel = VertexOffset + gl_VertexID;
+	return ivec2(texel % TextureWidth, frame * RowsPerFrame + texel / TextureWidth);
+}
 
 void main()
 {
+	// Looping clip: its last frame repeats the first one
+	const vec4 agent = agents[FirstAgent + gl_InstanceID];
+	const vec4 clip = clips[int(agent.x)];
+	const float frame = mod((Time + agent.y) * agent.z * clip.z, clip.y - 1.0f);
+	const int frame0 = min(int(frame), int(clip.y) - 2);
+	const float weight = frame - float(frame0);
+	const ivec2 texel0 = frameTexel(int(clip.x) + frame0);
+	const ivec2 texel1 = frameTexel(int(clip.x) + frame0 + 1);
+
+	const vec3 localPosition = BoundsMin + mix(texelFetch(PositionTexture, texel0, 0).xyz, texelFetch(PositionTexture, texel1, 0).xyz, weight) * BoundsExtent;
+	const vec3 localNormal = mix(texelFetch(NormalTexture, texel0, 0).xyz, texelFetch(NormalTexture, texel1, 0).xyz, weight);
+
 	// Transform vertex
-	vec4 position = model * vec4(VertexPosition, 1.0f);
+	vec4 position = InstanceWorld * vec4(localPosition, 1.0f);
 	gl_Position = projection * view * position;
 	PositionOut = position.xyz;
 
 	// Transform normal
-	vec4 normal = model * vec4(VertexNormal, 0.0f);
+	vec4 normal = InstanceWorld * vec4(localNormal, 0.0f);
 	NormalOut = normal.xyz;
 
 	// Pass-through UV coordinates
 	TexCoordsOut = VertexTexCoords;
+	TintOut = InstanceTint;
 }
 )glsl";
 
@@ -110,9 +259,10 @@ layout(binding = 2) uniform sampler2D s2RoughnessTexture;
 #define M_RCPPI 0.31830988618379067153776752674503f
 #define M_PI 3.1415926535897932384626433832795f
 
-layout(location = 0) in vec3 PositionIn;
-layout(location = 1) in vec3 NormalIn;
-layout(location = 2) in vec2 TexCoordsIn;
+layout(location = 0) smooth in vec3 PositionIn;
+layout(location = 1) smooth in vec3 NormalIn;
+layout(location = 2) smooth in vec2 TexCoordsIn;
+layout(location = 3) flat in vec4 TintIn;
 
 out vec4 FragColorOut;
 
@@ -218,12 +368,19 @@ layout(index = 1) subroutine(BRDF) vec3 blinnPhong(in vec3 v3Normal, in vec3 v3L
 
 void main()
 {
+	// Dithered distance fade: opaque geometry dissolves without sorting
+	if (TintIn.a < 1.0f)
+	{
+		float fNoise = fract(52.9829189f * fract(dot(gl_FragCoord.xy, vec2(0.06711056f, 0.00583715f))));
+		if (TintIn.a <= fNoise) discard;
+	}
+
 	// Normalize the inputs
 	vec3 v3Normal = normalize(NormalIn);
 	vec3 v3ViewDirection = normalize(cameraPosition - PositionIn);
 
 	// Get texture data
-	vec4 DiffuseColour = texture(s2DiffuseTexture, TexCoordsIn); // TODO: add mat
+	vec4 DiffuseColour = texture(s2DiffuseTexture, TexCoordsIn) * vec4(TintIn.rgb, 1.0f); // TODO: add mat
 	vec3 v3SpecularColour = texture(s2SpecularTexture, TexCoordsIn).rgb; // TODO: add mat
 	float fRoughness = texture(s2RoughnessTexture, TexCoordsIn).r; // TODO: add mat
 
@@ -249,6 +406,8 @@ void main()
 #pragma endregion
 //=============================================================================
 std::shared_ptr<ShaderProgram> shader;
+std::shared_ptr<ShaderProgram> skinnedShader;
+std::shared_ptr<ShaderProgram> crowdShader;
 std::shared_ptr<Material> tempMaterial;
 std::shared_ptr<Model> model;
 std::shared_ptr<Model> modelCathedral;
@@ -258,24 +417,94 @@ std::shared_ptr<Model> modelPlane;
 
 Camera camera;
 Scene scene;
-Node node;
-Node nodeCathedral;
-Node nodeCube;
-Node nodeSphere;
-Node nodePlane;
+Foliage foliage;
+Crowd crowd;
+Terrain terrain;
+
+std::unordered_map<std::string, std::shared_ptr<Model>> descriptionModels;
+std::unordered_map<std::string, std::shared_ptr<AnimationGraph>> descriptionGraphs; // по пути графа и модели
+bool animationCompression = true;
+std::unique_ptr<script::VM> scriptVM; // сценарии описания сцены; nullptr - сценариев нет
+std::unique_ptr<script::ScriptLoader> scriptLoader;
+bool scriptCache = true;
+bool scriptUpdateFailed = false; // update() с ошибкой не вызывается до успешной перезагрузки
+
+CollisionMesh collisionMesh; // статические узлы сцены
+std::unique_ptr<CharacterController> cameraController;
+bool cameraCollision = true;
+bool cameraWalking = false; // ходьба с гравитацией вместо полета
+float cameraFallSpeed = 0.0f;
+uint32_t brdf = 0; // subroutine BRDF фрагментного шейдера: 0 - GGX, 1 - Blinn-Phong, выбирается клавишами 1 и 2
+constexpr float CameraEyeHeight = 1.65f; // от ног капсулы
+constexpr float Gravity = 9.81f;
 
 bool firstMouse = true;
 float lastX = 1600.0f / 2.0;
 float lastY = 900.0f / 2.0;
 
+//=============================================================================
+namespace
+{
+	// Геометрия столкновений из узлов сцены, которые не двигаются: без аниматора и морфинга.
+	// Меши со скиннингом своей геометрии на CPU не хранят и пропускаются в AddModel
+	void buildCollision()
+	{
+		PROFILE_FUNCTION();
+
+		collisionMesh.Clear();
+		scene.GetWorld().ForEachChunk<const Renderable, const Transform>([](const ecs::ChunkView& chunk)
+		{
+			if (chunk.TryGet<const AnimatorComponent>() || chunk.TryGet<const MorpherComponent>()) return;
+			const Renderable* renderables = chunk.Get<const Renderable>();
+			const Transform* transforms = chunk.Get<const Transform>();
+			for (uint32_t i = 0; i < chunk.GetCount(); i++)
+				collisionMesh.AddModel(*renderables[i].model, transforms[i].GetModelMatrix());
+		});
+		collisionMesh.Build();
+		cameraController = std::make_unique<CharacterController>(collisionMesh, CharacterController::Settings{});
+		cameraFallSpeed = 0.0f;
+
+		const CollisionMesh::Statistics& statistics = collisionMesh.GetStatistics();
+		LOG_INFO(Scene, "Collision mesh: {} triangles, {} nodes, depth {}, built in {:.2f} ms", statistics.triangleCount,
+			statistics.nodeCount, statistics.maxDepth, statistics.buildMilliseconds);
+	}
+
+	// Сдвиг камеры вводом проходит капсулой персонажа: сквозь стены не пролетает, на ступени поднимается
+	void moveCamera(const glm::vec3& start, float deltaTime)
+	{
+		if (!cameraCollision || !cameraController) return;
+
+		glm::vec3 displacement = camera.GetPosition() - start;
+		if (cameraWalking)
+		{
+			// ввод только по горизонтали, по вертикали - падение
+			cameraFallSpeed = cameraController->IsGrounded() ? 0.0f : cameraFallSpeed + Gravity * deltaTime;
+			displacement.y = -cameraFallSpeed * deltaTime;
+		}
+		else if (displacement == glm::vec3(0.0f))
+			return; // камеру мог поставить замер или сценарий
+
+		const glm::vec3 eye(0.0f, CameraEyeHeight, 0.0f);
+		cameraController->SetPosition(start - eye);
+		cameraController->Move(displacement);
+		camera.SetPosition(cameraController->GetPosition() + eye);
+	}
+}
 //=============================================================================
 bool InitGame()
 {
+	PROFILE_FUNCTION();
+
 	rhi::Init();
+	gpuprofiler::Init();
 
 	scene.Init();
+	foliage.Init();
+	crowd.Init();
 
 	shader = std::make_shared<ShaderProgram>(vertexShaderSource, fragmentShaderSource);
+	skinnedShader = std::make_shared<ShaderProgram>(skinnedVertexShaderSource, fragmentShaderSource);
+	crowdShader = std::make_shared<ShaderProgram>(crowdVertexShaderSource, fragmentShaderSource);
 	tempMaterial = std::make_shared<Material>(
 		Texture2D::LoadFromFile("data/Textures/CrateDiffuse.bmp"),
 		Texture2D::LoadFromFile("data/Textures/CrateSpecular.bmp"),
@@ -290,58 +519,524 @@ bool InitGame()
 	modelSphere = Model::CreateSphere(1.0f, 36, 18, tempMaterial);
 	modelPlane = Model::CreatePlane(10.0f, 10.0f, 4.0f, 4.0f, tempMaterial);
 
-	nodePlane.SetModel(modelPlane);
-	//scene.AddNode(&nodePlane);
+	//scene.CreateNode(modelPlane, Transform());
 
-	nodeSphere.SetModel(modelSphere);
-	nodeSphere.GetTransform().SetPosition(glm::vec3(-2.0f, 0.0f, -5.0f));
-	//scene.AddNode(&nodeSphere);
+	//Transform sphereTransform;
+	//sphereTransform.SetPosition(glm::vec3(-2.0f, 0.0f, -5.0f));
+	//scene.CreateNode(modelSphere, sphereTransform);
 
-	nodeCube.SetModel(modelCube);
-	nodeCube.GetTransform().SetPosition(glm::vec3(2.0f, 0.0f, -5.0f));
-	//scene.AddNode(&nodeCube);
+	//Transform cubeTransform;
+	//cubeTransform.SetPosition(glm::vec3(2.0f, 0.0f, -5.0f));
+	//scene.CreateNode(modelCube, cubeTransform);
 
-	node.SetModel(model);
-	node.GetTransform().SetPosition(glm::vec3(0.0f, 0.0f, 0.0f));
-	node.GetTransform().Rotate(-90.0f, glm::vec3(1.0f, 0.0f, 0.0f));
-	//scene.AddNode(&node);
+	//Transform treeTransform;
+	//treeTransform.Rotate(-90.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+	//scene.CreateNode(model, treeTransform);
 
-	nodeCathedral.SetModel(modelCathedral);
-	nodeCathedral.GetTransform().SetPosition(glm::vec3(0.0f, 0.0f, 0.0f));
-	scene.AddNode(&nodeCathedral);
+	Transform cathedralTransform;
+	cathedralTransform.SetPosition(glm::vec3(0.0f, 0.0f, 0.0f));
+	scene.CreateNode(modelCathedral, cathedralTransform);
+	buildCollision();
 
 	return true;
 }
 //=============================================================================
 void CloseGame()
 {
+	scene.LogAnimationLodStatistics();
+	cameraController.reset();
+	collisionMesh.Clear();
+	scriptLoader.reset();
+	scriptVM.reset();
+	scene.Clear();
+	foliage.Close();
+	crowd.Close();
+	terrain.Close();
+	descriptionGraphs.clear();
+	descriptionModels.clear();
+	ClearImpostorResources();
+	ClearVertexAnimationResources();
+	ClearMorphTargetResources();
 	ClearDefaultGraphicsResource();
+	gpuprofiler::Close();
 	rhi::Close();
 }
 //=============================================================================
 void FixedUpdate(double deltaTime)
 {
+	PROFILE_FUNCTION();
+
+	// отрисовка смешивает состояние до и после тика
+	scene.SavePreviousTransforms();
+	if (scriptVM && !scriptUpdateFailed)
+	{
+		PROFILE_SCOPE("Scripts");
+		const script::Value arg = script::Value::Number(deltaTime);
+		if (!scriptVM->CallGlobal("update", &arg, 1))
+		{
+			LOG_WARNING(Script, "Script update paused after a runtime error until the script is reloaded");
+			scriptUpdateFailed = true;
+		}
+	}
+	scene.UpdateAnimations((float)deltaTime);
+	crowd.Advance((float)deltaTime);
+}
+//=============================================================================
+void FrameGame(double deltaTime, float alpha, FramePacket& packet)
+{
+	PROFILE_FUNCTION();
+
+	{
+		PROFILE_SCOPE("Input");
+		const glm::vec3 cameraStart = camera.GetPosition();
+		ProcessInput(camera, deltaTime, firstMouse, lastX, lastY);
+		moveCamera(cameraStart, (float)deltaTime);
+	}
+
+	// граница кадра: тики уже прошли, сценарии не выполняются
+	if (scriptLoader && scriptLoader->Update())
+		scriptUpdateFailed = false;
+
+	scene.BuildFramePacket(camera, GetFrameAspect(), alpha, packet);
+	foliage.BuildFramePacket(packet);
+	crowd.BuildFramePacket(alpha, packet);
+	terrain.BuildFramePacket(packet);
+	packet.brdf = brdf;
 }
 //=============================================================================
-void FrameGame(double deltaTime)
+void RenderGame(const FramePacket& packet)
 {
-	ProcessInput(camera, deltaTime, firstMouse, lastX, lastY);
+	PROFILE_FUNCTION();
 
-	glClearColor(0.2f, 0.5f, 0.8f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	{
+		GPU_PROFILE_SCOPE("Clear");
+		glClearColor(0.2f, 0.5f, 0.8f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
 
+	// выбор BRDF запоминается в программе и применяется после каждой ее привязки в Bind()
+	skinnedShader->FragmentSubRoutines(packet.brdf);
+	crowdShader->FragmentSubRoutines(packet.brdf);
+	shader->FragmentSubRoutines(packet.brdf);
+	skinnedShader->Bind();
+	skinnedShader->SetUniform1i("iNumPointLights", 3);
+	crowdShader->Bind();
+	crowdShader->SetUniform1i("iNumPointLights", 3);
 	shader->Bind();
 	shader->SetUniform1i("iNumPointLights", 3); // Set number of lights
-	scene.Render(camera, GetFrameAspect());
+	scene.RenderPacket(packet, *shader, *skinnedShader);
+	foliage.RenderPacket(packet, *shader);
+	crowd.RenderPacket(packet, *crowdShader);
+	terrain.RenderPacket(packet);
+}
+//=============================================================================
+void DrawImGui(double deltaTime, const FixedTimestep& fixedTimestep)
+{
+	const renderthread::FrameResult frameResult = renderthread::GetLastFrameResult();
+	const rhi::FrameStatistics& frameStatistics = frameResult.statistics;
+
+	ImGui::Begin("Render stats");
+	ImGui::Text("Frame: %.2f ms, render thread: %.2f ms%s", deltaTime * 1000.0, frameResult.renderCpuTime,
+		renderthread::IsThreaded() ? "" : " (inline)");
+	ImGui::Text("Draw calls: %u, triangles: %llu", frameStatistics.drawCalls, (unsigned long long)frameStatistics.triangles);
+	ImGui::Text("Texture binds: %u", frameStatistics.textureBinds);
+	ImGui::Text("GL state calls issued: %u", frameStatistics.issuedCalls);
+	ImGui::Text("GL state calls filtered: %u", frameStatistics.filteredCalls);
+	ImGui::Text("Visible nodes: %zu / %zu", scene.GetVisibleNodeCount(), scene.GetNodeCount());
+	bool instancing = scene.IsInstancingEnabled();
+	if (ImGui::Checkbox("Instancing", &instancing)) scene.SetInstancingEnabled(instancing);
+	ImGui::SameLine();
+	ImGui::Text("%u instances in %u draws, saved %u", frameStatistics.instances, frameStatistics.instancedDrawCalls,
+		frameStatistics.instances - frameStatistics.instancedDrawCalls);
+	ImGui::Text("Animated nodes: %zu, joints: %u", scene.GetAnimatedNodeCount(), scene.GetSkinnedJointCount());
+	bool animationLod = scene.IsAnimationLodEnabled();
+	if (ImGui::Checkbox("Animation LOD", &animationLod)) scene.SetAnimationLodEnabled(animationLod);
+	const Scene::AnimationLodStatistics& lodStatistics = scene.GetAnimationLodStatistics();
+	for (uint32_t level = 0; level < AnimationLodSettings::LevelCount; level++)
+	{
+		const uint64_t characters = lodStatistics.totalCharacters[level];
+		ImGui::Text("  LOD %u: %u characters, %u evaluated, %.2f us avg", level, lodStatistics.characters[level], lodStatistics.evaluations[level],
+			characters ? lodStatistics.totalMicroseconds[level] / (double)characters : 0.0);
+	}
+	bool morphCompute = scene.IsMorphComputeEnabled();
+	if (ImGui::Checkbox("Morph compute", &morphCompute)) scene.SetMorphComputeEnabled(morphCompute);
+	ImGui::SameLine();
+	ImGui::Text("%u meshes, %u targets, %u deltas", scene.GetMorphedMeshCount(), scene.GetActiveMorphTargetCount(), scene.GetMorphDeltaCount());
+	if (scriptVM)
+	{
+		const script::GcStatistics& gc = scriptVM->GetGcStatistics();
+		ImGui::Text("Script heap: %zu KB, GC cycles: %llu, max step: %.1f us", scriptVM->GetHeapSize() / 1024, (unsigned long long)gc.cycles, gc.maxStepMicroseconds);
+		const script::ScriptLoader::Statistics& loader = scriptLoader->GetStatistics();
+		ImGui::Text("Script load: %.2f ms, cache %u hits, %u misses, reloads: %u (%u failed)%s",
+			loader.loadMilliseconds, loader.cacheHits, loader.cacheMisses, loader.reloads, loader.failedReloads, scriptUpdateFailed ? ", update paused" : "");
+	}
+	ImGui::Checkbox("Camera collision", &cameraCollision);
+	ImGui::SameLine();
+	ImGui::Checkbox("Walk", &cameraWalking);
+	ImGui::SameLine();
+	const CollisionMesh::Statistics& collisionStatistics = collisionMesh.GetStatistics();
+	ImGui::Text("%u triangles, %u nodes%s", collisionStatistics.triangleCount, collisionStatistics.nodeCount,
+		cameraController && cameraController->IsGrounded() ? ", grounded" : "");
+	ImGui::Separator();
+	ImGui::Text("Tick rate: %.0f Hz, alpha: %.2f", fixedTimestep.GetSettings().tickRate, fixedTimestep.GetAlpha());
+	ImGui::Text("Ticks: %u, sim time: %.2f ms, CPU: %.2f ms", fixedTimestep.GetTicksThisFrame(),
+		fixedTimestep.GetSimTimeThisFrame() * 1000.0, fixedTimestep.GetTickCpuTimeThisFrame() * 1000.0);
+	ImGui::Text("Total ticks: %llu, dropped: %llu", (unsigned long long)fixedTimestep.GetTotalTicks(), (unsigned long long)fixedTimestep.GetDroppedTicks());
+	ImGui::End();
+
+	foliage.DrawImGui();
+	crowd.DrawImGui();
+	terrain.DrawImGui();
+	gpuprofiler::DrawImGui();
+	profiler::DrawImGui();
+	logger::DrawImGui();
+	framemem::DrawImGui();
+}
+//=============================================================================
+namespace
+{
+	// Модель по пути из описания сцены; "@имя" - встроенные процедурные модели
+	std::shared_ptr<Model> createModel(const std::string& modelPath)
+	{
+		if (modelPath == "@cube") return Model::CreateCube(1.0f, tempMaterial);
+		else if (modelPath == "@sphere") return Model::CreateSphere(1.0f, 36, 18, tempMaterial);
+		else if (modelPath == "@plane") return Model::CreatePlane(10.0f, 10.0f, 4.0f, 4.0f, tempMaterial);
+		else if (modelPath == "@skinned") return Model::CreateSkinnedCylinder(0.25f, 2.0f, 48, tempMaterial);
+		else return std::make_shared<Model>(modelPath);
+	}
+}
+//=============================================================================
+bool LoadSceneDescription(const std::string& path)
+{
+	PROFILE_FUNCTION();
+
+	std::ifstream file(path);
+	if (!file)
+	{
+		LOG_ERROR(Scene, "Failed to open scene description: {}", path);
+		return false;
+	}
+
+	scriptLoader.reset();
+	scriptVM.reset();
+	scriptUpdateFailed = false;
+	scene.Clear();
+	collisionMesh.Clear();
+	foliage.Clear();
+	crowd.Clear();
+	terrain.Close();
+	std::vector<std::string> scriptPaths;
+
+	// одна модель на путь: одинаковые объекты делят ресурсы
+	auto getModel = [](const std::string& modelPath)
+	{
+		auto& modelRef = descriptionModels[modelPath];
+		if (!modelRef)
+		{
+			modelRef = createModel(modelPath);
+			if (animationCompression) modelRef->CompressClips(ClipCompressionSettings{});
+		}
+		return modelRef;
+	};
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream stream(line);
+		std::string command;
+		if (!(stream >> command) || command[0] == '#') continue;
+		if (command == "foliage")
+		{
+			FoliageLayerSettings layer;
+			std::string modelPath;
+			std::string densityMapPath;
+			if (!(stream >> modelPath >> densityMapPath >> layer.areaMin.x >> layer.areaMin.y >> layer.areaMax.x >> layer.areaMax.y >> layer.density))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			if (stream >> layer.minScale >> layer.maxScale && stream >> layer.cullDistance)
+			{
+				layer.thinningStart = layer.cullDistance * 0.45f;
+				layer.fadeStart = layer.cullDistance * 0.75f;
+			}
+			if (densityMapPath != "-") layer.densityMapPath = densityMapPath;
+			layer.model = getModel(modelPath);
+			layer.seed = (uint32_t)std::hash<std::string>()(line);
+			if (!foliage.AddLayer(layer)) return false;
+			continue;
+		}
+		if (command == "script")
+		{
+			// сценарии выполняются после загрузки всех узлов, чтобы видеть сцену целиком
+			std::string scriptPath;
+			if (!(stream >> scriptPath))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			scriptPaths.push_back(scriptPath);
+			continue;
+		}
+		if (command == "terrain_tiles")
+		{
+			std::string heightmapPath;
+			std::string tilesPath;
+			uint32_t tileSize = 32;
+			if (!(stream >> heightmapPath >> tilesPath))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			stream >> tileSize;
+			// файл тайлов производный: собирается, только если его нет или карта высот новее
+			std::error_code error;
+			const bool upToDate = std::filesystem::exists(tilesPath, error)
+				&& std::filesystem::last_write_time(tilesPath, error) >= std::filesystem::last_write_time(heightmapPath, error);
+			if (!upToDate && !BuildTerrainTiles(heightmapPath, tilesPath, tileSize)) return false;
+			continue;
+		}
+		if (command == "terrain")
+		{
+			TerrainSettings settings;
+			if (!(stream >> settings.heightmapPath >> settings.origin.x >> settings.origin.y >> settings.sampleSpacing >> settings.heightScale))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			stream >> settings.diffuseTexturePath >> settings.textureScale;
+			if (!terrain.Load(settings)) return false;
+			continue;
+		}
+		if (command == "crowd")
+		{
+			CrowdGroupSettings group;
+			std::string modelPath;
+			if (!(stream >> modelPath >> group.clip >> group.count >> group.areaMin.x >> group.areaMin.y >> group.areaMax.x >> group.areaMax.y))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			if (stream >> group.minRate >> group.maxRate)
+				stream >> group.cullDistance;
+			if (group.clip == "*") group.clip.clear();
+			group.model = getModel(modelPath);
+			group.seed = (uint32_t)std::hash<std::string>()(line);
+			if (!crowd.AddGroup(group)) return false;
+			continue;
+		}
+		if (command == "impostor")
+		{
+			ImpostorSettings settings;
+			std::string modelPath;
+			if (!(stream >> modelPath >> settings.switchDistance))
+			{
+				LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+				return false;
+			}
+			stream >> settings.frames >> settings.frameResolution;
+			const auto& model = getModel(modelPath);
+			auto impostor = Impostor::Bake(*model, settings);
+			if (!impostor) return false;
+			model->SetImpostor(std::move(impostor));
+			continue;
+		}
+		const bool character = command == "character";
+		const bool animated = command == "animated" || character;
+		const bool morphed = command == "morphed";
+		if (command != "model" && !animated && !morphed)
+		{
+			LOG_WARNING(Scene, "Unknown scene description command: {}", command);
+			continue;
+		}
+
+		// у персонажа вместо клипа путь графа, затем значения его параметров; у узла с морфингом - веса целей
+		std::string modelPath;
+		std::string clipName;
+		std::vector<std::pair<std::string, float>> parameters;
+		if (!(stream >> modelPath) || ((animated || morphed) && !(stream >> clipName)))
+		{
+			LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+			return false;
+		}
+		while ((character || morphed) && (stream >> std::ws, std::isalpha(stream.peek())))
+		{
+			std::string parameter;
+			stream >> parameter;
+			const size_t separator = parameter.find('=');
+			if (separator == std::string::npos)
+			{
+				LOG_ERROR(Scene, "Invalid graph parameter '{}' in line: {}", parameter, line);
+				return false;
+			}
+			parameters.emplace_back(parameter.substr(0, separator), std::strtof(parameter.c_str() + separator + 1, nullptr));
+		}
+		glm::vec3 position{ 0.0f };
+		if (!(stream >> position.x >> position.y >> position.z))
+		{
+			LOG_ERROR(Scene, "Invalid scene description line: {}", line);
+			return false;
+		}
+		glm::vec3 rotation{ 0.0f };
+		float scale = 1.0f;
+		float speed = 1.0f;
+		if (stream >> rotation.x >> rotation.y >> rotation.z)
+			stream >> scale >> speed;
+
+		const auto nodeModel = getModel(modelPath);
+		Transform transform;
+		transform.SetPosition(position);
+		transform.Rotate(rotation.x, glm::vec3(1.0f, 0.0f, 0.0f));
+		transform.Rotate(rotation.y, glm::vec3(0.0f, 1.0f, 0.0f));
+		transform.Rotate(rotation.z, glm::vec3(0.0f, 0.0f, 1.0f));
+		transform.SetScale(glm::vec3(scale));
+		const ecs::Entity newNode = scene.CreateNode(nodeModel, transform);
+		if (character)
+		{
+			auto& graph = descriptionGraphs[clipName + "|" + modelPath];
+			if (!graph) graph = AnimationGraph::LoadFromFile(clipName, *nodeModel);
+			if (!graph) return false;
+
+			auto animator = std::make_shared<Animator>(nodeModel->GetSkeleton());
+			animator->SetGraph(graph);
+			animator->SetSpeed(speed);
+			for (const auto& [name, value] : parameters)
+			{
+				if (!animator->GetGraph()->SetParameter(name, value))
+					LOG_WARNING(Scene, "Animation graph {} has no parameter '{}'", clipName, name);
+			}
+			scene.GetWorld().Add(newNode, AnimatorComponent{ std::move(animator) });
+		}
+		else if (animated)
+		{
+			const auto clip = clipName == "*" && nodeModel->GetNumClips() > 0 ? nodeModel->GetClip(0) : nodeModel->FindClip(clipName);
+			if (!nodeModel->GetSkeleton() || !clip)
+			{
+				LOG_ERROR(Scene, "Model {} has no skeleton or clip '{}'", modelPath, clipName);
+				return false;
+			}
+			auto animator = std::make_shared<Animator>(nodeModel->GetSkeleton());
+			animator->Play(clip);
+			animator->SetSpeed(speed);
+			// одинаковые узлы с одним клипом не двигаются в такт
+			animator->SetTime(clip->GetDuration() * (float)(std::hash<std::string>()(line) % 1024) / 1024.0f);
+			scene.GetWorld().Add(newNode, AnimatorComponent{ std::move(animator) });
+		}
+		else if (morphed)
+		{
+			const auto clip = clipName == "-" ? nullptr : nodeModel->FindMorphClip(clipName);
+			if (nodeModel->GetMorphTargetCount() == 0 || (clipName != "-" && !clip))
+			{
+				LOG_ERROR(Scene, "Model {} has no morph targets or morph clip '{}'", modelPath, clipName);
+				return false;
+			}
+			auto morpher = std::make_shared<Morpher>(nodeModel->GetMorphTargetCount());
+			for (const auto& [name, value] : parameters)
+			{
+				const int32_t target = nodeModel->FindMorphTarget(name);
+				if (target >= 0)
+					morpher->SetWeight((uint32_t)target, value);
+				else
+					LOG_WARNING(Scene, "Model {} has no morph target '{}'", modelPath, name);
+			}
+			if (clip)
+			{
+				morpher->Play(clip);
+				morpher->SetTime(clip->GetDuration() * (float)(std::hash<std::string>()(line) % 1024) / 1024.0f);
+			}
+			morpher->SetSpeed(speed);
+			scene.GetWorld().Add(newNode, MorpherComponent{ std::move(morpher) });
+		}
+	}
+
+	if (!scriptPaths.empty())
+	{
+		scriptVM = std::make_unique<script::VM>();
+		script::OpenStandardLibrary(*scriptVM);
+		script::BindScene(*scriptVM, scene, camera);
+		script::ScriptLoader::Settings loaderSettings;
+		loaderSettings.useCache = scriptCache;
+		scriptLoader = std::make_unique<script::ScriptLoader>(*scriptVM, loaderSettings);
+		for (const std::string& scriptPath : scriptPaths)
+		{
+			if (!scriptLoader->RunFile(scriptPath))
+			{
+				scriptLoader.reset();
+				scriptVM.reset();
+				return false;
+			}
+		}
+	}
+
+	buildCollision();
+	LOG_INFO(Scene, "Scene description loaded: {} ({} nodes)", path, scene.GetNodeCount());
+	return true;
+}
+//=============================================================================
+void SetAnimationCompressionEnabled(bool enabled)
+{
+	animationCompression = enabled;
+}
+//=============================================================================
+void SetScriptCacheEnabled(bool enabled)
+{
+	scriptCache = enabled;
 }
 //=============================================================================
-void DrawImGui(double deltaTime)
+bool RunAnimationBenchmark(const std::string& modelPath)
 {
+	const std::shared_ptr<Model> model = createModel(modelPath);
+	if (model->GetNumClips() == 0)
+	{
+		LOG_ERROR(Benchmark, "Model has no animation clips: {}", modelPath);
+		return false;
+	}
 
+	for (size_t i = 0; i < model->GetNumClips(); i++)
+		animation::RunCompressionBenchmark(*model->GetClip(i), ClipCompressionSettings{});
+	return true;
+}
+//=============================================================================
+void SetCameraCollisionEnabled(bool enabled)
+{
+	cameraCollision = enabled;
+}
+//=============================================================================
+bool RunCollisionBenchmark(const std::string& modelPath)
+{
+	const std::shared_ptr<Model> model = createModel(modelPath);
+	return collision::RunBenchmark(*model);
+}
+//=============================================================================
+Camera& GetGameCamera()
+{
+	return camera;
+}
+//=============================================================================
+Scene& GetGameScene()
+{
+	return scene;
+}
+//=============================================================================
+Foliage& GetGameFoliage()
+{
+	return foliage;
+}
+//=============================================================================
+Terrain& GetGameTerrain()
+{
+	return terrain;
+}
+//=============================================================================
+Crowd& GetGameCrowd()
+{
+	return crowd;
 }
 //=============================================================================
 void ProcessInput(Camera& camera, float deltaTime, bool& firstMouse, float& lastX, float& lastY)
 {
+	if (!GetWindow()) return; // без окна ввода нет
+
 	if (glfwGetMouseButton(GetWindow(), GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS)
 	{
 		glfwSetInputMode(GetWindow(), GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -379,9 +1074,10 @@ void ProcessInput(Camera& camera, float deltaTime, bool& firstMouse, float& last
 	if (glfwGetKey(GetWindow(), GLFW_KEY_D) == GLFW_PRESS)
 		camera.ProcessKeyboard(Direction::Right, deltaTime);
 
+	// шейдеры принадлежат потоку рендера: выбор уходит в него с пакетом кадра
 	if (glfwGetKey(GetWindow(), GLFW_KEY_1) == GLFW_PRESS)
-		shader->FragmentSubRoutines(0);
+		brdf = 0;
 	if (glfwGetKey(GetWindow(), GLFW_KEY_2) == GLFW_PRESS)
-		shader->FragmentSubRoutines(1);
+		brdf = 1;
 }
 //=============================================================================
\ No newline at end of file
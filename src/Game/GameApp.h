@@ -3,12 +3,49 @@
 #include "CoreApp.h"
 #include "Scene.h"
 #include "Context.h"
+#include "FixedTimestep.h"
+#include "FramePacket.h"
 
 bool InitGame();
 void CloseGame();
 
+// Один тик симуляции с шагом FixedTimestep::GetFixedDeltaTime()
 void FixedUpdate(double deltaTime);
-void FrameGame(double deltaTime);
-void DrawImGui(double deltaTime);
+// Поток игры: ввод и сборка пакета кадра.
+// alpha - коэффициент интерполяции между двумя последними тиками симуляции
+void FrameGame(double deltaTime, float alpha, FramePacket& packet);
+// Поток рендера: отрисовка пакета
+void RenderGame(const FramePacket& packet);
+void DrawImGui(double deltaTime, const FixedTimestep& fixedTimestep);
+
+// Заменяет сцену описанием из файла: "model <path> <x> <y> <z> [<pitch> <yaw> <roll> [<scale>]]",
+// "animated <path> <clip|*> <x> <y> <z> [<pitch> <yaw> <roll> [<scale> [<speed>]]]" - узел с клипом скелета модели (* - первый клип),
+// "character <path> <graph> [<parameter>=<value> ...] <x> <y> <z> [<pitch> <yaw> <roll> [<scale> [<speed>]]]" - узел с графом анимации, см. AnimationGraph,
+// "morphed <path> <clip|-> [<target>=<weight> ...] <x> <y> <z> [<pitch> <yaw> <roll> [<scale> [<speed>]]]" - узел с весами целей морфинга
+// и клипом морфинга модели (- - только постоянные веса),
+// "foliage <path> <density map|-> <minX> <minZ> <maxX> <maxZ> <density> [<minScale> <maxScale> [<cullDistance>]]",
+// "crowd <path> <clip|*> <count> <minX> <minZ> <maxX> <maxZ> [<minRate> <maxRate> [<cullDistance>]]" - толпа с запеченной анимацией вершин (* - случайные клипы),
+// "impostor <path> <switchDistance> [<frames> <frameResolution>]" - импостор модели дальше switchDistance,
+// "terrain <heightmap|tiles> <originX> <originZ> <sampleSpacing> <heightScale> [<texture> <textureScale>]",
+// "terrain_tiles <heightmap> <tiles> [<tileSize>]" - собрать файл тайлов для потокового ландшафта, если он устарел,
+// "script <path>" - сценарий выполняется после загрузки сцены, его update(dt) вызывается каждый тик фиксированного шага, см. ScriptBindings.h.
+// Измененные файлы сценариев перезагружаются на границе кадра без перезапуска, см. ScriptLoader
+// Узлы без аниматора и морфинга становятся геометрией столкновений камеры, см. CollisionMesh
+bool LoadSceneDescription(const std::string& path);
+// Клипы моделей со скелетом из описаний сцены сжимаются при загрузке, см. AnimationClip::Compress
+void SetAnimationCompressionEnabled(bool enabled);
+// Байткод сценариев читается из кэша по хешу исходника и пишется в него, см. ScriptLoader
+void SetScriptCacheEnabled(bool enabled);
+// Замер сжатия и выборки клипов модели (путь как в описании сцены), результат в лог
+bool RunAnimationBenchmark(const std::string& modelPath);
+// Камера движется капсулой персонажа по статической геометрии сцены, см. CharacterController
+void SetCameraCollisionEnabled(bool enabled);
+// Замер построения дерева столкновений модели и запросов к нему, результат в лог
+bool RunCollisionBenchmark(const std::string& modelPath);
+Camera& GetGameCamera();
+Scene& GetGameScene();
+Foliage& GetGameFoliage();
+Terrain& GetGameTerrain();
+Crowd& GetGameCrowd();
 
 void ProcessInput(Camera& camera, float deltaTime, bool& firstMouse, float& lastX, float& lastY);
\ No newline at end of file
@@ -0,0 +1,331 @@
+﻿#include "stdafx.h"
+#include "GpuProfiler.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t MaxQueriesPerFrame = gpuprofiler::MaxScopesPerFrame * 2;
+	constexpr uint32_t InvalidScope = ~0u;
+
+	struct ScopeRecord final
+	{
+		const char* name;
+		uint32_t    depth;
+		uint32_t    beginQuery;
+		uint32_t    endQuery;
+	};
+
+	struct FrameQueries final
+	{
+		std::array<GLuint, MaxQueriesPerFrame> queries{};
+		std::array<ScopeRecord, gpuprofiler::MaxScopesPerFrame> scopes{};
+		uint64_t frameNumber{ 0 };
+		uint32_t numQueries{ 0 };
+		uint32_t numScopes{ 0 };
+		bool     pending{ false };
+	};
+
+	struct ScopeStats final
+	{
+		std::string name;
+		uint32_t    depth{ 0 };
+		std::array<double, gpuprofiler::HistoryFrames> history{};
+		uint32_t    historyHead{ 0 };
+		uint32_t    historyCount{ 0 };
+		double      last{ 0.0 };
+		double      max{ 0.0 };
+
+		void Push(double value)
+		{
+			history[historyHead] = value;
+			historyHead = (historyHead + 1) % gpuprofiler::HistoryFrames;
+			historyCount = std::min(historyCount + 1, gpuprofiler::HistoryFrames);
+			last = value;
+			max = std::max(max, value);
+		}
+
+		double Average() const
+		{
+			if (historyCount == 0) return 0.0;
+			double sum = 0.0;
+			for (uint32_t i = 0; i < historyCount; i++) sum += history[i];
+			return sum / historyCount;
+		}
+	};
+
+	struct TimelineEntry final
+	{
+		const char* name;
+		uint32_t    depth;
+		double      start;
+		double      end;
+	};
+
+	bool isInit{ false };
+	std::atomic<bool> requestedEnabled{ true };
+
+	// результаты пишет поток рендера, а окно профилировщика читает поток игры
+	std::mutex statsMutex;
+
+	std::array<FrameQueries, gpuprofiler::FramesInFlight> frames;
+	uint32_t currentFrame{ 0 };
+	bool     frameActive{ false };
+	uint64_t frameNumber{ 0 };
+	uint64_t lastResolvedFrameNumber{ ~0ull };
+
+	std::array<uint32_t, gpuprofiler::MaxScopesPerFrame> scopeStack{};
+	uint32_t scopeStackSize{ 0 };
+	uint32_t droppedScopes{ 0 }; // открытые области сверх лимитов: их концы пропускаются
+
+	std::vector<ScopeStats> scopeStats;
+	std::unordered_map<std::string_view, size_t> scopeStatsIndex; // ключ - литерал имени области, поиск без выделений памяти
+	std::vector<TimelineEntry> timeline;
+	double   timelineDuration{ 0.0 };
+	uint64_t droppedFrames{ 0 };
+
+	ScopeStats& getScopeStats(const char* name, uint32_t depth)
+	{
+		auto it = scopeStatsIndex.find(name);
+		if (it != scopeStatsIndex.end()) return scopeStats[it->second];
+
+		scopeStatsIndex[name] = scopeStats.size();
+		ScopeStats& stats = scopeStats.emplace_back();
+		stats.name = name;
+		stats.depth = depth;
+		return stats;
+	}
+
+	// Читает результаты кадра, если GPU уже их записал. Не блокирует: если данных нет - кадр теряется
+	void resolveFrame(FrameQueries& frame)
+	{
+		frame.pending = false;
+		if (frame.numScopes == 0) return;
+
+		// последний запрос кадра - конец корневой области, если он готов, готовы и все остальные
+		GLint available = 0;
+		glGetQueryObjectiv(frame.queries[frame.numQueries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			droppedFrames++;
+			return;
+		}
+
+		std::array<GLuint64, MaxQueriesPerFrame> timestamps;
+		for (uint32_t i = 0; i < frame.numQueries; i++)
+			glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &timestamps[i]);
+
+		const GLuint64 frameStart = timestamps[frame.scopes[0].beginQuery];
+		std::lock_guard<std::mutex> lock(statsMutex);
+		timeline.clear();
+		for (uint32_t i = 0; i < frame.numScopes; i++)
+		{
+			const ScopeRecord& scope = frame.scopes[i];
+			if (scope.endQuery == InvalidScope) continue;
+
+			const double start = double(timestamps[scope.beginQuery] - frameStart) * 1e-6;
+			const double end = double(timestamps[scope.endQuery] - frameStart) * 1e-6;
+			getScopeStats(scope.name, scope.depth).Push(end - start);
+			timeline.push_back({ scope.name, scope.depth, start, end });
+		}
+		timelineDuration = timeline.empty() ? 0.0 : timeline[0].end;
+		lastResolvedFrameNumber = frame.frameNumber;
+	}
+}
+//=============================================================================
+namespace gpuprofiler::detail
+{
+	bool enabled{ false };
+}
+//=============================================================================
+void gpuprofiler::Init()
+{
+	for (auto& frame : frames)
+	{
+		glCreateQueries(GL_TIMESTAMP, MaxQueriesPerFrame, frame.queries.data());
+		frame.numQueries = frame.numScopes = 0;
+		frame.pending = false;
+	}
+	currentFrame = 0;
+	isInit = true;
+}
+//=============================================================================
+void gpuprofiler::Close()
+{
+	if (!isInit) return;
+	for (auto& frame : frames)
+		glDeleteQueries(MaxQueriesPerFrame, frame.queries.data());
+	std::lock_guard<std::mutex> lock(statsMutex);
+	scopeStats.clear();
+	scopeStatsIndex.clear();
+	timeline.clear();
+	detail::enabled = false;
+	isInit = false;
+}
+//=============================================================================
+void gpuprofiler::SetEnabled(bool enabled)
+{
+	// применяется в начале следующего кадра, чтобы не разорвать открытые области
+	requestedEnabled = enabled;
+}
+//=============================================================================
+bool gpuprofiler::IsEnabled()
+{
+	return requestedEnabled;
+}
+//=============================================================================
+void gpuprofiler::BeginFrame()
+{
+	detail::enabled = isInit && requestedEnabled;
+	if (!detail::enabled) return;
+
+	FrameQueries& frame = frames[currentFrame];
+	if (frame.pending) resolveFrame(frame);
+	frame.frameNumber = frameNumber;
+	frame.numQueries = 0;
+	frame.numScopes = 0;
+	scopeStackSize = 0;
+	droppedScopes = 0;
+	frameActive = true;
+
+	BeginScope("Frame");
+}
+//=============================================================================
+void gpuprofiler::EndFrame()
+{
+	if (!frameActive) return;
+
+	while (scopeStackSize > 0) EndScope();
+
+	frames[currentFrame].pending = true;
+	currentFrame = (currentFrame + 1) % FramesInFlight;
+	frameNumber++;
+	frameActive = false;
+}
+//=============================================================================
+void gpuprofiler::BeginScope(const char* name)
+{
+	if (!frameActive) return;
+
+	// области за лимитом вложены в записанные или идут после них, поэтому их концы приходят первыми
+	FrameQueries& frame = frames[currentFrame];
+	if (droppedScopes > 0 || scopeStackSize >= MaxScopesPerFrame || frame.numScopes >= MaxScopesPerFrame)
+	{
+		droppedScopes++;
+		return;
+	}
+
+	const uint32_t beginQuery = frame.numQueries++;
+	glQueryCounter(frame.queries[beginQuery], GL_TIMESTAMP);
+
+	scopeStack[scopeStackSize++] = frame.numScopes;
+	frame.scopes[frame.numScopes++] = { name, scopeStackSize - 1, beginQuery, InvalidScope };
+}
+//=============================================================================
+void gpuprofiler::EndScope()
+{
+	if (!frameActive) return;
+	if (droppedScopes > 0)
+	{
+		droppedScopes--;
+		return;
+	}
+	if (scopeStackSize == 0) return;
+
+	const uint32_t scopeIndex = scopeStack[--scopeStackSize];
+
+	FrameQueries& frame = frames[currentFrame];
+	const uint32_t endQuery = frame.numQueries++;
+	glQueryCounter(frame.queries[endQuery], GL_TIMESTAMP);
+	frame.scopes[scopeIndex].endQuery = endQuery;
+}
+//=============================================================================
+double gpuprofiler::GetAverageFrameTime()
+{
+	std::lock_guard<std::mutex> lock(statsMutex);
+	return scopeStats.empty() ? 0.0 : scopeStats[0].Average();
+}
+//=============================================================================
+double gpuprofiler::GetLastFrameTime()
+{
+	std::lock_guard<std::mutex> lock(statsMutex);
+	return scopeStats.empty() ? 0.0 : scopeStats[0].last;
+}
+//=============================================================================
+uint64_t gpuprofiler::GetFrameNumber()
+{
+	return frameNumber;
+}
+//=============================================================================
+uint64_t gpuprofiler::GetLastResolvedFrameNumber()
+{
+	std::lock_guard<std::mutex> lock(statsMutex);
+	return lastResolvedFrameNumber;
+}
+//=============================================================================
+void gpuprofiler::DrawImGui()
+{
+	ImGui::Begin("GPU profiler");
+
+	bool enabled = requestedEnabled;
+	if (ImGui::Checkbox("Enabled", &enabled)) SetEnabled(enabled);
+	ImGui::SameLine();
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	if (ImGui::Button("Reset max"))
+	{
+		for (auto& stats : scopeStats) stats.max = 0.0;
+	}
+	ImGui::SameLine();
+	ImGui::Text("Dropped frames: %llu", (unsigned long long)droppedFrames);
+
+	if (ImGui::BeginTable("GpuScopes", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+	{
+		ImGui::TableSetupColumn("Scope");
+		ImGui::TableSetupColumn("Avg, ms");
+		ImGui::TableSetupColumn("Last, ms");
+		ImGui::TableSetupColumn("Max, ms");
+		ImGui::TableHeadersRow();
+		for (const auto& stats : scopeStats)
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::Text("%*s%s", (int)stats.depth * 2, "", stats.name.c_str());
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", stats.Average());
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", stats.last);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", stats.max);
+		}
+		ImGui::EndTable();
+	}
+
+	// Временная шкала последнего прочитанного кадра
+	if (!timeline.empty() && timelineDuration > 0.0)
+	{
+		const float rowHeight = ImGui::GetTextLineHeightWithSpacing();
+		uint32_t maxDepth = 0;
+		for (const auto& entry : timeline) maxDepth = std::max(maxDepth, entry.depth);
+
+		const ImVec2 origin = ImGui::GetCursorScreenPos();
+		const float width = std::max(ImGui::GetContentRegionAvail().x, 100.0f);
+		const float height = rowHeight * (maxDepth + 1);
+		ImGui::InvisibleButton("GpuTimeline", ImVec2(width, height));
+
+		ImDrawList* drawList = ImGui::GetWindowDrawList();
+		const float scale = width / (float)timelineDuration;
+		for (const auto& entry : timeline)
+		{
+			const ImVec2 min(origin.x + (float)entry.start * scale, origin.y + entry.depth * rowHeight);
+			const ImVec2 max(origin.x + std::max((float)entry.end * scale, (float)entry.start * scale + 1.0f), min.y + rowHeight - 1.0f);
+			const ImU32 color = ImColor::HSV((entry.depth * 0.17f + 0.55f) - std::floor(entry.depth * 0.17f + 0.55f), 0.6f, 0.7f);
+			drawList->AddRectFilled(min, max, color);
+			drawList->PushClipRect(min, max, true);
+			drawList->AddText(ImVec2(min.x + 2.0f, min.y), IM_COL32_WHITE, entry.name);
+			drawList->PopClipRect();
+
+			if (ImGui::IsMouseHoveringRect(min, max))
+				ImGui::SetTooltip("%s: %.3f ms", entry.name, entry.end - entry.start);
+		}
+	}
+
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
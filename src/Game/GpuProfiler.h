@@ -0,0 +1,64 @@
+﻿#pragma once
+
+// Профилировщик GPU на парах GL_TIMESTAMP запросов. Результаты читаются с задержкой в несколько кадров,
+// поэтому чтение никогда не ждет GPU. Области могут быть вложенными.
+// Кадры и области пишет поток, владеющий контекстом GL; результаты и DrawImGui доступны из любого потока.
+namespace gpuprofiler
+{
+	constexpr uint32_t FramesInFlight = 4;   // размер кольца запросов
+	constexpr uint32_t MaxScopesPerFrame = 64;
+	constexpr uint32_t HistoryFrames = 64;   // по скольким кадрам усредняется результат
+
+	void Init();
+	void Close();
+
+	void SetEnabled(bool enabled);
+	bool IsEnabled();
+
+	void BeginFrame();
+	void EndFrame();
+
+	// name должен жить дольше кадра (строковый литерал)
+	void BeginScope(const char* name);
+	void EndScope();
+
+	// Среднее время кадра на GPU в миллисекундах (0, если данных еще нет)
+	double GetAverageFrameTime();
+	// Время последнего прочитанного кадра в миллисекундах
+	double GetLastFrameTime();
+
+	// Номер записываемого кадра и номер кадра, к которому относится GetLastFrameTime() (~0, если такого еще нет)
+	uint64_t GetFrameNumber();
+	uint64_t GetLastResolvedFrameNumber();
+
+	void DrawImGui();
+
+	namespace detail
+	{
+		extern bool enabled;
+	}
+}
+
+class GpuProfileScope final
+{
+public:
+	explicit GpuProfileScope(const char* name)
+		: m_active(gpuprofiler::detail::enabled)
+	{
+		if (m_active) [[unlikely]] gpuprofiler::BeginScope(name);
+	}
+	~GpuProfileScope()
+	{
+		if (m_active) [[unlikely]] gpuprofiler::EndScope();
+	}
+
+	GpuProfileScope(const GpuProfileScope&) = delete;
+	GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+
+private:
+	bool m_active;
+};
+
+#define GPU_PROFILE_CONCAT_IMPL(a, b) a##b
+#define GPU_PROFILE_CONCAT(a, b) GPU_PROFILE_CONCAT_IMPL(a, b)
+#define GPU_PROFILE_SCOPE(name) GpuProfileScope GPU_PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
@@ -1,11 +1,198 @@
 ﻿#include "stdafx.h"
 #include "Graphics.h"
-#include "CoreApp.h"
+#include "Log.h"
 #include "Utility.h"
+#include "Profiler.h"
+#include "JobSystem.h"
+#include "MorphTarget.h"
 //=============================================================================
 namespace
 {
 	std::shared_ptr<Material> DefaultMeshMaterial;
+
+	// Геометрия меша на CPU: заполняется в задачах, буферы GL создаются на главном потоке
+	struct MeshData final
+	{
+		std::vector<MeshVertex>     vertices;
+		std::vector<MeshSkinVertex> skinVertices; // пусто у меша без скиннинга
+		std::vector<uint32_t>       indices;
+
+		// цели морфинга по порядку aiMesh::mAnimMeshes, modelTarget назначается на главном потоке по имени
+		std::vector<std::string>          morphTargetNames;
+		std::vector<MorphTargets::Target> morphTargets;
+		std::vector<MorphDelta>           morphDeltas;
+	};
+
+	// смещения меньше этого - шум экспорта, а не часть цели
+	constexpr float MorphDeltaEpsilon = 1e-5f;
+
+	glm::mat4 toGlm(const aiMatrix4x4& matrix)
+	{
+		return glm::transpose(*(const glm::mat4*)&matrix);
+	}
+
+	// Веса квантуются в доли 255 так, чтобы их сумма осталась ровно 255: остаток округления - самому тяжелому
+	MeshSkinVertex packSkinVertex(const glm::u8vec4& joints, const glm::vec4& weights)
+	{
+		MeshSkinVertex vertex;
+		vertex.joints = joints;
+		const float sum = weights.x + weights.y + weights.z + weights.w;
+		if (sum <= 0.0f)
+		{
+			vertex.weights = glm::u8vec4(255, 0, 0, 0);
+			return vertex;
+		}
+		int total = 0;
+		int heaviest = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			vertex.weights[i] = (uint8_t)std::lround(weights[i] / sum * 255.0f);
+			total += vertex.weights[i];
+			if (weights[i] > weights[heaviest]) heaviest = i;
+		}
+		vertex.weights[heaviest] = (uint8_t)(vertex.weights[heaviest] + 255 - total);
+		return vertex;
+	}
+
+	// Радиус сустава - расстояние от него до самой дальней вершины под его влиянием в позе привязки
+	void accumulateJointRadii(const Skeleton& skeleton, const std::vector<MeshVertex>& vertices, const std::vector<MeshSkinVertex>& skinVertices,
+		std::vector<float>& radii)
+	{
+		std::vector<glm::vec3> bindPositions(skeleton.GetJointCount());
+		for (uint32_t joint = 0; joint < skeleton.GetJointCount(); joint++)
+			bindPositions[joint] = glm::vec3(glm::inverse(skeleton.GetInverseBindMatrices()[joint])[3]);
+
+		radii.resize(skeleton.GetJointCount(), 0.0f);
+		for (size_t i = 0; i < skinVertices.size(); i++)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				if (skinVertices[i].weights[k] == 0) continue;
+				const uint32_t joint = skinVertices[i].joints[k];
+				radii[joint] = std::max(radii[joint], glm::distance(vertices[i].Position, bindPositions[joint]));
+			}
+		}
+	}
+
+	glm::vec3 sampleKeys(const aiVectorKey* keys, unsigned int count, double tick, const glm::vec3& fallback)
+	{
+		if (count == 0) return fallback;
+		const aiVectorKey* next = std::upper_bound(keys, keys + count, tick, [](double t, const aiVectorKey& key) { return t < key.mTime; });
+		if (next == keys) return glm::vec3(keys[0].mValue.x, keys[0].mValue.y, keys[0].mValue.z);
+		const aiVectorKey& previous = *(next - 1);
+		if (next == keys + count) return glm::vec3(previous.mValue.x, previous.mValue.y, previous.mValue.z);
+		const float weight = (float)((tick - previous.mTime) / (next->mTime - previous.mTime));
+		return glm::mix(glm::vec3(previous.mValue.x, previous.mValue.y, previous.mValue.z), glm::vec3(next->mValue.x, next->mValue.y, next->mValue.z), weight);
+	}
+
+	glm::quat sampleKeys(const aiQuatKey* keys, unsigned int count, double tick, const glm::quat& fallback)
+	{
+		if (count == 0) return fallback;
+		const aiQuatKey* next = std::upper_bound(keys, keys + count, tick, [](double t, const aiQuatKey& key) { return t < key.mTime; });
+		if (next == keys) return glm::quat(keys[0].mValue.w, keys[0].mValue.x, keys[0].mValue.y, keys[0].mValue.z);
+		const aiQuatKey& previous = *(next - 1);
+		const glm::quat from(previous.mValue.w, previous.mValue.x, previous.mValue.y, previous.mValue.z);
+		if (next == keys + count) return from;
+		const float weight = (float)((tick - previous.mTime) / (next->mTime - previous.mTime));
+		return glm::normalize(glm::slerp(from, glm::quat(next->mValue.w, next->mValue.x, next->mValue.y, next->mValue.z), weight));
+	}
+
+	void convertObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib, MeshData& data)
+	{
+		data.vertices.resize(mesh.indices.size());
+		data.indices.resize(mesh.indices.size());
+		for (unsigned int i = 0; i < mesh.indices.size(); i++)
+		{
+			const tinyobj::index_t& index = mesh.indices[i];
+
+			MeshVertex& vertex = data.vertices[i];
+			vertex.Position = glm::vec3(
+				attrib.vertices[3 * index.vertex_index + 0],
+				attrib.vertices[3 * index.vertex_index + 1],
+				attrib.vertices[3 * index.vertex_index + 2]);
+			vertex.Normal = glm::vec3(
+				attrib.normals[3 * index.normal_index + 0],
+				attrib.normals[3 * index.normal_index + 1],
+				attrib.normals[3 * index.normal_index + 2]);
+			vertex.TexCoords = glm::vec2(
+				attrib.texcoords[2 * index.texcoord_index + 0],
+				1.0f - attrib.texcoords[2 * index.texcoord_index + 1]);
+
+			data.indices[i] = i;
+		}
+	}
+
+	void convertAssimpMesh(const aiMesh* mesh, const Skeleton* skeleton, MeshData& data)
+	{
+		data.vertices.resize(mesh->mNumVertices);
+		for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+		{
+			MeshVertex& vertex = data.vertices[i];
+			vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+			if (mesh->HasNormals())
+				vertex.Normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+			else
+				vertex.Normal = glm::vec3{ 0.0f, 1.0f, 0.0f };
+
+			if (mesh->mTextureCoords[0])
+				vertex.TexCoords = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+			else
+				vertex.TexCoords = glm::vec2{ 0.0f };
+		}
+
+		data.indices.reserve(mesh->mNumFaces * 3);
+		for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+		{
+			const aiFace& face = mesh->mFaces[i];
+			for (unsigned int j = 0; j < face.mNumIndices; j++)
+				data.indices.push_back(face.mIndices[j]);
+		}
+
+		// позиции и нормали целей у Assimp полные, в памяти остаются только отличия от меша.
+		// Цель без позиций остается пустой, чтобы номера целей совпадали с номерами в ключах клипов
+		for (unsigned int i = 0; i < mesh->mNumAnimMeshes; i++)
+		{
+			const aiAnimMesh* animMesh = mesh->mAnimMeshes[i];
+			data.morphTargetNames.push_back(animMesh->mName.length > 0 ? animMesh->mName.C_Str() : std::string(mesh->mName.C_Str()) + ".Target" + std::to_string(i));
+			if (animMesh->HasPositions() && animMesh->mNumVertices == mesh->mNumVertices)
+			{
+				static_assert(sizeof(aiVector3D) == sizeof(glm::vec3));
+				data.morphTargets.push_back(MorphTargets::AppendTarget(data.vertices, (const glm::vec3*)animMesh->mVertices,
+					animMesh->HasNormals() ? (const glm::vec3*)animMesh->mNormals : nullptr, MorphDeltaEpsilon, data.morphDeltas));
+			}
+			else
+				data.morphTargets.push_back({ 0, (uint32_t)data.morphDeltas.size(), 0, glm::vec3(0.0f), glm::vec3(0.0f) });
+		}
+
+		if (!skeleton || !mesh->HasBones()) return;
+
+		// четыре самых тяжелых влияния на вершину; лишние уже отброшены aiProcess_LimitBoneWeights
+		std::vector<glm::u8vec4> joints(mesh->mNumVertices, glm::u8vec4(0));
+		std::vector<glm::vec4> weights(mesh->mNumVertices, glm::vec4(0.0f));
+		for (unsigned int i = 0; i < mesh->mNumBones; i++)
+		{
+			const aiBone* bone = mesh->mBones[i];
+			const int32_t joint = skeleton->FindJoint(bone->mName.C_Str());
+			if (joint < 0) continue;
+			for (unsigned int j = 0; j < bone->mNumWeights; j++)
+			{
+				const aiVertexWeight& weight = bone->mWeights[j];
+				glm::vec4& vertexWeights = weights[weight.mVertexId];
+				int lightest = 0;
+				for (int k = 1; k < 4; k++)
+				{
+					if (vertexWeights[k] < vertexWeights[lightest]) lightest = k;
+				}
+				if (weight.mWeight <= vertexWeights[lightest]) continue;
+				vertexWeights[lightest] = weight.mWeight;
+				joints[weight.mVertexId][lightest] = (uint8_t)joint;
+			}
+		}
+
+		data.skinVertices.resize(mesh->mNumVertices);
+		for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+			data.skinVertices[i] = packSkinVertex(joints[i], weights[i]);
+	}
 }
 //=============================================================================
 void ClearDefaultGraphicsResource()
@@ -77,43 +264,94 @@ void Material::Bind(uint32_t diffuseTexSlot, uint32_t specularTexSlot, uint32_t
 //=============================================================================
 Mesh::Mesh(const std::vector<MeshVertex>& vertices, const std::vector<uint32_t>& indices, std::shared_ptr<Material> material, const glm::mat4& localTransform)
 	: m_material(material)
+	, m_vertexCount((uint32_t)vertices.size())
 	, m_localTransform(localTransform)
 {
 	if (!m_material) m_material = GetDefaultMeshMaterial();
+
+	if (!vertices.empty())
+	{
+		m_boundsMin = m_boundsMax = vertices[0].Position;
+		for (const MeshVertex& vertex : vertices)
+		{
+			m_boundsMin = glm::min(m_boundsMin, vertex.Position);
+			m_boundsMax = glm::max(m_boundsMax, vertex.Position);
+		}
+	}
+
+	auto geometry = std::make_shared<MeshGeometry>();
+	geometry->positions.reserve(vertices.size());
+	for (const MeshVertex& vertex : vertices)
+		geometry->positions.push_back(vertex.Position);
+	geometry->indices = indices;
+	m_geometry = std::move(geometry);
+
 	m_vertexBuffer = std::make_shared<VertexBuffer>(vertices.size() * sizeof(MeshVertex), vertices.data());
 	m_indexBuffer = std::make_shared<IndexBuffer>(indices.size(), indices.data());
 	m_VAO = std::make_shared<VertexArray>(m_vertexBuffer, m_indexBuffer, MeshVertex::GetLayout());
+	[[maybe_unused]] const uint32_t instanceBinding = m_VAO->AddLayout(MeshInstanceData::GetLayout());
+	assert(instanceBinding == InstanceBinding);
 }
 //=============================================================================
-void Mesh::Draw()
+Mesh::Mesh(const std::vector<MeshVertex>& vertices, const std::vector<MeshSkinVertex>& skinVertices, const std::vector<uint32_t>& indices,
+	std::shared_ptr<Material> material, const glm::mat4& localTransform)
+	: Mesh(vertices, indices, std::move(material), localTransform)
 {
-	m_material->Bind();
-	m_VAO->Bind();
-	glDrawElements(GL_TRIANGLES, m_indexBuffer->GetCount(), GL_UNSIGNED_INT, nullptr);
+	assert(skinVertices.size() == vertices.size());
+	m_geometry.reset();
+
+	m_skinBuffer = std::make_shared<VertexBuffer>(skinVertices.size() * sizeof(MeshSkinVertex), skinVertices.data());
+	[[maybe_unused]] const uint32_t skinBinding = m_VAO->AddLayout(MeshSkinVertex::GetLayout());
+	assert(skinBinding == SkinBinding);
+	m_VAO->SetVertexBuffer(SkinBinding, m_skinBuffer->GetID());
 }
 //=============================================================================
-Model::Model(const std::vector<Mesh>& meshes)
+void Mesh::Draw(GLuint instanceBuffer, uint32_t baseInstance, uint32_t instanceCount, GLuint vertexBuffer, GLintptr vertexOffset) const
 {
-	m_meshes = meshes;
+	m_material->Bind();
+	if (vertexBuffer != 0)
+		m_VAO->SetVertexBuffer(VertexBinding, vertexBuffer, vertexOffset);
+	else
+		m_VAO->SetVertexBuffer(VertexBinding, m_vertexBuffer->GetID());
+	m_VAO->SetVertexBuffer(InstanceBinding, instanceBuffer);
+	m_VAO->Bind();
+	rhi::DrawElementsInstanced(GL_TRIANGLES, m_indexBuffer->GetCount(), GL_UNSIGNED_INT, nullptr, instanceCount, baseInstance);
 }
 //=============================================================================
-Model::Model(const std::string& path, std::shared_ptr<Material> customMainMaterial)
+void Mesh::DrawIndirect(GLuint instanceBuffer, GLintptr commandOffset) const
 {
-	loadModel(path, customMainMaterial);
+	m_material->Bind();
+	m_VAO->SetVertexBuffer(VertexBinding, m_vertexBuffer->GetID());
+	m_VAO->SetVertexBuffer(InstanceBinding, instanceBuffer);
+	m_VAO->Bind();
+	rhi::DrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, commandOffset);
 }
 //=============================================================================
-void Model::Draw()
+void Mesh::SetMorphTargets(std::shared_ptr<const MorphTargets> targets)
 {
-	for (unsigned int i = 0; i < m_meshes.size(); i++)
+	m_morphTargets = std::move(targets);
+	if (!m_morphTargets) return;
+	for (uint32_t i = 0; i < m_morphTargets->GetTargetCount(); i++)
 	{
-		m_meshes[i].Draw();
+		const MorphTargets::Target& target = m_morphTargets->GetTarget(i);
+		if (target.deltaCount == 0) continue;
+		m_boundsMin = glm::min(m_boundsMin, target.boundsMin);
+		m_boundsMax = glm::max(m_boundsMax, target.boundsMax);
 	}
 }
 //=============================================================================
-void Model::DrawMesh(size_t i)
+Model::Model(const std::vector<Mesh>& meshes)
+{
+	m_meshes = meshes;
+	updateBounds();
+}
+//=============================================================================
+Model::Model(const std::string& path, std::shared_ptr<Material> customMainMaterial)
 {
-	m_meshes[i].Draw();
+	loadModel(path, customMainMaterial);
+	updateBounds();
 }
+
 //=============================================================================
 std::shared_ptr<Model> Model::CreateCube(float length, std::shared_ptr<Material> material)
 {
@@ -257,8 +495,178 @@ std::shared_ptr<Model> Model::CreatePlane(float width, float height, float texWi
 	return std::make_shared<Model>(std::vector<Mesh>{ {vertices, indices, material, glm::mat4(1.0f)} });
 }
 //=============================================================================
+std::shared_ptr<Model> Model::CreateSkinnedCylinder(float radius, float height, uint32_t jointCount, std::shared_ptr<Material> material)
+{
+	constexpr uint32_t Sides = 16;
+	constexpr uint32_t RingsPerJoint = 2;
+	constexpr uint32_t SwayFrames = 60;
+
+	jointCount = std::clamp(jointCount, 1u, Skeleton::MaxJoints);
+	const float segment = height / (float)jointCount;
+
+	// цепочка вверх по оси Y: сустав j стоит в начале своего отрезка
+	auto skeleton = std::make_shared<Skeleton>();
+	for (uint32_t joint = 0; joint < jointCount; joint++)
+	{
+		skeleton->AddJoint("Joint" + std::to_string(joint), (int32_t)joint - 1, glm::vec3(0.0f, joint > 0 ? segment : 0.0f, 0.0f),
+			glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f), glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -segment * (float)joint, 0.0f)));
+	}
+
+	const uint32_t rings = jointCount * RingsPerJoint + 1;
+	std::vector<MeshVertex> vertices;
+	std::vector<MeshSkinVertex> skinVertices;
+	std::vector<uint32_t> indices;
+	vertices.reserve(rings * (Sides + 1) + 1);
+	skinVertices.reserve(vertices.capacity());
+	for (uint32_t ring = 0; ring < rings; ring++)
+	{
+		const float y = height * (float)ring / (float)(rings - 1);
+		// вершина делится между двумя ближайшими суставами по расстоянию до середин их отрезков
+		const float t = y / segment - 0.5f;
+		const uint32_t joint0 = std::min((uint32_t)std::max(t, 0.0f), jointCount - 1);
+		const uint32_t joint1 = std::min(joint0 + 1, jointCount - 1);
+		const float weight1 = glm::clamp(t - (float)joint0, 0.0f, 1.0f);
+		const MeshSkinVertex skin = packSkinVertex(glm::u8vec4(joint0, joint1, 0, 0), glm::vec4(1.0f - weight1, weight1, 0.0f, 0.0f));
+		for (uint32_t side = 0; side <= Sides; side++)
+		{
+			const float angle = glm::two_pi<float>() * (float)side / (float)Sides;
+			const glm::vec3 normal(std::cos(angle), 0.0f, std::sin(angle));
+			vertices.push_back({ glm::vec3(normal.x * radius, y, normal.z * radius), normal, glm::vec2((float)side / (float)Sides, y / height) });
+			skinVertices.push_back(skin);
+		}
+	}
+	for (uint32_t ring = 0; ring + 1 < rings; ring++)
+	{
+		for (uint32_t side = 0; side < Sides; side++)
+		{
+			const uint32_t i0 = ring * (Sides + 1) + side;
+			const uint32_t i1 = i0 + Sides + 1;
+			indices.insert(indices.end(), { i0, i1, i0 + 1, i0 + 1, i1, i1 + 1 });
+		}
+	}
+	// крышка сверху, веером из центра
+	const uint32_t top = (uint32_t)vertices.size();
+	vertices.push_back({ glm::vec3(0.0f, height, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec2(0.5f) });
+	skinVertices.push_back(packSkinVertex(glm::u8vec4(jointCount - 1, 0, 0, 0), glm::vec4(1.0f, 0.0f, 0.0f, 0.0f)));
+	const uint32_t topRing = (rings - 1) * (Sides + 1);
+	for (uint32_t side = 0; side < Sides; side++)
+		indices.insert(indices.end(), { top, topRing + side + 1, topRing + side });
+
+	// клип из поворотов суставов по фазе в [0, 2pi]; последний кадр совпадает с первым
+	auto createClip = [&](const std::string& name, uint32_t frames, auto&& jointRotation)
+	{
+		auto clip = std::make_shared<AnimationClip>(name, skeleton->GetSoaCount(), frames + 1);
+		for (uint32_t frame = 0; frame <= frames; frame++)
+		{
+			const float phase = glm::two_pi<float>() * (float)frame / (float)frames;
+			SoaTransform* pose = clip->GetFrame(frame);
+			for (uint32_t joint = 0; joint < jointCount; joint++)
+				pose[joint / 4].SetJoint(joint % 4, glm::vec3(0.0f, joint > 0 ? segment : 0.0f, 0.0f), jointRotation(phase, joint), glm::vec3(1.0f));
+		}
+		return clip;
+	};
+
+	// Sway: изгиб бежит волной снизу вверх и качает цепочку по кругу. Idle - то же медленнее и слабее,
+	// Bend - цепочка сгибается в сторону +X и разгибается; вместе они заменяют клипы персонажа для графов анимации
+	const float amplitude = glm::half_pi<float>() / (float)jointCount;
+	auto sway = [&](float scale)
+	{
+		return [&, scale](float phase, uint32_t joint)
+		{
+			const float wave = phase - 4.0f * (float)joint / (float)jointCount;
+			return glm::angleAxis(scale * amplitude * std::sin(wave), glm::vec3(0.0f, 0.0f, 1.0f))
+				* glm::angleAxis(0.5f * scale * amplitude * std::cos(wave), glm::vec3(1.0f, 0.0f, 0.0f));
+		};
+	};
+
+	// Bulge раздувает среднюю треть, Flare раскрывает верхнюю четверть; остальные вершины в целях не хранятся
+	std::vector<MorphTargets::Target> morphTargets;
+	std::vector<MorphDelta> morphDeltas;
+	auto addMorphTarget = [&](uint32_t modelTarget, auto&& radialOffset)
+	{
+		std::vector<glm::vec3> positions(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++)
+		{
+			const glm::vec3& position = vertices[i].Position;
+			positions[i] = position + glm::vec3(vertices[i].Normal.x, 0.0f, vertices[i].Normal.z) * radius * radialOffset(position.y / height);
+		}
+		morphTargets.push_back(MorphTargets::AppendTarget(vertices, positions.data(), nullptr, MorphDeltaEpsilon, morphDeltas));
+		morphTargets.back().modelTarget = modelTarget;
+	};
+	addMorphTarget(0, [](float y) { return y > 0.3f && y < 0.7f ? 0.6f * std::sin(glm::pi<float>() * (y - 0.3f) / 0.4f) : 0.0f; });
+	addMorphTarget(1, [](float y) { return y > 0.75f ? 4.0f * (y - 0.75f) * 4.0f * (y - 0.75f) : 0.0f; });
+
+	auto model = std::make_shared<Model>(std::vector<Mesh>{ { vertices, skinVertices, indices, material, glm::mat4(1.0f) } });
+	model->m_meshes[0].SetMorphTargets(std::make_shared<MorphTargets>(vertices, std::move(morphTargets), std::move(morphDeltas)));
+	model->m_morphTargetNames = { "Bulge", "Flare" };
+	// Breathe: середина вздувается и опадает за четыре секунды, раструб раскрывается в первой половине
+	auto breathe = std::make_shared<MorphClip>("Breathe", 2, SwayFrames * 2 + 1, AnimationClip::DefaultFrameRate);
+	for (uint32_t frame = 0; frame < breathe->GetFrameCount(); frame++)
+	{
+		const float phase = glm::two_pi<float>() * (float)frame / (float)(breathe->GetFrameCount() - 1);
+		breathe->GetFrame(frame)[0] = 0.5f - 0.5f * std::cos(phase);
+		breathe->GetFrame(frame)[1] = std::max(std::sin(phase), 0.0f);
+	}
+	model->m_morphClips.push_back(std::move(breathe));
+	accumulateJointRadii(*skeleton, vertices, skinVertices, model->m_jointRadii);
+	model->m_clips.push_back(createClip("Sway", SwayFrames, sway(1.0f)));
+	model->m_clips.push_back(createClip("Idle", SwayFrames * 2, sway(0.25f)));
+	model->m_clips.push_back(createClip("Bend", SwayFrames, [&](float phase, uint32_t)
+	{
+		return glm::angleAxis(-amplitude * (0.5f - 0.5f * std::cos(phase)), glm::vec3(0.0f, 0.0f, 1.0f));
+	}));
+	model->m_skeleton = std::move(skeleton);
+	model->updateBounds();
+	return model;
+}
+//=============================================================================
+std::shared_ptr<const AnimationClip> Model::FindClip(const std::string& name) const
+{
+	for (const auto& clip : m_clips)
+	{
+		if (clip->GetName() == name) return clip;
+	}
+	return nullptr;
+}
+//=============================================================================
+int32_t Model::FindMorphTarget(const std::string& name) const
+{
+	for (size_t i = 0; i < m_morphTargetNames.size(); i++)
+	{
+		if (m_morphTargetNames[i] == name) return (int32_t)i;
+	}
+	return -1;
+}
+//=============================================================================
+std::shared_ptr<const MorphClip> Model::FindMorphClip(const std::string& name) const
+{
+	for (const auto& clip : m_morphClips)
+	{
+		if (clip->GetName() == name) return clip;
+	}
+	return nullptr;
+}
+//=============================================================================
+void Model::CompressClips(const ClipCompressionSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	for (auto& clip : m_clips)
+	{
+		if (clip->IsCompressed()) continue;
+
+		ClipCompressionStatistics statistics;
+		clip = AnimationClip::Compress(*clip, settings, &statistics);
+		LOG_INFO(Graphics, "Clip '{}' compressed: {:.1f} KB -> {:.1f} KB, keys {} of {}, max error {:.3f} deg, translation {:.5f}",
+			clip->GetName(), statistics.rawBytes / 1024.0, statistics.compressedBytes / 1024.0, statistics.keys, statistics.rawKeys,
+			glm::degrees(statistics.maxRotationError), statistics.maxTranslationError);
+	}
+}
+//=============================================================================
 void Model::loadModel(const std::string& path, std::shared_ptr<Material> customMainMaterial)
 {
+	PROFILE_FUNCTION();
+
 	std::string ext = GetFileExtension(path);
 	if (ext.contains("obj"))
 	{
@@ -267,14 +675,55 @@ void Model::loadModel(const std::string& path, std::shared_ptr<Material> customM
 	else
 	{
 		// TODO: неизвестные форматы
-		//Error("Unknown model format: " + path);
+		//LOG_ERROR(Graphics, "Unknown model format: {}", path);
 
 		loadAssimpModel(path, customMainMaterial);
 	}
 }
 //=============================================================================
+void Model::updateBounds()
+{
+	if (m_meshes.empty()) return;
+
+	m_boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	m_boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+	for (const Mesh& mesh : m_meshes)
+	{
+		// AABB меша в системе модели: центр переносится матрицей, полуразмер - модулем ее поворота
+		const glm::mat4& transform = mesh.GetLocalTransform();
+		const glm::vec3 center = glm::vec3(transform * glm::vec4((mesh.GetBoundsMin() + mesh.GetBoundsMax()) * 0.5f, 1.0f));
+		const glm::vec3 halfSize = (mesh.GetBoundsMax() - mesh.GetBoundsMin()) * 0.5f;
+		const glm::mat3 absRotation = glm::mat3(glm::abs(transform[0]), glm::abs(transform[1]), glm::abs(transform[2]));
+		const glm::vec3 extent = absRotation * halfSize;
+		m_boundsMin = glm::min(m_boundsMin, center - extent);
+		m_boundsMax = glm::max(m_boundsMax, center + extent);
+	}
+
+	if (!m_skeleton || m_jointRadii.empty()) return;
+
+	// каждый кадр клипов: сфера сустава радиусом до его самой дальней вершины
+	const Skeleton& skeleton = *m_skeleton;
+	std::vector<glm::mat4> jointMatrices(skeleton.GetJointCount());
+	for (const auto& clip : m_clips)
+	{
+		for (uint32_t frame = 0; frame < clip->GetFrameCount(); frame++)
+		{
+			animation::LocalToModel(skeleton, clip->GetFrame(frame), jointMatrices.data());
+			for (uint32_t joint = 0; joint < skeleton.GetJointCount(); joint++)
+			{
+				if (m_jointRadii[joint] <= 0.0f) continue;
+				const glm::vec3 position(jointMatrices[joint][3]);
+				m_boundsMin = glm::min(m_boundsMin, position - m_jointRadii[joint]);
+				m_boundsMax = glm::max(m_boundsMax, position + m_jointRadii[joint]);
+			}
+		}
+	}
+}
+//=============================================================================
 void Model::loadObjModel(const std::string& path, std::shared_ptr<Material> customMainMaterial)
 {
+	PROFILE_FUNCTION();
+
 	std::string directory = GetFileDirectory(path);
 
 	tinyobj::attrib_t attrib;
@@ -284,12 +733,22 @@ void Model::loadObjModel(const std::string& path, std::shared_ptr<Material> cust
 
 	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.c_str(), directory.c_str()))
 	{
-		Fatal(warn + err);
+		LOG_FATAL(Graphics, "Failed to load model {}: {}{}", path, warn, err);
 		return;
 	}
 
-	for (const auto& shape : shapes)
+	// развертка вершин не зависит от GL - раскидываем формы по задачам
+	std::vector<MeshData> meshData(shapes.size());
+	jobs::ParallelFor((uint32_t)shapes.size(), 1, [&](uint32_t begin, uint32_t end)
 	{
+		PROFILE_SCOPE("ConvertObjMesh");
+		for (uint32_t i = begin; i < end; i++)
+			convertObjMesh(shapes[i].mesh, attrib, meshData[i]);
+	});
+
+	for (size_t i = 0; i < shapes.size(); i++)
+	{
+		const auto& shape = shapes[i];
 		std::shared_ptr<Material> material;
 		if (customMainMaterial)
 		{
@@ -302,117 +761,294 @@ void Model::loadObjModel(const std::string& path, std::shared_ptr<Material> cust
 			else
 				material = GetDefaultMeshMaterial();
 		}
-		processObjMesh(shape.mesh, attrib, material);
+		m_meshes.push_back(Mesh(meshData[i].vertices, meshData[i].indices, material, glm::mat4(1.0f)));
 	}
 }
 //=============================================================================
-void Model::processObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib, std::shared_ptr<Material> material)
-{
-	std::vector<MeshVertex> vertices;
-	std::vector<unsigned int> indices;
-
-	for (unsigned int i = 0; i < mesh.indices.size(); i++)
-	{
-		const tinyobj::index_t& index = mesh.indices[i];
-		
-		MeshVertex vertex;
-		vertex.Position = glm::vec3(
-			attrib.vertices[3 * index.vertex_index + 0], 
-			attrib.vertices[3 * index.vertex_index + 1], 
-			attrib.vertices[3 * index.vertex_index + 2]);
-		vertex.Normal = glm::vec3(
-			attrib.normals[3 * index.normal_index + 0], 
-			attrib.normals[3 * index.normal_index + 1], 
-			attrib.normals[3 * index.normal_index + 2]);
-		vertex.TexCoords = glm::vec2(
-			attrib.texcoords[2 * index.texcoord_index + 0], 
-			1.0f - attrib.texcoords[2 * index.texcoord_index + 1]);
-		
-		vertices.push_back(vertex);
-		indices.push_back(i);
-	}
-
-	m_meshes.push_back(Mesh(vertices, indices, material, glm::mat4(1.0f)));
-}
-//=============================================================================
 void Model::loadAssimpModel(const std::string& path, std::shared_ptr<Material> material)
 {
+	PROFILE_FUNCTION();
+
 	// Load scene from file
 	Assimp::Importer importer;
-	const aiScene* scene = importer.ReadFile(path.c_str(),
-		aiProcess_GenSmoothNormals |
-		aiProcess_CalcTangentSpace |
-		aiProcess_Triangulate |
-		aiProcess_ImproveCacheLocality |
-		aiProcess_SortByPType |
-		aiProcess_OptimizeMeshes); // TODO: aiProcess_FlipUVs?
+	const aiScene* scene = nullptr;
+	{
+		PROFILE_SCOPE("Assimp::ReadFile");
+		scene = importer.ReadFile(path.c_str(),
+			aiProcess_GenSmoothNormals |
+			aiProcess_CalcTangentSpace |
+			aiProcess_Triangulate |
+			aiProcess_ImproveCacheLocality |
+			aiProcess_SortByPType |
+			aiProcess_LimitBoneWeights |
+			aiProcess_OptimizeMeshes); // TODO: aiProcess_FlipUVs?
+	}
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
 	{
-		Error("Failed to open scene file: " + std::string(importer.GetErrorString()));
+		LOG_ERROR(Graphics, "Failed to open scene file: {}", importer.GetErrorString());
 		return;
 	}
 
 	std::string directory = GetFileDirectory(path);
 
 	// Обрабатываем корневой узел и все его потомки
-	processAssimpNode(directory, scene->mRootNode, scene, material);
+	std::vector<std::pair<aiMesh*, glm::mat4>> meshes;
+	processAssimpNode(scene->mRootNode, scene, meshes);
+	loadAssimpSkeleton(scene);
+
+	// конвертация вершин параллельно, создание буферов и загрузка текстур - на главном потоке
+	std::vector<MeshData> meshData(meshes.size());
+	jobs::ParallelFor((uint32_t)meshes.size(), 1, [&](uint32_t begin, uint32_t end)
+	{
+		PROFILE_SCOPE("ConvertAssimpMesh");
+		for (uint32_t i = begin; i < end; i++)
+			convertAssimpMesh(meshes[i].first, m_skeleton.get(), meshData[i]);
+	});
+
+	m_meshes.reserve(m_meshes.size() + meshes.size());
+	std::vector<std::vector<uint32_t>> meshMorphTargets(meshes.size()); // цели модели по номерам целей aiMesh
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		const aiMesh* mesh = meshes[i].first;
+
+		// Обрабатываем материал
+		auto meshMaterial = material;
+		if (mesh->mMaterialIndex >= 0)
+		{
+			aiMaterial* aiMaterial = scene->mMaterials[mesh->mMaterialIndex];
+			meshMaterial = std::make_shared<Material>(
+				loadAssimpTexture(directory, aiMaterial, aiTextureType_DIFFUSE),
+				loadAssimpTexture(directory, aiMaterial, aiTextureType_SPECULAR),
+				loadAssimpTexture(directory, aiMaterial, aiTextureType_HEIGHT));
+		}
+
+		if (meshData[i].skinVertices.empty())
+		{
+			m_meshes.emplace_back(meshData[i].vertices, meshData[i].indices, meshMaterial, meshes[i].second);
+		}
+		else
+		{
+			m_meshes.emplace_back(meshData[i].vertices, meshData[i].skinVertices, meshData[i].indices, meshMaterial, meshes[i].second);
+			accumulateJointRadii(*m_skeleton, meshData[i].vertices, meshData[i].skinVertices, m_jointRadii);
+		}
+
+		if (!meshData[i].morphTargets.empty())
+		{
+			// одноименные цели разных мешей (например, лицо и брови) получают общий вес
+			for (size_t target = 0; target < meshData[i].morphTargets.size(); target++)
+			{
+				const std::string& name = meshData[i].morphTargetNames[target];
+				int32_t modelTarget = FindMorphTarget(name);
+				if (modelTarget < 0)
+				{
+					modelTarget = (int32_t)m_morphTargetNames.size();
+					m_morphTargetNames.push_back(name);
+				}
+				meshData[i].morphTargets[target].modelTarget = (uint32_t)modelTarget;
+				meshMorphTargets[i].push_back((uint32_t)modelTarget);
+			}
+			m_meshes.back().SetMorphTargets(std::make_shared<MorphTargets>(meshData[i].vertices, std::move(meshData[i].morphTargets), std::move(meshData[i].morphDeltas)));
+		}
+	}
+
+	if (!m_morphTargetNames.empty())
+	{
+		loadAssimpMorphClips(scene, meshes, meshMorphTargets);
+		LOG_INFO(Graphics, "Morph targets in {}: {} targets, {} clips", path, m_morphTargetNames.size(), m_morphClips.size());
+	}
+
+	if (m_skeleton)
+	{
+		loadAssimpClips(scene);
+		LOG_INFO(Graphics, "Skinned model {}: {} joints, {} clips", path, m_skeleton->GetJointCount(), m_clips.size());
+	}
 }
 //=============================================================================
-void Model::processAssimpNode(const std::string& directoryModel, aiNode* node, const aiScene* scene, std::shared_ptr<Material> material)
+void Model::processAssimpNode(aiNode* node, const aiScene* scene, std::vector<std::pair<aiMesh*, glm::mat4>>& meshes)
 {
 	for (unsigned int i = 0; i < node->mNumMeshes; i++)
 	{
 		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
 		glm::mat4 localMat = glm::transpose(*(glm::mat4*)&node->mTransformation);
-		m_meshes.emplace_back(processAssimpMesh(directoryModel, localMat, mesh, scene, material));
+		meshes.emplace_back(mesh, localMat);
 	}
 
 	for (unsigned int i = 0; i < node->mNumChildren; i++)
 	{
-		processAssimpNode(directoryModel, node->mChildren[i], scene, material);
+		processAssimpNode(node->mChildren[i], scene, meshes);
 	}
 }
 //=============================================================================
-Mesh Model::processAssimpMesh(const std::string& directoryModel, const glm::mat4& localMat, aiMesh* mesh, const aiScene* scene, std::shared_ptr<Material> defaultMaterial)
+void Model::loadAssimpSkeleton(const aiScene* scene)
 {
-	std::vector<MeshVertex> vertices(mesh->mNumVertices);
-
-	// Обрабатываем вершины
-	for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+	std::unordered_map<std::string, const aiBone*> bones;
+	for (unsigned int i = 0; i < scene->mNumMeshes; i++)
 	{
-		MeshVertex& vertex = vertices[i];
-		vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
-		if (mesh->HasNormals())
-			vertex.Normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
-		else
-			vertex.Normal = glm::vec3{ 0.0f, 1.0f, 0.0f };
-
-		if (mesh->mTextureCoords[0])
-			vertex.TexCoords = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
-		else
-			vertex.TexCoords = glm::vec2{ 0.0f };
+		const aiMesh* mesh = scene->mMeshes[i];
+		for (unsigned int j = 0; j < mesh->mNumBones; j++)
+			bones.emplace(mesh->mBones[j]->mName.C_Str(), mesh->mBones[j]);
 	}
+	if (bones.empty()) return;
 
-	std::vector<unsigned int> indices;
-	for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+	// суставы - узлы костей и все их предки: без предков поза кости не дошла бы до корня модели
+	std::vector<const aiNode*> jointNodes;
+	for (const auto& [name, bone] : bones)
 	{
-		aiFace face = mesh->mFaces[i];
-		for (unsigned int j = 0; j < face.mNumIndices; j++)
-			indices.push_back(face.mIndices[j]);
+		for (const aiNode* node = scene->mRootNode->FindNode(name.c_str()); node; node = node->mParent)
+		{
+			if (std::find(jointNodes.begin(), jointNodes.end(), node) != jointNodes.end()) break;
+			jointNodes.push_back(node);
+		}
+	}
+	if (jointNodes.size() > Skeleton::MaxJoints)
+	{
+		LOG_WARNING(Graphics, "Skeleton has {} joints, more than {}: model is loaded without skinning", jointNodes.size(), Skeleton::MaxJoints);
+		return;
 	}
 
-	// Обрабатываем материал
-	auto material = defaultMaterial;
-	if (mesh->mMaterialIndex >= 0)
+	// обход в глубину дает порядок "родитель раньше потомка"; у узла вне скелета нет суставов и в потомках
+	struct Visit final
+	{
+		const aiNode* node;
+		int32_t       parent;
+		glm::mat4     parentGlobal;
+	};
+	auto skeleton = std::make_shared<Skeleton>();
+	std::vector<Visit> stack{ { scene->mRootNode, -1, glm::mat4(1.0f) } };
+	while (!stack.empty())
 	{
-		aiMaterial* aiMaterial = scene->mMaterials[mesh->mMaterialIndex];
-		material = std::make_shared<Material>(
-			loadAssimpTexture(directoryModel, aiMaterial, aiTextureType_DIFFUSE),
-			loadAssimpTexture(directoryModel, aiMaterial, aiTextureType_SPECULAR),
-			loadAssimpTexture(directoryModel, aiMaterial, aiTextureType_HEIGHT));
+		const Visit visit = stack.back();
+		stack.pop_back();
+		if (std::find(jointNodes.begin(), jointNodes.end(), visit.node) == jointNodes.end()) continue;
+
+		const glm::mat4 global = visit.parentGlobal * toGlm(visit.node->mTransformation);
+		aiVector3D scaling;
+		aiQuaternion rotation;
+		aiVector3D position;
+		visit.node->mTransformation.Decompose(scaling, rotation, position);
+		// предок без кости не влияет на вершины, его обратная матрица привязки - из позы узлов
+		const auto bone = bones.find(visit.node->mName.C_Str());
+		const glm::mat4 inverseBindMatrix = bone != bones.end() ? toGlm(bone->second->mOffsetMatrix) : glm::inverse(global);
+		const uint32_t joint = skeleton->AddJoint(visit.node->mName.C_Str(), visit.parent, glm::vec3(position.x, position.y, position.z),
+			glm::quat(rotation.w, rotation.x, rotation.y, rotation.z), glm::vec3(scaling.x, scaling.y, scaling.z), inverseBindMatrix);
+
+		for (unsigned int i = visit.node->mNumChildren; i-- > 0;)
+			stack.push_back({ visit.node->mChildren[i], (int32_t)joint, global });
 	}
+	m_skeleton = std::move(skeleton);
+}
+//=============================================================================
+void Model::loadAssimpClips(const aiScene* scene)
+{
+	const Skeleton& skeleton = *m_skeleton;
+	const uint32_t jointCount = skeleton.GetJointCount();
+	for (unsigned int i = 0; i < scene->mNumAnimations; i++)
+	{
+		const aiAnimation* animation = scene->mAnimations[i];
+		const double ticksPerSecond = animation->mTicksPerSecond > 0.0 ? animation->mTicksPerSecond : 25.0;
+		const double duration = animation->mDuration / ticksPerSecond;
+		// ключи пересчитываются на равномерную сетку, шаг подогнан так, чтобы последний кадр пришелся на конец клипа
+		const uint32_t frameCount = std::max(2u, (uint32_t)std::ceil(duration * AnimationClip::DefaultFrameRate) + 1);
+		const float frameRate = duration > 0.0 ? (float)((frameCount - 1) / duration) : AnimationClip::DefaultFrameRate;
+		const std::string name = animation->mName.length > 0 ? animation->mName.C_Str() : "Clip" + std::to_string(i);
+		auto clip = std::make_shared<AnimationClip>(name, skeleton.GetSoaCount(), frameCount, frameRate);
 
-	return { vertices, indices, material, localMat };
+		// сустав без канала стоит в позе привязки
+		std::vector<const aiNodeAnim*> channels(jointCount, nullptr);
+		for (unsigned int c = 0; c < animation->mNumChannels; c++)
+		{
+			const int32_t joint = skeleton.FindJoint(animation->mChannels[c]->mNodeName.C_Str());
+			if (joint >= 0) channels[joint] = animation->mChannels[c];
+		}
+
+		for (uint32_t frame = 0; frame < frameCount; frame++)
+		{
+			const double tick = std::min((double)frame / frameRate, duration) * ticksPerSecond;
+			SoaTransform* pose = clip->GetFrame(frame);
+			for (uint32_t joint = 0; joint < jointCount; joint++)
+			{
+				glm::vec3 translation;
+				glm::quat rotation;
+				glm::vec3 scale;
+				skeleton.GetBindPose()[joint / 4].GetJoint(joint % 4, translation, rotation, scale);
+				if (const aiNodeAnim* channel = channels[joint])
+				{
+					translation = sampleKeys(channel->mPositionKeys, channel->mNumPositionKeys, tick, translation);
+					rotation = sampleKeys(channel->mRotationKeys, channel->mNumRotationKeys, tick, rotation);
+					scale = sampleKeys(channel->mScalingKeys, channel->mNumScalingKeys, tick, scale);
+				}
+				pose[joint / 4].SetJoint(joint % 4, translation, rotation, scale);
+			}
+		}
+		m_clips.push_back(std::move(clip));
+	}
+}
+//=============================================================================
+void Model::loadAssimpMorphClips(const aiScene* scene, const std::vector<std::pair<aiMesh*, glm::mat4>>& meshes,
+	const std::vector<std::vector<uint32_t>>& meshMorphTargets)
+{
+	const uint32_t targetCount = GetMorphTargetCount();
+	for (unsigned int i = 0; i < scene->mNumAnimations; i++)
+	{
+		const aiAnimation* animation = scene->mAnimations[i];
+		if (animation->mNumMorphMeshChannels == 0) continue;
+
+		// сетка кадров - как у скелетных клипов
+		const double ticksPerSecond = animation->mTicksPerSecond > 0.0 ? animation->mTicksPerSecond : 25.0;
+		const double duration = animation->mDuration / ticksPerSecond;
+		const uint32_t frameCount = std::max(2u, (uint32_t)std::ceil(duration * AnimationClip::DefaultFrameRate) + 1);
+		const float frameRate = duration > 0.0 ? (float)((frameCount - 1) / duration) : AnimationClip::DefaultFrameRate;
+		const std::string name = animation->mName.length > 0 ? animation->mName.C_Str() : "Clip" + std::to_string(i);
+		auto clip = std::make_shared<MorphClip>(name, targetCount, frameCount, frameRate);
+
+		for (unsigned int c = 0; c < animation->mNumMorphMeshChannels; c++)
+		{
+			const aiMeshMorphAnim* channel = animation->mMorphMeshChannels[c];
+			if (channel->mNumKeys == 0) continue;
+
+			// канал называется по узлу с мешем или по самому мешу
+			const aiNode* node = scene->mRootNode->FindNode(channel->mName);
+			const std::vector<uint32_t>* targets = nullptr;
+			for (size_t m = 0; m < meshes.size() && !targets; m++)
+			{
+				const aiMesh* mesh = meshes[m].first;
+				const bool inNode = node && std::any_of(node->mMeshes, node->mMeshes + node->mNumMeshes,
+					[&](unsigned int index) { return scene->mMeshes[index] == mesh; });
+				if ((inNode || mesh->mName == channel->mName) && !meshMorphTargets[m].empty()) targets = &meshMorphTargets[m];
+			}
+			if (!targets)
+			{
+				LOG_WARNING(Graphics, "Morph channel '{}' of clip '{}' matches no mesh with morph targets", channel->mName.C_Str(), name);
+				continue;
+			}
+
+			// веса ключа разбрасываются по целям, между ключами - линейно
+			auto addKey = [&](const aiMeshMorphKey& key, float scale, float* weights)
+			{
+				for (unsigned int v = 0; v < key.mNumValuesAndWeights; v++)
+				{
+					if (key.mValues[v] < targets->size()) weights[(*targets)[key.mValues[v]]] += (float)key.mWeights[v] * scale;
+				}
+			};
+			for (uint32_t frame = 0; frame < frameCount; frame++)
+			{
+				const double tick = std::min((double)frame / frameRate, duration) * ticksPerSecond;
+				const aiMeshMorphKey* keys = channel->mKeys;
+				const aiMeshMorphKey* next = std::upper_bound(keys, keys + channel->mNumKeys, tick, [](double t, const aiMeshMorphKey& key) { return t < key.mTime; });
+				float* weights = clip->GetFrame(frame);
+				if (next == keys || next == keys + channel->mNumKeys)
+				{
+					addKey(next == keys ? keys[0] : *(next - 1), 1.0f, weights);
+					continue;
+				}
+				const aiMeshMorphKey& previous = *(next - 1);
+				const float weight = (float)((tick - previous.mTime) / (next->mTime - previous.mTime));
+				addKey(previous, 1.0f - weight, weights);
+				addKey(*next, weight, weights);
+			}
+		}
+		m_morphClips.push_back(std::move(clip));
+	}
 }
 //=============================================================================
 std::shared_ptr<Texture2D> Model::loadAssimpTexture(const std::string& directoryModel, aiMaterial* mat, aiTextureType type)
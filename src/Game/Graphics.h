@@ -1,9 +1,15 @@
 ﻿#pragma once
 
 #include "Render.h"
+#include "Animation.h"
 
 void ClearDefaultGraphicsResource();
 
+class Impostor;
+class VertexAnimation;
+class MorphTargets;
+class MorphClip;
+
 class Material final
 {
 public:
@@ -35,20 +41,92 @@ struct MeshVertex final
 	}
 };
 
+// Данные экземпляра меша, читаются из буфера экземпляров с location 3..7
+struct MeshInstanceData final
+{
+	glm::mat4 worldMatrix;
+	glm::vec4 tint{ 1.0f }; // rgb - множитель цвета, a - доля видимости для растворения по дистанции
+
+	inline static VertexBufferLayout GetLayout()
+	{
+		VertexBufferLayout layout;
+		layout.SetDivisor(1);
+		layout.Push<glm::mat4>("aInstanceWorld");
+		layout.Push<glm::vec4>("aInstanceTint");
+		return layout;
+	}
+};
+
+// Влияние суставов на вершину меша со скиннингом, читается из третьего буфера с location 8..9
+struct MeshSkinVertex final
+{
+	glm::u8vec4 joints{ 0 };  // индексы суставов скелета модели
+	glm::u8vec4 weights{ 0 }; // веса в долях 255, сумма 255
+
+	inline static VertexBufferLayout GetLayout()
+	{
+		VertexBufferLayout layout;
+		layout.Push<glm::u8vec4>("aJoints");
+		layout.PushNormalized<glm::u8vec4>("aWeights");
+		return layout;
+	}
+};
+
+// Треугольники меша в памяти CPU для запросов к геометрии, например для столкновений
+struct MeshGeometry final
+{
+	std::vector<glm::vec3> positions;
+	std::vector<uint32_t>  indices;
+};
+
 class Mesh final
 {
 public:
 	Mesh(const std::vector<MeshVertex>& vertices, const std::vector<uint32_t>& indices, std::shared_ptr<Material> material, const glm::mat4& localTransform);
-	void Draw();
+	// Меш со скиннингом: skinVertices параллельны vertices. С палитрой суставов localTransform не применяется,
+	// суставы уже в системе модели; без палитры меш рисуется в позе привязки как обычный
+	Mesh(const std::vector<MeshVertex>& vertices, const std::vector<MeshSkinVertex>& skinVertices, const std::vector<uint32_t>& indices,
+		std::shared_ptr<Material> material, const glm::mat4& localTransform);
+	// Рисует instanceCount экземпляров, их MeshInstanceData берутся из instanceBuffer начиная с baseInstance.
+	// vertexBuffer - свои MeshVertex экземпляра вместо вершин меша (например, после морфинга) начиная с vertexOffset байт
+	void Draw(GLuint instanceBuffer, uint32_t baseInstance, uint32_t instanceCount, GLuint vertexBuffer = 0, GLintptr vertexOffset = 0) const;
+	// То же, но число и начало экземпляров берутся из DrawElementsIndirectCommand в привязанном буфере команд
+	void DrawIndirect(GLuint instanceBuffer, GLintptr commandOffset) const;
+
+	uint32_t GetIndexCount() const { return m_indexBuffer->GetCount(); }
+	uint32_t GetVertexCount() const { return m_vertexCount; }
+	bool IsSkinned() const { return m_skinBuffer != nullptr; }
+	// Буферы MeshVertex и MeshSkinVertex, например для чтения вычислительным шейдером. У меша без скиннинга второго нет
+	GLuint GetVertexBufferID() const { return m_vertexBuffer->GetID(); }
+	GLuint GetSkinBufferID() const { return m_skinBuffer ? m_skinBuffer->GetID() : 0; }
+
+	// Цели морфинга, границы меша расширяются вершинами целей с весом 1
+	void SetMorphTargets(std::shared_ptr<const MorphTargets> targets);
+	const MorphTargets* GetMorphTargets() const { return m_morphTargets.get(); }
 
 	const glm::mat4& GetLocalTransform() const { return m_localTransform; }
+	// Границы вершин в системе координат меша (без m_localTransform)
+	const glm::vec3& GetBoundsMin() const { return m_boundsMin; }
+	const glm::vec3& GetBoundsMax() const { return m_boundsMax; }
+	// Позиции и индексы в системе координат меша; у меша со скиннингом nullptr - его вершины двигает поза
+	const MeshGeometry* GetGeometry() const { return m_geometry.get(); }
 
 private:
-	std::shared_ptr<VertexArray>  m_VAO;
-	std::shared_ptr<VertexBuffer> m_vertexBuffer;
-	std::shared_ptr<IndexBuffer>  m_indexBuffer;
-	std::shared_ptr<Material>     m_material;
-	glm::mat4                     m_localTransform = glm::mat4(1.0f);
+	static constexpr uint32_t VertexBinding = 0;
+	static constexpr uint32_t InstanceBinding = 1;
+	static constexpr uint32_t SkinBinding = 2;
+
+	std::shared_ptr<VertexArray>        m_VAO;
+	std::shared_ptr<VertexBuffer>       m_vertexBuffer;
+	std::shared_ptr<VertexBuffer>       m_skinBuffer;
+	std::shared_ptr<IndexBuffer>        m_indexBuffer;
+	std::shared_ptr<Material>           m_material;
+	std::shared_ptr<const MorphTargets> m_morphTargets;
+	std::shared_ptr<const MeshGeometry> m_geometry;
+	uint32_t                            m_vertexCount{ 0 };
+	glm::mat4                           m_localTransform = glm::mat4(1.0f);
+	glm::vec3                           m_boundsMin{ 0.0f };
+	glm::vec3                           m_boundsMax{ 0.0f };
 };
 
 class Model final
@@ -56,26 +134,72 @@ class Model final
 public:
 	Model(const std::vector<Mesh>& meshes);
 	Model(const std::string& path, std::shared_ptr<Material> customMainMaterial = nullptr);
-	void Draw();
-	void DrawMesh(size_t i);
 
 	size_t GetNumMesh() const { return m_meshes.size(); }
 	const Mesh& GetMesh(size_t i) const { return m_meshes[i]; }
+	// Границы всех мешей с учетом их локальных трансформаций
+	const glm::vec3& GetBoundsMin() const { return m_boundsMin; }
+	const glm::vec3& GetBoundsMax() const { return m_boundsMax; }
+
+	// Дальше GetSwitchDistance() модель рисуется импостором, см. Impostor::Bake
+	void SetImpostor(std::shared_ptr<Impostor> impostor) { m_impostor = std::move(impostor); }
+	const Impostor* GetImpostor() const { return m_impostor.get(); }
+
+	// Анимация вершин для толп, см. VertexAnimation::Bake
+	void SetVertexAnimation(std::shared_ptr<VertexAnimation> animation) { m_vertexAnimation = std::move(animation); }
+	const std::shared_ptr<VertexAnimation>& GetVertexAnimation() const { return m_vertexAnimation; }
+
+	// Скелет и клипы модели со скиннингом, у статической модели скелета нет
+	const std::shared_ptr<const Skeleton>& GetSkeleton() const { return m_skeleton; }
+	size_t GetNumClips() const { return m_clips.size(); }
+	const std::shared_ptr<const AnimationClip>& GetClip(size_t i) const { return m_clips[i]; }
+	// nullptr, если клипа нет
+	std::shared_ptr<const AnimationClip> FindClip(const std::string& name) const;
+	// Заменяет клипы сжатыми копиями, см. AnimationClip::Compress. Границы модели остаются посчитанными по исходным кадрам
+	void CompressClips(const ClipCompressionSettings& settings);
+
+	// Цели морфинга всех мешей по именам: веса узла (Morpher) и клипы морфинга идут в этом порядке
+	uint32_t GetMorphTargetCount() const { return (uint32_t)m_morphTargetNames.size(); }
+	const std::string& GetMorphTargetName(uint32_t target) const { return m_morphTargetNames[target]; }
+	// -1, если цели нет
+	int32_t FindMorphTarget(const std::string& name) const;
+	size_t GetNumMorphClips() const { return m_morphClips.size(); }
+	const std::shared_ptr<const MorphClip>& GetMorphClip(size_t i) const { return m_morphClips[i]; }
+	// nullptr, если клипа нет
+	std::shared_ptr<const MorphClip> FindMorphClip(const std::string& name) const;
 
 	static std::shared_ptr<Model> CreateCube(float length = 1.0f, std::shared_ptr<Material> material = nullptr);
 	static std::shared_ptr<Model> CreateSphere(float radius, uint32_t uiTessU, uint32_t uiTessV, std::shared_ptr<Material> material = nullptr);
 	static std::shared_ptr<Model> CreatePlane(float width, float height, float texWidth, float texHeight, std::shared_ptr<Material> material = nullptr);
+	// Вертикальный цилиндр на цепочке из jointCount суставов с клипами "Sway", "Idle" и "Bend" - замена персонажа для замеров скиннинга.
+	// Цели морфинга "Bulge" (вздутие середины) и "Flare" (раструб сверху), клип морфинга "Breathe"
+	static std::shared_ptr<Model> CreateSkinnedCylinder(float radius, float height, uint32_t jointCount, std::shared_ptr<Material> material = nullptr);
 
 private:
 	void loadModel(const std::string& path, std::shared_ptr<Material> customMainMaterial);
+	// У модели со скиннингом границы охватывают все кадры клипов
+	void updateBounds();
 
 	void loadObjModel(const std::string& path, std::shared_ptr<Material> customMainMaterial);
-	void processObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib, std::shared_ptr<Material> material);
 
 	void loadAssimpModel(const std::string& path, std::shared_ptr<Material> customMainMaterial);
-	void processAssimpNode(const std::string& directoryModel, aiNode* node, const aiScene* scene, std::shared_ptr<Material> material);
-	Mesh processAssimpMesh(const std::string& directoryModel, const glm::mat4& localMat, aiMesh* mesh, const aiScene* scene, std::shared_ptr<Material> material);
+	void processAssimpNode(aiNode* node, const aiScene* scene, std::vector<std::pair<aiMesh*, glm::mat4>>& meshes);
+	void loadAssimpSkeleton(const aiScene* scene);
+	void loadAssimpClips(const aiScene* scene);
+	void loadAssimpMorphClips(const aiScene* scene, const std::vector<std::pair<aiMesh*, glm::mat4>>& meshes,
+		const std::vector<std::vector<uint32_t>>& meshMorphTargets);
 	std::shared_ptr<Texture2D> loadAssimpTexture(const std::string& directoryModel, aiMaterial* mat, aiTextureType type);
 
-	std::vector<Mesh> m_meshes;
+	std::vector<Mesh>                m_meshes;
+	glm::vec3                        m_boundsMin{ 0.0f };
+	glm::vec3                        m_boundsMax{ 0.0f };
+	std::shared_ptr<Impostor>        m_impostor;
+	std::shared_ptr<VertexAnimation> m_vertexAnimation;
+
+	std::shared_ptr<const Skeleton>                   m_skeleton;
+	std::vector<std::shared_ptr<const AnimationClip>> m_clips;
+	std::vector<float>                                m_jointRadii; // от сустава до самой дальней вершины под его влиянием
+
+	std::vector<std::string>                          m_morphTargetNames;
+	std::vector<std::shared_ptr<const MorphClip>>     m_morphClips;
 };
\ No newline at end of file
@@ -0,0 +1,314 @@
+﻿#include "stdafx.h"
+#include "HeadlessContext.h"
+#include "Log.h"
+#if defined(_WIN32)
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#else
+#	include <dlfcn.h>
+#endif
+//=============================================================================
+// Минимальное подмножество EGL 1.5, необходимое для создания контекста
+namespace
+{
+	using EGLBoolean = unsigned int;
+	using EGLint = int32_t;
+	using EGLenum = unsigned int;
+	using EGLDisplay = void*;
+	using EGLConfig = void*;
+	using EGLContext = void*;
+	using EGLSurface = void*;
+	using EGLNativeDisplayType = void*;
+
+	constexpr EGLint EGL_SUCCESS = 0x3000;
+	constexpr EGLint EGL_ALPHA_SIZE = 0x3021;
+	constexpr EGLint EGL_BLUE_SIZE = 0x3022;
+	constexpr EGLint EGL_GREEN_SIZE = 0x3023;
+	constexpr EGLint EGL_RED_SIZE = 0x3024;
+	constexpr EGLint EGL_DEPTH_SIZE = 0x3025;
+	constexpr EGLint EGL_SURFACE_TYPE = 0x3033;
+	constexpr EGLint EGL_NONE = 0x3038;
+	constexpr EGLint EGL_RENDERABLE_TYPE = 0x3040;
+	constexpr EGLint EGL_EXTENSIONS = 0x3055;
+	constexpr EGLint EGL_HEIGHT = 0x3056;
+	constexpr EGLint EGL_WIDTH = 0x3057;
+	constexpr EGLint EGL_PBUFFER_BIT = 0x0001;
+	constexpr EGLint EGL_OPENGL_BIT = 0x0008;
+	constexpr EGLenum EGL_OPENGL_API = 0x30A2;
+	constexpr EGLint EGL_CONTEXT_MAJOR_VERSION = 0x3098;
+	constexpr EGLint EGL_CONTEXT_MINOR_VERSION = 0x30FB;
+	constexpr EGLint EGL_CONTEXT_OPENGL_PROFILE_MASK = 0x30FD;
+	constexpr EGLint EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT = 0x0001;
+	constexpr EGLint EGL_CONTEXT_OPENGL_DEBUG = 0x31B0;
+	constexpr EGLenum EGL_PLATFORM_SURFACELESS_MESA = 0x31DD;
+
+	using PFNEGLGETPROCADDRESS = GLADapiproc(*)(const char*);
+	using PFNEGLGETDISPLAY = EGLDisplay(*)(EGLNativeDisplayType);
+	using PFNEGLGETPLATFORMDISPLAYEXT = EGLDisplay(*)(EGLenum, void*, const EGLint*);
+	using PFNEGLINITIALIZE = EGLBoolean(*)(EGLDisplay, EGLint*, EGLint*);
+	using PFNEGLTERMINATE = EGLBoolean(*)(EGLDisplay);
+	using PFNEGLQUERYSTRING = const char* (*)(EGLDisplay, EGLint);
+	using PFNEGLBINDAPI = EGLBoolean(*)(EGLenum);
+	using PFNEGLCHOOSECONFIG = EGLBoolean(*)(EGLDisplay, const EGLint*, EGLConfig*, EGLint, EGLint*);
+	using PFNEGLCREATECONTEXT = EGLContext(*)(EGLDisplay, EGLConfig, EGLContext, const EGLint*);
+	using PFNEGLDESTROYCONTEXT = EGLBoolean(*)(EGLDisplay, EGLContext);
+	using PFNEGLCREATEPBUFFERSURFACE = EGLSurface(*)(EGLDisplay, EGLConfig, const EGLint*);
+	using PFNEGLDESTROYSURFACE = EGLBoolean(*)(EGLDisplay, EGLSurface);
+	using PFNEGLMAKECURRENT = EGLBoolean(*)(EGLDisplay, EGLSurface, EGLSurface, EGLContext);
+	using PFNEGLGETERROR = EGLint(*)();
+
+	struct EglApi final
+	{
+		PFNEGLGETPROCADDRESS       GetProcAddress{ nullptr };
+		PFNEGLGETDISPLAY           GetDisplay{ nullptr };
+		PFNEGLINITIALIZE           Initialize{ nullptr };
+		PFNEGLTERMINATE            Terminate{ nullptr };
+		PFNEGLQUERYSTRING          QueryString{ nullptr };
+		PFNEGLBINDAPI              BindAPI{ nullptr };
+		PFNEGLCHOOSECONFIG         ChooseConfig{ nullptr };
+		PFNEGLCREATECONTEXT        CreateContext{ nullptr };
+		PFNEGLDESTROYCONTEXT       DestroyContext{ nullptr };
+		PFNEGLCREATEPBUFFERSURFACE CreatePbufferSurface{ nullptr };
+		PFNEGLDESTROYSURFACE       DestroySurface{ nullptr };
+		PFNEGLMAKECURRENT          MakeCurrent{ nullptr };
+		PFNEGLGETERROR             GetError{ nullptr };
+	};
+
+	void*      library{ nullptr };
+	EglApi     egl;
+	EGLDisplay display{ nullptr };
+	EGLContext context{ nullptr };
+	EGLSurface surface{ nullptr };
+
+	void* loadLibrary()
+	{
+#if defined(_WIN32)
+		for (const char* name : { "libEGL.dll", "EGL.dll" })
+		{
+			if (HMODULE module = LoadLibraryA(name)) return (void*)module;
+		}
+#else
+		for (const char* name : { "libEGL.so.1", "libEGL.so" })
+		{
+			if (void* module = dlopen(name, RTLD_NOW | RTLD_LOCAL)) return module;
+		}
+#endif
+		return nullptr;
+	}
+
+	void unloadLibrary()
+	{
+		if (!library) return;
+#if defined(_WIN32)
+		FreeLibrary((HMODULE)library);
+#else
+		// Mesa не переживает dlclose: ее потоки и обработчики atexit остаются после eglTerminate
+		// и падают при выходе из процесса, поэтому библиотека остается загруженной
+#endif
+		library = nullptr;
+	}
+
+	template<typename T>
+	bool loadFunction(T& function, const char* name)
+	{
+#if defined(_WIN32)
+		function = reinterpret_cast<T>(::GetProcAddress((HMODULE)library, name));
+#else
+		function = reinterpret_cast<T>(dlsym(library, name));
+#endif
+		if (!function) LOG_ERROR(Render, "EGL function not found: {}", name);
+		return function != nullptr;
+	}
+
+	bool loadApi()
+	{
+		return loadFunction(egl.GetProcAddress, "eglGetProcAddress")
+			&& loadFunction(egl.GetDisplay, "eglGetDisplay")
+			&& loadFunction(egl.Initialize, "eglInitialize")
+			&& loadFunction(egl.Terminate, "eglTerminate")
+			&& loadFunction(egl.QueryString, "eglQueryString")
+			&& loadFunction(egl.BindAPI, "eglBindAPI")
+			&& loadFunction(egl.ChooseConfig, "eglChooseConfig")
+			&& loadFunction(egl.CreateContext, "eglCreateContext")
+			&& loadFunction(egl.DestroyContext, "eglDestroyContext")
+			&& loadFunction(egl.CreatePbufferSurface, "eglCreatePbufferSurface")
+			&& loadFunction(egl.DestroySurface, "eglDestroySurface")
+			&& loadFunction(egl.MakeCurrent, "eglMakeCurrent")
+			&& loadFunction(egl.GetError, "eglGetError");
+	}
+
+	bool hasExtension(const char* extensions, std::string_view name)
+	{
+		if (!extensions) return false;
+		std::string_view list(extensions);
+		size_t pos = 0;
+		while ((pos = list.find(name, pos)) != std::string_view::npos)
+		{
+			const size_t end = pos + name.size();
+			if ((pos == 0 || list[pos - 1] == ' ') && (end == list.size() || list[end] == ' '))
+				return true;
+			pos = end;
+		}
+		return false;
+	}
+
+	// Предпочтительно surfaceless-платформа Mesa: ей не нужен ни X11, ни DRM-устройство
+	EGLDisplay openDisplay()
+	{
+		const char* clientExtensions = egl.QueryString(nullptr, EGL_EXTENSIONS);
+		if (hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+		{
+			auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXT>(egl.GetProcAddress("eglGetPlatformDisplayEXT"));
+			if (getPlatformDisplay)
+			{
+				EGLDisplay platformDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, nullptr, nullptr);
+				if (platformDisplay && egl.Initialize(platformDisplay, nullptr, nullptr))
+					return platformDisplay;
+			}
+		}
+
+		EGLDisplay defaultDisplay = egl.GetDisplay(nullptr);
+		if (defaultDisplay && egl.Initialize(defaultDisplay, nullptr, nullptr))
+			return defaultDisplay;
+		return nullptr;
+	}
+
+	EGLContext createContext(EGLConfig config)
+	{
+		const EGLint versions[][2] = { { 4, 6 }, { 4, 5 } };
+		for (const auto& version : versions)
+		{
+			const EGLint attributes[] =
+			{
+				EGL_CONTEXT_MAJOR_VERSION, version[0],
+				EGL_CONTEXT_MINOR_VERSION, version[1],
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+#if defined(_DEBUG)
+				EGL_CONTEXT_OPENGL_DEBUG, 1,
+#endif
+				EGL_NONE
+			};
+			if (EGLContext result = egl.CreateContext(display, config, nullptr, attributes))
+				return result;
+		}
+		return nullptr;
+	}
+}
+//=============================================================================
+bool headless::Init(int width, int height)
+{
+	library = loadLibrary();
+	if (!library)
+	{
+		LOG_FATAL(Render, "Failed to load libEGL!");
+		return false;
+	}
+	if (!loadApi())
+	{
+		LOG_FATAL(Render, "Failed to load EGL functions!");
+		Close();
+		return false;
+	}
+
+	display = openDisplay();
+	if (!display)
+	{
+		LOG_FATAL(Render, "Failed to initialize EGL display!");
+		Close();
+		return false;
+	}
+
+	if (!egl.BindAPI(EGL_OPENGL_API))
+	{
+		LOG_FATAL(Render, "EGL does not support desktop OpenGL!");
+		Close();
+		return false;
+	}
+
+	const EGLint configAttributes[] =
+	{
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+	EGLConfig config = nullptr;
+	EGLint numConfigs = 0;
+	if (!egl.ChooseConfig(display, configAttributes, &config, 1, &numConfigs) || numConfigs == 0)
+	{
+		// у surfaceless-дисплея может не быть pbuffer-конфигураций
+		const EGLint anyConfig[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		if (!egl.ChooseConfig(display, anyConfig, &config, 1, &numConfigs) || numConfigs == 0)
+		{
+			LOG_FATAL(Render, "Failed to choose EGL config!");
+			Close();
+			return false;
+		}
+	}
+
+	context = createContext(config);
+	if (!context)
+	{
+		LOG_FATAL(Render, "Failed to create OpenGL 4.5+ core context through EGL (error {})!", egl.GetError());
+		Close();
+		return false;
+	}
+
+	// Рисуем всегда в offscreen FrameBuffer, поверхность нужна только если нет EGL_KHR_surfaceless_context
+	if (!hasExtension(egl.QueryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+	{
+		const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+		surface = egl.CreatePbufferSurface(display, config, surfaceAttributes);
+		if (!surface)
+		{
+			LOG_FATAL(Render, "Failed to create EGL pbuffer surface!");
+			Close();
+			return false;
+		}
+	}
+
+	if (!egl.MakeCurrent(display, surface, surface, context))
+	{
+		LOG_FATAL(Render, "Failed to make EGL context current (error {})!", egl.GetError());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+//=============================================================================
+void headless::Close()
+{
+	if (display)
+	{
+		egl.MakeCurrent(display, nullptr, nullptr, nullptr);
+		if (surface) egl.DestroySurface(display, surface);
+		if (context) egl.DestroyContext(display, context);
+		egl.Terminate(display);
+	}
+	surface = context = display = nullptr;
+	egl = {};
+	unloadLibrary();
+}
+//=============================================================================
+bool headless::MakeCurrent(bool current)
+{
+	if (!display) return false;
+	if (!egl.MakeCurrent(display, current ? surface : nullptr, current ? surface : nullptr, current ? context : nullptr))
+	{
+		LOG_ERROR(Render, "Failed to change current EGL context (error {})!", egl.GetError());
+		return false;
+	}
+	return true;
+}
+//=============================================================================
+GLADapiproc headless::GetProcAddress(const char* name)
+{
+	return egl.GetProcAddress ? egl.GetProcAddress(name) : nullptr;
+}
+//=============================================================================
\ No newline at end of file
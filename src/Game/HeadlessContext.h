@@ -0,0 +1,15 @@
+﻿#pragma once
+
+// Контекст OpenGL без окна через EGL (surfaceless или pbuffer). Работает на Mesa llvmpipe без дисплея и GPU.
+// libEGL загружается динамически, поэтому сборка не зависит от EGL SDK.
+namespace headless
+{
+	bool Init(int width, int height);
+	void Close();
+
+	// Делает контекст текущим для вызывающего потока или отвязывает его
+	bool MakeCurrent(bool current);
+
+	// Загрузчик функций GL для gladLoadGL
+	GLADapiproc GetProcAddress(const char* name);
+}
@@ -0,0 +1,468 @@
+﻿#include "stdafx.h"
+#include "Impostor.h"
+#include "Graphics.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	// Октаэдрическая развертка направлений, общая для запекания и отрисовки
+	const GLchar* octahedralSource = R"glsl(
+vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);
+}
+
+// Direction to grid coordinates [0, 1]. Hemisphere grid is rotated by 45 degrees and covers y >= 0 only
+vec2 encodeDirection(vec3 d, bool hemisphere)
+{
+	d /= abs(d.x) + abs(d.y) + abs(d.z);
+	if (hemisphere) return vec2(d.x + d.z, d.x - d.z) * 0.5f + 0.5f;
+	vec2 p = d.xz;
+	if (d.y < 0.0f) p = (1.0f - abs(d.zx)) * signNotZero(d.xz);
+	return p * 0.5f + 0.5f;
+}
+
+vec3 decodeDirection(vec2 uv, bool hemisphere)
+{
+	vec2 e = uv * 2.0f - 1.0f;
+	if (hemisphere)
+	{
+		vec2 o = vec2(e.x + e.y, e.x - e.y) * 0.5f;
+		return normalize(vec3(o.x, 1.0f - abs(o.x) - abs(o.y), o.y));
+	}
+	vec3 d = vec3(e.x, 1.0f - abs(e.x) - abs(e.y), e.y);
+	if (d.y < 0.0f) d.xz = (1.0f - abs(d.zx)) * signNotZero(d.xz);
+	return normalize(d);
+}
+
+// Same basis as glm::lookAt from d towards the center
+void frameBasis(vec3 d, out vec3 right, out vec3 up)
+{
+	vec3 upReference = abs(d.y) > 0.999f ? vec3(0.0f, 0.0f, 1.0f) : vec3(0.0f, 1.0f, 0.0f);
+	right = normalize(cross(upReference, d));
+	up = cross(d, right);
+}
+)glsl";
+
+	const GLchar* bakeVertexShaderSource = R"glsl(
+#version 430 core
+
+uniform mat4 ViewProjection;
+
+layout(location = 0) in vec3 VertexPosition;
+layout(location = 1) in vec3 VertexNormal;
+layout(location = 2) in vec2 VertexTexCoords;
+layout(location = 3) in mat4 InstanceWorld; // MeshInstanceData
+
+layout(location = 0) smooth out vec3 PositionOut;
+layout(location = 1) smooth out vec3 NormalOut;
+layout(location = 2) smooth out vec2 TexCoordsOut;
+
+void main()
+{
+	vec4 position = InstanceWorld * vec4(VertexPosition, 1.0f);
+	gl_Position = ViewProjection * position;
+	PositionOut = position.xyz;
+	NormalOut = mat3(InstanceWorld) * VertexNormal;
+	TexCoordsOut = VertexTexCoords;
+}
+)glsl";
+
+	const GLchar* bakeFragmentShaderSource = R"glsl(
+#version 430 core
+
+uniform vec4 BoundsSphere;   // model space center, radius
+uniform vec3 FrameDirection; // from the center towards the frame camera
+
+layout(binding = 0) uniform sampler2D s2DiffuseTexture;
+
+layout(location = 0) smooth in vec3 PositionIn;
+layout(location = 1) smooth in vec3 NormalIn;
+layout(location = 2) smooth in vec2 TexCoordsIn;
+
+layout(location = 0) out vec4 AlbedoOut;
+layout(location = 1) out vec4 NormalOut;
+layout(location = 2) out float DepthOut;
+
+void main()
+{
+	vec4 albedo = texture(s2DiffuseTexture, TexCoordsIn);
+	if (albedo.a < 0.5f) discard;
+
+	vec3 normal = normalize(NormalIn);
+	if (!gl_FrontFacing) normal = -normal;
+
+	AlbedoOut = vec4(albedo.rgb, 1.0f);
+	NormalOut = vec4(normal * 0.5f + 0.5f, 1.0f);
+	DepthOut = dot(PositionIn - BoundsSphere.xyz, FrameDirection) / BoundsSphere.w;
+}
+)glsl";
+
+	const GLchar* drawVertexShaderSource = R"glsl(
+layout(binding = 1) uniform CameraData
+{
+	mat4 view;
+	mat4 projection;
+	vec3 cameraPosition;
+};
+
+uniform vec4 BoundsSphere; // model space center, radius
+uniform vec2 FrameGrid;    // x - frames per side, y - 1 for hemisphere
+
+layout(location = 0) in vec3 VertexPosition; // quad corner in [-1, 1]
+layout(location = 3) in mat4 InstanceWorld;  // MeshInstanceData
+layout(location = 7) in vec4 InstanceTint;
+
+layout(location = 0) smooth out vec3 PositionOut;
+layout(location = 1) smooth out vec4 FrameUV01;
+layout(location = 2) smooth out vec2 FrameUV2;
+layout(location = 3) flat out vec4 Frame01;
+layout(location = 4) flat out vec2 Frame2;
+layout(location = 5) flat out vec3 FrameWeights;
+layout(location = 6) flat out vec4 TintOut;
+layout(location = 7) flat out float RadiusOut;
+layout(location = 8) flat out mat3 RotationOut;
+
+// Where the view ray through the quad vertex crosses the frame plane, in frame texture coordinates
+vec2 frameUV(vec2 frame, vec3 rayOrigin, vec3 rayDirection)
+{
+	vec3 d = decodeDirection(frame / (FrameGrid.x - 1.0f), FrameGrid.y > 0.5f);
+	vec3 right, up;
+	frameBasis(d, right, up);
+	vec3 q = rayOrigin + rayDirection * (-dot(rayOrigin, d) / dot(rayDirection, d));
+	return vec2(dot(q, right), dot(q, up)) / (2.0f * BoundsSphere.w) + 0.5f;
+}
+
+void main()
+{
+	float scale = length(InstanceWorld[0].xyz);
+	mat3 rotation = mat3(InstanceWorld[0].xyz / scale, normalize(InstanceWorld[1].xyz), normalize(InstanceWorld[2].xyz));
+	vec3 center = (InstanceWorld * vec4(BoundsSphere.xyz, 1.0f)).xyz;
+	float radius = BoundsSphere.w * scale;
+
+	// Camera facing quad around the bounding sphere
+	vec3 toCamera = normalize(cameraPosition - center);
+	vec3 right, up;
+	frameBasis(toCamera, right, up);
+	vec3 position = center + (right * VertexPosition.x + up * VertexPosition.y) * radius;
+	gl_Position = projection * view * vec4(position, 1.0f);
+
+	// Three frames of the grid triangle around the view direction
+	vec3 viewDirection = transpose(rotation) * toCamera;
+	if (FrameGrid.y > 0.5f) viewDirection.y = max(viewDirection.y, 0.0f) + 0.0001f;
+	vec2 grid = encodeDirection(normalize(viewDirection), FrameGrid.y > 0.5f) * (FrameGrid.x - 1.0f);
+	vec2 cell = min(floor(grid), vec2(FrameGrid.x - 2.0f));
+	vec2 f = grid - cell;
+	if (f.x + f.y < 1.0f)
+	{
+		Frame01 = vec4(cell, cell + vec2(1.0f, 0.0f));
+		FrameWeights = vec3(1.0f - f.x - f.y, f.x, f.y);
+	}
+	else
+	{
+		Frame01 = vec4(cell + vec2(1.0f, 1.0f), cell + vec2(1.0f, 0.0f));
+		FrameWeights = vec3(f.x + f.y - 1.0f, 1.0f - f.y, 1.0f - f.x);
+	}
+	Frame2 = cell + vec2(0.0f, 1.0f);
+
+	// Model space, relative to the sphere center
+	vec3 rayOrigin = transpose(rotation) * (cameraPosition - center) / scale;
+	vec3 rayDirection = transpose(rotation) * (position - cameraPosition) / scale;
+	FrameUV01 = vec4(frameUV(Frame01.xy, rayOrigin, rayDirection), frameUV(Frame01.zw, rayOrigin, rayDirection));
+	FrameUV2 = frameUV(Frame2, rayOrigin, rayDirection);
+
+	PositionOut = position;
+	TintOut = InstanceTint;
+	RadiusOut = radius;
+	RotationOut = rotation;
+}
+)glsl";
+
+	const GLchar* drawFragmentShaderSource = R"glsl(
+#version 430 core
+
+struct PointLight
+{
+	vec3 v3LightPosition;
+	vec3 v3LightIntensity;
+	vec3 v3Falloff;
+};
+
+#define MAX_LIGHTS 16
+#define M_RCPPI 0.31830988618379067153776752674503f
+
+layout(binding = 1) uniform CameraData
+{
+	mat4 view;
+	mat4 projection;
+	vec3 cameraPosition;
+};
+
+layout(std140, binding = 2) uniform PointLightData
+{
+	PointLight PointLights[MAX_LIGHTS];
+};
+
+uniform vec2 FrameGrid;
+
+layout(binding = 0) uniform sampler2D s2AlbedoAtlas;
+layout(binding = 1) uniform sampler2D s2NormalAtlas;
+layout(binding = 2) uniform sampler2D s2DepthAtlas;
+
+layout(location = 0) smooth in vec3 PositionIn;
+layout(location = 1) smooth in vec4 FrameUV01;
+layout(location = 2) smooth in vec2 FrameUV2;
+layout(location = 3) flat in vec4 Frame01;
+layout(location = 4) flat in vec2 Frame2;
+layout(location = 5) flat in vec3 FrameWeights;
+layout(location = 6) flat in vec4 TintIn;
+layout(location = 7) flat in float RadiusIn;
+layout(location = 8) flat in mat3 RotationIn;
+
+out vec4 FragColorOut;
+
+void main()
+{
+	vec2 frames[3] = vec2[3](Frame01.xy, Frame01.zw, Frame2);
+	vec2 uvs[3] = vec2[3](FrameUV01.xy, FrameUV01.zw, FrameUV2);
+	float weights[3] = float[3](FrameWeights.x, FrameWeights.y, FrameWeights.z);
+
+	// Blend the frames, weighted by coverage so that empty texels do not darken the result
+	vec4 albedo = vec4(0.0f);
+	vec3 normal = vec3(0.0f);
+	float depth = 0.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		vec2 uv = (frames[i] + clamp(uvs[i], 0.0f, 1.0f)) / FrameGrid.x;
+		bool inside = all(greaterThanEqual(uvs[i], vec2(0.0f))) && all(lessThanEqual(uvs[i], vec2(1.0f)));
+		vec4 frameAlbedo = texture(s2AlbedoAtlas, uv);
+		float weight = inside ? weights[i] * frameAlbedo.a : 0.0f;
+		albedo += vec4(frameAlbedo.rgb, 1.0f) * weight;
+		normal += (texture(s2NormalAtlas, uv).xyz * 2.0f - 1.0f) * weight;
+		depth += texture(s2DepthAtlas, uv).r * weight;
+	}
+	if (albedo.a < 0.5f) discard;
+
+	// Dithered distance fade, as in the mesh shader
+	if (TintIn.a < 1.0f)
+	{
+		float fNoise = fract(52.9829189f * fract(dot(gl_FragCoord.xy, vec2(0.06711056f, 0.00583715f))));
+		if (TintIn.a <= fNoise) discard;
+	}
+
+	vec3 colour = albedo.rgb / albedo.a * TintIn.rgb;
+	normal = normalize(RotationIn * normal);
+
+	// Push the fragment to the baked surface so impostors intersect the scene correctly
+	vec3 surface = PositionIn + normalize(cameraPosition - PositionIn) * (depth / albedo.a) * RadiusIn;
+	vec4 clip = projection * view * vec4(surface, 1.0f);
+	gl_FragDepth = clip.z / clip.w * 0.5f + 0.5f;
+
+	// Lambert over the scene point lights, unused lights are zero
+	vec3 v3RetColour = colour * vec3(0.3f);
+	for (int i = 0; i < MAX_LIGHTS; i++)
+	{
+		if (dot(PointLights[i].v3LightIntensity, PointLights[i].v3LightIntensity) == 0.0f) continue;
+		vec3 v3ToLight = PointLights[i].v3LightPosition - surface;
+		float fDist = length(v3ToLight);
+		vec3 v3Falloff = PointLights[i].v3Falloff;
+		vec3 v3LightIrradiance = PointLights[i].v3LightIntensity / (v3Falloff.x + (v3Falloff.y * fDist) + (v3Falloff.z * fDist * fDist));
+		v3RetColour += colour * M_RCPPI * max(dot(normal, v3ToLight / fDist), 0.0f) * v3LightIrradiance;
+	}
+	FragColorOut = vec4(v3RetColour, 1.0f);
+}
+)glsl";
+
+	std::shared_ptr<ShaderProgram> bakeProgram;
+	std::shared_ptr<ShaderProgram> drawProgram;
+	std::shared_ptr<VertexBuffer>  quadVertexBuffer;
+	std::shared_ptr<IndexBuffer>   quadIndexBuffer;
+	std::shared_ptr<VertexArray>   quadArray;
+	// буферы экземпляров запекания остаются привязаны к VAO мешей, их имена не должны освобождаться
+	std::vector<std::shared_ptr<VertexBuffer>> bakeInstanceBuffers;
+
+	constexpr uint32_t QuadInstanceBinding = 1;
+	constexpr uint32_t MinFrameMipSize = 8; // меньшие уровни смешивают соседние кадры
+
+	bool initSharedResources()
+	{
+		if (drawProgram) return true;
+
+		bakeProgram = std::make_shared<ShaderProgram>(bakeVertexShaderSource, bakeFragmentShaderSource);
+		drawProgram = std::make_shared<ShaderProgram>(std::string("#version 430 core\n") + octahedralSource + drawVertexShaderSource, drawFragmentShaderSource);
+		if (!bakeProgram->IsValid() || !drawProgram->IsValid()) [[unlikely]]
+		{
+			LOG_ERROR(Render, "Failed to create impostor shaders");
+			bakeProgram.reset();
+			drawProgram.reset();
+			return false;
+		}
+
+		const std::vector<MeshVertex> vertices = {
+			{ glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(0.0f, 0.0f) },
+			{ glm::vec3( 1.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(1.0f, 0.0f) },
+			{ glm::vec3( 1.0f,  1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(1.0f, 1.0f) },
+			{ glm::vec3(-1.0f,  1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(0.0f, 1.0f) },
+		};
+		const uint32_t indices[] = { 0, 1, 2, 2, 3, 0 };
+		quadVertexBuffer = std::make_shared<VertexBuffer>((unsigned int)(vertices.size() * sizeof(MeshVertex)), vertices.data());
+		quadIndexBuffer = std::make_shared<IndexBuffer>(6, indices);
+		quadArray = std::make_shared<VertexArray>(quadVertexBuffer, quadIndexBuffer, MeshVertex::GetLayout());
+		[[maybe_unused]] const uint32_t instanceBinding = quadArray->AddLayout(MeshInstanceData::GetLayout());
+		assert(instanceBinding == QuadInstanceBinding);
+		return true;
+	}
+
+	glm::vec3 decodeFrameDirection(const glm::vec2& uv, bool hemisphere)
+	{
+		const glm::vec2 e = uv * 2.0f - 1.0f;
+		if (hemisphere)
+		{
+			const glm::vec2 o = glm::vec2(e.x + e.y, e.x - e.y) * 0.5f;
+			return glm::normalize(glm::vec3(o.x, 1.0f - std::abs(o.x) - std::abs(o.y), o.y));
+		}
+		glm::vec3 d(e.x, 1.0f - std::abs(e.x) - std::abs(e.y), e.y);
+		if (d.y < 0.0f)
+		{
+			const float x = (1.0f - std::abs(d.z)) * (d.x >= 0.0f ? 1.0f : -1.0f);
+			const float z = (1.0f - std::abs(d.x)) * (d.z >= 0.0f ? 1.0f : -1.0f);
+			d.x = x;
+			d.z = z;
+		}
+		return glm::normalize(d);
+	}
+
+	// Копия вложения с цепочкой mip-уровней: само вложение - один уровень и удаляется вместе с FrameBuffer
+	std::shared_ptr<Texture2D> createAtlas(const FrameBuffer& frameBuffer, uint32_t index, uint32_t frameResolution)
+	{
+		const GLsizei size = (GLsizei)frameBuffer.GetWidth();
+		const GLsizei levels = std::max(1, (int)std::log2((float)frameResolution / MinFrameMipSize) + 1);
+
+		GLuint id;
+		glCreateTextures(GL_TEXTURE_2D, 1, &id);
+		glTextureStorage2D(id, levels, frameBuffer.GetColorFormat(index), size, size);
+		glCopyImageSubData(frameBuffer.GetColorTexture(index), GL_TEXTURE_2D, 0, 0, 0, 0, id, GL_TEXTURE_2D, 0, 0, 0, 0, size, size, 1);
+		glGenerateTextureMipmap(id);
+
+		glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		return std::make_shared<Texture2D>(id);
+	}
+}
+//=============================================================================
+std::shared_ptr<Impostor> Impostor::Bake(const Model& model, const ImpostorSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	const auto startTime = std::chrono::steady_clock::now();
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	const uint32_t atlasSize = settings.frames * settings.frameResolution;
+	if (model.GetNumMesh() == 0 || settings.frames < 2 || settings.frameResolution == 0 || atlasSize > (uint32_t)maxTextureSize)
+	{
+		LOG_ERROR(Render, "Invalid impostor settings: {} frames of {} px", settings.frames, settings.frameResolution);
+		return nullptr;
+	}
+	if (!initSharedResources()) return nullptr;
+
+	auto impostor = std::make_shared<Impostor>();
+	impostor->m_settings = settings;
+	impostor->m_boundsCenter = (model.GetBoundsMin() + model.GetBoundsMax()) * 0.5f;
+	impostor->m_boundsRadius = std::max(glm::length(model.GetBoundsMax() - model.GetBoundsMin()) * 0.5f, 0.001f);
+	const glm::vec3 center = impostor->m_boundsCenter;
+	const float radius = impostor->m_boundsRadius;
+
+	// экземпляр на меш, в нем локальная трансформация меша
+	std::vector<MeshInstanceData> instances(model.GetNumMesh());
+	for (size_t i = 0; i < model.GetNumMesh(); i++)
+		instances[i].worldMatrix = model.GetMesh(i).GetLocalTransform();
+	auto& instanceBuffer = bakeInstanceBuffers.emplace_back(std::make_shared<VertexBuffer>((unsigned int)(instances.size() * sizeof(MeshInstanceData)), instances.data()));
+
+	FrameBuffer frameBuffer(atlasSize, atlasSize, { GL_RGBA8, GL_RGBA8, GL_R16F });
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	frameBuffer.Bind();
+	rhi::SetDepthTest(true);
+	rhi::SetDepthWrite(true);
+	rhi::SetCullFace(false); // листва двусторонняя
+	rhi::SetBlend(false);
+
+	const float clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const float clearDepth = 1.0f;
+	for (GLint i = 0; i < (GLint)frameBuffer.GetColorAttachmentCount(); i++)
+		glClearNamedFramebufferfv(frameBuffer.GetID(), GL_COLOR, i, clearColor);
+	glClearNamedFramebufferfv(frameBuffer.GetID(), GL_DEPTH, 0, &clearDepth);
+
+	bakeProgram->Bind();
+	bakeProgram->SetUniform4f("BoundsSphere", center.x, center.y, center.z, radius);
+	const glm::mat4 projection = glm::ortho(-radius, radius, -radius, radius, radius, 3.0f * radius);
+	for (uint32_t y = 0; y < settings.frames; y++)
+	{
+		for (uint32_t x = 0; x < settings.frames; x++)
+		{
+			// кадры в узлах сетки: крайние строки и столбцы - границы развертки
+			const glm::vec3 direction = decodeFrameDirection(glm::vec2(x, y) / float(settings.frames - 1), settings.hemisphere);
+			const glm::vec3 upReference = std::abs(direction.y) > 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+			const glm::mat4 view = glm::lookAt(center + direction * 2.0f * radius, center, upReference);
+			bakeProgram->SetUniformMat4("ViewProjection", projection * view);
+			bakeProgram->SetUniform3f("FrameDirection", direction.x, direction.y, direction.z);
+
+			glViewport(x * settings.frameResolution, y * settings.frameResolution, settings.frameResolution, settings.frameResolution);
+			for (uint32_t i = 0; i < model.GetNumMesh(); i++)
+				model.GetMesh(i).Draw(instanceBuffer->GetID(), i, 1);
+		}
+	}
+
+	rhi::BindFramebuffer(0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	rhi::SetCullFace(true);
+	rhi::SetBlend(true);
+
+	impostor->m_albedoAtlas = createAtlas(frameBuffer, 0, settings.frameResolution);
+	impostor->m_normalAtlas = createAtlas(frameBuffer, 1, settings.frameResolution);
+	impostor->m_depthAtlas = createAtlas(frameBuffer, 2, settings.frameResolution);
+
+	const double bakeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	LOG_INFO(Render, "Impostor baked: {}x{} frames of {} px, {} px atlas, {:.1f} ms", settings.frames, settings.frames, settings.frameResolution, atlasSize, bakeTime);
+	return impostor;
+}
+//=============================================================================
+void Impostor::bind(GLuint instanceBuffer) const
+{
+	drawProgram->Bind();
+	drawProgram->SetUniform4f("BoundsSphere", m_boundsCenter.x, m_boundsCenter.y, m_boundsCenter.z, m_boundsRadius);
+	drawProgram->SetUniform2f("FrameGrid", (float)m_settings.frames, m_settings.hemisphere ? 1.0f : 0.0f);
+	m_albedoAtlas->Bind(0);
+	m_normalAtlas->Bind(1);
+	m_depthAtlas->Bind(2);
+	quadArray->SetVertexBuffer(QuadInstanceBinding, instanceBuffer);
+	quadArray->Bind();
+}
+//=============================================================================
+void Impostor::Draw(GLuint instanceBuffer, uint32_t baseInstance, uint32_t instanceCount) const
+{
+	bind(instanceBuffer);
+	rhi::DrawElementsInstanced(GL_TRIANGLES, (GLsizei)GetIndexCount(), GL_UNSIGNED_INT, nullptr, instanceCount, baseInstance);
+}
+//=============================================================================
+void Impostor::DrawIndirect(GLuint instanceBuffer, GLintptr commandOffset) const
+{
+	bind(instanceBuffer);
+	rhi::DrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, commandOffset);
+}
+//=============================================================================
+void ClearImpostorResources()
+{
+	bakeProgram.reset();
+	drawProgram.reset();
+	quadArray.reset();
+	quadVertexBuffer.reset();
+	quadIndexBuffer.reset();
+	bakeInstanceBuffers.clear();
+}
+//=============================================================================
\ No newline at end of file
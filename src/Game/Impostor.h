@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include "Render.h"
+
+class Model;
+
+struct ImpostorSettings final
+{
+	uint32_t frames{ 12 };            // кадров на сторону октаэдрической сетки
+	uint32_t frameResolution{ 128 };  // размер кадра в атласе, пикселей
+	bool     hemisphere{ true };      // только верхняя полусфера: деревья и постройки снизу не видны
+	float    switchDistance{ 60.0f }; // дальше вместо модели рисуется импостор
+};
+
+// Октаэдрический импостор: модель, снятая ортографической камерой с frames x frames направлений
+// в атласы альбедо, нормалей и глубины. Экземпляр рисуется одним четырехугольником, повернутым к камере,
+// из атласа смешиваются три кадра, ближайших к направлению взгляда
+class Impostor final
+{
+public:
+	// Съемка атласов через FrameBuffer с несколькими вложениями. Нужен контекст GL, nullptr при ошибке
+	static std::shared_ptr<Impostor> Bake(const Model& model, const ImpostorSettings& settings = {});
+
+	// Экземпляры - MeshInstanceData с мировой матрицей модели, как у мешей
+	void Draw(GLuint instanceBuffer, uint32_t baseInstance, uint32_t instanceCount) const;
+	// То же с DrawElementsIndirectCommand из привязанного буфера команд
+	void DrawIndirect(GLuint instanceBuffer, GLintptr commandOffset) const;
+
+	static uint32_t GetIndexCount() { return 6; }
+	const ImpostorSettings& GetSettings() const { return m_settings; }
+	float GetSwitchDistance() const { return m_settings.switchDistance; }
+
+private:
+	void bind(GLuint instanceBuffer) const;
+
+	ImpostorSettings           m_settings;
+	glm::vec3                  m_boundsCenter{ 0.0f }; // сфера модели, в нее вписаны кадры
+	float                      m_boundsRadius{ 0.0f };
+	std::shared_ptr<Texture2D> m_albedoAtlas;          // rgb - альбедо, a - покрытие
+	std::shared_ptr<Texture2D> m_normalAtlas;          // нормаль модели, упакованная в [0, 1]
+	std::shared_ptr<Texture2D> m_depthAtlas;           // смещение поверхности от плоскости кадра в радиусах сферы
+};
+
+// Общие шейдеры и геометрия импосторов
+void ClearImpostorResources();
\ No newline at end of file
@@ -0,0 +1,422 @@
+﻿#include "stdafx.h"
+#include "JobSystem.h"
+#include "Log.h"
+#include "Profiler.h"
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#endif
+//=============================================================================
+namespace jobs
+{
+	// доступ к внутренностям Counter из реализации
+	struct JobAccess final
+	{
+		static std::atomic<uint32_t>& Value(Counter& counter) { return counter.m_value; }
+		static std::atomic<uint32_t>& Finishing(Counter& counter) { return counter.m_finishing; }
+		static std::atomic_flag& Lock(Counter& counter) { return counter.m_lock; }
+		static Job*& Waiting(Counter& counter) { return counter.m_waiting; }
+	};
+}
+//=============================================================================
+namespace
+{
+	using namespace jobs;
+
+	constexpr uint32_t JobMask = MaxJobsPerThread - 1;
+	constexpr uint32_t SpinCount = 64; // попыток найти задачу до засыпания
+
+	inline void cpuPause()
+	{
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+		_mm_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	// Дека Chase-Lev фиксированного размера (Lê, Pop, Cohen, Zappa Nardelli, 2013).
+	// Push/Pop - только поток-владелец с нижнего конца, Steal - любой поток с верхнего
+	class WorkStealingQueue final
+	{
+	public:
+		bool Push(Job* job)
+		{
+			const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			const int64_t top = m_top.load(std::memory_order_acquire);
+			if (bottom - top >= (int64_t)MaxJobsPerThread) [[unlikely]] return false;
+
+			m_buffer[bottom & JobMask].store(job, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		Job* Pop()
+		{
+			const int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+			m_bottom.store(bottom, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t top = m_top.load(std::memory_order_relaxed);
+
+			if (top > bottom)
+			{
+				// дека пуста
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			Job* job = m_buffer[bottom & JobMask].load(std::memory_order_relaxed);
+			if (top == bottom)
+			{
+				// последний элемент - соревнуемся с ворами
+				if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					job = nullptr;
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+			return job;
+		}
+
+		Job* Steal()
+		{
+			int64_t top = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const int64_t bottom = m_bottom.load(std::memory_order_acquire);
+			if (top >= bottom) return nullptr;
+
+			Job* job = m_buffer[top & JobMask].load(std::memory_order_relaxed);
+			if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return job;
+		}
+
+	private:
+		alignas(64) std::atomic<int64_t> m_top{ 0 };
+		alignas(64) std::atomic<int64_t> m_bottom{ 0 };
+		alignas(64) std::array<std::atomic<Job*>, MaxJobsPerThread> m_buffer;
+	};
+
+	struct alignas(64) ThreadState final
+	{
+		WorkStealingQueue queue;
+		// кольцо задач потока: слот переиспользуется через MaxJobsPerThread выделений
+		std::array<Job, MaxJobsPerThread> jobs;
+		uint32_t allocated{ 0 };
+		uint32_t random{ 0 };
+		bool     overflowReported{ false };
+	};
+
+	std::vector<std::unique_ptr<ThreadState>> threadStates;
+	std::vector<std::thread>                  workers;
+	std::array<std::string, MaxThreads>       workerNames;
+	thread_local int                          threadIndex{ -1 };
+
+	std::atomic<bool>       isQuit{ false };
+	std::mutex              sleepMutex;
+	std::condition_variable sleepCondition;
+	std::atomic<uint32_t>   sleepingCount{ 0 };
+	std::atomic<uint32_t>   submitGeneration{ 0 };
+
+	void wakeWorkers()
+	{
+		submitGeneration.fetch_add(1);
+		if (sleepingCount.load() > 0)
+		{
+			// пустой захват: спящий поток либо увидит новое поколение, либо получит уведомление
+			{ std::lock_guard<std::mutex> lock(sleepMutex); }
+			sleepCondition.notify_one();
+		}
+	}
+
+	void executeJob(Job* job);
+
+	// слот кольца свободен, когда задача в нем выполнена (function сбрасывает исполнитель, возможно другой поток)
+	bool isJobPending(Job& job)
+	{
+		return std::atomic_ref(job.function).load(std::memory_order_acquire) != nullptr;
+	}
+
+	void pushJob(Job* job)
+	{
+		if (threadIndex < 0 || !threadStates[threadIndex]->queue.Push(job)) [[unlikely]]
+		{
+			// поток вне системы или дека переполнена - выполняем сразу, не блокируясь
+			executeJob(job);
+			return;
+		}
+		wakeWorkers();
+	}
+
+	void finishJob(Counter& counter)
+	{
+		std::atomic<uint32_t>& finishing = JobAccess::Finishing(counter);
+		finishing.fetch_add(1);
+		if (JobAccess::Value(counter).fetch_sub(1) == 1)
+		{
+			std::atomic_flag& lock = JobAccess::Lock(counter);
+			while (lock.test_and_set(std::memory_order_acquire)) cpuPause();
+			Job* waiting = std::exchange(JobAccess::Waiting(counter), nullptr);
+			lock.clear(std::memory_order_release);
+
+			while (waiting)
+			{
+				Job* next = waiting->next;
+				waiting->next = nullptr;
+				pushJob(waiting);
+				waiting = next;
+			}
+		}
+		// последнее обращение к счетчику: после него Wait() может вернуть управление
+		finishing.fetch_sub(1);
+	}
+
+	void executeJob(Job* job)
+	{
+		Counter* counter = job->counter;
+		job->function(job);
+		std::atomic_ref(job->function).store(nullptr, std::memory_order_release);
+		if (counter) finishJob(*counter);
+	}
+
+	Job* findJob()
+	{
+		ThreadState& state = *threadStates[threadIndex];
+		if (Job* job = state.queue.Pop()) return job;
+
+		// xorshift: случайная стартовая жертва, чтобы воры не толпились у одного потока
+		state.random ^= state.random << 13;
+		state.random ^= state.random >> 17;
+		state.random ^= state.random << 5;
+		const uint32_t count = (uint32_t)threadStates.size();
+		const uint32_t start = state.random % count;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const uint32_t victim = (start + i) % count;
+			if (victim == (uint32_t)threadIndex) continue;
+			if (Job* job = threadStates[victim]->queue.Steal()) return job;
+		}
+		return nullptr;
+	}
+
+	void workerMain(int index)
+	{
+		threadIndex = index;
+		profiler::SetThreadName(workerNames[index].c_str());
+
+		while (!isQuit.load(std::memory_order_relaxed))
+		{
+			const uint32_t generation = submitGeneration.load();
+			Job* job = nullptr;
+			for (uint32_t spin = 0; spin < SpinCount && !job; spin++)
+			{
+				job = findJob();
+				if (!job) cpuPause();
+			}
+			if (job)
+			{
+				executeJob(job);
+				continue;
+			}
+
+			sleepingCount.fetch_add(1);
+			{
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				sleepCondition.wait(lock, [generation] { return isQuit.load() || submitGeneration.load() != generation; });
+			}
+			sleepingCount.fetch_sub(1);
+		}
+		threadIndex = -1;
+	}
+}
+//=============================================================================
+bool jobs::Counter::IsDone() const
+{
+	return m_value.load() == 0 && m_finishing.load() == 0;
+}
+//=============================================================================
+void jobs::Init(uint32_t workerCount)
+{
+	if (!threadStates.empty()) return;
+
+	if (workerCount == 0)
+		workerCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	workerCount = std::min(workerCount, MaxThreads - 1);
+
+	isQuit = false;
+	threadStates.resize(workerCount + 1);
+	for (uint32_t i = 0; i <= workerCount; i++)
+	{
+		threadStates[i] = std::make_unique<ThreadState>();
+		threadStates[i]->random = 0x9E3779B9u * (i + 1);
+	}
+
+	threadIndex = 0; // главный поток
+	for (uint32_t i = 1; i <= workerCount; i++)
+	{
+		workerNames[i] = "Worker " + std::to_string(i);
+		workers.emplace_back(workerMain, (int)i);
+	}
+	LOG_INFO(Jobs, "Job system: {} workers", workerCount);
+}
+//=============================================================================
+void jobs::Close()
+{
+	if (threadStates.empty()) return;
+
+	// дочищаем очередь главного потока, рабочие доделают свои перед выходом из Wait-ов
+	while (Job* job = findJob()) executeJob(job);
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		isQuit = true;
+	}
+	sleepCondition.notify_all();
+	for (auto& worker : workers) worker.join();
+	workers.clear();
+	threadStates.clear();
+	threadIndex = -1;
+}
+//=============================================================================
+uint32_t jobs::GetThreadCount()
+{
+	return (uint32_t)std::max<size_t>(threadStates.size(), 1);
+}
+//=============================================================================
+int jobs::GetThreadIndex()
+{
+	return threadIndex;
+}
+//=============================================================================
+void jobs::Wait(const Counter& counter)
+{
+	if (threadIndex < 0) [[unlikely]]
+	{
+		while (!counter.IsDone()) std::this_thread::yield();
+		return;
+	}
+
+	while (!counter.IsDone())
+	{
+		if (Job* job = findJob()) executeJob(job);
+		else cpuPause();
+	}
+}
+//=============================================================================
+jobs::Job* jobs::detail::AllocateJob()
+{
+	if (threadIndex < 0) [[unlikely]]
+	{
+		// вне системы задача выполнится сразу в Submit
+		thread_local Job externalJob;
+		return &externalJob;
+	}
+	ThreadState& state = *threadStates[threadIndex];
+	Job* job = &state.jobs[state.allocated++ & JobMask];
+	if (isJobPending(*job)) [[unlikely]]
+	{
+		// кольцо переполнено: слот занят задачей, выделенной MaxJobsPerThread задач назад.
+		// Затереть ее нельзя - помогаем выполнять задачи, пока слот не освободится
+		if (!state.overflowReported)
+		{
+			state.overflowReported = true;
+			LOG_FATAL(Jobs, "Job ring overflow on thread {}: more than {} jobs in flight", threadIndex, MaxJobsPerThread);
+		}
+		while (isJobPending(*job))
+		{
+			if (Job* other = findJob()) executeJob(other);
+			else cpuPause();
+		}
+	}
+	return job;
+}
+//=============================================================================
+void jobs::detail::Submit(Job* job, Counter* counter, Counter* dependency)
+{
+	job->counter = counter;
+	job->next = nullptr;
+	if (counter) JobAccess::Value(*counter).fetch_add(1);
+
+	if (dependency && threadIndex < 0) [[unlikely]]
+	{
+		// у внешнего потока одна задача на поток - ждем зависимость на месте
+		Wait(*dependency);
+	}
+	else if (dependency)
+	{
+		std::atomic_flag& lock = JobAccess::Lock(*dependency);
+		while (lock.test_and_set(std::memory_order_acquire)) cpuPause();
+		if (JobAccess::Value(*dependency).load() != 0)
+		{
+			// задачу поставит в очередь поток, который обнулит dependency
+			job->next = std::exchange(JobAccess::Waiting(*dependency), job);
+			lock.clear(std::memory_order_release);
+			return;
+		}
+		lock.clear(std::memory_order_release);
+	}
+	pushJob(job);
+}
+//=============================================================================
+void jobs::RunOverheadBenchmark()
+{
+	using Clock = std::chrono::steady_clock;
+	auto nanosecondsPer = [](Clock::time_point start, uint64_t count)
+	{
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (double)count;
+	};
+
+	constexpr uint32_t Iterations = 20;
+	constexpr uint32_t BatchJobs = MaxJobsPerThread / 2;
+	LOG_INFO(Jobs, "Job system benchmark, threads: {}", GetThreadCount());
+
+	// пустые задачи: стоимость Run + выполнения + завершения, включая воровство
+	{
+		std::atomic<uint32_t> executed{ 0 };
+		const auto start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++)
+		{
+			Counter counter;
+			for (uint32_t j = 0; j < BatchJobs; j++)
+				Run([&executed] { executed.fetch_add(1, std::memory_order_relaxed); }, &counter);
+			Wait(counter);
+		}
+		LOG_INFO(Jobs, "  empty job:          {:.1f} ns/job", nanosecondsPer(start, (uint64_t)Iterations * BatchJobs));
+	}
+
+	// цепочка зависимостей: задержка передачи управления от задачи к задаче
+	{
+		constexpr uint32_t ChainLength = 256;
+		const auto start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++)
+		{
+			std::array<Counter, ChainLength> counters;
+			for (uint32_t j = 0; j < ChainLength; j++)
+				Run([] {}, &counters[j], j > 0 ? &counters[j - 1] : nullptr);
+			// каждый счетчик ждем отдельно: он должен пережить поток, который его обнулил
+			for (const Counter& counter : counters) Wait(counter);
+		}
+		LOG_INFO(Jobs, "  dependency chain:   {:.1f} ns/link", nanosecondsPer(start, (uint64_t)Iterations * ChainLength));
+	}
+
+	// ParallelFor по пустому телу: накладные расходы на деление диапазона
+	{
+		constexpr uint32_t Count = 1 << 20;
+		std::vector<float> data(Count, 1.0f);
+		auto body = [&data](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; i++) data[i] = data[i] * 0.5f + 1.0f;
+		};
+
+		auto start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++) body(0, Count);
+		const double serial = nanosecondsPer(start, Iterations) / 1e6;
+
+		start = Clock::now();
+		for (uint32_t i = 0; i < Iterations; i++) ParallelFor(Count, 1024, body);
+		const double parallel = nanosecondsPer(start, Iterations) / 1e6;
+
+		LOG_INFO(Jobs, "  parallel_for 1M:    serial {:.3f} ms, parallel {:.3f} ms", serial, parallel);
+	}
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+// Система задач: у каждого рабочего потока (и у главного) своя дека Chase-Lev, свободные
+// потоки воруют задачи у соседей. Завершение отслеживается счетчиками, задача может ждать
+// счетчик другой группы задач. Ожидание не блокирует поток - он выполняет чужие задачи.
+namespace jobs
+{
+	constexpr uint32_t MaxJobsPerThread = 4096; // степень двойки: размер деки и кольца задач потока
+	constexpr uint32_t MaxThreads = 64;
+
+	struct Job;
+
+	// Количество незавершенных задач группы. Должен жить, пока Wait() на нем не вернет управление
+	class Counter final
+	{
+	public:
+		Counter() = default;
+		Counter(const Counter&) = delete;
+		Counter& operator=(const Counter&) = delete;
+
+		bool IsDone() const;
+
+	private:
+		friend struct JobAccess;
+
+		std::atomic<uint32_t> m_value{ 0 };
+		std::atomic<uint32_t> m_finishing{ 0 }; // потоки, которые еще трогают счетчик после его обнуления
+		std::atomic_flag      m_lock;
+		Job*                  m_waiting{ nullptr }; // задачи, ждущие обнуления счетчика
+	};
+
+	// Задача занимает одну линию кэша: функтор хранится внутри, без выделений памяти
+	struct alignas(64) Job final
+	{
+		static constexpr size_t StorageSize = 40;
+
+		void   (*function)(Job* job){ nullptr }; // вызывает и разрушает хранимый функтор
+		Counter* counter{ nullptr };
+		Job*     next{ nullptr };
+		alignas(8) std::byte storage[StorageSize];
+	};
+
+	// workerCount = 0 - по числу ядер минус главный поток
+	void Init(uint32_t workerCount = 0);
+	void Close();
+
+	// Потоки, выполняющие задачи, включая главный
+	uint32_t GetThreadCount();
+	// 0 - главный поток, -1 - поток вне системы задач
+	int GetThreadIndex();
+
+	// Выполняет задачи, пока счетчик не обнулится
+	void Wait(const Counter& counter);
+
+	namespace detail
+	{
+		Job* AllocateJob();
+		// dependency != nullptr - задача попадет в очередь только после обнуления dependency
+		void Submit(Job* job, Counter* counter, Counter* dependency);
+	}
+
+	// function() выполнится на любом потоке системы. counter увеличивается сразу, уменьшается по завершении
+	template<typename F>
+	void Run(F&& function, Counter* counter = nullptr, Counter* dependency = nullptr)
+	{
+		using Functor = std::decay_t<F>;
+		static_assert(sizeof(Functor) <= Job::StorageSize, "job functor is too large, capture by reference");
+		static_assert(alignof(Functor) <= 8);
+
+		Job* job = detail::AllocateJob();
+		new (job->storage) Functor(std::forward<F>(function));
+		job->function = [](Job* job)
+		{
+			Functor* functor = std::launder(reinterpret_cast<Functor*>(job->storage));
+			(*functor)();
+			functor->~Functor();
+		};
+		detail::Submit(job, counter, dependency);
+	}
+
+	// Делит [0, count) на куски не меньше grainSize и вызывает function(begin, end) параллельно.
+	// Возвращает управление, когда все куски выполнены
+	template<typename F>
+	void ParallelFor(uint32_t count, uint32_t grainSize, F&& function)
+	{
+		if (count == 0) return;
+		const uint32_t threadCount = GetThreadCount();
+		const uint32_t chunks = threadCount * 4; // запас на неравномерную нагрузку
+		const uint32_t chunkSize = std::max(std::max(grainSize, 1u), (count + chunks - 1) / chunks);
+		if (chunkSize >= count || threadCount <= 1 || GetThreadIndex() < 0)
+		{
+			function(0u, count);
+			return;
+		}
+
+		Counter counter;
+		for (uint32_t begin = chunkSize; begin < count; begin += chunkSize)
+		{
+			const uint32_t end = std::min(begin + chunkSize, count);
+			Run([&function, begin, end] { function(begin, end); }, &counter);
+		}
+		function(0u, chunkSize); // первый кусок - на текущем потоке
+		Wait(counter);
+	}
+
+	// Микробенчмарк накладных расходов планировщика, результат в лог
+	void RunOverheadBenchmark();
+}
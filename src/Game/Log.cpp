@@ -0,0 +1,433 @@
+﻿#include "stdafx.h"
+#include "Log.h"
+#include "CoreApp.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	struct RecordHeader final
+	{
+		uint32_t                       size;           // вместе с заголовком и выравниванием
+		LogLevel                       level;
+		LogCategory                    category;
+		uint64_t                       time;           // нс от старта
+		const char*                    format;         // строка формата - литерал, живет до конца программы
+		uint32_t                       formatSize;
+		logger::detail::FormatFunction formatFunction; // nullptr - пропуск до конца кольца
+	};
+
+	// Кольцо одного потока: пишет только поток-владелец, читает только фоновый поток журнала
+	struct ThreadRing final
+	{
+		alignas(RecordHeader) std::array<std::byte, logger::BytesPerThread> data;
+		std::atomic<uint64_t> head{ 0 };
+		std::atomic<uint64_t> tail{ 0 };
+		uint64_t pendingHead{ 0 }; // конец резервируемой записи на стороне потока-владельца
+	};
+
+	struct LineRef final
+	{
+		uint64_t time;
+		size_t   offset;
+		size_t   size;
+	};
+
+	constexpr const char* LevelNames[] = { "Verbose", "Info", "Warning", "Error", "Fatal" };
+	constexpr const char* CategoryNames[] = { "Core", "Render", "Graphics", "Scene", "Jobs", "Profiler", "Benchmark", "Script" };
+	static_assert(std::size(LevelNames) == (size_t)LogLevel::Count);
+	static_assert(std::size(CategoryNames) == (size_t)LogCategory::Count);
+
+	const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	std::mutex                                                   ringsMutex;
+	std::array<std::unique_ptr<ThreadRing>, logger::MaxThreads> rings;
+	std::atomic<uint32_t>                                        ringCount{ 0 };
+	thread_local ThreadRing*                                     localRing{ nullptr };
+
+	std::thread             writerThread;
+	std::mutex              wakeMutex;
+	std::condition_variable wakeCondition;
+	std::condition_variable flushCondition;
+	std::atomic<bool>       wakeRequested{ false };
+	bool                    stopRequested{ false };
+	uint64_t                flushRequested{ 0 };
+	uint64_t                flushCompleted{ 0 };
+
+	std::atomic<uint64_t> writtenCount{ 0 };
+	std::atomic<uint64_t> droppedCount{ 0 };
+
+	std::mutex outputMutex; // вывод из фонового потока и прямой вывод до Init/после Close
+	FILE*      file{ nullptr };
+	bool       console{ true };
+
+	// Буферы фонового потока
+	std::string          text;
+	std::string          output;
+	std::vector<LineRef> lines;
+
+	inline uint64_t now()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	ThreadRing* getThreadRing()
+	{
+		if (localRing) [[likely]] return localRing;
+
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		const uint32_t count = ringCount.load(std::memory_order_relaxed);
+		if (count >= logger::MaxThreads) return nullptr;
+		rings[count] = std::make_unique<ThreadRing>();
+		localRing = rings[count].get();
+		ringCount.store(count + 1, std::memory_order_release);
+		return localRing;
+	}
+
+	void appendPrefix(std::string& out, uint64_t time, LogLevel level, LogCategory category)
+	{
+		std::format_to(std::back_inserter(out), "[{:9.3f}] [{}] ", double(time) * 1e-9, CategoryNames[(size_t)category]);
+		if (level != LogLevel::Info)
+		{
+			out += LevelNames[(size_t)level];
+			out += ": ";
+		}
+	}
+
+	void writeOutput(std::string_view str)
+	{
+		if (str.empty()) return;
+		if (console)
+		{
+			fwrite(str.data(), 1, str.size(), stdout);
+			fflush(stdout);
+		}
+		if (file)
+		{
+			fwrite(str.data(), 1, str.size(), file);
+			fflush(file);
+		}
+	}
+
+	// Форматирует записи одного кольца в text, ссылки на строки складывает в lines
+	void drainRing(ThreadRing& ring)
+	{
+		const uint64_t head = ring.head.load(std::memory_order_acquire);
+		uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+		while (tail < head)
+		{
+			const uint64_t offset = tail % logger::BytesPerThread;
+			const uint64_t remainder = logger::BytesPerThread - offset;
+			if (remainder < sizeof(RecordHeader))
+			{
+				tail += remainder;
+				continue;
+			}
+
+			const auto* header = reinterpret_cast<const RecordHeader*>(ring.data.data() + offset);
+			if (header->formatFunction)
+			{
+				const size_t lineOffset = text.size();
+				appendPrefix(text, header->time, header->level, header->category);
+				header->formatFunction(std::string_view(header->format, header->formatSize), reinterpret_cast<const std::byte*>(header + 1), text);
+				text += '\n';
+				lines.push_back({ header->time, lineOffset, text.size() - lineOffset });
+			}
+			tail += header->size;
+		}
+		ring.tail.store(tail, std::memory_order_release);
+	}
+
+	void drainAll()
+	{
+		text.clear();
+		lines.clear();
+		const uint32_t count = ringCount.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < count; i++)
+			drainRing(*rings[i]);
+		if (lines.empty()) return;
+
+		// кольца потоков сливаются в один поток сообщений по времени записи
+		std::stable_sort(lines.begin(), lines.end(), [](const LineRef& a, const LineRef& b) { return a.time < b.time; });
+		output.clear();
+		for (const LineRef& line : lines)
+			output.append(text, line.offset, line.size);
+
+		std::lock_guard<std::mutex> lock(outputMutex);
+		writeOutput(output);
+		writtenCount.fetch_add(lines.size(), std::memory_order_relaxed);
+	}
+
+	void writerLoop()
+	{
+		profiler::SetThreadName("Log");
+		while (true)
+		{
+			bool stop;
+			uint64_t flushTarget;
+			{
+				std::unique_lock<std::mutex> lock(wakeMutex);
+				wakeCondition.wait_for(lock, std::chrono::milliseconds(10), [] { return wakeRequested.load(std::memory_order_relaxed) || stopRequested; });
+				wakeRequested.store(false, std::memory_order_relaxed);
+				stop = stopRequested;
+				flushTarget = flushRequested;
+			}
+
+			drainAll();
+
+			if (flushTarget > flushCompleted)
+			{
+				{
+					std::lock_guard<std::mutex> lock(wakeMutex);
+					flushCompleted = flushTarget;
+				}
+				flushCondition.notify_all();
+			}
+			if (stop) break;
+		}
+	}
+
+	void wakeWriter()
+	{
+		wakeRequested.store(true, std::memory_order_relaxed);
+		wakeCondition.notify_one();
+	}
+}
+//=============================================================================
+namespace logger::detail
+{
+	std::atomic<uint8_t>  minLevel{ (uint8_t)LogLevel::Info };
+	std::atomic<uint32_t> categoryMask{ ~0u };
+	std::atomic<bool>     isRunning{ false };
+}
+//=============================================================================
+void logger::Init(const LoggerSettings& settings)
+{
+	SetLevel(settings.level);
+	detail::categoryMask.store(settings.categoryMask, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(outputMutex);
+		console = settings.console;
+		if (!settings.filePath.empty())
+		{
+			file = fopen(settings.filePath.c_str(), "w");
+			if (!file) fprintf(stderr, "Failed to open log file: %s\n", settings.filePath.c_str());
+		}
+	}
+
+	stopRequested = false;
+	writerThread = std::thread(writerLoop);
+	detail::isRunning.store(true, std::memory_order_release);
+}
+//=============================================================================
+void logger::Close()
+{
+	if (!detail::isRunning.exchange(false, std::memory_order_acq_rel)) return;
+
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex);
+		stopRequested = true;
+	}
+	wakeCondition.notify_one();
+	writerThread.join();
+
+	std::lock_guard<std::mutex> lock(outputMutex);
+	if (file)
+	{
+		fclose(file);
+		file = nullptr;
+	}
+	console = true; // дальнейшие прямые сообщения не должны потеряться
+}
+//=============================================================================
+void logger::Flush()
+{
+	if (!detail::isRunning.load(std::memory_order_acquire)) return;
+
+	std::unique_lock<std::mutex> lock(wakeMutex);
+	const uint64_t target = ++flushRequested;
+	wakeRequested.store(true, std::memory_order_relaxed);
+	wakeCondition.notify_one();
+	flushCondition.wait(lock, [target] { return flushCompleted >= target || stopRequested; });
+}
+//=============================================================================
+void logger::SetLevel(LogLevel level)
+{
+	detail::minLevel.store((uint8_t)std::min(level, LogLevel::Fatal), std::memory_order_relaxed);
+}
+//=============================================================================
+LogLevel logger::GetLevel()
+{
+	return (LogLevel)detail::minLevel.load(std::memory_order_relaxed);
+}
+//=============================================================================
+void logger::SetCategoryEnabled(LogCategory category, bool enabled)
+{
+	const uint32_t bit = 1u << (uint32_t)category;
+	if (enabled)
+		detail::categoryMask.fetch_or(bit, std::memory_order_relaxed);
+	else
+		detail::categoryMask.fetch_and(~bit, std::memory_order_relaxed);
+}
+//=============================================================================
+bool logger::IsCategoryEnabled(LogCategory category)
+{
+	return detail::categoryMask.load(std::memory_order_relaxed) & (1u << (uint32_t)category);
+}
+//=============================================================================
+const char* logger::GetLevelName(LogLevel level)
+{
+	return level < LogLevel::Count ? LevelNames[(size_t)level] : "Unknown";
+}
+//=============================================================================
+const char* logger::GetCategoryName(LogCategory category)
+{
+	return category < LogCategory::Count ? CategoryNames[(size_t)category] : "Unknown";
+}
+//=============================================================================
+namespace
+{
+	bool equalsIgnoreCase(std::string_view a, std::string_view b)
+	{
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+			[](char x, char y) { return std::tolower((unsigned char)x) == std::tolower((unsigned char)y); });
+	}
+}
+//=============================================================================
+bool logger::ParseLevel(std::string_view name, LogLevel& level)
+{
+	for (size_t i = 0; i < std::size(LevelNames); i++)
+	{
+		if (equalsIgnoreCase(name, LevelNames[i]))
+		{
+			level = (LogLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
+//=============================================================================
+bool logger::ParseCategories(std::string_view list, uint32_t& categoryMask)
+{
+	uint32_t mask = 0;
+	while (!list.empty())
+	{
+		const size_t comma = list.find(',');
+		const std::string_view name = list.substr(0, comma);
+		list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+		if (name.empty()) continue;
+
+		size_t i = 0;
+		while (i < std::size(CategoryNames) && !equalsIgnoreCase(name, CategoryNames[i])) i++;
+		if (i == std::size(CategoryNames)) return false;
+		mask |= 1u << i;
+	}
+	categoryMask = mask;
+	return true;
+}
+//=============================================================================
+uint64_t logger::GetWrittenCount()
+{
+	return writtenCount.load(std::memory_order_relaxed);
+}
+//=============================================================================
+uint64_t logger::GetDroppedCount()
+{
+	return droppedCount.load(std::memory_order_relaxed);
+}
+//=============================================================================
+void logger::DrawImGui()
+{
+	ImGui::Begin("Log");
+
+	int level = (int)GetLevel();
+	if (ImGui::Combo("Level", &level, LevelNames, (int)std::size(LevelNames)))
+		SetLevel((LogLevel)level);
+
+	for (size_t i = 0; i < std::size(CategoryNames); i++)
+	{
+		bool enabled = IsCategoryEnabled((LogCategory)i);
+		if (i % 4 != 0) ImGui::SameLine();
+		if (ImGui::Checkbox(CategoryNames[i], &enabled))
+			SetCategoryEnabled((LogCategory)i, enabled);
+	}
+
+	ImGui::Text("Written: %llu, dropped: %llu, threads: %u", (unsigned long long)GetWrittenCount(),
+		(unsigned long long)GetDroppedCount(), ringCount.load(std::memory_order_relaxed));
+
+	ImGui::End();
+}
+//=============================================================================
+std::byte* logger::detail::BeginRecord(LogLevel level, LogCategory category, std::string_view format, FormatFunction formatFunction, size_t argsSize)
+{
+	constexpr uint64_t Alignment = alignof(RecordHeader);
+	const uint64_t size = (sizeof(RecordHeader) + argsSize + Alignment - 1) & ~(Alignment - 1);
+
+	ThreadRing* ring = getThreadRing();
+	if (!ring || size > BytesPerThread / 2) [[unlikely]]
+	{
+		droppedCount.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+
+	// запись не разрывается: если не помещается до конца кольца, остаток пропускается
+	const uint64_t remainder = BytesPerThread - head % BytesPerThread;
+	const uint64_t skip = remainder < size ? remainder : 0;
+	if (head + skip + size - tail > BytesPerThread) [[unlikely]]
+	{
+		droppedCount.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	if (skip >= sizeof(RecordHeader))
+	{
+		auto* padding = reinterpret_cast<RecordHeader*>(ring->data.data() + head % BytesPerThread);
+		padding->size = (uint32_t)skip;
+		padding->formatFunction = nullptr;
+	}
+	head += skip;
+
+	auto* header = reinterpret_cast<RecordHeader*>(ring->data.data() + head % BytesPerThread);
+	header->size = (uint32_t)size;
+	header->level = level;
+	header->category = category;
+	header->time = now();
+	header->format = format.data();
+	header->formatSize = (uint32_t)format.size();
+	header->formatFunction = formatFunction;
+	ring->pendingHead = head + size;
+	return reinterpret_cast<std::byte*>(header + 1);
+}
+//=============================================================================
+void logger::detail::EndRecord(LogLevel level)
+{
+	localRing->head.store(localRing->pendingHead, std::memory_order_release);
+	if (level >= LogLevel::Error) [[unlikely]]
+	{
+		wakeWriter();
+		if (level == LogLevel::Fatal) OnFatal();
+	}
+}
+//=============================================================================
+void logger::detail::OnFatal()
+{
+	Flush();
+	app::Exit();
+}
+//=============================================================================
+void logger::detail::WriteDirect(LogLevel level, LogCategory category, std::string_view message)
+{
+	std::string line;
+	appendPrefix(line, now(), level, category);
+	line += message;
+	line += '\n';
+	{
+		std::lock_guard<std::mutex> lock(outputMutex);
+		writeOutput(line);
+	}
+	writtenCount.fetch_add(1, std::memory_order_relaxed);
+	if (level == LogLevel::Fatal) app::Exit();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,174 @@
+﻿#pragma once
+
+enum class LogLevel : uint8_t
+{
+	Verbose,
+	Info,
+	Warning,
+	Error,
+	Fatal,
+
+	Count
+};
+
+enum class LogCategory : uint8_t
+{
+	Core,
+	Render,
+	Graphics,
+	Scene,
+	Jobs,
+	Profiler,
+	Benchmark,
+	Script,
+
+	Count
+};
+
+struct LoggerSettings final
+{
+	LogLevel    level{ LogLevel::Info };
+	uint32_t    categoryMask{ ~0u };     // бит на каждую LogCategory
+	std::string filePath{ "log.txt" };   // пустая строка - без файла
+	bool        console{ true };
+};
+
+// Асинхронный журнал. Вызов журнала копирует строку формата и аргументы в кольцо своего потока без
+// блокировок, форматирование и вывод в stdout и файл делает фоновый поток. Если кольцо заполнено,
+// сообщение отбрасывается и учитывается в счетчике - поток кадра никогда не ждет вывода.
+// До Init и после Close сообщения форматируются и выводятся сразу на вызывающем потоке.
+namespace logger
+{
+	constexpr uint32_t BytesPerThread = 1 << 17; // размер кольца одного потока
+	constexpr uint32_t MaxThreads = 64;
+
+	void Init(const LoggerSettings& settings);
+	void Close();
+
+	// Ждет, пока фоновый поток выведет все сообщения, записанные до вызова
+	void Flush();
+
+	void SetLevel(LogLevel level);
+	LogLevel GetLevel();
+	void SetCategoryEnabled(LogCategory category, bool enabled);
+	bool IsCategoryEnabled(LogCategory category);
+
+	const char* GetLevelName(LogLevel level);
+	const char* GetCategoryName(LogCategory category);
+	bool ParseLevel(std::string_view name, LogLevel& level);
+	// Список категорий через запятую, например "render,scene"
+	bool ParseCategories(std::string_view list, uint32_t& categoryMask);
+
+	uint64_t GetWrittenCount();
+	uint64_t GetDroppedCount();
+
+	void DrawImGui();
+
+	namespace detail
+	{
+		extern std::atomic<uint8_t>  minLevel;
+		extern std::atomic<uint32_t> categoryMask;
+		extern std::atomic<bool>     isRunning;
+
+		using FormatFunction = void(*)(std::string_view format, const std::byte* args, std::string& out);
+
+		// Резервирует место под запись в кольце текущего потока, nullptr - сообщение отброшено
+		std::byte* BeginRecord(LogLevel level, LogCategory category, std::string_view format, FormatFunction formatFunction, size_t argsSize);
+		void EndRecord(LogLevel level);
+		// Сбрасывает журнал и завершает приложение
+		void OnFatal();
+		// Вывод в обход кольца, когда фоновый поток не запущен
+		void WriteDirect(LogLevel level, LogCategory category, std::string_view message);
+
+		template<typename T>
+		constexpr bool IsStringArg = std::is_convertible_v<const T&, std::string_view>;
+
+		// Аргументы хранятся в кольце как есть, строки - длиной и символами
+		template<typename T, bool = IsStringArg<T>>
+		struct ArgCodec final
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Log argument must be a string or trivially copyable");
+
+			static size_t Size(const T&) { return sizeof(T); }
+			static std::byte* Encode(std::byte* dst, const T& value)
+			{
+				std::memcpy(dst, &value, sizeof(T));
+				return dst + sizeof(T);
+			}
+			static T Decode(const std::byte*& src)
+			{
+				T value;
+				std::memcpy(&value, src, sizeof(T));
+				src += sizeof(T);
+				return value;
+			}
+		};
+
+		template<typename T>
+		struct ArgCodec<T, true> final
+		{
+			static size_t Size(const T& value) { return sizeof(uint32_t) + std::string_view(value).size(); }
+			static std::byte* Encode(std::byte* dst, const T& value)
+			{
+				const std::string_view str(value);
+				const uint32_t size = (uint32_t)str.size();
+				std::memcpy(dst, &size, sizeof(size));
+				std::memcpy(dst + sizeof(size), str.data(), size);
+				return dst + sizeof(size) + size;
+			}
+			static std::string_view Decode(const std::byte*& src)
+			{
+				uint32_t size;
+				std::memcpy(&size, src, sizeof(size));
+				const std::string_view str(reinterpret_cast<const char*>(src + sizeof(size)), size);
+				src += sizeof(size) + size;
+				return str;
+			}
+		};
+
+		template<typename... Args>
+		void FormatRecord(std::string_view format, [[maybe_unused]] const std::byte* args, std::string& out)
+		{
+			// инициализация списком гарантирует порядок чтения аргументов слева направо
+			std::tuple values{ ArgCodec<Args>::Decode(args)... };
+			std::apply([&](auto&... value) { std::vformat_to(std::back_inserter(out), format, std::make_format_args(value...)); }, values);
+		}
+	}
+
+	inline bool IsEnabled(LogLevel level, LogCategory category)
+	{
+		return level == LogLevel::Fatal
+			|| ((uint8_t)level >= detail::minLevel.load(std::memory_order_relaxed)
+				&& (detail::categoryMask.load(std::memory_order_relaxed) & (1u << (uint32_t)category)));
+	}
+
+	template<typename... Args>
+	void Write(LogLevel level, LogCategory category, std::format_string<Args...> format, Args&&... args)
+	{
+		if (!detail::isRunning.load(std::memory_order_acquire)) [[unlikely]]
+		{
+			detail::WriteDirect(level, category, std::vformat(format.get(), std::make_format_args(args...)));
+			return;
+		}
+
+		const size_t argsSize = (size_t{ 0 } + ... + detail::ArgCodec<std::remove_cvref_t<Args>>::Size(args));
+		std::byte* dst = detail::BeginRecord(level, category, format.get(), &detail::FormatRecord<std::remove_cvref_t<Args>...>, argsSize);
+		if (!dst) [[unlikely]]
+		{
+			if (level == LogLevel::Fatal) detail::OnFatal();
+			return;
+		}
+		((dst = detail::ArgCodec<std::remove_cvref_t<Args>>::Encode(dst, args)), ...);
+		detail::EndRecord(level);
+	}
+}
+
+// Аргументы не вычисляются, если уровень или категория выключены
+#define LOG_WRITE(level, category, ...) \
+	do { if (logger::IsEnabled(LogLevel::level, LogCategory::category)) logger::Write(LogLevel::level, LogCategory::category, __VA_ARGS__); } while (false)
+
+#define LOG_VERBOSE(category, ...) LOG_WRITE(Verbose, category, __VA_ARGS__)
+#define LOG_INFO(category, ...)    LOG_WRITE(Info, category, __VA_ARGS__)
+#define LOG_WARNING(category, ...) LOG_WRITE(Warning, category, __VA_ARGS__)
+#define LOG_ERROR(category, ...)   LOG_WRITE(Error, category, __VA_ARGS__)
+#define LOG_FATAL(category, ...)   LOG_WRITE(Fatal, category, __VA_ARGS__)
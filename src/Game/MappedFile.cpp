@@ -0,0 +1,83 @@
+﻿#include "stdafx.h"
+#include "MappedFile.h"
+#include "Log.h"
+#if defined(_WIN32)
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+//=============================================================================
+MappedFile::~MappedFile()
+{
+	Close();
+}
+//=============================================================================
+bool MappedFile::Open(const std::string& path)
+{
+	Close();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size{};
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		LOG_ERROR(Core, "Failed to open file for mapping: {}", path);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data)
+	{
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		LOG_ERROR(Core, "Failed to map file: {}", path);
+		return false;
+	}
+	m_file = file;
+	m_mapping = mapping;
+	m_size = (size_t)size.QuadPart;
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	struct stat status{};
+	if (file < 0 || fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		if (file >= 0) close(file);
+		LOG_ERROR(Core, "Failed to open file for mapping: {}", path);
+		return false;
+	}
+	void* data = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file); // отображение держит файл само
+	if (data == MAP_FAILED)
+	{
+		LOG_ERROR(Core, "Failed to map file: {}", path);
+		return false;
+	}
+	m_size = (size_t)status.st_size;
+#endif
+	m_data = static_cast<const std::byte*>(data);
+	return true;
+}
+//=============================================================================
+void MappedFile::Close()
+{
+	if (!m_data) return;
+
+#if defined(_WIN32)
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	CloseHandle(m_file);
+	m_mapping = nullptr;
+	m_file = nullptr;
+#else
+	munmap(const_cast<std::byte*>(m_data), m_size);
+#endif
+	m_data = nullptr;
+	m_size = 0;
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,27 @@
+﻿#pragma once
+
+// Файл, отображенный в память только для чтения. Страницы подгружает ОС при первом обращении
+// и может выгрузить под нехваткой памяти, поэтому отображение большого файла не занимает память процесса
+class MappedFile final
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::string& path);
+	void Close();
+
+	bool IsOpen() const { return m_data != nullptr; }
+	const std::byte* GetData() const { return m_data; }
+	size_t GetSize() const { return m_size; }
+
+private:
+	const std::byte* m_data{ nullptr };
+	size_t           m_size{ 0 };
+#if defined(_WIN32)
+	void*            m_file{ nullptr };
+	void*            m_mapping{ nullptr };
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,207 @@
+﻿#include "stdafx.h"
+#include "MorphTarget.h"
+#include "Graphics.h"
+#include "Log.h"
+#include <emmintrin.h>
+//=============================================================================
+namespace
+{
+	// Дельты одной цели прибавляются к вершинам экземпляра. В одной цели вершины не повторяются, гонок нет
+	const GLchar* applyShaderSource = R"glsl(
+#version 430 core
+
+layout(local_size_x = 64) in;
+
+struct MorphDelta
+{
+	vec3  position;
+	uint  vertex;
+	vec3  normal;
+	float padding;
+};
+
+layout(std430, binding = 8) readonly buffer MorphDeltaStorage { MorphDelta deltas[]; };
+layout(std430, binding = 9) buffer MorphVertexStorage { float vertexData[]; }; // MeshVertex, 8 floats
+
+uniform int   FirstDelta;
+uniform int   DeltaCount;
+uniform int   FirstVertex;
+uniform float Weight;
+
+void main()
+{
+	const int index = int(gl_GlobalInvocationID.x);
+	if (index >= DeltaCount) return;
+
+	const MorphDelta delta = deltas[FirstDelta + index];
+	const int base = (FirstVertex + int(delta.vertex)) * 8;
+	vertexData[base + 0] += delta.position.x * Weight;
+	vertexData[base + 1] += delta.position.y * Weight;
+	vertexData[base + 2] += delta.position.z * Weight;
+	vertexData[base + 3] += delta.normal.x * Weight;
+	vertexData[base + 4] += delta.normal.y * Weight;
+	vertexData[base + 5] += delta.normal.z * Weight;
+}
+)glsl";
+
+	constexpr uint32_t ApplyGroupSize = 64;
+	constexpr uint32_t DeltaBindingPoint = 8;
+	constexpr uint32_t VertexBindingPoint = 9;
+
+	std::shared_ptr<ShaderProgram> applyProgram;
+	bool applyProgramFailed = false;
+
+	static_assert(sizeof(MorphDelta) == 32, "MorphDelta must match the std430 layout of the apply shader");
+	static_assert(sizeof(MeshVertex) == 8 * sizeof(float), "MeshVertex must match vertexData of the apply shader");
+}
+//=============================================================================
+MorphTargets::MorphTargets(const std::vector<MeshVertex>& vertices, std::vector<Target> targets, std::vector<MorphDelta> deltas)
+	: m_vertices(vertices)
+	, m_targets(std::move(targets))
+	, m_deltas(std::move(deltas))
+{
+	// пустой буфер хранения GL не создаст, хватит одной дельты-заглушки
+	const MorphDelta empty{};
+	m_deltaBuffer = std::make_shared<StorageBuffer>(DeltaBindingPoint, (uint32_t)(std::max<size_t>(m_deltas.size(), 1) * sizeof(MorphDelta)),
+		m_deltas.empty() ? &empty : m_deltas.data());
+}
+//=============================================================================
+MorphTargets::Target MorphTargets::AppendTarget(const std::vector<MeshVertex>& vertices, const glm::vec3* positions, const glm::vec3* normals,
+	float epsilon, std::vector<MorphDelta>& deltas)
+{
+	Target target{ 0, (uint32_t)deltas.size(), 0, glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()) };
+	for (uint32_t i = 0; i < (uint32_t)vertices.size(); i++)
+	{
+		const glm::vec3 position = positions[i] - vertices[i].Position;
+		const glm::vec3 normal = normals ? normals[i] - vertices[i].Normal : glm::vec3(0.0f);
+		if (glm::all(glm::lessThan(glm::abs(position), glm::vec3(epsilon))) && glm::all(glm::lessThan(glm::abs(normal), glm::vec3(epsilon))))
+			continue;
+		deltas.push_back({ position, i, normal });
+		target.boundsMin = glm::min(target.boundsMin, positions[i]);
+		target.boundsMax = glm::max(target.boundsMax, positions[i]);
+	}
+	target.deltaCount = (uint32_t)deltas.size() - target.firstDelta;
+	if (target.deltaCount == 0) target.boundsMin = target.boundsMax = glm::vec3(0.0f);
+	return target;
+}
+//=============================================================================
+size_t MorphTargets::GetMemorySize() const
+{
+	return m_vertices.size() * sizeof(MeshVertex) + m_deltas.size() * sizeof(MorphDelta) * 2 + m_targets.size() * sizeof(Target);
+}
+//=============================================================================
+MorphClip::MorphClip(std::string name, uint32_t targetCount, uint32_t frameCount, float frameRate)
+	: m_name(std::move(name))
+	, m_targetCount(targetCount)
+	, m_frameCount(std::max(frameCount, 1u))
+	, m_frameRate(frameRate)
+	, m_weights(size_t(m_frameCount) * targetCount, 0.0f)
+{
+}
+//=============================================================================
+void MorphClip::Sample(float time, bool loop, float* weights) const
+{
+	const float duration = GetDuration();
+	if (loop && duration > 0.0f) time -= std::floor(time / duration) * duration;
+	const float position = glm::clamp(time * m_frameRate, 0.0f, float(m_frameCount - 1));
+	const uint32_t frame = std::min((uint32_t)position, m_frameCount - 1);
+	const uint32_t next = std::min(frame + 1, m_frameCount - 1);
+	const float weight = position - (float)frame;
+
+	const float* from = GetFrame(frame);
+	const float* to = GetFrame(next);
+	for (uint32_t target = 0; target < m_targetCount; target++)
+		weights[target] += from[target] + (to[target] - from[target]) * weight;
+}
+//=============================================================================
+Morpher::Morpher(uint32_t targetCount)
+	: m_weights(targetCount, 0.0f)
+{
+}
+//=============================================================================
+void Morpher::Play(std::shared_ptr<const MorphClip> clip, bool loop)
+{
+	assert(!clip || clip->GetTargetCount() == m_weights.size());
+	m_clip = std::move(clip);
+	m_loop = loop;
+	m_time = m_previousTime = 0.0f;
+}
+//=============================================================================
+void Morpher::Advance(float deltaTime)
+{
+	if (!m_clip) return;
+
+	m_previousTime = m_time;
+	m_time += deltaTime * m_speed;
+	const float duration = m_clip->GetDuration();
+	if (m_loop && duration > 0.0f && m_time >= duration)
+	{
+		// как у Animator: оба момента сдвигаются вместе
+		const float wrap = std::floor(m_time / duration) * duration;
+		m_time -= wrap;
+		m_previousTime -= wrap;
+	}
+}
+//=============================================================================
+void Morpher::Evaluate(float alpha, float* weights) const
+{
+	std::copy(m_weights.begin(), m_weights.end(), weights);
+	if (m_clip) m_clip->Sample(glm::mix(m_previousTime, m_time, alpha), m_loop, weights);
+}
+//=============================================================================
+void morph::ApplyTargets(const MorphTargets& targets, const MorphWeight* weights, uint32_t weightCount, MeshVertex* output)
+{
+	std::copy_n(targets.GetVertices(), targets.GetVertexCount(), output);
+
+	// дельта - четыре float позиции (последний - номер вершины) и четыре нормали; у вершины позиция и нормаль
+	// лежат подряд, поэтому каждая прибавляется одной невыровненной четверкой с нулем в лишней компоненте
+	const __m128 xyzMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+	const MorphDelta* deltas = targets.GetDeltas();
+	for (uint32_t i = 0; i < weightCount; i++)
+	{
+		const MorphTargets::Target& target = targets.GetTarget(weights[i].target);
+		const __m128 weight4 = _mm_and_ps(_mm_set1_ps(weights[i].weight), xyzMask);
+		const MorphDelta* delta = deltas + target.firstDelta;
+		for (uint32_t d = 0; d < target.deltaCount; d++, delta++)
+		{
+			float* vertex = &output[delta->vertex].Position.x;
+			const __m128 position = _mm_mul_ps(_mm_loadu_ps(&delta->position.x), weight4);
+			_mm_storeu_ps(vertex, _mm_add_ps(_mm_loadu_ps(vertex), position));
+			const __m128 normal = _mm_mul_ps(_mm_loadu_ps(&delta->normal.x), weight4);
+			_mm_storeu_ps(vertex + 3, _mm_add_ps(_mm_loadu_ps(vertex + 3), normal));
+		}
+	}
+}
+//=============================================================================
+void morph::DispatchTarget(const MorphTargets& targets, const MorphWeight& weight, GLuint outputBuffer, uint32_t firstVertex)
+{
+	if (!applyProgram && !applyProgramFailed)
+	{
+		applyProgram = std::make_shared<ShaderProgram>(applyShaderSource);
+		if (!applyProgram->IsValid()) [[unlikely]]
+		{
+			LOG_ERROR(Render, "Failed to create morph target shader, morphed meshes are drawn without targets");
+			applyProgram.reset();
+			applyProgramFailed = true;
+		}
+	}
+	if (!applyProgram) return;
+
+	const MorphTargets::Target& target = targets.GetTarget(weight.target);
+	if (target.deltaCount == 0) return;
+	applyProgram->Bind();
+	applyProgram->SetUniform1i("FirstDelta", (int)target.firstDelta);
+	applyProgram->SetUniform1i("DeltaCount", (int)target.deltaCount);
+	applyProgram->SetUniform1i("FirstVertex", (int)firstVertex);
+	applyProgram->SetUniform1f("Weight", weight.weight);
+	targets.GetDeltaBuffer().Bind();
+	rhi::BindStorageBuffer(VertexBindingPoint, outputBuffer);
+	rhi::DispatchCompute((target.deltaCount + ApplyGroupSize - 1) / ApplyGroupSize);
+}
+//=============================================================================
+void ClearMorphTargetResources()
+{
+	applyProgram.reset();
+	applyProgramFailed = false;
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,128 @@
+﻿#pragma once
+
+#include "Render.h"
+
+struct MeshVertex;
+
+// Смещение одной вершины цели морфинга; в буфере хранения - std430 { vec3 position; uint vertex; vec3 normal; float; }
+struct MorphDelta final
+{
+	glm::vec3 position;
+	uint32_t  vertex;
+	glm::vec3 normal;
+	float     padding{ 0.0f };
+};
+
+// Активная цель меша в кадре
+struct MorphWeight final
+{
+	uint32_t target; // MorphTargets::GetTarget
+	float    weight;
+};
+
+// Цели морфинга меша (blend shapes): хранятся только измененные вершины дельтами к вершинам меша.
+// Вершины меша хранятся копией для вычисления на CPU, дельты - еще и в буфере хранения для вычислительного шейдера
+class MorphTargets final
+{
+public:
+	struct Target final
+	{
+		uint32_t  modelTarget; // Model::GetMorphTargetName, по нему узел задает вес
+		uint32_t  firstDelta;
+		uint32_t  deltaCount;
+		glm::vec3 boundsMin;   // вершины цели с весом 1
+		glm::vec3 boundsMax;
+	};
+
+	// Нужен контекст GL
+	MorphTargets(const std::vector<MeshVertex>& vertices, std::vector<Target> targets, std::vector<MorphDelta> deltas);
+
+	// Дельты цели из ее полных позиций и нормалей (normals может быть nullptr); смещения меньше epsilon отбрасываются.
+	// Возвращает цель без modelTarget
+	static Target AppendTarget(const std::vector<MeshVertex>& vertices, const glm::vec3* positions, const glm::vec3* normals, float epsilon,
+		std::vector<MorphDelta>& deltas);
+
+	uint32_t GetTargetCount() const { return (uint32_t)m_targets.size(); }
+	const Target& GetTarget(uint32_t target) const { return m_targets[target]; }
+	uint32_t GetVertexCount() const { return (uint32_t)m_vertices.size(); }
+	const MeshVertex* GetVertices() const { return m_vertices.data(); }
+	const MorphDelta* GetDeltas() const { return m_deltas.data(); }
+	const StorageBuffer& GetDeltaBuffer() const { return *m_deltaBuffer; }
+	size_t GetMemorySize() const;
+
+private:
+	std::vector<MeshVertex>        m_vertices;
+	std::vector<Target>            m_targets;
+	std::vector<MorphDelta>        m_deltas;
+	std::shared_ptr<StorageBuffer> m_deltaBuffer;
+};
+
+// Веса целей модели по кадрам на равномерной сетке, как у AnimationClip
+class MorphClip final
+{
+public:
+	MorphClip(std::string name, uint32_t targetCount, uint32_t frameCount, float frameRate);
+
+	const std::string& GetName() const { return m_name; }
+	float GetDuration() const { return float(m_frameCount - 1) / m_frameRate; }
+	uint32_t GetFrameCount() const { return m_frameCount; }
+	uint32_t GetTargetCount() const { return m_targetCount; }
+
+	float* GetFrame(uint32_t frame) { return m_weights.data() + size_t(frame) * m_targetCount; }
+	const float* GetFrame(uint32_t frame) const { return m_weights.data() + size_t(frame) * m_targetCount; }
+
+	// Веса двух соседних кадров линейно, прибавляются к weights
+	void Sample(float time, bool loop, float* weights) const;
+
+private:
+	std::string        m_name;
+	uint32_t           m_targetCount;
+	uint32_t           m_frameCount;
+	float              m_frameRate;
+	std::vector<float> m_weights;
+};
+
+// Веса целей морфинга узла: постоянные от игры плюс клип. Время идет тиками фиксированного шага, как у Animator
+class Morpher final
+{
+public:
+	// Вес ниже этого цель не применяется
+	static constexpr float MinWeight = 0.001f;
+
+	explicit Morpher(uint32_t targetCount);
+
+	void SetWeight(uint32_t target, float weight) { m_weights[target] = weight; }
+	float GetWeight(uint32_t target) const { return m_weights[target]; }
+	uint32_t GetTargetCount() const { return (uint32_t)m_weights.size(); }
+
+	// nullptr - только постоянные веса
+	void Play(std::shared_ptr<const MorphClip> clip, bool loop = true);
+	void SetTime(float time) { m_time = m_previousTime = time; }
+	void SetSpeed(float speed) { m_speed = speed; }
+
+	// Тик фиксированного шага
+	void Advance(float deltaTime);
+	// Веса всех целей модели между двумя последними тиками
+	void Evaluate(float alpha, float* weights) const;
+
+private:
+	std::vector<float>               m_weights;
+	std::shared_ptr<const MorphClip> m_clip;
+	float                            m_time{ 0.0f };
+	float                            m_previousTime{ 0.0f };
+	float                            m_speed{ 1.0f };
+	bool                             m_loop{ true };
+};
+
+namespace morph
+{
+	// output = вершины меша плюс взвешенные дельты активных целей, SSE. Стоимость - копия вершин и дельты активных целей
+	void ApplyTargets(const MorphTargets& targets, const MorphWeight* weights, uint32_t weightCount, MeshVertex* output);
+
+	// Вычислительный проход: weights[i] целей прибавляется к вершинам в outputBuffer с вершины firstVertex.
+	// Вершины меша туда уже скопированы. Одна цель - один запуск; разные цели пишут в одни вершины, поэтому
+	// между целями одного меша нужен барьер - вызывающий запускает i-е цели всех мешей, затем ставит барьер
+	void DispatchTarget(const MorphTargets& targets, const MorphWeight& weight, GLuint outputBuffer, uint32_t firstVertex);
+}
+
+void ClearMorphTargetResources();
\ No newline at end of file
@@ -0,0 +1,439 @@
+﻿#include "stdafx.h"
+#include "Profiler.h"
+#include "Log.h"
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#	include <x86intrin.h>
+#endif
+//=============================================================================
+namespace
+{
+	constexpr uint32_t MaxThreads = 64;
+
+	struct Event final
+	{
+		const char* name; // nullptr - конец области
+		uint64_t    time;
+		uint32_t    depth;
+	};
+
+	// Кольцо одного потока: пишет только поток-владелец, читает только сборщик на главном потоке
+	struct ThreadBuffer final
+	{
+		std::array<Event, profiler::EventsPerThread> events;
+		std::atomic<uint32_t> head{ 0 };
+		std::atomic<uint32_t> tail{ 0 };
+		std::atomic<uint32_t> dropped{ 0 };
+		std::atomic<const char*> name{ "Thread" };
+		uint32_t index{ 0 };
+		uint32_t depth{ 0 }; // глубина вложенности на стороне потока-владельца
+
+		// состояние сборщика: открытые области по глубине
+		std::vector<std::pair<const char*, uint64_t>> openScopes;
+	};
+
+	struct ScopeRecord final
+	{
+		const char* name;
+		uint64_t    start;
+		uint64_t    end;
+		uint16_t    depth;
+		uint16_t    thread;
+	};
+
+	struct FrameRecord final
+	{
+		uint64_t index{ 0 };
+		uint64_t start{ 0 };
+		uint64_t end{ 0 };
+		std::vector<ScopeRecord> scopes;
+	};
+
+	bool requestedEnabled{ true };
+	bool isInit{ false };
+
+	std::mutex                                 threadsMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> threads;
+	thread_local ThreadBuffer*                 localBuffer{ nullptr };
+
+	std::array<FrameRecord, profiler::HistoryFrames> history;
+	uint64_t frameIndex{ 0 };
+	uint64_t frameStart{ 0 };
+
+	// калибровка тиков таймера относительно steady_clock
+	uint64_t calibrationTicks{ 0 };
+	std::chrono::steady_clock::time_point calibrationTime;
+	double   ticksPerMicrosecond{ 1000.0 };
+
+	std::string              capturePath;
+	uint32_t                 captureFramesLeft{ 0 };
+	std::vector<FrameRecord> captureFrames;
+
+	int  viewFrameOffset{ 0 };
+	char capturePathBuffer[256] = "profile.json";
+	int  captureRange[2] = { 0, 0 };
+	int  captureNextFrames{ 60 };
+
+	inline uint64_t now()
+	{
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void updateCalibration()
+	{
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+		const double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - calibrationTime).count();
+		if (elapsedUs > 1000.0)
+			ticksPerMicrosecond = double(now() - calibrationTicks) / elapsedUs;
+#endif
+	}
+
+	ThreadBuffer* getThreadBuffer()
+	{
+		if (localBuffer) [[likely]] return localBuffer;
+
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		if (threads.size() >= MaxThreads) return nullptr;
+		auto buffer = std::make_unique<ThreadBuffer>();
+		buffer->index = (uint32_t)threads.size();
+		localBuffer = buffer.get();
+		threads.push_back(std::move(buffer));
+		return localBuffer;
+	}
+
+	inline void pushEvent(ThreadBuffer& buffer, const char* name, uint32_t depth)
+	{
+		const uint32_t head = buffer.head.load(std::memory_order_relaxed);
+		const uint32_t tail = buffer.tail.load(std::memory_order_acquire);
+		if (head - tail >= profiler::EventsPerThread) [[unlikely]]
+		{
+			buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		buffer.events[head % profiler::EventsPerThread] = { name, now(), depth };
+		buffer.head.store(head + 1, std::memory_order_release);
+	}
+
+	// Переводит события потока в законченные области кадра
+	void drainThread(ThreadBuffer& buffer, FrameRecord& frame)
+	{
+		const uint32_t head = buffer.head.load(std::memory_order_acquire);
+		uint32_t tail = buffer.tail.load(std::memory_order_relaxed);
+		for (; tail != head; tail++)
+		{
+			const Event& event = buffer.events[tail % profiler::EventsPerThread];
+			if (event.name)
+			{
+				buffer.openScopes.resize(event.depth);
+				buffer.openScopes.emplace_back(event.name, event.time);
+			}
+			else if (event.depth < buffer.openScopes.size())
+			{
+				// область, начало которой потерялось при переполнении, просто пропускается
+				const auto& open = buffer.openScopes[event.depth];
+				if (open.first)
+					frame.scopes.push_back({ open.first, open.second, event.time, (uint16_t)event.depth, (uint16_t)buffer.index });
+				buffer.openScopes.resize(event.depth);
+			}
+		}
+		buffer.tail.store(tail, std::memory_order_release);
+	}
+
+	const FrameRecord* findFrame(uint64_t index)
+	{
+		const FrameRecord& frame = history[index % profiler::HistoryFrames];
+		return (frame.index == index && frame.end != 0) ? &frame : nullptr;
+	}
+
+	void writeJsonString(FILE* file, const char* str)
+	{
+		fputc('"', file);
+		for (; *str; str++)
+		{
+			if (*str == '"' || *str == '\\') fputc('\\', file);
+			fputc(*str, file);
+		}
+		fputc('"', file);
+	}
+
+	bool writeChromeTrace(const std::string& path, const std::vector<const FrameRecord*>& frames)
+	{
+		if (frames.empty())
+		{
+			LOG_ERROR(Profiler, "Profiler capture is empty: {}", path);
+			return false;
+		}
+
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file)
+		{
+			LOG_ERROR(Profiler, "Failed to open profiler capture file: {}", path);
+			return false;
+		}
+
+		const uint64_t base = frames.front()->start;
+		auto toUs = [base](uint64_t ticks) { return double(ticks - base) / ticksPerMicrosecond; };
+
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+		bool first = true;
+		{
+			std::lock_guard<std::mutex> lock(threadsMutex);
+			for (const auto& thread : threads)
+			{
+				fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n", thread->index);
+				writeJsonString(file, thread->name.load());
+				fputs("}}", file);
+				first = false;
+			}
+		}
+		for (const FrameRecord* frame : frames)
+		{
+			fprintf(file, "%s{\"ph\":\"i\",\"s\":\"g\",\"name\":\"Frame %llu\",\"pid\":0,\"tid\":0,\"ts\":%.3f}",
+				first ? "" : ",\n", (unsigned long long)frame->index, toUs(frame->start));
+			first = false;
+			for (const ScopeRecord& scope : frame->scopes)
+			{
+				fputs(",\n{\"ph\":\"X\",\"pid\":0,\"name\":", file);
+				writeJsonString(file, scope.name);
+				fprintf(file, ",\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", scope.thread, toUs(scope.start), double(scope.end - scope.start) / ticksPerMicrosecond);
+			}
+		}
+		fputs("\n]}\n", file);
+		fclose(file);
+
+		LOG_INFO(Profiler, "Profiler capture saved: {}", path);
+		return true;
+	}
+
+	void drawFlameGraph(const FrameRecord& frame)
+	{
+		const float rowHeight = ImGui::GetTextLineHeightWithSpacing();
+		const double duration = double(frame.end - frame.start) / ticksPerMicrosecond;
+		if (duration <= 0.0) return;
+
+		// строки: для каждого потока столько уровней, какова его максимальная глубина
+		std::array<uint32_t, MaxThreads> threadDepth{};
+		std::array<bool, MaxThreads> threadUsed{};
+		for (const auto& scope : frame.scopes)
+		{
+			threadDepth[scope.thread] = std::max<uint32_t>(threadDepth[scope.thread], scope.depth + 1u);
+			threadUsed[scope.thread] = true;
+		}
+		std::array<uint32_t, MaxThreads> threadRow{};
+		uint32_t rows = 0;
+		for (uint32_t i = 0; i < MaxThreads; i++)
+		{
+			threadRow[i] = rows;
+			if (threadUsed[i]) rows += threadDepth[i];
+		}
+		if (rows == 0) return;
+
+		const ImVec2 origin = ImGui::GetCursorScreenPos();
+		const float width = std::max(ImGui::GetContentRegionAvail().x, 100.0f);
+		ImGui::InvisibleButton("CpuFlame", ImVec2(width, rowHeight * rows));
+
+		ImDrawList* drawList = ImGui::GetWindowDrawList();
+		const float scale = width / (float)duration;
+		for (const auto& scope : frame.scopes)
+		{
+			const float start = (float)(double(int64_t(scope.start - frame.start)) / ticksPerMicrosecond);
+			const float end = (float)(double(int64_t(scope.end - frame.start)) / ticksPerMicrosecond);
+			const float y = origin.y + (threadRow[scope.thread] + scope.depth) * rowHeight;
+			const ImVec2 min(origin.x + std::max(start, 0.0f) * scale, y);
+			const ImVec2 max(origin.x + std::max(std::min(end, (float)duration) * scale, std::max(start, 0.0f) * scale + 1.0f), y + rowHeight - 1.0f);
+			const float hue = (float)((reinterpret_cast<uintptr_t>(scope.name) >> 4) % 64) / 64.0f;
+			drawList->AddRectFilled(min, max, ImColor::HSV(hue, 0.5f, 0.7f));
+			drawList->PushClipRect(min, max, true);
+			drawList->AddText(ImVec2(min.x + 2.0f, min.y), IM_COL32_WHITE, scope.name);
+			drawList->PopClipRect();
+
+			if (ImGui::IsMouseHoveringRect(min, max))
+				ImGui::SetTooltip("%s: %.3f ms", scope.name, (end - start) * 0.001f);
+		}
+	}
+}
+//=============================================================================
+namespace profiler::detail
+{
+	std::atomic<bool> enabled{ false };
+}
+//=============================================================================
+void profiler::Init()
+{
+	calibrationTicks = now();
+	calibrationTime = std::chrono::steady_clock::now();
+	frameIndex = 0;
+	frameStart = calibrationTicks;
+	for (auto& frame : history) frame = FrameRecord{};
+	history[0].start = frameStart;
+
+	isInit = true;
+	detail::enabled.store(requestedEnabled, std::memory_order_relaxed);
+	SetThreadName("Main");
+}
+//=============================================================================
+void profiler::Close()
+{
+	detail::enabled.store(false, std::memory_order_relaxed);
+	isInit = false;
+	captureFrames.clear();
+	// кольца потоков не освобождаются: рабочие потоки могут еще держать на них указатели
+}
+//=============================================================================
+void profiler::SetEnabled(bool enabled)
+{
+	// применяется в начале следующего кадра
+	requestedEnabled = enabled;
+}
+//=============================================================================
+bool profiler::IsEnabled()
+{
+	return requestedEnabled;
+}
+//=============================================================================
+void profiler::SetThreadName(const char* name)
+{
+	if (ThreadBuffer* buffer = getThreadBuffer())
+		buffer->name.store(name);
+}
+//=============================================================================
+void profiler::BeginFrame()
+{
+	if (!isInit) return;
+
+	const uint64_t time = now();
+	updateCalibration();
+
+	// закрываем текущий кадр: в него попадают все области, закончившиеся за кадр
+	FrameRecord& frame = history[frameIndex % HistoryFrames];
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (auto& thread : threads) drainThread(*thread, frame);
+	}
+	frame.end = time;
+
+	if (captureFramesLeft > 0)
+	{
+		captureFrames.push_back(frame);
+		if (--captureFramesLeft == 0)
+		{
+			std::vector<const FrameRecord*> frames;
+			for (const auto& captured : captureFrames) frames.push_back(&captured);
+			writeChromeTrace(capturePath, frames);
+			captureFrames.clear();
+		}
+	}
+
+	frameIndex++;
+	frameStart = time;
+	FrameRecord& next = history[frameIndex % HistoryFrames];
+	next.index = frameIndex;
+	next.start = time;
+	next.end = 0;
+	next.scopes.clear();
+
+	detail::enabled.store(requestedEnabled, std::memory_order_relaxed);
+}
+//=============================================================================
+void profiler::BeginScope(const char* name)
+{
+	ThreadBuffer* buffer = getThreadBuffer();
+	if (!buffer) return;
+	pushEvent(*buffer, name, buffer->depth++);
+}
+//=============================================================================
+void profiler::EndScope()
+{
+	ThreadBuffer* buffer = getThreadBuffer();
+	if (!buffer || buffer->depth == 0) return;
+	pushEvent(*buffer, nullptr, --buffer->depth);
+}
+//=============================================================================
+uint64_t profiler::GetFrameIndex()
+{
+	return frameIndex;
+}
+//=============================================================================
+bool profiler::CaptureToFile(const std::string& path, uint64_t firstFrame, uint64_t lastFrame)
+{
+	std::vector<const FrameRecord*> frames;
+	for (uint64_t i = firstFrame; i <= lastFrame && i < frameIndex; i++)
+	{
+		if (const FrameRecord* frame = findFrame(i))
+			frames.push_back(frame);
+	}
+	return writeChromeTrace(path, frames);
+}
+//=============================================================================
+void profiler::RequestCapture(const std::string& path, uint32_t frameCount)
+{
+	capturePath = path;
+	captureFramesLeft = frameCount;
+	captureFrames.clear();
+	captureFrames.reserve(frameCount);
+}
+//=============================================================================
+void profiler::DrawImGui()
+{
+	ImGui::Begin("CPU profiler");
+
+	bool enabled = requestedEnabled;
+	if (ImGui::Checkbox("Enabled", &enabled)) SetEnabled(enabled);
+
+	uint32_t dropped = 0;
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (const auto& thread : threads) dropped += thread->dropped.load(std::memory_order_relaxed);
+	}
+	ImGui::SameLine();
+	ImGui::Text("Frame %llu, dropped events: %u", (unsigned long long)frameIndex, dropped);
+
+	// история длительностей кадров, самый новый справа
+	const uint32_t available = (uint32_t)std::min<uint64_t>(frameIndex, HistoryFrames - 1);
+	std::array<float, HistoryFrames> frameTimes{};
+	for (uint32_t i = 0; i < available; i++)
+	{
+		if (const FrameRecord* frame = findFrame(frameIndex - available + i))
+			frameTimes[i] = (float)(double(frame->end - frame->start) / ticksPerMicrosecond * 0.001);
+	}
+	ImGui::PlotHistogram("##FrameTimes", frameTimes.data(), (int)available, 0, "Frame time, ms", 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+
+	if (available > 0)
+	{
+		ImGui::SliderInt("Frames ago", &viewFrameOffset, 1, (int)available);
+		viewFrameOffset = std::clamp(viewFrameOffset, 1, (int)available);
+		if (const FrameRecord* frame = findFrame(frameIndex - (uint64_t)viewFrameOffset))
+		{
+			ImGui::Text("Frame %llu: %.3f ms, %zu scopes", (unsigned long long)frame->index,
+				double(frame->end - frame->start) / ticksPerMicrosecond * 0.001, frame->scopes.size());
+			drawFlameGraph(*frame);
+		}
+	}
+
+	ImGui::Separator();
+	ImGui::InputText("Trace file", capturePathBuffer, sizeof(capturePathBuffer));
+	if (captureRange[0] == 0 && captureRange[1] == 0 && available > 0)
+	{
+		captureRange[0] = (int)(frameIndex - available);
+		captureRange[1] = (int)(frameIndex - 1);
+	}
+	ImGui::InputInt2("Frame range", captureRange);
+	ImGui::SameLine();
+	if (ImGui::Button("Capture range"))
+		CaptureToFile(capturePathBuffer, (uint64_t)std::max(captureRange[0], 0), (uint64_t)std::max(captureRange[1], 0));
+
+	ImGui::InputInt("Next frames", &captureNextFrames);
+	ImGui::SameLine();
+	if (captureFramesLeft > 0)
+		ImGui::Text("Capturing, %u left", captureFramesLeft);
+	else if (ImGui::Button("Capture next"))
+		RequestCapture(capturePathBuffer, (uint32_t)std::max(captureNextFrames, 1));
+
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+// Иерархический профилировщик CPU. Каждый поток пишет события начала/конца области в свое
+// кольцо без блокировок, главный поток раз в кадр собирает их в историю последних кадров.
+namespace profiler
+{
+	constexpr uint32_t EventsPerThread = 1 << 16; // размер кольца событий одного потока
+	constexpr uint32_t HistoryFrames = 120;       // сколько последних кадров хранится для просмотра и захвата
+
+	void Init();
+	void Close();
+
+	void SetEnabled(bool enabled);
+	bool IsEnabled();
+
+	// Имя потока для просмотра и trace. name должен жить до конца программы (строковый литерал)
+	void SetThreadName(const char* name);
+
+	// Вызывается главным потоком на границе кадра: собирает события всех потоков в кадр истории
+	void BeginFrame();
+
+	// name должен жить дольше захвата (строковый литерал)
+	void BeginScope(const char* name);
+	void EndScope();
+
+	uint64_t GetFrameIndex();
+
+	// Записывает в файл Chrome trace JSON (chrome://tracing, Perfetto) кадров [firstFrame, lastFrame] из истории
+	bool CaptureToFile(const std::string& path, uint64_t firstFrame, uint64_t lastFrame);
+	// Запоминает следующие frameCount кадров и по готовности пишет их в файл
+	void RequestCapture(const std::string& path, uint32_t frameCount);
+
+	void DrawImGui();
+
+	namespace detail
+	{
+		// пишет главный поток в начале кадра, читают области всех потоков
+		extern std::atomic<bool> enabled;
+	}
+}
+
+class ProfileScope final
+{
+public:
+	explicit ProfileScope(const char* name)
+		: m_active(profiler::detail::enabled.load(std::memory_order_relaxed))
+	{
+		if (m_active) profiler::BeginScope(name);
+	}
+	~ProfileScope()
+	{
+		if (m_active) profiler::EndScope();
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	bool m_active;
+};
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__FUNCTION__)
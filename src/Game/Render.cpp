@@ -1,7 +1,8 @@
 ﻿#include "stdafx.h"
 #include "Render.h"
-#include "CoreApp.h"
+#include "Log.h"
 #include "Utility.h"
+#include "Profiler.h"
 //=============================================================================
 unsigned int ShaderDataTypeSize(ShaderDataType type)
 {
@@ -18,6 +19,7 @@ unsigned int ShaderDataTypeSize(ShaderDataType type)
 	case ShaderDataType::Int3:   return sizeof(int) * 3;
 	case ShaderDataType::Int4:   return sizeof(int) * 4;
 	case ShaderDataType::Bool:   return 1;
+	case ShaderDataType::UByte4: return sizeof(uint8_t) * 4;
 	}
 	return 0;
 }
@@ -37,10 +39,21 @@ unsigned int GetComponentCount(ShaderDataType type)
 	case ShaderDataType::Int3:   return 3;
 	case ShaderDataType::Int4:   return 4;
 	case ShaderDataType::Bool:   return 1;
+	case ShaderDataType::UByte4: return 4;
 	}
 	return 0;
 }
 //=============================================================================
+unsigned int GetLocationCount(ShaderDataType type)
+{
+	switch (type)
+	{
+	case ShaderDataType::Mat3: return 3;
+	case ShaderDataType::Mat4: return 4;
+	default:                   return 1;
+	}
+}
+//=============================================================================
 GLenum GetShaderDataType(ShaderDataType type)
 {
 	switch (type)
@@ -59,12 +72,29 @@ GLenum GetShaderDataType(ShaderDataType type)
 		return GL_INT;
 	case ShaderDataType::Bool:
 		return GL_BOOL;
+	case ShaderDataType::UByte4:
+		return GL_UNSIGNED_BYTE;
 	case ShaderDataType::None:
 	default:
 		return 0;
 	}
 }
 //=============================================================================
+bool IsIntegerShaderDataType(ShaderDataType type)
+{
+	switch (type)
+	{
+	case ShaderDataType::Int:
+	case ShaderDataType::Int2:
+	case ShaderDataType::Int3:
+	case ShaderDataType::Int4:
+	case ShaderDataType::UByte4:
+		return true;
+	default:
+		return false;
+	}
+}
+//=============================================================================
 VertexBuffer::VertexBuffer(unsigned int size, const void* data)
 {
 	glCreateBuffers(1, &m_id);
@@ -74,6 +104,7 @@ VertexBuffer::VertexBuffer(unsigned int size, const void* data)
 //=============================================================================
 VertexBuffer::~VertexBuffer()
 {
+	rhi::OnBufferDeleted(m_id);
 	glDeleteBuffers(1, &m_id);
 }
 //=============================================================================
@@ -92,6 +123,7 @@ IndexBuffer::IndexBuffer(uint32_t count, const unsigned int* data)
 //=============================================================================
 IndexBuffer::~IndexBuffer()
 {
+	rhi::OnBufferDeleted(m_id);
 	glDeleteBuffers(1, &m_id);
 }
 //=============================================================================
@@ -101,15 +133,17 @@ void IndexBuffer::SetData(const void* data, unsigned int size, unsigned int offs
 }
 //=============================================================================
 UniformBuffer::UniformBuffer(uint32_t bindingPoint, uint32_t size)
-	: m_size(size)
+	: m_bindingPoint(bindingPoint)
+	, m_size(size)
 {
 	glCreateBuffers(1, &m_id);
 	glNamedBufferStorage(m_id, size, nullptr, GL_DYNAMIC_STORAGE_BIT);
-	glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, m_id);
+	Bind();
 }
 //=============================================================================
 UniformBuffer::~UniformBuffer()
 {
+	rhi::OnBufferDeleted(m_id);
 	glDeleteBuffers(1, &m_id);
 }
 //=============================================================================
@@ -118,37 +152,99 @@ void UniformBuffer::SetData(const void* data, uint32_t size, uint32_t offset)
 	glNamedBufferSubData(m_id, offset, (size ? size : m_size), data);
 }
 //=============================================================================
+void UniformBuffer::Bind() const
+{
+	rhi::BindUniformBuffer(m_bindingPoint, m_id);
+}
+//=============================================================================
+void UniformBuffer::BindRange(uint32_t offset, uint32_t size) const
+{
+	rhi::BindUniformBufferRange(m_bindingPoint, m_id, offset, size);
+}
+//=============================================================================
+StorageBuffer::StorageBuffer(uint32_t bindingPoint, uint32_t size, const void* data)
+	: m_bindingPoint(bindingPoint)
+	, m_size(size)
+{
+	glCreateBuffers(1, &m_id);
+	glNamedBufferStorage(m_id, size, data, GL_DYNAMIC_STORAGE_BIT);
+}
+//=============================================================================
+StorageBuffer::~StorageBuffer()
+{
+	rhi::OnBufferDeleted(m_id);
+	glDeleteBuffers(1, &m_id);
+}
+//=============================================================================
+void StorageBuffer::SetData(const void* data, uint32_t size, uint32_t offset)
+{
+	glNamedBufferSubData(m_id, offset, size, data);
+}
+//=============================================================================
+void StorageBuffer::Bind() const
+{
+	rhi::BindStorageBuffer(m_bindingPoint, m_id);
+}
+//=============================================================================
 VertexArray::VertexArray(std::shared_ptr<VertexBuffer> vb, std::shared_ptr<IndexBuffer> ib, const VertexBufferLayout& layout)
 {
 	glCreateVertexArrays(1, &m_id);
-
-	glVertexArrayVertexBuffer(m_id, 0, vb->GetID(), 0, layout.GetStride());
 	glVertexArrayElementBuffer(m_id, ib->GetID());
 
-	const auto& elements = layout.GetElements();
-	unsigned int offset = 0;
-	for (unsigned int i = 0; i < elements.size(); i++)
+	const uint32_t binding = AddLayout(layout);
+	SetVertexBuffer(binding, vb->GetID());
+}
+//=============================================================================
+uint32_t VertexArray::AddLayout(const VertexBufferLayout& layout)
+{
+	const uint32_t binding = (uint32_t)m_bindings.size();
+	m_bindings.push_back({ 0, 0, (GLsizei)layout.GetStride() });
+
+	for (const auto& element : layout.GetElements())
 	{
-		const auto& element = elements[i];
-		glEnableVertexArrayAttrib(m_id, i);
-		glVertexArrayAttribFormat(m_id, i, GetComponentCount(element.type), GetShaderDataType(element.type), element.normalized, offset);
-		glVertexArrayAttribBinding(m_id, i, 0);
-		offset += element.size;
+		// матрица передается столбцами, каждый столбец - отдельный атрибут
+		const uint32_t locations = GetLocationCount(element.type);
+		const uint32_t components = GetComponentCount(element.type) / locations;
+		const uint32_t columnSize = element.size / locations;
+		for (uint32_t column = 0; column < locations; column++)
+		{
+			const GLuint location = m_attributeCount++;
+			const GLuint offset = element.offset + column * columnSize;
+			glEnableVertexArrayAttrib(m_id, location);
+			if (IsIntegerShaderDataType(element.type) && !element.normalized)
+				glVertexArrayAttribIFormat(m_id, location, components, GetShaderDataType(element.type), offset);
+			else
+				glVertexArrayAttribFormat(m_id, location, components, GetShaderDataType(element.type), element.normalized, offset);
+			glVertexArrayAttribBinding(m_id, location, binding);
+		}
 	}
+	glVertexArrayBindingDivisor(m_id, binding, layout.GetDivisor());
+	return binding;
+}
+//=============================================================================
+void VertexArray::SetVertexBuffer(uint32_t binding, GLuint bufferId, GLintptr offset)
+{
+	Binding& state = m_bindings[binding];
+	if (state.buffer == bufferId && state.offset == offset) return;
+	state.buffer = bufferId;
+	state.offset = offset;
+	glVertexArrayVertexBuffer(m_id, binding, bufferId, offset, state.stride);
 }
 //=============================================================================
 VertexArray::~VertexArray()
 {
+	rhi::OnVertexArrayDeleted(m_id);
 	glDeleteVertexArrays(1, &m_id);
 }
 //=============================================================================
-void VertexArray::Bind()
+void VertexArray::Bind() const
 {
-	glBindVertexArray(m_id);
+	rhi::BindVertexArray(m_id);
 }
 //=============================================================================
 Texture2D::~Texture2D()
 {
+	rhi::OnTextureDeleted(m_id);
 	glDeleteTextures(1, &m_id);
 }
 //=============================================================================
@@ -169,7 +265,8 @@ std::shared_ptr<Texture2D> Texture2D::LoadFromMemory(int width, int height, void
 //=============================================================================
 std::shared_ptr<Texture2D> Texture2D::LoadFromFile(const std::string& path, bool flipVertical)
 {
-	Print("Texture load: " + path);
+	PROFILE_FUNCTION();
+	LOG_VERBOSE(Render, "Texture load: {}", path);
 
 	std::string ext = GetFileExtension(path);
 	if (ext.contains("ktx"))
@@ -189,7 +286,7 @@ std::shared_ptr<Texture2D> Texture2D::LoadFromFile(const std::string& path, bool
 		if (result != KTX_SUCCESS)
 		{
 			ktxTexture_Destroy(kTexture);
-			Error("Failed to load texture: " + path + "\nError: " + ktxErrorString(result));
+			LOG_ERROR(Render, "Failed to load texture: {}\nError: {}", path, ktxErrorString(result));
 			return nullptr;
 		}
 
@@ -199,11 +296,13 @@ std::shared_ptr<Texture2D> Texture2D::LoadFromFile(const std::string& path, bool
 		if (result != KTX_SUCCESS)
 		{
 			ktxTexture_Destroy(kTexture);
-			Error("Failed to load texture: " + path + "\nError: " + ktxErrorString(result));
+			LOG_ERROR(Render, "Failed to load texture: {}\nError: {}", path, ktxErrorString(result));
 			return nullptr;
 		}
 		ktxTexture_Destroy(kTexture);
+		// ktxTexture_GLUpload оставляет текстуру привязанной к активному юниту
 		glBindTexture(GL_TEXTURE_2D, 0);
+		rhi::InvalidateState();
 		return std::make_shared<Texture2D>(texture);
 	}
 	else
@@ -213,7 +312,7 @@ std::shared_ptr<Texture2D> Texture2D::LoadFromFile(const std::string& path, bool
 		unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
 		if (!data)
 		{
-			Error("Failed to load texture: " + path);
+			LOG_ERROR(Render, "Failed to load texture: {}", path);
 			return nullptr;
 		}
 		auto resurce = LoadFromMemory(width, height, data);
@@ -226,58 +325,89 @@ std::shared_ptr<Texture2D> Texture2D::LoadFromFile(const std::string& path, bool
 //=============================================================================
 void Texture2D::Bind(unsigned int slot) const
 {
-	glBindTextureUnit(slot, m_id);
+	rhi::BindTextureUnit(slot, m_id);
 }
 //=============================================================================
 FrameBuffer::FrameBuffer(unsigned int width, unsigned int height)
+	: FrameBuffer(width, height, { GL_RGB8 })
+{
+}
+//=============================================================================
+FrameBuffer::FrameBuffer(unsigned int width, unsigned int height, std::initializer_list<GLenum> colorFormats, GLenum depthFormat)
+	: m_width(width)
+	, m_height(height)
+	, m_colorFormats(colorFormats)
+	, m_depthFormat(depthFormat)
 {
 	glCreateFramebuffers(1, &m_id);
-	glBindFramebuffer(GL_FRAMEBUFFER, m_id);
-
-	glCreateTextures(GL_TEXTURE_2D, 1, &m_colorAttachment);
-	glTextureStorage2D(m_colorAttachment, 1, GL_RGB8, width, height);
-	glNamedFramebufferTexture(m_id, GL_COLOR_ATTACHMENT0, m_colorAttachment, 0);
+	createAttachments();
+}
+//=============================================================================
+FrameBuffer::~FrameBuffer()
+{
+	rhi::OnFramebufferDeleted(m_id);
+	deleteAttachments();
+	glDeleteFramebuffers(1, &m_id);
+}
+//=============================================================================
+void FrameBuffer::createAttachments()
+{
+	std::vector<GLenum> drawBuffers;
+	m_colorAttachments.resize(m_colorFormats.size());
+	for (size_t i = 0; i < m_colorFormats.size(); i++)
+	{
+		glCreateTextures(GL_TEXTURE_2D, 1, &m_colorAttachments[i]);
+		glTextureStorage2D(m_colorAttachments[i], 1, m_colorFormats[i], m_width, m_height);
+		glNamedFramebufferTexture(m_id, GL_COLOR_ATTACHMENT0 + (GLenum)i, m_colorAttachments[i], 0);
+		drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + (GLenum)i);
+	}
+	glNamedFramebufferDrawBuffers(m_id, (GLsizei)drawBuffers.size(), drawBuffers.data());
 
 	glCreateTextures(GL_TEXTURE_2D, 1, &m_depthAttachment);
-	glTextureStorage2D(m_depthAttachment, 1, GL_DEPTH_COMPONENT32F, width, height);
+	glTextureStorage2D(m_depthAttachment, 1, m_depthFormat, m_width, m_height);
 	glNamedFramebufferTexture(m_id, GL_DEPTH_ATTACHMENT, m_depthAttachment, 0);
 
 	if (glCheckNamedFramebufferStatus(m_id, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 	{
-		Fatal("ERROR::FRAMEBUFFER:: Framebuffer is not complete!");
+		LOG_FATAL(Render, "Framebuffer is not complete!");
 	}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 //=============================================================================
-FrameBuffer::~FrameBuffer()
+void FrameBuffer::deleteAttachments()
 {
-	glDeleteFramebuffers(1, &m_id);
-	glDeleteTextures(1, &m_colorAttachment);
+	for (GLuint texture : m_colorAttachments)
+	{
+		rhi::OnTextureDeleted(texture);
+		glDeleteTextures(1, &texture);
+	}
+	m_colorAttachments.clear();
+	rhi::OnTextureDeleted(m_depthAttachment);
 	glDeleteTextures(1, &m_depthAttachment);
+	m_depthAttachment = 0;
 }
 //=============================================================================
 void FrameBuffer::Bind() const
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, m_id);
+	rhi::BindFramebuffer(m_id);
 }
 //=============================================================================
 void FrameBuffer::Resize(unsigned int width, unsigned int height)
 {
-	glTextureStorage2D(m_colorAttachment, 1, GL_RGB8, width, height);
-	glTextureStorage2D(m_depthAttachment, 1, GL_DEPTH_COMPONENT32F, width, height);
-
-	glNamedFramebufferTexture(m_id, GL_COLOR_ATTACHMENT0, m_colorAttachment, 0);
-	glNamedFramebufferTexture(m_id, GL_DEPTH_ATTACHMENT, m_depthAttachment, 0);
+	// хранилище текстур неизменяемое, вложения создаются заново
+	m_width = width;
+	m_height = height;
+	deleteAttachments();
+	createAttachments();
 }
 //=============================================================================
-void FrameBuffer::BindColorTexture(GLuint textureUnit) const
+void FrameBuffer::BindColorTexture(GLuint textureUnit, uint32_t index) const
 {
-	glBindTextureUnit(textureUnit, m_colorAttachment);
+	rhi::BindTextureUnit(textureUnit, m_colorAttachments[index]);
 }
 //=============================================================================
 void FrameBuffer::BindВepthTexture(GLuint textureUnit) const
 {
-	glBindTextureUnit(textureUnit, m_depthAttachment);
+	rhi::BindTextureUnit(textureUnit, m_depthAttachment);
 }
 //=============================================================================
 ShaderProgram::ShaderProgram(const std::string& vertexShaderSource, const std::string& fragmentShaderSource)
@@ -293,11 +423,27 @@ ShaderProgram::ShaderProgram(const std::string& vertexShaderSource, const std::s
 		glDeleteShader(vs);
 		return;
 	}
-
+	linkProgram({ vs, fs });
+}
+//=============================================================================
+ShaderProgram::ShaderProgram(const std::string& computeShaderSource)
+{
+	const GLuint cs = compileShader(GL_COMPUTE_SHADER, computeShaderSource);
+	if (cs == 0) [[unlikely]]
+	{
+		return;
+	}
+	linkProgram({ cs });
+}
+//=============================================================================
+void ShaderProgram::linkProgram(std::initializer_list<GLuint> shaders)
+{
 	const GLuint id = glCreateProgram();
-	glAttachShader(id, vs);
-	glAttachShader(id, fs);
+	for (GLuint shader : shaders)
+		glAttachShader(id, shader);
 	glLinkProgram(id);
+	for (GLuint shader : shaders)
+		glDeleteShader(shader);
 
 	GLint linkResult;
 	glGetProgramiv(id, GL_LINK_STATUS, &linkResult);
@@ -308,20 +454,18 @@ ShaderProgram::ShaderProgram(const std::string& vertexShaderSource, const std::s
 		std::string message;
 		message.resize(length);
 		glGetProgramInfoLog(id, length, nullptr, &message[0]);
-		Error("Failed to link shaders: " + message);
+		LOG_ERROR(Render, "Failed to link shaders: {}", message);
 		glDeleteProgram(id);
 		return;
 	}
 	//glValidateProgram(id);
 
-	glDeleteShader(vs);
-	glDeleteShader(fs);
-
 	m_id = id;
 }
 //=============================================================================
 ShaderProgram::~ShaderProgram()
 {
+	rhi::OnShaderProgramDeleted(m_id);
 	glDeleteProgram(m_id);
 }
 //=============================================================================
@@ -329,9 +473,10 @@ void ShaderProgram::Bind() const
 {
 	if (!IsValid()) [[unlikely]]
 	{
-		Warning("Shader Program not valid");
+		LOG_WARNING(Render, "Shader Program not valid");
 	}
-	glUseProgram(m_id);
+	if (rhi::BindShaderProgram(m_id))
+		applySubRoutines();
 }
 //=============================================================================
 void ShaderProgram::SetUniform1i(const std::string& name, int value)
@@ -339,6 +484,11 @@ void ShaderProgram::SetUniform1i(const std::string& name, int value)
 	glUniform1i(getUniformLocation(name), value);
 }
 //=============================================================================
+void ShaderProgram::SetUniform1f(const std::string& name, float value)
+{
+	glUniform1f(getUniformLocation(name), value);
+}
+//=============================================================================
 void ShaderProgram::SetUniform2f(const std::string& name, float v0, float v1)
 {
 	glUniform2f(getUniformLocation(name), v0, v1);
@@ -354,11 +504,27 @@ void ShaderProgram::SetUniform4f(const std::string& name, float v0, float v1, fl
 	glUniform4f(getUniformLocation(name), v0, v1, v2, v3);
 }
 //=============================================================================
+void ShaderProgram::SetUniformMat4(const std::string& name, const glm::mat4& value)
+{
+	glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(value));
+}
+//=============================================================================
 void ShaderProgram::FragmentSubRoutines(uint32_t subroutines)
 {
-	Bind();
-	GLuint subRoutines[] = { subroutines };
-	glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &subRoutines[0]);
+	if (m_hasFragmentSubRoutine && m_fragmentSubRoutine == subroutines)
+		return;
+
+	m_fragmentSubRoutine = subroutines;
+	m_hasFragmentSubRoutine = true;
+	// если программа не привязана, выбор применится при следующем Bind()
+	if (rhi::GetBoundShaderProgram() == m_id)
+		applySubRoutines();
+}
+//=============================================================================
+void ShaderProgram::applySubRoutines() const
+{
+	if (!m_hasFragmentSubRoutine) return;
+	glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &m_fragmentSubRoutine);
 }
 //=============================================================================
 GLuint ShaderProgram::compileShader(unsigned int type, const std::string& source)
@@ -392,7 +558,7 @@ GLuint ShaderProgram::compileShader(unsigned int type, const std::string& source
 		std::string message;
 		message.resize(length);
 		glGetShaderInfoLog(id, length, &length, &message[0]);
-		Error("Failed to compile " + shaderTypeStr + " shader!\n" + message);
+		LOG_ERROR(Render, "Failed to compile {} shader!\n{}", shaderTypeStr, message);
 		glDeleteShader(id);
 		return 0;
 	}
@@ -406,7 +572,7 @@ int ShaderProgram::getUniformLocation(const std::string& name)
 		return m_UniformLocationCache[name];
 
 	int location = glGetUniformLocation(m_id, name.c_str());
-	if (location == -1) Warning("uniform '" + name + "' doesn't exist!");
+	if (location == -1) LOG_WARNING(Render, "uniform '{}' doesn't exist!", name);
 
 	m_UniformLocationCache[name] = location;
 	return location;
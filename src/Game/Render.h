@@ -6,6 +6,63 @@ namespace rhi
 {
 	void Init();
 	void Close();
+
+	// Счетчики кадра. issued - вызовы смены состояния, ушедшие в GL, filtered - отброшенные как повторные
+	struct FrameStatistics final
+	{
+		uint32_t issuedCalls{ 0 };
+		uint32_t filteredCalls{ 0 };
+		uint32_t drawCalls{ 0 };
+		uint64_t triangles{ 0 };
+		uint32_t textureBinds{ 0 };
+		uint32_t instancedDrawCalls{ 0 }; // вызовы DrawElementsInstanced
+		uint32_t instances{ 0 };          // экземпляры в них: без инстансинга это были бы отдельные вызовы
+		uint32_t indirectDrawCalls{ 0 };  // вызовы DrawElementsIndirect, число экземпляров известно только GPU
+		uint32_t computeDispatches{ 0 };
+	};
+
+	void BeginFrame();
+	const FrameStatistics& GetFrameStatistics(); // статистика последнего завершенного кадра
+
+	// Вызовы отрисовки, учитываемые в статистике кадра
+	void DrawElements(GLenum mode, GLsizei count, GLenum type, const void* indices);
+	void DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instanceCount, GLuint baseInstance);
+	// Параметры вызова берутся из буфера, привязанного BindDrawIndirectBuffer
+	void DrawElementsIndirect(GLenum mode, GLenum type, GLintptr indirectOffset);
+	void DispatchCompute(GLuint groupsX, GLuint groupsY = 1, GLuint groupsZ = 1);
+
+	// Кеш состояния GL. Функции возвращают true, если вызов GL действительно был выполнен
+	bool BindShaderProgram(GLuint id);
+	bool BindVertexArray(GLuint id);
+	bool BindTextureUnit(GLuint unit, GLuint id);
+	bool BindUniformBuffer(GLuint bindingPoint, GLuint id);
+	bool BindUniformBufferRange(GLuint bindingPoint, GLuint id, GLintptr offset, GLsizeiptr size);
+	bool BindStorageBuffer(GLuint bindingPoint, GLuint id);
+	bool BindDrawIndirectBuffer(GLuint id);
+	bool BindFramebuffer(GLuint id); // 0 - кадровый буфер по умолчанию (см. SetDefaultFramebuffer)
+	// В режиме без окна кадровым буфером по умолчанию становится offscreen FrameBuffer
+	void SetDefaultFramebuffer(GLuint id);
+	GLuint GetDefaultFramebuffer();
+
+	void SetDepthTest(bool enable);
+	void SetDepthWrite(bool enable);
+	void SetCullFace(bool enable);
+	void SetCullMode(GLenum mode);
+	void SetBlend(bool enable);
+	void SetBlendFunc(GLenum sfactor, GLenum dfactor);
+
+	GLuint GetBoundShaderProgram();
+
+	// Вызываются при удалении объектов GL, чтобы кеш не ссылался на мертвые имена
+	void OnShaderProgramDeleted(GLuint id);
+	void OnVertexArrayDeleted(GLuint id);
+	void OnTextureDeleted(GLuint id);
+	void OnBufferDeleted(GLuint id);
+	void OnFramebufferDeleted(GLuint id);
+
+	// Сброс кеша после стороннего кода, меняющего состояние GL в обход rhi
+	void InvalidateShaderProgram();
+	void InvalidateState();
 }
 
 class VertexBufferLayout final
@@ -13,89 +70,21 @@ class VertexBufferLayout final
 public:
 	VertexBufferLayout() = default;
 
+	// Реализации для поддерживаемых типов - после класса
 	template<typename T>
-	void Push(const std::string& name) { static_assert(false); }
-
-	template<>
-	void Push<float>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Float, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::vec2>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Float2, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::vec3>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Float3, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::vec4>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Float4, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::mat3>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Mat3, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::mat4>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Mat4, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<int>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Int, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::ivec2>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Int2, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::ivec3>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Int3, name });
-		calculateOffsetsAndStride();
-	}
-
-	template<>
-	void Push<glm::ivec4>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Int4, name });
-		calculateOffsetsAndStride();
-	}
+	void Push(const std::string& name) = delete;
 
-	template<>
-	void Push<bool>(const std::string& name)
-	{
-		m_elements.push_back({ ShaderDataType::Bool, name });
-		calculateOffsetsAndStride();
-	}
+	// Целые компоненты, которые шейдер читает как float в [0, 1]
+	template<typename T>
+	void PushNormalized(const std::string& name) = delete;
 
 	const std::vector<VertexBufferElement>& GetElements() const { return m_elements; }
 	unsigned int GetStride() const { return m_stride; }
 
+	// 0 - атрибуты вершины, N - атрибуты экземпляра, меняются через каждые N экземпляров
+	void SetDivisor(uint32_t divisor) { m_divisor = divisor; }
+	uint32_t GetDivisor() const { return m_divisor; }
+
 private:
 	void calculateOffsetsAndStride()
 	{
@@ -111,6 +100,108 @@ private:
 
 	std::vector<VertexBufferElement> m_elements;
 	unsigned int m_stride = 0;
+	uint32_t     m_divisor = 0;
+};
+
+template<>
+inline void VertexBufferLayout::Push<float>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Float, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::vec2>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Float2, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::vec3>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Float3, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::vec4>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Float4, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::mat3>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Mat3, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::mat4>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Mat4, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<int>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Int, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::ivec2>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Int2, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::ivec3>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Int3, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::ivec4>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Int4, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<bool>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::Bool, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::Push<glm::u8vec4>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::UByte4, name });
+	calculateOffsetsAndStride();
+}
+
+template<>
+inline void VertexBufferLayout::PushNormalized<glm::u8vec4>(const std::string& name)
+{
+	m_elements.push_back({ ShaderDataType::UByte4, name, true });
+	calculateOffsetsAndStride();
+}
+
+// Раскладка команды glDrawElementsIndirect
+struct DrawElementsIndirectCommand final
+{
+	uint32_t count;
+	uint32_t instanceCount;
+	uint32_t firstIndex;
+	int32_t  baseVertex;
+	uint32_t baseInstance;
 };
 
 class VertexBuffer final
@@ -151,10 +242,34 @@ public:
 
 	void SetData(const void* data, uint32_t size = 0, uint32_t offset = 0);
 
+	void Bind() const;
+	void BindRange(uint32_t offset, uint32_t size) const;
+
 	GLuint GetID() const { return m_id; }
 
 private:
 	GLuint   m_id;
+	uint32_t m_bindingPoint;
+	uint32_t m_size;
+};
+
+// Буфер std430 для вычислительных шейдеров, также годится как буфер команд косвенной отрисовки
+class StorageBuffer final
+{
+public:
+	StorageBuffer(uint32_t bindingPoint, uint32_t size, const void* data = nullptr);
+	~StorageBuffer();
+
+	void SetData(const void* data, uint32_t size, uint32_t offset = 0);
+
+	void Bind() const;
+
+	GLuint GetID() const { return m_id; }
+	uint32_t GetSize() const { return m_size; }
+
+private:
+	GLuint   m_id;
+	uint32_t m_bindingPoint;
 	uint32_t m_size;
 };
 
@@ -164,12 +279,27 @@ public:
 	VertexArray(std::shared_ptr<VertexBuffer> vb, std::shared_ptr<IndexBuffer> ib, const VertexBufferLayout& layout);
 	~VertexArray();
 
-	void Bind();
+	// Описывает атрибуты следующей точки привязки буфера и возвращает ее номер.
+	// Атрибуты занимают следующие свободные location, матрица - по location на столбец
+	uint32_t AddLayout(const VertexBufferLayout& layout);
+	// Буфер для точки привязки. Повторная привязка того же буфера не доходит до GL
+	void SetVertexBuffer(uint32_t binding, GLuint bufferId, GLintptr offset = 0);
+
+	void Bind() const;
 
 	GLuint GetID() const { return m_id; }
 
 private:
-	GLuint m_id;
+	struct Binding final
+	{
+		GLuint   buffer{ 0 };
+		GLintptr offset{ 0 };
+		GLsizei  stride{ 0 };
+	};
+
+	GLuint               m_id;
+	uint32_t             m_attributeCount{ 0 };
+	std::vector<Binding> m_bindings;
 };
 
 class Texture2D final
@@ -195,34 +325,54 @@ class FrameBuffer final
 {
 public:
 	FrameBuffer(unsigned int width, unsigned int height);
+	// Несколько цветовых вложений: выход фрагментного шейдера с location i пишется во вложение i
+	FrameBuffer(unsigned int width, unsigned int height, std::initializer_list<GLenum> colorFormats, GLenum depthFormat = GL_DEPTH_COMPONENT32F);
 	~FrameBuffer();
 
 	void Bind() const;
 
 	void Resize(unsigned int width, unsigned int height);
 
-	void BindColorTexture(GLuint textureUnit) const;
+	GLuint GetID() const { return m_id; }
+	unsigned int GetWidth() const { return m_width; }
+	unsigned int GetHeight() const { return m_height; }
+	uint32_t GetColorAttachmentCount() const { return (uint32_t)m_colorAttachments.size(); }
+	GLuint GetColorTexture(uint32_t index = 0) const { return m_colorAttachments[index]; }
+	GLenum GetColorFormat(uint32_t index = 0) const { return m_colorFormats[index]; }
+
+	void BindColorTexture(GLuint textureUnit, uint32_t index = 0) const;
 	void BindВepthTexture(GLuint textureUnit) const;
 
 private:
-	GLuint m_id;
-	GLuint m_colorAttachment;
-	GLuint m_depthAttachment;
+	void createAttachments();
+	void deleteAttachments();
+
+	GLuint              m_id;
+	unsigned int        m_width;
+	unsigned int        m_height;
+	std::vector<GLenum> m_colorFormats;
+	std::vector<GLuint> m_colorAttachments;
+	GLenum              m_depthFormat;
+	GLuint              m_depthAttachment{ 0 };
 };
 
 class ShaderProgram final
 {
 public:
 	ShaderProgram(const std::string& vertexShaderSource, const std::string& fragmentShaderSource);
+	explicit ShaderProgram(const std::string& computeShaderSource);
 	~ShaderProgram();
 
 	void Bind() const;
 
 	void SetUniform1i(const std::string& name, int value);
+	void SetUniform1f(const std::string& name, float value);
 	void SetUniform2f(const std::string& name, float v0, float v1);
 	void SetUniform3f(const std::string& name, float v0, float v1, float v2);
 	void SetUniform4f(const std::string& name, float v0, float v1, float v2, float v3);
+	void SetUniformMat4(const std::string& name, const glm::mat4& value);
 
+	// glUseProgram сбрасывает subroutine uniform, поэтому выбор хранится в программе и применяется при каждой реальной смене программы
 	void FragmentSubRoutines(uint32_t subroutines);
 
 	GLuint GetID() const { return m_id; }
@@ -231,8 +381,13 @@ public:
 
 private:
 	GLuint compileShader(unsigned int type, const std::string& source);
+	// Шейдеры удаляются в любом случае, при ошибке m_id остается 0
+	void linkProgram(std::initializer_list<GLuint> shaders);
 	int getUniformLocation(const std::string& name);
+	void applySubRoutines() const;
 
 	GLuint m_id{ 0 };
 	std::unordered_map<std::string, int> m_UniformLocationCache;
+	GLuint m_fragmentSubRoutine{ 0 };
+	bool   m_hasFragmentSubRoutine{ false };
 };
\ No newline at end of file
@@ -17,12 +17,17 @@ enum class ShaderDataType : uint8_t
 	Int2,
 	Int3,
 	Int4,
-	Bool
+	Bool,
+	UByte4
 };
 
 unsigned int ShaderDataTypeSize(ShaderDataType type);
 unsigned int GetComponentCount(ShaderDataType type);
+// Сколько location занимает атрибут: матрица - по одному на столбец
+unsigned int GetLocationCount(ShaderDataType type);
 GLenum GetShaderDataType(ShaderDataType type);
+// Целый тип без нормализации читается в шейдере как int/uint, а не как float
+bool IsIntegerShaderDataType(ShaderDataType type);
 
 //=============================================================================
 // structs
@@ -1,11 +1,11 @@
 ﻿#include "stdafx.h"
 #include "Render.h"
-#include "CoreApp.h"
+#include "Log.h"
 //=============================================================================
 #if defined(_DEBUG)
 void APIENTRY DebugCallback(uint32_t uiSource, uint32_t uiType, uint32_t /*uiID*/, uint32_t uiSeverity, int32_t /*iLength*/, const char* cMessage, void* /*userParam*/) noexcept
 {
-	std::string severity;
+	const char* severity;
 	switch (uiSeverity)
 	{
 	case GL_DEBUG_SEVERITY_HIGH:   severity = "High"; break;
@@ -15,7 +15,7 @@ void APIENTRY DebugCallback(uint32_t uiSource, uint32_t uiType, uint32_t /*uiID*
 	default: severity = "Notification"; break;
 	}
 
-	std::string type;
+	const char* type;
 	switch (uiType)
 	{
 	case GL_DEBUG_TYPE_ERROR:               type = "Error"; break;
@@ -27,7 +27,7 @@ void APIENTRY DebugCallback(uint32_t uiSource, uint32_t uiType, uint32_t /*uiID*
 	default: type = "Other"; break;
 	}
 
-	std::string source;
+	const char* source;
 	switch (uiSource)
 	{
 	case GL_DEBUG_SOURCE_API:             source = "OpenGL"; break;
@@ -40,17 +40,92 @@ void APIENTRY DebugCallback(uint32_t uiSource, uint32_t uiType, uint32_t /*uiID*
 		source = "Other"; break;
 	}
 
-	const std::string message = "OpenGL Debug: Severity=" + severity + ", Type=" + type + ", Source=" + source + " - " + cMessage;
-
-	if (uiSeverity == GL_DEBUG_SEVERITY_HIGH)
-		Fatal(message);
-	else
-		Error(message);
+	// уровень сообщения GL определяет уровень журнала, уведомления видны только в Verbose
+	LogLevel level = LogLevel::Verbose;
+	switch (uiSeverity)
+	{
+	case GL_DEBUG_SEVERITY_HIGH:   level = LogLevel::Fatal; break;
+	case GL_DEBUG_SEVERITY_MEDIUM: level = LogLevel::Error; break;
+	case GL_DEBUG_SEVERITY_LOW:    level = LogLevel::Warning; break;
+	default: break;
+	}
+	if (logger::IsEnabled(level, LogCategory::Render))
+		logger::Write(level, LogCategory::Render, "OpenGL Debug: Severity={}, Type={}, Source={} - {}", severity, type, source, cMessage);
 }
 #endif
 //=============================================================================
+namespace
+{
+	constexpr GLuint   UnknownState = ~0u;
+	constexpr uint32_t MaxCachedTextureUnits = 32;
+	constexpr uint32_t MaxCachedUniformBuffers = 16;
+	constexpr uint32_t MaxCachedStorageBuffers = 16;
+
+	struct UniformBufferBinding final
+	{
+		GLuint     id{ UnknownState };
+		GLintptr   offset{ 0 };
+		GLsizeiptr size{ 0 };
+	};
+
+	// Теневая копия состояния GL. UnknownState означает, что значение неизвестно и следующий вызов пройдет в GL
+	struct StateCache final
+	{
+		GLuint program{ UnknownState };
+		GLuint vertexArray{ UnknownState };
+		GLuint framebuffer{ UnknownState };
+		std::array<GLuint, MaxCachedTextureUnits> textureUnits;
+		std::array<UniformBufferBinding, MaxCachedUniformBuffers> uniformBuffers;
+		std::array<GLuint, MaxCachedStorageBuffers> storageBuffers;
+		GLuint drawIndirectBuffer{ UnknownState };
+
+		int    depthTest{ -1 };
+		int    depthWrite{ -1 };
+		int    cullFace{ -1 };
+		GLenum cullMode{ UnknownState };
+		int    blend{ -1 };
+		GLenum blendSrc{ UnknownState };
+		GLenum blendDst{ UnknownState };
+
+		void Reset()
+		{
+			*this = StateCache{};
+			textureUnits.fill(UnknownState);
+			uniformBuffers.fill(UniformBufferBinding{});
+			storageBuffers.fill(UnknownState);
+		}
+	};
+
+	StateCache           stateCache;
+	GLuint               defaultFramebuffer{ 0 };
+	rhi::FrameStatistics frameStatistics;
+	rhi::FrameStatistics lastFrameStatistics;
+
+	inline bool filterCall(bool isRedundant)
+	{
+		if (isRedundant)
+		{
+			frameStatistics.filteredCalls++;
+			return true;
+		}
+		frameStatistics.issuedCalls++;
+		return false;
+	}
+
+	inline void setCapability(GLenum cap, int& cached, bool enable)
+	{
+		if (filterCall(cached == (int)enable)) return;
+		cached = enable;
+		if (enable) glEnable(cap);
+		else glDisable(cap);
+	}
+}
+//=============================================================================
 void rhi::Init()
 {
+	stateCache.Reset();
+	BindFramebuffer(0);
+
 #if defined(_DEBUG)
 	//Allow for synchronous callbacks.
 	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
@@ -66,17 +141,258 @@ void rhi::Init()
 	//glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, NULL, GL_FALSE); //Disable medium severity warnings
 #endif
 
-	glEnable(GL_DEPTH_TEST);
+	SetDepthTest(true);
+	SetDepthWrite(true);
 	glDisable(GL_STENCIL_TEST);
 
-	glCullFace(GL_BACK);
-	glEnable(GL_CULL_FACE);
+	SetCullMode(GL_BACK);
+	SetCullFace(true);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	SetBlend(true);
+	SetBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 //=============================================================================
 void rhi::Close()
 {
+	stateCache.Reset();
+}
+//=============================================================================
+void rhi::BeginFrame()
+{
+	lastFrameStatistics = frameStatistics;
+	frameStatistics = {};
+}
+//=============================================================================
+const rhi::FrameStatistics& rhi::GetFrameStatistics()
+{
+	return lastFrameStatistics;
+}
+//=============================================================================
+void rhi::DrawElements(GLenum mode, GLsizei count, GLenum type, const void* indices)
+{
+	frameStatistics.drawCalls++;
+	if (mode == GL_TRIANGLES) frameStatistics.triangles += count / 3;
+	glDrawElements(mode, count, type, indices);
+}
+//=============================================================================
+void rhi::DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instanceCount, GLuint baseInstance)
+{
+	frameStatistics.drawCalls++;
+	frameStatistics.instancedDrawCalls++;
+	frameStatistics.instances += instanceCount;
+	if (mode == GL_TRIANGLES) frameStatistics.triangles += uint64_t(count / 3) * instanceCount;
+	glDrawElementsInstancedBaseInstance(mode, count, type, indices, instanceCount, baseInstance);
+}
+//=============================================================================
+void rhi::DrawElementsIndirect(GLenum mode, GLenum type, GLintptr indirectOffset)
+{
+	frameStatistics.drawCalls++;
+	frameStatistics.indirectDrawCalls++;
+	glDrawElementsIndirect(mode, type, (const void*)indirectOffset);
+}
+//=============================================================================
+void rhi::DispatchCompute(GLuint groupsX, GLuint groupsY, GLuint groupsZ)
+{
+	frameStatistics.computeDispatches++;
+	glDispatchCompute(groupsX, groupsY, groupsZ);
+}
+//=============================================================================
+bool rhi::BindShaderProgram(GLuint id)
+{
+	if (filterCall(stateCache.program == id)) return false;
+	stateCache.program = id;
+	glUseProgram(id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindVertexArray(GLuint id)
+{
+	if (filterCall(stateCache.vertexArray == id)) return false;
+	stateCache.vertexArray = id;
+	glBindVertexArray(id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindTextureUnit(GLuint unit, GLuint id)
+{
+	if (unit >= MaxCachedTextureUnits) [[unlikely]]
+	{
+		filterCall(false);
+		frameStatistics.textureBinds++;
+		glBindTextureUnit(unit, id);
+		return true;
+	}
+
+	if (filterCall(stateCache.textureUnits[unit] == id)) return false;
+	stateCache.textureUnits[unit] = id;
+	frameStatistics.textureBinds++;
+	glBindTextureUnit(unit, id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindUniformBuffer(GLuint bindingPoint, GLuint id)
+{
+	if (bindingPoint >= MaxCachedUniformBuffers) [[unlikely]]
+	{
+		filterCall(false);
+		glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, id);
+		return true;
+	}
+
+	auto& binding = stateCache.uniformBuffers[bindingPoint];
+	if (filterCall(binding.id == id && binding.offset == 0 && binding.size == 0)) return false;
+	binding = { id, 0, 0 };
+	glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindUniformBufferRange(GLuint bindingPoint, GLuint id, GLintptr offset, GLsizeiptr size)
+{
+	if (bindingPoint >= MaxCachedUniformBuffers) [[unlikely]]
+	{
+		filterCall(false);
+		glBindBufferRange(GL_UNIFORM_BUFFER, bindingPoint, id, offset, size);
+		return true;
+	}
 
-}
\ No newline at end of file
+	auto& binding = stateCache.uniformBuffers[bindingPoint];
+	if (filterCall(binding.id == id && binding.offset == offset && binding.size == size)) return false;
+	binding = { id, offset, size };
+	glBindBufferRange(GL_UNIFORM_BUFFER, bindingPoint, id, offset, size);
+	return true;
+}
+//=============================================================================
+bool rhi::BindStorageBuffer(GLuint bindingPoint, GLuint id)
+{
+	if (bindingPoint >= MaxCachedStorageBuffers) [[unlikely]]
+	{
+		filterCall(false);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, id);
+		return true;
+	}
+
+	if (filterCall(stateCache.storageBuffers[bindingPoint] == id)) return false;
+	stateCache.storageBuffers[bindingPoint] = id;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindDrawIndirectBuffer(GLuint id)
+{
+	if (filterCall(stateCache.drawIndirectBuffer == id)) return false;
+	stateCache.drawIndirectBuffer = id;
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, id);
+	return true;
+}
+//=============================================================================
+bool rhi::BindFramebuffer(GLuint id)
+{
+	if (id == 0) id = defaultFramebuffer;
+	if (filterCall(stateCache.framebuffer == id)) return false;
+	stateCache.framebuffer = id;
+	glBindFramebuffer(GL_FRAMEBUFFER, id);
+	return true;
+}
+//=============================================================================
+void rhi::SetDefaultFramebuffer(GLuint id)
+{
+	defaultFramebuffer = id;
+	stateCache.framebuffer = UnknownState;
+	BindFramebuffer(0);
+}
+//=============================================================================
+GLuint rhi::GetDefaultFramebuffer()
+{
+	return defaultFramebuffer;
+}
+//=============================================================================
+void rhi::SetDepthTest(bool enable)
+{
+	setCapability(GL_DEPTH_TEST, stateCache.depthTest, enable);
+}
+//=============================================================================
+void rhi::SetDepthWrite(bool enable)
+{
+	if (filterCall(stateCache.depthWrite == (int)enable)) return;
+	stateCache.depthWrite = enable;
+	glDepthMask(enable ? GL_TRUE : GL_FALSE);
+}
+//=============================================================================
+void rhi::SetCullFace(bool enable)
+{
+	setCapability(GL_CULL_FACE, stateCache.cullFace, enable);
+}
+//=============================================================================
+void rhi::SetCullMode(GLenum mode)
+{
+	if (filterCall(stateCache.cullMode == mode)) return;
+	stateCache.cullMode = mode;
+	glCullFace(mode);
+}
+//=============================================================================
+void rhi::SetBlend(bool enable)
+{
+	setCapability(GL_BLEND, stateCache.blend, enable);
+}
+//=============================================================================
+void rhi::SetBlendFunc(GLenum sfactor, GLenum dfactor)
+{
+	if (filterCall(stateCache.blendSrc == sfactor && stateCache.blendDst == dfactor)) return;
+	stateCache.blendSrc = sfactor;
+	stateCache.blendDst = dfactor;
+	glBlendFunc(sfactor, dfactor);
+}
+//=============================================================================
+GLuint rhi::GetBoundShaderProgram()
+{
+	return stateCache.program;
+}
+//=============================================================================
+void rhi::OnShaderProgramDeleted(GLuint id)
+{
+	// удаленная программа остается активной до следующего glUseProgram - просто забываем о ней
+	if (stateCache.program == id) stateCache.program = UnknownState;
+}
+//=============================================================================
+void rhi::OnVertexArrayDeleted(GLuint id)
+{
+	if (stateCache.vertexArray == id) stateCache.vertexArray = 0;
+}
+//=============================================================================
+void rhi::OnTextureDeleted(GLuint id)
+{
+	for (auto& unit : stateCache.textureUnits)
+	{
+		if (unit == id) unit = 0;
+	}
+}
+//=============================================================================
+void rhi::OnBufferDeleted(GLuint id)
+{
+	for (auto& binding : stateCache.uniformBuffers)
+	{
+		if (binding.id == id) binding = UniformBufferBinding{};
+	}
+	for (auto& binding : stateCache.storageBuffers)
+	{
+		if (binding == id) binding = UnknownState;
+	}
+	if (stateCache.drawIndirectBuffer == id) stateCache.drawIndirectBuffer = UnknownState;
+}
+//=============================================================================
+void rhi::OnFramebufferDeleted(GLuint id)
+{
+	if (stateCache.framebuffer == id) stateCache.framebuffer = 0;
+	if (defaultFramebuffer == id) defaultFramebuffer = 0;
+}
+//=============================================================================
+void rhi::InvalidateShaderProgram()
+{
+	stateCache.program = UnknownState;
+}
+//=============================================================================
+void rhi::InvalidateState()
+{
+	stateCache.Reset();
+}
+//=============================================================================
\ No newline at end of file
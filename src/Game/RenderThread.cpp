@@ -0,0 +1,257 @@
+﻿#include "stdafx.h"
+#include "RenderThread.h"
+#include "Context.h"
+#include "GpuProfiler.h"
+#include "Profiler.h"
+#include "FrameAllocator.h"
+//=============================================================================
+namespace
+{
+	using namespace renderthread;
+
+	constexpr size_t MaxPendingResults = 256; // если игра не забирает результаты, старые отбрасываются
+
+	Context*       context{ nullptr };
+	RenderFunction renderFunction;
+	bool           isThreaded{ false };
+	bool           isInit{ false };
+	bool           isPacketOpen{ false };
+
+	std::array<FramePacket, PacketCount> packets;
+
+	std::mutex              mutex;
+	std::condition_variable condition;
+	uint64_t                submittedFrames{ 0 };
+	uint64_t                renderedFrames{ 0 };
+	bool                    isQuit{ false };
+	std::thread             thread;
+
+	std::vector<FrameResult> pendingResults;
+	FrameResult              lastResult;
+
+	// состояние потока, который рисует
+	uint64_t previousFrameIndex{ ~0ull };
+	uint64_t previousGpuFrame{ ~0ull };
+	double   previousRenderCpuTime{ 0.0 };
+	uint64_t lastResolvedGpuFrame{ ~0ull };
+
+	// Статистика rhi кадра становится итоговой только в следующем rhi::BeginFrame()
+	void publishPreviousResult()
+	{
+		if (previousFrameIndex == ~0ull) return;
+
+		FrameResult result;
+		result.frameIndex = previousFrameIndex;
+		result.statistics = rhi::GetFrameStatistics();
+		result.gpuFrameNumber = previousGpuFrame;
+		result.renderCpuTime = previousRenderCpuTime;
+		const uint64_t resolved = gpuprofiler::GetLastResolvedFrameNumber();
+		if (resolved != ~0ull && resolved != lastResolvedGpuFrame)
+		{
+			result.resolvedGpuFrame = resolved;
+			result.resolvedGpuTime = gpuprofiler::GetLastFrameTime();
+			lastResolvedGpuFrame = resolved;
+		}
+		previousFrameIndex = ~0ull;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pendingResults.size() >= MaxPendingResults)
+			pendingResults.erase(pendingResults.begin());
+		pendingResults.push_back(result);
+		lastResult = result;
+	}
+
+	void finishFrames()
+	{
+		rhi::BeginFrame();
+		publishPreviousResult();
+	}
+
+	void renderPacket(FramePacket& packet)
+	{
+		PROFILE_SCOPE("RenderFrame");
+		const auto start = std::chrono::steady_clock::now();
+		framemem::ResetThreadArena();
+
+		rhi::BeginFrame();
+		gpuprofiler::BeginFrame();
+		publishPreviousResult();
+		previousFrameIndex = packet.frameIndex;
+		previousGpuFrame = gpuprofiler::GetFrameNumber();
+
+		if (packet.resized)
+			glViewport(0, 0, packet.width, packet.height);
+
+		renderFunction(packet);
+
+		if (ImDrawData* drawData = packet.ui.Get())
+		{
+			PROFILE_SCOPE("ImGui");
+			GPU_PROFILE_SCOPE("ImGui");
+			ImGui_ImplOpenGL3_NewFrame();
+			ImGui_ImplOpenGL3_RenderDrawData(drawData);
+			// бэкенд восстанавливает программу через glUseProgram, а это сбрасывает subroutine uniform
+			rhi::InvalidateShaderProgram();
+		}
+
+		gpuprofiler::EndFrame();
+
+		if (!packet.screenshotPath.empty())
+			context->SaveScreenshot(packet.screenshotPath);
+
+		{
+			PROFILE_SCOPE("Present");
+			context->Present();
+		}
+		previousRenderCpuTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void renderThreadMain()
+	{
+		profiler::SetThreadName("Render");
+		context->MakeCurrent(true);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			condition.wait(lock, [] { return isQuit || renderedFrames < submittedFrames; });
+			if (renderedFrames == submittedFrames) break; // выход только после отрисовки очереди
+
+			FramePacket& packet = packets[renderedFrames % PacketCount];
+			lock.unlock();
+			renderPacket(packet);
+			lock.lock();
+			renderedFrames++;
+			condition.notify_all();
+		}
+		lock.unlock();
+
+		finishFrames();
+		context->MakeCurrent(false);
+	}
+
+	void startThread()
+	{
+		isQuit = false;
+		context->MakeCurrent(false);
+		thread = std::thread(renderThreadMain);
+	}
+
+	void stopThread()
+	{
+		if (!thread.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isQuit = true;
+		}
+		condition.notify_all();
+		thread.join();
+		context->MakeCurrent(true);
+	}
+}
+//=============================================================================
+void renderthread::Init(Context& renderContext, RenderFunction function, bool threaded)
+{
+	context = &renderContext;
+	renderFunction = std::move(function);
+	isThreaded = threaded;
+	submittedFrames = renderedFrames = 0;
+	previousFrameIndex = lastResolvedGpuFrame = ~0ull;
+	pendingResults.clear();
+	lastResult = {};
+	isPacketOpen = false;
+
+	if (isThreaded) startThread();
+	isInit = true;
+}
+//=============================================================================
+void renderthread::Close()
+{
+	if (!isInit) return;
+	if (isThreaded) stopThread();
+	else finishFrames();
+	renderFunction = nullptr;
+	context = nullptr;
+	isInit = false;
+}
+//=============================================================================
+bool renderthread::IsThreaded()
+{
+	return isThreaded;
+}
+//=============================================================================
+FramePacket& renderthread::BeginPacket()
+{
+	assert(isInit && !isPacketOpen);
+
+	const uint64_t frame = submittedFrames;
+	if (isThreaded)
+	{
+		PROFILE_SCOPE("WaitForRender");
+		std::unique_lock<std::mutex> lock(mutex);
+		// пакет освобождается, когда нарисован кадр, занимавший его PacketCount кадров назад
+		condition.wait(lock, [frame] { return renderedFrames + PacketCount > frame; });
+	}
+
+	FramePacket& packet = packets[frame % PacketCount];
+	packet.frameIndex = frame;
+	packet.resized = false;
+	// контейнеры отпускают память арены до ее сброса
+	ArenaVector<DrawBatch>(packet.arena).swap(packet.batches);
+	ArenaVector<MeshInstanceData>(packet.arena).swap(packet.instances);
+	ArenaVector<ImpostorBatch>(packet.arena).swap(packet.impostorBatches);
+	ArenaVector<SkinnedDrawBatch>(packet.arena).swap(packet.skinnedBatches);
+	ArenaVector<uint32_t>(packet.arena).swap(packet.skinInstances);
+	ArenaVector<SkinMatrix>(packet.arena).swap(packet.skinPalettes);
+	ArenaVector<MorphDraw>(packet.arena).swap(packet.morphDraws);
+	ArenaVector<MorphWeight>(packet.arena).swap(packet.morphWeights);
+	ArenaVector<MeshVertex>(packet.arena).swap(packet.morphVertices);
+	ArenaVector<FoliageCellDraw>(packet.arena).swap(packet.foliageCells);
+	ArenaVector<TerrainNodeInstance>(packet.arena).swap(packet.terrainNodes);
+	ArenaVector<TerrainPageCache::Upload>(packet.arena).swap(packet.terrainUploads);
+	ArenaVector<CrowdDraw>(packet.arena).swap(packet.crowdDraws);
+	packet.arena.Reset();
+	packet.drawItems = 0;
+	packet.morphVertexCount = 0;
+	packet.morphCompute = false;
+	packet.foliageCompute = false;
+	packet.terrainNodeGroups = {};
+	packet.ui.Clear();
+	packet.screenshotPath.clear();
+	isPacketOpen = true;
+	return packet;
+}
+//=============================================================================
+void renderthread::Submit()
+{
+	assert(isPacketOpen);
+	isPacketOpen = false;
+
+	if (!isThreaded)
+	{
+		renderPacket(packets[submittedFrames % PacketCount]);
+		submittedFrames++;
+		renderedFrames++;
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		submittedFrames++;
+	}
+	condition.notify_all();
+}
+//=============================================================================
+void renderthread::PopFrameResults(std::vector<FrameResult>& results)
+{
+	results.clear();
+	std::lock_guard<std::mutex> lock(mutex);
+	results.swap(pendingResults);
+}
+//=============================================================================
+renderthread::FrameResult renderthread::GetLastFrameResult()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return lastResult;
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include "FramePacket.h"
+
+class Context;
+
+// Поток рендера владеет контекстом GL и рисует пакеты кадров, которые готовит поток игры.
+// Рендер отстает на один кадр: пока рисуется кадр N, игра собирает кадр N+1.
+// Ресурсы GL поток игры создает до Init() и удаляет после Close(), пока контекст принадлежит ему
+namespace renderthread
+{
+	constexpr uint32_t MaxQueuedFrames = 1;                  // на сколько кадров игра может опережать рендер
+	constexpr uint32_t PacketCount = MaxQueuedFrames + 1;    // пакет в записи + пакеты в очереди
+
+	// Итог отрисовки пакета, доступен потоку игры
+	struct FrameResult final
+	{
+		uint64_t             frameIndex{ ~0ull };
+		rhi::FrameStatistics statistics;
+		uint64_t             gpuFrameNumber{ ~0ull };    // номер этого кадра в gpuprofiler
+		uint64_t             resolvedGpuFrame{ ~0ull };  // кадр gpuprofiler, прочитанный за время этого кадра (~0 - нет)
+		double               resolvedGpuTime{ 0.0 };     // его время на GPU, мс
+		double               renderCpuTime{ 0.0 };       // время потока рендера на кадр, мс
+	};
+
+	using RenderFunction = std::function<void(const FramePacket& packet)>;
+
+	// threaded = false - пакет рисуется сразу в Submit() на вызывающем потоке
+	void Init(Context& context, RenderFunction renderFunction, bool threaded);
+	// Дорисовывает отправленные кадры и возвращает контекст GL вызывающему потоку
+	void Close();
+
+	bool IsThreaded();
+
+	// Пакет следующего кадра. Ждет, пока поток рендера освободит его
+	FramePacket& BeginPacket();
+	// Отправляет пакет из BeginPacket() в очередь
+	void Submit();
+
+	// Забирает результаты нарисованных с прошлого вызова кадров, по порядку
+	void PopFrameResults(std::vector<FrameResult>& results);
+	FrameResult GetLastFrameResult();
+}
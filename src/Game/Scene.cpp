@@ -1,5 +1,56 @@
 ﻿#include "stdafx.h"
 #include "Scene.h"
+#include "GpuProfiler.h"
+#include "JobSystem.h"
+#include "FramePacket.h"
+#include "Profiler.h"
+#include "FrameAllocator.h"
+#include "Impostor.h"
+#include "MorphTarget.h"
+#include "Log.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t MinInstanceCapacity = 1024;
+	constexpr uint32_t MinSkinPaletteCapacity = 16 * 1024;
+	constexpr uint32_t MinSkinInstanceCapacity = 1024;
+	constexpr uint32_t MinMorphVertexCapacity = 16 * 1024;
+
+	// Меш видимого узла до объединения одинаковых мешей в вызовы
+	struct DrawItem final
+	{
+		const Mesh* mesh;
+		glm::mat4   worldMatrix;
+		uint32_t    paletteOffset{ 0 }; // у меша со скиннингом - первая матрица палитры узла в FramePacket::skinPalettes
+	};
+
+	// Видимый узел с аниматором и место его палитры в пакете
+	struct AnimatedNode final
+	{
+		Animator* animator;
+		uint32_t  paletteOffset;
+		uint32_t  level;              // уровень детализации анимации
+		bool      evaluated{ false }; // поза считалась, а не смешалась из кэша аниматора
+		float     microseconds{ 0.0f };
+	};
+
+	// Меш с активными целями морфинга; веса уже в FramePacket::morphWeights
+	struct MorphItem final
+	{
+		const Mesh* mesh;
+		glm::mat4   worldMatrix;
+		uint32_t    paletteOffset; // MorphDraw::NoSkin - без скиннинга
+		uint32_t    firstWeight;
+		uint32_t    weightCount;
+	};
+
+	// Узел дальше дистанции переключения: весь узел рисуется одним импостором
+	struct ImpostorItem final
+	{
+		const Impostor* impostor;
+		glm::mat4       worldMatrix;
+	};
+}
 //=============================================================================
 Camera::Camera(glm::vec3 position, glm::vec3 up, float yaw, float pitch)
 	: m_position(position)
@@ -40,6 +91,13 @@ void Camera::ProcessMouseMovement(float xoffset, float yoffset)
 	updateCameraVectors();
 }
 //=============================================================================
+void Camera::SetOrientation(float yaw, float pitch)
+{
+	m_yaw = yaw;
+	m_pitch = std::clamp(pitch, -89.0f, 89.0f);
+	updateCameraVectors();
+}
+//=============================================================================
 void Camera::ProcessKeyboard(Direction direction, float deltaTime)
 {
 	float velocity = m_movementSpeed * deltaTime;
@@ -63,7 +121,6 @@ void Camera::updateCameraVectors()
 //=============================================================================
 void Scene::Init()
 {
-	m_uniformTransformBuffer = std::make_shared<UniformBuffer>(0, sizeof(TransformUniformData));
 	m_uniformCameraBuffer = std::make_shared<UniformBuffer>(1, sizeof(CameraUniformData));
 	m_uniformLightBuffer = std::make_shared<UniformBuffer>(2, sizeof(PointLightData) * MaxNumLight);
 	m_uniformMaterialBuffer = std::make_shared<UniformBuffer>(3, sizeof(MaterialData));
@@ -83,101 +140,510 @@ void Scene::Init()
 	m_uniformMaterialData.roughness = 0.35f;
 }
 //=============================================================================
-void Scene::AddNode(Node* node)
+ecs::Entity Scene::CreateNode(std::shared_ptr<Model> model, const Transform& transform)
 {
-	m_nodes.push_back(node);
+	const ecs::Entity entity = m_world.Create(Transform(transform), PreviousTransform{ transform }, WorldMatrix{ transform.GetModelMatrix() },
+		Renderable{ std::move(model) }, Visibility{});
+	m_nodes.push_back(entity);
+	return entity;
 }
 //=============================================================================
-void Scene::Render(const Camera& camera, float screenAspect)
+void Scene::Clear()
 {
-	assert(m_uniformTransformBuffer);
-	assert(m_uniformCameraBuffer);
-	assert(m_uniformLightBuffer);
-	assert(m_uniformMaterialBuffer);
+	m_world.Clear();
+	m_nodes.clear();
+	m_animationLodStatistics = {};
+}
+//=============================================================================
+void Scene::SavePreviousTransforms()
+{
+	m_world.ParallelForEach<const Transform, PreviousTransform>([](const Transform& transform, PreviousTransform& previous)
+	{
+		previous.transform = transform;
+	});
+}
+//=============================================================================
+void Scene::UpdateAnimations(float deltaTime)
+{
+	PROFILE_FUNCTION();
 
-	m_uniformLightBuffer->SetData(m_uniformLightData.data());
-	m_uniformMaterialBuffer->SetData(&m_uniformMaterialData);
+	// переходы графов и фазы клипов независимы по узлам
+	m_world.ParallelForEach<AnimatorComponent>([deltaTime](AnimatorComponent& component)
+	{
+		if (component.animator) component.animator->Advance(deltaTime);
+	});
+	m_world.ParallelForEach<MorpherComponent>([deltaTime](MorpherComponent& component)
+	{
+		if (component.morpher) component.morpher->Advance(deltaTime);
+	});
+}
+//=============================================================================
+void Scene::BuildFramePacket(const Camera& camera, float screenAspect, float alpha, FramePacket& packet)
+{
+	PROFILE_FUNCTION();
 
-	m_uniformCameraData.projection = camera.GetProjectionMatrix(screenAspect);
-	m_uniformCameraData.view = camera.GetViewMatrix();
-	m_uniformCameraData.cameraPosition = camera.GetPosition();
-	m_uniformCameraBuffer->SetData(&m_uniformCameraData);
+	packet.camera.projection = camera.GetProjectionMatrix(screenAspect);
+	packet.camera.view = camera.GetViewMatrix();
+	packet.camera.cameraPosition = camera.GetPosition();
+	packet.lights = m_uniformLightData;
+	packet.material = m_uniformMaterialData;
 
+	const glm::mat4 viewProjectionMatrix = packet.camera.projection * packet.camera.view;
 
-	glm::mat4 viewProjectionMatrix = m_uniformCameraData.projection * m_uniformCameraData.view;
+	updateTransforms(alpha);
+	cullNodes(viewProjectionMatrix);
+
+	// списки живут в аренах, рост по одному элементу оставил бы в них копии
+	size_t drawCount = 0;
+	m_world.ForEach<const Renderable, const Visibility>([&drawCount](const Renderable& renderable, const Visibility& visibility)
+	{
+		if (visibility.visible) drawCount += renderable.model->GetNumMesh();
+	});
 
-	for (auto node : m_nodes)
+	ArenaVector<DrawItem> items(framemem::GetThreadAllocator<DrawItem>());
+	ArenaVector<ImpostorItem> impostorItems(framemem::GetThreadAllocator<ImpostorItem>());
+	ArenaVector<DrawItem> skinnedItems(framemem::GetThreadAllocator<DrawItem>());
+	ArenaVector<AnimatedNode> animatedNodes(framemem::GetThreadAllocator<AnimatedNode>());
+	ArenaVector<MorphItem> morphItems(framemem::GetThreadAllocator<MorphItem>());
+	ArenaVector<float> nodeWeights(framemem::GetThreadAllocator<float>());
+	items.reserve(drawCount);
+	m_morphDeltaCount = 0;
+	uint32_t paletteSize = (uint32_t)packet.skinPalettes.size();
+	m_world.ForEachChunk<const Renderable, const WorldMatrix, const Visibility>([&](const ecs::ChunkView& chunk)
 	{
-		node->UpdateWorldMatrix();
-		if (isVisible(node, viewProjectionMatrix))
+		const Renderable* renderables = chunk.Get<const Renderable>();
+		const WorldMatrix* worldMatrices = chunk.Get<const WorldMatrix>();
+		const Visibility* visibilities = chunk.Get<const Visibility>();
+		const AnimatorComponent* animators = chunk.TryGet<const AnimatorComponent>();
+		const MorpherComponent* morphers = chunk.TryGet<const MorpherComponent>();
+		for (uint32_t row = 0; row < chunk.GetCount(); row++)
 		{
-			auto model = node->GetModel();
-			if (model)
+			if (!visibilities[row].visible) continue;
+
+			const auto& model = renderables[row].model;
+			const glm::mat4& worldMatrix = worldMatrices[row].matrix;
+			if (const Impostor* impostor = model->GetImpostor())
+			{
+				const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((model->GetBoundsMin() + model->GetBoundsMax()) * 0.5f, 1.0f));
+				const glm::vec3 toCamera = center - packet.camera.cameraPosition;
+				if (glm::dot(toCamera, toCamera) > impostor->GetSwitchDistance() * impostor->GetSwitchDistance())
+				{
+					impostorItems.push_back({ impostor, worldMatrix });
+					continue;
+				}
+			}
+			// палитра одна на узел, ее делят все меши модели со скиннингом
+			Animator* animator = model->GetSkeleton() && animators ? animators[row].animator.get() : nullptr;
+			assert(!animator || animator->GetSkeleton().GetJointCount() == model->GetSkeleton()->GetJointCount());
+			if (animator)
+			{
+				const uint32_t level = m_animationLodEnabled ? getAnimationLevel(*model, worldMatrix, packet.camera.cameraPosition, packet.camera.projection[1][1]) : 0;
+				animatedNodes.push_back({ animator, paletteSize, level });
+				paletteSize += animator->GetSkeleton().GetJointCount();
+			}
+			// веса всех целей модели, у мешей остаются только цели с заметным весом
+			const Morpher* morpher = model->GetMorphTargetCount() > 0 && morphers ? morphers[row].morpher.get() : nullptr;
+			assert(!morpher || morpher->GetTargetCount() == model->GetMorphTargetCount());
+			if (morpher)
+			{
+				nodeWeights.resize(morpher->GetTargetCount());
+				morpher->Evaluate(alpha, nodeWeights.data());
+			}
+			for (size_t i = 0; i < model->GetNumMesh(); i++)
 			{
-				for (size_t i = 0; i < model->GetNumMesh(); i++)
+				const Mesh& mesh = model->GetMesh(i);
+				if (const MorphTargets* targets = morpher ? mesh.GetMorphTargets() : nullptr)
 				{
-					m_uniformTransformData.model = node->GetWorldMatrix() * model->GetMesh(i).GetLocalTransform();
-					m_uniformTransformBuffer->SetData(&m_uniformTransformData);
-					model->DrawMesh(i);
+					const uint32_t firstWeight = (uint32_t)packet.morphWeights.size();
+					for (uint32_t target = 0; target < targets->GetTargetCount(); target++)
+					{
+						const MorphTargets::Target& meshTarget = targets->GetTarget(target);
+						const float weight = nodeWeights[meshTarget.modelTarget];
+						if (meshTarget.deltaCount == 0 || std::abs(weight) < Morpher::MinWeight) continue;
+						packet.morphWeights.push_back({ target, weight });
+						m_morphDeltaCount += meshTarget.deltaCount;
+					}
+					const uint32_t weightCount = (uint32_t)packet.morphWeights.size() - firstWeight;
+					if (weightCount > 0)
+					{
+						const bool skinned = animator && mesh.IsSkinned();
+						morphItems.push_back({ &mesh, skinned ? worldMatrix : worldMatrix * mesh.GetLocalTransform(),
+							skinned ? animatedNodes.back().paletteOffset : MorphDraw::NoSkin, firstWeight, weightCount });
+						continue;
+					}
 				}
+				if (animator && mesh.IsSkinned())
+					skinnedItems.push_back({ &mesh, worldMatrix, animatedNodes.back().paletteOffset });
+				else
+					items.push_back({ &mesh, worldMatrix * mesh.GetLocalTransform() });
 			}
 		}
+	});
+
+	// палитры узлов независимы и считаются параллельно прямо в пакет; аниматор у узла свой,
+	// поэтому кэш поз реже кадра трогает только одна задача. Невидимые узлы только двигают время в UpdateAnimations
+	m_animatedNodeCount = animatedNodes.size();
+	m_skinnedJointCount = paletteSize - (uint32_t)packet.skinPalettes.size();
+	packet.skinPalettes.resize(paletteSize);
+	jobs::ParallelFor((uint32_t)animatedNodes.size(), 4, [&](uint32_t begin, uint32_t end)
+	{
+		PROFILE_SCOPE("EvaluateAnimation");
+		using Clock = std::chrono::steady_clock;
+		for (uint32_t i = begin; i < end; i++)
+		{
+			AnimatedNode& animated = animatedNodes[i];
+			const AnimationLod lod = m_animationLodEnabled ? m_animationLodSettings.levels[animated.level] : AnimationLod{};
+			const Clock::time_point start = Clock::now();
+			animated.evaluated = animated.animator->Evaluate(alpha, lod, packet.frameIndex, packet.skinPalettes.data() + animated.paletteOffset);
+			animated.microseconds = std::chrono::duration<float, std::micro>(Clock::now() - start).count();
+		}
+	});
+
+	AnimationLodStatistics& lodStatistics = m_animationLodStatistics;
+	lodStatistics.characters = {};
+	lodStatistics.evaluations = {};
+	for (const AnimatedNode& animated : animatedNodes)
+	{
+		lodStatistics.characters[animated.level]++;
+		lodStatistics.evaluations[animated.level] += animated.evaluated ? 1 : 0;
+		lodStatistics.totalMicroseconds[animated.level] += animated.microseconds;
+	}
+	for (uint32_t level = 0; level < AnimationLodSettings::LevelCount; level++)
+		lodStatistics.totalCharacters[level] += lodStatistics.characters[level];
+
+	// одинаковые меши встают подряд и рисуются одним вызовом
+	if (m_instancingEnabled)
+		std::sort(items.begin(), items.end(), [](const DrawItem& a, const DrawItem& b) { return std::less<const Mesh*>()(a.mesh, b.mesh); });
+
+	packet.batches.reserve(packet.batches.size() + items.size());
+	packet.instances.reserve(packet.instances.size() + items.size());
+	packet.drawItems += (uint32_t)items.size();
+	for (const DrawItem& item : items)
+	{
+		if (m_instancingEnabled && !packet.batches.empty() && packet.batches.back().mesh == item.mesh)
+			packet.batches.back().instanceCount++;
+		else
+			packet.batches.push_back({ item.mesh, (uint32_t)packet.instances.size(), 1 });
+		packet.instances.push_back({ item.worldMatrix });
+	}
+
+	if (m_instancingEnabled)
+		std::sort(skinnedItems.begin(), skinnedItems.end(), [](const DrawItem& a, const DrawItem& b) { return std::less<const Mesh*>()(a.mesh, b.mesh); });
+	packet.skinnedBatches.reserve(packet.skinnedBatches.size() + skinnedItems.size());
+	packet.instances.reserve(packet.instances.size() + skinnedItems.size());
+	packet.skinInstances.reserve(packet.skinInstances.size() + skinnedItems.size());
+	packet.drawItems += (uint32_t)skinnedItems.size();
+	for (const DrawItem& item : skinnedItems)
+	{
+		if (m_instancingEnabled && !packet.skinnedBatches.empty() && packet.skinnedBatches.back().mesh == item.mesh)
+			packet.skinnedBatches.back().instanceCount++;
+		else
+			packet.skinnedBatches.push_back({ item.mesh, (uint32_t)packet.instances.size(), 1, (uint32_t)packet.skinInstances.size() });
+		packet.instances.push_back({ item.worldMatrix });
+		packet.skinInstances.push_back(item.paletteOffset);
+	}
+
+	// у каждого меша с морфингом своя копия вершин в буфере кадра, поэтому он рисуется отдельным вызовом.
+	// Стоимость растет с числом активных целей: неактивные цели и вершины без дельт не трогаются
+	packet.morphDraws.reserve(packet.morphDraws.size() + morphItems.size());
+	packet.drawItems += (uint32_t)morphItems.size();
+	for (const MorphItem& item : morphItems)
+	{
+		const uint32_t skinInstance = item.paletteOffset != MorphDraw::NoSkin ? (uint32_t)packet.skinInstances.size() : MorphDraw::NoSkin;
+		if (skinInstance != MorphDraw::NoSkin) packet.skinInstances.push_back(item.paletteOffset);
+		packet.morphDraws.push_back({ item.mesh, (uint32_t)packet.instances.size(), skinInstance, item.firstWeight, item.weightCount, packet.morphVertexCount });
+		packet.instances.push_back({ item.worldMatrix });
+		packet.morphVertexCount += item.mesh->GetMorphTargets()->GetVertexCount();
+	}
+	m_morphedMeshCount = (uint32_t)morphItems.size();
+	m_activeMorphTargetCount = 0;
+	for (const MorphItem& item : morphItems)
+		m_activeMorphTargetCount += item.weightCount;
+
+	// без вычислительных шейдеров цели применяются задачами здесь, поток рендера только загружает вершины
+	packet.morphCompute = m_morphComputeEnabled && GLAD_GL_VERSION_4_3;
+	if (!packet.morphCompute && !packet.morphDraws.empty())
+	{
+		packet.morphVertices.resize(packet.morphVertexCount);
+		jobs::ParallelFor((uint32_t)packet.morphDraws.size(), 4, [&](uint32_t begin, uint32_t end)
+		{
+			PROFILE_SCOPE("ApplyMorphTargets");
+			for (uint32_t i = begin; i < end; i++)
+			{
+				const MorphDraw& draw = packet.morphDraws[i];
+				morph::ApplyTargets(*draw.mesh->GetMorphTargets(), packet.morphWeights.data() + draw.firstWeight, draw.weightCount,
+					packet.morphVertices.data() + draw.firstVertex);
+			}
+		});
+	}
+
+	std::sort(impostorItems.begin(), impostorItems.end(), [](const ImpostorItem& a, const ImpostorItem& b) { return std::less<const Impostor*>()(a.impostor, b.impostor); });
+	packet.instances.reserve(packet.instances.size() + impostorItems.size());
+	packet.drawItems += (uint32_t)impostorItems.size();
+	for (const ImpostorItem& item : impostorItems)
+	{
+		if (!packet.impostorBatches.empty() && packet.impostorBatches.back().impostor == item.impostor)
+			packet.impostorBatches.back().instanceCount++;
+		else
+			packet.impostorBatches.push_back({ item.impostor, (uint32_t)packet.instances.size(), 1 });
+		packet.instances.push_back({ item.worldMatrix });
 	}
 }
 //=============================================================================
-bool Scene::isVisible(Node* node, const glm::mat4& viewProjectionMatrix) const
+void Scene::RenderPacket(const FramePacket& packet, ShaderProgram& program, ShaderProgram& skinnedProgram)
 {
-	if (!node->GetModel()) return false;
-	return isSphereVisible(node, viewProjectionMatrix) || isAABBVisible(node, viewProjectionMatrix);
+	PROFILE_FUNCTION();
+	GPU_PROFILE_SCOPE("Scene");
+
+	assert(m_uniformCameraBuffer);
+	assert(m_uniformLightBuffer);
+	assert(m_uniformMaterialBuffer);
+
+	m_uniformLightBuffer->SetData(packet.lights.data());
+	m_uniformMaterialBuffer->SetData(&packet.material);
+	m_uniformCameraBuffer->SetData(&packet.camera);
+
+	if (packet.instances.empty()) return;
+
+	const uint32_t instanceCount = (uint32_t)packet.instances.size();
+	if (instanceCount > m_instanceCapacity)
+	{
+		// старый буфер не удаляется: VAO мешей помнят его имя, а GL может выдать это имя новому буферу
+		if (m_instanceBuffer) m_retiredInstanceBuffers.push_back(std::move(m_instanceBuffer));
+		m_instanceCapacity = std::max({ instanceCount, m_instanceCapacity * 2, MinInstanceCapacity });
+		m_instanceBuffer = std::make_shared<VertexBuffer>(m_instanceCapacity * InstanceBufferRegions * (uint32_t)sizeof(MeshInstanceData));
+	}
+
+	// буфер разбит на области по кадрам, чтобы не писать в данные, которые GPU еще читает
+	const uint32_t baseInstance = m_instanceRegion * m_instanceCapacity;
+	m_instanceRegion = (m_instanceRegion + 1) % InstanceBufferRegions;
+	m_instanceBuffer->SetData(packet.instances.data(), instanceCount * (uint32_t)sizeof(MeshInstanceData), baseInstance * (uint32_t)sizeof(MeshInstanceData));
+
+	// вычислительный проход морфинга меняет программу, поэтому идет до отрисовки
+	if (!packet.morphDraws.empty())
+		updateMorphVertices(packet);
+
+	program.Bind();
+	for (const DrawBatch& batch : packet.batches)
+		batch.mesh->Draw(m_instanceBuffer->GetID(), baseInstance + batch.firstInstance, batch.instanceCount);
+	drawMorphed(packet, false, baseInstance, nullptr, 0);
+	if (!packet.skinInstances.empty())
+		renderSkinned(packet, skinnedProgram, baseInstance);
+	// импосторы сцены и растительности, отсеченной на CPU; программа импостора заменяет текущую
+	for (const ImpostorBatch& batch : packet.impostorBatches)
+		batch.impostor->Draw(m_instanceBuffer->GetID(), baseInstance + batch.firstInstance, batch.instanceCount);
 }
 //=============================================================================
-bool Scene::isSphereVisible(Node* node, const glm::mat4& viewProjectionMatrix) const
+void Scene::renderSkinned(const FramePacket& packet, ShaderProgram& skinnedProgram, uint32_t baseInstance)
 {
-	return true; // TODO: пока не работает isSphereVisible и isAABBVisible
+	GPU_PROFILE_SCOPE("Skinned");
 
-	// Предположим, что сфера охватывает всю модель
-	glm::vec3 center = node->GetTransform().GetPosition();
-	float radius = 1.0f; // Предположительный радиус модели
+	// буферы хранения не запоминаются в VAO, старые можно удалять сразу
+	const uint32_t paletteCount = (uint32_t)packet.skinPalettes.size();
+	if (paletteCount > m_skinPaletteCapacity)
+	{
+		m_skinPaletteCapacity = std::max({ paletteCount, m_skinPaletteCapacity * 2, MinSkinPaletteCapacity });
+		m_skinPaletteBuffer = std::make_shared<StorageBuffer>(SkinPaletteBindingPoint, m_skinPaletteCapacity * InstanceBufferRegions * (uint32_t)sizeof(SkinMatrix));
+	}
+	const uint32_t skinInstanceCount = (uint32_t)packet.skinInstances.size();
+	if (skinInstanceCount > m_skinInstanceCapacity)
+	{
+		m_skinInstanceCapacity = std::max({ skinInstanceCount, m_skinInstanceCapacity * 2, MinSkinInstanceCapacity });
+		m_skinInstanceBuffer = std::make_shared<StorageBuffer>(SkinInstanceBindingPoint, m_skinInstanceCapacity * InstanceBufferRegions * (uint32_t)sizeof(uint32_t));
+	}
+
+	// области по кадрам, как у буфера экземпляров; начала областей шейдер получает через uniform
+	const uint32_t paletteBase = m_skinRegion * m_skinPaletteCapacity;
+	const uint32_t skinInstanceBase = m_skinRegion * m_skinInstanceCapacity;
+	m_skinRegion = (m_skinRegion + 1) % InstanceBufferRegions;
+	m_skinPaletteBuffer->SetData(packet.skinPalettes.data(), paletteCount * (uint32_t)sizeof(SkinMatrix), paletteBase * (uint32_t)sizeof(SkinMatrix));
+	m_skinInstanceBuffer->SetData(packet.skinInstances.data(), skinInstanceCount * (uint32_t)sizeof(uint32_t), skinInstanceBase * (uint32_t)sizeof(uint32_t));
 
-	glm::vec4 sphereCenter = viewProjectionMatrix * glm::vec4(center, 1.0f);
-	if (std::abs(sphereCenter.x) > sphereCenter.w || std::abs(sphereCenter.y) > sphereCenter.w || std::abs(sphereCenter.z) > sphereCenter.w)
+	skinnedProgram.Bind();
+	skinnedProgram.SetUniform1i("PaletteBase", (int)paletteBase);
+	m_skinPaletteBuffer->Bind();
+	m_skinInstanceBuffer->Bind();
+	for (const SkinnedDrawBatch& batch : packet.skinnedBatches)
 	{
-		return false;
+		skinnedProgram.SetUniform1i("FirstSkinInstance", (int)(skinInstanceBase + batch.firstSkinInstance));
+		batch.mesh->Draw(m_instanceBuffer->GetID(), baseInstance + batch.firstInstance, batch.instanceCount);
 	}
-	return true;
+	drawMorphed(packet, true, baseInstance, &skinnedProgram, skinInstanceBase);
 }
 //=============================================================================
-bool Scene::isAABBVisible(Node* node, const glm::mat4& viewProjectionMatrix) const
+void Scene::updateMorphVertices(const FramePacket& packet)
 {
-	return true; // TODO: пока не работает isSphereVisible и isAABBVisible
+	GPU_PROFILE_SCOPE("Morph");
 
-	// Предположим, что AABB охватывает всю модель
-	glm::vec3 min = glm::vec3(-1.0f, -1.0f, -1.0f); // Минимальные координаты модели
-	glm::vec3 max = glm::vec3(1.0f, 1.0f, 1.0f);   // Максимальные координаты модели
+	const uint32_t vertexCount = packet.morphVertexCount;
+	if (vertexCount > m_morphVertexCapacity)
+	{
+		// как у буфера экземпляров: VAO мешей помнят имя буфера вершин
+		if (m_morphVertexBuffer) m_retiredMorphVertexBuffers.push_back(std::move(m_morphVertexBuffer));
+		m_morphVertexCapacity = std::max({ vertexCount, m_morphVertexCapacity * 2, MinMorphVertexCapacity });
+		m_morphVertexBuffer = std::make_shared<VertexBuffer>(m_morphVertexCapacity * InstanceBufferRegions * (uint32_t)sizeof(MeshVertex));
+	}
+	m_morphVertexBase = m_morphRegion * m_morphVertexCapacity;
+	m_morphRegion = (m_morphRegion + 1) % InstanceBufferRegions;
 
-	glm::mat4 worldMatrix = node->GetWorldMatrix();
-	glm::vec4 corners[] = 
+	if (!packet.morphCompute)
 	{
-		worldMatrix * glm::vec4(min.x, min.y, min.z, 1.0f),
-		worldMatrix * glm::vec4(max.x, min.y, min.z, 1.0f),
-		worldMatrix * glm::vec4(min.x, max.y, min.z, 1.0f),
-		worldMatrix * glm::vec4(max.x, max.y, min.z, 1.0f),
-		worldMatrix * glm::vec4(min.x, min.y, max.z, 1.0f),
-		worldMatrix * glm::vec4(max.x, min.y, max.z, 1.0f),
-		worldMatrix * glm::vec4(min.x, max.y, max.z, 1.0f),
-		worldMatrix * glm::vec4(max.x, max.y, max.z, 1.0f)
-	};
+		m_morphVertexBuffer->SetData(packet.morphVertices.data(), vertexCount * (uint32_t)sizeof(MeshVertex), m_morphVertexBase * (uint32_t)sizeof(MeshVertex));
+		return;
+	}
 
-	for (auto& corner : corners)
+	// вершины мешей копируются на GPU, затем i-е цели всех мешей прибавляются одним кругом запусков
+	uint32_t rounds = 0;
+	for (const MorphDraw& draw : packet.morphDraws)
+	{
+		const GLsizeiptr size = (GLsizeiptr)draw.mesh->GetMorphTargets()->GetVertexCount() * sizeof(MeshVertex);
+		glCopyNamedBufferSubData(draw.mesh->GetVertexBufferID(), m_morphVertexBuffer->GetID(), 0,
+			(GLintptr)(m_morphVertexBase + draw.firstVertex) * sizeof(MeshVertex), size);
+		rounds = std::max(rounds, draw.weightCount);
+	}
+	for (uint32_t round = 0; round < rounds; round++)
 	{
-		glm::vec4 transformedCorner = viewProjectionMatrix * corner;
-		if (transformedCorner.x >= -transformedCorner.w && transformedCorner.x <= transformedCorner.w &&
-			transformedCorner.y >= -transformedCorner.w && transformedCorner.y <= transformedCorner.w &&
-			transformedCorner.z >= -transformedCorner.w && transformedCorner.z <= transformedCorner.w)
+		for (const MorphDraw& draw : packet.morphDraws)
 		{
-			return true;
+			if (round < draw.weightCount)
+				morph::DispatchTarget(*draw.mesh->GetMorphTargets(), packet.morphWeights[draw.firstWeight + round], m_morphVertexBuffer->GetID(),
+					m_morphVertexBase + draw.firstVertex);
 		}
+		glMemoryBarrier(round + 1 < rounds ? GL_SHADER_STORAGE_BARRIER_BIT : GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	}
+}
+//=============================================================================
+void Scene::drawMorphed(const FramePacket& packet, bool skinned, uint32_t baseInstance, ShaderProgram* skinnedProgram, uint32_t skinInstanceBase)
+{
+	for (const MorphDraw& draw : packet.morphDraws)
+	{
+		if ((draw.skinInstance != MorphDraw::NoSkin) != skinned) continue;
+		if (skinned) skinnedProgram->SetUniform1i("FirstSkinInstance", (int)(skinInstanceBase + draw.skinInstance));
+		draw.mesh->Draw(m_instanceBuffer->GetID(), baseInstance + draw.instance, 1, m_morphVertexBuffer->GetID(),
+			(GLintptr)(m_morphVertexBase + draw.firstVertex) * sizeof(MeshVertex));
 	}
-	return false;
+}
+//=============================================================================
+void Scene::updateTransforms(float alpha)
+{
+	PROFILE_FUNCTION();
+
+	m_world.ParallelForEachChunk<const Transform, const PreviousTransform, WorldMatrix>([alpha](const ecs::ChunkView& chunk)
+	{
+		PROFILE_SCOPE("UpdateWorldMatrix");
+		const Transform* transforms = chunk.Get<const Transform>();
+		const PreviousTransform* previous = chunk.Get<const PreviousTransform>();
+		WorldMatrix* worldMatrices = chunk.Get<WorldMatrix>();
+		for (uint32_t i = 0; i < chunk.GetCount(); i++)
+			worldMatrices[i].matrix = Transform::Interpolate(previous[i].transform, transforms[i], alpha).GetModelMatrix();
+	});
+}
+//=============================================================================
+void Scene::cullNodes(const glm::mat4& viewProjectionMatrix)
+{
+	PROFILE_FUNCTION();
+
+	const Frustum frustum = Frustum::FromMatrix(viewProjectionMatrix);
+	std::atomic<uint32_t> visibleCount{ 0 };
+	m_world.ParallelForEachChunk<const Renderable, const WorldMatrix, Visibility>([&](const ecs::ChunkView& chunk)
+	{
+		PROFILE_SCOPE("Cull");
+		const Renderable* renderables = chunk.Get<const Renderable>();
+		const WorldMatrix* worldMatrices = chunk.Get<const WorldMatrix>();
+		Visibility* visibilities = chunk.Get<Visibility>();
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < chunk.GetCount(); i++)
+		{
+			const bool visible = isVisible(renderables[i].model.get(), worldMatrices[i].matrix, frustum);
+			visibilities[i].visible = visible;
+			count += visible;
+		}
+		visibleCount.fetch_add(count, std::memory_order_relaxed);
+	});
+	m_visibleNodeCount = visibleCount.load();
+}
+//=============================================================================
+bool Scene::isVisible(const Model* model, const glm::mat4& worldMatrix, const Frustum& frustum)
+{
+	if (!model || model->GetNumMesh() == 0) return false;
+
+	// AABB модели в мировых координатах: центр переносится матрицей, полуразмер - модулем ее поворота
+	const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((model->GetBoundsMin() + model->GetBoundsMax()) * 0.5f, 1.0f));
+	const glm::vec3 halfSize = (model->GetBoundsMax() - model->GetBoundsMin()) * 0.5f;
+	const glm::mat3 absRotation = glm::mat3(glm::abs(worldMatrix[0]), glm::abs(worldMatrix[1]), glm::abs(worldMatrix[2]));
+	const glm::vec3 extent = absRotation * halfSize;
+
+	// сфера отсекает дешевле, AABB - точнее
+	return frustum.IsSphereVisible(center, glm::length(extent)) && frustum.IsAABBVisible(center, extent);
+}
+//=============================================================================
+uint32_t Scene::getAnimationLevel(const Model& model, const glm::mat4& worldMatrix, const glm::vec3& cameraPosition, float focalScale) const
+{
+	const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((model.GetBoundsMin() + model.GetBoundsMax()) * 0.5f, 1.0f));
+	const float scale = std::max({ glm::length(glm::vec3(worldMatrix[0])), glm::length(glm::vec3(worldMatrix[1])), glm::length(glm::vec3(worldMatrix[2])) });
+	const float radius = glm::length(model.GetBoundsMax() - model.GetBoundsMin()) * 0.5f * scale;
+
+	// диаметр сферы в долях высоты экрана: 2r / (2d * tan(fov / 2)), а projection[1][1] = 1 / tan(fov / 2)
+	const float distance = glm::length(center - cameraPosition);
+	if (distance <= radius) return 0;
+	const float screenSize = radius * focalScale / distance;
+
+	uint32_t level = 0;
+	while (level < m_animationLodSettings.screenSizes.size() && screenSize < m_animationLodSettings.screenSizes[level])
+		level++;
+	return level;
+}
+//=============================================================================
+void Scene::LogAnimationLodStatistics() const
+{
+	for (uint32_t level = 0; level < AnimationLodSettings::LevelCount; level++)
+	{
+		const uint64_t characters = m_animationLodStatistics.totalCharacters[level];
+		if (characters == 0) continue;
+		const AnimationLod& lod = m_animationLodSettings.levels[level];
+		LOG_INFO(Scene, "Animation LOD {} (every {} frames, leaf depth {}, blending {}): {} character-frames, {:.2f} us per character",
+			level, lod.interval, lod.leafDepth, lod.blending ? "on" : "off", characters, m_animationLodStatistics.totalMicroseconds[level] / (double)characters);
+	}
+}
+//=============================================================================
+Frustum Frustum::FromMatrix(const glm::mat4& viewProjection)
+{
+	// Gribb-Hartmann: плоскости из строк матрицы, глубина клипа OpenGL [-w, w]
+	const glm::vec4 row0 = glm::row(viewProjection, 0);
+	const glm::vec4 row1 = glm::row(viewProjection, 1);
+	const glm::vec4 row2 = glm::row(viewProjection, 2);
+	const glm::vec4 row3 = glm::row(viewProjection, 3);
+
+	Frustum frustum;
+	frustum.planes[0] = row3 + row0; // left
+	frustum.planes[1] = row3 - row0; // right
+	frustum.planes[2] = row3 + row1; // bottom
+	frustum.planes[3] = row3 - row1; // top
+	frustum.planes[4] = row3 + row2; // near
+	frustum.planes[5] = row3 - row2; // far
+	for (auto& plane : frustum.planes)
+		plane /= glm::length(glm::vec3(plane));
+	return frustum;
+}
+//=============================================================================
+bool Frustum::IsSphereVisible(const glm::vec3& center, float radius) const
+{
+	for (const auto& plane : planes)
+	{
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
+//=============================================================================
+bool Frustum::IsAABBVisible(const glm::vec3& center, const glm::vec3& extent) const
+{
+	for (const auto& plane : planes)
+	{
+		const float radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+			return false;
+	}
+	return true;
 }
 //=============================================================================
\ No newline at end of file
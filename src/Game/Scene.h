@@ -1,11 +1,10 @@
 ﻿#pragma once
 
 #include "Graphics.h"
+#include "Entity.h"
 
-struct TransformUniformData final
-{
-	glm::aligned_mat4 model;
-};
+struct FramePacket;
+class Morpher;
 
 struct CameraUniformData final
 {
@@ -67,49 +66,57 @@ public:
 		return model;
 	}
 
+	// Смешивание двух состояний симуляции для отрисовки между тиками
+	static Transform Interpolate(const Transform& from, const Transform& to, float alpha)
+	{
+		Transform result;
+		result.m_position = glm::mix(from.m_position, to.m_position, alpha);
+		result.m_rotation = glm::slerp(from.m_rotation, to.m_rotation, alpha);
+		result.m_scale = glm::mix(from.m_scale, to.m_scale, alpha);
+		return result;
+	}
+
 private:
 	glm::vec3 m_position = glm::vec3{ 0.0f };
 	glm::quat m_rotation = { 1.0f, 0.0f, 0.0f, 0.0f };
 	glm::vec3 m_scale = glm::vec3{ 1.0f };
 };
 
-class Node final
-{
-public:
-	Node() = default;
+// Компоненты узла сцены в ecs::World сцены
 
-	void SetModel(std::shared_ptr<Model> model) { m_model = model; }
-	std::shared_ptr<Model> GetModel() const { return m_model; }
+// Состояние на момент предыдущего тика фиксированного шага
+struct PreviousTransform final
+{
+	Transform transform;
+};
 
-	void AddChild(Node* child) { m_children.push_back(child); }
-	const std::vector<Node*>& GetChildren() const { return m_children; }
+// Интерполированная мировая матрица кадра
+struct WorldMatrix final
+{
+	glm::mat4 matrix{ 1.0f };
+};
 
-	// TODO: не учитывается трасформа от предка
-	Transform& GetTransform() { return m_transform; }
-	const Transform& GetTransform() const { return m_transform; }
+struct Renderable final
+{
+	std::shared_ptr<Model> model;
+};
 
-	glm::mat4 GetWorldMatrix() const
-	{
-		if (m_parent) return m_parent->GetWorldMatrix() * m_transform.GetModelMatrix();
-		else return m_transform.GetModelMatrix();
-	}
+// Результат отсечения кадра, своя колонка: отсечение пишет только ее
+struct Visibility final
+{
+	bool visible{ false };
+};
 
-	void UpdateWorldMatrix()
-	{
-		m_worldMatrix = GetWorldMatrix();
-		for (auto& child : m_children)
-		{
-			child->m_parent = this;
-			child->UpdateWorldMatrix();
-		}
-	}
+// Поза скелета модели; без аниматора меш со скиннингом рисуется в позе привязки
+struct AnimatorComponent final
+{
+	std::shared_ptr<Animator> animator;
+};
 
-private:
-	Transform              m_transform;
-	std::shared_ptr<Model> m_model;
-	mutable glm::mat4      m_worldMatrix;
-	Node*                  m_parent = nullptr;
-	std::vector<Node*>     m_children;
+// Веса целей морфинга модели; без него меши с целями рисуются без морфинга
+struct MorpherComponent final
+{
+	std::shared_ptr<Morpher> morpher;
 };
 
 enum class Direction : uint8_t
@@ -131,6 +138,11 @@ public:
 	glm::mat4 GetViewMatrix() const;
 	glm::mat4 GetProjectionMatrix(float aspect) const;
 	glm::vec3 GetPosition() const { return m_position; }
+	float GetYaw() const { return m_yaw; }
+	float GetPitch() const { return m_pitch; }
+
+	void SetPosition(const glm::vec3& position) { m_position = position; }
+	void SetOrientation(float yaw, float pitch);
 
 	void ProcessMouseMovement(float xoffset, float yoffset);
 	void ProcessKeyboard(Direction direction, float deltaTime);
@@ -150,6 +162,16 @@ private:
 	float m_zoom;
 };
 
+// Плоскости пирамиды видимости: dot(xyz, p) + w >= 0 внутри
+struct Frustum final
+{
+	std::array<glm::vec4, 6> planes;
+
+	static Frustum FromMatrix(const glm::mat4& viewProjection);
+	bool IsSphereVisible(const glm::vec3& center, float radius) const;
+	bool IsAABBVisible(const glm::vec3& center, const glm::vec3& extent) const;
+};
+
 constexpr const size_t MaxNumLight = 16;
 
 class Scene final 
@@ -158,19 +180,108 @@ public:
 	void Init();
 
 	void AddCamera(const Camera& camera);
-	void AddNode(Node* node);
-	void Render(const Camera& camera, float screenAspect);
+	// Узел - сущность с Transform, PreviousTransform, WorldMatrix, Renderable и Visibility; аниматор и морфинг
+	// добавляются в мир компонентами AnimatorComponent и MorpherComponent
+	ecs::Entity CreateNode(std::shared_ptr<Model> model, const Transform& transform);
+	void Clear();
+	void SavePreviousTransforms();
+	// Тик фиксированного шага для аниматоров и весов морфинга узлов, параллельно задачами
+	void UpdateAnimations(float deltaTime);
+
+	// Поток игры: трансформы, отсечение и список отрисовки кадра.
+	// alpha - коэффициент интерполяции фиксированного шага (1 - текущее состояние)
+	void BuildFramePacket(const Camera& camera, float screenAspect, float alpha, FramePacket& packet);
+	// Поток рендера: загрузка uniform-буферов и отрисовка списка из пакета.
+	// program рисует обычные меши, skinnedProgram - меши со скиннингом, палитры суставов читает из буферов хранения
+	void RenderPacket(const FramePacket& packet, ShaderProgram& program, ShaderProgram& skinnedProgram);
+
+	size_t GetNodeCount() const { return m_nodes.size(); }
+	// Узлы в порядке создания
+	ecs::Entity GetNode(size_t index) const { return m_nodes[index]; }
+	ecs::World& GetWorld() { return m_world; }
+	const ecs::World& GetWorld() const { return m_world; }
+	size_t GetVisibleNodeCount() const { return m_visibleNodeCount; }
+	size_t GetAnimatedNodeCount() const { return m_animatedNodeCount; }
+	uint32_t GetSkinnedJointCount() const { return m_skinnedJointCount; }
+
+	// Вычисления поз видимых персонажей по уровням детализации анимации
+	struct AnimationLodStatistics final
+	{
+		std::array<uint32_t, AnimationLodSettings::LevelCount> characters{};       // в последнем кадре
+		std::array<uint32_t, AnimationLodSettings::LevelCount> evaluations{};      // из них с вычислением позы
+		std::array<uint64_t, AnimationLodSettings::LevelCount> totalCharacters{};  // с Clear(), персонажей на кадры
+		std::array<double, AnimationLodSettings::LevelCount>   totalMicroseconds{};
+	};
+
+	// Уровень детализации персонажа - по размеру описанной сферы модели на экране; выключено - все на полном
+	void SetAnimationLodEnabled(bool enabled) { m_animationLodEnabled = enabled; }
+	bool IsAnimationLodEnabled() const { return m_animationLodEnabled; }
+	void SetAnimationLodSettings(const AnimationLodSettings& settings) { m_animationLodSettings = settings; }
+	const AnimationLodStatistics& GetAnimationLodStatistics() const { return m_animationLodStatistics; }
+	// Средняя стоимость вычисления персонажа по уровням в лог
+	void LogAnimationLodStatistics() const;
+
+	// Видимые экземпляры одного меша рисуются одним вызовом
+	void SetInstancingEnabled(bool enabled) { m_instancingEnabled = enabled; }
+	bool IsInstancingEnabled() const { return m_instancingEnabled; }
+
+	// Цели морфинга применяются вычислительным шейдером, иначе задачами на CPU и загружаются готовыми вершинами
+	void SetMorphComputeEnabled(bool enabled) { m_morphComputeEnabled = enabled; }
+	bool IsMorphComputeEnabled() const { return m_morphComputeEnabled; }
+	// Последний кадр: видимые меши с активными целями, сами цели и их дельты
+	uint32_t GetMorphedMeshCount() const { return m_morphedMeshCount; }
+	uint32_t GetActiveMorphTargetCount() const { return m_activeMorphTargetCount; }
+	uint32_t GetMorphDeltaCount() const { return m_morphDeltaCount; }
 private:
-	bool isVisible(Node* node, const glm::mat4& viewProjectionMatrix) const;
-	bool isSphereVisible(Node* node, const glm::mat4& viewProjectionMatrix) const;
-	bool isAABBVisible(Node* node, const glm::mat4& viewProjectionMatrix) const;
-
-	std::vector<Node*>             m_nodes;
-	TransformUniformData           m_uniformTransformData;
-	std::shared_ptr<UniformBuffer> m_uniformTransformBuffer;
-	CameraUniformData              m_uniformCameraData;
+	static constexpr uint32_t InstanceBufferRegions = 3;
+	static constexpr uint32_t SkinPaletteBindingPoint = 4;
+	static constexpr uint32_t SkinInstanceBindingPoint = 5;
+
+	// Трансформы и отсечение - параллельно по кускам архетипов узлов
+	void updateTransforms(float alpha);
+	void cullNodes(const glm::mat4& viewProjectionMatrix);
+	static bool isVisible(const Model* model, const glm::mat4& worldMatrix, const Frustum& frustum);
+	uint32_t getAnimationLevel(const Model& model, const glm::mat4& worldMatrix, const glm::vec3& cameraPosition, float focalScale) const;
+	void renderSkinned(const FramePacket& packet, ShaderProgram& skinnedProgram, uint32_t baseInstance);
+	// Вершины экземпляров с морфингом в m_morphVertexBuffer: загрузка посчитанных на CPU или вычислительный проход
+	void updateMorphVertices(const FramePacket& packet);
+	void drawMorphed(const FramePacket& packet, bool skinned, uint32_t baseInstance, ShaderProgram* skinnedProgram, uint32_t skinInstanceBase);
+
+	ecs::World                     m_world;
+	std::vector<ecs::Entity>       m_nodes;
+	size_t                         m_visibleNodeCount{ 0 };
+	size_t                         m_animatedNodeCount{ 0 };  // видимых, с палитрой в кадре
+	uint32_t                       m_skinnedJointCount{ 0 };
+	bool                           m_instancingEnabled{ true };
+	bool                           m_animationLodEnabled{ true };
+	bool                           m_morphComputeEnabled{ true };
+	uint32_t                       m_morphedMeshCount{ 0 };
+	uint32_t                       m_activeMorphTargetCount{ 0 };
+	uint32_t                       m_morphDeltaCount{ 0 };
+	AnimationLodSettings           m_animationLodSettings;
+	AnimationLodStatistics         m_animationLodStatistics;
 	std::shared_ptr<UniformBuffer> m_uniformCameraBuffer;
 
+	// Поток рендера: буфер MeshInstanceData на InstanceBufferRegions кадров
+	std::shared_ptr<VertexBuffer>              m_instanceBuffer;
+	std::vector<std::shared_ptr<VertexBuffer>> m_retiredInstanceBuffers;
+	uint32_t                                   m_instanceCapacity{ 0 };
+	uint32_t                                   m_instanceRegion{ 0 };
+
+	// Поток рендера: палитры суставов и начала палитр экземпляров, тоже по областям кадров
+	std::shared_ptr<StorageBuffer> m_skinPaletteBuffer;
+	std::shared_ptr<StorageBuffer> m_skinInstanceBuffer;
+	uint32_t                       m_skinPaletteCapacity{ 0 };  // матриц в области
+	uint32_t                       m_skinInstanceCapacity{ 0 };
+	uint32_t                       m_skinRegion{ 0 };
+
+	// Поток рендера: вершины экземпляров с морфингом, тоже по областям кадров
+	std::shared_ptr<VertexBuffer>              m_morphVertexBuffer;
+	std::vector<std::shared_ptr<VertexBuffer>> m_retiredMorphVertexBuffers;
+	uint32_t                                   m_morphVertexCapacity{ 0 };
+	uint32_t                                   m_morphVertexBase{ 0 };
+	uint32_t                                   m_morphRegion{ 0 };
+
 	std::array<PointLightData, MaxNumLight> m_uniformLightData;
 	std::shared_ptr<UniformBuffer> m_uniformLightBuffer;
 
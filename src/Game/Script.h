@@ -0,0 +1,302 @@
+﻿#pragma once
+
+// Данные встроенного языка сценариев: значения, объекты кучи и байткод. Компилятор - ScriptCompiler.h,
+// исполнение и сборщик мусора - ScriptVM.h
+namespace script
+{
+	class VM;
+	struct Object;
+	struct String;
+	struct Function;
+	struct Class;
+	enum class ObjectType : uint8_t;
+
+	// NaN-boxing: число хранится самим double, остальные значения - тихий NaN с тегом в младших битах,
+	// объект - тихий NaN с битом знака и 48-битным указателем. Значение помещается в регистр и копируется без ветвлений
+	class Value final
+	{
+	public:
+		constexpr Value() = default;
+
+		static Value Number(double number) { Value value; value.m_bits = std::bit_cast<uint64_t>(number); return value; }
+		static Value Bool(bool boolean) { Value value; value.m_bits = boolean ? TrueBits : FalseBits; return value; }
+		static Value FromObject(const Object* object) { Value value; value.m_bits = SignBit | QuietNan | (uint64_t)(uintptr_t)object; return value; }
+		static constexpr Value Nil() { return Value(); }
+		// Служебное: слот глобальной переменной без значения, скрипту не виден
+		static constexpr Value Undefined() { Value value; value.m_bits = UndefinedBits; return value; }
+
+		bool IsNumber() const { return (m_bits & QuietNan) != QuietNan; }
+		bool IsNil() const { return m_bits == NilBits; }
+		bool IsBool() const { return (m_bits | 1) == TrueBits; }
+		bool IsUndefined() const { return m_bits == UndefinedBits; }
+		bool IsObject() const { return (m_bits & (SignBit | QuietNan)) == (SignBit | QuietNan); }
+		// Ложны только nil и false
+		bool IsFalsy() const { return m_bits == NilBits || m_bits == FalseBits; }
+
+		double AsNumber() const { return std::bit_cast<double>(m_bits); }
+		bool AsBool() const { return m_bits == TrueBits; }
+		Object* AsObject() const { return (Object*)(uintptr_t)(m_bits & ~(SignBit | QuietNan)); }
+		uint64_t GetBits() const { return m_bits; }
+
+		inline bool Is(ObjectType type) const;
+		String* AsString() const { return (String*)AsObject(); }
+
+		// Строки интернированы, поэтому равны по указателю; числа сравниваются как double (0 == -0, NaN != NaN)
+		bool operator==(const Value& other) const
+		{
+			if (IsNumber() && other.IsNumber()) return AsNumber() == other.AsNumber();
+			return m_bits == other.m_bits;
+		}
+
+	private:
+		static constexpr uint64_t SignBit = 0x8000000000000000ull;
+		static constexpr uint64_t QuietNan = 0x7ffc000000000000ull;
+		static constexpr uint64_t NilBits = QuietNan | 1;
+		static constexpr uint64_t FalseBits = QuietNan | 2;
+		static constexpr uint64_t TrueBits = QuietNan | 3;
+		static constexpr uint64_t UndefinedBits = QuietNan | 4;
+
+		uint64_t m_bits{ NilBits };
+	};
+	static_assert(sizeof(Value) == 8);
+
+	enum class ObjectType : uint8_t
+	{
+		String,
+		Table,
+		Function,
+		NativeFunction,
+		Class,
+		Instance,
+		NativeObject
+	};
+
+	// Цвета инкрементальной пометки: два белых чередуются по циклам, чтобы отличить объекты,
+	// созданные во время очистки, от недостижимых с прошлой пометки
+	enum class GcColor : uint8_t
+	{
+		White0,
+		White1,
+		Gray,
+		Black
+	};
+
+	struct Object
+	{
+		Object*    next;
+		ObjectType type;
+		GcColor    color;
+	};
+
+	bool Value::Is(ObjectType type) const { return IsObject() && AsObject()->type == type; }
+
+	// Неизменяемая интернированная строка, символы лежат сразу за заголовком
+	struct String final : Object
+	{
+		uint32_t length;
+		uint32_t hash;
+
+		const char* GetChars() const { return reinterpret_cast<const char*>(this + 1); }
+		std::string_view GetView() const { return { GetChars(), length }; }
+	};
+
+	// Таблица: плотный массив для ключей 0..n-1 и хеш с открытой адресацией для остальных.
+	// Ключом может быть любое значение, кроме nil и NaN
+	class ValueTable final
+	{
+	public:
+		struct Entry final
+		{
+			Value key{ Value::Undefined() }; // Undefined - пустой слот, nil - удаленный
+			Value value;
+		};
+
+		// nullptr - ключа нет
+		const Value* Find(Value key) const;
+		Value* Find(Value key) { return const_cast<Value*>(std::as_const(*this).Find(key)); }
+		Value Get(Value key) const { const Value* value = Find(key); return value ? *value : Value::Nil(); }
+		// Значение nil удаляет ключ
+		void Set(Value key, Value value);
+		bool Remove(Value key);
+		void Push(Value value);
+		void Clear();
+
+		uint32_t GetArrayCount() const { return (uint32_t)m_array.size(); }
+		Value* GetArray() { return m_array.data(); }
+		const Value* GetArray() const { return m_array.data(); }
+		std::vector<Value>& GetArrayStorage() { return m_array; }
+		uint32_t GetHashCount() const { return m_count; }
+		uint32_t GetHashCapacity() const { return (uint32_t)m_entries.size(); }
+		const Entry* GetEntries() const { return m_entries.data(); }
+		size_t GetMemorySize() const { return m_array.capacity() * sizeof(Value) + m_entries.capacity() * sizeof(Entry); }
+
+		// Обход: position - номер позиции, 0 в начале; false - обход закончен
+		bool Next(uint32_t& position, Value& key, Value& value) const;
+
+	private:
+		static uint32_t hashValue(Value key);
+		Entry* findEntry(Value key);
+		void resize(uint32_t capacity);
+		// ключи хеша, ставшие продолжением массива, переезжают в массив
+		void migrateToArray();
+
+		std::vector<Value> m_array;
+		std::vector<Entry> m_entries; // размер - степень двойки
+		uint32_t           m_count{ 0 };     // занятые слоты, без удаленных
+		uint32_t           m_tombstones{ 0 };
+	};
+
+	struct Table final : Object
+	{
+		ValueTable table;
+	};
+
+	// Команды байткода: 32 бита, op(8) A(8) B(8) C(8) или op(8) A(8) Bx(16)/sBx(16).
+	// Регистры - окно стека функции, K - константы функции
+#define SCRIPT_OPCODES(X) \
+	X(Move)      /* R[A] = R[B] */                                       \
+	X(LoadK)     /* R[A] = K[Bx] */                                      \
+	X(LoadNil)   /* R[A] = nil */                                        \
+	X(LoadTrue)  /* R[A] = true */                                       \
+	X(LoadFalse) /* R[A] = false */                                      \
+	X(GetGlobal) /* R[A] = G[Bx] */                                      \
+	X(SetGlobal) /* G[Bx] = R[A] */                                      \
+	X(DefineGlobal) /* G[Bx] = R[A]; при перезагрузке заданная переменная сохраняет значение */ \
+	X(DefineClass) /* G[Bx] = R[A]; существующий класс с тем же именем получает новые методы */ \
+	X(GetField)  /* R[A] = R[B].K[C] */                                  \
+	X(SetField)  /* R[A].K[B] = R[C] */                                  \
+	X(GetIndex)  /* R[A] = R[B][R[C]] */                                 \
+	X(SetIndex)  /* R[A][R[B]] = R[C] */                                 \
+	X(NewTable)  /* R[A] = {}, B - размер массива */                     \
+	X(Append)    /* R[A] += R[A+1..A+B] в массив */                      \
+	X(Add)       /* R[A] = R[B] + R[C] */                                \
+	X(Sub)                                                               \
+	X(Mul)                                                               \
+	X(Div)                                                               \
+	X(Mod)                                                               \
+	X(AddK)      /* R[A] = R[B] + K[C] */                                \
+	X(SubK)                                                              \
+	X(MulK)                                                              \
+	X(DivK)                                                              \
+	X(ModK)                                                              \
+	X(Neg)       /* R[A] = -R[B] */                                      \
+	X(Not)       /* R[A] = not R[B] */                                   \
+	X(Concat)    /* R[A] = R[B] .. R[C] */                               \
+	X(Eq)        /* R[A] = R[B] == R[C] */                               \
+	X(Ne)                                                                \
+	X(Lt)                                                                \
+	X(Le)                                                                \
+	X(EqK)       /* R[A] = R[B] == K[C] */                               \
+	X(NeK)                                                               \
+	X(LtK)                                                               \
+	X(LeK)                                                               \
+	X(GtK)                                                               \
+	X(GeK)                                                               \
+	X(Jump)      /* pc += sBx */                                         \
+	X(JumpIf)    /* if R[A] then pc += sBx */                            \
+	X(JumpIfNot) /* if not R[A] then pc += sBx */                        \
+	X(Call)      /* R[A] = R[A](R[A+1..A+B]) */                          \
+	X(Invoke)    /* R[A] = R[A+1].K[C](R[A+2..A+B]), B - аргументы вместе с this */ \
+	X(Return)    /* вернуть R[A] */                                      \
+	X(ReturnNil)                                                         \
+	X(ForPrep)   /* R[A]..R[A+2] - счетчик, предел, шаг; pc += sBx к ForLoop */ \
+	X(ForLoop)   /* R[A] += R[A+2]; если не прошли предел, R[A+3] = R[A] и pc += sBx */ \
+	X(Iterate)   /* следующая пара R[A] в R[A+2], R[A+3], позиция в R[A+1]; если есть, pc += sBx */
+
+	enum class Op : uint8_t
+	{
+#define SCRIPT_OPCODE_ENUM(name) name,
+		SCRIPT_OPCODES(SCRIPT_OPCODE_ENUM)
+#undef SCRIPT_OPCODE_ENUM
+		Count
+	};
+
+	namespace bytecode
+	{
+		constexpr int32_t JumpBias = 32767;
+
+		constexpr uint32_t Encode(Op op, uint32_t a, uint32_t b, uint32_t c) { return (uint32_t)op | a << 8 | b << 16 | c << 24; }
+		constexpr uint32_t EncodeBx(Op op, uint32_t a, uint32_t bx) { return (uint32_t)op | a << 8 | bx << 16; }
+		constexpr uint32_t EncodeSBx(Op op, uint32_t a, int32_t sbx) { return (uint32_t)op | a << 8 | (uint32_t)(sbx + JumpBias) << 16; }
+
+		constexpr Op GetOp(uint32_t instruction) { return (Op)(instruction & 0xff); }
+		constexpr uint32_t GetA(uint32_t instruction) { return (instruction >> 8) & 0xff; }
+		constexpr uint32_t GetB(uint32_t instruction) { return (instruction >> 16) & 0xff; }
+		constexpr uint32_t GetC(uint32_t instruction) { return instruction >> 24; }
+		constexpr uint32_t GetBx(uint32_t instruction) { return instruction >> 16; }
+		constexpr int32_t GetSBx(uint32_t instruction) { return (int32_t)(instruction >> 16) - JumpBias; }
+
+		const char* GetOpName(Op op);
+	}
+
+	// Скомпилированная функция. Замыканий нет: функция видит свои локальные переменные и глобальные
+	struct Function final : Object
+	{
+		String*               name;
+		String*               chunkName; // путь файла
+		std::vector<uint32_t> code;
+		std::vector<uint32_t> lines;     // строка исходника на команду
+		std::vector<Value>    constants;
+		uint8_t               arity;     // вместе с this у методов
+		uint8_t               registerCount;
+	};
+
+	using NativeFn = bool(*)(VM& vm, Value* args, uint32_t argCount, Value& result);
+
+	// Функция движка. У методов нативных классов args[0] - this
+	struct NativeFunction final : Object
+	{
+		String*  name;
+		NativeFn function;
+	};
+
+	struct NativeObject;
+
+	// Описание нативного класса: свойства читают и пишут объект движка на месте, без копии в таблицу.
+	// false - ошибка уже в vm.Error (например, объект движка уже удален)
+	struct NativeProperty final
+	{
+		const char* name;
+		bool (*get)(VM& vm, const NativeObject& object, Value& result);
+		bool (*set)(VM& vm, const NativeObject& object, Value value); // nullptr - только чтение
+	};
+
+	struct NativeMethod final
+	{
+		const char* name;
+		NativeFn    function;
+	};
+
+	struct NativeClassDesc final
+	{
+		const char*                 name;
+		std::vector<NativeProperty> properties;
+		std::vector<NativeMethod>   methods;
+	};
+
+	// Класс сценария или нативный класс. Методы - таблица имя -> Function/NativeFunction,
+	// у нативного класса properties - имя -> номер свойства в описании
+	struct Class final : Object
+	{
+		String*                name;
+		ValueTable             methods;
+		ValueTable             properties;
+		const NativeClassDesc* native;
+	};
+
+	// Экземпляр класса сценария: поля по именам
+	struct Instance final : Object
+	{
+		Class*     klass;
+		ValueTable fields;
+	};
+
+	// Ссылка на объект движка. Время жизни объекта - забота владельца ВМ; если объект может исчезнуть раньше,
+	// pointer указывает на владельца, а handle - проверяемая ссылка внутри него (например, сущность мира)
+	struct NativeObject final : Object
+	{
+		Class*   klass;
+		void*    pointer;
+		uint64_t handle;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,244 @@
+﻿#include "stdafx.h"
+#include "ScriptBindings.h"
+#include "Scene.h"
+//=============================================================================
+namespace
+{
+	using namespace script;
+
+	extern const NativeClassDesc SceneClass;
+	extern const NativeClassDesc NodeClass;
+	extern const NativeClassDesc TransformClass;
+	extern const NativeClassDesc CameraClass;
+
+	// this метода: объект нужного нативного класса (метод можно достать как значение и вызвать с чем угодно)
+	bool getSelfObject(VM& vm, const Value* args, uint32_t argCount, const NativeClassDesc& desc, const NativeObject*& self)
+	{
+		if (argCount == 0 || !args[0].Is(ObjectType::NativeObject) || static_cast<NativeObject*>(args[0].AsObject())->klass->native != &desc)
+			return vm.Error("{} method called without a {} object", desc.name, desc.name);
+		self = static_cast<const NativeObject*>(args[0].AsObject());
+		return true;
+	}
+
+	template<typename T>
+	bool getSelf(VM& vm, const Value* args, uint32_t argCount, const NativeClassDesc& desc, T*& self)
+	{
+		const NativeObject* object = nullptr;
+		if (!getSelfObject(vm, args, argCount, desc, object)) return false;
+		self = static_cast<T*>(object->pointer);
+		return true;
+	}
+
+	// Node и Transform хранят сцену и сущность узла: трансформ ищется в мире при каждом обращении,
+	// поэтому объект в сценарии переживает переносы сущности между кусками и замечает удаление узла
+	bool getTransform(VM& vm, const NativeObject& object, Transform*& transform)
+	{
+		transform = static_cast<Scene*>(object.pointer)->GetWorld().Get<Transform>(ecs::Entity::FromBits(object.handle));
+		if (!transform) return vm.Error("{} of a destroyed scene node", object.klass->name->GetView());
+		return true;
+	}
+
+	bool getSelfTransform(VM& vm, const Value* args, uint32_t argCount, Transform*& transform)
+	{
+		const NativeObject* object = nullptr;
+		return getSelfObject(vm, args, argCount, TransformClass, object) && getTransform(vm, *object, transform);
+	}
+
+	// Числовые аргументы метода после this
+	template<size_t Count>
+	bool getNumbers(VM& vm, const char* method, const Value* args, uint32_t argCount, std::array<float, Count>& numbers)
+	{
+		if (argCount != Count + 1) return vm.Error("{} expects {} arguments, got {}", method, Count, argCount - 1);
+		for (size_t i = 0; i < Count; i++)
+		{
+			if (!args[i + 1].IsNumber()) return vm.Error("{}: argument {} must be a number, got {}", method, i + 1, VM::GetTypeName(args[i + 1]));
+			numbers[i] = (float)args[i + 1].AsNumber();
+		}
+		return true;
+	}
+
+	bool getNumber(VM& vm, const char* property, Value value, float& number)
+	{
+		if (!value.IsNumber()) return vm.Error("{} must be a number, got {}", property, VM::GetTypeName(value));
+		number = (float)value.AsNumber();
+		return true;
+	}
+
+	// Scene
+	bool sceneNodeCount(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		Scene* scene = nullptr;
+		if (!getSelf(vm, args, argCount, SceneClass, scene)) return false;
+		result = Value::Number((double)scene->GetNodeCount());
+		return true;
+	}
+
+	bool sceneNode(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		Scene* scene = nullptr;
+		std::array<float, 1> index;
+		if (!getSelf(vm, args, argCount, SceneClass, scene) || !getNumbers(vm, "node", args, argCount, index)) return false;
+		if (index[0] < 0.0f || (size_t)index[0] >= scene->GetNodeCount())
+			return vm.Error("node index {} is out of range, scene has {} nodes", index[0], scene->GetNodeCount());
+		result = vm.NewNativeObject(NodeClass, scene, scene->GetNode((size_t)index[0]).ToBits());
+		return true;
+	}
+
+	// Node
+	bool nodeTransform(VM& vm, const NativeObject& object, Value& result)
+	{
+		Transform* transform = nullptr;
+		if (!getTransform(vm, object, transform)) return false;
+		result = vm.NewNativeObject(TransformClass, object.pointer, object.handle);
+		return true;
+	}
+
+	// Transform
+	template<int Axis>
+	bool getPosition(VM& vm, const NativeObject& object, Value& result)
+	{
+		Transform* transform = nullptr;
+		if (!getTransform(vm, object, transform)) return false;
+		result = Value::Number(transform->GetPosition()[Axis]);
+		return true;
+	}
+
+	template<int Axis>
+	bool setPosition(VM& vm, const NativeObject& object, Value value)
+	{
+		Transform* transform = nullptr;
+		if (!getTransform(vm, object, transform)) return false;
+		glm::vec3 position = transform->GetPosition();
+		if (!getNumber(vm, "position", value, position[Axis])) return false;
+		transform->SetPosition(position);
+		return true;
+	}
+
+	bool transformTranslate(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		Transform* transform = nullptr;
+		std::array<float, 3> offset;
+		if (!getSelfTransform(vm, args, argCount, transform) || !getNumbers(vm, "translate", args, argCount, offset)) return false;
+		transform->Translate({ offset[0], offset[1], offset[2] });
+		return true;
+	}
+
+	bool transformRotate(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		Transform* transform = nullptr;
+		std::array<float, 4> angleAxis;
+		if (!getSelfTransform(vm, args, argCount, transform) || !getNumbers(vm, "rotate", args, argCount, angleAxis)) return false;
+		const glm::vec3 axis{ angleAxis[1], angleAxis[2], angleAxis[3] };
+		if (glm::dot(axis, axis) < 1e-12f) return vm.Error("rotate: axis is zero");
+		transform->Rotate(angleAxis[0], glm::normalize(axis));
+		return true;
+	}
+
+	bool transformSetPosition(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		Transform* transform = nullptr;
+		std::array<float, 3> position;
+		if (!getSelfTransform(vm, args, argCount, transform) || !getNumbers(vm, "setPosition", args, argCount, position)) return false;
+		transform->SetPosition({ position[0], position[1], position[2] });
+		return true;
+	}
+
+	bool transformSetScale(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		Transform* transform = nullptr;
+		if (!getSelfTransform(vm, args, argCount, transform)) return false;
+		if (argCount == 2)
+		{
+			std::array<float, 1> scale;
+			if (!getNumbers(vm, "setScale", args, argCount, scale)) return false;
+			transform->SetScale(glm::vec3(scale[0]));
+			return true;
+		}
+		std::array<float, 3> scale;
+		if (!getNumbers(vm, "setScale", args, argCount, scale)) return false;
+		transform->SetScale({ scale[0], scale[1], scale[2] });
+		return true;
+	}
+
+	// Camera
+	template<int Axis>
+	bool getCameraPosition(VM&, const NativeObject& object, Value& result)
+	{
+		result = Value::Number(static_cast<Camera*>(object.pointer)->GetPosition()[Axis]);
+		return true;
+	}
+
+	template<int Axis>
+	bool setCameraPosition(VM& vm, const NativeObject& object, Value value)
+	{
+		Camera* camera = static_cast<Camera*>(object.pointer);
+		glm::vec3 position = camera->GetPosition();
+		if (!getNumber(vm, "camera position", value, position[Axis])) return false;
+		camera->SetPosition(position);
+		return true;
+	}
+
+	bool getCameraYaw(VM&, const NativeObject& object, Value& result)
+	{
+		result = Value::Number(static_cast<Camera*>(object.pointer)->GetYaw());
+		return true;
+	}
+
+	bool getCameraPitch(VM&, const NativeObject& object, Value& result)
+	{
+		result = Value::Number(static_cast<Camera*>(object.pointer)->GetPitch());
+		return true;
+	}
+
+	bool setCameraYaw(VM& vm, const NativeObject& object, Value value)
+	{
+		Camera* camera = static_cast<Camera*>(object.pointer);
+		float yaw = 0.0f;
+		if (!getNumber(vm, "yaw", value, yaw)) return false;
+		camera->SetOrientation(yaw, camera->GetPitch());
+		return true;
+	}
+
+	bool setCameraPitch(VM& vm, const NativeObject& object, Value value)
+	{
+		Camera* camera = static_cast<Camera*>(object.pointer);
+		float pitch = 0.0f;
+		if (!getNumber(vm, "pitch", value, pitch)) return false;
+		camera->SetOrientation(camera->GetYaw(), pitch);
+		return true;
+	}
+
+	const NativeClassDesc SceneClass{
+		"Scene",
+		{},
+		{ { "nodeCount", sceneNodeCount }, { "node", sceneNode } }
+	};
+
+	const NativeClassDesc NodeClass{
+		"Node",
+		{ { "transform", nodeTransform, nullptr } },
+		{}
+	};
+
+	const NativeClassDesc TransformClass{
+		"Transform",
+		{ { "x", getPosition<0>, setPosition<0> }, { "y", getPosition<1>, setPosition<1> }, { "z", getPosition<2>, setPosition<2> } },
+		{ { "translate", transformTranslate }, { "rotate", transformRotate }, { "setPosition", transformSetPosition }, { "setScale", transformSetScale } }
+	};
+
+	const NativeClassDesc CameraClass{
+		"Camera",
+		{
+			{ "x", getCameraPosition<0>, setCameraPosition<0> }, { "y", getCameraPosition<1>, setCameraPosition<1> }, { "z", getCameraPosition<2>, setCameraPosition<2> },
+			{ "yaw", getCameraYaw, setCameraYaw }, { "pitch", getCameraPitch, setCameraPitch }
+		},
+		{}
+	};
+}
+//=============================================================================
+void script::BindScene(VM& vm, Scene& scene, Camera& camera)
+{
+	vm.SetGlobal("scene", vm.NewNativeObject(SceneClass, &scene));
+	vm.SetGlobal("camera", vm.NewNativeObject(CameraClass, &camera));
+}
+//=============================================================================
\ No newline at end of file
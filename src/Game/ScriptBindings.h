@@ -0,0 +1,15 @@
+﻿#pragma once
+
+#include "ScriptVM.h"
+
+class Scene;
+class Camera;
+
+namespace script
+{
+	// Глобальные scene и camera для сценариев. Объекты сценария - ссылки на узлы, трансформы и камеру движка:
+	// свойства и методы читают и пишут их на месте, без копий в таблицы. Сцена и камера должны пережить ВМ.
+	//   scene.nodeCount()  scene.node(i).transform  t.x t.y t.z  t.translate(dx, dy, dz)  t.rotate(angle, ax, ay, az)
+	//   t.setPosition(x, y, z)  t.setScale(s | x, y, z)  camera.x camera.y camera.z camera.yaw camera.pitch
+	void BindScene(VM& vm, Scene& scene, Camera& camera);
+}
\ No newline at end of file
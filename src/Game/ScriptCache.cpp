@@ -0,0 +1,613 @@
+﻿#include "stdafx.h"
+#include "ScriptCache.h"
+#include "MappedFile.h"
+#include "JobSystem.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	using namespace script;
+	using namespace script::bytecode;
+
+	enum class ConstantTag : uint32_t
+	{
+		Number,
+		String,
+		Function,
+		Class
+	};
+
+	// Команды, у которых Bx - слот глобальной переменной
+	bool usesGlobalSlot(Op op)
+	{
+		return op == Op::GetGlobal || op == Op::SetGlobal || op == Op::DefineGlobal || op == Op::DefineClass;
+	}
+
+	bool readSource(const std::string& path, std::string& source)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file) return false;
+		std::stringstream stream;
+		stream << file.rdbuf();
+		source = stream.str();
+		return true;
+	}
+
+	// Сборка байткода: функции обходятся очередью по константам, строки, глобальные и классы
+	// нумеруются при первой встрече. Секции функций и классов пишутся сразу, таблицы - в конце
+	class ChunkWriter final
+	{
+	public:
+		explicit ChunkWriter(const VM& vm) : m_vm(vm) {}
+
+		bool Write(Function* main, uint64_t sourceHash, std::vector<std::byte>& chunk)
+		{
+			addFunction(main);
+			for (size_t i = 0; i < m_functionQueue.size(); i++)
+			{
+				if (!writeFunction(m_functionQueue[i])) return false;
+			}
+
+			std::vector<uint32_t> data;
+			for (const String* string : m_stringList)
+			{
+				data.push_back(string->length);
+				const size_t first = data.size();
+				data.resize(first + (string->length + 3) / 4, 0);
+				std::memcpy(data.data() + first, string->GetChars(), string->length);
+			}
+			data.insert(data.end(), m_globalList.begin(), m_globalList.end());
+			data.insert(data.end(), m_classWords.begin(), m_classWords.end());
+			data.insert(data.end(), m_functionWords.begin(), m_functionWords.end());
+
+			ScriptChunkHeader header{};
+			header.magic = ScriptChunkHeader::MagicValue;
+			header.version = ScriptChunkHeader::CurrentVersion;
+			header.opCount = (uint32_t)Op::Count;
+			header.stringCount = (uint32_t)m_stringList.size();
+			header.sourceHash = sourceHash;
+			header.globalCount = (uint32_t)m_globalList.size();
+			header.classCount = m_classCount;
+			header.functionCount = (uint32_t)m_functionQueue.size();
+			header.dataSize = (uint32_t)(data.size() * sizeof(uint32_t));
+
+			chunk.resize(sizeof(header) + header.dataSize);
+			std::memcpy(chunk.data(), &header, sizeof(header));
+			std::memcpy(chunk.data() + sizeof(header), data.data(), header.dataSize);
+			return true;
+		}
+
+	private:
+		uint32_t addString(const String* string)
+		{
+			const auto [found, inserted] = m_strings.try_emplace(string, (uint32_t)m_stringList.size());
+			if (inserted) m_stringList.push_back(string);
+			return found->second;
+		}
+
+		uint32_t addGlobal(uint32_t slot)
+		{
+			const auto [found, inserted] = m_globals.try_emplace(slot, (uint32_t)m_globalList.size());
+			if (inserted) m_globalList.push_back(addString(m_vm.GetGlobalName(slot)));
+			return found->second;
+		}
+
+		uint32_t addFunction(Function* function)
+		{
+			const auto [found, inserted] = m_functions.try_emplace(function, (uint32_t)m_functionQueue.size());
+			if (inserted) m_functionQueue.push_back(function);
+			return found->second;
+		}
+
+		bool addClass(const Class* klass, uint32_t& index)
+		{
+			const auto [found, inserted] = m_classes.try_emplace(klass, m_classCount);
+			index = found->second;
+			if (!inserted) return true;
+			if (klass->native) return false;
+
+			m_classCount++;
+			m_classWords.push_back(addString(klass->name));
+			m_classWords.push_back(klass->methods.GetHashCount() + klass->methods.GetArrayCount());
+			uint32_t position = 0;
+			Value name, method;
+			while (klass->methods.Next(position, name, method))
+			{
+				if (!name.Is(ObjectType::String) || !method.Is(ObjectType::Function)) return false;
+				m_classWords.push_back(addString(name.AsString()));
+				m_classWords.push_back(addFunction(static_cast<Function*>(method.AsObject())));
+			}
+			return true;
+		}
+
+		bool writeFunction(const Function* function)
+		{
+			std::vector<uint32_t>& words = m_functionWords;
+			words.push_back(addString(function->name));
+			words.push_back(function->arity | (uint32_t)function->registerCount << 8);
+			words.push_back((uint32_t)function->code.size());
+			for (const uint32_t instruction : function->code)
+			{
+				// слоты глобальных у каждой ВМ свои, в файле - номера имен
+				words.push_back(usesGlobalSlot(GetOp(instruction))
+					? EncodeBx(GetOp(instruction), GetA(instruction), addGlobal(GetBx(instruction)))
+					: instruction);
+			}
+			words.insert(words.end(), function->lines.begin(), function->lines.end());
+
+			words.push_back((uint32_t)function->constants.size());
+			for (const Value constant : function->constants)
+			{
+				if (constant.IsNumber())
+				{
+					const uint64_t bits = constant.GetBits();
+					words.insert(words.end(), { (uint32_t)ConstantTag::Number, (uint32_t)bits, (uint32_t)(bits >> 32) });
+				}
+				else if (constant.Is(ObjectType::String))
+					words.insert(words.end(), { (uint32_t)ConstantTag::String, addString(constant.AsString()) });
+				else if (constant.Is(ObjectType::Function))
+					words.insert(words.end(), { (uint32_t)ConstantTag::Function, addFunction(static_cast<Function*>(constant.AsObject())) });
+				else if (uint32_t index = 0; constant.Is(ObjectType::Class) && addClass(static_cast<Class*>(constant.AsObject()), index))
+					words.insert(words.end(), { (uint32_t)ConstantTag::Class, index });
+				else
+					return false;
+			}
+			return true;
+		}
+
+		const VM&                                         m_vm;
+		std::unordered_map<const String*, uint32_t>       m_strings;
+		std::vector<const String*>                        m_stringList;
+		std::unordered_map<uint32_t, uint32_t>            m_globals;    // слот ВМ -> номер в файле
+		std::vector<uint32_t>                             m_globalList; // номера строк имен
+		std::unordered_map<const Function*, uint32_t>     m_functions;
+		std::vector<Function*>                            m_functionQueue;
+		std::unordered_map<const Class*, uint32_t>        m_classes;
+		uint32_t                                          m_classCount{ 0 };
+		std::vector<uint32_t>                             m_classWords;
+		std::vector<uint32_t>                             m_functionWords;
+	};
+
+	// Чтение потока uint32 с проверкой границ: поврежденный файл дает ошибку, а не выход за буфер
+	class ChunkReader final
+	{
+	public:
+		ChunkReader(const uint32_t* data, size_t count) : m_data(data), m_count(count) {}
+
+		uint32_t Read()
+		{
+			if (m_position >= m_count) [[unlikely]]
+			{
+				m_failed = true;
+				return 0;
+			}
+			return m_data[m_position++];
+		}
+
+		// Номер из таблицы размером count
+		uint32_t ReadIndex(uint32_t count)
+		{
+			const uint32_t index = Read();
+			if (index >= count) [[unlikely]]
+			{
+				m_failed = true;
+				return 0;
+			}
+			return index;
+		}
+
+		// Число элементов, каждый занимает хотя бы слово: мусор вместо числа не превратится в огромное выделение
+		uint32_t ReadCount()
+		{
+			const uint32_t count = Read();
+			if (count > m_count - m_position) [[unlikely]]
+			{
+				m_failed = true;
+				return 0;
+			}
+			return count;
+		}
+
+		const uint32_t* ReadWords(size_t count)
+		{
+			if (count > m_count - m_position) [[unlikely]]
+			{
+				m_failed = true;
+				return nullptr;
+			}
+			const uint32_t* words = m_data + m_position;
+			m_position += count;
+			return words;
+		}
+
+		bool IsFailed() const { return m_failed; }
+		bool IsAtEnd() const { return m_position == m_count; }
+
+	private:
+		const uint32_t* m_data;
+		size_t          m_count;
+		size_t          m_position{ 0 };
+		bool            m_failed{ false };
+	};
+
+	Function* readChunk(VM& vm, const ScriptChunkHeader& header, ChunkReader& reader, const std::string& chunkName)
+	{
+		std::vector<String*> strings(header.stringCount);
+		for (String*& string : strings)
+		{
+			const uint32_t length = reader.Read();
+			const uint32_t* chars = reader.ReadWords(((size_t)length + 3) / 4);
+			if (!chars) return nullptr;
+			string = vm.Intern({ reinterpret_cast<const char*>(chars), length });
+		}
+
+		std::vector<uint32_t> globalSlots(header.globalCount);
+		for (uint32_t& slot : globalSlots)
+			slot = vm.GetGlobalSlot(strings[reader.ReadIndex(header.stringCount)]);
+		if (reader.IsFailed()) return nullptr;
+
+		// объекты создаются заранее: константы ссылаются вперед. Имя-заглушка - на случай ошибки посередине,
+		// недостроенная функция останется в куче до сборки и не должна ссылаться в никуда
+		String* chunkNameString = vm.Intern(chunkName);
+		std::vector<Function*> functions(header.functionCount);
+		for (Function*& function : functions) function = vm.NewFunction(chunkNameString, chunkNameString);
+
+		std::vector<Class*> classes(header.classCount);
+		for (Class*& klass : classes)
+		{
+			klass = vm.NewClass(strings[reader.ReadIndex(header.stringCount)]);
+			const uint32_t methodCount = reader.ReadCount();
+			for (uint32_t i = 0; i < methodCount && !reader.IsFailed(); i++)
+			{
+				const uint32_t name = reader.ReadIndex(header.stringCount);
+				const uint32_t method = reader.ReadIndex(header.functionCount);
+				klass->methods.Set(Value::FromObject(strings[name]), Value::FromObject(functions[method]));
+			}
+			if (reader.IsFailed()) return nullptr;
+		}
+
+		for (Function* function : functions)
+		{
+			function->name = strings[reader.ReadIndex(header.stringCount)];
+			const uint32_t sizes = reader.Read();
+			function->arity = (uint8_t)sizes;
+			function->registerCount = (uint8_t)(sizes >> 8);
+
+			const uint32_t codeSize = reader.Read();
+			const uint32_t* code = reader.ReadWords(codeSize);
+			const uint32_t* lines = reader.ReadWords(codeSize);
+			if (!code || !lines || codeSize == 0) return nullptr;
+			function->code.assign(code, code + codeSize);
+			function->lines.assign(lines, lines + codeSize);
+			for (uint32_t& instruction : function->code)
+			{
+				const Op op = GetOp(instruction);
+				if (op >= Op::Count) return nullptr;
+				if (!usesGlobalSlot(op)) continue;
+				if (GetBx(instruction) >= header.globalCount) return nullptr;
+				instruction = EncodeBx(op, GetA(instruction), globalSlots[GetBx(instruction)]);
+			}
+
+			function->constants.resize(reader.ReadCount());
+			for (Value& constant : function->constants)
+			{
+				switch ((ConstantTag)reader.Read())
+				{
+				case ConstantTag::Number:
+				{
+					const uint64_t low = reader.Read();
+					const uint64_t high = reader.Read();
+					constant = Value::Number(std::bit_cast<double>(low | high << 32));
+					break;
+				}
+				case ConstantTag::String: constant = Value::FromObject(strings[reader.ReadIndex(header.stringCount)]); break;
+				case ConstantTag::Function: constant = Value::FromObject(functions[reader.ReadIndex(header.functionCount)]); break;
+				case ConstantTag::Class:
+					if (classes.empty()) return nullptr;
+					constant = Value::FromObject(classes[reader.ReadIndex(header.classCount)]);
+					break;
+				default: return nullptr;
+				}
+			}
+			if (reader.IsFailed()) return nullptr;
+		}
+		return reader.IsAtEnd() && !functions.empty() ? functions[0] : nullptr;
+	}
+}
+//=============================================================================
+uint64_t script::HashSource(std::string_view source)
+{
+	// FNV-1a: ключ кэша, а не защита от подделки
+	uint64_t hash = 14695981039346656037ull;
+	for (const char c : source) hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+	return hash;
+}
+//=============================================================================
+bool script::SaveChunk(const VM& vm, Function* main, uint64_t sourceHash, std::vector<std::byte>& chunk)
+{
+	PROFILE_FUNCTION();
+	ChunkWriter writer(vm);
+	return writer.Write(main, sourceHash, chunk);
+}
+//=============================================================================
+script::Function* script::LoadChunk(VM& vm, const std::byte* data, size_t size, const std::string& chunkName)
+{
+	PROFILE_FUNCTION();
+	const ScriptChunkHeader* header = reinterpret_cast<const ScriptChunkHeader*>(data);
+	const bool valid = size >= sizeof(ScriptChunkHeader)
+		&& header->magic == ScriptChunkHeader::MagicValue
+		&& header->version == ScriptChunkHeader::CurrentVersion
+		&& header->opCount == (uint32_t)Op::Count
+		&& header->dataSize == size - sizeof(ScriptChunkHeader)
+		&& header->dataSize % sizeof(uint32_t) == 0
+		&& header->stringCount > 0 && header->functionCount > 0;
+	const uint32_t words = valid ? header->dataSize / sizeof(uint32_t) : 0;
+	if (!valid || std::max({ header->stringCount, header->globalCount, header->classCount, header->functionCount }) > words) return nullptr;
+
+	// до возврата главная функция и все, что из нее достижимо, не видны сборщику
+	vm.PauseGc();
+	ChunkReader reader(reinterpret_cast<const uint32_t*>(data + sizeof(ScriptChunkHeader)), words);
+	Function* main = readChunk(vm, *header, reader, chunkName);
+	vm.ResumeGc();
+	return main;
+}
+//=============================================================================
+bool script::RunCacheBenchmark(const std::string& directory)
+{
+	using Clock = std::chrono::steady_clock;
+	constexpr uint32_t Repeats = 200;
+
+	std::error_code error;
+	std::vector<std::string> paths;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, error))
+	{
+		if (entry.path().extension() == ".script") paths.push_back(entry.path().generic_string());
+	}
+	std::sort(paths.begin(), paths.end());
+
+	LOG_INFO(Script, "Script bytecode cache benchmark, {} repeats per file", Repeats);
+	bool succeeded = !paths.empty();
+	for (const std::string& path : paths)
+	{
+		std::string source;
+		if (!readSource(path, source))
+		{
+			succeeded = false;
+			continue;
+		}
+
+		// в одной ВМ: строки и слоты глобальных после первого прохода уже есть, как при повторной загрузке
+		VM vm;
+		std::vector<std::byte> chunk;
+		Function* main = vm.Compile(source, path);
+		if (!main || !SaveChunk(vm, main, HashSource(source), chunk))
+		{
+			succeeded = false;
+			continue;
+		}
+
+		LoadChunk(vm, chunk.data(), chunk.size(), path); // прогрев
+		auto start = Clock::now();
+		for (uint32_t i = 0; i < Repeats; i++) vm.Compile(source, path);
+		const double compileMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / Repeats;
+
+		start = Clock::now();
+		for (uint32_t i = 0; i < Repeats; i++) LoadChunk(vm, chunk.data(), chunk.size(), path);
+		const double loadMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / Repeats;
+
+		LOG_INFO(Script, "  {:<16} {:6.1f} KB source, {:6.1f} KB bytecode, compile {:7.3f} ms, load {:7.3f} ms ({:.1f}x)",
+			std::filesystem::path(path).filename().string(), source.size() / 1024.0, chunk.size() / 1024.0, compileMilliseconds, loadMilliseconds, compileMilliseconds / std::max(loadMilliseconds, 1e-6));
+	}
+	return succeeded;
+}
+//=============================================================================
+script::ScriptLoader::ScriptLoader(VM& vm, const Settings& settings)
+	: m_vm(vm)
+	, m_settings(settings)
+	, m_lastPoll(std::chrono::steady_clock::now())
+{
+	// отдельный поток, а не задачи: jobs::Wait в кадре мог бы взяться за компиляцию и задержать кадр
+	if (m_settings.hotReload)
+		m_thread = std::thread(&ScriptLoader::compilerThread, this);
+}
+//=============================================================================
+script::ScriptLoader::~ScriptLoader()
+{
+	// поток пишет в m_files
+	if (!m_thread.joinable()) return;
+	{
+		std::lock_guard lock(m_queueMutex);
+		m_stopThread = true;
+	}
+	m_queueCondition.notify_all();
+	m_thread.join();
+}
+//=============================================================================
+bool script::ScriptLoader::RunFile(const std::string& path)
+{
+	PROFILE_FUNCTION();
+	const auto start = std::chrono::steady_clock::now();
+
+	std::string source;
+	if (!readSource(path, source))
+	{
+		LOG_ERROR(Script, "Failed to open script: {}", path);
+		return false;
+	}
+
+	std::unique_ptr<WatchedFile> file = std::make_unique<WatchedFile>();
+	std::error_code error;
+	file->path = path;
+	file->writeTime = std::filesystem::last_write_time(path, error);
+	file->sourceHash = HashSource(source);
+
+	Function* main = nullptr;
+	const std::string cachePath = getCachePath(file->sourceHash);
+	if (m_settings.useCache && std::filesystem::exists(cachePath, error))
+	{
+		MappedFile cached;
+		if (cached.Open(cachePath))
+		{
+			const ScriptChunkHeader* header = reinterpret_cast<const ScriptChunkHeader*>(cached.GetData());
+			if (cached.GetSize() >= sizeof(ScriptChunkHeader) && header->sourceHash == file->sourceHash)
+				main = LoadChunk(m_vm, cached.GetData(), cached.GetSize(), path);
+			if (!main) LOG_WARNING(Script, "Stale script cache entry, recompiling: {}", cachePath);
+		}
+	}
+
+	if (main)
+		m_statistics.cacheHits++;
+	else
+	{
+		main = m_vm.Compile(source, path);
+		if (!main) return false;
+		m_statistics.cacheMisses++;
+		std::vector<std::byte> chunk;
+		if (m_settings.useCache && SaveChunk(m_vm, main, file->sourceHash, chunk)) storeChunk(file->sourceHash, chunk);
+	}
+
+	// следим и за файлом с ошибкой выполнения: исправление подхватится без перезапуска
+	m_files.push_back(std::move(file));
+	const bool completed = m_vm.RunMain(main);
+	m_statistics.loadMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return completed;
+}
+//=============================================================================
+bool script::ScriptLoader::Update()
+{
+	PROFILE_FUNCTION();
+
+	std::vector<WatchedFile*> completed;
+	{
+		std::lock_guard lock(m_queueMutex);
+		completed.swap(m_completed);
+	}
+
+	bool reloaded = false;
+	for (WatchedFile* file : completed)
+	{
+		file->compiling = false;
+		// время изменилось, содержимое нет
+		if (file->chunkHash == file->sourceHash) continue;
+		file->sourceHash = file->chunkHash;
+
+		const auto start = std::chrono::steady_clock::now();
+		Function* main = file->chunk.empty() ? nullptr : LoadChunk(m_vm, file->chunk.data(), file->chunk.size(), file->path);
+		std::vector<std::byte>().swap(file->chunk);
+		// ошибка компиляции уже в логе, старый код продолжает работать
+		if (!main || !m_vm.RunMain(main, true))
+		{
+			m_statistics.failedReloads++;
+			LOG_WARNING(Script, "Script reload failed: {}", file->path);
+			continue;
+		}
+		m_statistics.reloads++;
+		m_statistics.lastReloadMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		LOG_INFO(Script, "Script reloaded: {} ({:.2f} ms on the game thread)", file->path, m_statistics.lastReloadMilliseconds);
+		reloaded = true;
+	}
+
+	const auto now = std::chrono::steady_clock::now();
+	if (!m_settings.hotReload || std::chrono::duration<double>(now - m_lastPoll).count() < m_settings.pollInterval) return reloaded;
+	m_lastPoll = now;
+
+	bool queued = false;
+	for (const std::unique_ptr<WatchedFile>& file : m_files)
+	{
+		if (file->compiling) continue;
+		std::error_code error;
+		const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(file->path, error);
+		if (error || writeTime == file->writeTime) continue;
+
+		file->writeTime = writeTime;
+		file->compiling = true;
+		std::lock_guard lock(m_queueMutex);
+		m_queue.push_back(file.get());
+		queued = true;
+	}
+	if (queued) m_queueCondition.notify_one();
+	return reloaded;
+}
+//=============================================================================
+void script::ScriptLoader::compilerThread()
+{
+	profiler::SetThreadName("Script compiler");
+
+	while (true)
+	{
+		WatchedFile* file = nullptr;
+		{
+			std::unique_lock lock(m_queueMutex);
+			m_queueCondition.wait(lock, [this] { return m_stopThread || !m_queue.empty(); });
+			if (m_stopThread) return;
+			file = m_queue.front();
+			m_queue.erase(m_queue.begin());
+		}
+		recompile(*file);
+	}
+}
+//=============================================================================
+std::string script::ScriptLoader::getCachePath(uint64_t sourceHash) const
+{
+	return std::format("{}/{:016x}.sbc", m_settings.cacheDirectory, sourceHash);
+}
+//=============================================================================
+void script::ScriptLoader::recompile(WatchedFile& file)
+{
+	PROFILE_FUNCTION();
+
+	std::string source;
+	file.chunk.clear();
+	// файл может быть занят редактором посреди сохранения: следующая запись снова сменит время
+	file.chunkHash = readSource(file.path, source) ? HashSource(source) : file.sourceHash;
+
+	if (file.chunkHash != file.sourceHash)
+	{
+		// возврат к уже встречавшейся версии - байткод из кэша
+		const std::string cachePath = getCachePath(file.chunkHash);
+		std::error_code error;
+		MappedFile cached;
+		if (m_settings.useCache && std::filesystem::exists(cachePath, error) && cached.Open(cachePath))
+			file.chunk.assign(cached.GetData(), cached.GetData() + cached.GetSize());
+		else
+		{
+			// отдельная ВМ: основная принадлежит потоку игры. Слоты глобальных в байткоде относительные,
+			// поэтому скомпилированное здесь загружается в основную ВМ
+			VM compiler;
+			Function* main = compiler.Compile(source, file.path);
+			if (main && SaveChunk(compiler, main, file.chunkHash, file.chunk) && m_settings.useCache)
+				storeChunk(file.chunkHash, file.chunk);
+		}
+	}
+
+	std::lock_guard lock(m_queueMutex);
+	m_completed.push_back(&file);
+}
+//=============================================================================
+void script::ScriptLoader::storeChunk(uint64_t sourceHash, const std::vector<std::byte>& chunk) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(m_settings.cacheDirectory, error);
+
+	// запись во временный файл и переименование: читатель не увидит половину байткода.
+	// Имя временного файла по потоку: тот же исходник может записывать и поток игры, и поток компиляции
+	const std::string path = getCachePath(sourceHash);
+	const std::string temporaryPath = std::format("{}.{}.tmp", path, jobs::GetThreadIndex());
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(chunk.data()), (std::streamsize)chunk.size());
+		if (!file)
+		{
+			LOG_WARNING(Script, "Failed to write script cache: {}", temporaryPath);
+			return;
+		}
+	}
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error)
+	{
+		LOG_WARNING(Script, "Failed to write script cache: {} ({})", path, error.message());
+		std::filesystem::remove(temporaryPath, error);
+	}
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,111 @@
+﻿#pragma once
+
+#include "ScriptVM.h"
+
+namespace script
+{
+	// Файл байткода (.sbc), little-endian. Имя файла - хеш исходника: правка дает новый ключ, старые записи
+	// просто не читаются. За заголовком - поток uint32: строки (длина, символы с выравниванием до 4),
+	// глобальные (номер строки имени), классы (имя, число методов, пары имя - номер функции), функции
+	// (имя, arity | registerCount << 8, число команд, команды, строки, константы с тегом). Функция 0 - главная.
+	// В командах вместо слотов глобальных - номера в таблице файла, при загрузке заменяются слотами ВМ
+	struct ScriptChunkHeader final
+	{
+		static constexpr uint32_t MagicValue = 'S' | ('B' << 8) | ('C' << 16) | ('1' << 24);
+		static constexpr uint32_t CurrentVersion = 1;
+
+		uint32_t magic;
+		uint32_t version;
+		uint32_t opCount;       // Op::Count при записи: другой набор команд - другой байткод
+		uint32_t stringCount;
+		uint64_t sourceHash;
+		uint32_t globalCount;
+		uint32_t classCount;
+		uint32_t functionCount;
+		uint32_t dataSize;      // байт после заголовка
+	};
+
+	uint64_t HashSource(std::string_view source);
+
+	// Байткод главной функции и всего, что достижимо из нее через константы. false - константа,
+	// которую нельзя сохранить (такой компилятор не создает)
+	bool SaveChunk(const VM& vm, Function* main, uint64_t sourceHash, std::vector<std::byte>& chunk);
+	// Функции и классы в ВМ из байткода, nullptr - данные повреждены
+	Function* LoadChunk(VM& vm, const std::byte* data, size_t size, const std::string& chunkName);
+
+	// Время компиляции и загрузки байткода для всех *.script каталога, результат в лог
+	bool RunCacheBenchmark(const std::string& directory);
+
+	// Сценарии через кэш байткода и перезагрузка без перезапуска. При загрузке исходник хешируется, байткод
+	// с тем же хешем читается из отображенного файла кэша без компиляции, промах компилируется и пишется в кэш.
+	// Update() раз в pollInterval сверяет время изменения файлов; измененный файл компилируется в фоновом потоке
+	// в отдельной ВМ, а на границе кадра его байткод загружается и главная функция выполняется в режиме
+	// перезагрузки (см. VM::RunMain): функции и методы заменяются, глобальные и экземпляры сохраняют состояние
+	class ScriptLoader final
+	{
+	public:
+		struct Settings final
+		{
+			std::string cacheDirectory{ "data/scripts/cache" };
+			bool        useCache{ true };
+			bool        hotReload{ true };
+			double      pollInterval{ 0.5 }; // секунд
+		};
+
+		struct Statistics final
+		{
+			uint32_t cacheHits{ 0 };
+			uint32_t cacheMisses{ 0 };
+			uint32_t reloads{ 0 };
+			uint32_t failedReloads{ 0 };
+			double   loadMilliseconds{ 0.0 };  // все RunFile, вместе с выполнением главных функций
+			double   lastReloadMilliseconds{ 0.0 };
+		};
+
+		// ВМ должна пережить загрузчик
+		ScriptLoader(VM& vm, const Settings& settings);
+		~ScriptLoader();
+		ScriptLoader(const ScriptLoader&) = delete;
+		ScriptLoader& operator=(const ScriptLoader&) = delete;
+
+		// Загружает и выполняет файл, дальше следит за его изменениями
+		bool RunFile(const std::string& path);
+		// Граница кадра, вне выполнения сценариев: применяет готовые перекомпиляции, запускает новые.
+		// true - хотя бы один файл перезагружен без ошибок
+		bool Update();
+
+		const Statistics& GetStatistics() const { return m_statistics; }
+
+	private:
+		struct WatchedFile final
+		{
+			std::string                     path;
+			std::filesystem::file_time_type writeTime;
+			uint64_t                        sourceHash{ 0 };
+			bool                            compiling{ false };
+			// заполняет фоновый поток
+			std::vector<std::byte>          chunk;
+			uint64_t                        chunkHash{ 0 };
+		};
+
+		std::string getCachePath(uint64_t sourceHash) const;
+		void compilerThread();
+		// Фоновый поток: чтение, компиляция в отдельной ВМ и запись в кэш
+		void recompile(WatchedFile& file);
+		void storeChunk(uint64_t sourceHash, const std::vector<std::byte>& chunk) const;
+
+		VM&                                       m_vm;
+		Settings                                  m_settings;
+		Statistics                                m_statistics;
+		std::vector<std::unique_ptr<WatchedFile>> m_files; // адреса не меняются, пока фоновый поток их заполняет
+		std::chrono::steady_clock::time_point     m_lastPoll;
+
+		// Поток компиляции
+		std::thread                               m_thread;
+		std::vector<WatchedFile*>                 m_queue;
+		std::vector<WatchedFile*>                 m_completed;
+		std::mutex                                m_queueMutex;
+		std::condition_variable                   m_queueCondition;
+		bool                                      m_stopThread{ false };
+	};
+}
\ No newline at end of file
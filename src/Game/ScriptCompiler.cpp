@@ -0,0 +1,1596 @@
+﻿#include "stdafx.h"
+#include "ScriptCompiler.h"
+#include "ScriptVM.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	using namespace script;
+	using namespace script::bytecode;
+
+	enum class Token : uint8_t
+	{
+		Eof,
+		Name,
+		Number,
+		String,
+		LeftParen,
+		RightParen,
+		LeftBrace,
+		RightBrace,
+		LeftBracket,
+		RightBracket,
+		Comma,
+		Dot,
+		DotDot,
+		Semicolon,
+		Plus,
+		Minus,
+		Star,
+		Slash,
+		Percent,
+		Assign,
+		PlusAssign,
+		MinusAssign,
+		StarAssign,
+		SlashAssign,
+		DotDotAssign,
+		Equal,
+		NotEqual,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual,
+		And,
+		Or,
+		Not,
+		Var,
+		Fn,
+		Class,
+		Return,
+		If,
+		Else,
+		While,
+		For,
+		In,
+		Break,
+		True,
+		False,
+		Nil,
+		This
+	};
+
+	constexpr std::pair<std::string_view, Token> Keywords[] = {
+		{ "and", Token::And }, { "or", Token::Or }, { "not", Token::Not }, { "var", Token::Var }, { "fn", Token::Fn },
+		{ "class", Token::Class }, { "return", Token::Return }, { "if", Token::If }, { "else", Token::Else },
+		{ "while", Token::While }, { "for", Token::For }, { "in", Token::In }, { "break", Token::Break },
+		{ "true", Token::True }, { "false", Token::False }, { "nil", Token::Nil }, { "this", Token::This }
+	};
+
+	constexpr uint32_t MaxRegisters = 250;
+	constexpr uint32_t MaxConstantOperand = 255; // K в поле C
+	constexpr uint32_t AppendBatch = 32;
+
+	class Lexer final
+	{
+	public:
+		struct State final
+		{
+			size_t   position{ 0 };
+			uint32_t line{ 1 };
+		};
+
+		explicit Lexer(std::string_view source) : m_source(source) {}
+
+		// false - недопустимый символ или незакрытая строка, описание в error
+		bool Next(Token& token, std::string& error);
+
+		std::string_view GetText() const { return m_text; }
+		double GetNumber() const { return m_number; }
+		const std::string& GetString() const { return m_string; }
+		uint32_t GetLine() const { return m_tokenLine; }
+		uint32_t GetCurrentLine() const { return m_state.line; }
+
+	private:
+		char peek(size_t offset = 0) const { return m_state.position + offset < m_source.size() ? m_source[m_state.position + offset] : '\0'; }
+		bool skipSpace(std::string& error);
+
+		std::string_view m_source;
+		State            m_state;
+		std::string_view m_text;
+		double           m_number{ 0.0 };
+		std::string      m_string;
+		uint32_t         m_tokenLine{ 1 };
+	};
+
+	// Место значения выражения до того, как оно попало в регистр. Так константы уходят в операнды K,
+	// а результат последней команды пишется сразу в нужный регистр без лишнего Move
+	enum class ExpKind : uint8_t
+	{
+		Void,
+		Nil,
+		True,
+		False,
+		Number,   // number
+		Constant, // info - K
+		Local,    // info - регистр локальной переменной
+		Global,   // info - слот
+		Field,    // info - регистр объекта, aux - K имени
+		Index,    // info - регистр объекта, aux - регистр ключа
+		Register, // info - временный регистр
+		Reloc     // info - номер команды, ее A еще не задан
+	};
+
+	struct ExpDesc final
+	{
+		ExpKind  kind{ ExpKind::Void };
+		uint32_t info{ 0 };
+		uint32_t aux{ 0 };
+		double   number{ 0.0 };
+	};
+
+	enum class BinaryOp : uint8_t
+	{
+		None,
+		Add,
+		Sub,
+		Mul,
+		Div,
+		Mod,
+		Concat,
+		Equal,
+		NotEqual,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual,
+		And,
+		Or
+	};
+
+	// Приоритеты слева и справа; у склейки правый меньше - правая ассоциативность
+	struct Priority final
+	{
+		uint8_t left;
+		uint8_t right;
+	};
+	constexpr Priority Priorities[] = {
+		{ 0, 0 },                                 // None
+		{ 6, 6 }, { 6, 6 }, { 7, 7 }, { 7, 7 }, { 7, 7 }, // + - * / %
+		{ 5, 4 },                                 // ..
+		{ 3, 3 }, { 3, 3 }, { 3, 3 }, { 3, 3 }, { 3, 3 }, { 3, 3 }, // == != < <= > >=
+		{ 2, 2 }, { 1, 1 }                        // and or
+	};
+	constexpr uint8_t UnaryPriority = 8;
+
+	struct LocalVariable final
+	{
+		String*  name; // nullptr - скрытая переменная цикла
+		uint32_t reg;
+	};
+
+	struct LoopState final
+	{
+		std::vector<uint32_t> breaks;
+		uint32_t              localCount;
+	};
+
+	struct FunctionState final
+	{
+		FunctionState*                         parent{ nullptr };
+		Function*                              function{ nullptr };
+		std::vector<LocalVariable>             locals;
+		std::vector<LoopState>                 loops;
+		std::unordered_map<uint64_t, uint32_t> constantIndices;
+		uint32_t                               freeRegister{ 0 };
+		uint32_t                               scopeDepth{ 0 };
+		bool                                   script{ false }; // главная функция файла
+		bool                                   method{ false };
+	};
+
+	class Compiler final
+	{
+	public:
+		Compiler(VM& vm, std::string_view source, String* chunkName)
+			: m_vm(vm)
+			, m_lexer(source)
+			, m_chunkName(chunkName)
+		{
+		}
+
+		Function* Compile();
+
+	private:
+		// лексемы
+		void advance();
+		bool check(Token token) const { return m_token == token; }
+		bool match(Token token);
+		void expect(Token token, const char* what);
+		Token peekToken();
+		template<typename... Args>
+		void error(std::format_string<Args...> format, Args&&... args);
+
+		// функции и области видимости
+		Function* compileFunction(String* name, bool method);
+		void beginScope() { m_state->scopeDepth++; }
+		void endScope(uint32_t localCount);
+		void addLocal(String* name, uint32_t reg) { m_state->locals.push_back({ name, reg }); }
+		bool isScriptLevel() const { return m_state->script && m_state->scopeDepth == 0; }
+
+		// команды и регистры
+		uint32_t emit(uint32_t instruction);
+		uint32_t emitJump(Op op, uint32_t a = 0) { return emit(EncodeSBx(op, a, 0)); }
+		void patchJump(uint32_t jump, uint32_t target);
+		void patchJumpHere(uint32_t jump) { patchJump(jump, currentPc()); }
+		uint32_t currentPc() const { return (uint32_t)m_state->function->code.size(); }
+		uint32_t addConstant(Value value);
+		uint32_t numberConstant(double number) { return addConstant(Value::Number(number)); }
+		uint32_t stringConstant(std::string_view text) { return addConstant(Value::FromObject(m_vm.Intern(text))); }
+		void reserveRegisters(uint32_t count);
+		void freeRegister(uint32_t reg);
+		void freeExpression(const ExpDesc& e);
+		uint32_t activeLocals() const { return (uint32_t)m_state->locals.size(); }
+
+		// выражения в регистры
+		void discharge(ExpDesc& e);
+		void toRegister(ExpDesc& e, uint32_t reg);
+		uint32_t toNextRegister(ExpDesc& e);
+		uint32_t toAnyRegister(ExpDesc& e);
+		// номер K для операнда C, если выражение - константа с маленьким номером
+		bool toConstantOperand(const ExpDesc& e, uint32_t& constant, bool numbersOnly);
+		void storeTo(const ExpDesc& target, ExpDesc& value);
+
+		// разбор
+		void statement();
+		void block();
+		void varStatement();
+		void functionStatement();
+		void classStatement();
+		void ifStatement();
+		void whileStatement();
+		void forStatement();
+		void numericFor(String* name);
+		void iteratorFor(String* keyName);
+		void returnStatement();
+		void breakStatement();
+		void expressionStatement();
+		uint32_t condition();
+		void loopBody(uint32_t localCount);
+
+		void expression(ExpDesc& e) { subExpression(e, 0); }
+		BinaryOp subExpression(ExpDesc& e, uint8_t limit);
+		void unary(Token op, ExpDesc& e);
+		void infix(BinaryOp op, ExpDesc& left);
+		void postfix(BinaryOp op, ExpDesc& left, ExpDesc& right, uint32_t line);
+		void arithmetic(BinaryOp op, ExpDesc& left, ExpDesc& right);
+		void comparison(BinaryOp op, ExpDesc& left, ExpDesc& right);
+		void suffixedExpression(ExpDesc& e);
+		void primaryExpression(ExpDesc& e);
+		void resolveName(String* name, ExpDesc& e);
+		void call(ExpDesc& e);
+		void invoke(ExpDesc& object, String* name);
+		uint32_t arguments(uint32_t firstArgument);
+		void tableConstructor(ExpDesc& e);
+		void arrayConstructor(ExpDesc& e);
+		void flushAppend(uint32_t table, uint32_t& pending);
+
+		VM&              m_vm;
+		Lexer            m_lexer;
+		String*          m_chunkName;
+		FunctionState*   m_state{ nullptr };
+		Token            m_token{ Token::Eof };
+		uint32_t         m_line{ 1 };          // строка текущей лексемы
+		uint32_t         m_previousLine{ 1 };  // строка предыдущей, ей помечаются команды
+		bool             m_failed{ false };
+	};
+}
+//=============================================================================
+bool Lexer::skipSpace(std::string& error)
+{
+	for (;;)
+	{
+		const char c = peek();
+		if (c == '\n')
+		{
+			m_state.line++;
+			m_state.position++;
+		}
+		else if (c == ' ' || c == '\t' || c == '\r')
+			m_state.position++;
+		else if (c == '/' && peek(1) == '/')
+		{
+			while (peek() != '\n' && peek() != '\0') m_state.position++;
+		}
+		else if (c == '/' && peek(1) == '*')
+		{
+			m_state.position += 2;
+			while (!(peek() == '*' && peek(1) == '/'))
+			{
+				if (peek() == '\0')
+				{
+					error = "unterminated comment";
+					return false;
+				}
+				if (peek() == '\n') m_state.line++;
+				m_state.position++;
+			}
+			m_state.position += 2;
+		}
+		else
+			return true;
+	}
+}
+//=============================================================================
+bool Lexer::Next(Token& token, std::string& error)
+{
+	if (!skipSpace(error)) return false;
+
+	const size_t start = m_state.position;
+	m_tokenLine = m_state.line;
+	const char c = peek();
+	auto finish = [&](Token result, size_t length)
+	{
+		m_state.position += length;
+		m_text = m_source.substr(start, m_state.position - start);
+		token = result;
+		return true;
+	};
+
+	if (c == '\0')
+	{
+		m_text = "end of file";
+		token = Token::Eof;
+		return true;
+	}
+
+	if (std::isalpha((unsigned char)c) || c == '_')
+	{
+		size_t length = 1;
+		while (std::isalnum((unsigned char)peek(length)) || peek(length) == '_') length++;
+		const std::string_view word = m_source.substr(start, length);
+		for (const auto& [keyword, keywordToken] : Keywords)
+		{
+			if (word == keyword) return finish(keywordToken, length);
+		}
+		return finish(Token::Name, length);
+	}
+
+	if (std::isdigit((unsigned char)c) || (c == '.' && std::isdigit((unsigned char)peek(1))))
+	{
+		size_t length = 0;
+		while (std::isdigit((unsigned char)peek(length))) length++;
+		// "1..2" - склейка, а не дробная часть
+		if (peek(length) == '.' && peek(length + 1) != '.')
+		{
+			length++;
+			while (std::isdigit((unsigned char)peek(length))) length++;
+		}
+		if (peek(length) == 'e' || peek(length) == 'E')
+		{
+			size_t exponent = length + 1;
+			if (peek(exponent) == '+' || peek(exponent) == '-') exponent++;
+			if (std::isdigit((unsigned char)peek(exponent)))
+			{
+				length = exponent;
+				while (std::isdigit((unsigned char)peek(length))) length++;
+			}
+		}
+		const std::string_view text = m_source.substr(start, length);
+		std::from_chars(text.data(), text.data() + text.size(), m_number);
+		return finish(Token::Number, length);
+	}
+
+	if (c == '"')
+	{
+		m_string.clear();
+		size_t length = 1;
+		for (;;)
+		{
+			const char s = peek(length);
+			if (s == '\0' || s == '\n')
+			{
+				error = "unterminated string";
+				return false;
+			}
+			length++;
+			if (s == '"') break;
+			if (s != '\\')
+			{
+				m_string.push_back(s);
+				continue;
+			}
+			const char escape = peek(length++);
+			switch (escape)
+			{
+			case 'n': m_string.push_back('\n'); break;
+			case 't': m_string.push_back('\t'); break;
+			case 'r': m_string.push_back('\r'); break;
+			case '0': m_string.push_back('\0'); break;
+			case '"': m_string.push_back('"'); break;
+			case '\\': m_string.push_back('\\'); break;
+			default:
+				error = std::format("invalid escape sequence '\\{}'", escape);
+				return false;
+			}
+		}
+		return finish(Token::String, length);
+	}
+
+	const char next = peek(1);
+	switch (c)
+	{
+	case '(': return finish(Token::LeftParen, 1);
+	case ')': return finish(Token::RightParen, 1);
+	case '{': return finish(Token::LeftBrace, 1);
+	case '}': return finish(Token::RightBrace, 1);
+	case '[': return finish(Token::LeftBracket, 1);
+	case ']': return finish(Token::RightBracket, 1);
+	case ',': return finish(Token::Comma, 1);
+	case ';': return finish(Token::Semicolon, 1);
+	case '%': return finish(Token::Percent, 1);
+	case '.':
+		if (next != '.') return finish(Token::Dot, 1);
+		return peek(2) == '=' ? finish(Token::DotDotAssign, 3) : finish(Token::DotDot, 2);
+	case '+': return next == '=' ? finish(Token::PlusAssign, 2) : finish(Token::Plus, 1);
+	case '-': return next == '=' ? finish(Token::MinusAssign, 2) : finish(Token::Minus, 1);
+	case '*': return next == '=' ? finish(Token::StarAssign, 2) : finish(Token::Star, 1);
+	case '/': return next == '=' ? finish(Token::SlashAssign, 2) : finish(Token::Slash, 1);
+	case '=': return next == '=' ? finish(Token::Equal, 2) : finish(Token::Assign, 1);
+	case '<': return next == '=' ? finish(Token::LessEqual, 2) : finish(Token::Less, 1);
+	case '>': return next == '=' ? finish(Token::GreaterEqual, 2) : finish(Token::Greater, 1);
+	case '!':
+		if (next == '=') return finish(Token::NotEqual, 2);
+		break;
+	default:
+		break;
+	}
+	error = std::format("unexpected character '{}'", c);
+	return false;
+}
+//=============================================================================
+Function* Compiler::Compile()
+{
+	FunctionState state;
+	state.function = m_vm.NewFunction(m_vm.Intern("main"), m_chunkName);
+	state.script = true;
+	m_state = &state;
+
+	advance();
+	while (!check(Token::Eof))
+		statement();
+	emit(Encode(Op::ReturnNil, 0, 0, 0));
+	state.function->registerCount = (uint8_t)std::max<uint32_t>(state.function->registerCount, 1);
+
+	m_state = nullptr;
+	return m_failed ? nullptr : state.function;
+}
+//=============================================================================
+void Compiler::advance()
+{
+	m_previousLine = m_line;
+	if (m_failed)
+	{
+		m_token = Token::Eof;
+		return;
+	}
+	std::string message;
+	if (!m_lexer.Next(m_token, message))
+	{
+		m_line = m_lexer.GetCurrentLine();
+		error("{}", message);
+		return;
+	}
+	m_line = m_lexer.GetLine();
+}
+//=============================================================================
+bool Compiler::match(Token token)
+{
+	if (!check(token)) return false;
+	advance();
+	return true;
+}
+//=============================================================================
+void Compiler::expect(Token token, const char* what)
+{
+	if (!match(token)) error("expected {} near '{}'", what, m_lexer.GetText());
+}
+//=============================================================================
+Token Compiler::peekToken()
+{
+	// копия лексера: текст и значение текущей лексемы остаются на месте
+	Lexer lexer = m_lexer;
+	Token token = Token::Eof;
+	std::string message;
+	if (!lexer.Next(token, message)) token = Token::Eof;
+	return token;
+}
+//=============================================================================
+template<typename... Args>
+void Compiler::error(std::format_string<Args...> format, Args&&... args)
+{
+	if (m_failed) return;
+	m_failed = true;
+	m_token = Token::Eof;
+	LOG_ERROR(Script, "{}:{}: {}", m_chunkName->GetView(), m_line, std::format(format, std::forward<Args>(args)...));
+}
+//=============================================================================
+uint32_t Compiler::emit(uint32_t instruction)
+{
+	Function* function = m_state->function;
+	function->code.push_back(instruction);
+	function->lines.push_back(m_previousLine);
+	return (uint32_t)function->code.size() - 1;
+}
+//=============================================================================
+void Compiler::patchJump(uint32_t jump, uint32_t target)
+{
+	const int32_t offset = (int32_t)target - (int32_t)(jump + 1);
+	if (offset < -JumpBias || offset > JumpBias)
+	{
+		error("jump too long");
+		return;
+	}
+	uint32_t& instruction = m_state->function->code[jump];
+	instruction = EncodeSBx(GetOp(instruction), GetA(instruction), offset);
+}
+//=============================================================================
+uint32_t Compiler::addConstant(Value value)
+{
+	// функции и классы не повторяются, остальное - по битам значения
+	const bool unique = value.Is(ObjectType::Function) || value.Is(ObjectType::Class);
+	if (!unique)
+	{
+		const auto found = m_state->constantIndices.find(value.GetBits());
+		if (found != m_state->constantIndices.end()) return found->second;
+	}
+	std::vector<Value>& constants = m_state->function->constants;
+	if (constants.size() > 0xffff)
+	{
+		error("too many constants in function");
+		return 0;
+	}
+	constants.push_back(value);
+	const uint32_t index = (uint32_t)constants.size() - 1;
+	if (!unique) m_state->constantIndices.emplace(value.GetBits(), index);
+	return index;
+}
+//=============================================================================
+void Compiler::reserveRegisters(uint32_t count)
+{
+	m_state->freeRegister += count;
+	if (m_state->freeRegister > MaxRegisters)
+	{
+		error("function or expression needs too many registers");
+		m_state->freeRegister = MaxRegisters;
+	}
+	uint8_t& registerCount = m_state->function->registerCount;
+	registerCount = (uint8_t)std::max<uint32_t>(registerCount, m_state->freeRegister);
+}
+//=============================================================================
+void Compiler::freeRegister(uint32_t reg)
+{
+	// временные регистры освобождаются в обратном порядке, локальные переменные живут до конца блока
+	if (reg >= activeLocals() && !m_failed)
+	{
+		assert(reg == m_state->freeRegister - 1);
+		m_state->freeRegister--;
+	}
+}
+//=============================================================================
+void Compiler::freeExpression(const ExpDesc& e)
+{
+	if (e.kind == ExpKind::Register) freeRegister(e.info);
+}
+//=============================================================================
+void Compiler::discharge(ExpDesc& e)
+{
+	switch (e.kind)
+	{
+	case ExpKind::Global:
+		e = { ExpKind::Reloc, emit(EncodeBx(Op::GetGlobal, 0, e.info)) };
+		break;
+	case ExpKind::Field:
+		freeRegister(e.info);
+		e = { ExpKind::Reloc, emit(Encode(Op::GetField, 0, e.info, e.aux)) };
+		break;
+	case ExpKind::Index:
+		if (e.aux > e.info)
+		{
+			freeRegister(e.aux);
+			freeRegister(e.info);
+		}
+		else
+		{
+			freeRegister(e.info);
+			freeRegister(e.aux);
+		}
+		e = { ExpKind::Reloc, emit(Encode(Op::GetIndex, 0, e.info, e.aux)) };
+		break;
+	default:
+		break;
+	}
+}
+//=============================================================================
+void Compiler::toRegister(ExpDesc& e, uint32_t reg)
+{
+	discharge(e);
+	switch (e.kind)
+	{
+	case ExpKind::Nil: emit(Encode(Op::LoadNil, reg, 0, 0)); break;
+	case ExpKind::True: emit(Encode(Op::LoadTrue, reg, 0, 0)); break;
+	case ExpKind::False: emit(Encode(Op::LoadFalse, reg, 0, 0)); break;
+	case ExpKind::Number: emit(EncodeBx(Op::LoadK, reg, numberConstant(e.number))); break;
+	case ExpKind::Constant: emit(EncodeBx(Op::LoadK, reg, e.info)); break;
+	case ExpKind::Reloc:
+	{
+		uint32_t& instruction = m_state->function->code[e.info];
+		instruction = (instruction & ~0xff00u) | reg << 8;
+		break;
+	}
+	case ExpKind::Local:
+	case ExpKind::Register:
+		if (e.info != reg) emit(Encode(Op::Move, reg, e.info, 0));
+		break;
+	default:
+		error("expression has no value");
+		break;
+	}
+	e = { ExpKind::Register, reg };
+}
+//=============================================================================
+uint32_t Compiler::toNextRegister(ExpDesc& e)
+{
+	discharge(e);
+	freeExpression(e);
+	reserveRegisters(1);
+	toRegister(e, m_state->freeRegister - 1);
+	return e.info;
+}
+//=============================================================================
+uint32_t Compiler::toAnyRegister(ExpDesc& e)
+{
+	discharge(e);
+	if (e.kind == ExpKind::Local || e.kind == ExpKind::Register) return e.info;
+	return toNextRegister(e);
+}
+//=============================================================================
+bool Compiler::toConstantOperand(const ExpDesc& e, uint32_t& constant, bool numbersOnly)
+{
+	if (e.kind == ExpKind::Number)
+		constant = numberConstant(e.number);
+	else if (e.kind == ExpKind::Constant && !numbersOnly)
+		constant = e.info;
+	else
+		return false;
+	return constant <= MaxConstantOperand;
+}
+//=============================================================================
+void Compiler::storeTo(const ExpDesc& target, ExpDesc& value)
+{
+	switch (target.kind)
+	{
+	case ExpKind::Local:
+		freeExpression(value);
+		toRegister(value, target.info);
+		return;
+	case ExpKind::Global:
+		emit(EncodeBx(Op::SetGlobal, toAnyRegister(value), target.info));
+		break;
+	case ExpKind::Field:
+		emit(Encode(Op::SetField, target.info, target.aux, toAnyRegister(value)));
+		break;
+	case ExpKind::Index:
+		emit(Encode(Op::SetIndex, target.info, target.aux, toAnyRegister(value)));
+		break;
+	default:
+		error("cannot assign to this expression");
+		return;
+	}
+	freeExpression(value);
+}
+//=============================================================================
+Function* Compiler::compileFunction(String* name, bool method)
+{
+	FunctionState state;
+	state.parent = m_state;
+	state.function = m_vm.NewFunction(name, m_chunkName);
+	state.method = method;
+	m_state = &state;
+
+	// this - нулевой регистр метода, затем параметры
+	if (method)
+	{
+		addLocal(m_vm.Intern("this"), 0);
+		reserveRegisters(1);
+	}
+	expect(Token::LeftParen, "'(' after function name");
+	if (!check(Token::RightParen))
+	{
+		do
+		{
+			if (!check(Token::Name))
+			{
+				error("expected parameter name near '{}'", m_lexer.GetText());
+				break;
+			}
+			addLocal(m_vm.Intern(m_lexer.GetText()), activeLocals());
+			reserveRegisters(1);
+			advance();
+		} while (match(Token::Comma));
+	}
+	expect(Token::RightParen, "')' after parameters");
+	state.function->arity = (uint8_t)activeLocals();
+
+	expect(Token::LeftBrace, "'{' before function body");
+	state.scopeDepth = 1;
+	while (!check(Token::RightBrace) && !check(Token::Eof))
+		statement();
+	expect(Token::RightBrace, "'}' after function body");
+	emit(Encode(Op::ReturnNil, 0, 0, 0));
+
+	m_state = state.parent;
+	return state.function;
+}
+//=============================================================================
+void Compiler::endScope(uint32_t localCount)
+{
+	m_state->scopeDepth--;
+	m_state->locals.resize(localCount);
+	m_state->freeRegister = localCount;
+}
+//=============================================================================
+void Compiler::statement()
+{
+	switch (m_token)
+	{
+	case Token::Var: varStatement(); break;
+	case Token::Fn: functionStatement(); break;
+	case Token::Class: classStatement(); break;
+	case Token::If: ifStatement(); break;
+	case Token::While: whileStatement(); break;
+	case Token::For: forStatement(); break;
+	case Token::Return: returnStatement(); break;
+	case Token::Break: breakStatement(); break;
+	case Token::LeftBrace: block(); break;
+	case Token::Semicolon: advance(); break;
+	default: expressionStatement(); break;
+	}
+	// временные регистры выражений не переживают оператор
+	m_state->freeRegister = activeLocals();
+}
+//=============================================================================
+void Compiler::block()
+{
+	expect(Token::LeftBrace, "'{'");
+	const uint32_t localCount = activeLocals();
+	beginScope();
+	while (!check(Token::RightBrace) && !check(Token::Eof))
+		statement();
+	expect(Token::RightBrace, "'}'");
+	endScope(localCount);
+}
+//=============================================================================
+void Compiler::varStatement()
+{
+	advance();
+	if (!check(Token::Name))
+	{
+		error("expected variable name near '{}'", m_lexer.GetText());
+		return;
+	}
+	String* name = m_vm.Intern(m_lexer.GetText());
+	advance();
+
+	ExpDesc value{ ExpKind::Nil };
+	if (match(Token::Assign)) expression(value);
+
+	if (isScriptLevel())
+	{
+		// не SetGlobal: перезагрузка файла не сбрасывает состояние сценария
+		emit(EncodeBx(Op::DefineGlobal, toAnyRegister(value), m_vm.GetGlobalSlot(name)));
+		freeExpression(value);
+		return;
+	}
+	// переменная видна только после инициализатора: "var x = x" читает внешнюю x
+	const uint32_t reg = toNextRegister(value);
+	assert(m_failed || reg == activeLocals());
+	addLocal(name, reg);
+}
+//=============================================================================
+void Compiler::functionStatement()
+{
+	advance();
+	if (!check(Token::Name))
+	{
+		error("expected function name near '{}'", m_lexer.GetText());
+		return;
+	}
+	if (!isScriptLevel())
+	{
+		error("functions can only be declared at script level");
+		return;
+	}
+	String* name = m_vm.Intern(m_lexer.GetText());
+	advance();
+
+	Function* function = compileFunction(name, false);
+	ExpDesc value{ ExpKind::Constant, addConstant(Value::FromObject(function)) };
+	const ExpDesc target{ ExpKind::Global, m_vm.GetGlobalSlot(name) };
+	storeTo(target, value);
+}
+//=============================================================================
+void Compiler::classStatement()
+{
+	advance();
+	if (!check(Token::Name))
+	{
+		error("expected class name near '{}'", m_lexer.GetText());
+		return;
+	}
+	if (!isScriptLevel())
+	{
+		error("classes can only be declared at script level");
+		return;
+	}
+	String* name = m_vm.Intern(m_lexer.GetText());
+	advance();
+
+	// класс собирается при компиляции, выполнение только связывает его с глобальной
+	Class* klass = m_vm.NewClass(name);
+	expect(Token::LeftBrace, "'{' after class name");
+	while (!check(Token::RightBrace) && !check(Token::Eof))
+	{
+		expect(Token::Fn, "method declaration");
+		if (!check(Token::Name))
+		{
+			error("expected method name near '{}'", m_lexer.GetText());
+			break;
+		}
+		String* methodName = m_vm.Intern(m_lexer.GetText());
+		advance();
+		Function* method = compileFunction(methodName, true);
+		klass->methods.Set(Value::FromObject(methodName), Value::FromObject(method));
+	}
+	expect(Token::RightBrace, "'}' after class body");
+
+	ExpDesc value{ ExpKind::Constant, addConstant(Value::FromObject(klass)) };
+	emit(EncodeBx(Op::DefineClass, toAnyRegister(value), m_vm.GetGlobalSlot(name)));
+}
+//=============================================================================
+uint32_t Compiler::condition()
+{
+	ExpDesc e;
+	expression(e);
+	const uint32_t reg = toAnyRegister(e);
+	freeExpression(e);
+	return emitJump(Op::JumpIfNot, reg);
+}
+//=============================================================================
+void Compiler::ifStatement()
+{
+	advance();
+	const uint32_t skipThen = condition();
+	block();
+	if (!match(Token::Else))
+	{
+		patchJumpHere(skipThen);
+		return;
+	}
+	const uint32_t skipElse = emitJump(Op::Jump);
+	patchJumpHere(skipThen);
+	if (check(Token::If))
+		ifStatement();
+	else
+		block();
+	patchJumpHere(skipElse);
+}
+//=============================================================================
+void Compiler::loopBody(uint32_t localCount)
+{
+	m_state->loops.push_back({ {}, localCount });
+	block();
+}
+//=============================================================================
+void Compiler::whileStatement()
+{
+	advance();
+	const uint32_t start = currentPc();
+	const uint32_t exit = condition();
+	loopBody(activeLocals());
+	patchJump(emitJump(Op::Jump), start);
+	patchJumpHere(exit);
+
+	for (uint32_t jump : m_state->loops.back().breaks) patchJumpHere(jump);
+	m_state->loops.pop_back();
+}
+//=============================================================================
+void Compiler::forStatement()
+{
+	advance();
+	if (!check(Token::Name))
+	{
+		error("expected loop variable near '{}'", m_lexer.GetText());
+		return;
+	}
+	String* name = m_vm.Intern(m_lexer.GetText());
+	advance();
+
+	const uint32_t localCount = activeLocals();
+	beginScope();
+	if (check(Token::Assign))
+		numericFor(name);
+	else
+		iteratorFor(name);
+	endScope(localCount);
+}
+//=============================================================================
+void Compiler::numericFor(String* name)
+{
+	advance();
+	// скрытые счетчик, предел и шаг, затем видимая переменная - копия счетчика
+	const uint32_t base = m_state->freeRegister;
+	ExpDesc e;
+	expression(e);
+	toNextRegister(e);
+	expect(Token::Comma, "',' after loop start");
+	expression(e);
+	toNextRegister(e);
+	if (match(Token::Comma))
+		expression(e);
+	else
+		e = { ExpKind::Number, 0, 0, 1.0 };
+	toNextRegister(e);
+	for (uint32_t i = 0; i < 3; i++) addLocal(nullptr, base + i);
+
+	const uint32_t prepare = emitJump(Op::ForPrep, base);
+	reserveRegisters(1);
+	addLocal(name, base + 3);
+	const uint32_t bodyStart = currentPc();
+	loopBody(activeLocals());
+	patchJumpHere(prepare);
+	patchJump(emitJump(Op::ForLoop, base), bodyStart);
+
+	for (uint32_t jump : m_state->loops.back().breaks) patchJumpHere(jump);
+	m_state->loops.pop_back();
+}
+//=============================================================================
+void Compiler::iteratorFor(String* keyName)
+{
+	String* valueName = nullptr;
+	if (match(Token::Comma))
+	{
+		if (!check(Token::Name))
+		{
+			error("expected loop variable near '{}'", m_lexer.GetText());
+			return;
+		}
+		valueName = m_vm.Intern(m_lexer.GetText());
+		advance();
+	}
+	expect(Token::In, "'=' or 'in' in for loop");
+
+	// скрытые объект и позиция обхода, затем ключ и значение
+	const uint32_t base = m_state->freeRegister;
+	ExpDesc e;
+	expression(e);
+	toNextRegister(e);
+	e = { ExpKind::Number, 0, 0, 0.0 };
+	toNextRegister(e);
+	addLocal(nullptr, base);
+	addLocal(nullptr, base + 1);
+	reserveRegisters(2);
+	addLocal(keyName, base + 2);
+	addLocal(valueName, base + 3);
+
+	const uint32_t prepare = emitJump(Op::Jump);
+	const uint32_t bodyStart = currentPc();
+	loopBody(activeLocals());
+	patchJumpHere(prepare);
+	patchJump(emitJump(Op::Iterate, base), bodyStart);
+
+	for (uint32_t jump : m_state->loops.back().breaks) patchJumpHere(jump);
+	m_state->loops.pop_back();
+}
+//=============================================================================
+void Compiler::returnStatement()
+{
+	advance();
+	if (check(Token::RightBrace) || check(Token::Semicolon) || check(Token::Eof))
+	{
+		emit(Encode(Op::ReturnNil, 0, 0, 0));
+		return;
+	}
+	ExpDesc e;
+	expression(e);
+	emit(Encode(Op::Return, toAnyRegister(e), 0, 0));
+}
+//=============================================================================
+void Compiler::breakStatement()
+{
+	advance();
+	if (m_state->loops.empty())
+	{
+		error("'break' outside of a loop");
+		return;
+	}
+	m_state->loops.back().breaks.push_back(emitJump(Op::Jump));
+}
+//=============================================================================
+void Compiler::expressionStatement()
+{
+	ExpDesc target;
+	suffixedExpression(target);
+
+	BinaryOp compound = BinaryOp::None;
+	switch (m_token)
+	{
+	case Token::PlusAssign: compound = BinaryOp::Add; break;
+	case Token::MinusAssign: compound = BinaryOp::Sub; break;
+	case Token::StarAssign: compound = BinaryOp::Mul; break;
+	case Token::SlashAssign: compound = BinaryOp::Div; break;
+	case Token::DotDotAssign: compound = BinaryOp::Concat; break;
+	default: break;
+	}
+
+	if (match(Token::Assign))
+	{
+		if (target.kind != ExpKind::Local && target.kind != ExpKind::Global && target.kind != ExpKind::Field && target.kind != ExpKind::Index)
+		{
+			error("cannot assign to this expression");
+			return;
+		}
+		ExpDesc value;
+		expression(value);
+		storeTo(target, value);
+	}
+	else if (compound != BinaryOp::None)
+	{
+		const uint32_t line = m_line;
+		advance();
+		// объект и ключ цели остаются в своих регистрах до записи результата
+		ExpDesc current = target;
+		if (target.kind == ExpKind::Field || target.kind == ExpKind::Index)
+		{
+			reserveRegisters(1);
+			const Op op = target.kind == ExpKind::Field ? Op::GetField : Op::GetIndex;
+			emit(Encode(op, m_state->freeRegister - 1, target.info, target.aux));
+			current = { ExpKind::Register, m_state->freeRegister - 1 };
+		}
+		else if (target.kind != ExpKind::Local && target.kind != ExpKind::Global)
+		{
+			error("cannot assign to this expression");
+			return;
+		}
+		// "x *= a + b" - это x = x * (a + b): правая часть разбирается целиком
+		infix(compound, current);
+		ExpDesc value;
+		expression(value);
+		postfix(compound, current, value, line);
+		storeTo(target, current);
+	}
+	else if (target.kind != ExpKind::Register || m_state->function->code.empty()
+		|| (GetOp(m_state->function->code.back()) != Op::Call && GetOp(m_state->function->code.back()) != Op::Invoke))
+	{
+		error("expected statement near '{}'", m_lexer.GetText());
+	}
+}
+//=============================================================================
+BinaryOp Compiler::subExpression(ExpDesc& e, uint8_t limit)
+{
+	if (check(Token::Minus) || check(Token::Not))
+	{
+		const Token op = m_token;
+		advance();
+		subExpression(e, UnaryPriority);
+		unary(op, e);
+	}
+	else
+		suffixedExpression(e);
+
+	for (;;)
+	{
+		BinaryOp op = BinaryOp::None;
+		switch (m_token)
+		{
+		case Token::Plus: op = BinaryOp::Add; break;
+		case Token::Minus: op = BinaryOp::Sub; break;
+		case Token::Star: op = BinaryOp::Mul; break;
+		case Token::Slash: op = BinaryOp::Div; break;
+		case Token::Percent: op = BinaryOp::Mod; break;
+		case Token::DotDot: op = BinaryOp::Concat; break;
+		case Token::Equal: op = BinaryOp::Equal; break;
+		case Token::NotEqual: op = BinaryOp::NotEqual; break;
+		case Token::Less: op = BinaryOp::Less; break;
+		case Token::LessEqual: op = BinaryOp::LessEqual; break;
+		case Token::Greater: op = BinaryOp::Greater; break;
+		case Token::GreaterEqual: op = BinaryOp::GreaterEqual; break;
+		case Token::And: op = BinaryOp::And; break;
+		case Token::Or: op = BinaryOp::Or; break;
+		default: break;
+		}
+		if (op == BinaryOp::None || Priorities[(size_t)op].left <= limit) return op;
+
+		const uint32_t line = m_line;
+		advance();
+		infix(op, e);
+		ExpDesc right;
+		subExpression(right, Priorities[(size_t)op].right);
+		postfix(op, e, right, line);
+	}
+}
+//=============================================================================
+void Compiler::unary(Token op, ExpDesc& e)
+{
+	if (op == Token::Minus)
+	{
+		if (e.kind == ExpKind::Number)
+		{
+			e.number = -e.number;
+			return;
+		}
+		const uint32_t reg = toAnyRegister(e);
+		freeExpression(e);
+		e = { ExpKind::Reloc, emit(Encode(Op::Neg, 0, reg, 0)) };
+		return;
+	}
+
+	switch (e.kind)
+	{
+	case ExpKind::Nil:
+	case ExpKind::False:
+		e = { ExpKind::True };
+		return;
+	case ExpKind::True:
+	case ExpKind::Number:
+	case ExpKind::Constant:
+		e = { ExpKind::False };
+		return;
+	default:
+		break;
+	}
+	const uint32_t reg = toAnyRegister(e);
+	freeExpression(e);
+	e = { ExpKind::Reloc, emit(Encode(Op::Not, 0, reg, 0)) };
+}
+//=============================================================================
+void Compiler::infix(BinaryOp op, ExpDesc& left)
+{
+	switch (op)
+	{
+	case BinaryOp::And:
+	case BinaryOp::Or:
+	{
+		// результат в одном регистре: левый операнд, а если он решил не все - правый поверх
+		const uint32_t reg = toNextRegister(left);
+		left.aux = emitJump(op == BinaryOp::And ? Op::JumpIfNot : Op::JumpIf, reg);
+		break;
+	}
+	default:
+		// числовая константа может уйти в операнд K или свернуться с правой
+		if (left.kind != ExpKind::Number) toAnyRegister(left);
+		break;
+	}
+}
+//=============================================================================
+void Compiler::postfix(BinaryOp op, ExpDesc& left, ExpDesc& right, uint32_t line)
+{
+	const uint32_t savedLine = m_previousLine;
+	m_previousLine = line;
+	switch (op)
+	{
+	case BinaryOp::And:
+	case BinaryOp::Or:
+	{
+		const uint32_t reg = left.info;
+		discharge(right);
+		freeExpression(right);
+		toRegister(right, reg);
+		patchJumpHere(left.aux);
+		left = { ExpKind::Register, reg };
+		break;
+	}
+	case BinaryOp::Equal:
+	case BinaryOp::NotEqual:
+	case BinaryOp::Less:
+	case BinaryOp::LessEqual:
+	case BinaryOp::Greater:
+	case BinaryOp::GreaterEqual:
+		comparison(op, left, right);
+		break;
+	default:
+		arithmetic(op, left, right);
+		break;
+	}
+	m_previousLine = savedLine;
+}
+//=============================================================================
+void Compiler::arithmetic(BinaryOp op, ExpDesc& left, ExpDesc& right)
+{
+	if (left.kind == ExpKind::Number && right.kind == ExpKind::Number && op != BinaryOp::Concat)
+	{
+		const double a = left.number;
+		const double b = right.number;
+		switch (op)
+		{
+		case BinaryOp::Add: left.number = a + b; return;
+		case BinaryOp::Sub: left.number = a - b; return;
+		case BinaryOp::Mul: left.number = a * b; return;
+		// деление на ноль остается выполнению: результат тот же, но константа NaN не попадет в таблицу констант
+		case BinaryOp::Div: if (b != 0.0) { left.number = a / b; return; } break;
+		case BinaryOp::Mod: if (b != 0.0) { left.number = a - std::floor(a / b) * b; return; } break;
+		default: break;
+		}
+	}
+
+	static constexpr Op RegisterOps[] = { Op::Add, Op::Sub, Op::Mul, Op::Div, Op::Mod, Op::Concat };
+	static constexpr Op ConstantOps[] = { Op::AddK, Op::SubK, Op::MulK, Op::DivK, Op::ModK, Op::Concat };
+	const size_t opIndex = (size_t)op - (size_t)BinaryOp::Add;
+	const bool commutative = op == BinaryOp::Add || op == BinaryOp::Mul;
+
+	uint32_t constant = 0;
+	if (op != BinaryOp::Concat && toConstantOperand(right, constant, true) && left.kind != ExpKind::Number)
+	{
+		const uint32_t reg = left.info;
+		freeExpression(left);
+		left = { ExpKind::Reloc, emit(Encode(ConstantOps[opIndex], 0, reg, constant)) };
+		return;
+	}
+	if (commutative && left.kind == ExpKind::Number && toConstantOperand(left, constant, true))
+	{
+		const uint32_t reg = toAnyRegister(right);
+		freeExpression(right);
+		left = { ExpKind::Reloc, emit(Encode(ConstantOps[opIndex], 0, reg, constant)) };
+		return;
+	}
+
+	const uint32_t rc = toAnyRegister(right);
+	const uint32_t rb = toAnyRegister(left);
+	if (rb > rc)
+	{
+		freeExpression(left);
+		freeExpression(right);
+	}
+	else
+	{
+		freeExpression(right);
+		freeExpression(left);
+	}
+	left = { ExpKind::Reloc, emit(Encode(RegisterOps[opIndex], 0, rb, rc)) };
+}
+//=============================================================================
+void Compiler::comparison(BinaryOp op, ExpDesc& left, ExpDesc& right)
+{
+	// константа справа - форма K; a > b - это b < a
+	uint32_t constant = 0;
+	const bool equality = op == BinaryOp::Equal || op == BinaryOp::NotEqual;
+	if (left.kind != ExpKind::Number && toConstantOperand(right, constant, !equality))
+	{
+		static constexpr Op ConstantOps[] = { Op::EqK, Op::NeK, Op::LtK, Op::LeK, Op::GtK, Op::GeK };
+		const uint32_t reg = left.info;
+		freeExpression(left);
+		left = { ExpKind::Reloc, emit(Encode(ConstantOps[(size_t)op - (size_t)BinaryOp::Equal], 0, reg, constant)) };
+		return;
+	}
+
+	const uint32_t rc = toAnyRegister(right);
+	const uint32_t rb = toAnyRegister(left);
+	if (rb > rc)
+	{
+		freeExpression(left);
+		freeExpression(right);
+	}
+	else
+	{
+		freeExpression(right);
+		freeExpression(left);
+	}
+	uint32_t instruction = 0;
+	switch (op)
+	{
+	case BinaryOp::Equal: instruction = Encode(Op::Eq, 0, rb, rc); break;
+	case BinaryOp::NotEqual: instruction = Encode(Op::Ne, 0, rb, rc); break;
+	case BinaryOp::Less: instruction = Encode(Op::Lt, 0, rb, rc); break;
+	case BinaryOp::LessEqual: instruction = Encode(Op::Le, 0, rb, rc); break;
+	case BinaryOp::Greater: instruction = Encode(Op::Lt, 0, rc, rb); break;
+	default: instruction = Encode(Op::Le, 0, rc, rb); break;
+	}
+	left = { ExpKind::Reloc, emit(instruction) };
+}
+//=============================================================================
+void Compiler::suffixedExpression(ExpDesc& e)
+{
+	primaryExpression(e);
+	for (;;)
+	{
+		switch (m_token)
+		{
+		case Token::Dot:
+		{
+			advance();
+			if (!check(Token::Name))
+			{
+				error("expected field name near '{}'", m_lexer.GetText());
+				return;
+			}
+			String* name = m_vm.Intern(m_lexer.GetText());
+			advance();
+			if (check(Token::LeftParen))
+			{
+				invoke(e, name);
+				break;
+			}
+			const uint32_t object = toAnyRegister(e);
+			const uint32_t key = addConstant(Value::FromObject(name));
+			if (key <= MaxConstantOperand)
+			{
+				e = { ExpKind::Field, object, key };
+				break;
+			}
+			ExpDesc keyExpression{ ExpKind::Constant, key };
+			e = { ExpKind::Index, object, toNextRegister(keyExpression) };
+			break;
+		}
+		case Token::LeftBracket:
+		{
+			advance();
+			const uint32_t object = toAnyRegister(e);
+			ExpDesc key;
+			expression(key);
+			const uint32_t keyRegister = toAnyRegister(key);
+			expect(Token::RightBracket, "']'");
+			e = { ExpKind::Index, object, keyRegister };
+			break;
+		}
+		case Token::LeftParen:
+			call(e);
+			break;
+		default:
+			return;
+		}
+	}
+}
+//=============================================================================
+void Compiler::primaryExpression(ExpDesc& e)
+{
+	switch (m_token)
+	{
+	case Token::Number:
+		e = { ExpKind::Number, 0, 0, m_lexer.GetNumber() };
+		advance();
+		return;
+	case Token::String:
+		e = { ExpKind::Constant, stringConstant(m_lexer.GetString()) };
+		advance();
+		return;
+	case Token::Nil: e = { ExpKind::Nil }; advance(); return;
+	case Token::True: e = { ExpKind::True }; advance(); return;
+	case Token::False: e = { ExpKind::False }; advance(); return;
+	case Token::This:
+		if (!m_state->method)
+		{
+			error("'this' outside of a method");
+			return;
+		}
+		e = { ExpKind::Local, 0 };
+		advance();
+		return;
+	case Token::Name:
+		resolveName(m_vm.Intern(m_lexer.GetText()), e);
+		advance();
+		return;
+	case Token::LeftParen:
+		advance();
+		expression(e);
+		expect(Token::RightParen, "')'");
+		// (a.b) - значение, а не цель присваивания
+		discharge(e);
+		return;
+	case Token::LeftBrace:
+		tableConstructor(e);
+		return;
+	case Token::LeftBracket:
+		arrayConstructor(e);
+		return;
+	case Token::Fn:
+	{
+		advance();
+		Function* function = compileFunction(m_vm.Intern("anonymous"), false);
+		e = { ExpKind::Constant, addConstant(Value::FromObject(function)) };
+		return;
+	}
+	default:
+		error("unexpected '{}'", m_lexer.GetText());
+		return;
+	}
+}
+//=============================================================================
+void Compiler::resolveName(String* name, ExpDesc& e)
+{
+	for (auto local = m_state->locals.rbegin(); local != m_state->locals.rend(); ++local)
+	{
+		if (local->name == name)
+		{
+			e = { ExpKind::Local, local->reg };
+			return;
+		}
+	}
+	for (const FunctionState* outer = m_state->parent; outer; outer = outer->parent)
+	{
+		for (const LocalVariable& local : outer->locals)
+		{
+			if (local.name == name)
+			{
+				error("cannot use local variable '{}' of an enclosing function, functions do not capture locals", name->GetView());
+				return;
+			}
+		}
+	}
+	e = { ExpKind::Global, m_vm.GetGlobalSlot(name) };
+}
+//=============================================================================
+uint32_t Compiler::arguments(uint32_t firstArgument)
+{
+	expect(Token::LeftParen, "'('");
+	uint32_t count = 0;
+	if (!check(Token::RightParen))
+	{
+		do
+		{
+			ExpDesc argument;
+			expression(argument);
+			const uint32_t reg = toNextRegister(argument);
+			if (!m_failed && reg != firstArgument + count)
+				error("internal error: argument register mismatch");
+			count++;
+		} while (match(Token::Comma) && !m_failed);
+	}
+	expect(Token::RightParen, "')' after arguments");
+	return count;
+}
+//=============================================================================
+void Compiler::call(ExpDesc& e)
+{
+	const uint32_t line = m_line;
+	const uint32_t base = toNextRegister(e);
+	const uint32_t count = arguments(base + 1);
+	m_previousLine = line;
+	emit(Encode(Op::Call, base, count, 0));
+	m_state->freeRegister = base + 1;
+	e = { ExpKind::Register, base };
+}
+//=============================================================================
+void Compiler::invoke(ExpDesc& object, String* name)
+{
+	// R[base] - результат, R[base + 1] - объект, дальше аргументы
+	const uint32_t line = m_line;
+	const uint32_t nameConstant = addConstant(Value::FromObject(name));
+	if (nameConstant > MaxConstantOperand)
+	{
+		error("too many distinct names in function");
+		return;
+	}
+	discharge(object);
+	freeExpression(object);
+	const uint32_t base = m_state->freeRegister;
+	reserveRegisters(2);
+	toRegister(object, base + 1);
+	const uint32_t count = arguments(base + 2);
+	m_previousLine = line;
+	emit(Encode(Op::Invoke, base, count + 1, nameConstant));
+	m_state->freeRegister = base + 1;
+	object = { ExpKind::Register, base };
+}
+//=============================================================================
+void Compiler::flushAppend(uint32_t table, uint32_t& pending)
+{
+	if (pending == 0) return;
+	emit(Encode(Op::Append, table, pending, 0));
+	m_state->freeRegister = table + 1;
+	pending = 0;
+}
+//=============================================================================
+void Compiler::tableConstructor(ExpDesc& e)
+{
+	advance();
+	const uint32_t table = m_state->freeRegister;
+	const uint32_t newTable = emit(Encode(Op::NewTable, table, 0, 0));
+	reserveRegisters(1);
+
+	uint32_t pending = 0;
+	uint32_t arrayCount = 0;
+	while (!check(Token::RightBrace) && !check(Token::Eof))
+	{
+		if (check(Token::Name) && peekToken() == Token::Assign)
+		{
+			flushAppend(table, pending);
+			const uint32_t key = stringConstant(m_lexer.GetText());
+			advance();
+			advance();
+			ExpDesc value;
+			expression(value);
+			const uint32_t reg = toAnyRegister(value);
+			if (key <= MaxConstantOperand)
+				emit(Encode(Op::SetField, table, key, reg));
+			else
+			{
+				ExpDesc keyExpression{ ExpKind::Constant, key };
+				emit(Encode(Op::SetIndex, table, toNextRegister(keyExpression), reg));
+			}
+			m_state->freeRegister = table + 1;
+		}
+		else if (match(Token::LeftBracket))
+		{
+			flushAppend(table, pending);
+			ExpDesc key;
+			expression(key);
+			const uint32_t keyRegister = toAnyRegister(key);
+			expect(Token::RightBracket, "']'");
+			expect(Token::Assign, "'=' after table key");
+			ExpDesc value;
+			expression(value);
+			emit(Encode(Op::SetIndex, table, keyRegister, toAnyRegister(value)));
+			m_state->freeRegister = table + 1;
+		}
+		else
+		{
+			ExpDesc value;
+			expression(value);
+			toNextRegister(value);
+			arrayCount++;
+			if (++pending == AppendBatch) flushAppend(table, pending);
+		}
+		if (!match(Token::Comma)) break;
+	}
+	flushAppend(table, pending);
+	expect(Token::RightBrace, "'}' after table");
+
+	uint32_t& instruction = m_state->function->code[newTable];
+	instruction = Encode(Op::NewTable, table, std::min(arrayCount, 255u), 0);
+	e = { ExpKind::Register, table };
+}
+//=============================================================================
+void Compiler::arrayConstructor(ExpDesc& e)
+{
+	advance();
+	const uint32_t table = m_state->freeRegister;
+	const uint32_t newTable = emit(Encode(Op::NewTable, table, 0, 0));
+	reserveRegisters(1);
+
+	uint32_t pending = 0;
+	uint32_t count = 0;
+	while (!check(Token::RightBracket) && !check(Token::Eof))
+	{
+		ExpDesc value;
+		expression(value);
+		toNextRegister(value);
+		count++;
+		if (++pending == AppendBatch) flushAppend(table, pending);
+		if (!match(Token::Comma)) break;
+	}
+	flushAppend(table, pending);
+	expect(Token::RightBracket, "']' after array");
+
+	uint32_t& instruction = m_state->function->code[newTable];
+	instruction = Encode(Op::NewTable, table, std::min(count, 255u), 0);
+	e = { ExpKind::Register, table };
+}
+//=============================================================================
+Function* script::CompileSource(VM& vm, std::string_view source, String* chunkName)
+{
+	PROFILE_FUNCTION();
+
+	Compiler compiler(vm, source, chunkName);
+	return compiler.Compile();
+}
+//=============================================================================
+const char* script::bytecode::GetOpName(Op op)
+{
+	static constexpr const char* Names[] = {
+#define SCRIPT_OPCODE_NAME(name) #name,
+		SCRIPT_OPCODES(SCRIPT_OPCODE_NAME)
+#undef SCRIPT_OPCODE_NAME
+	};
+	return op < Op::Count ? Names[(size_t)op] : "?";
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,20 @@
+﻿#pragma once
+
+#include "Script.h"
+
+// Язык сценариев: фигурные скобки, переводы строк не значимы, ";" не обязательна.
+//   var x = 1                         глобальная на уровне файла, локальная в блоке и функции
+//   fn name(a, b) { return a + b }    функции и классы объявляются только на уровне файла
+//   class Body { fn init(x) { this.x = x } fn move(dx) { this.x += dx } }
+//   var b = Body(1)   b.move(2)       вызов класса создает экземпляр и вызывает init
+//   if a < b { } else if c { } else { }      while cond { }      break
+//   for i = 0, n - 1 [, step] { }     числовой цикл, предел включен
+//   for k, v in t { }                 обход таблицы: массив, затем хеш
+//   { name = 1, ["key"] = 2 }  [1, 2, 3]  t.name  t[i]  a .. b (склейка строк)  and or not  == != < <= > >=
+// Замыканий нет: вложенная функция не видит локальные переменные внешней, только глобальные
+namespace script
+{
+	// Однопроходный компилятор: разбор с приоритетами операторов сразу в регистровый байткод.
+	// Ошибки - в лог с файлом и строкой, результат nullptr. Сборщик мусора на время компиляции остановлен вызывающим
+	Function* CompileSource(VM& vm, std::string_view source, String* chunkName);
+}
\ No newline at end of file
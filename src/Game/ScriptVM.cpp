@@ -0,0 +1,1573 @@
+﻿#include "stdafx.h"
+#include "ScriptVM.h"
+#include "ScriptCompiler.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+// GCC и Clang: переход по таблице адресов меток, у каждой команды своя точка ветвления и своя история
+// предсказателя. MSVC не умеет брать адрес метки - обычный switch
+#if defined(__GNUC__) || defined(__clang__)
+#	define SCRIPT_COMPUTED_GOTO 1
+#else
+#	define SCRIPT_COMPUTED_GOTO 0
+#endif
+//=============================================================================
+namespace
+{
+	using namespace script;
+	using namespace script::bytecode;
+
+	constexpr size_t StackSize = 64 * 1024;
+	constexpr size_t MaxFrames = 1024;
+
+	// -0 и 0 - один ключ
+	Value normalizeKey(Value key)
+	{
+		return key.IsNumber() && key.AsNumber() == 0.0 ? Value::Number(0.0) : key;
+	}
+
+	bool arrayIndex(Value key, size_t count, uint32_t& index)
+	{
+		if (!key.IsNumber()) return false;
+		const double number = key.AsNumber();
+		if (!(number >= 0.0 && number < (double)count)) return false;
+		index = (uint32_t)number;
+		return (double)index == number;
+	}
+
+	uint32_t hashString(std::string_view text)
+	{
+		uint32_t hash = 2166136261u;
+		for (const char c : text) hash = (hash ^ (uint8_t)c) * 16777619u;
+		return hash;
+	}
+
+	std::string numberToString(double number)
+	{
+		if (number == std::floor(number) && std::abs(number) < 1e15) return std::format("{}", (int64_t)number);
+		return std::format("{}", number);
+	}
+
+	bool isLive(const ValueTable::Entry& entry)
+	{
+		return !entry.key.IsUndefined() && !entry.key.IsNil();
+	}
+}
+//=============================================================================
+uint32_t ValueTable::hashValue(Value key)
+{
+	if (key.Is(ObjectType::String)) return key.AsString()->hash;
+	uint64_t bits = key.GetBits();
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+//=============================================================================
+const Value* ValueTable::Find(Value key) const
+{
+	key = normalizeKey(key);
+	uint32_t index = 0;
+	if (arrayIndex(key, m_array.size(), index)) return m_array[index].IsNil() ? nullptr : &m_array[index];
+	if (m_count == 0) return nullptr;
+
+	const uint32_t mask = (uint32_t)m_entries.size() - 1;
+	for (uint32_t slot = hashValue(key) & mask;; slot = (slot + 1) & mask)
+	{
+		const Entry& entry = m_entries[slot];
+		if (entry.key.IsUndefined()) return nullptr;
+		if (entry.key == key) return &entry.value;
+	}
+}
+//=============================================================================
+ValueTable::Entry* ValueTable::findEntry(Value key)
+{
+	if (m_count == 0) return nullptr;
+	const uint32_t mask = (uint32_t)m_entries.size() - 1;
+	for (uint32_t slot = hashValue(key) & mask;; slot = (slot + 1) & mask)
+	{
+		Entry& entry = m_entries[slot];
+		if (entry.key.IsUndefined()) return nullptr;
+		if (entry.key == key) return &entry;
+	}
+}
+//=============================================================================
+void ValueTable::Set(Value key, Value value)
+{
+	key = normalizeKey(key);
+	uint32_t index = 0;
+	if (arrayIndex(key, m_array.size(), index))
+	{
+		m_array[index] = value;
+		while (!m_array.empty() && m_array.back().IsNil()) m_array.pop_back();
+		return;
+	}
+	if (value.IsNil())
+	{
+		Remove(key);
+		return;
+	}
+	if (key.IsNumber() && key.AsNumber() == (double)m_array.size())
+	{
+		// продолжение массива: ключ мог лежать в хеше, пока массив был короче
+		Remove(key);
+		Push(value);
+		return;
+	}
+
+	if ((m_count + m_tombstones + 1) * 4 > m_entries.size() * 3)
+		resize(std::max<uint32_t>(8, std::bit_ceil((m_count + 1) * 2)));
+
+	const uint32_t mask = (uint32_t)m_entries.size() - 1;
+	Entry* tombstone = nullptr;
+	for (uint32_t slot = hashValue(key) & mask;; slot = (slot + 1) & mask)
+	{
+		Entry& entry = m_entries[slot];
+		if (entry.key.IsUndefined())
+		{
+			Entry& target = tombstone ? *tombstone : entry;
+			if (tombstone) m_tombstones--;
+			target.key = key;
+			target.value = value;
+			m_count++;
+			return;
+		}
+		if (entry.key.IsNil())
+		{
+			if (!tombstone) tombstone = &entry;
+		}
+		else if (entry.key == key)
+		{
+			entry.value = value;
+			return;
+		}
+	}
+}
+//=============================================================================
+bool ValueTable::Remove(Value key)
+{
+	key = normalizeKey(key);
+	uint32_t index = 0;
+	if (arrayIndex(key, m_array.size(), index))
+	{
+		if (m_array[index].IsNil()) return false;
+		m_array[index] = Value::Nil();
+		while (!m_array.empty() && m_array.back().IsNil()) m_array.pop_back();
+		return true;
+	}
+	Entry* entry = findEntry(key);
+	if (!entry) return false;
+	entry->key = Value::Nil();
+	entry->value = Value::Nil();
+	m_count--;
+	m_tombstones++;
+	return true;
+}
+//=============================================================================
+void ValueTable::Push(Value value)
+{
+	m_array.push_back(value);
+	if (m_count > 0) migrateToArray();
+}
+//=============================================================================
+void ValueTable::Clear()
+{
+	m_array.clear();
+	m_entries.clear();
+	m_count = 0;
+	m_tombstones = 0;
+}
+//=============================================================================
+void ValueTable::resize(uint32_t capacity)
+{
+	std::vector<Entry> entries(capacity);
+	const uint32_t mask = capacity - 1;
+	for (const Entry& entry : m_entries)
+	{
+		if (!isLive(entry)) continue;
+		uint32_t slot = hashValue(entry.key) & mask;
+		while (!entries[slot].key.IsUndefined()) slot = (slot + 1) & mask;
+		entries[slot] = entry;
+	}
+	m_entries = std::move(entries);
+	m_tombstones = 0;
+}
+//=============================================================================
+void ValueTable::migrateToArray()
+{
+	while (m_count > 0)
+	{
+		Entry* entry = findEntry(Value::Number((double)m_array.size()));
+		if (!entry) return;
+		m_array.push_back(entry->value);
+		entry->key = Value::Nil();
+		entry->value = Value::Nil();
+		m_count--;
+		m_tombstones++;
+	}
+}
+//=============================================================================
+bool ValueTable::Next(uint32_t& position, Value& key, Value& value) const
+{
+	const uint32_t arrayCount = (uint32_t)m_array.size();
+	while (position < arrayCount)
+	{
+		const uint32_t index = position++;
+		if (m_array[index].IsNil()) continue;
+		key = Value::Number(index);
+		value = m_array[index];
+		return true;
+	}
+	while (position - arrayCount < m_entries.size())
+	{
+		const Entry& entry = m_entries[position++ - arrayCount];
+		if (!isLive(entry)) continue;
+		key = entry.key;
+		value = entry.value;
+		return true;
+	}
+	return false;
+}
+//=============================================================================
+VM::VM()
+{
+	m_stack.resize(StackSize);
+	// кадры не переезжают: интерпретатор держит указатель на текущий
+	m_frames.reserve(MaxFrames);
+	m_gcThreshold = m_gcSettings.minThreshold;
+	m_initName = Intern("init");
+}
+//=============================================================================
+VM::~VM()
+{
+	m_strings.clear();
+	while (m_objects)
+	{
+		Object* next = m_objects->next;
+		freeObject(m_objects);
+		m_objects = next;
+	}
+}
+//=============================================================================
+template<typename T>
+T* VM::allocate(ObjectType type, size_t size)
+{
+	T* object = new (::operator new(size)) T();
+	object->type = type;
+	object->color = m_currentWhite;
+	object->next = m_objects;
+	m_objects = object;
+	trackMemory((ptrdiff_t)size);
+	return object;
+}
+//=============================================================================
+void VM::freeObject(Object* object)
+{
+	size_t size = 0;
+	switch (object->type)
+	{
+	case ObjectType::String:
+	{
+		String* string = static_cast<String*>(object);
+		m_strings.erase(string->GetView());
+		size = sizeof(String) + string->length + 1;
+		string->~String();
+		break;
+	}
+	case ObjectType::Table:
+	{
+		Table* table = static_cast<Table*>(object);
+		size = sizeof(Table) + table->table.GetMemorySize();
+		table->~Table();
+		break;
+	}
+	case ObjectType::Function:
+		size = sizeof(Function);
+		static_cast<Function*>(object)->~Function();
+		break;
+	case ObjectType::NativeFunction:
+		size = sizeof(NativeFunction);
+		static_cast<NativeFunction*>(object)->~NativeFunction();
+		break;
+	case ObjectType::Class:
+		size = sizeof(Class);
+		static_cast<Class*>(object)->~Class();
+		break;
+	case ObjectType::Instance:
+	{
+		Instance* instance = static_cast<Instance*>(object);
+		size = sizeof(Instance) + instance->fields.GetMemorySize();
+		instance->~Instance();
+		break;
+	}
+	case ObjectType::NativeObject:
+		size = sizeof(NativeObject);
+		static_cast<NativeObject*>(object)->~NativeObject();
+		break;
+	}
+	::operator delete(object);
+	m_bytesAllocated -= size;
+}
+//=============================================================================
+String* VM::Intern(std::string_view text)
+{
+	const auto found = m_strings.find(text);
+	if (found != m_strings.end())
+	{
+		// строка недостижима с прошлой пометки, но очистка до нее еще не дошла - снова живая
+		String* string = found->second;
+		if (m_gcPhase == GcPhase::Sweep && string->color == otherWhite()) string->color = m_currentWhite;
+		return string;
+	}
+
+	String* string = allocate<String>(ObjectType::String, sizeof(String) + text.size() + 1);
+	string->length = (uint32_t)text.size();
+	string->hash = hashString(text);
+	char* chars = reinterpret_cast<char*>(string + 1);
+	std::memcpy(chars, text.data(), text.size());
+	chars[text.size()] = '\0';
+	m_strings.emplace(string->GetView(), string);
+	return string;
+}
+//=============================================================================
+Table* VM::NewTable()
+{
+	return allocate<Table>(ObjectType::Table);
+}
+//=============================================================================
+Function* VM::NewFunction(String* name, String* chunkName)
+{
+	Function* function = allocate<Function>(ObjectType::Function);
+	function->name = name;
+	function->chunkName = chunkName;
+	return function;
+}
+//=============================================================================
+Class* VM::NewClass(String* name)
+{
+	Class* klass = allocate<Class>(ObjectType::Class);
+	klass->name = name;
+	return klass;
+}
+//=============================================================================
+Value VM::NewNativeFunction(std::string_view name, NativeFn function)
+{
+	String* nameString = Intern(name);
+	NativeFunction* native = allocate<NativeFunction>(ObjectType::NativeFunction);
+	native->name = nameString;
+	native->function = function;
+	return Value::FromObject(native);
+}
+//=============================================================================
+Class* VM::DefineNativeClass(const NativeClassDesc& desc)
+{
+	Class* klass = NewClass(Intern(desc.name));
+	klass->native = &desc;
+	m_nativeClasses.push_back(klass);
+	for (size_t i = 0; i < desc.properties.size(); i++)
+		klass->properties.Set(Value::FromObject(Intern(desc.properties[i].name)), Value::Number((double)i));
+	for (const NativeMethod& method : desc.methods)
+		klass->methods.Set(Value::FromObject(Intern(method.name)), NewNativeFunction(method.name, method.function));
+	return klass;
+}
+//=============================================================================
+Value VM::NewNativeObject(Class* klass, void* pointer, uint64_t handle)
+{
+	NativeObject* object = allocate<NativeObject>(ObjectType::NativeObject);
+	object->klass = klass;
+	object->pointer = pointer;
+	object->handle = handle;
+	return Value::FromObject(object);
+}
+//=============================================================================
+Value VM::NewNativeObject(const NativeClassDesc& desc, void* pointer, uint64_t handle)
+{
+	for (Class* klass : m_nativeClasses)
+	{
+		if (klass->native == &desc) return NewNativeObject(klass, pointer, handle);
+	}
+	return NewNativeObject(DefineNativeClass(desc), pointer, handle);
+}
+//=============================================================================
+void VM::SetTableValue(Object* owner, ValueTable& table, Value key, Value value)
+{
+	const size_t memorySize = table.GetMemorySize();
+	table.Set(key, value);
+	trackMemory((ptrdiff_t)table.GetMemorySize() - (ptrdiff_t)memorySize);
+	barrier(owner, key);
+	barrier(owner, value);
+}
+//=============================================================================
+void VM::PushTableValue(Table* table, Value value)
+{
+	const size_t memorySize = table->table.GetMemorySize();
+	table->table.Push(value);
+	trackMemory((ptrdiff_t)table->table.GetMemorySize() - (ptrdiff_t)memorySize);
+	barrier(table, value);
+}
+//=============================================================================
+uint32_t VM::GetGlobalSlot(String* name)
+{
+	const Value key = Value::FromObject(name);
+	if (const Value* slot = m_globalSlots.Find(key)) return (uint32_t)slot->AsNumber();
+
+	assert(m_globals.size() <= 0xffff);
+	const uint32_t slot = (uint32_t)m_globals.size();
+	m_globals.push_back(Value::Undefined());
+	m_globalNames.push_back(name);
+	m_globalSlots.Set(key, Value::Number(slot));
+	return slot;
+}
+//=============================================================================
+Value VM::GetGlobal(std::string_view name)
+{
+	const Value* slot = m_globalSlots.Find(Value::FromObject(Intern(name)));
+	if (!slot) return Value::Nil();
+	const Value value = m_globals[(size_t)slot->AsNumber()];
+	return value.IsUndefined() ? Value::Nil() : value;
+}
+//=============================================================================
+void VM::SetGlobal(std::string_view name, Value value)
+{
+	m_globals[GetGlobalSlot(Intern(name))] = value;
+}
+//=============================================================================
+Function* VM::Compile(std::string_view source, const std::string& chunkName)
+{
+	// объекты компилятора достижимы только из него самого
+	PauseGc();
+	Function* function = CompileSource(*this, source, Intern(chunkName));
+	ResumeGc();
+	return function;
+}
+//=============================================================================
+bool VM::RunMain(Function* main, bool reload)
+{
+	m_reloading = reload;
+	const bool completed = Call(Value::FromObject(main), nullptr, 0);
+	m_reloading = false;
+	return completed;
+}
+//=============================================================================
+bool VM::RunSource(std::string_view source, const std::string& chunkName)
+{
+	Function* function = Compile(source, chunkName);
+	return function && RunMain(function);
+}
+//=============================================================================
+bool VM::RunFile(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+	{
+		LOG_ERROR(Script, "Failed to open script: {}", path);
+		return false;
+	}
+	std::stringstream stream;
+	stream << file.rdbuf();
+	return RunSource(stream.str(), path);
+}
+//=============================================================================
+bool VM::Call(Value callee, const Value* args, uint32_t argCount, Value* result)
+{
+	Value* slot = getStackTop();
+	if (slot + argCount + 2 > m_stack.data() + m_stack.size())
+	{
+		LOG_ERROR(Script, "Script stack overflow");
+		return false;
+	}
+	slot[0] = callee;
+	std::copy(args, args + argCount, slot + 1);
+
+	const size_t depth = m_frames.size();
+	if (!callValue(slot, argCount)) return reportError(depth);
+	if (m_frames.size() > depth && !execute(depth)) return false;
+	if (result) *result = *slot;
+	return true;
+}
+//=============================================================================
+bool VM::CallGlobal(std::string_view name, const Value* args, uint32_t argCount, Value* result)
+{
+	const Value callee = GetGlobal(name);
+	if (callee.IsNil())
+	{
+		if (result) *result = Value::Nil();
+		return true;
+	}
+	return Call(callee, args, argCount, result);
+}
+//=============================================================================
+Value* VM::getStackTop()
+{
+	// верх самого высокого кадра: у вызывающего регистров может быть больше, чем у вызванного
+	Value* top = m_stack.data();
+	for (const CallFrame& frame : m_frames)
+		top = std::max(top, frame.base + frame.function->registerCount);
+	return top;
+}
+//=============================================================================
+bool VM::pushFrame(Function* function, Value* slot, uint32_t argCount, bool constructor)
+{
+	if (argCount != function->arity) [[unlikely]]
+		return Error("function '{}' expects {} arguments, got {}", function->name->GetView(), function->arity, argCount);
+	Value* base = slot + 1;
+	if (m_frames.size() == MaxFrames || base + function->registerCount > m_stack.data() + m_stack.size()) [[unlikely]]
+		return Error("stack overflow");
+
+	// остатки прошлых вызовов в регистрах не должны попасть сборщику как корни
+	std::fill(base + argCount, base + function->registerCount, Value::Nil());
+	m_frames.push_back({ function, function->code.data(), base, constructor });
+	return true;
+}
+//=============================================================================
+bool VM::callValue(Value* slot, uint32_t argCount)
+{
+	const Value callee = *slot;
+	if (callee.Is(ObjectType::Function)) [[likely]]
+		return pushFrame(static_cast<Function*>(callee.AsObject()), slot, argCount, false);
+
+	if (callee.Is(ObjectType::NativeFunction))
+	{
+		Value result;
+		if (!static_cast<NativeFunction*>(callee.AsObject())->function(*this, slot + 1, argCount, result)) return false;
+		*slot = result;
+		return true;
+	}
+
+	if (callee.Is(ObjectType::Class))
+	{
+		Class* klass = static_cast<Class*>(callee.AsObject());
+		if (klass->native) return Error("cannot construct native class '{}'", klass->name->GetView());
+
+		Instance* instance = allocate<Instance>(ObjectType::Instance);
+		instance->klass = klass;
+		const Value* init = klass->methods.Find(Value::FromObject(m_initName));
+		if (!init || !init->Is(ObjectType::Function))
+		{
+			if (argCount != 0) return Error("class '{}' has no init and takes no arguments", klass->name->GetView());
+			*slot = Value::FromObject(instance);
+			return true;
+		}
+		// this перед аргументами, результат конструктора - this
+		Function* function = static_cast<Function*>(init->AsObject());
+		if (function->arity != argCount + 1)
+			return Error("'{}.init' expects {} arguments, got {}", klass->name->GetView(), function->arity - 1, argCount);
+		std::copy_backward(slot + 1, slot + 1 + argCount, slot + 2 + argCount);
+		slot[1] = Value::FromObject(instance);
+		return pushFrame(function, slot, argCount + 1, true);
+	}
+	return Error("attempt to call a {} value", GetTypeName(callee));
+}
+//=============================================================================
+bool VM::invoke(Value* slot, uint32_t argCount, String* name)
+{
+	const Value receiver = slot[1];
+	const Value key = Value::FromObject(name);
+	// поле-функция вызывается без this: аргументы сдвигаются на место объекта
+	auto callField = [&](Value callee)
+	{
+		std::copy(slot + 2, slot + 1 + argCount, slot + 1);
+		slot[0] = callee;
+		return callValue(slot, argCount - 1);
+	};
+
+	if (receiver.Is(ObjectType::Instance)) [[likely]]
+	{
+		const Instance* instance = static_cast<Instance*>(receiver.AsObject());
+		if (const Value* method = instance->klass->methods.Find(key); method && method->Is(ObjectType::Function))
+			return pushFrame(static_cast<Function*>(method->AsObject()), slot, argCount, false);
+		if (const Value* field = instance->fields.Find(key)) return callField(*field);
+		return Error("undefined method '{}' of class '{}'", name->GetView(), instance->klass->name->GetView());
+	}
+	if (receiver.Is(ObjectType::Table))
+	{
+		if (const Value* field = static_cast<Table*>(receiver.AsObject())->table.Find(key)) return callField(*field);
+		return Error("attempt to call a nil field '{}'", name->GetView());
+	}
+	if (receiver.Is(ObjectType::NativeObject))
+	{
+		const NativeObject* object = static_cast<NativeObject*>(receiver.AsObject());
+		const Value* method = object->klass->methods.Find(key);
+		if (!method) return Error("undefined method '{}' of '{}'", name->GetView(), object->klass->name->GetView());
+		Value result;
+		if (!static_cast<NativeFunction*>(method->AsObject())->function(*this, slot + 1, argCount, result)) return false;
+		*slot = result;
+		return true;
+	}
+	return Error("attempt to call method '{}' of a {} value", name->GetView(), GetTypeName(receiver));
+}
+//=============================================================================
+bool VM::getField(Value object, String* name, Value& result)
+{
+	const Value key = Value::FromObject(name);
+	if (object.Is(ObjectType::Instance))
+	{
+		const Instance* instance = static_cast<Instance*>(object.AsObject());
+		if (const Value* value = instance->fields.Find(key))
+			result = *value;
+		else
+			result = instance->klass->methods.Get(key);
+		return true;
+	}
+	if (object.Is(ObjectType::Table))
+	{
+		result = static_cast<Table*>(object.AsObject())->table.Get(key);
+		return true;
+	}
+	if (object.Is(ObjectType::NativeObject))
+	{
+		const NativeObject* native = static_cast<NativeObject*>(object.AsObject());
+		if (const Value* index = native->klass->properties.Find(key))
+			return native->klass->native->properties[(size_t)index->AsNumber()].get(*this, *native, result);
+		if (const Value* method = native->klass->methods.Find(key))
+		{
+			result = *method;
+			return true;
+		}
+		return Error("'{}' has no property '{}'", native->klass->name->GetView(), name->GetView());
+	}
+	if (object.Is(ObjectType::Class))
+	{
+		result = static_cast<Class*>(object.AsObject())->methods.Get(key);
+		return true;
+	}
+	return Error("attempt to index a {} value with '{}'", GetTypeName(object), name->GetView());
+}
+//=============================================================================
+bool VM::setField(Value object, String* name, Value value)
+{
+	const Value key = Value::FromObject(name);
+	if (object.Is(ObjectType::Instance))
+	{
+		Instance* instance = static_cast<Instance*>(object.AsObject());
+		SetTableValue(instance, instance->fields, key, value);
+		return true;
+	}
+	if (object.Is(ObjectType::Table))
+	{
+		Table* table = static_cast<Table*>(object.AsObject());
+		SetTableValue(table, table->table, key, value);
+		return true;
+	}
+	if (object.Is(ObjectType::NativeObject))
+	{
+		const NativeObject* native = static_cast<NativeObject*>(object.AsObject());
+		const Value* index = native->klass->properties.Find(key);
+		if (!index) return Error("'{}' has no property '{}'", native->klass->name->GetView(), name->GetView());
+		const NativeProperty& property = native->klass->native->properties[(size_t)index->AsNumber()];
+		if (!property.set) return Error("property '{}' of '{}' is read-only", name->GetView(), native->klass->name->GetView());
+		return property.set(*this, *native, value);
+	}
+	return Error("attempt to set field '{}' of a {} value", name->GetView(), GetTypeName(object));
+}
+//=============================================================================
+bool VM::getIndex(Value object, Value key, Value& result)
+{
+	if (object.Is(ObjectType::Table))
+	{
+		result = static_cast<Table*>(object.AsObject())->table.Get(key);
+		return true;
+	}
+	if (key.Is(ObjectType::String) && (object.Is(ObjectType::Instance) || object.Is(ObjectType::NativeObject)))
+		return getField(object, key.AsString(), result);
+	return Error("attempt to index a {} value", GetTypeName(object));
+}
+//=============================================================================
+bool VM::setIndex(Value object, Value key, Value value)
+{
+	if (object.Is(ObjectType::Table))
+	{
+		if (key.IsNil()) return Error("table index is nil");
+		if (key.IsNumber() && std::isnan(key.AsNumber())) return Error("table index is NaN");
+		Table* table = static_cast<Table*>(object.AsObject());
+		SetTableValue(table, table->table, key, value);
+		return true;
+	}
+	if (key.Is(ObjectType::String) && (object.Is(ObjectType::Instance) || object.Is(ObjectType::NativeObject)))
+		return setField(object, key.AsString(), value);
+	return Error("attempt to index a {} value", GetTypeName(object));
+}
+//=============================================================================
+String* VM::concatenate(Value a, Value b)
+{
+	auto append = [this](std::string& text, Value value)
+	{
+		if (value.Is(ObjectType::String))
+			text += value.AsString()->GetView();
+		else if (value.IsNumber())
+			text += numberToString(value.AsNumber());
+		else
+			return Error("attempt to concatenate a {} value", GetTypeName(value));
+		return true;
+	};
+
+	std::string text;
+	if (!append(text, a) || !append(text, b)) return nullptr;
+	return Intern(text);
+}
+//=============================================================================
+void VM::defineClass(uint32_t slot, Class* klass)
+{
+	Value& global = m_globals[slot];
+	if (global.Is(ObjectType::Class))
+	{
+		// повторное объявление (перезагрузка файла): живые экземпляры ссылаются на старый класс,
+		// поэтому он остается и получает новые методы, поля экземпляров не трогаются
+		Class* existing = static_cast<Class*>(global.AsObject());
+		if (existing != klass && !existing->native)
+		{
+			uint32_t position = 0;
+			Value name, method;
+			while (klass->methods.Next(position, name, method))
+			{
+				existing->methods.Set(name, method);
+				barrier(existing, method);
+			}
+			return;
+		}
+	}
+	global = Value::FromObject(klass);
+}
+//=============================================================================
+bool VM::reportError(size_t entryDepth)
+{
+	auto lineOf = [](const CallFrame& frame)
+	{
+		const size_t index = frame.pc > frame.function->code.data() ? frame.pc - frame.function->code.data() - 1 : 0;
+		return index < frame.function->lines.size() ? frame.function->lines[index] : 0u;
+	};
+
+	std::string message;
+	if (m_frames.size() > entryDepth)
+	{
+		const CallFrame& top = m_frames.back();
+		message = std::format("{}:{}: {}", top.function->chunkName->GetView(), lineOf(top), m_error);
+		constexpr size_t MaxTracebackFrames = 16;
+		for (size_t i = m_frames.size(); i > entryDepth; i--)
+		{
+			if (m_frames.size() - i == MaxTracebackFrames)
+			{
+				message += std::format("\n    ... {} more", i - entryDepth);
+				break;
+			}
+			const CallFrame& frame = m_frames[i - 1];
+			message += std::format("\n    in {} ({}:{})", frame.function->name->GetView(), frame.function->chunkName->GetView(), lineOf(frame));
+		}
+	}
+	else
+		message = m_error;
+
+	LOG_ERROR(Script, "{}", message);
+	m_frames.resize(entryDepth);
+	m_error.clear();
+	return false;
+}
+//=============================================================================
+#define RA (base[GetA(instruction)])
+#define RB (base[GetB(instruction)])
+#define RC (base[GetC(instruction)])
+#define KC (constants[GetC(instruction)])
+#define LOAD_FRAME() \
+	frame = &m_frames.back(); \
+	pc = frame->pc; \
+	base = frame->base; \
+	constants = frame->function->constants.data()
+#define RUNTIME_ERROR(...) do { Error(__VA_ARGS__); goto error; } while (false)
+
+#if SCRIPT_COMPUTED_GOTO
+#	define CASE(name) Label##name:
+#	define DISPATCH() do { instruction = *pc++; goto *DispatchTable[instruction & 0xff]; } while (false)
+#else
+#	define CASE(name) case Op::name:
+#	define DISPATCH() continue
+#endif
+
+#define ARITHMETIC(left, right, expression) \
+	{ \
+		const Value a = left; \
+		const Value b = right; \
+		if (!a.IsNumber() || !b.IsNumber()) [[unlikely]] \
+			RUNTIME_ERROR("attempt to perform arithmetic on a {} value", GetTypeName(a.IsNumber() ? b : a)); \
+		const double x = a.AsNumber(); \
+		const double y = b.AsNumber(); \
+		RA = Value::Number(expression); \
+	} \
+	DISPATCH();
+
+#define COMPARISON(left, right, operator) \
+	{ \
+		const Value a = left; \
+		const Value b = right; \
+		if (a.IsNumber() && b.IsNumber()) [[likely]] \
+			RA = Value::Bool(a.AsNumber() operator b.AsNumber()); \
+		else if (a.Is(ObjectType::String) && b.Is(ObjectType::String)) \
+			RA = Value::Bool(a.AsString()->GetView() operator b.AsString()->GetView()); \
+		else \
+			RUNTIME_ERROR("attempt to compare {} with {}", GetTypeName(a), GetTypeName(b)); \
+	} \
+	DISPATCH();
+
+bool VM::execute(size_t entryDepth)
+{
+	CallFrame* frame;
+	const uint32_t* pc;
+	Value* base;
+	const Value* constants;
+	uint32_t instruction;
+	LOAD_FRAME();
+
+#if SCRIPT_COMPUTED_GOTO
+	static const void* const DispatchTable[] = {
+#	define SCRIPT_OPCODE_LABEL(name) &&Label##name,
+		SCRIPT_OPCODES(SCRIPT_OPCODE_LABEL)
+#	undef SCRIPT_OPCODE_LABEL
+	};
+	DISPATCH();
+#else
+	for (;;)
+	{
+		instruction = *pc++;
+		switch (GetOp(instruction))
+		{
+#endif
+
+	CASE(Move) RA = RB; DISPATCH();
+	CASE(LoadK) RA = constants[GetBx(instruction)]; DISPATCH();
+	CASE(LoadNil) RA = Value::Nil(); DISPATCH();
+	CASE(LoadTrue) RA = Value::Bool(true); DISPATCH();
+	CASE(LoadFalse) RA = Value::Bool(false); DISPATCH();
+
+	CASE(GetGlobal)
+	{
+		const Value value = m_globals[GetBx(instruction)];
+		if (value.IsUndefined()) [[unlikely]]
+			RUNTIME_ERROR("undefined variable '{}'", m_globalNames[GetBx(instruction)]->GetView());
+		RA = value;
+	}
+	DISPATCH();
+
+	CASE(SetGlobal) m_globals[GetBx(instruction)] = RA; DISPATCH();
+	CASE(DefineGlobal)
+	{
+		Value& global = m_globals[GetBx(instruction)];
+		if (!m_reloading || global.IsUndefined()) global = RA;
+	}
+	DISPATCH();
+	CASE(DefineClass) defineClass(GetBx(instruction), static_cast<Class*>(RA.AsObject())); DISPATCH();
+
+	CASE(GetField)
+	{
+		const Value object = RB;
+		if (object.Is(ObjectType::Instance)) [[likely]]
+		{
+			if (const Value* value = static_cast<Instance*>(object.AsObject())->fields.Find(KC))
+			{
+				RA = *value;
+				DISPATCH();
+			}
+		}
+		Value result;
+		if (!getField(object, KC.AsString(), result)) goto error;
+		RA = result;
+	}
+	DISPATCH();
+
+	CASE(SetField)
+	{
+		const Value object = RA;
+		const Value value = RC;
+		// перезапись существующего поля не меняет размер таблицы
+		if (object.Is(ObjectType::Instance) && !value.IsNil()) [[likely]]
+		{
+			Instance* instance = static_cast<Instance*>(object.AsObject());
+			if (Value* field = instance->fields.Find(constants[GetB(instruction)]))
+			{
+				*field = value;
+				barrier(instance, value);
+				DISPATCH();
+			}
+		}
+		if (!setField(object, constants[GetB(instruction)].AsString(), value)) goto error;
+	}
+	DISPATCH();
+
+	CASE(GetIndex)
+	{
+		const Value object = RB;
+		const Value key = RC;
+		uint32_t index = 0;
+		if (object.Is(ObjectType::Table))
+		{
+			const ValueTable& table = static_cast<Table*>(object.AsObject())->table;
+			if (arrayIndex(key, table.GetArrayCount(), index)) [[likely]]
+			{
+				RA = table.GetArray()[index];
+				DISPATCH();
+			}
+		}
+		Value result;
+		if (!getIndex(object, key, result)) goto error;
+		RA = result;
+	}
+	DISPATCH();
+
+	CASE(SetIndex)
+	{
+		const Value object = RA;
+		const Value key = RB;
+		const Value value = RC;
+		uint32_t index = 0;
+		if (object.Is(ObjectType::Table) && !value.IsNil())
+		{
+			Table* table = static_cast<Table*>(object.AsObject());
+			if (arrayIndex(key, table->table.GetArrayCount(), index)) [[likely]]
+			{
+				table->table.GetArray()[index] = value;
+				barrier(table, value);
+				DISPATCH();
+			}
+		}
+		if (!setIndex(object, key, value)) goto error;
+	}
+	DISPATCH();
+
+	CASE(NewTable)
+	{
+		Table* table = NewTable();
+		if (const uint32_t arrayCount = GetB(instruction))
+		{
+			table->table.GetArrayStorage().reserve(arrayCount);
+			trackMemory(arrayCount * sizeof(Value));
+		}
+		RA = Value::FromObject(table);
+		gcCheck();
+	}
+	DISPATCH();
+
+	CASE(Append)
+	{
+		Table* table = static_cast<Table*>(RA.AsObject());
+		const Value* values = &RA + 1;
+		for (uint32_t i = 0; i < GetB(instruction); i++) PushTableValue(table, values[i]);
+	}
+	DISPATCH();
+
+	CASE(Add) ARITHMETIC(RB, RC, x + y)
+	CASE(Sub) ARITHMETIC(RB, RC, x - y)
+	CASE(Mul) ARITHMETIC(RB, RC, x * y)
+	CASE(Div) ARITHMETIC(RB, RC, x / y)
+	CASE(Mod) ARITHMETIC(RB, RC, x - std::floor(x / y) * y)
+	CASE(AddK) ARITHMETIC(RB, KC, x + y)
+	CASE(SubK) ARITHMETIC(RB, KC, x - y)
+	CASE(MulK) ARITHMETIC(RB, KC, x * y)
+	CASE(DivK) ARITHMETIC(RB, KC, x / y)
+	CASE(ModK) ARITHMETIC(RB, KC, x - std::floor(x / y) * y)
+
+	CASE(Neg)
+	{
+		const Value value = RB;
+		if (!value.IsNumber()) [[unlikely]]
+			RUNTIME_ERROR("attempt to negate a {} value", GetTypeName(value));
+		RA = Value::Number(-value.AsNumber());
+	}
+	DISPATCH();
+
+	CASE(Not) RA = Value::Bool(RB.IsFalsy()); DISPATCH();
+
+	CASE(Concat)
+	{
+		String* string = concatenate(RB, RC);
+		if (!string) goto error;
+		RA = Value::FromObject(string);
+		gcCheck();
+	}
+	DISPATCH();
+
+	CASE(Eq) RA = Value::Bool(RB == RC); DISPATCH();
+	CASE(Ne) RA = Value::Bool(!(RB == RC)); DISPATCH();
+	CASE(Lt) COMPARISON(RB, RC, <)
+	CASE(Le) COMPARISON(RB, RC, <=)
+	CASE(EqK) RA = Value::Bool(RB == KC); DISPATCH();
+	CASE(NeK) RA = Value::Bool(!(RB == KC)); DISPATCH();
+	CASE(LtK) COMPARISON(RB, KC, <)
+	CASE(LeK) COMPARISON(RB, KC, <=)
+	CASE(GtK) COMPARISON(RB, KC, >)
+	CASE(GeK) COMPARISON(RB, KC, >=)
+
+	CASE(Jump) pc += GetSBx(instruction); DISPATCH();
+	CASE(JumpIf) if (!RA.IsFalsy()) pc += GetSBx(instruction); DISPATCH();
+	CASE(JumpIfNot) if (RA.IsFalsy()) pc += GetSBx(instruction); DISPATCH();
+
+	CASE(Call)
+	{
+		frame->pc = pc;
+		const size_t depth = m_frames.size();
+		if (!callValue(&RA, GetB(instruction))) goto error;
+		if (m_frames.size() != depth)
+		{
+			LOAD_FRAME();
+		}
+		else
+			gcCheck();
+	}
+	DISPATCH();
+
+	CASE(Invoke)
+	{
+		frame->pc = pc;
+		const size_t depth = m_frames.size();
+		if (!invoke(&RA, GetB(instruction), KC.AsString())) goto error;
+		if (m_frames.size() != depth)
+		{
+			LOAD_FRAME();
+		}
+		else
+			gcCheck();
+	}
+	DISPATCH();
+
+	CASE(Return)
+	{
+		base[-1] = frame->constructor ? base[0] : RA;
+		m_frames.pop_back();
+		if (m_frames.size() == entryDepth) return true;
+		LOAD_FRAME();
+		gcCheck();
+	}
+	DISPATCH();
+
+	CASE(ReturnNil)
+	{
+		base[-1] = frame->constructor ? base[0] : Value::Nil();
+		m_frames.pop_back();
+		if (m_frames.size() == entryDepth) return true;
+		LOAD_FRAME();
+		gcCheck();
+	}
+	DISPATCH();
+
+	CASE(ForPrep)
+	{
+		Value* loop = &RA;
+		if (!loop[0].IsNumber() || !loop[1].IsNumber() || !loop[2].IsNumber()) [[unlikely]]
+			RUNTIME_ERROR("'for' start, limit and step must be numbers");
+		if (loop[2].AsNumber() == 0.0) [[unlikely]]
+			RUNTIME_ERROR("'for' step is zero");
+		loop[0] = Value::Number(loop[0].AsNumber() - loop[2].AsNumber());
+		pc += GetSBx(instruction);
+	}
+	DISPATCH();
+
+	CASE(ForLoop)
+	{
+		Value* loop = &RA;
+		const double step = loop[2].AsNumber();
+		const double index = loop[0].AsNumber() + step;
+		const double limit = loop[1].AsNumber();
+		if (step > 0.0 ? index <= limit : index >= limit)
+		{
+			loop[0] = loop[3] = Value::Number(index);
+			pc += GetSBx(instruction);
+		}
+	}
+	DISPATCH();
+
+	CASE(Iterate)
+	{
+		Value* loop = &RA;
+		if (!loop[0].Is(ObjectType::Table)) [[unlikely]]
+			RUNTIME_ERROR("attempt to iterate over a {} value", GetTypeName(loop[0]));
+		uint32_t position = (uint32_t)loop[1].AsNumber();
+		Value key, value;
+		if (static_cast<Table*>(loop[0].AsObject())->table.Next(position, key, value))
+		{
+			loop[1] = Value::Number(position);
+			loop[2] = key;
+			loop[3] = value;
+			pc += GetSBx(instruction);
+		}
+	}
+	DISPATCH();
+
+#if !SCRIPT_COMPUTED_GOTO
+		default:
+			RUNTIME_ERROR("invalid opcode {}", instruction & 0xff);
+		}
+	}
+#endif
+
+error:
+	frame->pc = pc;
+	return reportError(entryDepth);
+}
+
+#undef RA
+#undef RB
+#undef RC
+#undef KC
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef CASE
+#undef DISPATCH
+#undef ARITHMETIC
+#undef COMPARISON
+//=============================================================================
+std::string VM::ToString(Value value) const
+{
+	if (value.IsNumber()) return numberToString(value.AsNumber());
+	if (value.IsNil() || value.IsUndefined()) return "nil";
+	if (value.IsBool()) return value.AsBool() ? "true" : "false";
+
+	const Object* object = value.AsObject();
+	switch (object->type)
+	{
+	case ObjectType::String: return std::string(static_cast<const String*>(object)->GetView());
+	case ObjectType::Table: return std::format("table: {}", (const void*)object);
+	case ObjectType::Function: return std::format("fn {}", static_cast<const Function*>(object)->name->GetView());
+	case ObjectType::NativeFunction: return std::format("native fn {}", static_cast<const NativeFunction*>(object)->name->GetView());
+	case ObjectType::Class: return std::format("class {}", static_cast<const Class*>(object)->name->GetView());
+	case ObjectType::Instance: return std::format("{}: {}", static_cast<const Instance*>(object)->klass->name->GetView(), (const void*)object);
+	case ObjectType::NativeObject: return std::format("{}: {}", static_cast<const NativeObject*>(object)->klass->name->GetView(), static_cast<const NativeObject*>(object)->pointer);
+	}
+	return "?";
+}
+//=============================================================================
+const char* VM::GetTypeName(Value value)
+{
+	if (value.IsNumber()) return "number";
+	if (value.IsNil() || value.IsUndefined()) return "nil";
+	if (value.IsBool()) return "bool";
+	switch (value.AsObject()->type)
+	{
+	case ObjectType::String: return "string";
+	case ObjectType::Table: return "table";
+	case ObjectType::Function:
+	case ObjectType::NativeFunction: return "function";
+	case ObjectType::Class: return "class";
+	case ObjectType::Instance: return "instance";
+	case ObjectType::NativeObject: return "native object";
+	}
+	return "?";
+}
+//=============================================================================
+void VM::markObject(Object* object)
+{
+	if (!isWhite(object)) return;
+	// у строки нет ссылок - сразу черная
+	if (object->type == ObjectType::String)
+	{
+		object->color = GcColor::Black;
+		return;
+	}
+	object->color = GcColor::Gray;
+	m_grayStack.push_back(object);
+}
+//=============================================================================
+void VM::markTable(const ValueTable& table)
+{
+	const Value* array = table.GetArray();
+	for (uint32_t i = 0; i < table.GetArrayCount(); i++) markValue(array[i]);
+	const ValueTable::Entry* entries = table.GetEntries();
+	for (uint32_t i = 0; i < table.GetHashCapacity(); i++)
+	{
+		if (!isLive(entries[i])) continue;
+		markValue(entries[i].key);
+		markValue(entries[i].value);
+	}
+}
+//=============================================================================
+void VM::markRoots()
+{
+	for (const Value* value = m_stack.data(), *top = getStackTop(); value < top; value++) markValue(*value);
+	for (const Value& value : m_globals) markValue(value);
+	for (String* name : m_globalNames) markObject(name);
+	for (Class* klass : m_nativeClasses) markObject(klass);
+	for (const CallFrame& frame : m_frames) markObject(frame.function);
+	markObject(m_initName);
+}
+//=============================================================================
+uint32_t VM::propagate(uint32_t budget)
+{
+	uint32_t work = 0;
+	while (!m_grayStack.empty() && work < budget)
+	{
+		Object* object = m_grayStack.back();
+		m_grayStack.pop_back();
+		if (object->color != GcColor::Gray) continue;
+		object->color = GcColor::Black;
+		work++;
+
+		switch (object->type)
+		{
+		case ObjectType::String:
+			break;
+		case ObjectType::Table:
+		{
+			const ValueTable& table = static_cast<Table*>(object)->table;
+			markTable(table);
+			work += table.GetArrayCount() + table.GetHashCapacity();
+			break;
+		}
+		case ObjectType::Function:
+		{
+			const Function* function = static_cast<Function*>(object);
+			markObject(function->name);
+			markObject(function->chunkName);
+			for (const Value& constant : function->constants) markValue(constant);
+			work += (uint32_t)function->constants.size();
+			break;
+		}
+		case ObjectType::NativeFunction:
+			markObject(static_cast<NativeFunction*>(object)->name);
+			break;
+		case ObjectType::Class:
+		{
+			const Class* klass = static_cast<Class*>(object);
+			markObject(klass->name);
+			markTable(klass->methods);
+			markTable(klass->properties);
+			work += klass->methods.GetHashCapacity() + klass->properties.GetHashCapacity();
+			break;
+		}
+		case ObjectType::Instance:
+		{
+			const Instance* instance = static_cast<Instance*>(object);
+			markObject(instance->klass);
+			markTable(instance->fields);
+			work += instance->fields.GetArrayCount() + instance->fields.GetHashCapacity();
+			break;
+		}
+		case ObjectType::NativeObject:
+			markObject(static_cast<NativeObject*>(object)->klass);
+			break;
+		}
+	}
+	return work;
+}
+//=============================================================================
+void VM::atomic()
+{
+	// корни менялись без барьеров (стек, глобальные) - просматриваются еще раз, затем пометка до конца
+	markRoots();
+	propagate(UINT32_MAX);
+	m_currentWhite = otherWhite();
+	m_sweepCursor = &m_objects;
+	m_gcPhase = GcPhase::Sweep;
+}
+//=============================================================================
+bool VM::sweep(uint32_t budget)
+{
+	const GcColor dead = otherWhite();
+	for (uint32_t work = 0; *m_sweepCursor && work < budget; work++)
+	{
+		Object* object = *m_sweepCursor;
+		if (object->color == dead)
+		{
+			*m_sweepCursor = object->next;
+			freeObject(object);
+			m_gcStatistics.freedObjects++;
+		}
+		else
+		{
+			object->color = m_currentWhite;
+			m_sweepCursor = &object->next;
+		}
+	}
+	return *m_sweepCursor == nullptr;
+}
+//=============================================================================
+void VM::finishCycle()
+{
+	m_sweepCursor = nullptr;
+	m_gcPhase = GcPhase::Idle;
+	m_gcThreshold = std::max(m_gcSettings.minThreshold, (size_t)((double)m_bytesAllocated * m_gcSettings.pauseRatio));
+}
+//=============================================================================
+void VM::gcStep()
+{
+	if (m_gcPaused) return;
+	if (m_gcPhase == GcPhase::Idle)
+	{
+		if (m_bytesAllocated < m_gcThreshold)
+		{
+			m_gcDebt = 0;
+			return;
+		}
+		m_gcStatistics.cycles++;
+		markRoots();
+		m_gcPhase = GcPhase::Mark;
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	if (m_gcPhase == GcPhase::Mark)
+	{
+		propagate(m_gcSettings.stepWork);
+		if (m_grayStack.empty()) atomic();
+	}
+	else if (sweep(m_gcSettings.stepWork))
+		finishCycle();
+
+	// долг гасится по шагу за раз: при быстром выделении шаги идут на каждой безопасной точке, но каждый ограничен
+	m_gcDebt = std::max<ptrdiff_t>(m_gcDebt - (ptrdiff_t)m_gcSettings.stepBytes, 0);
+	const double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	m_gcStatistics.steps++;
+	m_gcStatistics.totalMicroseconds += microseconds;
+	m_gcStatistics.maxStepMicroseconds = std::max(m_gcStatistics.maxStepMicroseconds, microseconds);
+}
+//=============================================================================
+void VM::CollectGarbage()
+{
+	if (m_gcPaused) return;
+	PROFILE_FUNCTION();
+
+	const auto start = std::chrono::steady_clock::now();
+	if (m_gcPhase == GcPhase::Idle)
+	{
+		m_gcStatistics.cycles++;
+		markRoots();
+		m_gcPhase = GcPhase::Mark;
+	}
+	if (m_gcPhase == GcPhase::Mark) atomic();
+	sweep(UINT32_MAX);
+	finishCycle();
+	m_gcDebt = 0;
+	m_gcStatistics.totalMicroseconds += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+//=============================================================================
+namespace
+{
+	bool checkArgumentCount(VM& vm, const char* name, uint32_t argCount, uint32_t expected)
+	{
+		if (argCount == expected) return true;
+		return vm.Error("{} expects {} arguments, got {}", name, expected, argCount);
+	}
+
+	bool getNumber(VM& vm, const char* name, const Value* args, uint32_t index, double& number)
+	{
+		if (!args[index].IsNumber()) return vm.Error("{}: argument {} must be a number, got {}", name, index + 1, VM::GetTypeName(args[index]));
+		number = args[index].AsNumber();
+		return true;
+	}
+
+	bool getTable(VM& vm, const char* name, const Value* args, Table*& table)
+	{
+		if (!args[0].Is(ObjectType::Table)) return vm.Error("{}: argument 1 must be a table, got {}", name, VM::GetTypeName(args[0]));
+		table = static_cast<Table*>(args[0].AsObject());
+		return true;
+	}
+
+	bool printValues(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		std::string text;
+		for (uint32_t i = 0; i < argCount; i++)
+		{
+			if (i > 0) text += '\t';
+			text += vm.ToString(args[i]);
+		}
+		LOG_INFO(Script, "{}", text);
+		return true;
+	}
+
+	bool lengthOf(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		if (!checkArgumentCount(vm, "len", argCount, 1)) return false;
+		if (args[0].Is(ObjectType::String))
+			result = Value::Number(args[0].AsString()->length);
+		else if (args[0].Is(ObjectType::Table))
+			result = Value::Number(static_cast<Table*>(args[0].AsObject())->table.GetArrayCount());
+		else
+			return vm.Error("len: expected a string or a table, got {}", VM::GetTypeName(args[0]));
+		return true;
+	}
+
+	bool pushValue(VM& vm, Value* args, uint32_t argCount, Value&)
+	{
+		Table* table = nullptr;
+		if (!checkArgumentCount(vm, "push", argCount, 2) || !getTable(vm, "push", args, table)) return false;
+		if (args[1].IsNil()) return vm.Error("push: value is nil");
+		vm.PushTableValue(table, args[1]);
+		return true;
+	}
+
+	bool popValue(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		Table* table = nullptr;
+		if (!checkArgumentCount(vm, "pop", argCount, 1) || !getTable(vm, "pop", args, table)) return false;
+		std::vector<Value>& array = table->table.GetArrayStorage();
+		if (array.empty()) return true;
+		result = array.back();
+		array.pop_back();
+		return true;
+	}
+
+	bool removeKey(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		Table* table = nullptr;
+		if (!checkArgumentCount(vm, "remove", argCount, 2) || !getTable(vm, "remove", args, table)) return false;
+		result = table->table.Get(args[1]);
+		if (!args[1].IsNil()) vm.SetTableValue(table, table->table, args[1], Value::Nil());
+		return true;
+	}
+
+	bool toString(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		if (!checkArgumentCount(vm, "tostring", argCount, 1)) return false;
+		result = args[0].Is(ObjectType::String) ? args[0] : Value::FromObject(vm.Intern(vm.ToString(args[0])));
+		return true;
+	}
+
+	bool toNumber(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		if (!checkArgumentCount(vm, "tonumber", argCount, 1)) return false;
+		if (args[0].IsNumber())
+			result = args[0];
+		else if (args[0].Is(ObjectType::String))
+		{
+			const std::string_view text = args[0].AsString()->GetView();
+			double number = 0.0;
+			const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+			if (error == std::errc() && end == text.data() + text.size()) result = Value::Number(number);
+		}
+		return true;
+	}
+
+	bool joinValues(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		Table* table = nullptr;
+		if ((argCount != 1 && argCount != 2) || !getTable(vm, "join", args, table))
+			return argCount == 1 || argCount == 2 ? false : vm.Error("join expects a table and an optional separator");
+		std::string_view separator;
+		if (argCount == 2)
+		{
+			if (!args[1].Is(ObjectType::String)) return vm.Error("join: separator must be a string");
+			separator = args[1].AsString()->GetView();
+		}
+
+		std::string text;
+		const ValueTable& values = table->table;
+		for (uint32_t i = 0; i < values.GetArrayCount(); i++)
+		{
+			if (i > 0) text += separator;
+			const Value value = values.GetArray()[i];
+			if (value.Is(ObjectType::String))
+				text += value.AsString()->GetView();
+			else if (value.IsNumber())
+				text += numberToString(value.AsNumber());
+			else
+				return vm.Error("join: element {} is a {}", i, VM::GetTypeName(value));
+		}
+		result = Value::FromObject(vm.Intern(text));
+		return true;
+	}
+
+	bool clockSeconds(VM&, Value*, uint32_t, Value& result)
+	{
+		result = Value::Number(std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		return true;
+	}
+
+	bool collectGarbage(VM& vm, Value*, uint32_t, Value& result)
+	{
+		vm.CollectGarbage();
+		result = Value::Number((double)vm.GetHeapSize() / 1024.0);
+		return true;
+	}
+
+	template<double(*Function)(double)>
+	bool mathFunction(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		double x = 0.0;
+		if (!checkArgumentCount(vm, "math function", argCount, 1) || !getNumber(vm, "math function", args, 0, x)) return false;
+		result = Value::Number(Function(x));
+		return true;
+	}
+
+	template<bool Minimum>
+	bool mathExtremum(VM& vm, Value* args, uint32_t argCount, Value& result)
+	{
+		const char* name = Minimum ? "min" : "max";
+		if (argCount == 0) return vm.Error("{} expects at least one argument", name);
+		double extremum = 0.0;
+		if (!getNumber(vm, name, args, 0, extremum)) return false;
+		for (uint32_t i = 1; i < argCount; i++)
+		{
+			double x = 0.0;
+			if (!getNumber(vm, name, args, i, x)) return false;
+			extremum = Minimum ? std::min(extremum, x) : std::max(extremum, x);
+		}
+		result = Value::Number(extremum);
+		return true;
+	}
+
+	double squareRoot(double x) { return std::sqrt(x); }
+	double roundDown(double x) { return std::floor(x); }
+	double absolute(double x) { return std::abs(x); }
+	double sine(double x) { return std::sin(x); }
+	double cosine(double x) { return std::cos(x); }
+}
+//=============================================================================
+void script::OpenStandardLibrary(VM& vm)
+{
+	vm.DefineNative("print", printValues);
+	vm.DefineNative("len", lengthOf);
+	vm.DefineNative("push", pushValue);
+	vm.DefineNative("pop", popValue);
+	vm.DefineNative("remove", removeKey);
+	vm.DefineNative("tostring", toString);
+	vm.DefineNative("tonumber", toNumber);
+	vm.DefineNative("join", joinValues);
+	vm.DefineNative("clock", clockSeconds);
+	vm.DefineNative("gc", collectGarbage);
+
+	Table* math = vm.NewTable();
+	vm.SetGlobal("math", Value::FromObject(math));
+	auto set = [&](std::string_view name, Value value) { vm.SetTableValue(math, math->table, Value::FromObject(vm.Intern(name)), value); };
+	set("sqrt", vm.NewNativeFunction("sqrt", mathFunction<squareRoot>));
+	set("floor", vm.NewNativeFunction("floor", mathFunction<roundDown>));
+	set("abs", vm.NewNativeFunction("abs", mathFunction<absolute>));
+	set("sin", vm.NewNativeFunction("sin", mathFunction<sine>));
+	set("cos", vm.NewNativeFunction("cos", mathFunction<cosine>));
+	set("min", vm.NewNativeFunction("min", mathExtremum<true>));
+	set("max", vm.NewNativeFunction("max", mathExtremum<false>));
+	set("pi", Value::Number(glm::pi<double>()));
+}
+//=============================================================================
+bool script::RunBenchmark(const std::string& directory)
+{
+	using Clock = std::chrono::steady_clock;
+	constexpr const char* Names[] = { "fib", "nbody", "strings", "tables" };
+
+	LOG_INFO(Script, "Script VM benchmark, dispatch: {}", SCRIPT_COMPUTED_GOTO ? "computed goto" : "switch");
+	bool succeeded = true;
+	for (const char* name : Names)
+	{
+		VM vm;
+		OpenStandardLibrary(vm);
+		const std::string path = std::format("{}/{}.script", directory, name);
+		if (!vm.RunFile(path))
+		{
+			succeeded = false;
+			continue;
+		}
+		if (vm.GetGlobal("run").IsNil())
+		{
+			LOG_ERROR(Script, "Benchmark script has no run(): {}", path);
+			succeeded = false;
+			continue;
+		}
+
+		Value result;
+		const auto start = Clock::now();
+		if (!vm.CallGlobal("run", nullptr, 0, &result))
+		{
+			succeeded = false;
+			continue;
+		}
+		const double milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		const GcStatistics& gc = vm.GetGcStatistics();
+		LOG_INFO(Script, "  {:<8} {:9.2f} ms   result {}   gc: {} cycles, {} steps, max step {:.1f} us, heap {} KB",
+			name, milliseconds, vm.ToString(result), gc.cycles, gc.steps, gc.maxStepMicroseconds, vm.GetHeapSize() / 1024);
+	}
+	return succeeded;
+}
+//=============================================================================
\ No newline at end of file
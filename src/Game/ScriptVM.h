@@ -0,0 +1,181 @@
+﻿#pragma once
+
+#include "Script.h"
+
+namespace script
+{
+	// Темп инкрементальной сборки: цикл начинается, когда куча выросла в pauseRatio раз от живой после прошлого цикла,
+	// дальше каждые stepBytes выделенной памяти выполняется шаг не больше stepWork единиц работы
+	// (объект или значение при пометке, объект при очистке). Длина паузы ограничена stepWork, а не размером кучи
+	struct GcSettings final
+	{
+		float    pauseRatio{ 2.0f };
+		size_t   minThreshold{ 1024 * 1024 };
+		size_t   stepBytes{ 64 * 1024 };
+		uint32_t stepWork{ 4096 };
+	};
+
+	struct GcStatistics final
+	{
+		uint64_t cycles{ 0 };
+		uint64_t steps{ 0 };
+		uint64_t freedObjects{ 0 };
+		double   totalMicroseconds{ 0.0 };
+		double   maxStepMicroseconds{ 0.0 };
+	};
+
+	// Виртуальная машина: регистровый байткод, куча объектов с инкрементальным сборщиком мусора, глобальные переменные.
+	// Не потокобезопасна: все вызовы с одного потока
+	class VM final
+	{
+	public:
+		VM();
+		~VM();
+		VM(const VM&) = delete;
+		VM& operator=(const VM&) = delete;
+
+		// Компилирует и выполняет главную функцию. Ошибки компиляции и выполнения - в лог, false
+		bool RunSource(std::string_view source, const std::string& chunkName);
+		bool RunFile(const std::string& path);
+		// Главная функция файла без выполнения, nullptr - ошибка компиляции
+		Function* Compile(std::string_view source, const std::string& chunkName);
+		// reload - повторное выполнение измененного файла: var уровня файла не трогает уже заданные глобальные,
+		// функции заменяются, классы получают новые методы, живые экземпляры остаются как есть
+		bool RunMain(Function* main, bool reload = false);
+
+		// Вызов функции, нативной функции или конструктора класса из кода движка
+		bool Call(Value callee, const Value* args, uint32_t argCount, Value* result = nullptr);
+		// Вызов глобальной функции, если она определена; false - ошибка выполнения
+		bool CallGlobal(std::string_view name, const Value* args, uint32_t argCount, Value* result = nullptr);
+
+		Value GetGlobal(std::string_view name);
+		void SetGlobal(std::string_view name, Value value);
+		Value NewNativeFunction(std::string_view name, NativeFn function);
+		void DefineNative(std::string_view name, NativeFn function) { SetGlobal(name, NewNativeFunction(name, function)); }
+		Class* DefineNativeClass(const NativeClassDesc& desc);
+		// Ссылка на объект движка, класс - из DefineNativeClass
+		Value NewNativeObject(Class* klass, void* pointer, uint64_t handle = 0);
+		// То же по описанию: класс определяется при первом обращении
+		Value NewNativeObject(const NativeClassDesc& desc, void* pointer, uint64_t handle = 0);
+
+		String* Intern(std::string_view text);
+		Table* NewTable();
+		// Запись в таблицу объекта кучи из нативного кода: барьер сборщика и учет памяти
+		void SetTableValue(Object* owner, ValueTable& table, Value key, Value value);
+		void PushTableValue(Table* table, Value value);
+		std::string ToString(Value value) const;
+		static const char* GetTypeName(Value value);
+
+		// Для нативных функций: сообщение ошибки выполнения, вызывающий возвращает false
+		template<typename... Args>
+		bool Error(std::format_string<Args...> format, Args&&... args)
+		{
+			m_error = std::format(format, std::forward<Args>(args)...);
+			return false;
+		}
+
+		// Полный цикл сборки сразу, например между уровнями
+		void CollectGarbage();
+		void SetGcSettings(const GcSettings& settings) { m_gcSettings = settings; }
+		const GcStatistics& GetGcStatistics() const { return m_gcStatistics; }
+		size_t GetHeapSize() const { return m_bytesAllocated; }
+
+		// Для компилятора и загрузчика байткода: слот глобальной переменной по имени, создается при первом обращении
+		uint32_t GetGlobalSlot(String* name);
+		String* GetGlobalName(uint32_t slot) const { return m_globalNames[slot]; }
+		// Объекты, созданные до ResumeGc, еще не достижимы из корней и не собираются
+		void PauseGc() { m_gcPaused++; }
+		void ResumeGc() { m_gcPaused--; }
+		Function* NewFunction(String* name, String* chunkName);
+		Class* NewClass(String* name);
+
+	private:
+		struct CallFrame final
+		{
+			Function*       function;
+			const uint32_t* pc;
+			Value*          base;
+			bool            constructor; // init вызван конструктором, результат - this
+		};
+
+		enum class GcPhase : uint8_t
+		{
+			Idle,
+			Mark,
+			Sweep
+		};
+
+		template<typename T>
+		T* allocate(ObjectType type, size_t size = sizeof(T));
+		void freeObject(Object* object);
+
+		bool execute(size_t entryDepth);
+		// callee в slot, аргументы после него. Функция сценария - новый кадр, нативная выполняется сразу
+		bool callValue(Value* slot, uint32_t argCount);
+		bool pushFrame(Function* function, Value* slot, uint32_t argCount, bool constructor);
+		bool getField(Value object, String* name, Value& result);
+		bool setField(Value object, String* name, Value value);
+		bool getIndex(Value object, Value key, Value& result);
+		bool setIndex(Value object, Value key, Value value);
+		bool invoke(Value* slot, uint32_t argCount, String* name);
+		String* concatenate(Value a, Value b);
+		void defineClass(uint32_t slot, Class* klass);
+		bool reportError(size_t entryDepth);
+		Value* getStackTop();
+
+		// сборщик мусора
+		void gcCheck() { if (m_gcDebt >= (ptrdiff_t)m_gcSettings.stepBytes) gcStep(); }
+		void gcStep();
+		void markValue(Value value) { if (value.IsObject()) markObject(value.AsObject()); }
+		void markObject(Object* object);
+		void markTable(const ValueTable& table);
+		void markRoots();
+		uint32_t propagate(uint32_t budget);
+		void atomic();
+		// true - список объектов пройден до конца
+		bool sweep(uint32_t budget);
+		void finishCycle();
+		void trackMemory(ptrdiff_t delta) { m_bytesAllocated += delta; m_gcDebt += delta; }
+		void barrier(Object* container, Value value)
+		{
+			// при очистке черные объекты не трогаем: новые и выжившие объекты уже текущего белого цвета
+			if (container->color == GcColor::Black && m_gcPhase == GcPhase::Mark && value.IsObject() && isWhite(value.AsObject())) [[unlikely]]
+			{
+				// назад: черный контейнер снова серый и будет просмотрен еще раз
+				container->color = GcColor::Gray;
+				m_grayStack.push_back(container);
+			}
+		}
+		bool isWhite(const Object* object) const { return object->color == GcColor::White0 || object->color == GcColor::White1; }
+		GcColor otherWhite() const { return m_currentWhite == GcColor::White0 ? GcColor::White1 : GcColor::White0; }
+
+		std::vector<Value>      m_stack;
+		std::vector<CallFrame>  m_frames;
+		std::string             m_error;
+		std::vector<Value>      m_globals;
+		std::vector<String*>    m_globalNames;
+		ValueTable              m_globalSlots; // имя -> номер слота
+		std::vector<Class*>     m_nativeClasses;
+		std::unordered_map<std::string_view, String*> m_strings;
+		String*                 m_initName{ nullptr };
+		bool                    m_reloading{ false };
+
+		Object*                 m_objects{ nullptr };
+		std::vector<Object*>    m_grayStack;
+		Object**                m_sweepCursor{ nullptr };
+		GcPhase                 m_gcPhase{ GcPhase::Idle };
+		GcColor                 m_currentWhite{ GcColor::White0 };
+		uint32_t                m_gcPaused{ 0 }; // компилятор держит объекты вне корней
+		size_t                  m_bytesAllocated{ 0 };
+		size_t                  m_gcThreshold{ 0 };
+		ptrdiff_t               m_gcDebt{ 0 };
+		GcSettings              m_gcSettings;
+		GcStatistics            m_gcStatistics;
+	};
+
+	// Встроенные функции: print, len, push, pop, remove, tostring, tonumber, join, clock, gc и математика
+	void OpenStandardLibrary(VM& vm);
+
+	// Замер интерпретатора на сценариях fib, nbody, strings, tables из каталога, результат в лог
+	bool RunBenchmark(const std::string& directory);
+}
\ No newline at end of file
@@ -0,0 +1,854 @@
+﻿#include "stdafx.h"
+#include "Terrain.h"
+#include "FramePacket.h"
+#include "GpuProfiler.h"
+#include "Log.h"
+#include "Profiler.h"
+#include "Utility.h"
+//=============================================================================
+namespace
+{
+	constexpr uint32_t TerrainDataBindingPoint = 5;
+	constexpr uint32_t NodeBufferRegions = 3;
+	constexpr uint32_t MaxDrawNodes = 4096; // на кадр; при разумной lodDistance выбирается на порядок меньше
+	constexpr uint32_t NodeGroupCount = 5;  // целые узлы и четыре четверти
+
+	// Раскладка std140 блока TerrainData
+	struct TerrainUniformData final
+	{
+		glm::vec4 area;         // xy - мировое начало, zw - размер
+		glm::vec4 heightParams; // x - масштаб, y - смещение, zw - размер карты в отсчетах, у .tiles - размер страницы
+		glm::vec4 gridParams;   // x - квадов на сторону узла, y - метров на повтор текстуры, z - шаг отсчетов, w - кайма страницы
+		glm::vec4 morphRanges[Terrain::MaxLodCount];
+	};
+
+	static_assert(Terrain::MaxLodCount == 12, "MaxLodCount must match MorphRanges in the terrain shader");
+	static_assert(TerrainTileHeader::MaxLevels == Terrain::MaxLodCount, "Tile levels map to terrain LODs one to one");
+
+	const GLchar* terrainCommonSource = R"glsl(
+layout(binding = 1) uniform CameraData
+{
+	mat4 view;
+	mat4 projection;
+	vec3 cameraPosition;
+};
+
+layout(std140, binding = 5) uniform TerrainData
+{
+	vec4 TerrainArea;     // xy - world origin, zw - world size
+	vec4 HeightParams;    // x - height scale, y - height offset, zw - heightmap size in samples, page size when streamed
+	vec4 GridParams;      // x - quads per node side, y - texture repeat in meters, z - sample spacing, w - page apron
+	vec4 MorphRanges[12]; // x - morph start, y - morph end for each LOD
+};
+
+#ifdef TERRAIN_STREAMED
+layout(binding = 0) uniform sampler2DArray s2aHeightPages;
+
+// texel - page sample coordinates including the apron, layer - page cache layer
+float pageHeight(vec2 texel, float layer)
+{
+	return textureLod(s2aHeightPages, vec3((texel + 0.5f) / HeightParams.zw, layer), 0.0f).r * HeightParams.x + HeightParams.y;
+}
+#else
+layout(binding = 0) uniform sampler2D s2Heightmap;
+
+float sampleHeight(vec2 world)
+{
+	// Sample centers, so that bilinear filtering matches the CPU query
+	vec2 uv = ((world - TerrainArea.xy) / TerrainArea.zw * (HeightParams.zw - 1.0f) + 0.5f) / HeightParams.zw;
+	return textureLod(s2Heightmap, uv, 0.0f).r * HeightParams.x + HeightParams.y;
+}
+#endif
+)glsl";
+
+	const GLchar* terrainVertexShaderSource = R"glsl(
+layout(location = 0) in vec2 GridPosition; // [0, 1] across the node
+layout(location = 1) in vec4 NodeData;     // xy - node min corner, z - node size, w - LOD
+
+layout(location = 0) smooth out vec3 PositionOut;
+
+#ifdef TERRAIN_STREAMED
+layout(location = 2) in vec4 PageData;     // x - cache layer, yz - node offset in the page, w - node size in pages
+
+layout(location = 1) smooth out vec3 PageCoordOut;
+layout(location = 2) flat out float TexelSizeOut;
+
+vec3 pageCoord(vec2 local)
+{
+	return vec3(GridParams.w + (PageData.yz + local * PageData.w) * GridParams.x, PageData.x);
+}
+
+float nodeHeight(vec2 local)
+{
+	vec3 coord = pageCoord(local);
+	return pageHeight(coord.xy, coord.z);
+}
+#else
+float nodeHeight(vec2 local)
+{
+	return sampleHeight(NodeData.xy + local * NodeData.z);
+}
+#endif
+
+void main()
+{
+	vec2 local = GridPosition;
+	vec2 world = NodeData.xy + local * NodeData.z;
+	float height = nodeHeight(local);
+
+	// Odd vertices slide onto their even neighbours towards the end of the LOD range,
+	// so the grid matches the twice coarser grid of the next LOD
+	vec2 morphRange = MorphRanges[int(NodeData.w)].xy;
+	float morph = clamp((distance(cameraPosition, vec3(world.x, height, world.y)) - morphRange.x) / (morphRange.y - morphRange.x), 0.0f, 1.0f);
+	vec2 oddOffset = fract(GridPosition * GridParams.x * 0.5f) * 2.0f / GridParams.x;
+	local -= oddOffset * morph;
+	world = NodeData.xy + local * NodeData.z;
+	height = nodeHeight(local);
+
+	PositionOut = vec3(world.x, height, world.y);
+#ifdef TERRAIN_STREAMED
+	PageCoordOut = pageCoord(local);
+	TexelSizeOut = NodeData.z / (GridParams.x * PageData.w);
+#endif
+	gl_Position = projection * view * vec4(PositionOut, 1.0f);
+}
+)glsl";
+
+	const GLchar* terrainFragmentShaderSource = R"glsl(
+struct PointLight
+{
+	vec3 v3LightPosition;
+	vec3 v3LightIntensity;
+	vec3 v3Falloff;
+};
+
+#define MAX_LIGHTS 16
+#define M_RCPPI 0.31830988618379067153776752674503f
+
+layout(std140, binding = 2) uniform PointLightData
+{
+	PointLight PointLights[MAX_LIGHTS];
+};
+
+layout(binding = 1) uniform sampler2D s2DiffuseTexture;
+
+layout(location = 0) smooth in vec3 PositionIn;
+
+#ifdef TERRAIN_STREAMED
+layout(binding = 2) uniform sampler2DArray s2aSplatPages;
+
+layout(location = 1) smooth in vec3 PageCoordIn;
+layout(location = 2) flat in float TexelSizeIn;
+#endif
+
+out vec4 FragColorOut;
+
+const vec3 SunDirection = normalize(vec3(0.4f, 1.0f, 0.3f));
+
+void main()
+{
+	// Nodes on the map border extend past it
+	if (any(lessThan(PositionIn.xz, TerrainArea.xy)) || any(greaterThan(PositionIn.xz, TerrainArea.xy + TerrainArea.zw))) discard;
+
+#ifdef TERRAIN_STREAMED
+	// Neighbours from the apron on page borders, at the resolution of the page actually resident
+	float spacing = TexelSizeIn;
+	float hL = pageHeight(PageCoordIn.xy - vec2(1.0f, 0.0f), PageCoordIn.z);
+	float hR = pageHeight(PageCoordIn.xy + vec2(1.0f, 0.0f), PageCoordIn.z);
+	float hD = pageHeight(PageCoordIn.xy - vec2(0.0f, 1.0f), PageCoordIn.z);
+	float hU = pageHeight(PageCoordIn.xy + vec2(0.0f, 1.0f), PageCoordIn.z);
+#else
+	float spacing = GridParams.z;
+	float hL = sampleHeight(PositionIn.xz - vec2(spacing, 0.0f));
+	float hR = sampleHeight(PositionIn.xz + vec2(spacing, 0.0f));
+	float hD = sampleHeight(PositionIn.xz - vec2(0.0f, spacing));
+	float hU = sampleHeight(PositionIn.xz + vec2(0.0f, spacing));
+#endif
+	vec3 normal = normalize(vec3(hL - hR, 2.0f * spacing, hD - hU));
+
+	vec3 colour = texture(s2DiffuseTexture, PositionIn.xz / GridParams.y).rgb;
+#ifdef TERRAIN_STREAMED
+	// Splat weights of the page: grass, rock, dirt, snow
+	vec4 weights = texture(s2aSplatPages, vec3((PageCoordIn.xy + 0.5f) / HeightParams.zw, PageCoordIn.z));
+	colour *= weights.r * vec3(0.55f, 0.75f, 0.45f) + weights.g * vec3(0.6f, 0.55f, 0.5f) + weights.b * vec3(0.55f, 0.45f, 0.35f) + weights.a * vec3(0.95f, 0.95f, 1.0f);
+#else
+	// Grass on flat ground, rock on slopes
+	colour *= mix(vec3(0.55f, 0.75f, 0.45f), vec3(0.6f, 0.55f, 0.5f), smoothstep(0.15f, 0.4f, 1.0f - normal.y));
+#endif
+
+	// Ambient and sky light, terrain is mostly far from the scene point lights
+	vec3 v3RetColour = colour * (0.3f + 0.6f * max(dot(normal, SunDirection), 0.0f));
+	for (int i = 0; i < MAX_LIGHTS; i++)
+	{
+		if (dot(PointLights[i].v3LightIntensity, PointLights[i].v3LightIntensity) == 0.0f) continue;
+		vec3 v3ToLight = PointLights[i].v3LightPosition - PositionIn;
+		float fDist = length(v3ToLight);
+		vec3 v3Falloff = PointLights[i].v3Falloff;
+		vec3 v3LightIrradiance = PointLights[i].v3LightIntensity / (v3Falloff.x + (v3Falloff.y * fDist) + (v3Falloff.z * fDist * fDist));
+		v3RetColour += colour * M_RCPPI * max(dot(normal, v3ToLight / fDist), 0.0f) * v3LightIrradiance;
+	}
+	FragColorOut = vec4(v3RetColour, 1.0f);
+}
+)glsl";
+
+	bool intersectRayAABB(const glm::vec3& origin, const glm::vec3& invDirection, const glm::vec3& boxMin, const glm::vec3& boxMax, float& tEnter, float& tExit)
+	{
+		const glm::vec3 t0 = (boxMin - origin) * invDirection;
+		const glm::vec3 t1 = (boxMax - origin) * invDirection;
+		const glm::vec3 tNear = glm::min(t0, t1);
+		const glm::vec3 tFar = glm::max(t0, t1);
+		tEnter = std::max({ tNear.x, tNear.y, tNear.z });
+		tExit = std::min({ tFar.x, tFar.y, tFar.z });
+		return tExit >= std::max(tEnter, 0.0f);
+	}
+
+	bool intersectSphereAABB(const glm::vec3& center, float radius, const glm::vec3& boxMin, const glm::vec3& boxMax)
+	{
+		const glm::vec3 closest = glm::clamp(center, boxMin, boxMax);
+		const glm::vec3 offset = closest - center;
+		return glm::dot(offset, offset) <= radius * radius;
+	}
+}
+//=============================================================================
+bool LoadTerrainHeightmap(const std::string& path, std::vector<uint16_t>& heights, int& width, int& height)
+{
+	const std::string extension = GetFileExtension(path);
+	if (extension == ".r16" || extension == ".raw")
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		const size_t sampleCount = file ? (size_t)file.tellg() / sizeof(uint16_t) : 0;
+		const int side = (int)std::lround(std::sqrt((double)sampleCount));
+		if (side < 2 || size_t(side) * side != sampleCount)
+		{
+			LOG_ERROR(Scene, "Failed to load terrain heightmap, expected a square 16-bit raw file: {}", path);
+			return false;
+		}
+		heights.resize(sampleCount);
+		file.seekg(0);
+		file.read(reinterpret_cast<char*>(heights.data()), sampleCount * sizeof(uint16_t));
+		width = side;
+		height = side;
+		return true;
+	}
+
+	int channels;
+	stbi_set_flip_vertically_on_load(false);
+	stbi_us* data = stbi_load_16(path.c_str(), &width, &height, &channels, 1);
+	if (!data || width < 2 || height < 2)
+	{
+		LOG_ERROR(Scene, "Failed to load terrain heightmap: {}", path);
+		if (data) stbi_image_free(data);
+		return false;
+	}
+	if (!stbi_is_16_bit(path.c_str()))
+		LOG_WARNING(Scene, "Terrain heightmap is 8-bit, heights will be stepped: {}", path);
+	heights.assign(data, data + size_t(width) * height);
+	stbi_image_free(data);
+	return true;
+}
+//=============================================================================
+bool Terrain::Load(const TerrainSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	Close();
+	const bool streamed = GetFileExtension(settings.heightmapPath) == ".tiles";
+	if (settings.sampleSpacing <= 0.0f || (!streamed && (settings.gridResolution < 2 || (settings.gridResolution & (settings.gridResolution - 1)) != 0)))
+	{
+		LOG_ERROR(Scene, "Invalid terrain settings: spacing {}, grid {}", settings.sampleSpacing, settings.gridResolution);
+		return false;
+	}
+	m_settings = settings;
+	// на меньшей дальности узлы соседних LOD не успевают слиться без швов
+	m_settings.lodDistance = std::max(settings.lodDistance, 2.0f);
+
+	uint32_t lodCount = 1;
+	if (streamed)
+	{
+		if (!m_tiles.Open(settings.heightmapPath)) return false;
+		const TerrainTileHeader& header = m_tiles.GetHeader();
+		m_width = (int)header.width;
+		m_height = (int)header.height;
+		m_settings.gridResolution = header.tileSize;
+		lodCount = header.levelCount;
+		for (uint32_t lod = 0; lod < lodCount; lod++)
+			m_levelNodes[lod] = glm::uvec2(m_tiles.GetPagesX(lod), m_tiles.GetPagesZ(lod));
+	}
+	else
+	{
+		if (!LoadTerrainHeightmap(settings.heightmapPath, m_heights, m_width, m_height)) return false;
+
+		// корней столько, сколько нужно для покрытия карты: глубина дерева ограничена MaxLodCount
+		const uint32_t n = m_settings.gridResolution;
+		while (lodCount < MaxLodCount && (n << (lodCount - 1)) < uint32_t(std::max(m_width, m_height) - 1))
+			lodCount++;
+		for (uint32_t lod = 0; lod < lodCount; lod++)
+		{
+			const uint32_t span = n << lod;
+			m_levelNodes[lod] = glm::max(glm::uvec2((m_width - 2 + span) / span, (m_height - 2 + span) / span), glm::uvec2(1));
+		}
+	}
+	m_lodCount = lodCount;
+	if (!streamed) buildNodeRanges();
+
+	const float leafSize = m_settings.gridResolution * m_settings.sampleSpacing;
+	const glm::vec2 extent = glm::vec2(m_width - 1, m_height - 1) * m_settings.sampleSpacing;
+	float previousRange = 0.0f;
+	for (uint32_t lod = 0; lod < lodCount; lod++)
+	{
+		m_lodRanges[lod] = leafSize * m_settings.lodDistance * float(1u << lod);
+		m_morphRanges[lod] = glm::vec2(glm::mix(previousRange, m_lodRanges[lod], m_settings.morphStart), m_lodRanges[lod]);
+		previousRange = m_lodRanges[lod];
+		m_statistics.nodeCount += m_levelNodes[lod].x * m_levelNodes[lod].y;
+	}
+	// верхний LOD рисуется на любой дальности и не сливается
+	m_lodRanges[lodCount - 1] = std::numeric_limits<float>::max();
+	m_morphRanges[lodCount - 1] = glm::vec2(std::numeric_limits<float>::max() * 0.5f, std::numeric_limits<float>::max());
+
+	m_statistics.lodCount = lodCount;
+	m_statistics.streamed = streamed;
+
+	if (streamed)
+	{
+		// страницы верхнего LOD закреплены в кэше: запасная страница есть у любого узла
+		if (!m_pageCache.Init(m_tiles, lodCount - 1, m_settings.pageCache))
+		{
+			Close();
+			return false;
+		}
+	}
+	else
+	{
+		// текстура высот: 16 бит без потери точности, фильтрация в шейдере
+		GLuint heightId;
+		glCreateTextures(GL_TEXTURE_2D, 1, &heightId);
+		glTextureStorage2D(heightId, 1, GL_R16, m_width, m_height);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		glTextureSubImage2D(heightId, 0, 0, 0, m_width, m_height, GL_RED, GL_UNSIGNED_SHORT, m_heights.data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTextureParameteri(heightId, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(heightId, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(heightId, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureParameteri(heightId, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		m_heightTexture = std::make_shared<Texture2D>(heightId);
+	}
+
+	if (!m_settings.diffuseTexturePath.empty())
+		m_diffuseTexture = Texture2D::LoadFromFile(m_settings.diffuseTexturePath);
+	if (!m_diffuseTexture)
+		m_diffuseTexture = GetDefaultMeshMaterial()->diffuseTexture;
+
+	const std::string header = streamed ? "#version 430 core\n#define TERRAIN_STREAMED\n" : "#version 430 core\n";
+	m_program = std::make_shared<ShaderProgram>(
+		header + terrainCommonSource + terrainVertexShaderSource,
+		header + terrainCommonSource + terrainFragmentShaderSource);
+	if (!m_program->IsValid()) [[unlikely]]
+	{
+		LOG_ERROR(Scene, "Failed to create terrain shader");
+		Close();
+		return false;
+	}
+
+	TerrainUniformData uniformData{};
+	uniformData.area = glm::vec4(m_settings.origin, extent);
+	uniformData.heightParams = glm::vec4(m_settings.heightScale, m_settings.heightOffset, m_width, m_height);
+	uniformData.gridParams = glm::vec4(m_settings.gridResolution, m_settings.textureScale, m_settings.sampleSpacing, 0.0f);
+	if (streamed)
+	{
+		uniformData.heightParams = glm::vec4(m_settings.heightScale, m_settings.heightOffset, glm::vec2(m_tiles.GetPageSamples()));
+		uniformData.gridParams.w = (float)TerrainTileHeader::Apron;
+	}
+	for (uint32_t lod = 0; lod < lodCount; lod++)
+		uniformData.morphRanges[lod] = glm::vec4(m_morphRanges[lod], 0.0f, 0.0f);
+	m_uniformBuffer = std::make_shared<UniformBuffer>(TerrainDataBindingPoint, (uint32_t)sizeof(TerrainUniformData));
+	m_uniformBuffer->SetData(&uniformData);
+
+	// общая сетка узла; индексы сложены по четвертям, чтобы четверть рисовалась отрезком индексов
+	const uint32_t n = m_settings.gridResolution;
+	std::vector<glm::vec2> vertices;
+	vertices.reserve((n + 1) * (n + 1));
+	for (uint32_t z = 0; z <= n; z++)
+	{
+		for (uint32_t x = 0; x <= n; x++)
+			vertices.push_back(glm::vec2(x, z) / float(n));
+	}
+	std::vector<uint32_t> indices;
+	indices.reserve(n * n * 6);
+	for (uint32_t quarter = 0; quarter < 4; quarter++)
+	{
+		const uint32_t x0 = (quarter & 1) * n / 2;
+		const uint32_t z0 = (quarter >> 1) * n / 2;
+		for (uint32_t z = z0; z < z0 + n / 2; z++)
+		{
+			for (uint32_t x = x0; x < x0 + n / 2; x++)
+			{
+				const uint32_t i00 = z * (n + 1) + x;
+				const uint32_t i10 = i00 + 1;
+				const uint32_t i01 = i00 + n + 1;
+				const uint32_t i11 = i01 + 1;
+				indices.insert(indices.end(), { i00, i01, i10, i10, i01, i11 });
+			}
+		}
+	}
+
+	VertexBufferLayout gridLayout;
+	gridLayout.Push<glm::vec2>("aGridPosition");
+	VertexBufferLayout nodeLayout;
+	nodeLayout.SetDivisor(1);
+	nodeLayout.Push<glm::vec4>("aNodeData");
+	nodeLayout.Push<glm::vec4>("aPageData");
+
+	m_gridVertexBuffer = std::make_shared<VertexBuffer>((unsigned int)(vertices.size() * sizeof(glm::vec2)), vertices.data());
+	m_gridIndexBuffer = std::make_shared<IndexBuffer>((uint32_t)indices.size(), indices.data());
+	m_nodeBuffer = std::make_shared<VertexBuffer>(MaxDrawNodes * NodeBufferRegions * (uint32_t)sizeof(TerrainNodeInstance));
+	m_gridArray = std::make_shared<VertexArray>(m_gridVertexBuffer, m_gridIndexBuffer, gridLayout);
+	m_gridArray->SetVertexBuffer(m_gridArray->AddLayout(nodeLayout), m_nodeBuffer->GetID());
+
+	LOG_INFO(Scene, "Terrain loaded: {} ({}x{} samples, {:.0f}x{:.0f} m, {} nodes, {} LODs{})",
+		m_settings.heightmapPath, m_width, m_height, extent.x, extent.y, m_statistics.nodeCount, lodCount, streamed ? ", streamed" : "");
+	return true;
+}
+//=============================================================================
+void Terrain::Close()
+{
+	if (m_statistics.streamed)
+	{
+		const TerrainPageCache::Statistics& cache = m_pageCache.GetStatistics();
+		LOG_INFO(Scene, "Terrain page cache: hit rate {:.1f}%, {} pages loaded, {} evicted, page-in latency avg {:.2f} ms, max {:.2f} ms",
+			cache.totalLookups > 0 ? 100.0 * cache.totalHits / cache.totalLookups : 100.0, cache.loadedPages, cache.evictedPages, cache.averageLatency, cache.maxLatency);
+	}
+	m_pageCache.Close();
+	m_tiles.Close();
+
+	m_heights.clear();
+	m_width = 0;
+	m_height = 0;
+	m_lodCount = 0;
+	m_levelNodes = {};
+	m_levelFirstNode = {};
+	m_nodeRanges.clear();
+	m_statistics = {};
+
+	m_heightTexture.reset();
+	m_diffuseTexture.reset();
+	m_program.reset();
+	m_uniformBuffer.reset();
+	m_gridArray.reset();
+	m_gridVertexBuffer.reset();
+	m_gridIndexBuffer.reset();
+	m_nodeBuffer.reset();
+}
+//=============================================================================
+void Terrain::buildNodeRanges()
+{
+	uint32_t total = 0;
+	for (uint32_t lod = 0; lod < m_lodCount; lod++)
+	{
+		m_levelFirstNode[lod] = total;
+		total += m_levelNodes[lod].x * m_levelNodes[lod].y;
+	}
+	m_nodeRanges.resize(total);
+
+	const uint32_t n = m_settings.gridResolution;
+	for (uint32_t lod = 0; lod < m_lodCount; lod++)
+	{
+		const glm::uvec2 count = m_levelNodes[lod];
+		for (uint32_t z = 0; z < count.y; z++)
+		{
+			for (uint32_t x = 0; x < count.x; x++)
+			{
+				glm::u16vec2 range(std::numeric_limits<uint16_t>::max(), 0);
+				if (lod == 0)
+				{
+					// отсчеты узла вместе с дальними краями, их делят соседние узлы
+					for (uint32_t sz = z * n; sz <= std::min((z + 1) * n, uint32_t(m_height - 1)); sz++)
+					{
+						for (uint32_t sx = x * n; sx <= std::min((x + 1) * n, uint32_t(m_width - 1)); sx++)
+						{
+							const uint16_t sample = m_heights[size_t(sz) * m_width + sx];
+							range = glm::u16vec2(std::min(range.x, sample), std::max(range.y, sample));
+						}
+					}
+				}
+				else
+				{
+					for (uint32_t quarter = 0; quarter < 4; quarter++)
+					{
+						const glm::uvec2 child(x * 2 + (quarter & 1), z * 2 + (quarter >> 1));
+						if (child.x >= m_levelNodes[lod - 1].x || child.y >= m_levelNodes[lod - 1].y) continue;
+						const glm::u16vec2 childRange = m_nodeRanges[m_levelFirstNode[lod - 1] + child.y * m_levelNodes[lod - 1].x + child.x];
+						range = glm::u16vec2(std::min(range.x, childRange.x), std::max(range.y, childRange.y));
+					}
+				}
+				m_nodeRanges[m_levelFirstNode[lod] + z * count.x + x] = range;
+			}
+		}
+	}
+}
+//=============================================================================
+void Terrain::getNodeBox(uint32_t lod, uint32_t x, uint32_t z, glm::vec3& boxMin, glm::vec3& boxMax) const
+{
+	glm::u16vec2 range;
+	if (m_tiles.IsOpen())
+	{
+		const uint16_t* pageRange = m_tiles.GetPageRange(m_tiles.GetPageIndex(lod, x, z));
+		range = glm::u16vec2(pageRange[0], pageRange[1]);
+	}
+	else
+	{
+		range = m_nodeRanges[m_levelFirstNode[lod] + z * m_levelNodes[lod].x + x];
+	}
+
+	const float size = m_settings.gridResolution * m_settings.sampleSpacing * float(1u << lod);
+	const glm::vec2 min = m_settings.origin + glm::vec2(x, z) * size;
+	const glm::vec2 heights = glm::vec2(range) / 65535.0f * m_settings.heightScale + m_settings.heightOffset;
+	boxMin = glm::vec3(min.x, heights.x, min.y);
+	boxMax = glm::vec3(min.x + size, heights.y, min.y + size);
+}
+//=============================================================================
+void Terrain::BuildFramePacket(FramePacket& packet)
+{
+	m_statistics.selectedNodes = 0;
+	m_statistics.culledNodes = 0;
+	m_statistics.drawnVertices = 0;
+	if (!IsLoaded()) return;
+
+	PROFILE_FUNCTION();
+
+	// готовые страницы получают слои до выбора узлов, чтобы кадр уже рисовал по ним
+	if (m_tiles.IsOpen())
+		m_pageCache.BeginFrame(packet.frameIndex, packet.terrainUploads);
+
+	const Frustum frustum = Frustum::FromMatrix(packet.camera.projection * packet.camera.view);
+	const glm::vec3 cameraPosition = packet.camera.cameraPosition;
+
+	auto allocator = framemem::GetThreadAllocator<TerrainNodeInstance>();
+	ArenaVector<TerrainNodeInstance> groups[NodeGroupCount] = {
+		ArenaVector<TerrainNodeInstance>(allocator), ArenaVector<TerrainNodeInstance>(allocator), ArenaVector<TerrainNodeInstance>(allocator),
+		ArenaVector<TerrainNodeInstance>(allocator), ArenaVector<TerrainNodeInstance>(allocator) };
+	const uint32_t rootLod = m_lodCount - 1;
+	for (uint32_t z = 0; z < m_levelNodes[rootLod].y; z++)
+	{
+		for (uint32_t x = 0; x < m_levelNodes[rootLod].x; x++)
+			selectNode(rootLod, x, z, frustum, cameraPosition, groups);
+	}
+
+	if (m_tiles.IsOpen())
+		m_pageCache.EndFrame();
+
+	size_t total = 0;
+	for (const auto& group : groups)
+		total += group.size();
+	if (total > MaxDrawNodes) [[unlikely]]
+	{
+		LOG_WARNING(Scene, "Terrain selected {} nodes, only {} are drawn; increase lodDistance or gridResolution", total, MaxDrawNodes);
+		total = MaxDrawNodes;
+	}
+
+	const uint32_t n = m_settings.gridResolution;
+	packet.terrainNodes.reserve(total);
+	for (uint32_t g = 0; g < NodeGroupCount; g++)
+	{
+		const size_t count = std::min(groups[g].size(), total - packet.terrainNodes.size());
+		packet.terrainNodes.insert(packet.terrainNodes.end(), groups[g].begin(), groups[g].begin() + count);
+		packet.terrainNodeGroups[g] = (uint32_t)count;
+		m_statistics.drawnVertices += count * (g == 0 ? (n + 1) * (n + 1) : (n / 2 + 1) * (n / 2 + 1));
+	}
+	m_statistics.selectedNodes = (uint32_t)total;
+}
+//=============================================================================
+bool Terrain::selectNode(uint32_t lod, uint32_t x, uint32_t z, const Frustum& frustum, const glm::vec3& cameraPosition, ArenaVector<TerrainNodeInstance>* groups)
+{
+	// false - узел вне диапазона своего LOD и его рисует родитель
+	glm::vec3 boxMin, boxMax;
+	getNodeBox(lod, x, z, boxMin, boxMax);
+	if (!intersectSphereAABB(cameraPosition, m_lodRanges[lod], boxMin, boxMax)) return false;
+
+	if (!frustum.IsAABBVisible((boxMin + boxMax) * 0.5f, (boxMax - boxMin) * 0.5f))
+	{
+		m_statistics.culledNodes++;
+		return true;
+	}
+
+	// страница нужна, только если узел рисуется своей сеткой хотя бы частично
+	TerrainNodeInstance instance{ glm::vec4(boxMin.x, boxMin.z, boxMax.x - boxMin.x, (float)lod), glm::vec4(0.0f) };
+	bool hasPage = !m_tiles.IsOpen();
+	auto node = [&]
+	{
+		if (!hasPage)
+		{
+			instance.page = acquirePage(lod, x, z, glm::distance(cameraPosition, glm::clamp(cameraPosition, boxMin, boxMax)));
+			hasPage = true;
+		}
+		return instance;
+	};
+
+	if (lod == 0 || !intersectSphereAABB(cameraPosition, m_lodRanges[lod - 1], boxMin, boxMax))
+	{
+		groups[0].push_back(node());
+		return true;
+	}
+
+	// часть узла ближе: подробнее рисуются только дети в диапазоне, остальные четверти - сеткой этого узла
+	const glm::uvec2 childCount = m_levelNodes[lod - 1];
+	for (uint32_t quarter = 0; quarter < 4; quarter++)
+	{
+		const glm::uvec2 child(x * 2 + (quarter & 1), z * 2 + (quarter >> 1));
+		if (child.x < childCount.x && child.y < childCount.y && !selectNode(lod - 1, child.x, child.y, frustum, cameraPosition, groups))
+			groups[1 + quarter].push_back(node());
+	}
+	return true;
+}
+//=============================================================================
+glm::vec4 Terrain::acquirePage(uint32_t lod, uint32_t x, uint32_t z, float priority)
+{
+	const int32_t layer = m_pageCache.Acquire(m_tiles.GetPageIndex(lod, x, z), priority);
+	if (layer >= 0) return glm::vec4((float)layer, 0.0f, 0.0f, 1.0f);
+
+	// пока страница в пути - ближайший загруженный предок; страницы корней закреплены
+	for (uint32_t ancestor = lod + 1; ancestor < m_lodCount; ancestor++)
+	{
+		const uint32_t shift = ancestor - lod;
+		const glm::uvec2 page(x >> shift, z >> shift);
+		const int32_t ancestorLayer = m_pageCache.Touch(m_tiles.GetPageIndex(ancestor, page.x, page.y));
+		if (ancestorLayer < 0) continue;
+
+		const float scale = 1.0f / float(1u << shift);
+		return glm::vec4((float)ancestorLayer, glm::vec2(x - (page.x << shift), z - (page.y << shift)) * scale, scale);
+	}
+	return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+//=============================================================================
+void Terrain::RenderPacket(const FramePacket& packet)
+{
+	if (!IsLoaded() || (packet.terrainNodes.empty() && packet.terrainUploads.empty())) return;
+
+	PROFILE_FUNCTION();
+	GPU_PROFILE_SCOPE("Terrain");
+
+	// страницы, готовые к этому кадру, загружаются до отрисовки
+	m_pageCache.ProcessUploads(packet.terrainUploads.data(), packet.terrainUploads.size());
+	if (packet.terrainNodes.empty()) return;
+
+	// область буфера узлов на кадр, как у буфера экземпляров сцены
+	const uint32_t baseInstance = m_nodeRegion * MaxDrawNodes;
+	m_nodeRegion = (m_nodeRegion + 1) % NodeBufferRegions;
+	m_nodeBuffer->SetData(packet.terrainNodes.data(), (uint32_t)(packet.terrainNodes.size() * sizeof(TerrainNodeInstance)), baseInstance * (uint32_t)sizeof(TerrainNodeInstance));
+
+	m_program->Bind();
+	m_uniformBuffer->Bind();
+	if (m_tiles.IsOpen())
+		m_pageCache.Bind(0, 2);
+	else
+		m_heightTexture->Bind(0);
+	m_diffuseTexture->Bind(1);
+	m_gridArray->Bind();
+
+	const uint32_t quarterIndexCount = m_gridIndexBuffer->GetCount() / 4;
+	uint32_t firstNode = 0;
+	for (uint32_t g = 0; g < NodeGroupCount; g++)
+	{
+		const uint32_t count = packet.terrainNodeGroups[g];
+		if (count == 0) continue;
+
+		const GLsizei indexCount = (GLsizei)(g == 0 ? m_gridIndexBuffer->GetCount() : quarterIndexCount);
+		const uintptr_t indexOffset = (g == 0 ? 0 : (g - 1) * quarterIndexCount) * sizeof(uint32_t);
+		rhi::DrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, reinterpret_cast<const void*>(indexOffset), count, baseInstance + firstNode);
+		firstNode += count;
+	}
+}
+//=============================================================================
+float Terrain::getSample(int x, int z) const
+{
+	uint16_t sample;
+	if (m_tiles.IsOpen())
+	{
+		// страница уровня 0 из отображения; отсчет на границе есть в обеих соседних страницах
+		const uint32_t n = m_settings.gridResolution;
+		const uint32_t pageX = std::min(uint32_t(x) / n, m_tiles.GetPagesX(0) - 1);
+		const uint32_t pageZ = std::min(uint32_t(z) / n, m_tiles.GetPagesZ(0) - 1);
+		const uint32_t i = uint32_t(x) - pageX * n + TerrainTileHeader::Apron;
+		const uint32_t j = uint32_t(z) - pageZ * n + TerrainTileHeader::Apron;
+		sample = m_tiles.GetPageHeights(m_tiles.GetPageIndex(0, pageX, pageZ))[j * m_tiles.GetPageSamples() + i];
+	}
+	else
+	{
+		sample = m_heights[size_t(z) * m_width + x];
+	}
+	return sample / 65535.0f * m_settings.heightScale + m_settings.heightOffset;
+}
+//=============================================================================
+float Terrain::GetHeight(float x, float z) const
+{
+	if (!IsLoaded()) return 0.0f;
+
+	// билинейно, как textureLod в шейдере
+	const float fx = glm::clamp((x - m_settings.origin.x) / m_settings.sampleSpacing, 0.0f, float(m_width - 1));
+	const float fz = glm::clamp((z - m_settings.origin.y) / m_settings.sampleSpacing, 0.0f, float(m_height - 1));
+	const int x0 = std::min((int)fx, m_width - 2);
+	const int z0 = std::min((int)fz, m_height - 2);
+	const float tx = fx - x0;
+	const float tz = fz - z0;
+	const float bottom = glm::mix(getSample(x0, z0), getSample(x0 + 1, z0), tx);
+	const float top = glm::mix(getSample(x0, z0 + 1), getSample(x0 + 1, z0 + 1), tx);
+	return glm::mix(bottom, top, tz);
+}
+//=============================================================================
+glm::vec3 Terrain::GetNormal(float x, float z) const
+{
+	const float spacing = m_settings.sampleSpacing;
+	const float hL = GetHeight(x - spacing, z);
+	const float hR = GetHeight(x + spacing, z);
+	const float hD = GetHeight(x, z - spacing);
+	const float hU = GetHeight(x, z + spacing);
+	return glm::normalize(glm::vec3(hL - hR, 2.0f * spacing, hD - hU));
+}
+//=============================================================================
+bool Terrain::Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, TerrainHit& hit) const
+{
+	if (!IsLoaded()) return false;
+
+	// обход дерева по AABB узлов; узлы дальше уже найденного пересечения пропускаются
+	const glm::vec3 invDirection = 1.0f / direction;
+	float closest = maxDistance;
+	bool found = false;
+	std::array<glm::uvec3, 4 * MaxLodCount> stack; // LOD, x, z
+	const uint32_t rootLod = m_lodCount - 1;
+	for (uint32_t rootZ = 0; rootZ < m_levelNodes[rootLod].y; rootZ++)
+	{
+		for (uint32_t rootX = 0; rootX < m_levelNodes[rootLod].x; rootX++)
+		{
+			size_t stackSize = 0;
+			stack[stackSize++] = glm::uvec3(rootLod, rootX, rootZ);
+			while (stackSize > 0)
+			{
+				const glm::uvec3 node = stack[--stackSize];
+				glm::vec3 boxMin, boxMax;
+				getNodeBox(node.x, node.y, node.z, boxMin, boxMax);
+				float tEnter, tExit;
+				if (!intersectRayAABB(origin, invDirection, boxMin, boxMax, tEnter, tExit) || tEnter > closest) continue;
+
+				if (node.x == 0)
+				{
+					float t;
+					if (raycastLeaf(origin, direction, std::max(tEnter, 0.0f), std::min(tExit, closest), t))
+					{
+						closest = t;
+						found = true;
+					}
+					continue;
+				}
+				const glm::uvec2 childCount = m_levelNodes[node.x - 1];
+				for (uint32_t quarter = 0; quarter < 4; quarter++)
+				{
+					const glm::uvec2 child(node.y * 2 + (quarter & 1), node.z * 2 + (quarter >> 1));
+					if (child.x < childCount.x && child.y < childCount.y)
+						stack[stackSize++] = glm::uvec3(node.x - 1, child);
+				}
+			}
+		}
+	}
+	if (!found) return false;
+
+	hit.distance = closest;
+	hit.position = origin + direction * closest;
+	hit.normal = GetNormal(hit.position.x, hit.position.z);
+	return true;
+}
+//=============================================================================
+bool Terrain::raycastLeaf(const glm::vec3& origin, const glm::vec3& direction, float tEnter, float tExit, float& t) const
+{
+	// шаг в половину отсчета, затем уточнение делением пополам
+	auto gap = [&](float distance)
+	{
+		const glm::vec3 point = origin + direction * distance;
+		return point.y - GetHeight(point.x, point.z);
+	};
+
+	if (gap(tEnter) <= 0.0f)
+	{
+		t = tEnter;
+		return true;
+	}
+
+	const float step = m_settings.sampleSpacing * 0.5f;
+	float previous = tEnter;
+	while (previous < tExit)
+	{
+		const float current = std::min(previous + step, tExit);
+		if (gap(current) <= 0.0f)
+		{
+			float above = previous;
+			float below = current;
+			for (int i = 0; i < 12; i++)
+			{
+				const float middle = (above + below) * 0.5f;
+				(gap(middle) > 0.0f ? above : below) = middle;
+			}
+			t = below;
+			return true;
+		}
+		previous = current;
+	}
+	return false;
+}
+//=============================================================================
+glm::vec3 Terrain::GetBoundsMin() const
+{
+	if (!IsLoaded()) return glm::vec3(m_settings.origin.x, 0.0f, m_settings.origin.y);
+
+	float minHeight = std::numeric_limits<float>::max();
+	const uint32_t rootLod = m_lodCount - 1;
+	for (uint32_t z = 0; z < m_levelNodes[rootLod].y; z++)
+	{
+		for (uint32_t x = 0; x < m_levelNodes[rootLod].x; x++)
+		{
+			glm::vec3 boxMin, boxMax;
+			getNodeBox(rootLod, x, z, boxMin, boxMax);
+			minHeight = std::min(minHeight, boxMin.y);
+		}
+	}
+	return glm::vec3(m_settings.origin.x, minHeight, m_settings.origin.y);
+}
+//=============================================================================
+glm::vec3 Terrain::GetBoundsMax() const
+{
+	const glm::vec2 mapMax = m_settings.origin + glm::vec2(std::max(m_width - 1, 0), std::max(m_height - 1, 0)) * m_settings.sampleSpacing;
+	if (!IsLoaded()) return glm::vec3(mapMax.x, 0.0f, mapMax.y);
+
+	float maxHeight = -std::numeric_limits<float>::max();
+	const uint32_t rootLod = m_lodCount - 1;
+	for (uint32_t z = 0; z < m_levelNodes[rootLod].y; z++)
+	{
+		for (uint32_t x = 0; x < m_levelNodes[rootLod].x; x++)
+		{
+			glm::vec3 boxMin, boxMax;
+			getNodeBox(rootLod, x, z, boxMin, boxMax);
+			maxHeight = std::max(maxHeight, boxMax.y);
+		}
+	}
+	return glm::vec3(mapMax.x, maxHeight, mapMax.y);
+}
+//=============================================================================
+void Terrain::DrawImGui()
+{
+	if (!IsLoaded()) return;
+
+	ImGui::Begin("Terrain");
+	ImGui::Text("Heightmap: %dx%d, nodes: %u, LODs: %u", m_width, m_height, m_statistics.nodeCount, m_statistics.lodCount);
+	ImGui::Text("Selected nodes: %u, frustum culled: %u", m_statistics.selectedNodes, m_statistics.culledNodes);
+	ImGui::Text("Vertices: %llu", (unsigned long long)m_statistics.drawnVertices);
+	if (m_statistics.streamed)
+	{
+		const TerrainPageCache::Statistics& cache = m_pageCache.GetStatistics();
+		ImGui::Separator();
+		ImGui::Text("Pages: %u resident of %u, %u in flight, %.1f MB", cache.residentPages, m_settings.pageCache.capacity, cache.inFlightPages, cache.residentBytes / (1024.0 * 1024.0));
+		ImGui::Text("Hit rate: %.1f%% frame, %.1f%% total",
+			cache.frameLookups > 0 ? 100.0 * cache.frameHits / cache.frameLookups : 100.0,
+			cache.totalLookups > 0 ? 100.0 * cache.totalHits / cache.totalLookups : 100.0);
+		ImGui::Text("Page-in latency: avg %.2f ms, max %.2f ms", cache.averageLatency, cache.maxLatency);
+		ImGui::Text("Loaded: %llu, evicted: %llu, uploads this frame: %u", (unsigned long long)cache.loadedPages, (unsigned long long)cache.evictedPages, cache.frameUploads);
+	}
+	ImGui::End();
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,122 @@
+﻿#pragma once
+
+#include "Graphics.h"
+#include "FrameAllocator.h"
+#include "TerrainStreaming.h"
+
+struct FramePacket;
+struct Frustum;
+
+struct TerrainSettings final
+{
+	std::string heightmapPath;           // 16-битный PNG, сырой квадратный .r16 (little-endian) или файл тайлов .tiles. Строка 0 у origin.y
+	glm::vec2   origin{ 0.0f };          // мировые XZ первого отсчета
+	float       sampleSpacing{ 1.0f };   // метров между отсчетами
+	float       heightScale{ 100.0f };   // высота отсчета 65535
+	float       heightOffset{ 0.0f };
+	uint32_t    gridResolution{ 32 };    // квадов на сторону узла, степень двойки. У .tiles - размер страницы
+	float       lodDistance{ 2.0f };     // дальность LOD 0 в размерах листового узла, у каждого следующего LOD - вдвое больше
+	float       morphStart{ 0.7f };      // доля диапазона LOD, после которой вершины сливаются в сетку следующего
+	std::string diffuseTexturePath;      // пусто - белая текстура
+	float       textureScale{ 8.0f };    // метров на повтор текстуры
+	TerrainPageCache::Settings pageCache; // только для .tiles
+};
+
+// Один узел кадра: экземпляр сетки
+struct TerrainNodeInstance final
+{
+	glm::vec4 node; // xy - угол узла, z - размер, w - LOD
+	glm::vec4 page; // .tiles: x - слой кэша, yz - смещение узла в странице, w - доля страницы. Страница может быть предком узла
+};
+
+// Высоты карты построчно, для .r16 и PNG
+bool LoadTerrainHeightmap(const std::string& path, std::vector<uint16_t>& heights, int& width, int& height);
+
+struct TerrainHit final
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	float     distance;
+};
+
+// Ландшафт по карте высот (CDLOD). Квадродерево узлов над картой, все узлы рисуются одной сеткой
+// gridResolution x gridResolution, растянутой на узел; высоты берутся из текстуры в вершинном шейдере.
+// Размер узла удваивается с каждым LOD, а дальность LOD растет так же, поэтому число вершин
+// в кадре зависит от дальности и разрешения сетки, но не от размера мира. На границе диапазона LOD
+// нечетные вершины плавно сдвигаются к четным, и сетка совпадает с сеткой следующего уровня без швов.
+// Дерево неявное: узел LOD L с индексом (x, z) покрывает gridResolution * 2^L квадов карты.
+// Карта .tiles не загружается целиком: узел совпадает со страницей файла, диапазоны высот читаются
+// из отображения, а страницы подгружает TerrainPageCache. Пока страницы нет, узел рисуется
+// по странице ближайшего загруженного предка
+class Terrain final
+{
+public:
+	static constexpr uint32_t MaxLodCount = 12;
+
+	struct Statistics final
+	{
+		uint32_t nodeCount{ 0 };
+		bool     streamed{ false };
+		uint32_t lodCount{ 0 };
+		uint32_t selectedNodes{ 0 };   // узлы и четверти узлов кадра
+		uint32_t culledNodes{ 0 };     // отброшены пирамидой видимости
+		uint64_t drawnVertices{ 0 };
+	};
+
+	// Нужен контекст GL: текстура высот, сетка и шейдер
+	bool Load(const TerrainSettings& settings);
+	void Close();
+	bool IsLoaded() const { return m_lodCount > 0; }
+
+	// Поток игры: выбор узлов по камере пакета
+	void BuildFramePacket(FramePacket& packet);
+	// Поток рендера
+	void RenderPacket(const FramePacket& packet);
+
+	// Запросы к карте высот для игровой логики. Только чтение, можно звать с любого потока.
+	// Вне карты берется ближайший край
+	float GetHeight(float x, float z) const;
+	glm::vec3 GetNormal(float x, float z) const;
+	// direction - единичный. Ищет первое пересечение не дальше maxDistance
+	bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, TerrainHit& hit) const;
+
+	glm::vec3 GetBoundsMin() const;
+	glm::vec3 GetBoundsMax() const;
+	const Statistics& GetStatistics() const { return m_statistics; }
+	const TerrainPageCache::Statistics& GetPageCacheStatistics() const { return m_pageCache.GetStatistics(); }
+
+	void DrawImGui();
+
+private:
+	void buildNodeRanges();
+	void getNodeBox(uint32_t lod, uint32_t x, uint32_t z, glm::vec3& boxMin, glm::vec3& boxMax) const;
+	bool selectNode(uint32_t lod, uint32_t x, uint32_t z, const Frustum& frustum, const glm::vec3& cameraPosition, ArenaVector<TerrainNodeInstance>* groups);
+	glm::vec4 acquirePage(uint32_t lod, uint32_t x, uint32_t z, float priority);
+	bool raycastLeaf(const glm::vec3& origin, const glm::vec3& direction, float tEnter, float tExit, float& t) const;
+	float getSample(int x, int z) const;
+
+	TerrainSettings       m_settings;
+	std::vector<uint16_t> m_heights;    // пусто у .tiles
+	TerrainTileFile       m_tiles;
+	TerrainPageCache      m_pageCache;
+	int                   m_width{ 0 };
+	int                   m_height{ 0 };
+	uint32_t              m_lodCount{ 0 };
+	std::array<glm::uvec2, MaxLodCount> m_levelNodes{};     // узлов LOD по X и Z; узлы верхнего LOD - корни
+	std::array<uint32_t, MaxLodCount>   m_levelFirstNode{}; // начало LOD в m_nodeRanges
+	std::vector<glm::u16vec2>           m_nodeRanges;       // min и max высот узлов; у .tiles они в файле
+	Statistics            m_statistics;
+	std::array<float, MaxLodCount>     m_lodRanges{};   // узел LOD рисуется, пока камера ближе
+	std::array<glm::vec2, MaxLodCount> m_morphRanges{}; // начало и конец слияния вершин LOD
+
+	// Поток рендера
+	std::shared_ptr<Texture2D>     m_heightTexture;
+	std::shared_ptr<Texture2D>     m_diffuseTexture;
+	std::shared_ptr<ShaderProgram> m_program;
+	std::shared_ptr<UniformBuffer> m_uniformBuffer;
+	std::shared_ptr<VertexBuffer>  m_gridVertexBuffer;
+	std::shared_ptr<IndexBuffer>   m_gridIndexBuffer;
+	std::shared_ptr<VertexBuffer>  m_nodeBuffer; // TerrainNodeInstance на экземпляр, области по кадрам как у Scene
+	std::shared_ptr<VertexArray>   m_gridArray;
+	uint32_t                       m_nodeRegion{ 0 };
+};
\ No newline at end of file
@@ -0,0 +1,565 @@
+﻿#include "stdafx.h"
+#include "TerrainStreaming.h"
+#include "Terrain.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	constexpr uint64_t PageAlignment = 4096;
+
+	uint64_t alignUp(uint64_t value, uint64_t alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	// Веса слоев в странице выровнены на 4 байта после высот
+	size_t pageSplatOffset(uint32_t samples)
+	{
+		return (size_t)alignUp(size_t(samples) * samples * sizeof(uint16_t), sizeof(uint32_t));
+	}
+
+	size_t pageDataSize(uint32_t samples)
+	{
+		return pageSplatOffset(samples) + size_t(samples) * samples * sizeof(uint32_t);
+	}
+
+	glm::uvec2 levelPageCount(uint32_t width, uint32_t height, uint32_t tileSize, uint32_t level)
+	{
+		const uint32_t pageSpan = tileSize << level;
+		return glm::max(glm::uvec2((width - 1 + pageSpan - 1) / pageSpan, (height - 1 + pageSpan - 1) / pageSpan), glm::uvec2(1));
+	}
+
+	// Веса по высоте и уклону: трава, камень, земля в низинах, снег. Уклон в нормированных высотах
+	// на отсчет, SlopeScale подобран под heightScale / sampleSpacing около 60
+	std::vector<uint32_t> computeSplat(const std::vector<uint16_t>& heights, int width, int height)
+	{
+		constexpr float SlopeScale = 60.0f;
+
+		std::vector<uint32_t> splat(heights.size());
+		auto sample = [&](int x, int z)
+		{
+			return heights[size_t(glm::clamp(z, 0, height - 1)) * width + glm::clamp(x, 0, width - 1)] / 65535.0f;
+		};
+		for (int z = 0; z < height; z++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const float h = sample(x, z);
+				const glm::vec2 gradient(sample(x + 1, z) - sample(x - 1, z), sample(x, z + 1) - sample(x, z - 1));
+				const float slope = glm::length(gradient) * 0.5f * SlopeScale;
+
+				const float rock = glm::smoothstep(0.3f, 0.6f, slope);
+				const float snow = glm::smoothstep(0.7f, 0.8f, h) * (1.0f - rock);
+				const float dirt = (1.0f - glm::smoothstep(0.05f, 0.2f, h)) * (1.0f - rock) * (1.0f - snow);
+				const float grass = std::max(1.0f - rock - snow - dirt, 0.0f);
+				const glm::vec4 weights = glm::vec4(grass, rock, dirt, snow) / (grass + rock + dirt + snow);
+				const glm::uvec4 bytes = glm::uvec4(glm::round(weights * 255.0f));
+				splat[size_t(z) * width + x] = bytes.x | (bytes.y << 8) | (bytes.z << 16) | (bytes.w << 24);
+			}
+		}
+		return splat;
+	}
+}
+//=============================================================================
+bool BuildTerrainTiles(const std::string& heightmapPath, const std::string& outputPath, uint32_t tileSize, const std::string& splatPath)
+{
+	PROFILE_FUNCTION();
+
+	if (tileSize < 2 || tileSize > 1024 || (tileSize & (tileSize - 1)) != 0)
+	{
+		LOG_ERROR(Scene, "Invalid terrain tile size: {}", tileSize);
+		return false;
+	}
+
+	std::vector<uint16_t> heights;
+	int width, height;
+	if (!LoadTerrainHeightmap(heightmapPath, heights, width, height)) return false;
+
+	std::vector<uint32_t> splat;
+	if (!splatPath.empty())
+	{
+		int splatWidth, splatHeight, channels;
+		stbi_set_flip_vertically_on_load(false);
+		stbi_uc* data = stbi_load(splatPath.c_str(), &splatWidth, &splatHeight, &channels, STBI_rgb_alpha);
+		if (!data || splatWidth != width || splatHeight != height)
+		{
+			LOG_ERROR(Scene, "Failed to load terrain splat map, expected {}x{} image: {}", width, height, splatPath);
+			if (data) stbi_image_free(data);
+			return false;
+		}
+		splat.resize(size_t(width) * height);
+		std::memcpy(splat.data(), data, splat.size() * sizeof(uint32_t));
+		stbi_image_free(data);
+	}
+	else
+	{
+		splat = computeSplat(heights, width, height);
+	}
+
+	// уровней столько же, сколько LOD у ландшафта в памяти с gridResolution = tileSize
+	TerrainTileHeader header{};
+	header.magic = TerrainTileHeader::MagicValue;
+	header.version = TerrainTileHeader::CurrentVersion;
+	header.width = (uint32_t)width;
+	header.height = (uint32_t)height;
+	header.tileSize = tileSize;
+	header.levelCount = 1;
+	while (header.levelCount < TerrainTileHeader::MaxLevels && (tileSize << (header.levelCount - 1)) < uint32_t(std::max(width, height) - 1))
+		header.levelCount++;
+
+	uint32_t pageCount = 0;
+	for (uint32_t level = 0; level < header.levelCount; level++)
+	{
+		const glm::uvec2 pages = levelPageCount(header.width, header.height, tileSize, level);
+		pageCount += pages.x * pages.y;
+	}
+
+	const uint32_t samples = tileSize + 1 + 2 * TerrainTileHeader::Apron;
+	header.rangesOffset = sizeof(TerrainTileHeader);
+	header.pagesOffset = alignUp(header.rangesOffset + pageCount * 2 * sizeof(uint16_t), PageAlignment);
+	header.pageStride = alignUp(pageDataSize(samples), PageAlignment);
+
+	std::ofstream file(outputPath, std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		LOG_ERROR(Scene, "Failed to create terrain tiles: {}", outputPath);
+		return false;
+	}
+
+	std::vector<glm::u16vec2> ranges(pageCount);
+	std::vector<std::byte> page((size_t)header.pageStride);
+	uint16_t* pageHeights = reinterpret_cast<uint16_t*>(page.data());
+	uint32_t* pageSplat = reinterpret_cast<uint32_t*>(page.data() + pageSplatOffset(samples));
+	file.seekp((std::streamoff)header.pagesOffset);
+
+	uint32_t pageIndex = 0;
+	uint32_t childFirstPage = 0;
+	glm::uvec2 childPages(0);
+	for (uint32_t level = 0; level < header.levelCount; level++)
+	{
+		const glm::uvec2 pages = levelPageCount(header.width, header.height, tileSize, level);
+		const uint32_t levelFirstPage = pageIndex;
+		for (uint32_t pz = 0; pz < pages.y; pz++)
+		{
+			for (uint32_t px = 0; px < pages.x; px++, pageIndex++)
+			{
+				// прореживание: отсчет уровня L - каждый 2^L-й отсчет уровня 0, за краем карты - край
+				for (uint32_t j = 0; j < samples; j++)
+				{
+					for (uint32_t i = 0; i < samples; i++)
+					{
+						const int levelX = int(px * tileSize + i) - int(TerrainTileHeader::Apron);
+						const int levelZ = int(pz * tileSize + j) - int(TerrainTileHeader::Apron);
+						const size_t source = size_t(glm::clamp(levelZ * (1 << level), 0, height - 1)) * width + glm::clamp(levelX * (1 << level), 0, width - 1);
+						pageHeights[j * samples + i] = heights[source];
+						pageSplat[j * samples + i] = splat[source];
+					}
+				}
+
+				// диапазон - по всем отсчетам уровня 0 под страницей, иначе прореживание срезало бы пики
+				// и отсечение с лучами промахивались бы мимо них
+				glm::u16vec2 range(std::numeric_limits<uint16_t>::max(), 0);
+				if (level == 0)
+				{
+					for (uint32_t z = pz * tileSize; z <= std::min((pz + 1) * tileSize, header.height - 1); z++)
+					{
+						for (uint32_t x = px * tileSize; x <= std::min((px + 1) * tileSize, header.width - 1); x++)
+						{
+							range.x = std::min(range.x, heights[size_t(z) * width + x]);
+							range.y = std::max(range.y, heights[size_t(z) * width + x]);
+						}
+					}
+				}
+				else
+				{
+					for (uint32_t quarter = 0; quarter < 4; quarter++)
+					{
+						const glm::uvec2 child(px * 2 + (quarter & 1), pz * 2 + (quarter >> 1));
+						if (child.x >= childPages.x || child.y >= childPages.y) continue;
+						const glm::u16vec2 childRange = ranges[childFirstPage + child.y * childPages.x + child.x];
+						range = glm::u16vec2(std::min(range.x, childRange.x), std::max(range.y, childRange.y));
+					}
+				}
+				ranges[pageIndex] = range;
+				file.write(reinterpret_cast<const char*>(page.data()), page.size());
+			}
+		}
+		childFirstPage = levelFirstPage;
+		childPages = pages;
+	}
+
+	file.seekp(0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(ranges.data()), ranges.size() * sizeof(glm::u16vec2));
+	if (!file)
+	{
+		LOG_ERROR(Scene, "Failed to write terrain tiles: {}", outputPath);
+		return false;
+	}
+
+	LOG_INFO(Scene, "Terrain tiles built: {} ({}x{} samples, {} levels, {} pages of {}x{} quads, {:.1f} MB)",
+		outputPath, width, height, header.levelCount, pageCount, tileSize, tileSize,
+		(header.pagesOffset + pageCount * header.pageStride) / (1024.0 * 1024.0));
+	return true;
+}
+//=============================================================================
+bool TerrainTileFile::Open(const std::string& path)
+{
+	Close();
+	if (!m_file.Open(path)) return false;
+
+	const TerrainTileHeader* header = reinterpret_cast<const TerrainTileHeader*>(m_file.GetData());
+	const bool valid = m_file.GetSize() >= sizeof(TerrainTileHeader)
+		&& header->magic == TerrainTileHeader::MagicValue
+		&& header->version == TerrainTileHeader::CurrentVersion
+		&& header->width >= 2 && header->height >= 2
+		&& header->tileSize >= 2 && (header->tileSize & (header->tileSize - 1)) == 0
+		&& header->levelCount >= 1 && header->levelCount <= TerrainTileHeader::MaxLevels;
+	if (!valid)
+	{
+		LOG_ERROR(Scene, "Invalid terrain tiles: {}", path);
+		Close();
+		return false;
+	}
+
+	m_header = header;
+	for (uint32_t level = 0; level < header->levelCount; level++)
+	{
+		m_levelPages[level] = levelPageCount(header->width, header->height, header->tileSize, level);
+		m_levelFirstPage[level + 1] = m_levelFirstPage[level] + m_levelPages[level].x * m_levelPages[level].y;
+	}
+
+	if (header->pageStride < pageDataSize(GetPageSamples()) || m_file.GetSize() < header->pagesOffset + GetPageCount() * header->pageStride)
+	{
+		LOG_ERROR(Scene, "Terrain tiles are truncated: {}", path);
+		Close();
+		return false;
+	}
+	return true;
+}
+//=============================================================================
+void TerrainTileFile::Close()
+{
+	m_file.Close();
+	m_header = nullptr;
+	m_levelPages = {};
+	m_levelFirstPage = {};
+}
+//=============================================================================
+const uint16_t* TerrainTileFile::GetPageRange(uint32_t page) const
+{
+	return reinterpret_cast<const uint16_t*>(m_file.GetData() + m_header->rangesOffset) + size_t(page) * 2;
+}
+//=============================================================================
+const uint16_t* TerrainTileFile::GetPageHeights(uint32_t page) const
+{
+	return reinterpret_cast<const uint16_t*>(m_file.GetData() + m_header->pagesOffset + page * m_header->pageStride);
+}
+//=============================================================================
+const uint32_t* TerrainTileFile::GetPageSplat(uint32_t page) const
+{
+	return reinterpret_cast<const uint32_t*>(reinterpret_cast<const std::byte*>(GetPageHeights(page)) + pageSplatOffset(GetPageSamples()));
+}
+//=============================================================================
+bool TerrainPageCache::Init(const TerrainTileFile& file, uint32_t pinnedLevel, const Settings& settings)
+{
+	PROFILE_FUNCTION();
+
+	Close();
+	const uint32_t pinnedPages = file.GetPagesX(pinnedLevel) * file.GetPagesZ(pinnedLevel);
+	if (settings.stagingPages == 0 || settings.threadCount == 0 || pinnedPages > settings.capacity / 2)
+	{
+		LOG_ERROR(Scene, "Invalid terrain page cache settings: {} layers for {} pinned pages, {} staging pages", settings.capacity, pinnedPages, settings.stagingPages);
+		return false;
+	}
+
+	m_file = &file;
+	m_settings = settings;
+	const uint32_t samples = file.GetPageSamples();
+	m_pageBytes = pageDataSize(samples);
+
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &m_heightArray);
+	glTextureStorage3D(m_heightArray, 1, GL_R16, samples, samples, settings.capacity);
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &m_splatArray);
+	glTextureStorage3D(m_splatArray, 1, GL_RGBA8, samples, samples, settings.capacity);
+	for (GLuint texture : { m_heightArray, m_splatArray })
+	{
+		glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+
+	m_layers.assign(settings.capacity, {});
+	m_pageLayers.assign(file.GetPageCount(), -1);
+	m_pageStagingSlots.assign(file.GetPageCount(), InvalidSlot);
+	m_pageRequestPriorities.assign(file.GetPageCount(), NoRequest);
+	m_frameRequests.reserve(file.GetPageCount());
+	// страниц в пути не больше буферов подкачки
+	m_queue.reserve(settings.stagingPages);
+	m_completed.reserve(settings.stagingPages);
+	m_waitingUploads.reserve(settings.stagingPages);
+	m_staging.resize(m_pageBytes * settings.stagingPages);
+	m_freeStagingSlots.resize(settings.stagingPages);
+	for (uint32_t i = 0; i < settings.stagingPages; i++)
+		m_freeStagingSlots[i] = settings.stagingPages - 1 - i;
+
+	// верхний уровень загружается сразу: у любого узла есть резидентный предок
+	for (uint32_t z = 0; z < file.GetPagesZ(pinnedLevel); z++)
+	{
+		for (uint32_t x = 0; x < file.GetPagesX(pinnedLevel); x++)
+		{
+			const uint32_t page = file.GetPageIndex(pinnedLevel, x, z);
+			const uint32_t layer = (uint32_t)allocateLayer();
+			readPage(page, 0);
+			uploadLayer(layer, 0);
+			m_layers[layer] = { page, 0, true };
+			m_pageLayers[page] = (int32_t)layer;
+			m_residentCount++;
+		}
+	}
+
+	m_statistics.residentPages = m_residentCount;
+	m_statistics.residentBytes = size_t(settings.capacity) * samples * samples * (sizeof(uint16_t) + sizeof(uint32_t)) + m_staging.size();
+
+	// отдельные потоки, а не задачи: чтение ждет диск и заняло бы рабочих, нужных кадру
+	for (uint32_t i = 0; i < settings.threadCount; i++)
+		m_threads.emplace_back(&TerrainPageCache::workerThread, this);
+	return true;
+}
+//=============================================================================
+void TerrainPageCache::Close()
+{
+	{
+		std::lock_guard lock(m_queueMutex);
+		m_stopThreads = true;
+	}
+	m_queueCondition.notify_all();
+	for (std::thread& thread : m_threads)
+		thread.join();
+	m_threads.clear();
+	m_stopThreads = false;
+	m_queue.clear();
+	m_completed.clear();
+
+	m_layers.clear();
+	m_pageLayers.clear();
+	m_pageStagingSlots.clear();
+	m_pageRequestPriorities.clear();
+	m_frameRequests.clear();
+	m_residentCount = 0;
+	m_inFlightCount = 0;
+	m_waitingUploads.clear();
+	m_staging.clear();
+	m_freeStagingSlots.clear();
+	m_statistics = {};
+	m_frameIndex = 0;
+	m_file = nullptr;
+
+	if (m_heightArray) glDeleteTextures(1, &m_heightArray);
+	if (m_splatArray) glDeleteTextures(1, &m_splatArray);
+	m_heightArray = 0;
+	m_splatArray = 0;
+}
+//=============================================================================
+void TerrainPageCache::workerThread()
+{
+	profiler::SetThreadName("Terrain I/O");
+
+	while (true)
+	{
+		LoadRequest request;
+		{
+			std::unique_lock lock(m_queueMutex);
+			m_queueCondition.wait(lock, [this] { return m_stopThreads || !m_queue.empty(); });
+			if (m_stopThreads) return;
+			// последними поставлены самые важные запросы последнего кадра
+			request = m_queue.back();
+			m_queue.pop_back();
+		}
+
+		readPage(request.page, request.stagingSlot);
+		request.latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request.requestTime).count();
+
+		std::lock_guard lock(m_queueMutex);
+		m_completed.push_back(request);
+	}
+}
+//=============================================================================
+void TerrainPageCache::readPage(uint32_t page, uint32_t stagingSlot)
+{
+	PROFILE_FUNCTION();
+
+	// промахи отображения приходятся на этот поток: ОС читает страницы файла здесь
+	std::memcpy(m_staging.data() + size_t(stagingSlot) * m_pageBytes, m_file->GetPageHeights(page), m_pageBytes);
+}
+//=============================================================================
+int32_t TerrainPageCache::allocateLayer()
+{
+	// свободный слой или самый давний. Страницы этого и прошлого кадра не вытесняются,
+	// иначе кэш меньше видимого набора перезаписывал бы сам себя
+	int32_t oldest = -1;
+	for (uint32_t i = 0; i < (uint32_t)m_layers.size(); i++)
+	{
+		const Layer& layer = m_layers[i];
+		if (layer.page == InvalidPage) return (int32_t)i;
+		if (layer.pinned || layer.lastUsedFrame + 1 >= m_frameIndex) continue;
+		if (oldest < 0 || layer.lastUsedFrame < m_layers[oldest].lastUsedFrame)
+			oldest = (int32_t)i;
+	}
+	if (oldest >= 0)
+	{
+		m_pageLayers[m_layers[oldest].page] = -1;
+		m_residentCount--;
+		m_layers[oldest].page = InvalidPage;
+		m_statistics.evictedPages++;
+	}
+	return oldest;
+}
+//=============================================================================
+void TerrainPageCache::BeginFrame(uint64_t frameIndex, ArenaVector<Upload>& uploads)
+{
+	PROFILE_FUNCTION();
+
+	m_frameIndex = frameIndex;
+	m_statistics.frameLookups = 0;
+	m_statistics.frameHits = 0;
+	m_statistics.frameUploads = 0;
+	{
+		std::lock_guard lock(m_queueMutex);
+		m_waitingUploads.insert(m_waitingUploads.end(), m_completed.begin(), m_completed.end());
+		m_completed.clear();
+	}
+
+	size_t waiting = 0;
+	for (const LoadRequest& request : m_waitingUploads)
+	{
+		const int32_t layer = allocateLayer();
+		if (layer < 0)
+		{
+			m_waitingUploads[waiting++] = request;
+			continue;
+		}
+
+		m_layers[layer] = { request.page, frameIndex, false };
+		m_pageLayers[request.page] = layer;
+		m_pageStagingSlots[request.page] = InvalidSlot;
+		m_residentCount++;
+		m_inFlightCount--;
+		uploads.push_back({ (uint32_t)layer, request.stagingSlot });
+
+		m_statistics.frameUploads++;
+		m_statistics.loadedPages++;
+		m_statistics.averageLatency += (request.latency - m_statistics.averageLatency) / double(m_statistics.loadedPages);
+		m_statistics.maxLatency = std::max(m_statistics.maxLatency, request.latency);
+	}
+	m_waitingUploads.resize(waiting);
+}
+//=============================================================================
+int32_t TerrainPageCache::Acquire(uint32_t page, float priority)
+{
+	m_statistics.frameLookups++;
+	m_statistics.totalLookups++;
+	if (const int32_t layer = Touch(page); layer >= 0)
+	{
+		m_statistics.frameHits++;
+		m_statistics.totalHits++;
+		return layer;
+	}
+
+	if (m_pageStagingSlots[page] == InvalidSlot)
+	{
+		float& requestPriority = m_pageRequestPriorities[page];
+		if (requestPriority == NoRequest) m_frameRequests.push_back(page);
+		requestPriority = std::min(requestPriority, priority);
+	}
+	return -1;
+}
+//=============================================================================
+int32_t TerrainPageCache::Touch(uint32_t page)
+{
+	const int32_t layer = m_pageLayers[page];
+	if (layer < 0) return -1;
+	m_layers[layer].lastUsedFrame = m_frameIndex;
+	return layer;
+}
+//=============================================================================
+void TerrainPageCache::EndFrame()
+{
+	if (!m_frameRequests.empty())
+	{
+		PROFILE_FUNCTION();
+
+		auto allocator = framemem::GetThreadAllocator<std::pair<float, uint32_t>>();
+		ArenaVector<std::pair<float, uint32_t>> requests(allocator);
+		requests.reserve(m_frameRequests.size());
+		for (const uint32_t page : m_frameRequests)
+		{
+			requests.push_back({ m_pageRequestPriorities[page], page });
+			m_pageRequestPriorities[page] = NoRequest;
+		}
+		m_frameRequests.clear();
+		std::sort(requests.begin(), requests.end());
+
+		// запросов в пути не больше буферов подкачки, остальные повторятся в следующих кадрах
+		ArenaVector<uint32_t> slots(framemem::GetThreadAllocator<uint32_t>());
+		{
+			std::lock_guard lock(m_stagingMutex);
+			const size_t count = std::min({ requests.size(), m_freeStagingSlots.size(), size_t(m_settings.maxRequestsPerFrame) });
+			slots.assign(m_freeStagingSlots.end() - count, m_freeStagingSlots.end());
+			m_freeStagingSlots.resize(m_freeStagingSlots.size() - count);
+		}
+		const size_t count = slots.size();
+
+		if (count > 0)
+		{
+			const auto now = std::chrono::steady_clock::now();
+			{
+				std::lock_guard lock(m_queueMutex);
+				for (size_t i = count; i-- > 0;)
+				{
+					m_pageStagingSlots[requests[i].second] = slots[i];
+					m_queue.push_back({ requests[i].second, slots[i], now, 0.0 });
+				}
+			}
+			m_inFlightCount += (uint32_t)count;
+			m_queueCondition.notify_all();
+		}
+	}
+
+	m_statistics.residentPages = m_residentCount;
+	m_statistics.inFlightPages = m_inFlightCount;
+}
+//=============================================================================
+void TerrainPageCache::ProcessUploads(const Upload* uploads, size_t count)
+{
+	if (count == 0) return;
+
+	PROFILE_FUNCTION();
+
+	for (size_t i = 0; i < count; i++)
+		uploadLayer(uploads[i].layer, uploads[i].stagingSlot);
+
+	std::lock_guard lock(m_stagingMutex);
+	for (size_t i = 0; i < count; i++)
+		m_freeStagingSlots.push_back(uploads[i].stagingSlot);
+}
+//=============================================================================
+void TerrainPageCache::uploadLayer(uint32_t layer, uint32_t stagingSlot) const
+{
+	const uint32_t samples = m_file->GetPageSamples();
+	const std::byte* data = m_staging.data() + size_t(stagingSlot) * m_pageBytes;
+	// строка высот нечетной длины не выровнена на 4 байта
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTextureSubImage3D(m_heightArray, 0, 0, 0, (GLint)layer, samples, samples, 1, GL_RED, GL_UNSIGNED_SHORT, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTextureSubImage3D(m_splatArray, 0, 0, 0, (GLint)layer, samples, samples, 1, GL_RGBA, GL_UNSIGNED_BYTE, data + pageSplatOffset(samples));
+}
+//=============================================================================
+void TerrainPageCache::Bind(uint32_t heightUnit, uint32_t splatUnit) const
+{
+	rhi::BindTextureUnit(heightUnit, m_heightArray);
+	rhi::BindTextureUnit(splatUnit, m_splatArray);
+}
+//=============================================================================
\ No newline at end of file
@@ -0,0 +1,177 @@
+﻿#pragma once
+
+#include "Render.h"
+#include "MappedFile.h"
+#include "FrameAllocator.h"
+
+// Заголовок файла тайлов ландшафта (.tiles), little-endian. За ним - диапазоны высот страниц
+// (uint16 min, max по отсчетам уровня 0 под страницей), затем страницы по уровням, внутри уровня - по строкам.
+// Страница уровня L покрывает tileSize квадов уровня L (tileSize * 2^L отсчетов уровня 0) и хранит
+// PageSamples^2 высот uint16, затем столько же весов слоев RGBA8. Уровень L прореживает уровень 0
+// через 2^L отсчетов без усреднения: четные вершины узла лежат на вершинах следующего уровня,
+// и слияние LOD в шейдере не дает швов
+struct TerrainTileHeader final
+{
+	static constexpr uint32_t MagicValue = 'T' | ('T' << 8) | ('I' << 16) | ('L' << 24);
+	static constexpr uint32_t CurrentVersion = 1;
+	static constexpr uint32_t Apron = 1;      // отсчетов вокруг страницы: нормали на краю без соседей
+	static constexpr uint32_t MaxLevels = 12; // как Terrain::MaxLodCount
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;        // отсчетов уровня 0
+	uint32_t height;
+	uint32_t tileSize;     // квадов на сторону страницы, степень двойки
+	uint32_t levelCount;
+	uint64_t rangesOffset;
+	uint64_t pagesOffset;
+	uint64_t pageStride;   // кратно 4096, страница не делит страницу памяти с соседями
+};
+
+// Строит файл тайлов из карты высот. splatPath - RGBA-карта весов четырех слоев того же размера;
+// пусто - веса по высоте и уклону
+bool BuildTerrainTiles(const std::string& heightmapPath, const std::string& outputPath, uint32_t tileSize = 32, const std::string& splatPath = {});
+
+// Отображенный в память файл тайлов. Данные не копируются, ОС подгружает страницы файла при чтении
+class TerrainTileFile final
+{
+public:
+	bool Open(const std::string& path);
+	void Close();
+	bool IsOpen() const { return m_file.IsOpen(); }
+
+	const TerrainTileHeader& GetHeader() const { return *m_header; }
+	uint32_t GetPageSamples() const { return m_header->tileSize + 1 + 2 * TerrainTileHeader::Apron; }
+	uint32_t GetPagesX(uint32_t level) const { return m_levelPages[level].x; }
+	uint32_t GetPagesZ(uint32_t level) const { return m_levelPages[level].y; }
+	uint32_t GetPageCount() const { return m_levelFirstPage[m_header->levelCount]; }
+	uint32_t GetPageIndex(uint32_t level, uint32_t x, uint32_t z) const { return m_levelFirstPage[level] + z * m_levelPages[level].x + x; }
+
+	// Нормированные min и max высот под страницей
+	const uint16_t* GetPageRange(uint32_t page) const;
+	const uint16_t* GetPageHeights(uint32_t page) const;
+	const uint32_t* GetPageSplat(uint32_t page) const;
+
+private:
+	MappedFile                                               m_file;
+	const TerrainTileHeader*                                 m_header{ nullptr };
+	std::array<glm::uvec2, TerrainTileHeader::MaxLevels>     m_levelPages{};
+	std::array<uint32_t, TerrainTileHeader::MaxLevels + 1>   m_levelFirstPage{};
+};
+
+// Кэш страниц в массивах текстур (высоты R16 и веса RGBA8) с вытеснением давно не использованных.
+// Промахи копят запросы кадра, самые важные уходят фоновым потокам, которые читают страницы из
+// отображенного файла в буферы подкачки; поток игры назначает готовым страницам слои, а загрузку
+// в текстуры выполняет поток рендера из пакета кадра. Число слоев и буферов подкачки фиксировано,
+// поэтому занятая память не зависит от размера мира
+class TerrainPageCache final
+{
+public:
+	struct Settings final
+	{
+		uint32_t capacity{ 256 };           // слоев в массивах текстур
+		uint32_t stagingPages{ 32 };        // буферов подкачки, столько страниц может быть в пути
+		uint32_t threadCount{ 2 };
+		uint32_t maxRequestsPerFrame{ 16 };
+	};
+
+	struct Statistics final
+	{
+		uint32_t residentPages{ 0 };
+		uint32_t inFlightPages{ 0 };
+		uint32_t frameLookups{ 0 };
+		uint32_t frameHits{ 0 };
+		uint32_t frameUploads{ 0 };
+		uint64_t totalLookups{ 0 };
+		uint64_t totalHits{ 0 };
+		uint64_t loadedPages{ 0 };
+		uint64_t evictedPages{ 0 };
+		double   averageLatency{ 0.0 };     // мс от запроса до готовности страницы
+		double   maxLatency{ 0.0 };
+		size_t   residentBytes{ 0 };        // текстуры и буферы подкачки
+	};
+
+	// Загрузка готовой страницы в слой на потоке рендера
+	struct Upload final
+	{
+		uint32_t layer;
+		uint32_t stagingSlot;
+	};
+
+	// Нужен контекст GL. pinnedLevel - уровень, страницы которого загружаются сразу и не вытесняются
+	bool Init(const TerrainTileFile& file, uint32_t pinnedLevel, const Settings& settings);
+	void Close();
+
+	// Поток игры. Готовые страницы получают слои, их загрузки добавляются в uploads
+	void BeginFrame(uint64_t frameIndex, ArenaVector<Upload>& uploads);
+	// Слой страницы или -1; промах ставит запрос, меньший priority важнее
+	int32_t Acquire(uint32_t page, float priority);
+	// Слой без запроса и без учета в статистике: запасная страница предка
+	int32_t Touch(uint32_t page);
+	// Запросы кадра уходят фоновым потокам
+	void EndFrame();
+
+	// Поток рендера
+	void ProcessUploads(const Upload* uploads, size_t count);
+	void Bind(uint32_t heightUnit, uint32_t splatUnit) const;
+
+	const Statistics& GetStatistics() const { return m_statistics; }
+
+private:
+	static constexpr uint32_t InvalidPage = ~0u;
+	static constexpr uint32_t InvalidSlot = ~0u;
+	static constexpr float    NoRequest = std::numeric_limits<float>::infinity();
+
+	struct Layer final
+	{
+		uint32_t page{ InvalidPage };
+		uint64_t lastUsedFrame{ 0 };
+		bool     pinned{ false };
+	};
+
+	struct LoadRequest final
+	{
+		uint32_t page;
+		uint32_t stagingSlot;
+		std::chrono::steady_clock::time_point requestTime;
+		double   latency;   // мс, заполняет фоновый поток
+	};
+
+	void workerThread();
+	void readPage(uint32_t page, uint32_t stagingSlot);
+	void uploadLayer(uint32_t layer, uint32_t stagingSlot) const;
+	int32_t allocateLayer();
+
+	const TerrainTileFile* m_file{ nullptr };
+	Settings               m_settings;
+	Statistics             m_statistics;
+	uint64_t               m_frameIndex{ 0 };
+	size_t                 m_pageBytes{ 0 };
+
+	// Поток игры. Массивы по номеру страницы и списки заполняются в Init, в кадре память не выделяется
+	std::vector<Layer>       m_layers;
+	std::vector<int32_t>     m_pageLayers;           // слой или -1
+	std::vector<uint32_t>    m_pageStagingSlots;     // буфер подкачки страницы в пути или InvalidSlot
+	std::vector<float>       m_pageRequestPriorities; // приоритет запроса кадра или NoRequest
+	std::vector<uint32_t>    m_frameRequests;        // страницы с запросом в этом кадре
+	uint32_t                 m_residentCount{ 0 };
+	uint32_t                 m_inFlightCount{ 0 };
+	std::vector<LoadRequest> m_waitingUploads;       // готовы, но все слои заняты в этом кадре
+
+	// Буферы подкачки: поток игры занимает, фоновый поток заполняет, поток рендера освобождает
+	std::vector<std::byte> m_staging;
+	std::vector<uint32_t>  m_freeStagingSlots;
+	std::mutex             m_stagingMutex;
+
+	// Фоновые потоки
+	std::vector<std::thread>  m_threads;
+	std::vector<LoadRequest>  m_queue;
+	std::vector<LoadRequest>  m_completed;
+	std::mutex                m_queueMutex;
+	std::condition_variable   m_queueCondition;
+	bool                      m_stopThreads{ false };
+
+	// Поток рендера
+	GLuint m_heightArray{ 0 };
+	GLuint m_splatArray{ 0 };
+};
\ No newline at end of file
@@ -0,0 +1,249 @@
+﻿#include "stdafx.h"
+#include "VertexAnimation.h"
+#include "Graphics.h"
+#include "Log.h"
+#include "Profiler.h"
+//=============================================================================
+namespace
+{
+	// Вершина меша на кадр: скиннинг по палитре кадра или локальная трансформация меша без скиннинга.
+	// Позиция нормализуется в границы модели, чтобы поместиться в RGBA16
+	const GLchar* bakeShaderSource = R"glsl(
+#version 430 core
+
+layout(local_size_x = 64) in;
+
+layout(std430, binding = 0) readonly buffer VertexStorage { float vertexData[]; };   // MeshVertex, 8 floats
+layout(std430, binding = 1) readonly buffer SkinStorage { uvec2 skinData[]; };       // MeshSkinVertex: joints, weights
+layout(std430, binding = 2) readonly buffer PaletteStorage { vec4 paletteRows[]; };  // JointCount matrices per frame
+
+layout(binding = 0, rgba16) writeonly uniform image2D PositionImage;
+layout(binding = 1, rgba8_snorm) writeonly uniform image2D NormalImage;
+
+uniform int  VertexCount;
+uniform int  VertexOffset;   // first vertex of the mesh in a texture frame
+uniform int  JointCount;     // 0 - rigid mesh, LocalTransform is applied
+uniform mat4 LocalTransform;
+uniform int  TextureWidth;
+uniform int  RowsPerFrame;
+uniform vec3 BoundsMin;
+uniform vec3 BoundsExtent;
+
+void main()
+{
+	const int vertex = int(gl_GlobalInvocationID.x);
+	if (vertex >= VertexCount) return;
+	const int frame = int(gl_GlobalInvocationID.y);
+
+	const int base = vertex * 8;
+	vec3 position = vec3(vertexData[base + 0], vertexData[base + 1], vertexData[base + 2]);
+	vec3 normal = vec3(vertexData[base + 3], vertexData[base + 4], vertexData[base + 5]);
+
+	if (JointCount > 0)
+	{
+		const uvec4 joints = (uvec4(skinData[vertex].x) >> uvec4(0, 8, 16, 24)) & 0xFFu;
+		const vec4 weights = unpackUnorm4x8(skinData[vertex].y);
+		vec4 row0 = vec4(0.0f);
+		vec4 row1 = vec4(0.0f);
+		vec4 row2 = vec4(0.0f);
+		for (int i = 0; i < 4; i++)
+		{
+			const int row = (frame * JointCount + int(joints[i])) * 3;
+			row0 += paletteRows[row + 0] * weights[i];
+			row1 += paletteRows[row + 1] * weights[i];
+			row2 += paletteRows[row + 2] * weights[i];
+		}
+		const vec4 p = vec4(position, 1.0f);
+		position = vec3(dot(row0, p), dot(row1, p), dot(row2, p));
+		normal = vec3(dot(row0.xyz, normal), dot(row1.xyz, normal), dot(row2.xyz, normal));
+	}
+	else
+	{
+		position = (LocalTransform * vec4(position, 1.0f)).xyz;
+		normal = mat3(LocalTransform) * normal;
+	}
+
+	const int texel = VertexOffset + vertex;
+	const ivec2 coord = ivec2(texel % TextureWidth, frame * RowsPerFrame + texel / TextureWidth);
+	imageStore(PositionImage, coord, vec4(clamp((position - BoundsMin) / BoundsExtent, 0.0f, 1.0f), 1.0f));
+	imageStore(NormalImage, coord, vec4(normalize(normal), 0.0f));
+}
+)glsl";
+
+	constexpr uint32_t BakeGroupSize = 64;
+	constexpr uint32_t PositionTextureSlot = 3; // после слотов материала
+	constexpr uint32_t NormalTextureSlot = 4;
+	constexpr uint32_t ClipBindingPoint = 7;
+
+	std::shared_ptr<ShaderProgram> bakeProgram;
+
+	std::shared_ptr<Texture2D> createTexture(GLenum format, uint32_t width, uint32_t height)
+	{
+		GLuint id;
+		glCreateTextures(GL_TEXTURE_2D, 1, &id);
+		glTextureStorage2D(id, 1, format, (GLsizei)width, (GLsizei)height);
+		// шейдер толпы читает texelFetch, фильтрация не нужна
+		glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		return std::make_shared<Texture2D>(id);
+	}
+}
+//=============================================================================
+std::shared_ptr<VertexAnimation> VertexAnimation::Bake(const Model& model, const VertexAnimationSettings& settings)
+{
+	PROFILE_FUNCTION();
+
+	const auto startTime = std::chrono::steady_clock::now();
+
+	const auto& skeletonPointer = model.GetSkeleton();
+	if (!skeletonPointer || model.GetNumClips() == 0 || model.GetNumMesh() == 0)
+	{
+		LOG_ERROR(Render, "Vertex animation needs a model with a skeleton and clips");
+		return nullptr;
+	}
+	if (!GLAD_GL_VERSION_4_3 || settings.frameRate <= 0.0f || settings.textureWidth == 0)
+	{
+		LOG_ERROR(Render, "Vertex animation bake is not available: compute shaders {}, {} fps, texture width {}",
+			GLAD_GL_VERSION_4_3 ? "available" : "unavailable", settings.frameRate, settings.textureWidth);
+		return nullptr;
+	}
+	if (!bakeProgram)
+	{
+		bakeProgram = std::make_shared<ShaderProgram>(bakeShaderSource);
+		if (!bakeProgram->IsValid()) [[unlikely]]
+		{
+			LOG_ERROR(Render, "Failed to create vertex animation bake shader");
+			bakeProgram.reset();
+			return nullptr;
+		}
+	}
+	const Skeleton& skeleton = *skeletonPointer;
+
+	auto animation = std::make_shared<VertexAnimation>();
+
+	// вершины всех мешей подряд в одном кадре текстуры
+	uint32_t vertexCount = 0;
+	for (size_t i = 0; i < model.GetNumMesh(); i++)
+	{
+		animation->m_meshVertexOffsets.push_back(vertexCount);
+		vertexCount += model.GetMesh(i).GetVertexCount();
+	}
+
+	// кадры клипа равномерно покрывают его длительность, первый и последний кадры совпадают с краями клипа
+	uint32_t frameCount = 0;
+	for (size_t i = 0; i < model.GetNumClips(); i++)
+	{
+		const AnimationClip& clip = *model.GetClip(i);
+		const float duration = clip.GetDuration();
+		const uint32_t frames = std::max(2u, (uint32_t)std::ceil(duration * settings.frameRate) + 1);
+		animation->m_clips.push_back({ clip.GetName(), frameCount, frames, duration > 0.0f ? float(frames - 1) / duration : settings.frameRate });
+		frameCount += frames;
+	}
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	animation->m_textureWidth = std::min({ settings.textureWidth, vertexCount, (uint32_t)maxTextureSize });
+	animation->m_rowsPerFrame = (vertexCount + animation->m_textureWidth - 1) / animation->m_textureWidth;
+	animation->m_textureHeight = animation->m_rowsPerFrame * frameCount;
+	if (vertexCount == 0 || animation->m_textureHeight > (uint32_t)maxTextureSize)
+	{
+		LOG_ERROR(Render, "Vertex animation does not fit a texture: {} vertices, {} frames", vertexCount, frameCount);
+		return nullptr;
+	}
+
+	// границы модели уже охватывают все кадры клипов, небольшой запас на округление
+	animation->m_boundsExtent = glm::max(model.GetBoundsMax() - model.GetBoundsMin(), glm::vec3(0.001f)) * 1.01f;
+	animation->m_boundsMin = (model.GetBoundsMin() + model.GetBoundsMax()) * 0.5f - animation->m_boundsExtent * 0.5f;
+
+	// палитры всех кадров всех клипов
+	const uint32_t jointCount = skeleton.GetJointCount();
+	std::vector<SkinMatrix> palettes(size_t(frameCount) * jointCount);
+	{
+		PROFILE_SCOPE("VertexAnimationPalettes");
+		std::vector<SoaTransform> local(skeleton.GetSoaCount());
+		std::vector<glm::mat4> jointMatrices(jointCount);
+		for (size_t i = 0; i < model.GetNumClips(); i++)
+		{
+			const AnimationClip& clip = *model.GetClip(i);
+			const Clip& bakedClip = animation->m_clips[i];
+			for (uint32_t frame = 0; frame < bakedClip.frameCount; frame++)
+			{
+				clip.Sample(frame / bakedClip.frameRate, false, local.data());
+				animation::LocalToModel(skeleton, local.data(), jointMatrices.data());
+				animation::BuildSkinPalette(skeleton, jointMatrices.data(), palettes.data() + size_t(bakedClip.firstFrame + frame) * jointCount);
+			}
+		}
+	}
+	StorageBuffer paletteBuffer(2, (uint32_t)(palettes.size() * sizeof(SkinMatrix)), palettes.data());
+
+	animation->m_positionTexture = createTexture(GL_RGBA16, animation->m_textureWidth, animation->m_textureHeight);
+	animation->m_normalTexture = createTexture(GL_RGBA8_SNORM, animation->m_textureWidth, animation->m_textureHeight);
+	glBindImageTexture(0, animation->m_positionTexture->GetID(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16);
+	glBindImageTexture(1, animation->m_normalTexture->GetID(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8_SNORM);
+
+	bakeProgram->Bind();
+	bakeProgram->SetUniform1i("TextureWidth", (int)animation->m_textureWidth);
+	bakeProgram->SetUniform1i("RowsPerFrame", (int)animation->m_rowsPerFrame);
+	bakeProgram->SetUniform3f("BoundsMin", animation->m_boundsMin.x, animation->m_boundsMin.y, animation->m_boundsMin.z);
+	bakeProgram->SetUniform3f("BoundsExtent", animation->m_boundsExtent.x, animation->m_boundsExtent.y, animation->m_boundsExtent.z);
+	paletteBuffer.Bind();
+	for (size_t i = 0; i < model.GetNumMesh(); i++)
+	{
+		const Mesh& mesh = model.GetMesh(i);
+		if (mesh.GetVertexCount() == 0) continue;
+
+		// буферы вершин меша читаются как буферы хранения, отдельная копия не нужна
+		rhi::BindStorageBuffer(0, mesh.GetVertexBufferID());
+		if (mesh.IsSkinned()) rhi::BindStorageBuffer(1, mesh.GetSkinBufferID());
+		bakeProgram->SetUniform1i("VertexCount", (int)mesh.GetVertexCount());
+		bakeProgram->SetUniform1i("VertexOffset", (int)animation->m_meshVertexOffsets[i]);
+		bakeProgram->SetUniform1i("JointCount", mesh.IsSkinned() ? (int)jointCount : 0);
+		bakeProgram->SetUniformMat4("LocalTransform", mesh.GetLocalTransform());
+		rhi::DispatchCompute((mesh.GetVertexCount() + BakeGroupSize - 1) / BakeGroupSize, frameCount);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	std::vector<glm::vec4> clipData;
+	for (const Clip& clip : animation->m_clips)
+		clipData.emplace_back((float)clip.firstFrame, (float)clip.frameCount, clip.frameRate, 0.0f);
+	animation->m_clipBuffer = std::make_shared<StorageBuffer>(ClipBindingPoint, (uint32_t)(clipData.size() * sizeof(glm::vec4)), clipData.data());
+
+	const double bakeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	LOG_INFO(Render, "Vertex animation baked: {} clips, {} frames of {} vertices, {}x{} textures, {} KB, {:.1f} ms",
+		animation->m_clips.size(), frameCount, vertexCount, animation->m_textureWidth, animation->m_textureHeight, animation->GetMemorySize() / 1024, bakeTime);
+	return animation;
+}
+//=============================================================================
+void VertexAnimation::Bind(ShaderProgram& program) const
+{
+	program.SetUniform1i("TextureWidth", (int)m_textureWidth);
+	program.SetUniform1i("RowsPerFrame", (int)m_rowsPerFrame);
+	program.SetUniform3f("BoundsMin", m_boundsMin.x, m_boundsMin.y, m_boundsMin.z);
+	program.SetUniform3f("BoundsExtent", m_boundsExtent.x, m_boundsExtent.y, m_boundsExtent.z);
+	m_positionTexture->Bind(PositionTextureSlot);
+	m_normalTexture->Bind(NormalTextureSlot);
+	m_clipBuffer->Bind();
+}
+//=============================================================================
+int32_t VertexAnimation::FindClip(const std::string& name) const
+{
+	for (size_t i = 0; i < m_clips.size(); i++)
+	{
+		if (m_clips[i].name == name) return (int32_t)i;
+	}
+	return -1;
+}
+//=============================================================================
+size_t VertexAnimation::GetMemorySize() const
+{
+	// RGBA16 позиция и RGBA8 нормаль на вершину кадра
+	return size_t(m_textureWidth) * m_textureHeight * (8 + 4) + m_clips.size() * sizeof(glm::vec4);
+}
+//=============================================================================
+void ClearVertexAnimationResources()
+{
+	bakeProgram.reset();
+}
+//=============================================================================
\ No newline at end of file
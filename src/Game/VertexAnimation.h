@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include "Render.h"
+
+class Model;
+
+struct VertexAnimationSettings final
+{
+	float    frameRate{ 30.0f };   // кадров в секунду при запекании клипов
+	uint32_t textureWidth{ 2048 }; // вершин в строке текстуры; кадр модели с большим числом вершин занимает несколько строк
+};
+
+// Анимация вершин, запеченная в текстуры: позиции и нормали всех вершин модели на каждом кадре каждого клипа,
+// кадры клипов идут подряд сверху вниз. Вершинный шейдер толпы смешивает два соседних кадра своего клипа,
+// поэтому во время игры скелет, выборка клипов и палитры не нужны
+class VertexAnimation final
+{
+public:
+	struct Clip final
+	{
+		std::string name;
+		uint32_t    firstFrame;
+		uint32_t    frameCount;
+		float       frameRate; // кадры равномерно покрывают длительность клипа, поэтому частота может отличаться от заданной
+	};
+
+	// Скиннинг всех мешей модели вычислительным шейдером по палитрам каждого кадра.
+	// Нужны контекст GL и модель со скелетом и клипами, nullptr при ошибке
+	static std::shared_ptr<VertexAnimation> Bake(const Model& model, const VertexAnimationSettings& settings = {});
+
+	// Текстуры в слоты 3 и 4, таблица клипов в буфер хранения 7, раскладка текстур в uniform-переменные program
+	void Bind(ShaderProgram& program) const;
+
+	// Первая вершина меша модели в кадре текстуры
+	uint32_t GetMeshVertexOffset(size_t mesh) const { return m_meshVertexOffsets[mesh]; }
+	size_t GetClipCount() const { return m_clips.size(); }
+	const Clip& GetClip(size_t i) const { return m_clips[i]; }
+	// -1, если клипа нет
+	int32_t FindClip(const std::string& name) const;
+	size_t GetMemorySize() const;
+
+private:
+	std::vector<Clip>              m_clips;
+	std::vector<uint32_t>          m_meshVertexOffsets;
+	uint32_t                       m_textureWidth{ 0 };
+	uint32_t                       m_textureHeight{ 0 };
+	uint32_t                       m_rowsPerFrame{ 0 };
+	glm::vec3                      m_boundsMin{ 0.0f };    // позиции хранятся нормализованными в границах модели
+	glm::vec3                      m_boundsExtent{ 0.0f };
+	std::shared_ptr<Texture2D>     m_positionTexture;      // RGBA16, xyz - позиция в границах модели
+	std::shared_ptr<Texture2D>     m_normalTexture;        // RGBA8_SNORM
+	std::shared_ptr<StorageBuffer> m_clipBuffer;           // vec4 на клип: первый кадр, число кадров, частота
+};
+
+// Общий шейдер запекания
+void ClearVertexAnimationResources();
\ No newline at end of file
@@ -1,12 +1,152 @@
 ﻿#include "stdafx.h"
 #include "CoreApp.h"
+#include "Log.h"
 #include "Context.h"
 #include "GameApp.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "FixedTimestep.h"
+#include "JobSystem.h"
+#include "RenderThread.h"
+#include "FrameAllocator.h"
+#include "ScriptCache.h"
+#include "Entity.h"
 //=============================================================================
 #if defined(_MSC_VER)
 #	pragma comment( lib, "3rdparty.lib" )
 #endif
 //=============================================================================
+struct CommandLine final
+{
+	bool        headless{ false };   // --headless
+	uint64_t    maxFrames{ 0 };      // --frames N, 0 - без ограничения
+	std::string screenshotPath;      // --screenshot file.png, снимок последнего кадра
+
+	FixedTimestepSettings fixedTimestepSettings; // --tick-rate Hz, --max-ticks N
+	uint32_t              workerCount{ 0 };      // --workers N, 0 - по числу ядер
+	bool                  benchmarkJobs{ false }; // --bench-jobs, замер накладных расходов системы задач
+	uint32_t              ecsBenchmarkEntities{ 0 }; // --bench-ecs [N], замер обхода N сущностей (по умолчанию 1M)
+	bool                  renderThread{ true };   // --no-render-thread, рисовать на потоке игры
+	bool                  instancing{ true };     // --no-instancing, каждый меш отдельным вызовом
+	bool                  foliageCompute{ true }; // --no-foliage-compute, отсечение растительности на CPU
+	bool                  animationCompression{ true }; // --no-animation-compression, клипы моделей несжатыми кадрами
+	bool                  animationLod{ true };         // --no-animation-lod, позы всех персонажей каждый кадр целиком
+	bool                  morphCompute{ true };         // --no-morph-compute, цели морфинга применяются на CPU
+	bool                  scriptCache{ true };          // --no-script-cache, компилировать сценарии при каждой загрузке
+	bool                  cameraCollision{ true };      // --no-camera-collision, камера летает сквозь геометрию уровня
+	std::string           animationBenchmarkModel;      // --bench-animation model|@skinned, замер сжатия и выборки клипов
+	std::string           scriptBenchmarkDirectory;     // --bench-script dir, замер ВМ сценариев на *.script с функцией run() и кэша байткода
+	std::string           collisionBenchmarkModel;      // --bench-collision model, замер построения BVH модели и запросов столкновений
+
+	LoggerSettings loggerSettings; // --log-level verbose|info|warning|error, --log-categories render,scene, --log-file log.txt
+
+	bool              benchmark{ false };  // --benchmark scene.txt camera.txt [--warmup N] [--measure M] [--output result.json]
+	BenchmarkSettings benchmarkSettings;
+	std::string       compareBaseline;     // --bench-compare baseline.json current.json [--threshold percent]
+	std::string       compareCurrent;
+	double            compareThreshold{ 5.0 };
+
+	std::string tilesHeightmap;   // --build-terrain-tiles heightmap.png output.tiles [--tile-size N] [--splat splat.png]
+	std::string tilesOutput;
+	uint32_t    tileSize{ 32 };
+	std::string tilesSplat;
+};
+//=============================================================================
+CommandLine ParseCommandLine(int argc, char* argv[])
+{
+	CommandLine commandLine;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string_view arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--headless")
+			commandLine.headless = true;
+		else if (arg == "--frames" && hasValue)
+			commandLine.maxFrames = std::strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--screenshot" && hasValue)
+			commandLine.screenshotPath = argv[++i];
+		else if (arg == "--benchmark" && i + 2 < argc)
+		{
+			commandLine.benchmark = true;
+			commandLine.benchmarkSettings.scenePath = argv[++i];
+			commandLine.benchmarkSettings.cameraPath = argv[++i];
+		}
+		else if (arg == "--warmup" && hasValue)
+			commandLine.benchmarkSettings.warmupFrames = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--measure" && hasValue)
+			commandLine.benchmarkSettings.measuredFrames = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--output" && hasValue)
+			commandLine.benchmarkSettings.outputPath = argv[++i];
+		else if (arg == "--tick-rate" && hasValue)
+			commandLine.fixedTimestepSettings.tickRate = std::strtod(argv[++i], nullptr);
+		else if (arg == "--max-ticks" && hasValue)
+			commandLine.fixedTimestepSettings.maxTicksPerFrame = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--workers" && hasValue)
+			commandLine.workerCount = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--bench-jobs")
+			commandLine.benchmarkJobs = true;
+		else if (arg == "--bench-ecs")
+		{
+			commandLine.ecsBenchmarkEntities = 1'000'000;
+			if (hasValue && std::isdigit((unsigned char)argv[i + 1][0]))
+				commandLine.ecsBenchmarkEntities = std::max(1u, (uint32_t)std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--no-render-thread")
+			commandLine.renderThread = false;
+		else if (arg == "--no-instancing")
+			commandLine.instancing = false;
+		else if (arg == "--no-foliage-compute")
+			commandLine.foliageCompute = false;
+		else if (arg == "--no-animation-compression")
+			commandLine.animationCompression = false;
+		else if (arg == "--no-animation-lod")
+			commandLine.animationLod = false;
+		else if (arg == "--no-morph-compute")
+			commandLine.morphCompute = false;
+		else if (arg == "--no-script-cache")
+			commandLine.scriptCache = false;
+		else if (arg == "--no-camera-collision")
+			commandLine.cameraCollision = false;
+		else if (arg == "--bench-animation" && hasValue)
+			commandLine.animationBenchmarkModel = argv[++i];
+		else if (arg == "--bench-script" && hasValue)
+			commandLine.scriptBenchmarkDirectory = argv[++i];
+		else if (arg == "--bench-collision" && hasValue)
+			commandLine.collisionBenchmarkModel = argv[++i];
+		else if (arg == "--log-level" && hasValue)
+		{
+			if (!logger::ParseLevel(argv[++i], commandLine.loggerSettings.level))
+				LOG_WARNING(Core, "Unknown log level: {}", argv[i]);
+		}
+		else if (arg == "--log-categories" && hasValue)
+		{
+			if (!logger::ParseCategories(argv[++i], commandLine.loggerSettings.categoryMask))
+				LOG_WARNING(Core, "Unknown log category in: {}", argv[i]);
+		}
+		else if (arg == "--log-file" && hasValue)
+			commandLine.loggerSettings.filePath = argv[++i];
+		else if (arg == "--bench-compare" && i + 2 < argc)
+		{
+			commandLine.compareBaseline = argv[++i];
+			commandLine.compareCurrent = argv[++i];
+		}
+		else if (arg == "--threshold" && hasValue)
+			commandLine.compareThreshold = std::strtod(argv[++i], nullptr);
+		else if (arg == "--build-terrain-tiles" && i + 2 < argc)
+		{
+			commandLine.tilesHeightmap = argv[++i];
+			commandLine.tilesOutput = argv[++i];
+		}
+		else if (arg == "--tile-size" && hasValue)
+			commandLine.tileSize = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--splat" && hasValue)
+			commandLine.tilesSplat = argv[++i];
+		else
+			LOG_WARNING(Core, "Unknown command line argument: {}", arg);
+	}
+	return commandLine;
+}
+//=============================================================================
 bool ShouldCloseApp(const Context& context)
 {
 	return app::isExit || context.ShouldClose();
@@ -16,39 +156,161 @@ int main(
 	[[maybe_unused]] int   argc,
 	[[maybe_unused]] char* argv[])
 {
+	const CommandLine commandLine = ParseCommandLine(argc, argv);
+
+	if (!commandLine.compareBaseline.empty())
+		return CompareBenchmarkResults(commandLine.compareBaseline, commandLine.compareCurrent, commandLine.compareThreshold);
+
+	logger::Init(commandLine.loggerSettings);
+	profiler::Init();
+	jobs::Init(commandLine.workerCount);
+
+	if (commandLine.benchmarkJobs)
+	{
+		jobs::RunOverheadBenchmark();
+		jobs::Close();
+		profiler::Close();
+		logger::Close();
+		return 0;
+	}
+
+	if (commandLine.ecsBenchmarkEntities > 0)
+	{
+		ecs::RunBenchmark(commandLine.ecsBenchmarkEntities);
+		jobs::Close();
+		profiler::Close();
+		logger::Close();
+		return 0;
+	}
+
+	if (!commandLine.scriptBenchmarkDirectory.empty())
+	{
+		const bool completed = script::RunBenchmark(commandLine.scriptBenchmarkDirectory)
+			&& script::RunCacheBenchmark(commandLine.scriptBenchmarkDirectory);
+		jobs::Close();
+		profiler::Close();
+		logger::Close();
+		return completed ? 0 : 1;
+	}
+
+	if (!commandLine.tilesHeightmap.empty())
+	{
+		const bool built = BuildTerrainTiles(commandLine.tilesHeightmap, commandLine.tilesOutput, commandLine.tileSize, commandLine.tilesSplat);
+		jobs::Close();
+		profiler::Close();
+		logger::Close();
+		return built ? 0 : 1;
+	}
+
 	Context context;
+	Benchmark benchmark;
+	FixedTimestep fixedTimestep;
+	fixedTimestep.Init(commandLine.fixedTimestepSettings);
+	std::vector<renderthread::FrameResult> frameResults;
+	uint64_t frameCount = 0;
+	int exitCode = 0;
 
-	if (context.Init(1600, 900, "Game") 
+	if (context.Init(1600, 900, "Game", commandLine.headless) 
 		&& InitGame())
 	{
+		GetGameScene().SetInstancingEnabled(commandLine.instancing);
+		GetGameScene().SetAnimationLodEnabled(commandLine.animationLod);
+		GetGameScene().SetMorphComputeEnabled(commandLine.morphCompute);
+		GetGameFoliage().SetComputeEnabled(commandLine.foliageCompute);
+		SetAnimationCompressionEnabled(commandLine.animationCompression);
+		SetScriptCacheEnabled(commandLine.scriptCache);
+		SetCameraCollisionEnabled(commandLine.cameraCollision);
+
+		if (!commandLine.animationBenchmarkModel.empty())
+		{
+			exitCode = RunAnimationBenchmark(commandLine.animationBenchmarkModel) ? 0 : 1;
+			app::Exit();
+		}
+		else if (!commandLine.collisionBenchmarkModel.empty())
+		{
+			exitCode = RunCollisionBenchmark(commandLine.collisionBenchmarkModel) ? 0 : 1;
+			app::Exit();
+		}
+		else if (commandLine.benchmark)
+		{
+			if (!LoadSceneDescription(commandLine.benchmarkSettings.scenePath)
+				|| !benchmark.Init(commandLine.benchmarkSettings))
+			{
+				exitCode = 1;
+				app::Exit();
+			}
+		}
+
+		// загрузка закончена, дальше контекстом GL владеет поток рендера
+		renderthread::Init(context, RenderGame, commandLine.renderThread);
+
 		while (!ShouldCloseApp(context))
 		{
+			profiler::BeginFrame();
+			PROFILE_SCOPE("Frame");
+
 			context.BeginFrame();
 
-			if (context.IsResize())
+			renderthread::PopFrameResults(frameResults);
+			for (const auto& result : frameResults)
+				benchmark.OnFrameRendered(result);
+
+			FramePacket& packet = renderthread::BeginPacket();
+			packet.width = context.GetWidth();
+			packet.height = context.GetHeight();
+			packet.resized = context.IsResize();
+
+			benchmark.BeginFrame(GetGameCamera(), packet.frameIndex);
+
+			// в режиме замера время идет фиксированным шагом, чтобы кадры были воспроизводимы
+			const double deltaTime = benchmark.IsActive() ? benchmark.GetFixedDeltaTime() : context.GetDeltaTime();
+
+			{
+				PROFILE_SCOPE("Simulation");
+				const uint32_t ticks = fixedTimestep.Advance(deltaTime);
+				fixedTimestep.BeginTicks();
+				for (uint32_t i = 0; i < ticks; i++)
+					FixedUpdate(fixedTimestep.GetFixedDeltaTime());
+				fixedTimestep.EndTicks();
+			}
+			FrameGame(deltaTime, fixedTimestep.GetAlpha(), packet);
+
+			{
+				PROFILE_SCOPE("ImGui");
+				context.BeginImgui();
+				DrawImGui(deltaTime, fixedTimestep);
+				context.EndImgui(packet.ui);
+			}
+
+			const bool isLastFrame = commandLine.maxFrames > 0 && ++frameCount >= commandLine.maxFrames;
+			if (isLastFrame)
 			{
-				glViewport(0, 0, context.GetWidth(), context.GetHeight());
+				packet.screenshotPath = commandLine.screenshotPath;
+				app::Exit();
 			}
 
-			// Update и FixedUpdate
-			// это не работает
-			//float accumulator = 0.0f;
-			//float fixedDeltaTime = 1.0f / 60.0f;
-			//while (accumulator < deltaTime)
-			//{
-			//	FixedUpdate(fixedDeltaTime);
-			//	accumulator += fixedDeltaTime;
-			//}
-			FrameGame(context.GetDeltaTime());
+			renderthread::Submit();
 
-			context.BeginImgui();
-			DrawImGui(context.GetDeltaTime());
-			context.EndImgui();
+			{
+				PROFILE_SCOPE("EndFrame");
+				context.EndFrame();
+			}
 
-			context.EndFrame();
+			benchmark.EndFrame();
+			if (benchmark.IsFinished())
+			{
+				if (!benchmark.WriteResult()) exitCode = 1;
+				app::Exit();
+			}
 		}
 	}
+	renderthread::Close();
 	CloseGame();
 	context.Close();
+	jobs::Close();
+	profiler::Close();
+	framemem::LogReport();
+	logger::Close();
+	return exitCode;
 }
 //=============================================================================
\ No newline at end of file
@@ -9,11 +9,25 @@
 
 #include <cmath>
 #include <string>
+#include <string_view>
+#include <format>
 #include <filesystem>
 #include <algorithm>
 #include <memory>
 #include <chrono>
 #include <array>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <bit>
+#include <charconv>
 
 #include <glad/gl.h>
 